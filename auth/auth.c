@@ -174,6 +174,9 @@ static int handle_auth_headers(int code,
            this connection, make sure to initialize the authentication handler 
            first. */
         if (authn_info->scheme != scheme) {
+            /* The baton of another scheme is of no use to this one. */
+            authn_info->baton = NULL;
+
             status = scheme->init_ctx_func(code, ctx, ctx->pool);
             if (!status) {
                 status = scheme->init_conn_func(scheme, code, conn,
@@ -379,11 +382,16 @@ apr_status_t serf__handle_auth_response(int *consumed_response,
         /* Requeue the request with the necessary auth headers. */
         /* ### application doesn't know about this request! we just drop it
            ### on the floor.  */
-        (void) serf__request_requeue(request);
+        /* A CONNECT request that the TLS handshake followed is sent again
+           on a new connection instead, see read_from_connection(). */
+        if (!request->ssltunnel || !request->conn->tunneled_stream)
+            (void) serf__request_requeue(request);
+        request->conn->metrics.auth_round_trips++;
 
         return APR_EOF;
     } else {
         serf__validate_response_func_t validate_resp;
+        const serf__authn_scheme_t *scheme;
         serf_connection_t *conn = request->conn;
         serf_context_t *ctx = conn->ctx;
         serf__authn_info_t *authn_info;
@@ -392,9 +400,12 @@ apr_status_t serf__handle_auth_response(int *consumed_response,
 
         /* Validate the response server authn headers. */
         authn_info = serf__get_authn_info_for_server(conn);
-        if (authn_info->scheme) {
-            validate_resp = authn_info->scheme->validate_response_func;
-            resp_status = validate_resp(authn_info->scheme, HOST, sl.code,
+        scheme = authn_info->scheme;
+        if (request->auth_realm && request->auth_realm->baton)
+            scheme = request->auth_realm->scheme;
+        if (scheme) {
+            validate_resp = scheme->validate_response_func;
+            resp_status = validate_resp(scheme, HOST, sl.code,
                                         conn, request, response, pool);
         }
 
@@ -487,3 +498,162 @@ serf__authn_info_t *serf__get_authn_info_for_server(serf_connection_t *conn)
 
     return authn_info;
 }
+
+/* A path prefix on a server, and the realm protecting it. */
+typedef struct authn_space_t {
+    const char *path;
+    apr_size_t path_len;
+    serf__authn_realm_t *realm;
+} authn_space_t;
+
+/* Returns the realm protecting PATH, from the longest known path prefix
+   of it, or NULL when PATH lies outside the known protection spaces. */
+static serf__authn_realm_t *realm_for_path(serf__authn_info_t *authn_info,
+                                           const char *path)
+{
+    int i;
+
+    if (!path || !authn_info->spaces)
+        return NULL;
+
+    /* The spaces are kept longest path first. */
+    for (i = 0; i < authn_info->spaces->nelts; i++) {
+        authn_space_t *space = &APR_ARRAY_IDX(authn_info->spaces, i,
+                                              authn_space_t);
+
+        if (strncmp(path, space->path, space->path_len) == 0)
+            return space->realm;
+    }
+
+    return NULL;
+}
+
+serf__authn_realm_t *serf__authn_learn_realm(serf__authn_info_t *authn_info,
+                                             serf_request_t *request,
+                                             const char *realm_name,
+                                             int *tried,
+                                             apr_pool_t *pool)
+{
+    serf__authn_realm_t *realm;
+    const char *slash;
+
+    if (!authn_info->realms) {
+        authn_info->realms = apr_hash_make(pool);
+        authn_info->spaces = apr_array_make(pool, 4, sizeof(authn_space_t));
+    }
+
+    realm = apr_hash_get(authn_info->realms, realm_name, APR_HASH_KEY_STRING);
+    if (!realm) {
+        realm = apr_pcalloc(pool, sizeof(*realm));
+        realm->name = apr_pstrdup(pool, realm_name);
+        apr_pool_create(&realm->pool, pool);
+        apr_hash_set(authn_info->realms, realm->name, APR_HASH_KEY_STRING,
+                     realm);
+    }
+
+    /* Credentials kept for another scheme are of no use to this one. */
+    if (realm->scheme != authn_info->scheme) {
+        realm->scheme = authn_info->scheme;
+        realm->baton = NULL;
+        apr_pool_clear(realm->pool);
+    }
+
+    *tried = (request->auth_realm == realm && realm->baton);
+
+    /* Everything at or below the directory of the request is assumed to be
+       in the same realm, see RFC 7617 section 2.2. */
+    slash = request->auth_path ? strrchr(request->auth_path, '/') : NULL;
+    if (slash) {
+        apr_size_t len = slash - request->auth_path + 1;
+        authn_space_t *space;
+        int i;
+
+        for (i = 0; i < authn_info->spaces->nelts; i++) {
+            space = &APR_ARRAY_IDX(authn_info->spaces, i, authn_space_t);
+
+            if (space->path_len <= len)
+                break;
+        }
+
+        if (i < authn_info->spaces->nelts && space->path_len == len
+            && strncmp(space->path, request->auth_path, len) == 0) {
+            space->realm = realm;
+        }
+        else {
+            /* Insert the new space at I, keeping the longest paths first. */
+            apr_array_push(authn_info->spaces);
+            space = &APR_ARRAY_IDX(authn_info->spaces, i, authn_space_t);
+            memmove(space + 1, space,
+                    (authn_info->spaces->nelts - 1 - i) * sizeof(*space));
+            space->path = apr_pstrmemdup(pool, request->auth_path, len);
+            space->path_len = len;
+            space->realm = realm;
+        }
+    }
+
+    return realm;
+}
+
+void *serf__authn_realm_reset(serf__authn_realm_t *realm, apr_size_t size)
+{
+    apr_pool_clear(realm->pool);
+    realm->baton = apr_pcalloc(realm->pool, size);
+
+    return realm->baton;
+}
+
+void serf__setup_request_authn(serf_request_t *request,
+                               const char *method,
+                               const char *uri,
+                               serf_bucket_t *hdrs_bkt)
+{
+    serf_connection_t *conn = request->conn;
+    serf__authn_info_t *authn_info;
+    const serf__authn_scheme_t *scheme;
+    apr_uri_t parsed_uri;
+
+    authn_info = serf__get_authn_info_for_server(conn);
+
+    if (apr_uri_parse(request->respool, uri, &parsed_uri) == APR_SUCCESS
+        && parsed_uri.path) {
+        request->auth_path = parsed_uri.path;
+    }
+    else {
+        request->auth_path = NULL;
+    }
+
+    /* Outside the known protection spaces, try the last realm we
+       authenticated to, as a server often uses only one. */
+    request->auth_realm = realm_for_path(authn_info, request->auth_path);
+    if (!request->auth_realm)
+        request->auth_realm = authn_info->realm;
+
+    if (request->auth_realm && request->auth_realm->baton)
+        scheme = request->auth_realm->scheme;
+    else
+        scheme = authn_info->scheme;
+
+    if (scheme) {
+        scheme->setup_request_func(HOST, 0, conn, request, method, uri,
+                                   hdrs_bkt);
+    }
+}
+
+apr_status_t serf_config_proxy_credentials(serf_context_t *ctx,
+                                           const char *username,
+                                           const char *password)
+{
+    const serf__authn_scheme_t *scheme;
+
+    for (scheme = serf_authn_schemes; scheme->name != 0; ++scheme) {
+        if (scheme->type == SERF_AUTHN_BASIC)
+            break;
+    }
+    if (!scheme->name)
+        return SERF_ERROR_AUTHN_NOT_SUPPORTED;
+
+    ctx->proxy_authn_info.scheme = scheme;
+    ctx->proxy_authn_info.failed_authn_types = 0;
+
+    return serf__set_basic_proxy_credentials(ctx, username, password);
+}
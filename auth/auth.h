@@ -33,6 +33,21 @@ const char *serf__construct_realm(peer_t peer,
                                   const char *realm_name,
                                   apr_pool_t *pool);
 
+/* Returns the realm REALM_NAME of the server of AUTHN_INFO, for the current
+   scheme of AUTHN_INFO, and remembers that it protects the directory of the
+   path of REQUEST. *TRIED is set when REQUEST was sent with the credentials
+   kept for the realm, so they failed; otherwise they can be used without
+   asking the application again. Allocates from POOL. */
+serf__authn_realm_t *serf__authn_learn_realm(serf__authn_info_t *authn_info,
+                                             serf_request_t *request,
+                                             const char *realm_name,
+                                             int *tried,
+                                             apr_pool_t *pool);
+
+/* Drops the credentials kept for REALM, and returns a new zeroed baton of
+   SIZE bytes for the next ones, allocated from the pool of REALM. */
+void *serf__authn_realm_reset(serf__authn_realm_t *realm, apr_size_t size);
+
 /** Basic authentication **/
 apr_status_t serf__init_basic(int code,
                               serf_context_t *ctx,
@@ -54,6 +69,11 @@ apr_status_t serf__setup_request_basic_auth(peer_t peer,
                                             const char *method,
                                             const char *uri,
                                             serf_bucket_t *hdrs_bkt);
+/* Have the proxy requests of CTX sent with the Basic credentials
+   USERNAME and PASSWORD, see serf_config_proxy_credentials(). */
+apr_status_t serf__set_basic_proxy_credentials(serf_context_t *ctx,
+                                               const char *username,
+                                               const char *password);
 
 /** Digest authentication **/
 apr_status_t serf__init_digest(int code,
@@ -48,6 +48,7 @@ serf__handle_basic_auth(int code,
     apr_pool_t *cred_pool;
     char *username, *password, *realm_name;
     const char *eq, *realm = NULL;
+    serf__authn_realm_t *cached = NULL;
 
     /* Can't do Basic authentication if there's no callback to get
        username & password. */
@@ -86,6 +87,23 @@ serf__handle_basic_auth(int code,
                                       pool);
     }
 
+    if (code == 401) {
+        int tried;
+
+        /* Credentials are kept per realm, so requests switching between
+           realms of the server don't need new ones each time. */
+        cached = serf__authn_learn_realm(authn_info, request,
+                                         realm_name ? realm_name : "",
+                                         &tried, pool);
+        basic_info = cached->baton;
+
+        /* The credentials of the realm didn't fail yet, retry with them. */
+        if (basic_info && basic_info->value && !tried) {
+            authn_info->realm = cached;
+            return APR_SUCCESS;
+        }
+    }
+
     /* Ask the application for credentials */
     apr_pool_create(&cred_pool, pool);
     status = serf__provide_credentials(ctx,
@@ -98,14 +116,23 @@ serf__handle_basic_auth(int code,
         return status;
     }
 
-    tmp = apr_pstrcat(conn->pool, username, ":", password, NULL);
+    tmp = apr_pstrcat(cred_pool, username, ":", password, NULL);
     tmp_len = strlen(tmp);
-    apr_pool_destroy(cred_pool);
+
+    /* The new credentials replace those of the realm. */
+    if (code == 401) {
+        basic_info = serf__authn_realm_reset(cached, sizeof(*basic_info));
+        pool = cached->pool;
+    }
 
     serf__encode_auth_header(&basic_info->value,
                              authn_info->scheme->name,
                              tmp, tmp_len, pool);
     basic_info->header = (code == 401) ? "Authorization" : "Proxy-Authorization";
+    apr_pool_destroy(cred_pool);
+
+    if (code == 401)
+        authn_info->realm = cached;
 
     return APR_SUCCESS;
 }
@@ -122,8 +149,8 @@ serf__init_basic(int code,
    connections in the context to the same server (same realm, username,
    password). Therefore we can keep the header value in the per-server store
    context instead of per connection.
-   TODO: we currently don't cache this info per realm, so each time a request
-   'switches realms', we have to ask the application for new credentials. */
+   For servers, the header value is kept per realm, see
+   serf__authn_learn_realm(). */
 apr_status_t
 serf__init_basic_connection(const serf__authn_scheme_t *scheme,
                             int code,
@@ -165,6 +192,8 @@ serf__setup_request_basic_auth(peer_t peer,
         authn_info = &ctx->proxy_authn_info;
     }
     basic_info = authn_info->baton;
+    if (peer == HOST && request->auth_realm && request->auth_realm->baton)
+        basic_info = request->auth_realm->baton;
 
     if (basic_info && basic_info->header && basic_info->value) {
         serf_bucket_headers_setn(hdrs_bkt, basic_info->header,
@@ -174,3 +203,25 @@ serf__setup_request_basic_auth(peer_t peer,
 
     return SERF_ERROR_AUTHN_FAILED;
 }
+
+apr_status_t
+serf__set_basic_proxy_credentials(serf_context_t *ctx,
+                                  const char *username,
+                                  const char *password)
+{
+    serf__authn_info_t *authn_info = &ctx->proxy_authn_info;
+    basic_authn_info_t *basic_info;
+    const char *tmp;
+
+    basic_info = apr_pcalloc(ctx->pool, sizeof(*basic_info));
+
+    tmp = apr_pstrcat(ctx->pool, username, ":", password, NULL);
+    serf__encode_auth_header(&basic_info->value, "Basic", tmp, strlen(tmp),
+                             ctx->pool);
+    basic_info->header = "Proxy-Authorization";
+
+    /* The connections set up from now on use these right away. */
+    authn_info->baton = basic_info;
+
+    return APR_SUCCESS;
+}
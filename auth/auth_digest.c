@@ -29,10 +29,14 @@
 
 /* TODO: add support for the domain attribute. This defines the protection
    space, so that serf can decide per URI if it should reuse the cached
-   credentials for the server, or not. */
+   credentials for the server, or not. For now the protection space is
+   learned from the paths of the challenged requests, see
+   serf__authn_learn_realm(). */
 
 /* Stores the context information related to Digest authentication.
-   This information is stored in the per server cache in the serf context. */
+   This information is stored in the per server cache in the serf context,
+   per realm for servers. HA1 is kept with the nonce, so a new nonce for
+   the same realm and user doesn't need the password again. */
 typedef struct digest_authn_info_t {
     /* nonce-count for digest authentication */
     unsigned int digest_nc;
@@ -246,10 +250,12 @@ serf__handle_digest_auth(int code,
     serf_connection_t *conn = request->conn;
     serf_context_t *ctx = conn->ctx;
     serf__authn_info_t *authn_info;
+    serf__authn_realm_t *cached = NULL;
     digest_authn_info_t *digest_info;
     apr_status_t status;
     apr_pool_t *cred_pool;
     char *username, *password;
+    int stale = 0;
 
     /* Can't do Digest authentication if there's no callback to get
        username & password. */
@@ -264,8 +270,11 @@ serf__handle_digest_auth(int code,
     }
     digest_info = authn_info->baton;
 
+    /* Everything that is only needed while handling this challenge. */
+    apr_pool_create(&cred_pool, pool);
+
     /* Need a copy cuz we're going to write NUL characters into the string.  */
-    attrs = apr_pstrdup(pool, auth_attr);
+    attrs = apr_pstrdup(cred_pool, auth_attr);
 
     /* We're expecting a list of key=value pairs, separated by a comma.
        Ex. realm="SVN Digest",
@@ -303,28 +312,41 @@ serf__handle_digest_auth(int code,
             qop = val;
         else if (strcmp(key, "opaque") == 0)
             opaque = val;
+        else if (strcmp(key, "stale") == 0)
+            stale = (strcasecmp(val, "true") == 0);
 
         /* Ignore all unsupported attributes. */
     }
 
     if (!realm_name) {
+        apr_pool_destroy(cred_pool);
         return SERF_ERROR_AUTHN_MISSING_ATTRIBUTE;
     }
 
-    realm = serf__construct_realm(code == 401 ? HOST : PROXY,
-                                  conn, realm_name,
-                                  pool);
+    if (code == 401) {
+        digest_authn_info_t *old_info;
+        const char *kept_ha1 = NULL, *kept_username = NULL;
+        int tried;
+
+        cached = serf__authn_learn_realm(authn_info, request, realm_name,
+                                         &tried, pool);
+        old_info = cached->baton;
+
+        /* Unless the credentials of the realm were rejected, hold on to
+           them while the parameters of the old challenge are dropped. */
+        if (old_info && old_info->ha1 && (!tried || stale)) {
+            kept_ha1 = apr_pstrdup(cred_pool, old_info->ha1);
+            kept_username = apr_pstrdup(cred_pool, old_info->username);
+        }
 
-    /* Ask the application for credentials */
-    apr_pool_create(&cred_pool, pool);
-    status = serf__provide_credentials(ctx,
-                                       &username, &password,
-                                       request,
-                                       code, authn_info->scheme->name,
-                                       realm, cred_pool);
-    if (status) {
-        apr_pool_destroy(cred_pool);
-        return status;
+        digest_info = serf__authn_realm_reset(cached, sizeof(*digest_info));
+        digest_info->pool = cached->pool;
+        digest_info->ha1 = apr_pstrdup(digest_info->pool, kept_ha1);
+        digest_info->username = apr_pstrdup(digest_info->pool, kept_username);
+        authn_info->realm = cached;
+    }
+    else {
+        digest_info->pool = conn->pool;
     }
 
     digest_info->header = (code == 401) ? "Authorization" :
@@ -333,18 +355,40 @@ serf__handle_digest_auth(int code,
     /* Store the digest authentication parameters in the context cached for
        this server in the serf context, so we can use it to create the
        Authorization header when setting up requests on the same or different
-       connections (e.g. in case of KeepAlive off on the server).
-       TODO: we currently don't cache this info per realm, so each time a request
-       'switches realms', we have to ask the application for new credentials. */
-    digest_info->pool = conn->pool;
+       connections (e.g. in case of KeepAlive off on the server). */
     digest_info->qop = apr_pstrdup(digest_info->pool, qop);
     digest_info->nonce = apr_pstrdup(digest_info->pool, nonce);
     digest_info->cnonce = NULL;
     digest_info->opaque = apr_pstrdup(digest_info->pool, opaque);
     digest_info->algorithm = apr_pstrdup(digest_info->pool, algorithm);
     digest_info->realm = apr_pstrdup(digest_info->pool, realm_name);
+    /* A new nonce starts counting its requests from 1 again. */
+    digest_info->digest_nc = 1;
+
+    /* A stale nonce, or a realm whose credentials weren't rejected, keeps
+       its HA1: there is no need to ask for the password again. */
+    if (cached && digest_info->ha1) {
+        apr_pool_destroy(cred_pool);
+        serf__connection_set_pipelining(conn, 1);
+        return APR_SUCCESS;
+    }
+
+    realm = serf__construct_realm(code == 401 ? HOST : PROXY,
+                                  conn, realm_name,
+                                  cred_pool);
+
+    /* Ask the application for credentials */
+    status = serf__provide_credentials(ctx,
+                                       &username, &password,
+                                       request,
+                                       code, authn_info->scheme->name,
+                                       realm, cred_pool);
+    if (status) {
+        apr_pool_destroy(cred_pool);
+        return status;
+    }
+
     digest_info->username = apr_pstrdup(digest_info->pool, username);
-    digest_info->digest_nc++;
 
     status = build_digest_ha1(&digest_info->ha1, username, password,
                               digest_info->realm, digest_info->pool);
@@ -411,8 +455,10 @@ serf__setup_request_digest_auth(peer_t peer,
         authn_info = &ctx->proxy_authn_info;
     }
     digest_info = authn_info->baton;
+    if (peer == HOST && request->auth_realm && request->auth_realm->baton)
+        digest_info = request->auth_realm->baton;
 
-    if (digest_info && digest_info->realm) {
+    if (digest_info && digest_info->realm && digest_info->ha1) {
         const char *value;
         const char *path;
 
@@ -535,6 +581,8 @@ serf__validate_response_digest_auth(const serf__authn_scheme_t *scheme,
             authn_info = &ctx->proxy_authn_info;
         }
         digest_info = authn_info->baton;
+        if (peer == HOST && request->auth_realm && request->auth_realm->baton)
+            digest_info = request->auth_realm->baton;
 
         status = build_digest_ha2(&ha2, req_uri, "", qop, pool);
         if (status)
@@ -31,8 +31,6 @@
 #include <apr_strings.h>
 
 /** TODO:
- ** - send session key directly on new connections where we already know
- **   the server requires Kerberos authn.
  ** - Add a way for serf to give detailed error information back to the
  **   application.
  ** - This file is both GSSAPI and Kerberos/NTLM independent, so update names
@@ -85,8 +83,10 @@
  * Note: Step 1 of the handshake will only happen on the first connection, once
  * we know the server requires Kerberos authentication, the initial requests
  * on the other connections will include a session key, so we start at
- * step 2 in the handshake.
- * ### TODO: Not implemented yet!
+ * step 2 in the handshake. The security context itself is bound to the
+ * connection it was established on, so each connection still gets its own;
+ * what is shared is the knowledge that the server takes a session key, and
+ * how long the ticket behind it remains valid (see gss_host_info_t).
  */
 
 /* Current state of the authentication of the current request. */
@@ -160,6 +160,26 @@ typedef enum {
 /* HTTP Service name, used to get the session key.  */
 #define KRB_HTTP_SERVICE "HTTP"
 
+/* Don't send a session key up front when the ticket expires this soon, as
+   the server might see it expired. */
+#define KRB_EXPIRY_MARGIN apr_time_from_sec(60)
+
+/* Stores what the handshakes on the connections to a server learned about
+   it, in the per server cache in the serf context. New connections to the
+   server use it to skip the initial 40x response. */
+typedef struct
+{
+    /* Set once a handshake with the server completed, and cleared when the
+       server rejects a session key sent up front. */
+    int authenticated;
+
+    /* When the ticket of the last completed handshake expires, or 0. */
+    apr_time_t expires;
+
+    /* The persistence state the server was last found in. */
+    authn_persistence_state_t pstate;
+} gss_host_info_t;
+
 /* Stores the context information related to Kerberos authentication. */
 typedef struct
 {
@@ -176,6 +196,16 @@ typedef struct
 
     const char *header;
     const char *value;
+
+    /* When the current security context expires, or 0. */
+    apr_time_t expires;
+
+    /* The info shared by the connections to the server, NULL for proxies. */
+    gss_host_info_t *host;
+
+    /* Set until the first response on the connection, when its first request
+       gets a session key without the server asking for it. */
+    int preemptive;
 } gss_authn_info_t;
 
 /* On the initial 401 response of the server, request a session key from
@@ -210,6 +240,7 @@ gss_api_get_credentials(serf_connection_t *conn,
          KRB_HTTP_SERVICE, hostname,
          &input_buf,
          &output_buf,
+         &gss_info->expires,
          gss_info->pool,
          gss_info->pool
         );
@@ -288,7 +319,7 @@ do_auth(peer_t peer,
            host/proxy. 
            Only add the Authorization header if we know the server requires
            per-request authentication (stateless). */
-        if (gss_info->pstate != pstate_stateless)
+        if (gss_info->pstate != pstate_stateless && !gss_info->preemptive)
             return APR_SUCCESS;
     }
 
@@ -307,6 +338,8 @@ do_auth(peer_t peer,
                           "switching to (slower) stateless mode.\n");
 
                 gss_info->pstate = pstate_stateless;
+                if (gss_info->host)
+                    gss_info->host->pstate = pstate_stateless;
                 serf__connection_set_pipelining(conn, 0);
                 break;
             }
@@ -319,7 +352,17 @@ do_auth(peer_t peer,
         /* We provided token with this request, but server responded with empty
            authentication header. This means server rejected our credentials.
          */
-        return SERF_ERROR_AUTHN_CREDENTIALS_REJECTED;
+        if (!gss_info->preemptive)
+            return SERF_ERROR_AUTHN_CREDENTIALS_REJECTED;
+
+        /* Unless the server didn't ask for the token, as we sent it up front.
+           Start over as if this were the first challenge of the server. */
+        serf__log(LOGLVL_INFO, LOGCOMP_AUTHN, __FILE__, conn->config,
+                  "Server rejected the session key sent up front, "
+                  "renegotiating.\n");
+
+        gss_info->preemptive = 0;
+        gss_info->host->authenticated = 0;
     }
 
     /* If the server didn't provide us with a token, start with a new initial
@@ -377,10 +420,21 @@ serf__init_spnego_connection(const serf__authn_scheme_t *scheme,
     serf_context_t *ctx = conn->ctx;
     serf__authn_info_t *authn_info;
     gss_authn_info_t *gss_info = NULL;
+    gss_host_info_t *host = NULL;
 
     /* For proxy authentication, reuse the gss context for all connections. 
        For server authentication, create a new gss context per connection. */
     if (code == 401) {
+        serf__authn_info_t *server_info;
+
+        server_info = serf__get_authn_info_for_server(conn);
+        host = server_info->baton;
+        if (!host) {
+            host = apr_pcalloc(ctx->pool, sizeof(*host));
+            host->pstate = pstate_init;
+            server_info->baton = host;
+        }
+
         authn_info = &conn->authn_info;
     } else {
         authn_info = &ctx->proxy_authn_info;
@@ -399,8 +453,33 @@ serf__init_spnego_connection(const serf__authn_scheme_t *scheme,
         if (status) {
             return status;
         }
+        gss_info->host = host;
         authn_info->baton = gss_info;
     }
+    else if (host) {
+        /* The connection was reset. A new socket needs a new handshake. */
+        serf__spnego_reset_sec_context(gss_info->gss_ctx);
+        gss_info->state = gss_api_auth_not_started;
+        gss_info->pstate = pstate_init;
+        gss_info->header = NULL;
+        gss_info->value = NULL;
+    }
+
+    /* If an earlier connection to the server completed a handshake, and its
+       ticket remains valid for a while, send a session key with the first
+       request instead of waiting for the server to ask for it. */
+    gss_info->preemptive = 0;
+    if (host && host->authenticated
+        && (!host->expires
+            || apr_time_now() + KRB_EXPIRY_MARGIN < host->expires)) {
+        gss_info->preemptive = 1;
+        if (host->pstate == pstate_stateless)
+            gss_info->pstate = pstate_stateless;
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
+                  "Server is known to use SPNEGO, authenticate the first "
+                  "request up front.\n");
+    }
 
     /* Make serf send the initial requests one by one */
     serf__connection_set_pipelining(conn, 0);
@@ -424,14 +503,32 @@ serf__handle_spnego_auth(int code,
     serf_context_t *ctx = conn->ctx;
     gss_authn_info_t *gss_info = (code == 401) ? conn->authn_info.baton :
                                                  ctx->proxy_authn_info.baton;
+    apr_status_t status;
+
+    /* The connection was set up before the server was found to use SPNEGO. */
+    if (!gss_info) {
+        serf__authn_info_t *authn_info = (code == 401) ?
+            serf__get_authn_info_for_server(conn) : &ctx->proxy_authn_info;
 
-    return do_auth(code == 401 ? HOST : PROXY,
-                   code,
-                   gss_info,
-                   request->conn,
-                   request,
-                   auth_hdr,
-                   pool);
+        status = serf__init_spnego_connection(authn_info->scheme, code, conn,
+                                              conn->pool);
+        if (status)
+            return status;
+
+        gss_info = (code == 401) ? conn->authn_info.baton :
+                                   ctx->proxy_authn_info.baton;
+    }
+
+    status = do_auth(code == 401 ? HOST : PROXY,
+                     code,
+                     gss_info,
+                     request->conn,
+                     request,
+                     auth_hdr,
+                     pool);
+    gss_info->preemptive = 0;
+
+    return status;
 }
 
 /* Setup the authn headers on this request message. */
@@ -447,6 +544,11 @@ serf__setup_request_spnego_auth(peer_t peer,
     serf_context_t *ctx = conn->ctx;
     gss_authn_info_t *gss_info = (peer == HOST) ? conn->authn_info.baton :
                                                   ctx->proxy_authn_info.baton;
+    int initial_token = 0;
+
+    /* Nothing is known about the server on this connection yet. */
+    if (!gss_info)
+        return APR_SUCCESS;
 
     /* If we have an ongoing authentication handshake, the handler of the
        previous response will have created the authn headers for this request
@@ -471,7 +573,15 @@ serf__setup_request_spnego_auth(peer_t peer,
 
     switch (gss_info->pstate) {
         case pstate_init:
-            /* We shouldn't normally arrive here, do nothing. */
+            /* The server is known to take our session key, as another
+               connection to it was authenticated. */
+            if (gss_info->preemptive) {
+                serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
+                          "Add Negotiate header to first request on this "
+                          "connection.\n");
+                initial_token = 1;
+            }
+            /* Otherwise we shouldn't normally arrive here, do nothing. */
             break;
         case pstate_undecided: /* fall through */
             serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
@@ -486,38 +596,41 @@ serf__setup_request_spnego_auth(peer_t peer,
             /* Nothing to do here. */
             break;
         case pstate_stateless:
-            {
-                apr_status_t status;
+            /* Authentication on this connection is known to be stateless.
+               Add an initial Negotiate token for the server, to bypass the
+               40x response we know we'll otherwise receive.
+              (RFC 4559 section 4.2) */
+            serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
+                      "Add initial Negotiate header to request.\n");
+            initial_token = 1;
+            break;
+    }
 
-                /* Authentication on this connection is known to be stateless.
-                   Add an initial Negotiate token for the server, to bypass the
-                   40x response we know we'll otherwise receive.
-                  (RFC 4559 section 4.2) */
-                serf__log(LOGLVL_DEBUG, LOGCOMP_AUTHN, __FILE__, conn->config,
-                          "Add initial Negotiate header to request.\n");
-
-                status = do_auth(peer,
-                                 code,
-                                 gss_info,
-                                 conn,
-                                 request,
-                                 0l,    /* no response authn header */
-                                 conn->pool);
-                if (status)
-                    return status;
-
-                serf_bucket_headers_setn(hdrs_bkt, gss_info->header,
-                                         gss_info->value);
-
-                /* Remember that we're using this request for authentication
-                   handshake. */
-                request->auth_baton = (void*) TRUE;
-
-                /* We should send each token only once. */
-                gss_info->header = NULL;
-                gss_info->value = NULL;
-                break;
-            }
+    if (initial_token) {
+        apr_status_t status;
+
+        status = do_auth(peer,
+                         code,
+                         gss_info,
+                         conn,
+                         request,
+                         0l,    /* no response authn header */
+                         conn->pool);
+        if (status)
+            return status;
+
+        if (gss_info->header && gss_info->value) {
+            serf_bucket_headers_setn(hdrs_bkt, gss_info->header,
+                                     gss_info->value);
+
+            /* Remember that we're using this request for authentication
+               handshake. */
+            request->auth_baton = (void*) TRUE;
+        }
+
+        /* We should send each token only once. */
+        gss_info->header = NULL;
+        gss_info->value = NULL;
     }
 
     return APR_SUCCESS;
@@ -598,6 +711,12 @@ serf__validate_response_spnego_auth(const serf__authn_scheme_t *scheme,
         auth_hdr_name = "Proxy-Authenticate";
     }
 
+    if (!gss_info)
+        return APR_SUCCESS;
+
+    /* The token sent up front, if any, was accepted. */
+    gss_info->preemptive = 0;
+
     if (gss_info->state != gss_api_auth_completed) {
         serf_bucket_t *hdrs;
         const char *auth_hdr_val;
@@ -627,16 +746,31 @@ serf__validate_response_spnego_auth(const serf__authn_scheme_t *scheme,
     }
 
     if (gss_info->state == gss_api_auth_completed) {
+        if (gss_info->host) {
+            gss_info->host->authenticated = 1;
+            gss_info->host->expires = gss_info->expires;
+        }
+
         switch(gss_info->pstate) {
             case pstate_init:
-                /* Authentication of the first request is done. */
-                gss_info->pstate = pstate_undecided;
+                /* Authentication of the first request is done. If another
+                   connection found the server to support persistent
+                   authentication, take its word for it. */
+                if (gss_info->host
+                    && gss_info->host->pstate == pstate_stateful) {
+                    gss_info->pstate = pstate_stateful;
+                    serf__connection_set_pipelining(conn, 1);
+                }
+                else
+                    gss_info->pstate = pstate_undecided;
                 break;
             case pstate_undecided:
                 /* The server didn't request for authentication even though
                    we didn't add an Authorization header to previous
                    request. That means it supports persistent authentication. */
                 gss_info->pstate = pstate_stateful;
+                if (gss_info->host)
+                    gss_info->host->pstate = pstate_stateful;
                 serf__connection_set_pipelining(conn, 1);
                 break;
             default:
@@ -74,6 +74,9 @@ serf__spnego_create_sec_context(serf__spnego_context_t **ctx_p,
  * to destination server. This buffer will be automatically freed on
  * RESULT_POOL cleanup.
  *
+ * *EXPIRES is set to the time the security context, and so the ticket it is
+ * based on, stops being valid, or to 0 if it doesn't expire or it's unknown.
+ *
  * All temporary allocations will be performed in SCRATCH_POOL.
  *
  * Return value:
@@ -94,6 +97,7 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
                               const char *hostname,
                               serf__spnego_buffer_t *input_buf,
                               serf__spnego_buffer_t *output_buf,
+                              apr_time_t *expires,
                               apr_pool_t *result_pool,
                               apr_pool_t *scratch_pool
                               );
@@ -153,6 +153,7 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
                               const char *hostname,
                               serf__spnego_buffer_t *input_buf,
                               serf__spnego_buffer_t *output_buf,
+                              apr_time_t *expires,
                               apr_pool_t *result_pool,
                               apr_pool_t *scratch_pool
                               )
@@ -164,6 +165,7 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
     gss_buffer_desc bufdesc;
     gss_OID dummy;        /* value unused */
     OM_uint32 dummy_stat; /* value unused */
+    OM_uint32 time_rec;
 
     /* Get the name for the HTTP service at the target host. */
     /* TODO: should be shared between multiple requests. */
@@ -203,10 +205,15 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
          &dummy,                    /* actual mech type */
          gss_output_buf_p,           /* output_token */
          NULL,                      /* ret_flags */
-         NULL                       /* not interested in remaining validity */
+         &time_rec                  /* remaining validity, in seconds */
          );
 
     gss_release_name(&dummy_stat, &host_gss_name);
+
+    if (GSS_ERROR(gss_maj_stat) || time_rec == GSS_C_INDEFINITE)
+        *expires = 0;
+    else
+        *expires = apr_time_now() + apr_time_from_sec(time_rec);
     apr_pool_cleanup_register(result_pool, gss_output_buf_p,
                               cleanup_sec_buffer,
                               apr_pool_cleanup_null);
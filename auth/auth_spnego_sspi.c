@@ -29,6 +29,10 @@
 #define SEC_E_MUTUAL_AUTH_FAILED _HRESULT_TYPEDEF_(0x80090363L)
 #endif
 
+/* The time between the FILETIME epoch, January 1, 1601, and the APR
+   epoch, January 1, 1970, in 100ns units. */
+#define FILETIME_EPOCH_DELTA APR_UINT64_C(116444736000000000)
+
 struct serf__spnego_context_t
 {
     CredHandle sspi_credentials;
@@ -214,6 +218,7 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
                               const char *hostname,
                               serf__spnego_buffer_t *input_buf,
                               serf__spnego_buffer_t *output_buf,
+                              apr_time_t *expires,
                               apr_pool_t *result_pool,
                               apr_pool_t *scratch_pool
                               )
@@ -226,6 +231,7 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
     SecBufferDesc sspi_out_buffer_desc;
     apr_status_t apr_status;
     const char *canonname;
+    TimeStamp expiry;
 
     if (!ctx->initalized && ctx->authn_type == SERF_AUTHN_NEGOTIATE) {
         apr_status = get_canonical_hostname(&canonname, hostname, scratch_pool);
@@ -276,7 +282,23 @@ serf__spnego_init_sec_context(serf_connection_t *conn,
         &ctx->sspi_context,
         &sspi_out_buffer_desc,
         &actual_attr,
-        NULL);
+        &expiry);
+
+    *expires = 0;
+    if (!FAILED(status) && expiry.QuadPart != MAXLONGLONG) {
+        FILETIME local_time, utc_time;
+
+        /* EXPIRY is in local time, in 100ns units since January 1, 1601. */
+        local_time.dwLowDateTime = expiry.LowPart;
+        local_time.dwHighDateTime = expiry.HighPart;
+        if (LocalFileTimeToFileTime(&local_time, &utc_time)) {
+            ULARGE_INTEGER t;
+
+            t.LowPart = utc_time.dwLowDateTime;
+            t.HighPart = utc_time.dwHighDateTime;
+            *expires = (apr_time_t)((t.QuadPart - FILETIME_EPOCH_DELTA) / 10);
+        }
+    }
 
     if (sspi_out_buffer.cbBuffer > 0) {
         apr_pool_cleanup_register(result_pool, sspi_out_buffer.pvBuffer,
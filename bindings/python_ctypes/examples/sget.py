@@ -26,7 +26,15 @@ ONE_SECOND = 1000000
 
 
 def main():
-  fetch('serf.googlecode.com', 80, '/svn/trunk/NOTICE')
+  parser = argparse.ArgumentParser()
+  parser.add_argument('urls', nargs='*',
+                      help='fetch these URLs in one batch')
+  args = parser.parse_args()
+
+  if args.urls:
+    fetch_batch(args.urls)
+  else:
+    fetch('serf.googlecode.com', 80, '/svn/trunk/NOTICE')
 
 
 def fetch(hostname, port, path):
@@ -110,13 +118,31 @@ def req_accept(req, bkt, a_baton, pool):
 def req_handler(req, resp_bkt, h_baton, pool):
   assert resp_bkt is not None
 
-  buf = serf.ctypes.create_string_buffer(8000)
+  body = serf.iter_body(resp_bkt)
+  for span in body:
+    sys.stdout.write(span.tobytes())
+  return body.status
 
-  while True:
-    status = resp_bkt.type.read(resp_bkt, 8000, buf, len(buf))
-    print status
-    if status:
-      return status
+
+def fetch_batch(urls):
+  "Fetch all of URLS with one native call."
+  serf.apr_initialize()
+  status, pool = serf.apr_pool_create(None)
+  assert status == 0
+
+  ctx = serf.serf_context_create(pool)
+  status, results = serf.fetch_urls(ctx, urls, max_conns=4,
+                                    timeout=30 * ONE_SECOND,
+                                    parent_pool=pool)
+  if status:
+    print 'STATUS:', status, serf.serf_error_string(status)
+
+  for url, (status, code, body) in zip(urls, results):
+    print url, status, code, len(body)
+
+  results.close()
+  serf.apr_pool_destroy(pool)
+  serf.apr_terminate()
 
 
 if __name__ == '__main__':
@@ -16,6 +16,7 @@
 # ====================================================================
 #
 
+import sys
 import types
 import ctypes
 
@@ -42,6 +43,14 @@ BKTALLOC_P = _make_incomplete_ptr('serf_bucket_allocator_t')
 
 STATUS = ctypes.c_int
 
+APR_SUCCESS = 0
+APR_TIMEUP = 70007
+APR_EOF = 70014
+### the value of EAGAIN on Linux and Mac OS X only.
+APR_EAGAIN = 35 if sys.platform == 'darwin' else 11
+
+SERF_READ_ALL_AVAIL = ctypes.c_size_t(-1).value
+
 BATON = ctypes.py_object  # standard baton type: pass any Python object
 
 class BUCKET(ctypes.Structure):
@@ -57,11 +66,13 @@ BUCKET._fields_ = [
   ('data', BATON),
   ('allocator', BKTALLOC_P),
   ]
+# The data of read and peek is returned as a plain pointer: a c_char_p
+# would copy it into a Python string. See bucket_read().
 BUCKET_TYPE._fields_ = [
   ('name', ctypes.c_char_p),
-  ('read', ctypes.CFUNCTYPE(STATUS, BUCKET_P, ctypes.c_int,
-                            ctypes.POINTER(ctypes.c_char_p),
-                            ctypes.POINTER(ctypes.c_int))),
+  ('read', ctypes.CFUNCTYPE(STATUS, BUCKET_P, ctypes.c_size_t,
+                            ctypes.POINTER(ctypes.c_void_p),
+                            ctypes.POINTER(ctypes.c_size_t))),
   ('readline', ctypes.CFUNCTYPE(STATUS, BUCKET_P, ctypes.c_int,
                                 ctypes.POINTER(ctypes.c_int),
                                 ctypes.POINTER(ctypes.c_char_p),
@@ -78,8 +89,8 @@ BUCKET_TYPE._fields_ = [
                                          ctypes.POINTER(ctypes.c_int))),
   ('read_bucket', ctypes.CFUNCTYPE(BUCKET_P, BUCKET_P, BUCKET_TYPE_P)),
   ('peek', ctypes.CFUNCTYPE(STATUS, BUCKET_P,
-                            ctypes.POINTER(ctypes.c_char_p),
-                            ctypes.POINTER(ctypes.c_int))),
+                            ctypes.POINTER(ctypes.c_void_p),
+                            ctypes.POINTER(ctypes.c_size_t))),
   ('destroy', ctypes.CFUNCTYPE(None, BUCKET_P)),
   ]
 
@@ -220,3 +231,117 @@ REQ_SETUP_F = ctypes.CFUNCTYPE(STATUS,
                                POOL_P)
 _define('serf_connection_request_create', REQUEST_P,
         CONN_P, REQ_SETUP_F, BATON)
+
+
+def _span(data, length):
+  "A memoryview of the LENGTH bytes at address DATA, without copying them."
+  if not length:
+    return memoryview(b'')
+  return memoryview((ctypes.c_char * length).from_address(data))
+
+
+def bucket_read(bkt, requested=SERF_READ_ALL_AVAIL):
+  """Read up to REQUESTED bytes from BKT, which is a BUCKET_P.
+
+  Returns (status, span), where span is a memoryview of the bucket's own
+  buffer: it is only valid until the next read from BKT. Copy it with
+  bytes(span) to keep the data.
+  """
+  data = ctypes.c_void_p()
+  length = ctypes.c_size_t()
+  status = bkt.contents.type.contents.read(bkt, requested,
+                                            ctypes.byref(data),
+                                            ctypes.byref(length))
+  return status, _span(data.value, length.value)
+
+
+class BodyIterator(object):
+  """Iterate over the spans of the body in response bucket BKT.
+
+  Each span is a memoryview as returned by bucket_read(). The iteration
+  stops when no more data is available now: STATUS is then APR_EOF at the
+  end of the body, APR_EAGAIN if the handler should return and wait for
+  more, or an error. A handler can simply return iterator.status.
+  """
+
+  def __init__(self, bkt, requested=SERF_READ_ALL_AVAIL):
+    self.bkt = bkt
+    self.requested = requested
+    self.status = APR_SUCCESS
+
+  def __iter__(self):
+    return self
+
+  def __next__(self):
+    while self.status == APR_SUCCESS:
+      self.status, span = bucket_read(self.bkt, self.requested)
+      if len(span):
+        return span
+    raise StopIteration
+
+  next = __next__  # Python 2
+
+
+def iter_body(bkt, requested=SERF_READ_ALL_AVAIL):
+  "Returns a BodyIterator over the body in response bucket BKT."
+  return BodyIterator(bkt, requested)
+
+
+class FETCH_RESULT(ctypes.Structure):
+  _fields_ = [ ('status', STATUS),
+               ('code', ctypes.c_int),
+               ('body', ctypes.c_void_p),
+               ('body_len', ctypes.c_size_t),
+               ]
+
+_serf_context_fetch_urls = _define('serf_context_fetch_urls', STATUS,
+                                   ctypes.POINTER(FETCH_RESULT),
+                                   CONTEXT_P,
+                                   ctypes.POINTER(ctypes.c_char_p),
+                                   ctypes.c_int,
+                                   ctypes.c_uint,
+                                   ctypes.c_int64,
+                                   POOL_P)
+
+
+class FetchResults(object):
+  """The results of fetch_urls(), in the order of the URLs.
+
+  Each result is a tuple (status, code, body), where body is a memoryview
+  of memory owned by this object: it is valid until close() is called.
+  """
+
+  def __init__(self, pool, results):
+    self._pool = pool
+    self._results = results
+
+  def __len__(self):
+    return len(self._results)
+
+  def __getitem__(self, i):
+    r = self._results[i]
+    return r.status, r.code, _span(r.body, r.body_len)
+
+  def close(self):
+    if self._pool:
+      apr_pool_destroy(self._pool)
+      self._pool = None
+      self._results = []
+
+
+def fetch_urls(ctx, urls, max_conns=4, timeout=0, parent_pool=None):
+  """GET all of URLS with serf_context_fetch_urls(): the loop runs to
+  completion in one native call, instead of one call per response read.
+
+  TIMEOUT is in microseconds, 0 for none. Returns (status, results), where
+  results is a FetchResults.
+  """
+  status, pool = apr_pool_create(parent_pool)
+  if status:
+    return status, FetchResults(None, [])
+
+  c_urls = (ctypes.c_char_p * len(urls))(*urls)
+  results = (FETCH_RESULT * len(urls))()
+  status = _serf_context_fetch_urls(results, ctx, c_urls, len(urls),
+                                    max_conns, timeout, pool)
+  return status, FetchResults(pool, results)
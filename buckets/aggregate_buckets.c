@@ -13,20 +13,26 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
 #include "serf.h"
 #include "serf_bucket_util.h"
 
+#include "serf_private.h"
 
-/* Should be an APR_RING? */
-typedef struct bucket_list {
-    serf_bucket_t *bucket;
-    struct bucket_list *next;
-} bucket_list_t;
 
 typedef struct aggregate_context_t {
-    bucket_list_t *list; /* active buckets */
-    bucket_list_t *last; /* last bucket of the list */
-    bucket_list_t *done; /* we finished reading this; now pending a destroy */
+    /* The active buckets: a ring of LIST_SIZE slots (a power of two),
+       holding COUNT buckets starting at slot FIRST. */
+    serf_bucket_t **list;
+    int list_size;
+    int first;
+    int count;
+
+    /* we finished reading these; now pending a destroy */
+    serf_bucket_t **done;
+    int done_size;
+    int done_count;
 
     serf_bucket_aggregate_eof_t hold_open;
     void *hold_open_baton;
@@ -38,24 +44,85 @@ typedef struct aggregate_context_t {
 } aggregate_context_t;
 
 
+/* The I'th active bucket of CTX. */
+#define LIST_AT(ctx, i) \
+    ((ctx)->list[((ctx)->first + (i)) & ((ctx)->list_size - 1)])
+
+/* The slots of the ring (and the done array) are kept when buckets are
+   removed, and only grow when needed. */
+#define INITIAL_LIST_SIZE 4
+
+static void grow_list(aggregate_context_t *ctx,
+                      serf_bucket_alloc_t *allocator)
+{
+    int new_size = ctx->list_size ? ctx->list_size * 2 : INITIAL_LIST_SIZE;
+    serf_bucket_t **new_list;
+    int i;
+
+    new_list = serf_bucket_mem_alloc(allocator,
+                                     new_size * sizeof(*new_list));
+    for (i = 0; i < ctx->count; i++)
+        new_list[i] = LIST_AT(ctx, i);
+
+    if (ctx->list)
+        serf_bucket_mem_free(allocator, ctx->list);
+
+    ctx->list = new_list;
+    ctx->list_size = new_size;
+    ctx->first = 0;
+}
+
+/* Removes the first active bucket from the list, and returns it. */
+static serf_bucket_t *pop_head(aggregate_context_t *ctx)
+{
+    serf_bucket_t *head = ctx->list[ctx->first];
+
+    ctx->first = (ctx->first + 1) & (ctx->list_size - 1);
+    ctx->count--;
+
+    return head;
+}
+
+/* Moves the first active bucket to the to-be-freed list. This ensures
+ * that the bucket stays alive (so as not to violate our read semantics).
+ * We'll destroy it the next time we are asked to perform a read operation
+ * - thus ensuring the proper read lifetime.
+ */
+static void head_done(aggregate_context_t *ctx,
+                      serf_bucket_alloc_t *allocator)
+{
+    if (ctx->done_count == ctx->done_size) {
+        int new_size = ctx->done_size ? ctx->done_size * 2
+                                      : INITIAL_LIST_SIZE;
+        serf_bucket_t **new_done;
+
+        new_done = serf_bucket_mem_alloc(allocator,
+                                         new_size * sizeof(*new_done));
+        if (ctx->done) {
+            memcpy(new_done, ctx->done, ctx->done_count * sizeof(*new_done));
+            serf_bucket_mem_free(allocator, ctx->done);
+        }
+
+        ctx->done = new_done;
+        ctx->done_size = new_size;
+    }
+
+    ctx->done[ctx->done_count++] = pop_head(ctx);
+}
+
 static void cleanup_aggregate(aggregate_context_t *ctx,
                               serf_bucket_alloc_t *allocator)
 {
-    bucket_list_t *next_list;
+    int i;
 
     /* If we finished reading a bucket during the previous read, then
      * we can now toss that bucket.
      */
-    while (ctx->done != NULL) {
-        next_list = ctx->done->next;
-
-        if (ctx->bucket_owner) {
-            serf_bucket_destroy(ctx->done->bucket);
-        }
-        serf_bucket_mem_free(allocator, ctx->done);
-
-        ctx->done = next_list;
+    if (ctx->bucket_owner) {
+        for (i = 0; i < ctx->done_count; i++)
+            serf_bucket_destroy(ctx->done[i]);
     }
+    ctx->done_count = 0;
 }
 
 void serf_bucket_aggregate_cleanup(
@@ -73,8 +140,12 @@ static aggregate_context_t *create_aggregate(serf_bucket_alloc_t *allocator)
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
 
     ctx->list = NULL;
-    ctx->last = NULL;
+    ctx->list_size = 0;
+    ctx->first = 0;
+    ctx->count = 0;
     ctx->done = NULL;
+    ctx->done_size = 0;
+    ctx->done_count = 0;
     ctx->hold_open = NULL;
     ctx->hold_open_baton = NULL;
     ctx->config = NULL;
@@ -112,18 +183,21 @@ serf_bucket_t *serf__bucket_stream_create(
 static void serf_aggregate_destroy_and_data(serf_bucket_t *bucket)
 {
     aggregate_context_t *ctx = bucket->data;
-    bucket_list_t *next_ctx;
 
-    while (ctx->list) {
+    while (ctx->count) {
+        serf_bucket_t *head = pop_head(ctx);
+
         if (ctx->bucket_owner) {
-            serf_bucket_destroy(ctx->list->bucket);
+            serf_bucket_destroy(head);
         }
-        next_ctx = ctx->list->next;
-        serf_bucket_mem_free(bucket->allocator, ctx->list);
-        ctx->list = next_ctx;
     }
     cleanup_aggregate(ctx, bucket->allocator);
 
+    if (ctx->list)
+        serf_bucket_mem_free(bucket->allocator, ctx->list);
+    if (ctx->done)
+        serf_bucket_mem_free(bucket->allocator, ctx->done);
+
     serf_default_destroy_and_data(bucket);
 }
 
@@ -145,14 +219,13 @@ void serf_bucket_aggregate_prepend(
     serf_bucket_t *prepend_bucket)
 {
     aggregate_context_t *ctx = aggregate_bucket->data;
-    bucket_list_t *new_list;
 
-    new_list = serf_bucket_mem_alloc(aggregate_bucket->allocator,
-                                     sizeof(*new_list));
-    new_list->bucket = prepend_bucket;
-    new_list->next = ctx->list;
+    if (ctx->count == ctx->list_size)
+        grow_list(ctx, aggregate_bucket->allocator);
 
-    ctx->list = new_list;
+    ctx->first = (ctx->first - 1) & (ctx->list_size - 1);
+    ctx->list[ctx->first] = prepend_bucket;
+    ctx->count++;
 
     /* Share our config with this new bucket */
     serf_bucket_set_config(prepend_bucket, ctx->config);
@@ -163,25 +236,12 @@ void serf_bucket_aggregate_append(
     serf_bucket_t *append_bucket)
 {
     aggregate_context_t *ctx = aggregate_bucket->data;
-    bucket_list_t *new_list;
 
-    new_list = serf_bucket_mem_alloc(aggregate_bucket->allocator,
-                                     sizeof(*new_list));
-    new_list->bucket = append_bucket;
-    new_list->next = NULL;
+    if (ctx->count == ctx->list_size)
+        grow_list(ctx, aggregate_bucket->allocator);
 
-    /* If we use APR_RING, this is trivial.  So, wait.
-    new_list->next = ctx->list;
-    ctx->list = new_list;
-    */
-    if (ctx->list == NULL) {
-        ctx->list = new_list;
-        ctx->last = new_list;
-    }
-    else {
-        ctx->last->next = new_list;
-        ctx->last = ctx->last->next;
-    }
+    LIST_AT(ctx, ctx->count) = append_bucket;
+    ctx->count++;
 
     /* Share our config with this new bucket */
     serf_bucket_set_config(append_bucket, ctx->config);
@@ -243,7 +303,7 @@ static apr_status_t read_aggregate(serf_bucket_t *bucket,
 
     *vecs_used = 0;
 
-    if (!ctx->list) {
+    if (!ctx->count) {
         if (ctx->hold_open) {
             return ctx->hold_open(ctx->hold_open_baton, bucket);
         }
@@ -254,7 +314,7 @@ static apr_status_t read_aggregate(serf_bucket_t *bucket,
 
     status = APR_SUCCESS;
     while (requested) {
-        serf_bucket_t *head = ctx->list->bucket;
+        serf_bucket_t *head = ctx->list[ctx->first];
 
         status = serf_bucket_read_iovec(head, requested, vecs_size, vecs,
                                         &cur_vecs_used);
@@ -266,8 +326,6 @@ static apr_status_t read_aggregate(serf_bucket_t *bucket,
         *vecs_used += cur_vecs_used;
 
         if (cur_vecs_used > 0 || status) {
-            bucket_list_t *next_list;
-
             /* If we got SUCCESS (w/bytes) or EAGAIN, we want to return now
              * as it isn't safe to read more without returning to our caller.
              */
@@ -276,19 +334,12 @@ static apr_status_t read_aggregate(serf_bucket_t *bucket,
             }
 
             /* However, if we read EOF, we can stash this bucket in a
-             * to-be-freed list and move on to the next bucket.  This ensures
-             * that the bucket stays alive (so as not to violate our read
-             * semantics).  We'll destroy this list of buckets the next time
-             * we are asked to perform a read operation - thus ensuring the
-             * proper read lifetime.
+             * to-be-freed list and move on to the next bucket.
              */
-            next_list = ctx->list->next;
-            ctx->list->next = ctx->done;
-            ctx->done = ctx->list;
-            ctx->list = next_list;
+            head_done(ctx, bucket->allocator);
 
             /* If we have no more in our list, return EOF. */
-            if (!ctx->list) {
+            if (!ctx->count) {
                 if (ctx->hold_open) {
                     return ctx->hold_open(ctx->hold_open_baton, bucket);
                 }
@@ -360,6 +411,93 @@ static apr_status_t serf_aggregate_read_iovec(serf_bucket_t *bucket,
     return read_aggregate(bucket, requested, vecs_size, vecs, vecs_used);
 }
 
+static apr_status_t serf_aggregate_read_for_sendfile(serf_bucket_t *bucket,
+                                                     apr_size_t requested,
+                                                     apr_hdtr_t *hdtr,
+                                                     apr_file_t **file,
+                                                     apr_off_t *offset,
+                                                     apr_size_t *len)
+{
+    aggregate_context_t *ctx = bucket->data;
+    int vecs_size = hdtr->numheaders;
+    int trailers_size = hdtr->numtrailers;
+    apr_status_t status;
+
+    cleanup_aggregate(ctx, bucket->allocator);
+
+    *file = NULL;
+    hdtr->numheaders = 0;
+    hdtr->numtrailers = 0;
+
+    if (!ctx->count) {
+        if (ctx->hold_open) {
+            return ctx->hold_open(ctx->hold_open_baton, bucket);
+        }
+        else {
+            return APR_EOF;
+        }
+    }
+
+    /* Collect the data of our buckets as headers, until one of them hands
+       out a file. Nothing can follow the file except for its trailers. */
+    while (1) {
+        serf_bucket_t *head = ctx->list[ctx->first];
+        apr_hdtr_t head_hdtr;
+        int i;
+
+        head_hdtr.headers = hdtr->headers + hdtr->numheaders;
+        head_hdtr.numheaders = vecs_size - hdtr->numheaders;
+        head_hdtr.trailers = hdtr->trailers;
+        head_hdtr.numtrailers = trailers_size;
+
+        status = serf_bucket_read_for_sendfile(head, requested, &head_hdtr,
+                                               file, offset, len);
+
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        hdtr->numheaders += head_hdtr.numheaders;
+
+        if (*file) {
+            hdtr->numtrailers = head_hdtr.numtrailers;
+        }
+        else if (!status || APR_STATUS_IS_EAGAIN(status)
+                 || status == SERF_ERROR_WAIT_CONN) {
+            /* Not safe to read more without returning to our caller. */
+            return status;
+        }
+
+        if (status == APR_EOF) {
+            /* Move the finished bucket to the to-be-freed list. */
+            head_done(ctx, bucket->allocator);
+
+            if (!ctx->count) {
+                if (ctx->hold_open) {
+                    return ctx->hold_open(ctx->hold_open_baton, bucket);
+                }
+                else {
+                    return APR_EOF;
+                }
+            }
+
+            status = APR_SUCCESS;
+        }
+
+        if (*file)
+            return status;
+
+        if (requested != SERF_READ_ALL_AVAIL) {
+            for (i = 0; i < head_hdtr.numheaders; i++)
+                requested -= head_hdtr.headers[i].iov_len;
+        }
+
+        /* We reached our max.  Oh well. */
+        if (!requested || hdtr->numheaders == vecs_size) {
+            return APR_SUCCESS;
+        }
+    }
+}
+
 static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
                                             int acceptable, int *found,
                                             const char **data, apr_size_t *len)
@@ -375,7 +513,7 @@ static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
 
         *len = 0;
 
-        if (!ctx->list) {
+        if (!ctx->count) {
             if (ctx->hold_open) {
                 return ctx->hold_open(ctx->hold_open_baton, bucket);
             }
@@ -384,7 +522,7 @@ static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
             }
         }
 
-        head = ctx->list->bucket;
+        head = ctx->list[ctx->first];
 
         status = serf_bucket_readline(head, acceptable, found,
                                       data, len);
@@ -392,16 +530,11 @@ static apr_status_t serf_aggregate_readline(serf_bucket_t *bucket,
             return status;
 
         if (status == APR_EOF) {
-            bucket_list_t *next_list;
-
             /* head bucket is empty, move to to-be-cleaned-up list. */
-            next_list = ctx->list->next;
-            ctx->list->next = ctx->done;
-            ctx->done = ctx->list;
-            ctx->list = next_list;
+            head_done(ctx, bucket->allocator);
 
             /* If we have no more in our list, return EOF. */
-            if (!ctx->list) {
+            if (!ctx->count) {
                 if (ctx->hold_open) {
                     return ctx->hold_open(ctx->hold_open_baton, bucket);
                 }
@@ -432,7 +565,7 @@ static apr_status_t serf_aggregate_peek(serf_bucket_t *bucket,
     cleanup_aggregate(ctx, bucket->allocator);
 
     /* Peek the first bucket in the list, if any. */
-    if (!ctx->list) {
+    if (!ctx->count) {
         *len = 0;
         if (ctx->hold_open) {
             status = ctx->hold_open(ctx->hold_open_baton, bucket);
@@ -445,12 +578,19 @@ static apr_status_t serf_aggregate_peek(serf_bucket_t *bucket,
         }
     }
 
-    head = ctx->list->bucket;
+    head = ctx->list[ctx->first];
 
     status = serf_bucket_peek(head, data, len);
 
+    /* Look past the buckets that were read to the end. */
+    while (status == APR_EOF && !*len && ctx->count > 1) {
+        head_done(ctx, bucket->allocator);
+        head = ctx->list[ctx->first];
+        status = serf_bucket_peek(head, data, len);
+    }
+
     if (status == APR_EOF) {
-        if (ctx->list->next) {
+        if (ctx->count > 1) {
             status = APR_SUCCESS;
         } else {
             if (ctx->hold_open) {
@@ -472,33 +612,47 @@ static serf_bucket_t * serf_aggregate_read_bucket(
     aggregate_context_t *ctx = bucket->data;
     serf_bucket_t *found_bucket;
 
-    if (!ctx->list) {
-        return NULL;
-    }
+    cleanup_aggregate(ctx, bucket->allocator);
+
+    while (ctx->count) {
+        serf_bucket_t *head = ctx->list[ctx->first];
+        const char *data;
+        apr_size_t len;
+
+        if (head->type == type) {
+            /* Got the bucket. Consume it from our list. */
+            found_bucket = pop_head(ctx);
+            return found_bucket;
+        }
 
-    if (ctx->list->bucket->type == type) {
-        /* Got the bucket. Consume it from our list. */
-        found_bucket = ctx->list->bucket;
-        ctx->list = ctx->list->next;
-        return found_bucket;
+        /* Skip the buckets that were read to the end, so that what follows
+           them can be spliced off as well. */
+        if (ctx->count > 1 && head->type->peek
+            && serf_bucket_peek(head, &data, &len) == APR_EOF && !len) {
+            head_done(ctx, bucket->allocator);
+            continue;
+        }
+
+        /* Call read_bucket on first one in our list. */
+        return serf_bucket_read_bucket(head, type);
     }
 
-    /* Call read_bucket on first one in our list. */
-    return serf_bucket_read_bucket(ctx->list->bucket, type);
+    return NULL;
 }
 
 static apr_uint64_t serf_aggregate_get_remaining(serf_bucket_t *bucket)
 {
     aggregate_context_t *ctx = bucket->data;
     apr_uint64_t remaining = 0;
-    bucket_list_t *cur;
+    int i;
 
     if (ctx->hold_open) {
         return SERF_LENGTH_UNKNOWN;
     }
 
-    for(cur = ctx->list; cur != NULL; cur = cur->next) {
-        apr_uint64_t bucket_remaining = serf_bucket_get_remaining(cur->bucket);
+    for (i = 0; i < ctx->count; i++) {
+        apr_uint64_t bucket_remaining =
+            serf_bucket_get_remaining(LIST_AT(ctx, i));
 
         if (bucket_remaining == SERF_LENGTH_UNKNOWN) {
             return SERF_LENGTH_UNKNOWN;
@@ -517,27 +671,71 @@ static apr_status_t serf_aggregate_set_config(serf_bucket_t *bucket,
        it along to our wrapped buckets. Store it for all buckets that will be
        be added later. */
     aggregate_context_t *ctx = bucket->data;
-    bucket_list_t *cur;
     apr_status_t err_status = APR_SUCCESS;
+    int i;
 
     ctx->config = config;
 
-    for(cur = ctx->list; cur != NULL; cur = cur->next) {
+    for (i = 0; i < ctx->count; i++) {
         apr_status_t status;
 
-        status = serf_bucket_set_config(cur->bucket, config);
+        status = serf_bucket_set_config(LIST_AT(ctx, i), config);
         if (status)
             err_status = status;
     }
     return err_status;
 }
 
+int serf__bucket_aggregate_movable(serf_bucket_t *bucket)
+{
+    aggregate_context_t *ctx = bucket->data;
+    int i;
+
+    /* A stream is fed by its owner, which doesn't know about the move. */
+    if (ctx->hold_open || !ctx->bucket_owner)
+        return 0;
+
+    for (i = 0; i < ctx->count; i++) {
+        serf_bucket_t *child = LIST_AT(ctx, i);
+
+        if (SERF_BUCKET_IS_SIMPLE(child)) {
+            if (!serf__bucket_simple_movable(child))
+                return 0;
+        }
+        else if (!SERF_BUCKET_IS_AGGREGATE(child)
+                 || !serf__bucket_aggregate_movable(child)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+serf_bucket_t *serf__bucket_aggregate_move(serf_bucket_t *bucket,
+                                           serf_bucket_alloc_t *allocator)
+{
+    aggregate_context_t *ctx = bucket->data;
+    serf_bucket_t *moved = serf_bucket_aggregate_create(allocator);
+
+    while (ctx->count) {
+        serf_bucket_t *child = serf_bucket_move(pop_head(ctx), allocator);
+
+        serf_bucket_aggregate_append(moved, child);
+    }
+    if (ctx->config)
+        serf_bucket_set_config(moved, ctx->config);
+
+    serf_bucket_destroy(bucket);
+
+    return moved;
+}
+
 const serf_bucket_type_t serf_bucket_type_aggregate = {
     "AGGREGATE",
     serf_aggregate_read,
     serf_aggregate_readline,
     serf_aggregate_read_iovec,
-    serf_default_read_for_sendfile,
+    serf_aggregate_read_for_sendfile,
     serf_buckets_are_v2,
     serf_aggregate_peek,
     serf_aggregate_destroy_and_data,
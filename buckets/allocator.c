@@ -27,8 +27,8 @@ typedef struct node_header_t {
     apr_size_t size;
     union {
         struct node_header_t *next;      /* if size == 0 (freed/inactive) */
-        /* no data                          if size == STANDARD_NODE_SIZE */
-        apr_memnode_t *memnode;          /* if size > STANDARD_NODE_SIZE */
+        /* no data                          if size <= MAX_NODE_SIZE */
+        apr_memnode_t *memnode;          /* if size > MAX_NODE_SIZE */
     } u;
 } node_header_t;
 
@@ -40,21 +40,33 @@ typedef struct node_header_t {
  */
 #define SIZEOF_NODE_HEADER_T  APR_ALIGN_DEFAULT(sizeof(node_header_t))
 
+/* Set in the size of the nodes that were allocated while statistics were
+ * enabled, so that freeing those that weren't leaves the statistics alone.
+ * Node sizes are aligned, so the lowest bit is free.
+ */
+#define NODE_COUNTED 1
+
 
-/* STANDARD_NODE_SIZE is manually set to an allocation size that will
- * capture most allocators performed via this API. It must be "large
- * enough" to avoid lots of spillage to allocating directly from the
- * apr_allocator associated with the bucket allocator. The apr_allocator
- * has a minimum size of 8k, which can be expensive if you missed the
- * STANDARD_NODE_SIZE by just a few bytes.
+/* Small allocations are served from a set of power-of-two size classes,
+ * each with its own freelist. All nodes are carved from the same ALLOC_AMT
+ * blocks, so a 200 byte header list or a 1KB string no longer costs a
+ * full 8k memnode from the apr_allocator, and gets recycled when freed.
+ *
+ * The apr_allocator has a minimum size of 8k, so only allocations larger
+ * than MAX_NODE_SIZE (including the node header) will spill to it.
  */
+#define MIN_NODE_SIZE 64
+#define MAX_NODE_SIZE 4096
+
+/* Number of size classes: 64, 128, 256, 512, 1k, 2k and 4k. */
+#define NUM_SIZE_CLASSES 7
+
 /* ### we should define some rules or ways to determine how to derive
- * ### a "good" value for this. probably log some stats on allocs, then
- * ### analyze them for size "misses". then find the balance point between
- * ### wasted space due to min-size allocator, and wasted-space due to
- * ### size-spill to the 8k minimum.
+ * ### a "good" set of size classes. probably log some stats on allocs,
+ * ### then analyze them for size "misses". then find the balance point
+ * ### between wasted space due to rounding up to a class, and wasted
+ * ### space due to size-spill to the 8k minimum.
  */
-#define STANDARD_NODE_SIZE 128
 
 /* When allocating a block of memory from the allocator, we should go for
  * an 8k block, minus the overhead that the allocator needs.
@@ -92,10 +104,14 @@ struct serf_bucket_alloc_t {
 
     apr_uint32_t num_alloc;
 
-    node_header_t *freelist;    /* free STANDARD_NODE_SIZE blocks */
+    /* free nodes, one list per size class */
+    node_header_t *freelist[NUM_SIZE_CLASSES];
     apr_memnode_t *blocks;      /* blocks we allocated for subdividing */
 
     track_state_t *track;
+
+    /* allocation statistics, NULL unless enabled */
+    serf_bucket_alloc_stats_t *stats;
 };
 
 /* ==================================================================== */
@@ -165,35 +181,135 @@ apr_pool_t *serf_bucket_allocator_get_pool(
 }
 
 
+void serf_bucket_allocator_enable_stats(serf_bucket_alloc_t *allocator)
+{
+    if (allocator->stats == NULL) {
+        allocator->stats = apr_pcalloc(allocator->pool,
+                                       sizeof(*allocator->stats));
+    }
+}
+
+apr_status_t serf_bucket_allocator_get_stats(
+    serf_bucket_alloc_stats_t *stats,
+    const serf_bucket_alloc_t *allocator)
+{
+    if (allocator->stats == NULL)
+        return APR_EINVAL;
+
+    *stats = *allocator->stats;
+
+    return APR_SUCCESS;
+}
+
+/* Account for an allocation of REQUESTED bytes, for which NODE_SIZE bytes
+ * were handed out.
+ */
+static void record_alloc(serf_bucket_alloc_stats_t *stats,
+                         apr_size_t requested,
+                         apr_size_t node_size)
+{
+    apr_size_t limit = 16;
+    int idx = 0;
+
+    while (requested > limit && idx < SERF_ALLOC_STATS_HISTOGRAM_SIZE - 1) {
+        limit <<= 1;
+        idx++;
+    }
+    stats->size_histogram[idx]++;
+
+    stats->num_allocs++;
+    stats->live_bytes += node_size;
+    if (stats->live_bytes > stats->peak_bytes)
+        stats->peak_bytes = stats->live_bytes;
+}
+
+/* Returns the index of the smallest size class that can hold SIZE bytes
+ * (node header included). SIZE must not exceed MAX_NODE_SIZE.
+ */
+static int size_to_class(apr_size_t size)
+{
+    apr_size_t class_size = MIN_NODE_SIZE;
+    int idx = 0;
+
+    while (class_size < size) {
+        class_size <<= 1;
+        idx++;
+    }
+
+    return idx;
+}
+
+#define CLASS_TO_SIZE(idx) ((apr_size_t)MIN_NODE_SIZE << (idx))
+
+/* Hand the unused tail of the ACTIVE block to the freelists, largest
+ * classes first, so no memory is wasted when we move on to a new block.
+ */
+static void distribute_remainder(serf_bucket_alloc_t *allocator,
+                                 apr_memnode_t *active)
+{
+    int idx = NUM_SIZE_CLASSES - 1;
+
+    while (idx >= 0) {
+        apr_size_t class_size = CLASS_TO_SIZE(idx);
+        node_header_t *node;
+
+        if (active->first_avail + class_size > active->endp) {
+            idx--;
+            continue;
+        }
+
+        node = (node_header_t *)active->first_avail;
+        active->first_avail += class_size;
+
+        node->u.next = allocator->freelist[idx];
+        allocator->freelist[idx] = node;
+#ifdef DEBUG_DOUBLE_FREE
+        node->size = 0;
+#else
+        node->size = class_size;
+#endif
+    }
+}
+
 void *serf_bucket_mem_alloc(
     serf_bucket_alloc_t *allocator,
     apr_size_t size)
 {
     node_header_t *node;
+    apr_size_t requested = size;
 
     ++allocator->num_alloc;
 
     size += SIZEOF_NODE_HEADER_T;
-    if (size <= STANDARD_NODE_SIZE) {
-        if (allocator->freelist) {
+    if (size <= MAX_NODE_SIZE) {
+        int idx = size_to_class(size);
+        apr_size_t class_size = CLASS_TO_SIZE(idx);
+
+        if (allocator->freelist[idx]) {
             /* just pull a node off our freelist */
-            node = allocator->freelist;
-            allocator->freelist = node->u.next;
+            node = allocator->freelist[idx];
+            allocator->freelist[idx] = node->u.next;
+            if (allocator->stats)
+                allocator->stats->freelist_hits++;
 #ifdef DEBUG_DOUBLE_FREE
             /* When we free an item, we set its size to zero. Thus, when
              * we return it to the caller, we must ensure the size is set
              * properly.
              */
-            node->size = STANDARD_NODE_SIZE;
+            node->size = class_size;
 #endif
         }
         else {
             apr_memnode_t *active = allocator->blocks;
 
             if (active == NULL
-                || active->first_avail + STANDARD_NODE_SIZE >= active->endp) {
+                || active->first_avail + class_size > active->endp) {
                 apr_memnode_t *head = allocator->blocks;
 
+                /* Don't lose what's left of the current block. */
+                if (active)
+                    distribute_remainder(allocator, active);
+
                 /* ran out of room. grab another block. */
                 active = apr_allocator_alloc(allocator->allocator, ALLOC_AMT);
 
@@ -201,19 +317,25 @@ void *serf_bucket_mem_alloc(
                 if (active == NULL)
                     return NULL;
 
+                if (allocator->stats)
+                    allocator->stats->block_grabs++;
+
                 /* link the block into our tracking list */
                 allocator->blocks = active;
                 active->next = head;
             }
 
             node = (node_header_t *)active->first_avail;
-            node->size = STANDARD_NODE_SIZE;
-            active->first_avail += STANDARD_NODE_SIZE;
+            node->size = class_size;
+            active->first_avail += class_size;
         }
     }
     else {
-        apr_memnode_t *memnode = apr_allocator_alloc(allocator->allocator,
-                                                     size);
+        apr_memnode_t *memnode;
+
+        /* Keep the lowest bit of the size free, see NODE_COUNTED. */
+        size = APR_ALIGN_DEFAULT(size);
+        memnode = apr_allocator_alloc(allocator->allocator, size);
 
         if (memnode == NULL)
             return NULL;
@@ -221,6 +343,14 @@ void *serf_bucket_mem_alloc(
         node = (node_header_t *)memnode->first_avail;
         node->u.memnode = memnode;
         node->size = size;
+
+        if (allocator->stats)
+            allocator->stats->direct_allocs++;
+    }
+
+    if (allocator->stats) {
+        record_alloc(allocator->stats, requested, node->size);
+        node->size |= NODE_COUNTED;
     }
 
     return ((char *)node) + SIZEOF_NODE_HEADER_T;
@@ -250,10 +380,20 @@ void serf_bucket_mem_free(
 
     node = (node_header_t *)((char *)block - SIZEOF_NODE_HEADER_T);
 
-    if (node->size == STANDARD_NODE_SIZE) {
-        /* put the node onto our free list */
-        node->u.next = allocator->freelist;
-        allocator->freelist = node;
+    /* Nodes from before the statistics were enabled were never counted
+       as live. */
+    if (node->size & NODE_COUNTED) {
+        node->size &= ~(apr_size_t)NODE_COUNTED;
+        allocator->stats->num_frees++;
+        allocator->stats->live_bytes -= node->size;
+    }
+
+    if (node->size && node->size <= MAX_NODE_SIZE) {
+        int idx = size_to_class(node->size);
+
+        /* put the node onto the free list of its size class */
+        node->u.next = allocator->freelist[idx];
+        allocator->freelist[idx] = node;
 
 #ifdef DEBUG_DOUBLE_FREE
         /* note that this thing was freed. */
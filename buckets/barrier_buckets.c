@@ -63,6 +63,15 @@ static apr_status_t serf_barrier_peek(serf_bucket_t *bucket,
     return serf_bucket_peek(stream, data, len);
 }
 
+static serf_bucket_t *serf_barrier_read_bucket(serf_bucket_t *bucket,
+                                               const serf_bucket_type_t *type)
+{
+    serf_bucket_t *stream = bucket->data;
+
+    /* What is read out of the stream no longer belongs to it. */
+    return serf_bucket_read_bucket(stream, type);
+}
+
 static void serf_barrier_destroy(serf_bucket_t *bucket)
 {
     /* The intent of this bucket is not to let our wrapped buckets be
@@ -100,7 +109,7 @@ const serf_bucket_type_t serf_bucket_type_barrier = {
     serf_buckets_are_v2,
     serf_barrier_peek,
     serf_barrier_destroy,
-    serf_default_read_bucket,
+    serf_barrier_read_bucket,
     serf_barrier_get_remaining,
     serf_barrier_set_config,
 };
@@ -0,0 +1,303 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+#ifdef SERF_HAVE_BROTLI
+
+#include <brotli/decode.h>
+
+/* How much compressed data to ask the stream for at a time. */
+#define BROTLI_INPUT_SIZE (16 * 1024)
+
+typedef struct brotli_context_t {
+    serf_bucket_t *stream;
+    serf_bucket_alloc_t *allocator;
+
+    BrotliDecoderState *state;
+
+    /* The compressed data not yet consumed by the decoder. It belongs to
+       STREAM, so STREAM isn't read again before it is consumed. */
+    const uint8_t *next_in;
+    size_t avail_in;
+
+    /* Decoded data taken from the decoder but not read yet. It lives in
+       the decoder until it is asked for more. */
+    const char *out;
+    apr_size_t out_len;
+
+    /* Set when the decoder can't go on without more compressed data. */
+    int needs_input;
+
+    /* Set once the decoder saw the end of the compressed stream. */
+    int finished;
+
+    serf_config_t *config;
+} brotli_context_t;
+
+/* Have brotli allocate from our allocator. Its blocks are larger than
+   what the allocator keeps on its freelists, so they go straight to the
+   memory nodes. */
+static void *brotli_alloc(void *opaque, size_t size)
+{
+    return serf_bucket_mem_alloc(opaque, size);
+}
+
+static void brotli_free(void *opaque, void *block)
+{
+    if (block)
+        serf_bucket_mem_free(opaque, block);
+}
+
+int serf_bucket_is_brotli_supported(void)
+{
+    return 1;
+}
+
+serf_bucket_t *serf_bucket_brotli_decompress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+    brotli_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->allocator = allocator;
+    ctx->state = BrotliDecoderCreateInstance(brotli_alloc, brotli_free,
+                                             allocator);
+    ctx->next_in = NULL;
+    ctx->avail_in = 0;
+    ctx->out = NULL;
+    ctx->out_len = 0;
+    ctx->needs_input = 1;
+    ctx->finished = 0;
+    ctx->config = NULL;
+
+    return serf_bucket_create(&serf_bucket_type_brotli_decompress, allocator,
+                              ctx);
+}
+
+/* Make sure CTX has decoded data to hand out, unless it returns an error,
+   APR_EAGAIN or APR_EOF. */
+static apr_status_t fill_output(brotli_context_t *ctx)
+{
+    while (!ctx->out_len) {
+        BrotliDecoderResult result;
+        size_t avail_out = 0;
+
+        if (BrotliDecoderHasMoreOutput(ctx->state)) {
+            size_t size = 0; /* As much as there is. */
+
+            ctx->out = (const char *)BrotliDecoderTakeOutput(ctx->state,
+                                                               &size);
+            ctx->out_len = size;
+            continue;
+        }
+
+        if (ctx->finished)
+            return APR_EOF;
+
+        if (ctx->needs_input && !ctx->avail_in) {
+            const char *data;
+            apr_size_t len;
+            apr_status_t status;
+
+            status = serf_bucket_read(ctx->stream, BROTLI_INPUT_SIZE,
+                                      &data, &len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+
+            if (!len) {
+                if (APR_STATUS_IS_EOF(status)) {
+                    serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__,
+                              ctx->config,
+                              "Unexpected EOF on input stream\n");
+                    return SERF_ERROR_DECOMPRESSION_FAILED;
+                }
+                return status;
+            }
+
+            ctx->next_in = (const uint8_t *)data;
+            ctx->avail_in = len;
+        }
+
+        /* Without room for its output, the decoder keeps it to be taken
+           with BrotliDecoderTakeOutput(), which saves us a copy. */
+        result = BrotliDecoderDecompressStream(ctx->state,
+                                               &ctx->avail_in, &ctx->next_in,
+                                               &avail_out, NULL, NULL);
+
+        if (result == BROTLI_DECODER_RESULT_ERROR) {
+            BrotliDecoderErrorCode code;
+
+            code = BrotliDecoderGetErrorCode(ctx->state);
+
+            serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                      "brotli decoding error %d - %s\n",
+                      code, BrotliDecoderErrorString(code));
+            return SERF_ERROR_DECOMPRESSION_FAILED;
+        }
+
+        if (result == BROTLI_DECODER_RESULT_SUCCESS)
+            ctx->finished = 1;
+        ctx->needs_input = (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* The status to return with data handed out by CTX. */
+static apr_status_t output_status(brotli_context_t *ctx)
+{
+    if (!ctx->out_len && ctx->finished
+        && !BrotliDecoderHasMoreOutput(ctx->state))
+        return APR_EOF;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_brotli_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data, apr_size_t *len)
+{
+    brotli_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = fill_output(ctx);
+    if (status) {
+        *len = 0;
+        return status;
+    }
+
+    *data = ctx->out;
+    *len = ctx->out_len;
+    if (requested < *len)
+        *len = requested;
+
+    ctx->out += *len;
+    ctx->out_len -= *len;
+
+    return output_status(ctx);
+}
+
+static apr_status_t serf_brotli_readline(serf_bucket_t *bucket,
+                                         int acceptable, int *found,
+                                         const char **data, apr_size_t *len)
+{
+    brotli_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = fill_output(ctx);
+    if (status) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        return status;
+    }
+
+    *data = ctx->out;
+    *len = ctx->out_len;
+    serf_util_readline(&ctx->out, &ctx->out_len, acceptable, found);
+    *len -= ctx->out_len;
+
+    return output_status(ctx);
+}
+
+static apr_status_t serf_brotli_peek(serf_bucket_t *bucket,
+                                     const char **data,
+                                     apr_size_t *len)
+{
+    brotli_context_t *ctx = bucket->data;
+
+    /* Only what was decoded already, as decoding may block. */
+    *data = ctx->out;
+    *len = ctx->out_len;
+
+    return output_status(ctx);
+}
+
+static void serf_brotli_destroy_and_data(serf_bucket_t *bucket)
+{
+    brotli_context_t *ctx = bucket->data;
+
+    if (ctx->state)
+        BrotliDecoderDestroyInstance(ctx->state);
+    serf_bucket_destroy(ctx->stream);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_brotli_set_config(serf_bucket_t *bucket,
+                                           serf_config_t *config)
+{
+    brotli_context_t *ctx = bucket->data;
+
+    ctx->config = config;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_brotli_decompress = {
+    "BROTLI-DECOMPRESS",
+    serf_brotli_read,
+    serf_brotli_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_brotli_peek,
+    serf_brotli_destroy_and_data,
+    serf_default_read_bucket,
+    NULL,
+    serf_brotli_set_config,
+};
+
+#else /* SERF_HAVE_BROTLI */
+
+int serf_bucket_is_brotli_supported(void)
+{
+    return 0;
+}
+
+serf_bucket_t *serf_bucket_brotli_decompress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+    return NULL;
+}
+
+static apr_status_t serf_brotli_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data, apr_size_t *len)
+{
+    *len = 0;
+    return APR_ENOTIMPL;
+}
+
+const serf_bucket_type_t serf_bucket_type_brotli_decompress = {
+    "BROTLI-DECOMPRESS",
+    serf_brotli_read,
+    NULL,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    NULL,
+    serf_default_destroy_and_data,
+    serf_default_read_bucket,
+    NULL,
+    serf_default_ignore_config,
+};
+
+#endif /* SERF_HAVE_BROTLI */
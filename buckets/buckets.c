@@ -17,6 +17,7 @@
 #include <apr_want.h>
 
 #include <apr_pools.h>
+#include <apr_strings.h>
 
 #include "serf.h"
 #include "serf_bucket_util.h"
@@ -263,12 +264,17 @@ void serf_util_readline(
     want_crlf = acceptable & SERF_NEWLINE_CRLF;
     want_lf = acceptable & SERF_NEWLINE_LF;
 
-    if (want_cr || want_crlf) {
-        cr = memchr(start, '\r', *len);
-    }
+    /* Look for the LF first: it terminates the line in all cases we care
+     * about, so there is no need to look for a CR beyond it. This way each
+     * byte of the line is scanned once per character, instead of searching
+     * the whole buffer for a CR that only shows up lines later.
+     */
     if (want_lf) {
         lf = memchr(start, '\n', *len);
     }
+    if (want_cr || want_crlf) {
+        cr = memchr(start, '\r', lf ? (apr_size_t)(lf - start) : *len);
+    }
 
     if (cr != NULL) {
         if (lf != NULL) {
@@ -329,11 +335,143 @@ void serf_databuf_init(serf_databuf_t *databuf)
     databuf->status = APR_SUCCESS;
 }
 
+/* The reader of the databufs set up with serf__databuf_init(). It marks
+   them for common_databuf_prep(), which reads into the buffer of the
+   serf__databuf_t instead of the one of the public struct. */
+static apr_status_t private_databuf_read(void *baton,
+                                         apr_size_t bufsize,
+                                         char *buf,
+                                         apr_size_t *len)
+{
+    serf__databuf_t *pdb = baton;
+
+    return pdb->read(pdb->read_baton, bufsize, buf, len);
+}
+
+/* The serf__databuf_t that DATABUF is part of, or NULL. */
+static serf__databuf_t *get_private_databuf(serf_databuf_t *databuf)
+{
+    if (databuf->read != private_databuf_read)
+        return NULL;
+    return databuf->read_baton;
+}
+
+void serf__databuf_init(serf__databuf_t *pdb,
+                        serf_databuf_reader_t read,
+                        void *read_baton)
+{
+    serf_databuf_init(&pdb->databuf);
+    pdb->databuf.read = private_databuf_read;
+    pdb->databuf.read_baton = pdb;
+
+    pdb->read = read;
+    pdb->read_baton = read_baton;
+    pdb->buffer = pdb->databuf.buf;
+    pdb->bufsize = sizeof(pdb->databuf.buf);
+    pdb->allocator = NULL;
+    pdb->shared = NULL;
+}
+
+void serf__databuf_set_bufsize(serf__databuf_t *pdb,
+                               apr_size_t bufsize,
+                               serf_bucket_alloc_t *allocator)
+{
+    serf_databuf_t *databuf = &pdb->databuf;
+    char *buffer;
+
+    /* Keep what hasn't been read yet. */
+    if (bufsize < databuf->remaining)
+        bufsize = databuf->remaining;
+
+    if (bufsize < sizeof(databuf->buf))
+        bufsize = sizeof(databuf->buf);
+
+    if (pdb->shared) {
+        serf_shared_buffer_t *shared;
+
+        /* The data was handed over before, so serf_databuf_read_bucket()
+           expects the reads to go into a shared buffer. Swap in one of the
+           new size, or keep the old one if that fails. */
+        if (bufsize == pdb->bufsize)
+            return;
+        shared = serf__shared_buffer_alloc(bufsize);
+        if (!shared)
+            return;
+
+        buffer = serf__shared_buffer_data(shared);
+        if (databuf->remaining)
+            memcpy(buffer, databuf->current, databuf->remaining);
+        serf_shared_buffer_release(pdb->shared);
+
+        pdb->shared = shared;
+        pdb->buffer = buffer;
+        pdb->bufsize = bufsize;
+        databuf->current = buffer;
+        return;
+    }
+
+    if (bufsize == sizeof(databuf->buf)) {
+        buffer = databuf->buf;
+    }
+    else {
+        buffer = serf_bucket_mem_alloc(allocator, bufsize);
+    }
+
+    if (buffer == pdb->buffer)
+        return;
+
+    if (databuf->remaining)
+        memmove(buffer, databuf->current, databuf->remaining);
+    databuf->current = buffer;
+
+    serf__databuf_cleanup(pdb);
+
+    pdb->buffer = buffer;
+    pdb->bufsize = bufsize;
+    pdb->allocator = buffer == databuf->buf ? NULL : allocator;
+}
+
+void serf__databuf_cleanup(serf__databuf_t *pdb)
+{
+    if (pdb->allocator) {
+        serf_bucket_mem_free(pdb->allocator, pdb->buffer);
+        pdb->allocator = NULL;
+    }
+    if (pdb->shared) {
+        serf_shared_buffer_release(pdb->shared);
+        pdb->shared = NULL;
+    }
+    pdb->buffer = pdb->databuf.buf;
+    pdb->bufsize = sizeof(pdb->databuf.buf);
+}
+
+void serf__databuf_configure(serf__databuf_t *pdb,
+                             serf_config_t *config,
+                             serf_bucket_alloc_t *allocator)
+{
+    const char *value;
+    apr_int64_t bufsize;
+
+    /* Buckets not (yet) on a connection have no config. */
+    if (!config)
+        return;
+
+    if (serf_config_get_string(config, SERF_CONFIG_CONN_READ_BUFSIZE,
+                               &value) || !value)
+        return;
+
+    bufsize = apr_atoi64(value);
+    if (bufsize > 0)
+        serf__databuf_set_bufsize(pdb, (apr_size_t)bufsize, allocator);
+}
+
 /* Ensure the buffer is prepared for reading. Will return APR_SUCCESS,
  * APR_EOF, or some failure code. *len is only set for EOF. */
 static apr_status_t common_databuf_prep(serf_databuf_t *databuf,
                                         apr_size_t *len)
 {
+    serf__databuf_t *pdb;
+    char *buffer;
     apr_size_t readlen;
     apr_status_t status;
 
@@ -349,13 +487,21 @@ static apr_status_t common_databuf_prep(serf_databuf_t *databuf,
     }
 
     /* refill the buffer */
-    status = (*databuf->read)(databuf->read_baton, sizeof(databuf->buf),
-                              databuf->buf, &readlen);
+    pdb = get_private_databuf(databuf);
+    if (pdb) {
+        buffer = pdb->buffer;
+        status = pdb->read(pdb->read_baton, pdb->bufsize, buffer, &readlen);
+    }
+    else {
+        buffer = databuf->buf;
+        status = (*databuf->read)(databuf->read_baton, sizeof(databuf->buf),
+                                  buffer, &readlen);
+    }
     if (SERF_BUCKET_READ_ERROR(status)) {
         return status;
     }
 
-    databuf->current = databuf->buf;
+    databuf->current = buffer;
     databuf->remaining = readlen;
     databuf->status = status;
 
@@ -445,6 +591,105 @@ apr_status_t serf_databuf_peek(
 }
 
 
+
+serf_bucket_t *serf_databuf_read_bucket(
+    serf_databuf_t *databuf,
+    const serf_bucket_type_t *type,
+    serf_bucket_alloc_t *allocator)
+{
+    serf__databuf_t *pdb = get_private_databuf(databuf);
+    serf_shared_buffer_t *next;
+    serf_bucket_t *bucket;
+
+    /* Only the databufs of serf's own buckets can switch to reading into
+       shared buffers. */
+    if (!pdb || type != &serf_bucket_type_simple || !databuf->remaining)
+        return NULL;
+
+    if (!pdb->shared) {
+        apr_size_t bufsize = pdb->bufsize;
+        serf_shared_buffer_t *shared = serf__shared_buffer_alloc(bufsize);
+
+        if (!shared)
+            return NULL;
+
+        /* Copy the data into a shared buffer this once; from now on
+           the reads go into shared buffers, which are handed over as
+           they are. */
+        memcpy(serf__shared_buffer_data(shared), databuf->current,
+               databuf->remaining);
+        serf__databuf_cleanup(pdb);
+        pdb->shared = shared;
+        pdb->buffer = serf__shared_buffer_data(shared);
+        pdb->bufsize = bufsize;
+        databuf->current = pdb->buffer;
+    }
+
+    next = serf__shared_buffer_alloc(pdb->bufsize);
+    if (!next)
+        return NULL;
+
+    bucket = serf__bucket_shared_span_create(pdb->shared,
+                                             databuf->current,
+                                             databuf->remaining, allocator);
+
+    pdb->shared = next;
+    pdb->buffer = serf__shared_buffer_data(next);
+    databuf->current = pdb->buffer;
+    databuf->remaining = 0;
+
+    return bucket;
+}
+
+serf_bucket_t *serf__bucket_read_bucket_limited(serf_bucket_t *stream,
+                                                const serf_bucket_type_t *type,
+                                                apr_uint64_t *remaining)
+{
+    serf_bucket_t *found;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    /* Only simple buckets tell exactly how much they hold. */
+    if (type != &serf_bucket_type_simple || !*remaining)
+        return NULL;
+
+    /* What is spliced off is what STREAM has buffered, it must not run
+       into whatever follows the body. */
+    status = serf_bucket_peek(stream, &data, &len);
+    if (SERF_BUCKET_READ_ERROR(status) || !len || len > *remaining)
+        return NULL;
+
+    found = serf_bucket_read_bucket(stream, type);
+    if (found)
+        *remaining -= serf_bucket_get_remaining(found);
+
+    return found;
+}
+
+serf_bucket_t *serf_bucket_move(
+    serf_bucket_t *bucket,
+    serf_bucket_alloc_t *allocator)
+{
+    if (bucket->allocator == allocator)
+        return bucket;
+
+    if (SERF_BUCKET_IS_SIMPLE(bucket)) {
+        if (!serf__bucket_simple_movable(bucket))
+            return NULL;
+        return serf__bucket_simple_move(bucket, allocator);
+    }
+
+    if (SERF_BUCKET_IS_AGGREGATE(bucket)) {
+        if (!serf__bucket_aggregate_movable(bucket))
+            return NULL;
+        return serf__bucket_aggregate_move(bucket, allocator);
+    }
+
+    return NULL;
+}
+
+
 /* ==================================================================== */
 
 
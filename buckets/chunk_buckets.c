@@ -32,7 +32,12 @@ typedef struct chunk_context_t {
     serf_bucket_t *chunk;
     serf_bucket_t *stream;
 
-    char chunk_hdr[20];
+    /* The CRLF that ends the data of a chunk is sent along with the header
+       of the next chunk, or with the last-chunk, to save an iovec. */
+    int crlf_pending;
+
+    /* CRLF, the chunk length in hex and CRLF */
+    char chunk_hdr[24];
 
     serf_config_t *config;
 } chunk_context_t;
@@ -47,6 +52,7 @@ serf_bucket_t *serf_bucket_chunk_create(
     ctx->state = STATE_FETCH;
     ctx->chunk = serf_bucket_aggregate_create(allocator);
     ctx->stream = stream;
+    ctx->crlf_pending = 0;
     ctx->config = NULL;
 
     return serf_bucket_create(&serf_bucket_type_chunk, allocator, ctx);
@@ -54,13 +60,41 @@ serf_bucket_t *serf_bucket_chunk_create(
 
 #define CRLF "\r\n"
 
+/* Format the header of a chunk of LEN bytes in CTX->chunk_hdr, after the
+   end of the previous chunk if that wasn't sent yet. Returns its length. */
+static apr_size_t format_chunk_hdr(chunk_context_t *ctx, apr_uint64_t len)
+{
+    apr_size_t hdr_len;
+
+    hdr_len = apr_snprintf(ctx->chunk_hdr, sizeof(ctx->chunk_hdr),
+                           "%s%" APR_UINT64_T_HEX_FMT CRLF,
+                           ctx->crlf_pending ? CRLF : "", len);
+    ctx->crlf_pending = 1;
+
+    return hdr_len;
+}
+
+/* Set VEC to the last-chunk, which ends the body. */
+static void last_chunk(chunk_context_t *ctx, struct iovec *vec)
+{
+    if (ctx->crlf_pending) {
+        vec->iov_base = CRLF "0" CRLF CRLF;
+        vec->iov_len = sizeof(CRLF "0" CRLF CRLF) - 1;
+    }
+    else {
+        vec->iov_base = "0" CRLF CRLF;
+        vec->iov_len = sizeof("0" CRLF CRLF) - 1;
+    }
+    ctx->crlf_pending = 0;
+    ctx->state = STATE_EOF;
+}
+
 static apr_status_t create_chunk(serf_bucket_t *bucket)
 {
     chunk_context_t *ctx = bucket->data;
-    serf_bucket_t *simple_bkt;
-    apr_size_t chunk_len;
     apr_size_t stream_len;
-    struct iovec vecs[66]; /* 64 + chunk trailer + EOF trailer = 66 */
+    struct iovec vecs[66]; /* chunk header + 64 + EOF trailer = 66 */
+    struct iovec *first;
     int vecs_read;
     int i;
 
@@ -68,9 +102,11 @@ static apr_status_t create_chunk(serf_bucket_t *bucket)
         return APR_SUCCESS;
     }
 
+    /* Read the data behind the slot of the chunk header, which is only
+       known once we know the length. */
     ctx->last_status =
         serf_bucket_read_iovec(ctx->stream, SERF_READ_ALL_AVAIL,
-                               64, vecs, &vecs_read);
+                               64, vecs + 1, &vecs_read);
 
     if (SERF_BUCKET_READ_ERROR(ctx->last_status)) {
         /* Uh-oh. */
@@ -79,50 +115,39 @@ static apr_status_t create_chunk(serf_bucket_t *bucket)
 
     /* Count the length of the data we read. */
     stream_len = 0;
-    for (i = 0; i < vecs_read; i++) {
+    for (i = 1; i <= vecs_read; i++) {
         stream_len += vecs[i].iov_len;
     }
 
-    /* assert: stream_len in hex < sizeof(ctx->chunk_hdr) */
-
     /* Inserting a 0 byte chunk indicates a terminator, which already happens
      * during the EOF handler below.  Adding another one here will cause the
      * EOF chunk to be interpreted by the server as a new request.  So,
      * we'll only do this if we have something to write.
      */
     if (stream_len) {
-        /* Build the chunk header. */
-        chunk_len = apr_snprintf(ctx->chunk_hdr, sizeof(ctx->chunk_hdr),
-                                 "%" APR_UINT64_T_HEX_FMT CRLF,
-                                 (apr_uint64_t)stream_len);
-
-        /* Create a copy of the chunk header so we can have multiple chunks
-         * in the pipeline at the same time.
-         */
-        simple_bkt = serf_bucket_simple_copy_create(ctx->chunk_hdr, chunk_len,
-                                                    bucket->allocator);
-        serf_bucket_set_config(simple_bkt, ctx->config);
-        serf_bucket_aggregate_append(ctx->chunk, simple_bkt);
-
-        /* Insert the chunk footer. */
-        vecs[vecs_read].iov_base = CRLF;
-        vecs[vecs_read++].iov_len = sizeof(CRLF) - 1;
+        /* The header doesn't need a copy: we only get here again after
+           all of the chunk was read. */
+        vecs[0].iov_base = ctx->chunk_hdr;
+        vecs[0].iov_len = format_chunk_hdr(ctx, stream_len);
+        first = vecs;
+        vecs_read++;
+    }
+    else {
+        first = vecs + 1;
+        vecs_read = 0;
     }
 
     /* We've reached the end of the line for the stream. */
     if (APR_STATUS_IS_EOF(ctx->last_status)) {
-        /* Insert the chunk footer. */
-        vecs[vecs_read].iov_base = "0" CRLF CRLF;
-        vecs[vecs_read++].iov_len = sizeof("0" CRLF CRLF) - 1;
-
-        ctx->state = STATE_EOF;
+        last_chunk(ctx, &first[vecs_read++]);
     }
     else {
         /* Okay, we can return data.  */
         ctx->state = STATE_CHUNK;
     }
 
-    serf_bucket_aggregate_append_iovec(ctx->chunk, vecs, vecs_read);
+    if (vecs_read)
+        serf_bucket_aggregate_append_iovec(ctx->chunk, first, vecs_read);
 
     return APR_SUCCESS;
 }
@@ -200,6 +225,69 @@ static apr_status_t serf_chunk_read_iovec(serf_bucket_t *bucket,
     return status;
 }
 
+static apr_status_t serf_chunk_read_for_sendfile(serf_bucket_t *bucket,
+                                                 apr_size_t requested,
+                                                 apr_hdtr_t *hdtr,
+                                                 apr_file_t **file,
+                                                 apr_off_t *offset,
+                                                 apr_size_t *len)
+{
+    chunk_context_t *ctx = bucket->data;
+    int vecs_size = hdtr->numheaders;
+    apr_hdtr_t stream_hdtr;
+    apr_uint64_t chunk_len;
+    apr_status_t status;
+    int i;
+
+    /* What we already have goes the usual way. We need room for a chunk
+       header in front of the data and the last-chunk behind it. */
+    if (ctx->state != STATE_FETCH || vecs_size < 3) {
+        return serf_default_read_for_sendfile(bucket, requested, hdtr,
+                                              file, offset, len);
+    }
+
+    stream_hdtr.headers = hdtr->headers + 1;
+    stream_hdtr.numheaders = vecs_size - 2;
+    stream_hdtr.trailers = NULL;
+    stream_hdtr.numtrailers = 0;
+
+    status = serf_bucket_read_for_sendfile(ctx->stream, requested,
+                                           &stream_hdtr, file, offset, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    /* The chunk covers all of it, the file included, so that the file can
+       be sent as is. */
+    chunk_len = *file ? *len : 0;
+    for (i = 0; i < stream_hdtr.numheaders; i++)
+        chunk_len += stream_hdtr.headers[i].iov_len;
+
+    hdtr->numheaders = 0;
+    hdtr->numtrailers = 0;
+    if (chunk_len) {
+        hdtr->headers[0].iov_base = ctx->chunk_hdr;
+        hdtr->headers[0].iov_len = format_chunk_hdr(ctx, chunk_len);
+        hdtr->numheaders = stream_hdtr.numheaders + 1;
+    }
+
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+
+    if (*file) {
+        struct iovec vec;
+
+        /* Nothing can follow the file, the last-chunk is sent next time. */
+        last_chunk(ctx, &vec);
+        serf_bucket_aggregate_append_iovec(ctx->chunk, &vec, 1);
+
+        return APR_SUCCESS;
+    }
+
+    last_chunk(ctx, &hdtr->headers[hdtr->numheaders++]);
+
+    return APR_EOF;
+}
+
 static apr_status_t serf_chunk_peek(serf_bucket_t *bucket,
                                      const char **data,
                                      apr_size_t *len)
@@ -245,7 +333,7 @@ const serf_bucket_type_t serf_bucket_type_chunk = {
     serf_chunk_read,
     serf_chunk_readline,
     serf_chunk_read_iovec,
-    serf_default_read_for_sendfile,
+    serf_chunk_read_for_sendfile,
     serf_buckets_are_v2,
     serf_chunk_peek,
     serf_chunk_destroy,
@@ -0,0 +1,395 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <zlib.h>
+
+#ifdef SERF_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+/* The compressed data is handed out straight from a buffer this large. */
+#define COMPRESS_BUFFER_SIZE (16 * 1024)
+
+/* The most data passed to the compressor at a time. */
+#define COMPRESS_INPUT_SIZE (64 * 1024)
+
+static const int COMPRESS_MEMLEVEL = 8;
+
+typedef enum compress_mode_t {
+    MODE_CONTINUE,              /* compress what we have */
+    MODE_FLUSH,                 /* and emit all of it */
+    MODE_FINISH                 /* and end the compressed stream */
+} compress_mode_t;
+
+typedef struct compress_context_t {
+    serf_bucket_t *stream;
+
+    int format;                 /* One of SERF_COMPRESS_* */
+    int level;
+    int initialized;
+
+    z_stream zstream;
+#ifdef SERF_HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+#endif
+
+    /* The data read from STREAM that wasn't compressed yet. It belongs to
+       STREAM, so STREAM isn't read again before it is consumed. */
+    const char *in_data;
+    apr_size_t in_len;
+
+    /* The compressed data. OUT points to the part not read yet. */
+    char *buffer;
+    const char *out;
+    apr_size_t out_len;
+
+    int hit_eof;                /* STREAM returned APR_EOF */
+    int unflushed;              /* Input went in since the last flush */
+    int flushing;               /* Everything so far should be emitted */
+    int done;                   /* The compressed stream is complete */
+
+    serf_config_t *config;
+} compress_context_t;
+
+serf_bucket_t *serf_bucket_compress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator,
+    int format,
+    int level)
+{
+    compress_context_t *ctx;
+
+    switch (format) {
+        case SERF_COMPRESS_GZIP:
+        case SERF_COMPRESS_DEFLATE:
+            break;
+#ifdef SERF_HAVE_ZSTD
+        case SERF_COMPRESS_ZSTD:
+            break;
+#endif
+        default:
+            return NULL;
+    }
+
+    ctx = serf_bucket_mem_calloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->format = format;
+    ctx->level = level;
+
+    return serf_bucket_create(&serf_bucket_type_compress, allocator, ctx);
+}
+
+static apr_status_t init_compressor(serf_bucket_t *bucket)
+{
+    compress_context_t *ctx = bucket->data;
+
+#ifdef SERF_HAVE_ZSTD
+    if (ctx->format == SERF_COMPRESS_ZSTD) {
+        size_t ret;
+
+        ctx->cctx = ZSTD_createCCtx();
+        if (!ctx->cctx)
+            return APR_ENOMEM;
+
+        /* zstd picks its default level on 0 */
+        ret = ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
+                                     ctx->level < 0 ? 0 : ctx->level);
+        if (ZSTD_isError(ret)) {
+            serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                      "zstd init error %s\n", ZSTD_getErrorName(ret));
+            return SERF_ERROR_COMPRESSION_FAILED;
+        }
+    }
+    else
+#endif
+    {
+        int zRC;
+
+        /* zlib adds the gzip header and trailer itself for window sizes
+           above 15; 'deflate' is the zlib format of RFC 1950. */
+        zRC = deflateInit2(&ctx->zstream,
+                           ctx->level < 0 ? Z_DEFAULT_COMPRESSION
+                                          : ctx->level,
+                           Z_DEFLATED,
+                           ctx->format == SERF_COMPRESS_GZIP ? 15 + 16 : 15,
+                           COMPRESS_MEMLEVEL, Z_DEFAULT_STRATEGY);
+        if (zRC != Z_OK) {
+            serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                      "deflateInit2 error %d - %s\n",
+                      zRC, ctx->zstream.msg);
+            return SERF_ERROR_COMPRESSION_FAILED;
+        }
+    }
+
+    ctx->buffer = serf_bucket_mem_alloc(bucket->allocator,
+                                        COMPRESS_BUFFER_SIZE);
+    ctx->initialized = 1;
+
+    return APR_SUCCESS;
+}
+
+/* Run the compressor once in MODE, filling the output buffer. Sets
+   CTX->FLUSHING and CTX->DONE when MODE is completed. */
+static apr_status_t compress_some(compress_context_t *ctx,
+                                  compress_mode_t mode)
+{
+    apr_size_t consumed;
+    apr_size_t produced;
+    int completed;
+
+#ifdef SERF_HAVE_ZSTD
+    if (ctx->format == SERF_COMPRESS_ZSTD) {
+        ZSTD_inBuffer in;
+        ZSTD_outBuffer out;
+        size_t ret;
+
+        in.src = ctx->in_data;
+        in.size = ctx->in_len;
+        in.pos = 0;
+        out.dst = ctx->buffer;
+        out.size = COMPRESS_BUFFER_SIZE;
+        out.pos = 0;
+
+        ret = ZSTD_compressStream2(ctx->cctx, &out, &in,
+                                   mode == MODE_FINISH ? ZSTD_e_end
+                                   : mode == MODE_FLUSH ? ZSTD_e_flush
+                                   : ZSTD_e_continue);
+        if (ZSTD_isError(ret)) {
+            serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                      "zstd compression error %s\n", ZSTD_getErrorName(ret));
+            return SERF_ERROR_COMPRESSION_FAILED;
+        }
+
+        consumed = in.pos;
+        produced = out.pos;
+        /* For flushing and ending, 0 means nothing is left to emit. */
+        completed = (ret == 0);
+    }
+    else
+#endif
+    {
+        apr_size_t in_len = ctx->in_len;
+        int zRC;
+
+        if (in_len > COMPRESS_INPUT_SIZE)
+            in_len = COMPRESS_INPUT_SIZE;
+
+        ctx->zstream.next_in = (Bytef *)ctx->in_data;  /* Casting away const */
+        ctx->zstream.avail_in = (uInt)in_len;
+        ctx->zstream.next_out = (Bytef *)ctx->buffer;
+        ctx->zstream.avail_out = COMPRESS_BUFFER_SIZE;
+
+        zRC = deflate(&ctx->zstream,
+                      mode == MODE_FINISH ? Z_FINISH
+                      : mode == MODE_FLUSH ? Z_SYNC_FLUSH
+                      : Z_NO_FLUSH);
+
+        /* Z_BUF_ERROR only says that no progress was possible. */
+        if (zRC != Z_OK && zRC != Z_STREAM_END && zRC != Z_BUF_ERROR) {
+            serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                      "deflate error %d - %s\n", zRC, ctx->zstream.msg);
+            return SERF_ERROR_COMPRESSION_FAILED;
+        }
+
+        consumed = in_len - ctx->zstream.avail_in;
+        produced = COMPRESS_BUFFER_SIZE - ctx->zstream.avail_out;
+        /* A flush is complete when zlib had room to spare. */
+        completed = (mode == MODE_FINISH) ? (zRC == Z_STREAM_END)
+                                          : (ctx->zstream.avail_out != 0);
+    }
+
+    ctx->in_data += consumed;
+    ctx->in_len -= consumed;
+    ctx->out = ctx->buffer;
+    ctx->out_len = produced;
+
+    if (consumed)
+        ctx->unflushed = 1;
+
+    if (completed && mode == MODE_FLUSH) {
+        ctx->flushing = 0;
+        ctx->unflushed = 0;
+    }
+    else if (completed && mode == MODE_FINISH) {
+        ctx->done = 1;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Make sure CTX has compressed data to hand out, unless it returns an
+   error, APR_EAGAIN or APR_EOF. */
+static apr_status_t fill_output(serf_bucket_t *bucket)
+{
+    compress_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (!ctx->initialized) {
+        status = init_compressor(bucket);
+        if (status)
+            return status;
+    }
+
+    while (!ctx->out_len) {
+        compress_mode_t mode;
+
+        if (ctx->done)
+            return APR_EOF;
+
+        if (!ctx->in_len && !ctx->hit_eof && !ctx->flushing) {
+            status = serf_bucket_read(ctx->stream, COMPRESS_INPUT_SIZE,
+                                      &ctx->in_data, &ctx->in_len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+
+            if (APR_STATUS_IS_EOF(status))
+                ctx->hit_eof = 1;
+            else if (!ctx->in_len) {
+                /* The body stalls. Emit what the compressor holds back,
+                   so that the other side sees it without waiting for
+                   more data. */
+                if (!ctx->unflushed)
+                    return status;
+                ctx->flushing = 1;
+            }
+        }
+
+        if (ctx->hit_eof && !ctx->in_len)
+            mode = MODE_FINISH;
+        else if (ctx->flushing)
+            mode = MODE_FLUSH;
+        else
+            mode = MODE_CONTINUE;
+
+        status = compress_some(ctx, mode);
+        if (status)
+            return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_compress_read(serf_bucket_t *bucket,
+                                       apr_size_t requested,
+                                       const char **data, apr_size_t *len)
+{
+    compress_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = fill_output(bucket);
+    if (status) {
+        *len = 0;
+        return status;
+    }
+
+    *data = ctx->out;
+    *len = ctx->out_len;
+    if (requested < *len)
+        *len = requested;
+
+    ctx->out += *len;
+    ctx->out_len -= *len;
+
+    return (ctx->done && !ctx->out_len) ? APR_EOF : APR_SUCCESS;
+}
+
+static apr_status_t serf_compress_readline(serf_bucket_t *bucket,
+                                           int acceptable, int *found,
+                                           const char **data,
+                                           apr_size_t *len)
+{
+    compress_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = fill_output(bucket);
+    if (status) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        return status;
+    }
+
+    *data = ctx->out;
+    *len = ctx->out_len;
+    serf_util_readline(&ctx->out, &ctx->out_len, acceptable, found);
+    *len -= ctx->out_len;
+
+    return (ctx->done && !ctx->out_len) ? APR_EOF : APR_SUCCESS;
+}
+
+static apr_status_t serf_compress_peek(serf_bucket_t *bucket,
+                                       const char **data,
+                                       apr_size_t *len)
+{
+    compress_context_t *ctx = bucket->data;
+
+    /* Only what was compressed already, as reading the body may block. */
+    *data = ctx->out;
+    *len = ctx->out_len;
+
+    return (ctx->done && !ctx->out_len) ? APR_EOF : APR_SUCCESS;
+}
+
+static apr_uint64_t serf_compress_get_remaining(serf_bucket_t *bucket)
+{
+    /* The compressed length is only known once we're done. */
+    return SERF_LENGTH_UNKNOWN;
+}
+
+static void serf_compress_destroy_and_data(serf_bucket_t *bucket)
+{
+    compress_context_t *ctx = bucket->data;
+
+    if (ctx->initialized) {
+#ifdef SERF_HAVE_ZSTD
+        if (ctx->format == SERF_COMPRESS_ZSTD)
+            ZSTD_freeCCtx(ctx->cctx);
+        else
+#endif
+            deflateEnd(&ctx->zstream);
+
+        serf_bucket_mem_free(bucket->allocator, ctx->buffer);
+    }
+    serf_bucket_destroy(ctx->stream);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_compress_set_config(serf_bucket_t *bucket,
+                                             serf_config_t *config)
+{
+    compress_context_t *ctx = bucket->data;
+
+    ctx->config = config;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_compress = {
+    "COMPRESS",
+    serf_compress_read,
+    serf_compress_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_compress_peek,
+    serf_compress_destroy_and_data,
+    serf_default_read_bucket,
+    serf_compress_get_remaining,
+    serf_compress_set_config,
+};
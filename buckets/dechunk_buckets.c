@@ -13,10 +13,13 @@
  * limitations under the License.
  */
 
+#define APR_WANT_MEMFUNC
+#include <apr_want.h>
 #include <apr_strings.h>
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 typedef struct dechunk_context_t {
     serf_bucket_t *stream;
@@ -60,12 +63,13 @@ static void serf_dechunk_destroy_and_data(serf_bucket_t *bucket)
     serf_default_destroy_and_data(bucket);
 }
 
-static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
-                                      apr_size_t requested,
-                                      const char **data, apr_size_t *len)
+/* Read the chunk framing up to the data of the next chunk. Returns
+   APR_SUCCESS when CTX is at chunk data, APR_EOF after the last-chunk. */
+static apr_status_t fetch_chunk_start(dechunk_context_t *ctx)
 {
-    dechunk_context_t *ctx = bucket->data;
     apr_status_t status;
+    const char *data;
+    apr_size_t len;
 
     while (1) {
         switch (ctx->state) {
@@ -107,51 +111,22 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
             }
             /* assert: status != 0 */
 
-            /* Note that we didn't actually read anything, so our callers
-             * don't get confused.
-             */
-            *len = 0;
-
             return status;
 
         case STATE_CHUNK:
-
-            if (requested > ctx->body_left) {
-                requested = ctx->body_left;
-            }
-
-            /* Delegate to the stream bucket to do the read. */
-            status = serf_bucket_read(ctx->stream, requested, data, len);
-            if (SERF_BUCKET_READ_ERROR(status))
-                return status;
-
-            /* Some data was read, so decrement the amount left and see
-             * if we're done reading this chunk.
-             */
-            ctx->body_left -= *len;
-            if (!ctx->body_left) {
-                ctx->state = STATE_TERM;
-                ctx->body_left = 2;     /* CRLF */
-            }
-
-            /* We need more data but there is no more available. */
-            if (ctx->body_left && APR_STATUS_IS_EOF(status)) {
-                return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
-            }
-
-            /* Return the data we just read. */
-            return status;
+            return APR_SUCCESS;
 
         case STATE_TERM:
             /* Delegate to the stream bucket to do the read. */
-            status = serf_bucket_read(ctx->stream, ctx->body_left, data, len);
+            status = serf_bucket_read(ctx->stream, (apr_size_t)ctx->body_left,
+                                      &data, &len);
             if (SERF_BUCKET_READ_ERROR(status))
                 return status;
 
             /* Some data was read, so decrement the amount left and see
              * if we're done reading the chunk terminator.
              */
-            ctx->body_left -= *len;
+            ctx->body_left -= len;
 
             /* We need more data but there is no more available. */
             if (ctx->body_left && APR_STATUS_IS_EOF(status))
@@ -161,9 +136,6 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
                 ctx->state = STATE_SIZE;
             }
 
-            /* Don't return the CR of CRLF to the caller! */
-            *len = 0;
-
             if (status)
                 return status;
 
@@ -171,7 +143,6 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
 
         case STATE_DONE:
             /* Just keep returning EOF */
-            *len = 0;
             return APR_EOF;
 
         default:
@@ -182,6 +153,271 @@ static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
     /* NOTREACHED */
 }
 
+static apr_status_t serf_dechunk_read(serf_bucket_t *bucket,
+                                      apr_size_t requested,
+                                      const char **data, apr_size_t *len)
+{
+    dechunk_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = fetch_chunk_start(ctx);
+    if (status) {
+        /* Note that we didn't actually read anything, so our callers
+         * don't get confused.
+         */
+        *len = 0;
+        return status;
+    }
+
+    if (requested > ctx->body_left) {
+        requested = (apr_size_t)ctx->body_left;
+    }
+
+    /* Delegate to the stream bucket to do the read. */
+    status = serf_bucket_read(ctx->stream, requested, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    /* Some data was read, so decrement the amount left and see
+     * if we're done reading this chunk.
+     */
+    ctx->body_left -= *len;
+    if (!ctx->body_left) {
+        ctx->state = STATE_TERM;
+        ctx->body_left = 2;     /* CRLF */
+    }
+
+    /* We need more data but there is no more available. */
+    if (ctx->body_left && APR_STATUS_IS_EOF(status)) {
+        return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+    }
+
+    /* Return the data we just read. */
+    return status;
+}
+
+/* Walk the LEN bytes at DATA, which follow the point in the chunked stream
+   that CTX is at, through as many chunks as fit in REQUESTED bytes and
+   VECS_SIZE iovecs. Returns how many bytes of DATA were walked.
+
+   With VECS NULL this only determines how much to read. Otherwise DATA was
+   read from the stream, and the chunk data is stored in VECS, and CTX is
+   moved past the data walked. The walk then also takes a partial chunk
+   size line at the end of DATA, which has to be the end of what was read.
+
+   The walk stops before a chunk size line it can't parse, which is left
+   to fetch_chunk_start() to report. */
+static apr_size_t walk_chunks(dechunk_context_t *ctx,
+                              const char *data, apr_size_t len,
+                              apr_size_t requested,
+                              int vecs_size, struct iovec *vecs,
+                              int *vecs_used)
+{
+    int state = ctx->state;
+    apr_int64_t body_left = ctx->body_left;
+    apr_size_t pos = 0;
+    int used = 0;
+
+    while (pos < len) {
+        if (state == STATE_CHUNK) {
+            apr_size_t take = len - pos;
+
+            if (take > body_left)
+                take = (apr_size_t)body_left;
+            if (take > requested)
+                take = requested;
+            if (!take || used == vecs_size)
+                break;
+
+            if (vecs) {
+                vecs[used].iov_base = (void *)(data + pos);
+                vecs[used].iov_len = take;
+            }
+            used++;
+            pos += take;
+            requested -= take;
+            body_left -= take;
+
+            if (body_left)
+                break;
+
+            state = STATE_TERM;
+            body_left = 2;      /* CRLF */
+
+            /* Don't walk into the framing when no data can follow. */
+            if (!requested || used == vecs_size)
+                break;
+        }
+        else if (state == STATE_TERM) {
+            apr_size_t take = len - pos;
+
+            if (take > body_left)
+                take = (apr_size_t)body_left;
+
+            pos += take;
+            body_left -= take;
+            if (!body_left)
+                state = STATE_SIZE;
+        }
+        else if (state == STATE_SIZE) {
+            const char *line = data + pos;
+            const char *nl = memchr(line, '\n', len - pos);
+            char hex[32];
+            apr_size_t hex_len;
+
+            if (!nl) {
+                /* Leave the line to the line buffer. */
+                if (vecs && len - pos < sizeof(ctx->linebuf.line)) {
+                    memcpy(ctx->linebuf.line, line, len - pos);
+                    ctx->linebuf.used = len - pos;
+                    ctx->linebuf.state = SERF_LINEBUF_PARTIAL;
+                    pos = len;
+                }
+                break;
+            }
+
+            hex_len = nl - line;
+            if (!hex_len || line[hex_len - 1] != '\r'
+                || hex_len > sizeof(hex))
+                break;
+            hex_len--;
+
+            memcpy(hex, line, hex_len);
+            hex[hex_len] = '\0';
+            body_left = apr_strtoi64(hex, NULL, 16);
+            if (errno == ERANGE || body_left < 0)
+                break;
+
+            pos = nl + 1 - data;
+            state = body_left ? STATE_CHUNK : STATE_DONE;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (vecs) {
+        ctx->state = state;
+        ctx->body_left = body_left;
+        *vecs_used = used;
+    }
+
+    return pos;
+}
+
+static apr_status_t serf_dechunk_read_iovec(serf_bucket_t *bucket,
+                                            apr_size_t requested,
+                                            int vecs_size,
+                                            struct iovec *vecs,
+                                            int *vecs_used)
+{
+    dechunk_context_t *ctx = bucket->data;
+    const char *data;
+    apr_size_t len;
+    apr_size_t walk_len;
+    apr_status_t status;
+
+    *vecs_used = 0;
+
+    status = fetch_chunk_start(ctx);
+    if (status)
+        return status;
+
+    /* See how many chunks are buffered in the stream, to hand out all of
+       their data while reading the stream only once. We can't read it
+       twice, as that may invalidate what the first read returned. */
+    status = serf_bucket_peek(ctx->stream, &data, &len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    walk_len = walk_chunks(ctx, data, len, requested, vecs_size, NULL, NULL);
+    if (!walk_len) {
+        status = serf_dechunk_read(bucket, requested, &data, &len);
+        if (!SERF_BUCKET_READ_ERROR(status) && len) {
+            vecs[0].iov_base = (void *)data;
+            vecs[0].iov_len = len;
+            *vecs_used = 1;
+        }
+        return status;
+    }
+
+    status = serf_bucket_read(ctx->stream, walk_len, &data, &len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    walk_chunks(ctx, data, len, requested, vecs_size, vecs, vecs_used);
+
+    if (ctx->state == STATE_DONE)
+        return APR_EOF;
+
+    /* We need more data but there is no more available. */
+    if (APR_STATUS_IS_EOF(status))
+        return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+
+    return status;
+}
+
+static apr_status_t serf_dechunk_peek(serf_bucket_t *bucket,
+                                      const char **data,
+                                      apr_size_t *len)
+{
+    dechunk_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->state == STATE_DONE) {
+        *len = 0;
+        return APR_EOF;
+    }
+
+    /* The framing can't be skipped without reading it. */
+    if (ctx->state != STATE_CHUNK) {
+        *len = 0;
+        return APR_SUCCESS;
+    }
+
+    status = serf_bucket_peek(ctx->stream, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    if (*len > ctx->body_left)
+        *len = (apr_size_t)ctx->body_left;
+
+    return APR_SUCCESS;
+}
+
+static serf_bucket_t *serf_dechunk_read_bucket(serf_bucket_t *bucket,
+                                               const serf_bucket_type_t *type)
+{
+    dechunk_context_t *ctx = bucket->data;
+    apr_uint64_t body_left;
+    serf_bucket_t *found;
+
+    /* The framing is read here, but nothing that follows it: when no chunk
+       data is buffered, a plain read gets to it. */
+    if (fetch_chunk_start(ctx))
+        return NULL;
+
+    body_left = ctx->body_left;
+    found = serf__bucket_read_bucket_limited(ctx->stream, type, &body_left);
+    ctx->body_left = body_left;
+
+    if (found && !ctx->body_left) {
+        ctx->state = STATE_TERM;
+        ctx->body_left = 2;     /* CRLF */
+    }
+
+    return found;
+}
+
+static apr_uint64_t serf_dechunk_get_remaining(serf_bucket_t *bucket)
+{
+    dechunk_context_t *ctx = bucket->data;
+
+    /* Only the size of the chunk being read is known, not whether another
+       chunk follows it. */
+    return ctx->state == STATE_DONE ? 0 : SERF_LENGTH_UNKNOWN;
+}
+
 static apr_status_t serf_dechunk_set_config(serf_bucket_t *bucket,
                                             serf_config_t *config)
 {
@@ -195,18 +431,17 @@ static apr_status_t serf_dechunk_set_config(serf_bucket_t *bucket,
 
 /* ### need to implement */
 #define serf_dechunk_readline NULL
-#define serf_dechunk_peek NULL
 
 const serf_bucket_type_t serf_bucket_type_dechunk = {
     "DECHUNK",
     serf_dechunk_read,
     serf_dechunk_readline,
-    serf_default_read_iovec,
+    serf_dechunk_read_iovec,
     serf_default_read_for_sendfile,
     serf_buckets_are_v2,
     serf_dechunk_peek,
     serf_dechunk_destroy_and_data,
-    serf_default_read_bucket,
-    NULL,
+    serf_dechunk_read_bucket,
+    serf_dechunk_get_remaining,
     serf_dechunk_set_config,
 };
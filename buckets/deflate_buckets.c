@@ -32,14 +32,15 @@
 static char deflate_magic[2] = { '\037', '\213' };
 #define DEFLATE_MAGIC_SIZE 10
 #define DEFLATE_VERIFY_SIZE 8
-#define DEFLATE_BUFFER_SIZE 8096
+/* The inflated data is handed out straight from a buffer this large, so
+   that zlib runs on large spans and few reads are needed per response. */
+#define DEFLATE_BUFFER_SIZE (64 * 1024)
 
 static const int DEFLATE_WINDOW_SIZE = -15;
 static const int DEFLATE_MEMLEVEL = 9;
 
 typedef struct deflate_context_t {
     serf_bucket_t *stream;
-    serf_bucket_t *inflate_stream;
 
     int format;                 /* Are we 'deflate' or 'gzip'? */
 
@@ -56,12 +57,17 @@ typedef struct deflate_context_t {
 
     z_stream zstream;
     char hdr_buffer[DEFLATE_MAGIC_SIZE];
-    unsigned char buffer[DEFLATE_BUFFER_SIZE];
     unsigned long crc;
     int windowSize;
     int memLevel;
     int bufferSize;
 
+    /* The inflated data, allocated when inflating starts. The bytes from
+       OUT_POS up to OUT_LEN weren't read yet. */
+    unsigned char *buffer;
+    apr_size_t out_pos;
+    apr_size_t out_len;
+
     /* How much of the chunk, or the terminator, do we have left to read? */
     apr_size_t stream_left;
 
@@ -92,7 +98,6 @@ serf_bucket_t *serf_bucket_deflate_create(
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->stream = stream;
     ctx->stream_status = APR_SUCCESS;
-    ctx->inflate_stream = serf_bucket_aggregate_create(allocator);
     ctx->format = format;
     ctx->crc = 0;
     ctx->config = NULL;
@@ -118,6 +123,8 @@ serf_bucket_t *serf_bucket_deflate_create(
     ctx->windowSize = DEFLATE_WINDOW_SIZE;
     ctx->memLevel = DEFLATE_MEMLEVEL;
     ctx->bufferSize = DEFLATE_BUFFER_SIZE;
+    ctx->buffer = NULL;
+    ctx->out_pos = ctx->out_len = 0;
 
     return serf_bucket_create(&serf_bucket_type_deflate, allocator, ctx);
 }
@@ -130,14 +137,11 @@ static void serf_deflate_destroy_and_data(serf_bucket_t *bucket)
         ctx->state <= STATE_FINISH)
         inflateEnd(&ctx->zstream);
 
-    /* We may have appended inflate_stream into the stream bucket.
-     * If so, avoid free'ing it twice.
-     */
-    if (ctx->inflate_stream) {
-        serf_bucket_destroy(ctx->inflate_stream);
-    }
     serf_bucket_destroy(ctx->stream);
 
+    if (ctx->buffer)
+        serf_bucket_mem_free(bucket->allocator, ctx->buffer);
+
     serf_default_destroy_and_data(bucket);
 }
 
@@ -152,6 +156,16 @@ static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
     int zRC;
 
     while (1) {
+        /* Hand out what we inflated before, ahead of the gzip trailer. */
+        if (ctx->out_pos < ctx->out_len) {
+            *data = (const char *)ctx->buffer + ctx->out_pos;
+            *len = ctx->out_len - ctx->out_pos;
+            if (requested < *len)
+                *len = requested;
+            ctx->out_pos += *len;
+            return APR_SUCCESS;
+        }
+
         switch (ctx->state) {
         case STATE_READING_HEADER:
         case STATE_READING_VERIFY:
@@ -236,187 +250,145 @@ static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
                           zRC, ctx->zstream.msg);
                 return SERF_ERROR_DECOMPRESSION_FAILED;
             }
-            ctx->zstream.next_out = ctx->buffer;
-            ctx->zstream.avail_out = ctx->bufferSize;
+            if (!ctx->buffer)
+                ctx->buffer = serf_bucket_mem_alloc(bucket->allocator,
+                                                    ctx->bufferSize);
             ctx->state++;
             break;
         case STATE_FINISH:
             inflateEnd(&ctx->zstream);
-            serf_bucket_aggregate_prepend(ctx->stream, ctx->inflate_stream);
-            ctx->inflate_stream = 0;
             ctx->state++;
             break;
         case STATE_INFLATE:
-            /* Do we have anything already uncompressed to read? */
-            status = serf_bucket_read(ctx->inflate_stream, requested, data,
-                                      len);
-            if (SERF_BUCKET_READ_ERROR(status)) {
-                return status;
-            }
-            /* Hide EOF. */
-            if (APR_STATUS_IS_EOF(status)) {
-                status = ctx->stream_status;
-                if (APR_STATUS_IS_EOF(status)) {
-                    /* We've read all of the data from our stream, but we
-                     * need to continue to iterate until we flush
-                     * out the zlib buffer.
-                     */
-                    status = APR_SUCCESS;
-                }
-            }
-            if (*len != 0) {
-                return status;
-            }
-
-            /* We tried; but we have nothing buffered. Fetch more. */
+            /* We have nothing buffered. Inflate as much as our buffer
+               holds, or as long as our stream has data. */
+            ctx->zstream.next_out = ctx->buffer;
+            ctx->zstream.avail_out = ctx->bufferSize;
+            zRC = Z_OK;
 
-            /* It is possible that we maxed out avail_out before
-             * exhausting avail_in; therefore, continue using the
-             * previous buffer.  Otherwise, fetch more data from
-             * our stream bucket.
-             */
-            if (ctx->zstream.avail_in == 0) {
-                /* When we empty our inflated stream, we'll return this
-                 * status - this allow us to eventually pass up EAGAINs.
+            while (1) {
+                /* It is possible that we maxed out avail_out before
+                 * exhausting avail_in; therefore, continue using the
+                 * previous buffer.  Otherwise, fetch more data from
+                 * our stream bucket.
                  */
-                ctx->stream_status = serf_bucket_read(ctx->stream,
-                                                      ctx->bufferSize,
-                                                      &private_data,
-                                                      &private_len);
+                if (ctx->zstream.avail_in == 0) {
+                    int have_output =
+                        ctx->zstream.avail_out < (uInt)ctx->bufferSize;
 
-                if (SERF_BUCKET_READ_ERROR(ctx->stream_status)) {
-                    return ctx->stream_status;
-                }
+                    /* Don't ask again when our stream just told us that it
+                       has nothing more for now. */
+                    if (have_output && ctx->stream_status)
+                        break;
 
-                if (!private_len && APR_STATUS_IS_EAGAIN(ctx->stream_status)) {
-                    *len = 0;
-                    status = ctx->stream_status;
-                    ctx->stream_status = APR_SUCCESS;
-                    return status;
-                }
+                    ctx->stream_status = serf_bucket_read(ctx->stream,
+                                                          ctx->bufferSize,
+                                                          &private_data,
+                                                          &private_len);
 
-                /* Make valgrind happy and explictly initialize next_in to specific
-                 * value for empty buffer. */
-                if (private_len) {
-                    ctx->zstream.next_in = (unsigned char*)private_data;
-                    ctx->zstream.avail_in = private_len;
-                } else {
-                    ctx->zstream.next_in = Z_NULL;
-                    ctx->zstream.avail_in = 0;
-                }
-            }
+                    if (SERF_BUCKET_READ_ERROR(ctx->stream_status)) {
+                        return ctx->stream_status;
+                    }
 
-            while (1) {
+                    /* Make valgrind happy and explictly initialize next_in
+                     * to specific value for empty buffer. */
+                    if (private_len) {
+                        ctx->zstream.next_in = (unsigned char*)private_data;
+                        ctx->zstream.avail_in = private_len;
+                    } else {
+                        ctx->zstream.next_in = Z_NULL;
+                        ctx->zstream.avail_in = 0;
+
+                        if (have_output)
+                            break;
+
+                        /* At EOF zlib may still have data for us, so
+                           let it tell. */
+                        if (!APR_STATUS_IS_EOF(ctx->stream_status)) {
+                            /* When we empty our inflated data, we'll
+                             * return this status - this allow us to
+                             * eventually pass up EAGAINs.
+                             */
+                            *len = 0;
+                            status = ctx->stream_status;
+                            ctx->stream_status = APR_SUCCESS;
+                            return status;
+                        }
+                    }
+                }
 
                 zRC = inflate(&ctx->zstream, Z_NO_FLUSH);
 
-                /* We're full or zlib requires more space. Either case, clear
-                   out our buffer, reset, and return. */
-                if (zRC == Z_BUF_ERROR || ctx->zstream.avail_out == 0) {
-                    serf_bucket_t *tmp;
-                    ctx->zstream.next_out = ctx->buffer;
-                    private_len = ctx->bufferSize - ctx->zstream.avail_out;
-
-                    ctx->crc = crc32(ctx->crc, (const Bytef *)ctx->buffer,
-                                     private_len);
-
-                    /* FIXME: There probably needs to be a free func. */
-                    tmp = SERF_BUCKET_SIMPLE_STRING_LEN((char *)ctx->buffer,
-                                                        private_len,
-                                                        bucket->allocator);
-                    serf_bucket_aggregate_append(ctx->inflate_stream, tmp);
-                    ctx->zstream.avail_out = ctx->bufferSize;
+                if (zRC == Z_STREAM_END)
                     break;
-                }
-
-                if (zRC == Z_STREAM_END) {
-                    serf_bucket_t *tmp;
-
-                    private_len = ctx->bufferSize - ctx->zstream.avail_out;
-                    ctx->crc = crc32(ctx->crc, (const Bytef *)ctx->buffer,
-                                     private_len);
-                    /* FIXME: There probably needs to be a free func. */
-                    tmp = SERF_BUCKET_SIMPLE_STRING_LEN((char *)ctx->buffer,
-                                                        private_len,
-                                                        bucket->allocator);
-                    serf_bucket_aggregate_append(ctx->inflate_stream, tmp);
-
-                    ctx->zstream.avail_out = ctx->bufferSize;
-
-                    /* Push back the remaining data to be read. */
-                    tmp = serf_bucket_aggregate_create(bucket->allocator);
-                    serf_bucket_set_config(tmp, ctx->config);
-                    serf_bucket_aggregate_prepend(tmp, ctx->stream);
-                    ctx->stream = tmp;
-
-                    /* We now need to take the remaining avail_in and
-                     * throw it in ctx->stream so our next read picks it up.
-                     */
-                    tmp = SERF_BUCKET_SIMPLE_STRING_LEN(
-                                        (const char*)ctx->zstream.next_in,
-                                                     ctx->zstream.avail_in,
-                                                     bucket->allocator);
-                    serf_bucket_aggregate_prepend(ctx->stream, tmp);
 
-                    switch (ctx->format) {
-                    case SERF_DEFLATE_GZIP:
-                        ctx->stream_left = ctx->stream_size =
-                            DEFLATE_VERIFY_SIZE;
-                        ctx->state++;
-                        break;
-                    case SERF_DEFLATE_DEFLATE:
-                        /* Deflate does not have a verify footer. */
-                        ctx->state = STATE_FINISH;
-                        break;
-                    default:
-                        /* Not reachable */
-                        return APR_EGENERAL;
-                    }
-
-                    break;
+                /* No progress, and no more data will come. */
+                if (zRC == Z_BUF_ERROR && ctx->zstream.avail_in == 0
+                    && APR_STATUS_IS_EOF(ctx->stream_status)) {
+                    serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__,
+                              ctx->config,
+                              "Unexpected EOF on input stream\n");
+                    return SERF_ERROR_DECOMPRESSION_FAILED;
                 }
 
-                /* Any other error? */
-                if (zRC != Z_OK) {
+                /* Z_BUF_ERROR means that zlib needs more input or more
+                   space, which we handle here. */
+                if (zRC != Z_OK && zRC != Z_BUF_ERROR) {
                     serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__,
                               ctx->config, "inflate error %d - %s\n",
                               zRC, ctx->zstream.msg);
                     return SERF_ERROR_DECOMPRESSION_FAILED;
                 }
 
-                /* As long as zRC == Z_OK, just keep looping. */
+                /* We're full. */
+                if (ctx->zstream.avail_out == 0)
+                    break;
             }
-            /* Okay, we've inflated.  Try to read. */
-            status = serf_bucket_read(ctx->inflate_stream, requested, data,
-                                      len);
-            /* Hide EOF. */
-            if (APR_STATUS_IS_EOF(status)) {
-                status = ctx->stream_status;
-
-                /* If the inflation wasn't finished, return APR_SUCCESS. */
-                if (zRC != Z_STREAM_END)
-                    return APR_SUCCESS;
-
-                /* If our stream is finished too and all data was inflated,
-                 * return SUCCESS so we'll iterate one more time.
+
+            ctx->out_pos = 0;
+            ctx->out_len = ctx->bufferSize - ctx->zstream.avail_out;
+            ctx->crc = crc32(ctx->crc, (const Bytef *)ctx->buffer,
+                             (uInt)ctx->out_len);
+
+            if (zRC == Z_STREAM_END) {
+                serf_bucket_t *tmp;
+
+                /* Push back the remaining data to be read. */
+                tmp = serf_bucket_aggregate_create(bucket->allocator);
+                serf_bucket_set_config(tmp, ctx->config);
+                serf_bucket_aggregate_prepend(tmp, ctx->stream);
+                ctx->stream = tmp;
+
+                /* We now need to take the remaining avail_in and
+                 * throw it in ctx->stream so our next read picks it up.
                  */
-                if (APR_STATUS_IS_EOF(status)) {
-                    /* No more data to read from the stream, and everything
-                       inflated. If all data was received correctly, state
-                       should have been advanced to STATE_READING_VERIFY or
-                       STATE_FINISH. If not, then the data was incomplete
-                       and we have an error. */
-                    if (ctx->state != STATE_INFLATE)
-                        return APR_SUCCESS;
-                    else {
-                        serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__,
-                                  ctx->config,
-                                  "Unexpected EOF on input stream\n");
-                        return SERF_ERROR_DECOMPRESSION_FAILED;
-                    }
+                if (ctx->zstream.avail_in) {
+                    tmp = SERF_BUCKET_SIMPLE_STRING_LEN(
+                                        (const char*)ctx->zstream.next_in,
+                                                     ctx->zstream.avail_in,
+                                                     bucket->allocator);
+                    serf_bucket_aggregate_prepend(ctx->stream, tmp);
+                    ctx->zstream.avail_in = 0;
+                }
+
+                switch (ctx->format) {
+                case SERF_DEFLATE_GZIP:
+                    ctx->stream_left = ctx->stream_size =
+                        DEFLATE_VERIFY_SIZE;
+                    ctx->state++;
+                    break;
+                case SERF_DEFLATE_DEFLATE:
+                    /* Deflate does not have a verify footer. */
+                    ctx->state = STATE_FINISH;
+                    break;
+                default:
+                    /* Not reachable */
+                    return APR_EGENERAL;
                 }
             }
-            return status;
+
+            /* Okay, we've inflated. The data is handed out next. */
+            break;
         case STATE_DONE:
             /* We're done inflating.  Use our finished buffer. */
             return serf_bucket_read(ctx->stream, requested, data, len);
@@ -429,6 +401,20 @@ static apr_status_t serf_deflate_read(serf_bucket_t *bucket,
     /* NOTREACHED */
 }
 
+static apr_uint64_t serf_deflate_get_remaining(serf_bucket_t *bucket)
+{
+    deflate_context_t *ctx = bucket->data;
+
+    /* Once zlib found the end of the stream, all that is left of the
+       inflated data is in our buffer. */
+    if (ctx->state <= STATE_INFLATE)
+        return SERF_LENGTH_UNKNOWN;
+    if (ctx->state == STATE_DONE)
+        return serf_bucket_get_remaining(ctx->stream);
+
+    return ctx->out_len - ctx->out_pos;
+}
+
 static apr_status_t serf_deflate_set_config(serf_bucket_t *bucket,
                                             serf_config_t *config)
 {
@@ -453,6 +439,6 @@ const serf_bucket_type_t serf_bucket_type_deflate = {
     serf_deflate_peek,
     serf_deflate_destroy_and_data,
     serf_default_read_bucket,
-    NULL,
+    serf_deflate_get_remaining,
     serf_deflate_set_config,
 };
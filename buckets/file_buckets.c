@@ -17,12 +17,19 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 typedef struct file_context_t {
     apr_file_t *file;
 
-    serf_databuf_t databuf;
+    serf__databuf_t databuf;
     apr_uint64_t remaining;
+
+    /* File offset of the next byte to read into the databuf. */
+    apr_off_t offset;
+    /* The file position was handed out to sendfile and may have been
+       moved, so seek to OFFSET before the next read. */
+    int seek_needed;
 } file_context_t;
 
 
@@ -30,9 +37,24 @@ static apr_status_t file_reader(void *baton, apr_size_t bufsize,
                                 char *buf, apr_size_t *len)
 {
     file_context_t *ctx = baton;
+    apr_status_t status;
+
+    if (ctx->seek_needed) {
+        apr_off_t offset = ctx->offset;
+
+        status = apr_file_seek(ctx->file, APR_SET, &offset);
+        if (status) {
+            *len = 0;
+            return status;
+        }
+        ctx->seek_needed = 0;
+    }
 
     *len = bufsize;
-    return apr_file_read(ctx->file, buf, len);
+    status = apr_file_read(ctx->file, buf, len);
+    ctx->offset += *len;
+
+    return status;
 }
 
 serf_bucket_t *serf_bucket_file_create(
@@ -55,11 +77,13 @@ serf_bucket_t *serf_bucket_file_create(
      */
     if (status == APR_SUCCESS && APR_MMAP_CANDIDATE(finfo.size)) {
         apr_mmap_t *file_mmap;
-        status = apr_mmap_create(&file_mmap, file, 0, finfo.size,
-                                 APR_MMAP_READ,
-                                 serf_bucket_allocator_get_pool(allocator));
+        apr_status_t mmap_status;
+
+        mmap_status = apr_mmap_create(
+                          &file_mmap, file, 0, finfo.size, APR_MMAP_READ,
+                          serf_bucket_allocator_get_pool(allocator));
 
-        if (status == APR_SUCCESS) {
+        if (mmap_status == APR_SUCCESS) {
             return serf_bucket_mmap_create(file_mmap, allocator);
         }
     }
@@ -68,13 +92,18 @@ serf_bucket_t *serf_bucket_file_create(
     /* Oh, well. */
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->file = file;
+    ctx->offset = 0;
+    ctx->seek_needed = 0;
 
-    serf_databuf_init(&ctx->databuf);
-    ctx->databuf.read = file_reader;
-    ctx->databuf.read_baton = ctx;
+    serf__databuf_init(&ctx->databuf, file_reader, ctx);
 
     if (status == APR_SUCCESS) {
-        ctx->remaining = finfo.size;
+        /* Remember where we start, sendfile needs an absolute offset. */
+        status = apr_file_seek(file, APR_CUR, &ctx->offset);
+    }
+
+    if (status == APR_SUCCESS && ctx->offset <= finfo.size) {
+        ctx->remaining = finfo.size - ctx->offset;
     }
     else {
         ctx->remaining = SERF_LENGTH_UNKNOWN;
@@ -90,7 +119,7 @@ static apr_status_t serf_file_read(serf_bucket_t *bucket,
     file_context_t *ctx = bucket->data;
     apr_status_t status;
 
-    status = serf_databuf_read(&ctx->databuf, requested, data, len);
+    status = serf_databuf_read(&ctx->databuf.databuf, requested, data, len);
 
     if (SERF_BUCKET_READ_ERROR(status))
     {
@@ -112,7 +141,8 @@ static apr_status_t serf_file_readline(serf_bucket_t *bucket,
     file_context_t *ctx = bucket->data;
     apr_status_t status;
 
-    status = serf_databuf_readline(&ctx->databuf, acceptable, found, data, len);
+    status = serf_databuf_readline(&ctx->databuf.databuf, acceptable, found,
+                                   data, len);
 
     if (SERF_BUCKET_READ_ERROR(status))
     {
@@ -128,13 +158,55 @@ static apr_status_t serf_file_readline(serf_bucket_t *bucket,
 
 }
 
+static apr_status_t serf_file_read_for_sendfile(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                apr_hdtr_t *hdtr,
+                                                apr_file_t **file,
+                                                apr_off_t *offset,
+                                                apr_size_t *len)
+{
+    file_context_t *ctx = bucket->data;
+
+    /* If we don't know how much is left in the file, or if some of it was
+       already read into our buffer, go the usual way. The buffer will be
+       returned as headers then, and the next call can send the file. */
+    if (ctx->remaining == SERF_LENGTH_UNKNOWN
+        || ctx->databuf.databuf.remaining || ctx->databuf.databuf.status) {
+        return serf_default_read_for_sendfile(bucket, requested, hdtr,
+                                              file, offset, len);
+    }
+
+    hdtr->numheaders = 0;
+    hdtr->numtrailers = 0;
+
+    if (ctx->remaining == 0) {
+        *file = NULL;
+        return APR_EOF;
+    }
+
+    if (requested == SERF_READ_ALL_AVAIL || requested > ctx->remaining)
+        requested = (ctx->remaining > REQUESTED_MAX)
+                    ? REQUESTED_MAX : (apr_size_t)ctx->remaining;
+
+    *file = ctx->file;
+    *offset = ctx->offset;
+    *len = requested;
+
+    /* Consider this part of the file read. */
+    ctx->offset += requested;
+    ctx->remaining -= requested;
+    ctx->seek_needed = 1;
+
+    return ctx->remaining ? APR_SUCCESS : APR_EOF;
+}
+
 static apr_status_t serf_file_peek(serf_bucket_t *bucket,
                                    const char **data,
                                    apr_size_t *len)
 {
     file_context_t *ctx = bucket->data;
 
-    return serf_databuf_peek(&ctx->databuf, data, len);
+    return serf_databuf_peek(&ctx->databuf.databuf, data, len);
 }
 
 static apr_uint64_t serf_file_get_remaining(serf_bucket_t *bucket)
@@ -143,16 +215,34 @@ static apr_uint64_t serf_file_get_remaining(serf_bucket_t *bucket)
     return ctx->remaining;
 }
 
+static apr_status_t serf_file_set_config(serf_bucket_t *bucket,
+                                         serf_config_t *config)
+{
+    file_context_t *ctx = bucket->data;
+
+    serf__databuf_configure(&ctx->databuf, config, bucket->allocator);
+
+    return APR_SUCCESS;
+}
+
+static void serf_file_destroy(serf_bucket_t *bucket)
+{
+    file_context_t *ctx = bucket->data;
+
+    serf__databuf_cleanup(&ctx->databuf);
+    serf_default_destroy_and_data(bucket);
+}
+
 const serf_bucket_type_t serf_bucket_type_file = {
     "FILE",
     serf_file_read,
     serf_file_readline,
     serf_default_read_iovec,
-    serf_default_read_for_sendfile,
+    serf_file_read_for_sendfile,
     serf_buckets_are_v2,
     serf_file_peek,
-    serf_default_destroy_and_data,
+    serf_file_destroy,
     serf_default_read_bucket,
     serf_file_get_remaining,
-    serf_default_ignore_config,
+    serf_file_set_config,
 };
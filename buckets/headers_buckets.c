@@ -18,6 +18,7 @@
 #define APR_WANT_MEMFUNC
 #include <apr_want.h>
 #include <apr_general.h>  /* for strcasecmp() */
+#include <apr_lib.h>      /* for apr_tolower() */
 
 #include "serf.h"
 #include "serf_bucket_util.h"
@@ -37,8 +38,25 @@ typedef struct header_list {
 #define ALLOC_VALUE  0x0002  /* value lives in our allocator */
 
     struct header_list *next;
+
+    /* Used by the index: hash of the (lowercased) header name, and the
+       next header in the same index slot, in wire order. */
+    apr_uint32_t hash;
+    struct header_list *hash_next;
 } header_list_t;
 
+/* An index is built once a bucket holds more than this many headers. Below
+   that, walking the list is just as fast. */
+#define INDEX_THRESHOLD 8
+
+/* Number of slots in the index, must be a power of two. */
+#define INDEX_SIZE 64
+
+/* Header blocks up to this size are copied into one buffer when they are
+   read in one go, so they can be written with a single iovec. Chosen to
+   fit the largest node size of the bucket allocator. */
+#define FLATTEN_MAX 4000
+
 typedef struct headers_context_t {
     header_list_t *list;
     header_list_t *last;
@@ -51,13 +69,61 @@ typedef struct headers_context_t {
         READ_VALUE,     /* reading cur_read->value */
         READ_CRLF,      /* reading "\r\n" */
         READ_TERM,      /* reading the final "\r\n" */
-        READ_DONE       /* no more data to read */
+        READ_DONE,      /* no more data to read */
+        READ_FLAT       /* reading the whole serialized block from flat */
     } state;
     apr_size_t amt_read; /* how much of the current state we've read */
 
+    char *flat;          /* serialized headers, in state READ_FLAT */
+    apr_size_t flat_len;
+
+    int count;              /* number of headers in LIST */
+    header_list_t **index;  /* INDEX_SIZE slots, or NULL if not built */
+
 } headers_context_t;
 
 
+/* Case-insensitive FNV-1a hash of a header name. */
+static apr_uint32_t hash_header(const char *header, apr_size_t len)
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)apr_tolower(header[i]);
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/* Add HDR at the end of its slot in the index of CTX. */
+static void index_header(headers_context_t *ctx, header_list_t *hdr)
+{
+    header_list_t **slot = &ctx->index[hdr->hash & (INDEX_SIZE - 1)];
+
+    while (*slot)
+        slot = &(*slot)->hash_next;
+
+    hdr->hash_next = NULL;
+    *slot = hdr;
+}
+
+static void build_index(headers_context_t *ctx,
+                        serf_bucket_alloc_t *allocator)
+{
+    header_list_t *scan;
+
+    ctx->index = serf_bucket_mem_calloc(allocator,
+                                        INDEX_SIZE * sizeof(*ctx->index));
+    if (ctx->index == NULL)
+        return;
+
+    for (scan = ctx->list; scan; scan = scan->next)
+        index_header(ctx, scan);
+}
+
+
 serf_bucket_t *serf_bucket_headers_create(
     serf_bucket_alloc_t *allocator)
 {
@@ -67,6 +133,10 @@ serf_bucket_t *serf_bucket_headers_create(
     ctx->list = NULL;
     ctx->last = NULL;
     ctx->state = READ_START;
+    ctx->amt_read = 0;
+    ctx->count = 0;
+    ctx->index = NULL;
+    ctx->flat = NULL;
 
     return serf_bucket_create(&serf_bucket_type_headers, allocator, ctx);
 }
@@ -109,6 +179,8 @@ void serf_bucket_headers_setx(
         hdr->value = value;
     }
 
+    hdr->hash = hash_header(header, header_size);
+
     /* Add the new header at the end of the list. */
     if (ctx->last)
         ctx->last->next = hdr;
@@ -116,6 +188,10 @@ void serf_bucket_headers_setx(
         ctx->list = hdr;
 
     ctx->last = hdr;
+    ctx->count++;
+
+    if (ctx->index)
+        index_header(ctx, hdr);
 }
 
 void serf_bucket_headers_set(
@@ -153,13 +229,26 @@ const char *serf_bucket_headers_get(
     const char *header)
 {
     headers_context_t *ctx = headers_bucket->data;
-    header_list_t *found = ctx->list;
+    header_list_t *found;
     const char *val = NULL;
     int value_size = 0;
     int val_alloc = 0;
+    apr_uint32_t hash = 0;
+
+    if (ctx->index == NULL && ctx->count > INDEX_THRESHOLD)
+        build_index(ctx, headers_bucket->allocator);
+
+    if (ctx->index) {
+        hash = hash_header(header, strlen(header));
+        found = ctx->index[hash & (INDEX_SIZE - 1)];
+    }
+    else {
+        found = ctx->list;
+    }
 
     while (found) {
-        if (strcasecmp(found->header, header) == 0) {
+        if ((!ctx->index || found->hash == hash)
+            && strcasecmp(found->header, header) == 0) {
             if (val) {
                 /* ### this is BROKEN. the caller doesn't know that it should
                    ### free the result.  */
@@ -192,7 +281,7 @@ const char *serf_bucket_headers_get(
                 value_size = found->value_size;
             }
         }
-        found = found->next;
+        found = ctx->index ? found->hash_next : found->next;
     }
 
     return val;
@@ -205,19 +294,37 @@ void serf__bucket_headers_remove(serf_bucket_t *bucket, const char *header)
 
     /* Find and delete all items with the same header (case insensitive) */
     while (scan) {
+        header_list_t *next_hdr = scan->next;
+
         if (strcasecmp(scan->header, header) == 0) {
             if (prev) {
-                prev->next = scan->next;
+                prev->next = next_hdr;
             } else {
-                ctx->list = scan->next;
+                ctx->list = next_hdr;
             }
             if (ctx->last == scan) {
-                ctx->last = NULL;
+                ctx->last = prev;
             }
+
+            if (ctx->index) {
+                header_list_t **slot;
+
+                slot = &ctx->index[scan->hash & (INDEX_SIZE - 1)];
+                while (*slot != scan)
+                    slot = &(*slot)->hash_next;
+                *slot = scan->hash_next;
+            }
+            ctx->count--;
+
+            if (scan->alloc_flags & ALLOC_HEADER)
+                serf_bucket_mem_free(bucket->allocator, (void *)scan->header);
+            if (scan->alloc_flags & ALLOC_VALUE)
+                serf_bucket_mem_free(bucket->allocator, (void *)scan->value);
+            serf_bucket_mem_free(bucket->allocator, scan);
         } else {
             prev = scan;
         }
-        scan = scan->next;
+        scan = next_hdr;
     }
 }
 
@@ -254,9 +361,96 @@ static void serf_headers_destroy_and_data(serf_bucket_t *bucket)
         scan = next_hdr;
     }
 
+    if (ctx->index)
+        serf_bucket_mem_free(bucket->allocator, ctx->index);
+    if (ctx->flat)
+        serf_bucket_mem_free(bucket->allocator, ctx->flat);
+
     serf_default_destroy_and_data(bucket);
 }
 
+/* Returns the length of the serialized headers which haven't been read. */
+static apr_size_t remaining_length(headers_context_t *ctx)
+{
+    header_list_t *scan;
+    apr_size_t len = 2;   /* the final CRLF */
+
+    switch (ctx->state) {
+    case READ_START:
+        scan = ctx->list;
+        break;
+    case READ_HEADER:
+        len += ctx->cur_read->header_size + 2 + ctx->cur_read->value_size + 2;
+        scan = ctx->cur_read->next;
+        break;
+    case READ_SEP:
+        len += 2 + ctx->cur_read->value_size + 2;
+        scan = ctx->cur_read->next;
+        break;
+    case READ_VALUE:
+        len += ctx->cur_read->value_size + 2;
+        scan = ctx->cur_read->next;
+        break;
+    case READ_CRLF:
+        len += 2;
+        scan = ctx->cur_read->next;
+        break;
+    case READ_TERM:
+        scan = NULL;
+        break;
+    case READ_FLAT:
+        return ctx->flat_len - ctx->amt_read;
+    case READ_DONE:
+    default:
+        return 0;
+    }
+
+    for (; scan; scan = scan->next)
+        len += scan->header_size + 2 + scan->value_size + 2;
+
+    /* Everything in the current state includes what was read of it. */
+    return len - ctx->amt_read;
+}
+
+/* Serialize all headers into one buffer, if we haven't started reading
+   yet and they are small enough, so they can be returned at once. */
+static void flatten_headers(serf_bucket_t *bucket, apr_size_t requested)
+{
+    headers_context_t *ctx = bucket->data;
+    header_list_t *scan;
+    apr_size_t total;
+    char *p;
+
+    if (ctx->state != READ_START)
+        return;
+
+    total = remaining_length(ctx);
+    if (total > FLATTEN_MAX
+        || (requested != SERF_READ_ALL_AVAIL && requested < total))
+        return;
+
+    p = ctx->flat = serf_bucket_mem_alloc(bucket->allocator, total);
+    if (p == NULL)
+        return;
+
+    for (scan = ctx->list; scan; scan = scan->next) {
+        memcpy(p, scan->header, scan->header_size);
+        p += scan->header_size;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy(p, scan->value, scan->value_size);
+        p += scan->value_size;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+
+    ctx->flat_len = total;
+    ctx->amt_read = 0;
+    ctx->state = READ_FLAT;
+}
+
 static void select_value(
     headers_context_t *ctx,
     const char **value,
@@ -295,6 +489,10 @@ static void select_value(
         v = "\r\n";
         l = 2;
         break;
+    case READ_FLAT:
+        v = ctx->flat;
+        l = ctx->flat_len;
+        break;
     case READ_DONE:
         *len = 0;
         return;
@@ -310,6 +508,13 @@ static void select_value(
 /* the current data chunk has been read/consumed. move our internal state. */
 static apr_status_t consume_chunk(headers_context_t *ctx)
 {
+    /* the flattened block holds everything, we're done. */
+    if (ctx->state == READ_FLAT) {
+        ctx->state = READ_DONE;
+        ctx->amt_read = 0;
+        return APR_EOF;
+    }
+
     /* move to the next state, resetting the amount read. */
     ++ctx->state;
     ctx->amt_read = 0;
@@ -341,7 +546,8 @@ static apr_status_t serf_headers_peek(serf_bucket_t *bucket,
     select_value(ctx, data, len);
 
     /* already done or returning the CRLF terminator? return EOF */
-    if (ctx->state == READ_DONE || ctx->state == READ_TERM)
+    if (ctx->state == READ_DONE || ctx->state == READ_TERM
+        || ctx->state == READ_FLAT)
         return APR_EOF;
 
     return APR_SUCCESS;
@@ -354,6 +560,8 @@ static apr_status_t serf_headers_read(serf_bucket_t *bucket,
     headers_context_t *ctx = bucket->data;
     apr_size_t avail;
 
+    flatten_headers(bucket, requested);
+
     select_value(ctx, data, &avail);
     if (ctx->state == READ_DONE) {
         *len = avail;
@@ -394,6 +602,18 @@ static apr_status_t serf_headers_readline(serf_bucket_t *bucket,
         return APR_EOF;
     }
 
+    if (ctx->state == READ_FLAT) {
+        const char *end = *data;
+
+        serf_util_readline(&end, len, SERF_NEWLINE_CRLF, found);
+        *len = end - *data;
+        ctx->amt_read += *len;
+
+        if (ctx->amt_read == ctx->flat_len)
+            return consume_chunk(ctx);
+        return APR_SUCCESS;
+    }
+
     /* we consumed this chunk. advance the state. */
     status = consume_chunk(ctx);
 
@@ -415,6 +635,9 @@ static apr_status_t serf_headers_read_iovec(serf_bucket_t *bucket,
 
     *vecs_used = 0;
 
+    /* If we can return all headers now, do so with just one iovec. */
+    flatten_headers(bucket, requested);
+
     for (i = 0; i < vecs_size; i++) {
         const char *data;
         apr_size_t len;
@@ -451,13 +674,23 @@ static apr_status_t serf_headers_read_iovec(serf_bucket_t *bucket,
     return APR_SUCCESS;
 }
 
+static apr_uint64_t serf_headers_get_remaining(serf_bucket_t *bucket)
+{
+    headers_context_t *ctx = bucket->data;
+
+    return remaining_length(ctx);
+}
+
 const serf_bucket_type_t serf_bucket_type_headers = {
     "HEADERS",
     serf_headers_read,
     serf_headers_readline,
     serf_headers_read_iovec,
     serf_default_read_for_sendfile,
-    serf_default_read_bucket,
+    serf_buckets_are_v2,
     serf_headers_peek,
     serf_headers_destroy_and_data,
+    serf_default_read_bucket,
+    serf_headers_get_remaining,
+    serf_default_ignore_config,
 };
@@ -0,0 +1,742 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_lib.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+/* HPACK header compression for HTTP/2, see RFC 7541.
+
+   The decoder keeps the dynamic table the peer's encoder maintains for
+   us. Our encoder doesn't insert anything in the peer's table: request
+   headers are sent as static table references or as literals without
+   indexing, so it needs no state at all. */
+
+/* The static table, RFC 7541 Appendix A. */
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+#define STATIC_TABLE_SIZE \
+    (sizeof(static_table) / sizeof(static_table[0]))
+
+/* Each dynamic table entry is accounted with this overhead on top of the
+   length of its name and value (RFC 7541, 4.1). */
+#define ENTRY_OVERHEAD 32
+
+/* The Huffman code, RFC 7541 Appendix B. The code is canonical: within a
+   length the codes increase with the symbol, so the decoder only needs
+   the number of codes per length and the symbols sorted by code. */
+static const apr_uint32_t huffman_codes[257] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+    0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+    0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+    0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+    0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+    0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+    0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+    0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+    0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+    0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+    0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+    0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+    0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+    0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+    0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+    0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+    0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+    0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+    0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+    0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+    0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+    0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+    0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+    0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+    0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+    0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+    0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+    0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+    0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+    0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+    0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+    0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+    0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee, 0x3fffffff
+};
+
+static const unsigned char huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28,
+    30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28,
+    28, 28, 28, 28, 28, 28,  6, 10, 10, 12, 13,  6,  8,
+    11, 10, 10,  8, 11,  8,  6,  6,  6,  5,  5,  5,  6,
+     6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10, 13,
+     6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8,
+    13, 19, 13, 14,  6, 15,  5,  6,  5,  6,  5,  6,  6,
+     6,  5,  7,  7,  6,  6,  6,  5,  6,  7,  6,  5,  5,
+     6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28, 20, 22,
+    20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24,
+    23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23,
+    22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23,
+    22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22,
+    23, 23, 20, 22, 22, 22, 23, 22, 22, 23, 26, 26, 20,
+    19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28,
+    27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22,
+    25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27,
+    27, 27, 28, 27, 27, 27, 27, 27, 26, 30
+};
+
+static const apr_uint16_t huffman_counts[31] = {
+     0,  0,  0,  0,  0, 10, 26, 32,  6,  0,  5,  3,  2,  6,  2,  3,
+     0,  0,  0,  3,  8, 13, 26, 29, 12,  4, 15, 19, 29,  0,  4
+};
+
+static const apr_uint16_t huffman_syms[257] = {
+     48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,  45,
+     46,  47,  51,  52,  53,  54,  55,  56,  57,  61,  65,  95,  98,
+    100, 102, 103, 104, 108, 109, 110, 112, 114, 117,  58,  66,  67,
+     68,  69,  70,  71,  72,  73,  74,  75,  76,  77,  78,  79,  80,
+     81,  82,  83,  84,  85,  86,  87,  89, 106, 107, 113, 118, 119,
+    120, 121, 122,  38,  42,  44,  59,  88,  90,  33,  34,  40,  41,
+     63,  39,  43, 124,  35,  62,   0,  36,  64,  91,  93, 126,  94,
+    125,  60,  96, 123,  92, 195, 208, 128, 130, 131, 162, 184, 194,
+    224, 226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227,
+    229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164,
+    169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228,
+    232, 233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182, 183,
+    188, 191, 197, 231, 239,   9, 142, 144, 145, 148, 159, 171, 206,
+    215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202,
+    205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251,
+    252, 253, 254,   2,   3,   4,   5,   6,   7,   8,  11,  12,  14,
+     15,  16,  17,  18,  19,  20,  21,  23,  24,  25,  26,  27,  28,
+     29,  30,  31, 127, 220, 249,  10,  13,  22, 256
+};
+
+#define HUFFMAN_EOS 256
+
+/* Decode the Huffman coded string in SRC into DST, which must have room
+   for SRC_LEN * 8 / 5 bytes, the length of the string when it contains
+   only 5 bit codes. */
+static apr_status_t huffman_decode(char *dst, apr_size_t *dst_len,
+                                   const unsigned char *src,
+                                   apr_size_t src_len)
+{
+    apr_uint32_t code = 0;  /* the bits read for the current symbol */
+    apr_uint32_t first = 0; /* the first code of length LEN */
+    int index = 0;          /* the position of FIRST in huffman_syms */
+    int len = 0;
+    char *out = dst;
+    apr_size_t i;
+
+    for (i = 0; i < src_len; i++) {
+        int bit;
+
+        for (bit = 7; bit >= 0; bit--) {
+            int count;
+
+            code |= (src[i] >> bit) & 1;
+            len++;
+
+            count = huffman_counts[len];
+            if (code - first < (apr_uint32_t)count) {
+                int sym = huffman_syms[index + (code - first)];
+
+                if (sym == HUFFMAN_EOS)
+                    return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+                *out++ = (char)sym;
+                code = first = 0;
+                index = len = 0;
+                continue;
+            }
+
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+
+    /* The string is padded with the most significant bits of EOS, which
+       are all ones, to a full byte. */
+    if (len > 7 || (code >> 1) != (1U << len) - 1)
+        return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+    *dst_len = out - dst;
+
+    return APR_SUCCESS;
+}
+
+static apr_size_t huffman_len(const char *str, apr_size_t len, int lower)
+{
+    apr_size_t bits = 0;
+    apr_size_t i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        bits += huffman_lens[lower ? apr_tolower(c) : c];
+    }
+
+    return (bits + 7) / 8;
+}
+
+/* Huffman code STR into DST, which has room for huffman_len() bytes. */
+static void huffman_encode(unsigned char *dst, const char *str,
+                           apr_size_t len, int lower)
+{
+    apr_uint64_t bits = 0;
+    int nbits = 0;
+    apr_size_t i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (lower)
+            c = apr_tolower(c);
+
+        bits = (bits << huffman_lens[c]) | huffman_codes[c];
+        nbits += huffman_lens[c];
+
+        while (nbits >= 8) {
+            nbits -= 8;
+            *dst++ = (unsigned char)(bits >> nbits);
+        }
+    }
+
+    if (nbits)
+        *dst = (unsigned char)((bits << (8 - nbits)) | (0xff >> nbits));
+}
+
+
+/*** The decoder ***/
+
+typedef struct hpack_entry_t {
+    apr_size_t name_len;
+    apr_size_t value_len;
+    /* followed by the name and the value, both NUL terminated */
+} hpack_entry_t;
+
+#define ENTRY_NAME(e) ((const char *)((e) + 1))
+#define ENTRY_VALUE(e) (ENTRY_NAME(e) + (e)->name_len + 1)
+#define ENTRY_SIZE(e) ((e)->name_len + (e)->value_len + ENTRY_OVERHEAD)
+
+struct serf__hpack_table_t {
+    /* The dynamic table, newest entry first, as a ring of COUNT entries
+       starting at FIRST. */
+    hpack_entry_t **entries;
+    int entries_size;
+    int first;
+    int count;
+
+    /* The size of the entries, and the maximum set by the encoder. */
+    apr_size_t size;
+    apr_size_t max_size;
+
+    /* The maximum we announced to the encoder. */
+    apr_size_t limit;
+
+    serf_bucket_alloc_t *allocator;
+};
+
+#define TABLE_AT(tbl, i) \
+    ((tbl)->entries[((tbl)->first + (i)) % (tbl)->entries_size])
+
+#define INITIAL_ENTRIES_SIZE 16
+
+serf__hpack_table_t *serf__hpack_table_create(apr_size_t max_size,
+                                              apr_pool_t *pool)
+{
+    serf__hpack_table_t *tbl = apr_pcalloc(pool, sizeof(*tbl));
+
+    tbl->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
+    tbl->entries_size = INITIAL_ENTRIES_SIZE;
+    tbl->entries = serf_bucket_mem_alloc(tbl->allocator,
+                                         tbl->entries_size
+                                         * sizeof(*tbl->entries));
+    tbl->max_size = tbl->limit = max_size;
+
+    return tbl;
+}
+
+/* Remove the oldest entries until TBL fits in MAX_SIZE. */
+static void evict_entries(serf__hpack_table_t *tbl, apr_size_t max_size)
+{
+    while (tbl->size > max_size) {
+        hpack_entry_t *entry = TABLE_AT(tbl, tbl->count - 1);
+
+        tbl->size -= ENTRY_SIZE(entry);
+        tbl->count--;
+        serf_bucket_mem_free(tbl->allocator, entry);
+    }
+}
+
+static void insert_entry(serf__hpack_table_t *tbl,
+                         const char *name, apr_size_t name_len,
+                         const char *value, apr_size_t value_len)
+{
+    hpack_entry_t *entry;
+    char *data;
+
+    if (name_len + value_len + ENTRY_OVERHEAD > tbl->max_size) {
+        /* An entry larger than the table just empties it. */
+        evict_entries(tbl, 0);
+        return;
+    }
+
+    /* Copy before evicting, NAME may refer to an entry that goes. */
+    entry = serf_bucket_mem_alloc(tbl->allocator,
+                                  sizeof(*entry) + name_len + value_len + 2);
+    entry->name_len = name_len;
+    entry->value_len = value_len;
+    data = (char *)(entry + 1);
+    memcpy(data, name, name_len);
+    data[name_len] = '\0';
+    memcpy(data + name_len + 1, value, value_len);
+    data[name_len + 1 + value_len] = '\0';
+
+    evict_entries(tbl, tbl->max_size - ENTRY_SIZE(entry));
+
+    if (tbl->count == tbl->entries_size) {
+        hpack_entry_t **entries;
+        int i;
+
+        entries = serf_bucket_mem_alloc(tbl->allocator,
+                                        2 * tbl->entries_size
+                                        * sizeof(*entries));
+        for (i = 0; i < tbl->count; i++)
+            entries[i] = TABLE_AT(tbl, i);
+
+        serf_bucket_mem_free(tbl->allocator, tbl->entries);
+        tbl->entries = entries;
+        tbl->entries_size *= 2;
+        tbl->first = 0;
+    }
+
+    tbl->first = (tbl->first + tbl->entries_size - 1) % tbl->entries_size;
+    tbl->entries[tbl->first] = entry;
+    tbl->count++;
+    tbl->size += ENTRY_SIZE(entry);
+}
+
+static apr_status_t get_entry(serf__hpack_table_t *tbl,
+                              apr_uint32_t index,
+                              const char **name, apr_size_t *name_len,
+                              const char **value, apr_size_t *value_len)
+{
+    if (index == 0)
+        return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+    if (index <= STATIC_TABLE_SIZE) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+    }
+    else {
+        hpack_entry_t *entry;
+
+        index -= STATIC_TABLE_SIZE + 1;
+        if (index >= (apr_uint32_t)tbl->count)
+            return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+        entry = TABLE_AT(tbl, index);
+        *name = ENTRY_NAME(entry);
+        *name_len = entry->name_len;
+        *value = ENTRY_VALUE(entry);
+        *value_len = entry->value_len;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Read an integer with a PREFIX bits prefix (RFC 7541, 5.1). */
+static apr_status_t read_int(apr_uint32_t *value, int prefix,
+                             const unsigned char **p,
+                             const unsigned char *end)
+{
+    apr_uint32_t max = (1U << prefix) - 1;
+    apr_uint32_t v;
+    int shift = 0;
+    unsigned char b;
+
+    if (*p >= end)
+        return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+    v = *(*p)++ & max;
+    if (v < max) {
+        *value = v;
+        return APR_SUCCESS;
+    }
+
+    do {
+        /* Nothing we decode needs more than 28 bits. */
+        if (*p >= end || shift > 21)
+            return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+        b = *(*p)++;
+        v += (apr_uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    *value = v;
+
+    return APR_SUCCESS;
+}
+
+/* Read a string literal (RFC 7541, 5.2). Huffman coded strings are
+   decoded in POOL, others point into the header block. */
+static apr_status_t read_string(const char **str, apr_size_t *len,
+                                const unsigned char **p,
+                                const unsigned char *end,
+                                apr_pool_t *pool)
+{
+    apr_uint32_t str_len;
+    int huffman;
+    apr_status_t status;
+
+    if (*p >= end)
+        return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+    huffman = (**p & 0x80) != 0;
+    status = read_int(&str_len, 7, p, end);
+    if (status)
+        return status;
+
+    if (str_len > (apr_size_t)(end - *p))
+        return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+    if (huffman) {
+        char *buf = apr_palloc(pool, str_len * 8 / 5 + 1);
+
+        status = huffman_decode(buf, len, *p, str_len);
+        if (status)
+            return status;
+
+        buf[*len] = '\0';
+        *str = buf;
+    }
+    else {
+        *str = (const char *)*p;
+        *len = str_len;
+    }
+
+    *p += str_len;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf__hpack_decode(serf__hpack_table_t *tbl,
+                                const char *data,
+                                apr_size_t len,
+                                serf__hpack_header_cb_t cb,
+                                void *baton,
+                                apr_pool_t *scratch_pool)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+    int seen_header = 0;
+
+    while (p < end) {
+        const char *name, *value;
+        apr_size_t name_len, value_len;
+        apr_uint32_t index;
+        int indexing = 0;
+        apr_status_t status;
+
+        if (*p & 0x80) {
+            /* Indexed header field. */
+            status = read_int(&index, 7, &p, end);
+            if (!status)
+                status = get_entry(tbl, index, &name, &name_len,
+                                   &value, &value_len);
+        }
+        else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update, only allowed before the first
+               header of a block. */
+            status = read_int(&index, 5, &p, end);
+            if (status)
+                return status;
+            if (seen_header || index > tbl->limit)
+                return SERF_ERROR_HTTP2_COMPRESSION_ERROR;
+
+            tbl->max_size = index;
+            evict_entries(tbl, index);
+            continue;
+        }
+        else {
+            /* Literal header field with incremental indexing, without
+               indexing or never indexed. */
+            indexing = (*p & 0xc0) == 0x40;
+
+            status = read_int(&index, indexing ? 6 : 4, &p, end);
+            if (!status && index)
+                status = get_entry(tbl, index, &name, &name_len,
+                                   &value, &value_len);
+            else if (!status)
+                status = read_string(&name, &name_len, &p, end,
+                                     scratch_pool);
+            if (!status)
+                status = read_string(&value, &value_len, &p, end,
+                                     scratch_pool);
+        }
+        if (status)
+            return status;
+
+        seen_header = 1;
+
+        status = cb(baton, name, name_len, value, value_len);
+        if (status)
+            return status;
+
+        if (indexing)
+            insert_entry(tbl, name, name_len, value, value_len);
+    }
+
+    return APR_SUCCESS;
+}
+
+
+/*** The encoder ***/
+
+typedef struct encoder_t {
+    char *buf;
+    apr_size_t len;
+    apr_size_t size;
+    serf_bucket_alloc_t *allocator;
+} encoder_t;
+
+static void ensure_space(encoder_t *enc, apr_size_t needed)
+{
+    apr_size_t size = enc->size;
+    char *buf;
+
+    if (enc->len + needed <= size)
+        return;
+
+    while (size < enc->len + needed)
+        size *= 2;
+
+    buf = serf_bucket_mem_alloc(enc->allocator, size);
+    memcpy(buf, enc->buf, enc->len);
+    serf_bucket_mem_free(enc->allocator, enc->buf);
+    enc->buf = buf;
+    enc->size = size;
+}
+
+static void emit_int(encoder_t *enc, unsigned char flags, int prefix,
+                     apr_size_t value)
+{
+    apr_size_t max = (1U << prefix) - 1;
+
+    ensure_space(enc, 1 + (sizeof(value) * 8 + 6) / 7);
+
+    if (value < max) {
+        enc->buf[enc->len++] = (char)(flags | value);
+        return;
+    }
+
+    enc->buf[enc->len++] = (char)(flags | max);
+    value -= max;
+    while (value >= 0x80) {
+        enc->buf[enc->len++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    enc->buf[enc->len++] = (char)value;
+}
+
+static void emit_string(encoder_t *enc, const char *str, apr_size_t len,
+                        int lower)
+{
+    apr_size_t huffman_size = huffman_len(str, len, lower);
+
+    if (huffman_size < len) {
+        emit_int(enc, 0x80, 7, huffman_size);
+        ensure_space(enc, huffman_size);
+        huffman_encode((unsigned char *)enc->buf + enc->len, str, len,
+                       lower);
+        enc->len += huffman_size;
+    }
+    else {
+        apr_size_t i;
+
+        emit_int(enc, 0x00, 7, len);
+        ensure_space(enc, len);
+        for (i = 0; i < len; i++) {
+            enc->buf[enc->len++] = lower ? (char)apr_tolower(str[i])
+                                         : str[i];
+        }
+    }
+}
+
+static void emit_header(encoder_t *enc, const char *name, const char *value)
+{
+    apr_size_t name_len = strlen(name);
+    apr_uint32_t name_index = 0;
+    apr_uint32_t i;
+    int sensitive;
+
+    for (i = 0; i < STATIC_TABLE_SIZE; i++) {
+        if (strcasecmp(static_table[i].name, name) != 0)
+            continue;
+
+        if (strcmp(static_table[i].value, value) == 0) {
+            emit_int(enc, 0x80, 7, i + 1);
+            return;
+        }
+        if (!name_index)
+            name_index = i + 1;
+    }
+
+    /* Credentials are never indexed, not even by intermediaries. */
+    sensitive = strcasecmp(name, "authorization") == 0
+                || strcasecmp(name, "proxy-authorization") == 0;
+
+    emit_int(enc, sensitive ? 0x10 : 0x00, 4, name_index);
+    if (!name_index)
+        emit_string(enc, name, name_len, 1);
+    emit_string(enc, value, strlen(value), 0);
+}
+
+static int encode_header(void *baton, const char *key, const char *value)
+{
+    encoder_t *enc = baton;
+
+    /* HTTP/2 has no connection specific headers, and the Host header
+       became the :authority pseudo header. */
+    if (strcasecmp(key, "Connection") == 0
+        || strcasecmp(key, "Keep-Alive") == 0
+        || strcasecmp(key, "Proxy-Connection") == 0
+        || strcasecmp(key, "Transfer-Encoding") == 0
+        || strcasecmp(key, "Upgrade") == 0
+        || strcasecmp(key, "Host") == 0)
+        return 0;
+
+    if (strcasecmp(key, "TE") == 0 && strcasecmp(value, "trailers") != 0)
+        return 0;
+
+    emit_header(enc, key, value);
+
+    return 0;
+}
+
+void serf__hpack_encode_request(char **block,
+                                apr_size_t *block_len,
+                                const char *method,
+                                const char *scheme,
+                                const char *authority,
+                                const char *path,
+                                serf_bucket_t *headers,
+                                serf_bucket_alloc_t *allocator)
+{
+    encoder_t enc;
+
+    enc.size = 256;
+    enc.len = 0;
+    enc.allocator = allocator;
+    enc.buf = serf_bucket_mem_alloc(allocator, enc.size);
+
+    emit_header(&enc, ":method", method);
+    emit_header(&enc, ":scheme", scheme);
+    if (authority)
+        emit_header(&enc, ":authority", authority);
+    emit_header(&enc, ":path", path);
+
+    if (headers)
+        serf_bucket_headers_do(headers, encode_header, &enc);
+
+    *block = enc.buf;
+    *block_len = enc.len;
+}
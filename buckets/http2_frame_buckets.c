@@ -0,0 +1,417 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <apr_pools.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+/* The stream identifier is 31 bits, the remaining bit is reserved. */
+#define STREAM_ID_MASK 0x7fffffff
+
+typedef struct frame_context_t {
+    serf_bucket_t *payload;
+    apr_uint32_t stream_id;
+    unsigned char type;
+    unsigned char flags;
+} frame_context_t;
+
+
+serf_bucket_t *serf_bucket_http2_frame_create(
+    serf_bucket_t *payload,
+    unsigned char frame_type,
+    unsigned char flags,
+    apr_uint32_t stream_id,
+    serf_bucket_alloc_t *allocator)
+{
+    frame_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->payload = payload;
+    ctx->stream_id = stream_id & STREAM_ID_MASK;
+    ctx->type = frame_type;
+    ctx->flags = flags;
+
+    return serf_bucket_create(&serf_bucket_type_http2_frame, allocator, ctx);
+}
+
+static void serialize_frame(serf_bucket_t *bucket)
+{
+    frame_context_t *ctx = bucket->data;
+    char header[SERF_HTTP2_FRAME_HEADER_SIZE];
+    apr_uint64_t len = 0;
+
+    if (ctx->payload)
+        len = serf_bucket_get_remaining(ctx->payload);
+
+    header[0] = (char)((len >> 16) & 0xff);
+    header[1] = (char)((len >> 8) & 0xff);
+    header[2] = (char)(len & 0xff);
+    header[3] = (char)ctx->type;
+    header[4] = (char)ctx->flags;
+    header[5] = (char)((ctx->stream_id >> 24) & 0xff);
+    header[6] = (char)((ctx->stream_id >> 16) & 0xff);
+    header[7] = (char)((ctx->stream_id >> 8) & 0xff);
+    header[8] = (char)(ctx->stream_id & 0xff);
+
+    /* Like the request bucket, become an aggregate so a pointer to this
+       bucket still represents the right data. */
+    serf_bucket_aggregate_become(bucket);
+
+    serf_bucket_aggregate_append(
+        bucket, serf_bucket_simple_copy_create(header, sizeof(header),
+                                               bucket->allocator));
+    if (ctx->payload)
+        serf_bucket_aggregate_append(bucket, ctx->payload);
+
+    serf_bucket_mem_free(bucket->allocator, ctx);
+}
+
+static apr_status_t serf_http2_frame_read(serf_bucket_t *bucket,
+                                          apr_size_t requested,
+                                          const char **data,
+                                          apr_size_t *len)
+{
+    serialize_frame(bucket);
+
+    return serf_bucket_read(bucket, requested, data, len);
+}
+
+static apr_status_t serf_http2_frame_readline(serf_bucket_t *bucket,
+                                              int acceptable, int *found,
+                                              const char **data,
+                                              apr_size_t *len)
+{
+    serialize_frame(bucket);
+
+    return serf_bucket_readline(bucket, acceptable, found, data, len);
+}
+
+static apr_status_t serf_http2_frame_read_iovec(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                int vecs_size,
+                                                struct iovec *vecs,
+                                                int *vecs_used)
+{
+    serialize_frame(bucket);
+
+    return serf_bucket_read_iovec(bucket, requested,
+                                  vecs_size, vecs, vecs_used);
+}
+
+static apr_status_t serf_http2_frame_peek(serf_bucket_t *bucket,
+                                          const char **data,
+                                          apr_size_t *len)
+{
+    serialize_frame(bucket);
+
+    return serf_bucket_peek(bucket, data, len);
+}
+
+/* Only called when the frame wasn't serialized yet. */
+static void serf_http2_frame_destroy(serf_bucket_t *bucket)
+{
+    frame_context_t *ctx = bucket->data;
+
+    if (ctx->payload)
+        serf_bucket_destroy(ctx->payload);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_uint64_t serf_http2_frame_get_remaining(serf_bucket_t *bucket)
+{
+    frame_context_t *ctx = bucket->data;
+
+    if (!ctx->payload)
+        return SERF_HTTP2_FRAME_HEADER_SIZE;
+
+    return SERF_HTTP2_FRAME_HEADER_SIZE
+           + serf_bucket_get_remaining(ctx->payload);
+}
+
+static apr_status_t serf_http2_frame_set_config(serf_bucket_t *bucket,
+                                                serf_config_t *config)
+{
+    frame_context_t *ctx = bucket->data;
+
+    if (!ctx->payload)
+        return APR_SUCCESS;
+
+    return serf_bucket_set_config(ctx->payload, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_http2_frame = {
+    "HTTP2-FRAME",
+    serf_http2_frame_read,
+    serf_http2_frame_readline,
+    serf_http2_frame_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_http2_frame_peek,
+    serf_http2_frame_destroy,
+    serf_default_read_bucket,
+    serf_http2_frame_get_remaining,
+    serf_http2_frame_set_config,
+};
+
+
+typedef struct unframe_context_t {
+    serf_bucket_t *stream;
+    apr_size_t max_payload_size;
+
+    /* The frame header, as far as we read it. */
+    char header[SERF_HTTP2_FRAME_HEADER_SIZE];
+    apr_size_t header_read;
+
+    apr_uint32_t stream_id;
+    unsigned char type;
+    unsigned char flags;
+
+    apr_size_t remaining;
+} unframe_context_t;
+
+
+serf_bucket_t *serf_bucket_http2_unframe_create(
+    serf_bucket_t *stream,
+    apr_size_t max_payload_size,
+    serf_bucket_alloc_t *allocator)
+{
+    unframe_context_t *ctx;
+
+    ctx = serf_bucket_mem_calloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->max_payload_size = max_payload_size;
+
+    return serf_bucket_create(&serf_bucket_type_http2_unframe, allocator,
+                              ctx);
+}
+
+static apr_status_t read_frame_header(unframe_context_t *ctx)
+{
+    const unsigned char *header;
+
+    while (ctx->header_read < SERF_HTTP2_FRAME_HEADER_SIZE) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_read(ctx->stream,
+                                  SERF_HTTP2_FRAME_HEADER_SIZE
+                                  - ctx->header_read,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        memcpy(ctx->header + ctx->header_read, data, len);
+        ctx->header_read += len;
+
+        if (ctx->header_read == SERF_HTTP2_FRAME_HEADER_SIZE)
+            break;
+
+        /* An EOF between frames is just the end of the stream. */
+        if (APR_STATUS_IS_EOF(status))
+            return ctx->header_read ? SERF_ERROR_TRUNCATED_HTTP_RESPONSE
+                                    : APR_EOF;
+        if (status)
+            return status;
+    }
+
+    header = (const unsigned char *)ctx->header;
+    ctx->remaining = ((apr_size_t)header[0] << 16)
+                     | ((apr_size_t)header[1] << 8)
+                     | header[2];
+    ctx->type = header[3];
+    ctx->flags = header[4];
+    ctx->stream_id = (((apr_uint32_t)header[5] << 24)
+                      | ((apr_uint32_t)header[6] << 16)
+                      | ((apr_uint32_t)header[7] << 8)
+                      | header[8]) & STREAM_ID_MASK;
+
+    if (ctx->remaining > ctx->max_payload_size)
+        return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_bucket_http2_unframe_read_info(
+    serf_bucket_t *bucket,
+    apr_uint32_t *stream_id,
+    unsigned char *frame_type,
+    unsigned char *flags)
+{
+    unframe_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->header_read < SERF_HTTP2_FRAME_HEADER_SIZE) {
+        status = read_frame_header(ctx);
+        if (status)
+            return status;
+    }
+
+    if (stream_id)
+        *stream_id = ctx->stream_id;
+    if (frame_type)
+        *frame_type = ctx->type;
+    if (flags)
+        *flags = ctx->flags;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_http2_unframe_read(serf_bucket_t *bucket,
+                                            apr_size_t requested,
+                                            const char **data,
+                                            apr_size_t *len)
+{
+    unframe_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *len = 0;
+
+    if (ctx->header_read < SERF_HTTP2_FRAME_HEADER_SIZE) {
+        status = read_frame_header(ctx);
+        if (status)
+            return status;
+    }
+
+    if (!ctx->remaining)
+        return APR_EOF;
+
+    if (requested == SERF_READ_ALL_AVAIL || requested > ctx->remaining)
+        requested = ctx->remaining;
+
+    status = serf_bucket_read(ctx->stream, requested, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    ctx->remaining -= *len;
+
+    if (!ctx->remaining)
+        return APR_EOF;
+    if (APR_STATUS_IS_EOF(status))
+        return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+
+    return status;
+}
+
+static apr_status_t serf_http2_unframe_readline(serf_bucket_t *bucket,
+                                                int acceptable, int *found,
+                                                const char **data,
+                                                apr_size_t *len)
+{
+    unframe_context_t *ctx = bucket->data;
+    const char *peek_data, *rest;
+    apr_size_t peek_len, rest_len;
+    apr_status_t status;
+
+    *found = SERF_NEWLINE_NONE;
+    *len = 0;
+
+    if (ctx->header_read < SERF_HTTP2_FRAME_HEADER_SIZE) {
+        status = read_frame_header(ctx);
+        if (status)
+            return status;
+    }
+
+    if (!ctx->remaining)
+        return APR_EOF;
+
+    /* Find the line in what's available of this frame, then consume
+       just that. */
+    status = serf_bucket_peek(ctx->stream, &peek_data, &peek_len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    if (peek_len > ctx->remaining)
+        peek_len = ctx->remaining;
+
+    if (!peek_len)
+        return APR_STATUS_IS_EOF(status) ? SERF_ERROR_TRUNCATED_HTTP_RESPONSE
+                                         : status;
+
+    rest = peek_data;
+    rest_len = peek_len;
+    serf_util_readline(&rest, &rest_len, acceptable, found);
+
+    return serf_http2_unframe_read(bucket, peek_len - rest_len, data, len);
+}
+
+static apr_status_t serf_http2_unframe_peek(serf_bucket_t *bucket,
+                                            const char **data,
+                                            apr_size_t *len)
+{
+    unframe_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *len = 0;
+
+    if (ctx->header_read < SERF_HTTP2_FRAME_HEADER_SIZE) {
+        status = read_frame_header(ctx);
+        if (status)
+            return status;
+    }
+
+    if (!ctx->remaining)
+        return APR_EOF;
+
+    status = serf_bucket_peek(ctx->stream, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    if (*len >= ctx->remaining) {
+        *len = ctx->remaining;
+        return APR_EOF;
+    }
+
+    return APR_STATUS_IS_EOF(status) ? SERF_ERROR_TRUNCATED_HTTP_RESPONSE
+                                     : status;
+}
+
+static apr_uint64_t serf_http2_unframe_get_remaining(serf_bucket_t *bucket)
+{
+    unframe_context_t *ctx = bucket->data;
+
+    if (ctx->header_read < SERF_HTTP2_FRAME_HEADER_SIZE)
+        return SERF_LENGTH_UNKNOWN;
+
+    return ctx->remaining;
+}
+
+static apr_status_t serf_http2_unframe_set_config(serf_bucket_t *bucket,
+                                                  serf_config_t *config)
+{
+    unframe_context_t *ctx = bucket->data;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+/* The stream outlives the frames read from it, so it is left alone. */
+const serf_bucket_type_t serf_bucket_type_http2_unframe = {
+    "HTTP2-UNFRAME",
+    serf_http2_unframe_read,
+    serf_http2_unframe_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_http2_unframe_peek,
+    serf_default_destroy_and_data,
+    serf_default_read_bucket,
+    serf_http2_unframe_get_remaining,
+    serf_http2_unframe_set_config,
+};
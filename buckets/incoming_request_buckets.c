@@ -0,0 +1,457 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_lib.h>
+#include <apr_strings.h>
+#include <apr_date.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+/* Parses a request as a server receives it. This is the counterpart of
+   the response bucket in response_buckets.c, and works the same way: the
+   request line and the headers are read first, then the body is read
+   through the bucket. */
+typedef struct incoming_request_context_t {
+    serf_bucket_t *stream;
+    serf_bucket_t *body;        /* Pointer to the stream wrapping the body. */
+    serf_bucket_t *headers;     /* holds parsed headers */
+
+    enum {
+        STATE_REQUEST_LINE,     /* reading request line */
+        STATE_HEADERS,          /* reading headers */
+        STATE_BODY,             /* reading body */
+        STATE_TRAILERS,         /* reading trailers */
+        STATE_DONE              /* we've sent EOF */
+    } state;
+
+    serf_request_line rl;
+
+    int chunked;                /* Do we need to read trailers? */
+
+    serf_config_t *config;
+
+    /* Buffer for accumulating a line from the request. */
+    serf_linebuf_t linebuf;
+} incoming_request_context_t;
+
+serf_bucket_t *serf_bucket_incoming_request_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+    incoming_request_context_t *ctx;
+
+    ctx = serf_bucket_mem_calloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->headers = serf_bucket_headers_create(allocator);
+    ctx->state = STATE_REQUEST_LINE;
+
+    serf_linebuf_init(&ctx->linebuf);
+
+    return serf_bucket_create(&serf_bucket_type_incoming_request, allocator,
+                              ctx);
+}
+
+serf_bucket_t *serf_bucket_incoming_request_get_headers(
+    serf_bucket_t *bucket)
+{
+    return ((incoming_request_context_t *)bucket->data)->headers;
+}
+
+static void serf_incoming_request_destroy_and_data(serf_bucket_t *bucket)
+{
+    incoming_request_context_t *ctx = bucket->data;
+
+    if (ctx->state != STATE_REQUEST_LINE) {
+        serf_bucket_mem_free(bucket->allocator, (void*)ctx->rl.method);
+        serf_bucket_mem_free(bucket->allocator, (void*)ctx->rl.uri);
+    }
+
+    serf_bucket_destroy(ctx->stream);
+    if (ctx->body != NULL)
+        serf_bucket_destroy(ctx->body);
+    serf_bucket_destroy(ctx->headers);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t fetch_line(incoming_request_context_t *ctx,
+                               int acceptable)
+{
+    return serf_linebuf_fetch(&ctx->linebuf, ctx->stream, acceptable);
+}
+
+static apr_status_t parse_request_line(incoming_request_context_t *ctx,
+                                       serf_bucket_alloc_t *allocator)
+{
+    const char *line = ctx->linebuf.line;
+    const char *end = line + ctx->linebuf.used;
+    const char *uri, *version;
+
+    /* ctx->linebuf.line should be of form: 'GET /path HTTP/1.1'. */
+    uri = memchr(line, ' ', end - line);
+    if (!uri || uri == line)
+        return SERF_ERROR_BAD_HTTP_REQUEST;
+    uri++;
+
+    version = memchr(uri, ' ', end - uri);
+    if (!version || version == uri)
+        return SERF_ERROR_BAD_HTTP_REQUEST;
+    version++;
+
+    if (end - version != 8 || !apr_date_checkmask(version, "HTTP/#.#"))
+        return SERF_ERROR_BAD_HTTP_REQUEST;
+
+    ctx->rl.version = SERF_HTTP_VERSION(version[5] - '0', version[7] - '0');
+    ctx->rl.method = serf_bstrmemdup(allocator, line, uri - 1 - line);
+    ctx->rl.uri = serf_bstrmemdup(allocator, uri, version - 1 - uri);
+
+    return APR_SUCCESS;
+}
+
+/* Reads one header line into the headers bucket, like fetch_headers() in
+   response_buckets.c. */
+static apr_status_t fetch_headers(serf_bucket_t *bkt,
+                                  incoming_request_context_t *ctx)
+{
+    apr_status_t status;
+
+    status = fetch_line(ctx, SERF_NEWLINE_ANY);
+    if (status == SERF_ERROR_LINE_TOO_LONG)
+        return SERF_ERROR_BAD_HTTP_REQUEST;
+    else if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    if (ctx->linebuf.state == SERF_LINEBUF_READY && ctx->linebuf.used) {
+        const char *end_key;
+        const char *c;
+
+        end_key = c = memchr(ctx->linebuf.line, ':', ctx->linebuf.used);
+        if (!c)
+            return SERF_ERROR_BAD_HTTP_REQUEST;
+
+        /* Skip over initial ':' and all whitespaces. */
+        for (c++; c < ctx->linebuf.line + ctx->linebuf.used; c++) {
+            if (!apr_isspace(*c))
+                break;
+        }
+
+        serf_bucket_headers_setx(
+            ctx->headers,
+            ctx->linebuf.line, end_key - ctx->linebuf.line, 1,
+            c, ctx->linebuf.line + ctx->linebuf.used - c, 1);
+    }
+
+    return status;
+}
+
+static apr_status_t run_machine(serf_bucket_t *bkt,
+                                incoming_request_context_t *ctx)
+{
+    apr_status_t status = APR_SUCCESS;
+
+    switch (ctx->state) {
+    case STATE_REQUEST_LINE:
+        status = fetch_line(ctx, SERF_NEWLINE_ANY);
+        if (status == SERF_ERROR_LINE_TOO_LONG)
+            return SERF_ERROR_BAD_HTTP_REQUEST;
+        else if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        if (ctx->linebuf.state == SERF_LINEBUF_READY) {
+            /* RFC 7230 3.5: ignore the empty lines some clients send
+               after the body of the previous request. */
+            if (!ctx->linebuf.used)
+                break;
+
+            status = parse_request_line(ctx, bkt->allocator);
+            if (status)
+                return status;
+
+            ctx->state = STATE_HEADERS;
+        }
+        else if (APR_STATUS_IS_EOF(status) && ctx->linebuf.used) {
+            /* The client closed the connection in the middle of the
+               request line. A close before it is just APR_EOF, the
+               normal end of a keepalive connection. */
+            return SERF_ERROR_BAD_HTTP_REQUEST;
+        }
+        break;
+    case STATE_HEADERS:
+        status = fetch_headers(bkt, ctx);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        /* If an empty line was read, then we hit the end of the headers.
+         * Move on to the body.
+         */
+        if (ctx->linebuf.state == SERF_LINEBUF_READY && !ctx->linebuf.used) {
+            const char *v;
+
+            ctx->state = STATE_BODY;
+
+            /* Unlike a response, a request without Content-Length or
+               chunked encoding has no body. */
+            v = serf_bucket_headers_get(ctx->headers, "Transfer-Encoding");
+            if (v && strcasecmp("chunked", v) == 0) {
+                ctx->chunked = 1;
+                ctx->body =
+                    serf_bucket_barrier_create(ctx->stream, bkt->allocator);
+                ctx->body = serf_bucket_dechunk_create(ctx->body,
+                                                       bkt->allocator);
+                break;
+            }
+            else if (v) {
+                /* We can't tell where the body ends. */
+                return SERF_ERROR_BAD_HTTP_REQUEST;
+            }
+
+            v = serf_bucket_headers_get(ctx->headers, "Content-Length");
+            if (v) {
+                apr_int64_t length;
+                char *end;
+
+                length = apr_strtoi64(v, &end, 10);
+                if (errno == ERANGE || end == v || *end || length < 0)
+                    return SERF_ERROR_BAD_HTTP_REQUEST;
+
+                ctx->body =
+                    serf_bucket_barrier_create(ctx->stream, bkt->allocator);
+                ctx->body = serf_bucket_response_body_create(
+                              ctx->body, length, bkt->allocator);
+            }
+            else {
+                ctx->body = serf_bucket_simple_create(NULL, 0, NULL, NULL,
+                                                      bkt->allocator);
+            }
+        }
+        else if (APR_STATUS_IS_EOF(status)) {
+            return SERF_ERROR_BAD_HTTP_REQUEST;
+        }
+        break;
+    case STATE_BODY:
+        /* Don't do anything. */
+        break;
+    case STATE_TRAILERS:
+        status = fetch_headers(bkt, ctx);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        /* If an empty line was read, then we're done. */
+        if (ctx->linebuf.state == SERF_LINEBUF_READY && !ctx->linebuf.used) {
+            ctx->state = STATE_DONE;
+            return APR_EOF;
+        }
+        if (APR_STATUS_IS_EOF(status))
+            return SERF_ERROR_BAD_HTTP_REQUEST;
+        break;
+    case STATE_DONE:
+        return APR_EOF;
+    default:
+        /* Not reachable */
+        return APR_EGENERAL;
+    }
+
+    return status;
+}
+
+static apr_status_t wait_for_body(serf_bucket_t *bkt,
+                                  incoming_request_context_t *ctx)
+{
+    apr_status_t status;
+
+    /* Keep reading and moving through states if we aren't at the BODY */
+    while (ctx->state < STATE_BODY) {
+        status = run_machine(bkt, ctx);
+
+        /* Anything other than APR_SUCCESS means that we cannot immediately
+         * read again (for now).
+         */
+        if (status)
+            return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_bucket_incoming_request_wait_for_headers(
+    serf_bucket_t *bucket)
+{
+    incoming_request_context_t *ctx = bucket->data;
+
+    return wait_for_body(bucket, ctx);
+}
+
+apr_status_t serf_bucket_incoming_request_line(
+    serf_bucket_t *bkt,
+    serf_request_line *rline)
+{
+    incoming_request_context_t *ctx = bkt->data;
+    apr_status_t status;
+
+    if (ctx->state != STATE_REQUEST_LINE) {
+        *rline = ctx->rl;
+        return APR_SUCCESS;
+    }
+
+    /* Like serf_bucket_response_status(), running the machine once is
+       enough to tell whether the line is there. */
+    status = run_machine(bkt, ctx);
+    if (ctx->state == STATE_HEADERS) {
+        *rline = ctx->rl;
+    }
+    else {
+        /* Indicate that we don't have the information yet. */
+        rline->version = 0;
+    }
+
+    return status;
+}
+
+/* Reads the trailers of a chunked body, up to the end of the request. */
+static apr_status_t read_trailers(serf_bucket_t *bucket,
+                                  incoming_request_context_t *ctx)
+{
+    while (1) {
+        apr_status_t status = run_machine(bucket, ctx);
+
+        if (status)
+            return status;
+    }
+}
+
+/* Turns the STATUS of a read from the body into the status of a read from
+   the request. */
+static apr_status_t body_status(serf_bucket_t *bucket,
+                                incoming_request_context_t *ctx,
+                                apr_status_t status,
+                                int got_data)
+{
+    /* The client closed the connection before the end of the body. */
+    if (status == SERF_ERROR_TRUNCATED_HTTP_RESPONSE)
+        return SERF_ERROR_BAD_HTTP_REQUEST;
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+
+    if (!ctx->chunked) {
+        ctx->state = STATE_DONE;
+        return APR_EOF;
+    }
+
+    /* The trailers come from the stream, which may reuse the buffer of
+       the data just read. Leave them for the next read then. */
+    ctx->state = STATE_TRAILERS;
+    if (got_data)
+        return APR_SUCCESS;
+
+    return read_trailers(bucket, ctx);
+}
+
+static apr_status_t serf_incoming_request_read(serf_bucket_t *bucket,
+                                               apr_size_t requested,
+                                               const char **data,
+                                               apr_size_t *len)
+{
+    incoming_request_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *len = 0;
+
+    if (ctx->state == STATE_TRAILERS || ctx->state == STATE_DONE)
+        return read_trailers(bucket, ctx);
+
+    status = wait_for_body(bucket, ctx);
+    if (status)
+        return status;
+
+    status = serf_bucket_read(ctx->body, requested, data, len);
+
+    return body_status(bucket, ctx, status, *len != 0);
+}
+
+static apr_status_t serf_incoming_request_read_iovec(serf_bucket_t *bucket,
+                                                     apr_size_t requested,
+                                                     int vecs_size,
+                                                     struct iovec *vecs,
+                                                     int *vecs_used)
+{
+    incoming_request_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *vecs_used = 0;
+
+    if (ctx->state == STATE_TRAILERS || ctx->state == STATE_DONE)
+        return read_trailers(bucket, ctx);
+
+    status = wait_for_body(bucket, ctx);
+    if (status)
+        return status;
+
+    status = serf_bucket_read_iovec(ctx->body, requested, vecs_size, vecs,
+                                    vecs_used);
+
+    return body_status(bucket, ctx, status, *vecs_used != 0);
+}
+
+static apr_status_t serf_incoming_request_readline(serf_bucket_t *bucket,
+                                                   int acceptable, int *found,
+                                                   const char **data,
+                                                   apr_size_t *len)
+{
+    incoming_request_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    *len = 0;
+    *found = SERF_NEWLINE_NONE;
+
+    if (ctx->state == STATE_TRAILERS || ctx->state == STATE_DONE)
+        return read_trailers(bucket, ctx);
+
+    status = wait_for_body(bucket, ctx);
+    if (status)
+        return status;
+
+    status = serf_bucket_readline(ctx->body, acceptable, found, data, len);
+
+    return body_status(bucket, ctx, status, *len != 0);
+}
+
+static apr_status_t serf_incoming_request_set_config(serf_bucket_t *bucket,
+                                                     serf_config_t *config)
+{
+    incoming_request_context_t *ctx = bucket->data;
+
+    ctx->config = config;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+/* ### need to implement */
+#define serf_incoming_request_peek NULL
+
+const serf_bucket_type_t serf_bucket_type_incoming_request = {
+    "INCOMING-REQUEST",
+    serf_incoming_request_read,
+    serf_incoming_request_readline,
+    serf_incoming_request_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_incoming_request_peek,
+    serf_incoming_request_destroy_and_data,
+    serf_default_read_bucket,
+    NULL,
+    serf_incoming_request_set_config,
+};
@@ -107,6 +107,15 @@ static apr_status_t serf_limit_peek(serf_bucket_t *bucket,
     return serf_bucket_peek(ctx->stream, data, len);
 }
 
+static serf_bucket_t *serf_limit_read_bucket(serf_bucket_t *bucket,
+                                             const serf_bucket_type_t *type)
+{
+    limit_context_t *ctx = bucket->data;
+
+    return serf__bucket_read_bucket_limited(ctx->stream, type,
+                                            &ctx->remaining);
+}
+
 static void serf_limit_destroy(serf_bucket_t *bucket)
 {
     limit_context_t *ctx = bucket->data;
@@ -119,6 +128,11 @@ static void serf_limit_destroy(serf_bucket_t *bucket)
 static apr_uint64_t serf_limit_get_remaining(serf_bucket_t *bucket)
 {
     limit_context_t *ctx = bucket->data;
+    apr_uint64_t remaining = serf_bucket_get_remaining(ctx->stream);
+
+    /* The stream may end before the limit. */
+    if (remaining != SERF_LENGTH_UNKNOWN && remaining < ctx->remaining)
+        return remaining;
 
     return ctx->remaining;
 }
@@ -142,7 +156,7 @@ const serf_bucket_type_t serf_bucket_type_limit = {
     serf_buckets_are_v2,
     serf_limit_peek,
     serf_limit_destroy,
-    serf_default_read_bucket,
+    serf_limit_read_bucket,
     serf_limit_get_remaining,
     serf_limit_set_config,
 };
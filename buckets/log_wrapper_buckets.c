@@ -81,16 +81,20 @@ serf_log_wrapped_read_iovec(serf_bucket_t *bucket,
         serf__log(LOGLVL_ERROR, LOGCOMP_CONN, ctx->prefix, ctx->config,
                   "Error %d while reading.\n", status);
 
-    for (i = 0, len = 0; i < *vecs_used; i++)
-        len += vecs[i].iov_len;
-    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, ctx->prefix, ctx->config,
-              "--- %d bytes. --\n", len);
-
-    for (i = 0; i < *vecs_used; i++) {
-        serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, ctx->config,
-                         "%.*s", vecs[i].iov_len, vecs[i].iov_base);
+    if (serf__log_enabled(LOGLVL_DEBUG, LOGCOMP_CONN, ctx->config)) {
+        for (i = 0, len = 0; i < *vecs_used; i++)
+            len += vecs[i].iov_len;
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, ctx->prefix, ctx->config,
+                  "--- %d bytes. --\n", len);
+    }
+
+    if (serf__log_enabled(LOGLVL_DEBUG, LOGCOMP_RAWMSG, ctx->config)) {
+        for (i = 0; i < *vecs_used; i++) {
+            serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, ctx->config,
+                             "%.*s", vecs[i].iov_len, vecs[i].iov_base);
+        }
+        serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, ctx->config, "\n");
     }
-    serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, ctx->config, "\n");
 
     return status;
 }
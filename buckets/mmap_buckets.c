@@ -21,11 +21,26 @@
 
 #if APR_HAS_MMAP
 
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+/* Windows are mapped at multiples of this size, which is a multiple of the
+   page size (and of the allocation granularity on Windows). */
+#define WINDOW_ALIGN (64 * 1024)
+
 typedef struct mmap_context_t {
     apr_mmap_t *mmap;
     void *current;
     apr_off_t offset;
     apr_off_t remaining;
+
+    /* The rest is only used when mapping FILE one window at a time. MMAP
+       then holds the current window, starting at FILE_OFFSET. */
+    apr_file_t *file;
+    apr_off_t file_offset;
+    apr_size_t window_size;
+    apr_pool_t *window_pool;
 } mmap_context_t;
 
 
@@ -40,18 +55,116 @@ serf_bucket_t *serf_bucket_mmap_create(
     ctx->current = NULL;
     ctx->offset = 0;
     ctx->remaining = ctx->mmap->size;
+    ctx->file = NULL;
 
     return serf_bucket_create(&serf_bucket_type_mmap, allocator, ctx);
 }
 
+serf_bucket_t *serf_bucket_mmap_window_create(
+    apr_file_t *file,
+    apr_size_t window_size,
+    serf_bucket_alloc_t *allocator)
+{
+    mmap_context_t *ctx;
+    apr_finfo_t finfo;
+    apr_off_t pos = 0;
+    apr_status_t status;
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if (!status)
+        status = apr_file_seek(file, APR_CUR, &pos);
+    if (status || pos > finfo.size)
+        return serf_bucket_file_create(file, allocator);
+
+    if (window_size == 0)
+        window_size = SERF_MMAP_WINDOW_DEFAULT;
+    window_size = (window_size + WINDOW_ALIGN - 1) / WINDOW_ALIGN
+                  * WINDOW_ALIGN;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->mmap = NULL;
+    ctx->current = NULL;
+    ctx->remaining = finfo.size - pos;
+    ctx->file = file;
+    ctx->window_size = window_size;
+
+    /* Start with the window that holds the current position. */
+    ctx->offset = pos % window_size;
+    ctx->file_offset = pos - ctx->offset;
+
+    /* Each window gets mapped in a cleared pool, so we don't leak an
+       apr_mmap_t per window. */
+    apr_pool_create(&ctx->window_pool,
+                    serf_bucket_allocator_get_pool(allocator));
+
+    return serf_bucket_create(&serf_bucket_type_mmap, allocator, ctx);
+}
+
+/* In window mode, make sure the data at the read position is mapped. */
+static apr_status_t prepare_window(mmap_context_t *ctx)
+{
+    apr_size_t size;
+    apr_status_t status;
+
+    if (!ctx->file || ctx->remaining == 0)
+        return APR_SUCCESS;
+
+    if (ctx->mmap && ctx->offset < (apr_off_t)ctx->mmap->size)
+        return APR_SUCCESS;
+
+    /* We're done with this window, unmap it and move on to the next. */
+    if (ctx->mmap) {
+        ctx->file_offset += ctx->mmap->size;
+        ctx->offset = 0;
+        apr_mmap_delete(ctx->mmap);
+        ctx->mmap = NULL;
+        apr_pool_clear(ctx->window_pool);
+    }
+
+    if (ctx->remaining > (apr_off_t)ctx->window_size - ctx->offset)
+        size = ctx->window_size;
+    else
+        size = (apr_size_t)(ctx->offset + ctx->remaining);
+
+    status = apr_mmap_create(&ctx->mmap, ctx->file, ctx->file_offset, size,
+                             APR_MMAP_READ, ctx->window_pool);
+    if (status) {
+        ctx->mmap = NULL;
+        return status;
+    }
+
+#ifdef POSIX_MADV_SEQUENTIAL
+    /* We read front to back; let the kernel read ahead aggressively. */
+    posix_madvise(ctx->mmap->mm, size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t serf_mmap_read(serf_bucket_t *bucket,
                                      apr_size_t requested,
                                      const char **data, apr_size_t *len)
 {
     mmap_context_t *ctx = bucket->data;
+    apr_size_t avail;
+    apr_status_t status;
+
+    if (ctx->remaining == 0) {
+        *len = 0;
+        return APR_EOF;
+    }
+
+    status = prepare_window(ctx);
+    if (status) {
+        *len = 0;
+        return status;
+    }
+
+    /* What's left in the mapped data. */
+    avail = (apr_size_t)(ctx->mmap->size - ctx->offset);
 
-    if (requested == SERF_READ_ALL_AVAIL || requested > ctx->remaining) {
-        *len = ctx->remaining;
+    if (requested == SERF_READ_ALL_AVAIL || requested > avail) {
+        *len = avail;
     }
     else {
         *len = requested;
@@ -76,6 +189,20 @@ static apr_status_t serf_mmap_readline(serf_bucket_t *bucket,
 {
     mmap_context_t *ctx = bucket->data;
     const char *end;
+    apr_status_t status;
+
+    if (ctx->remaining == 0) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        return APR_EOF;
+    }
+
+    status = prepare_window(ctx);
+    if (status) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        return status;
+    }
 
     /* ### Would it be faster to call this once and do the offset ourselves? */
     apr_mmap_offset((void**)data, ctx->mmap, ctx->offset);
@@ -84,7 +211,7 @@ static apr_status_t serf_mmap_readline(serf_bucket_t *bucket,
     /* XXX An overflow is generated if we pass &ctx->remaining to readline.
      * Not real clear why.
      */
-    *len = ctx->remaining;
+    *len = (apr_size_t)(ctx->mmap->size - ctx->offset);
 
     serf_util_readline(&end, len, acceptable, found);
 
@@ -104,13 +231,39 @@ static apr_status_t serf_mmap_peek(serf_bucket_t *bucket,
                                      apr_size_t *len)
 {
     mmap_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (ctx->remaining == 0) {
+        *len = 0;
+        return APR_EOF;
+    }
+
+    status = prepare_window(ctx);
+    if (status) {
+        *len = 0;
+        return status;
+    }
 
     /* return whatever we have left */
     apr_mmap_offset((void**)data, ctx->mmap, ctx->offset);
-    *len = ctx->remaining;
+    *len = (apr_size_t)(ctx->mmap->size - ctx->offset);
 
-    /* we returned everything this bucket will ever hold */
-    return APR_EOF;
+    /* did we return everything this bucket will ever hold? */
+    return (apr_off_t)*len == ctx->remaining ? APR_EOF : APR_SUCCESS;
+}
+
+static void serf_mmap_destroy(serf_bucket_t *bucket)
+{
+    mmap_context_t *ctx = bucket->data;
+
+    /* In window mode, the mmap is ours. */
+    if (ctx->file) {
+        if (ctx->mmap)
+            apr_mmap_delete(ctx->mmap);
+        apr_pool_destroy(ctx->window_pool);
+    }
+
+    serf_default_destroy_and_data(bucket);
 }
 
 static apr_uint64_t serf_mmap_get_remaining(serf_bucket_t *bucket)
@@ -127,7 +280,7 @@ const serf_bucket_type_t serf_bucket_type_mmap = {
     serf_default_read_for_sendfile,
     serf_buckets_are_v2,
     serf_mmap_peek,
-    serf_default_destroy_and_data,
+    serf_mmap_destroy,
     serf_default_read_bucket,
     serf_mmap_get_remaining,
     serf_default_ignore_config,
@@ -141,6 +294,14 @@ serf_bucket_t *serf_bucket_mmap_create(apr_mmap_t *file_mmap,
     return NULL;
 }
 
+serf_bucket_t *serf_bucket_mmap_window_create(
+    apr_file_t *file,
+    apr_size_t window_size,
+    serf_bucket_alloc_t *allocator)
+{
+    return serf_bucket_file_create(file, allocator);
+}
+
 const serf_bucket_type_t serf_bucket_type_mmap = {
     "MMAP",
     NULL,
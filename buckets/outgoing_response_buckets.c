@@ -0,0 +1,273 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+/* Serializes a response as a server sends it. This is the counterpart of
+   the request bucket in request_buckets.c: on the first read it becomes
+   an aggregate of the status line, the headers and the framed body. */
+typedef struct outgoing_response_context_t {
+    int code;
+    const char *reason;
+    int version;
+    serf_bucket_t *headers;
+    serf_bucket_t *body;
+    serf_config_t *config;
+} outgoing_response_context_t;
+
+serf_bucket_t *serf_bucket_outgoing_response_create(
+    serf_bucket_t *body,
+    int code,
+    const char *reason,
+    int http_version,
+    serf_bucket_alloc_t *allocator)
+{
+    outgoing_response_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->code = code;
+    ctx->reason = reason;
+    ctx->version = http_version;
+    ctx->headers = serf_bucket_headers_create(allocator);
+    ctx->body = body;
+    ctx->config = NULL;
+
+    return serf_bucket_create(&serf_bucket_type_outgoing_response, allocator,
+                              ctx);
+}
+
+serf_bucket_t *serf_bucket_outgoing_response_get_headers(
+    serf_bucket_t *bucket)
+{
+    return ((outgoing_response_context_t *)bucket->data)->headers;
+}
+
+static const char *default_reason(int code)
+{
+    switch (code) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        default:  return "Unknown";
+    }
+}
+
+static void serialize_data(serf_bucket_t *bucket)
+{
+    outgoing_response_context_t *ctx = bucket->data;
+    serf_bucket_t *new_bucket;
+    char buf[64];
+    char *line;
+    apr_size_t len;
+    struct iovec iov[3];
+
+    /* Create a bucket for the status line. A HTTP/1.0 client gets a
+       HTTP/1.0 response, so it doesn't see features it may not know. */
+    len = apr_snprintf(buf, sizeof(buf), "HTTP/%d.%d %03d ",
+                       SERF_HTTP_VERSION_MAJOR(ctx->version),
+                       SERF_HTTP_VERSION_MINOR(ctx->version),
+                       ctx->code);
+    if (!ctx->reason)
+        ctx->reason = default_reason(ctx->code);
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (char*)ctx->reason;
+    iov[1].iov_len = strlen(ctx->reason);
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = sizeof("\r\n") - 1;
+
+    line = serf_bstrcatv(bucket->allocator, iov, 3, &len);
+    new_bucket = serf_bucket_simple_own_create(line, len, bucket->allocator);
+
+    /* Note that self needs to become an aggregate bucket so that a
+     * pointer to self still represents the "right" data.
+     */
+    serf_bucket_aggregate_become(bucket);
+
+    serf_bucket_aggregate_append(bucket, new_bucket);
+    serf_bucket_aggregate_append(bucket, ctx->headers);
+
+    /* 1xx, 204 and 304 responses never have a body. */
+    if ((ctx->code >= 100 && ctx->code < 200)
+        || ctx->code == 204 || ctx->code == 304) {
+        if (ctx->body)
+            serf_bucket_destroy(ctx->body);
+    }
+    /* The caller did its own framing, e.g. for a response to HEAD. */
+    else if (serf_bucket_headers_get(ctx->headers, "Content-Length")
+             || serf_bucket_headers_get(ctx->headers, "Transfer-Encoding")) {
+        if (ctx->body)
+            serf_bucket_aggregate_append(bucket, ctx->body);
+    }
+    else if (!ctx->body) {
+        serf_bucket_headers_setn(ctx->headers, "Content-Length", "0");
+    }
+    else {
+        apr_uint64_t remaining = serf_bucket_get_remaining(ctx->body);
+
+        /* If we know the length, then use C-L and the raw body. Otherwise,
+           use chunked encoding, or for HTTP/1.0 end the body by closing
+           the connection. */
+        if (remaining != SERF_LENGTH_UNKNOWN) {
+            apr_snprintf(buf, sizeof(buf), "%" APR_UINT64_T_FMT, remaining);
+            serf_bucket_headers_set(ctx->headers, "Content-Length", buf);
+        }
+        else if (ctx->version >= SERF_HTTP_11) {
+            serf_bucket_headers_setn(ctx->headers, "Transfer-Encoding",
+                                     "chunked");
+            ctx->body = serf_bucket_chunk_create(ctx->body,
+                                                 bucket->allocator);
+        }
+        serf_bucket_aggregate_append(bucket, ctx->body);
+    }
+
+    /* Our private context is no longer needed, and is not referred to by
+     * any existing bucket. Toss it.
+     */
+    serf_bucket_mem_free(bucket->allocator, ctx);
+}
+
+int serf__bucket_outgoing_response_closes(serf_bucket_t *bucket)
+{
+    outgoing_response_context_t *ctx = bucket->data;
+    const char *v;
+
+    v = serf_bucket_headers_get(ctx->headers, "Connection");
+    if (v && strcasecmp(v, "close") == 0)
+        return 1;
+
+    /* Without a length or chunking, the body ends when the connection is
+       closed. */
+    if (ctx->version < SERF_HTTP_11 && ctx->body
+        && serf_bucket_get_remaining(ctx->body) == SERF_LENGTH_UNKNOWN
+        && !serf_bucket_headers_get(ctx->headers, "Content-Length"))
+        return 1;
+
+    return 0;
+}
+
+static apr_status_t serf_outgoing_response_read(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                const char **data,
+                                                apr_size_t *len)
+{
+    /* Seralize our private data into a new aggregate bucket. */
+    serialize_data(bucket);
+
+    /* Delegate to the "new" aggregate bucket to do the read. */
+    return serf_bucket_read(bucket, requested, data, len);
+}
+
+static apr_status_t serf_outgoing_response_readline(serf_bucket_t *bucket,
+                                                    int acceptable,
+                                                    int *found,
+                                                    const char **data,
+                                                    apr_size_t *len)
+{
+    serialize_data(bucket);
+
+    return serf_bucket_readline(bucket, acceptable, found, data, len);
+}
+
+static apr_status_t serf_outgoing_response_read_iovec(serf_bucket_t *bucket,
+                                                      apr_size_t requested,
+                                                      int vecs_size,
+                                                      struct iovec *vecs,
+                                                      int *vecs_used)
+{
+    serialize_data(bucket);
+
+    return serf_bucket_read_iovec(bucket, requested,
+                                  vecs_size, vecs, vecs_used);
+}
+
+static apr_status_t serf_outgoing_response_read_for_sendfile(
+    serf_bucket_t *bucket,
+    apr_size_t requested,
+    apr_hdtr_t *hdtr,
+    apr_file_t **file,
+    apr_off_t *offset,
+    apr_size_t *len)
+{
+    /* The aggregate hands out the file of a file bucket body. */
+    serialize_data(bucket);
+
+    return serf_bucket_read_for_sendfile(bucket, requested, hdtr,
+                                         file, offset, len);
+}
+
+static apr_status_t serf_outgoing_response_peek(serf_bucket_t *bucket,
+                                                const char **data,
+                                                apr_size_t *len)
+{
+    serialize_data(bucket);
+
+    return serf_bucket_peek(bucket, data, len);
+}
+
+/* Note that this function is only called when serialize_data()
+   hasn't been called on the bucket */
+static void serf_outgoing_response_destroy(serf_bucket_t *bucket)
+{
+    outgoing_response_context_t *ctx = bucket->data;
+
+    serf_bucket_destroy(ctx->headers);
+
+    if (ctx->body)
+        serf_bucket_destroy(ctx->body);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_outgoing_response_set_config(serf_bucket_t *bucket,
+                                                      serf_config_t *config)
+{
+    outgoing_response_context_t *ctx = bucket->data;
+
+    ctx->config = config;
+
+    return serf_bucket_set_config(ctx->headers, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_outgoing_response = {
+    "OUTGOING-RESPONSE",
+    serf_outgoing_response_read,
+    serf_outgoing_response_readline,
+    serf_outgoing_response_read_iovec,
+    serf_outgoing_response_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_outgoing_response_peek,
+    serf_outgoing_response_destroy,
+    serf_default_read_bucket,
+    NULL,
+    serf_outgoing_response_set_config,
+};
@@ -18,6 +18,7 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 
 typedef struct request_context_t {
@@ -87,6 +88,25 @@ void serf_bucket_request_set_root(
                         NULL);
 }
 
+void serf__bucket_request_read(serf_bucket_t *bucket,
+                               serf_bucket_t **body_bkt,
+                               const char **uri,
+                               const char **method,
+                               apr_int64_t *content_length)
+{
+    request_context_t *ctx = (request_context_t *)bucket->data;
+
+    *uri = ctx->uri;
+    *method = ctx->method;
+    *content_length = ctx->len;
+
+    /* The caller owns the body now. */
+    if (body_bkt) {
+        *body_bkt = ctx->body;
+        ctx->body = NULL;
+    }
+}
+
 static void serialize_data(serf_bucket_t *bucket)
 {
     request_context_t *ctx = bucket->data;
@@ -17,6 +17,7 @@
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 /* Older versions of APR do not have this macro.  */
 #ifdef APR_SIZE_MAX
@@ -115,6 +116,23 @@ static apr_status_t serf_response_body_peek(serf_bucket_t *bucket,
     return serf_bucket_peek(ctx->stream, data, len);
 }
 
+static serf_bucket_t *serf_response_body_read_bucket(
+    serf_bucket_t *bucket,
+    const serf_bucket_type_t *type)
+{
+    body_context_t *ctx = bucket->data;
+
+    return serf__bucket_read_bucket_limited(ctx->stream, type,
+                                            &ctx->remaining);
+}
+
+static apr_uint64_t serf_response_body_get_remaining(serf_bucket_t *bucket)
+{
+    body_context_t *ctx = bucket->data;
+
+    return ctx->remaining;
+}
+
 static void serf_response_body_destroy(serf_bucket_t *bucket)
 {
     body_context_t *ctx = bucket->data;
@@ -143,7 +161,7 @@ const serf_bucket_type_t serf_bucket_type_response_body = {
     serf_buckets_are_v2,
     serf_response_body_peek,
     serf_response_body_destroy,
-    serf_default_read_bucket,
-    NULL,
+    serf_response_body_read_bucket,
+    serf_response_body_get_remaining,
     serf_response_body_set_config,
 };
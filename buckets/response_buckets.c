@@ -21,6 +21,15 @@
 #include "serf_bucket_util.h"
 #include "serf_private.h"
 
+/* The size of the body buffer of serf_bucket_response_read_body() when the
+   length of the body isn't known, which is doubled as needed. */
+#define INITIAL_BODY_SIZE 8192
+
+/* The largest rest of a body that serf_bucket_response_read_body() trusts
+   the Content-Length for. A bigger Content-Length is not allocated up
+   front, as the server may never send that much. */
+#define MAX_EXACT_BODY_SIZE (4 * 1024 * 1024)
+
 typedef struct response_context_t {
     serf_bucket_t *stream;
     serf_bucket_t *body;        /* Pointer to the stream wrapping the body. */
@@ -48,6 +57,24 @@ typedef struct response_context_t {
        body was read completely. */
     apr_status_t error_on_eof;
 
+    /* The body bytes read so far, including those read from the response
+       this one continues. */
+    apr_uint64_t body_read;
+
+    /* For a resumed response: the validator of the representation, and the
+       bytes to skip when the server sent the whole body again. */
+    const char *resume_validator;
+    apr_uint64_t resume_skip;
+
+    /* The header block when it was parsed in place. The headers point
+       into it. */
+    char *header_block;
+
+    /* The body read so far by serf_bucket_response_read_body(). */
+    char *body_buf;
+    apr_size_t body_buf_len;
+    apr_size_t body_buf_size;
+
 } response_context_t;
 
 /* Returns 1 if according to RFC2626 this response can have a body, 0 if it
@@ -89,6 +116,13 @@ serf_bucket_t *serf_bucket_response_create(
     ctx->head_req = 0;
     ctx->error_on_eof = 0;
     ctx->config = NULL;
+    ctx->body_read = 0;
+    ctx->resume_validator = NULL;
+    ctx->resume_skip = 0;
+    ctx->header_block = NULL;
+    ctx->body_buf = NULL;
+    ctx->body_buf_len = 0;
+    ctx->body_buf_size = 0;
 
     serf_linebuf_init(&ctx->linebuf);
 
@@ -122,6 +156,8 @@ static void serf_response_destroy_and_data(serf_bucket_t *bucket)
     if (ctx->body != NULL)
         serf_bucket_destroy(ctx->body);
     serf_bucket_destroy(ctx->headers);
+    if (ctx->header_block)
+        serf_bucket_mem_free(bucket->allocator, ctx->header_block);
 
     serf_default_destroy_and_data(bucket);
 }
@@ -216,6 +252,268 @@ static apr_status_t fetch_headers(serf_bucket_t *bkt, response_context_t *ctx)
     return status;
 }
 
+/* Find the end of a header block of LEN bytes at DATA. Returns its length
+   including the empty line that ends it, or 0 if the block isn't complete
+   or not in the plain form that parse_header_block() handles: CRLF or LF
+   line endings, and a colon on every line. */
+static apr_size_t header_block_length(const char *data, apr_size_t len)
+{
+    apr_size_t pos = 0;
+
+    while (pos < len) {
+        const char *line = data + pos;
+        const char *nl = memchr(line, '\n', len - pos);
+        apr_size_t line_len;
+
+        if (!nl)
+            return 0;
+
+        line_len = nl - line;
+        if (line_len && line[line_len - 1] == '\r')
+            line_len--;
+
+        pos += (nl - line) + 1;
+        if (!line_len)
+            return pos;
+
+        if (line_len >= SERF_LINEBUF_LIMIT
+            || memchr(line, '\r', line_len)
+            || !memchr(line, ':', line_len))
+            return 0;
+    }
+
+    return 0;
+}
+
+/* Parse the header block of LEN bytes at BLOCK in place, adding the headers
+   to CTX->headers without copying them. */
+static void parse_header_block(response_context_t *ctx,
+                               char *block, apr_size_t len)
+{
+    char *line = block;
+    char *end = block + len;
+
+    while (line < end) {
+        char *nl = memchr(line, '\n', end - line);
+        char *line_end = nl;
+        char *colon;
+        char *value;
+
+        if (line_end > line && line_end[-1] == '\r')
+            line_end--;
+        if (line_end == line)
+            break;
+
+        colon = memchr(line, ':', line_end - line);
+        value = colon + 1;
+        while (value < line_end && apr_isspace(*value))
+            value++;
+
+        /* The headers bucket expects NUL terminated names and values. */
+        *colon = '\0';
+        *line_end = '\0';
+
+        serf_bucket_headers_setx(ctx->headers,
+                                 line, colon - line, 0,
+                                 value, line_end - value, 0);
+
+        line = nl + 1;
+    }
+}
+
+/* When the rest of the header block is available from the stream at once,
+   read all of it into one buffer and parse it in place, saving the copies
+   per header of fetch_headers(). Sets *PARSED when it did so. */
+static apr_status_t fetch_header_block(serf_bucket_t *bkt,
+                                       response_context_t *ctx,
+                                       int *parsed)
+{
+    const char *data;
+    apr_size_t len;
+    apr_size_t block_len;
+    apr_size_t copied;
+    apr_status_t status;
+
+    *parsed = 0;
+
+    /* A partial line must be finished by the line buffer. */
+    if (ctx->linebuf.state != SERF_LINEBUF_EMPTY
+        && ctx->linebuf.state != SERF_LINEBUF_READY)
+        return APR_SUCCESS;
+
+    status = serf_bucket_peek(ctx->stream, &data, &len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    block_len = header_block_length(data, len);
+    if (!block_len)
+        return APR_SUCCESS;
+
+    ctx->header_block = serf_bucket_mem_alloc(bkt->allocator, block_len);
+
+    /* What was peeked can be read without blocking. */
+    copied = 0;
+    while (copied < block_len) {
+        status = serf_bucket_read(ctx->stream, block_len - copied,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+        memcpy(ctx->header_block + copied, data, len);
+        copied += len;
+
+        if (status && copied < block_len)
+            return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+    }
+
+    parse_header_block(ctx, ctx->header_block, block_len);
+
+    /* As after reading the empty line that ends the headers. */
+    ctx->linebuf.state = SERF_LINEBUF_READY;
+    ctx->linebuf.used = 0;
+    *parsed = 1;
+
+    return APR_SUCCESS;
+}
+
+/* Return 1 if the ETag or Last-Modified header of the response matches
+   VALIDATOR. */
+static int same_representation(response_context_t *ctx,
+                               const char *validator)
+{
+    const char *v;
+
+    v = serf_bucket_headers_get(ctx->headers, "ETag");
+    if (v && strcmp(v, validator) == 0)
+        return 1;
+
+    v = serf_bucket_headers_get(ctx->headers, "Last-Modified");
+    if (v && strcmp(v, validator) == 0)
+        return 1;
+
+    return 0;
+}
+
+/* Check that the response continues the body of the response it resumes,
+   now that its headers are read. */
+static apr_status_t check_resumed(serf_bucket_t *bkt,
+                                  response_context_t *ctx)
+{
+    const char *v;
+
+    if (ctx->sl.code == 206) {
+        /* Content-Range: bytes first-last/length */
+        v = serf_bucket_headers_get(ctx->headers, "Content-Range");
+        if (!v || strncasecmp(v, "bytes ", 6) != 0
+            || (apr_uint64_t)apr_strtoi64(v + 6, NULL, 10) != ctx->body_read)
+            return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+
+        /* Present it as the rest of the original response. */
+        ctx->sl.code = 200;
+        serf_bucket_mem_free(bkt->allocator, (void*)ctx->sl.reason);
+        ctx->sl.reason = serf_bstrmemdup(bkt->allocator, "OK", 2);
+
+        return APR_SUCCESS;
+    }
+
+    /* The server ignored the Range, but sent the same body again. */
+    if (ctx->sl.code == 200
+        && same_representation(ctx, ctx->resume_validator)) {
+        ctx->resume_skip = ctx->body_read;
+        return APR_SUCCESS;
+    }
+
+    /* The representation changed, what was read before can't be
+       completed anymore. */
+    return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+}
+
+/* Skip the part of the body that was read before, see check_resumed(). */
+static apr_status_t skip_resumed(response_context_t *ctx)
+{
+    while (ctx->resume_skip) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_read(ctx->body,
+                                  ctx->resume_skip < 65536
+                                      ? (apr_size_t)ctx->resume_skip : 65536,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        ctx->resume_skip -= len;
+
+        if (APR_STATUS_IS_EOF(status) && ctx->resume_skip)
+            return SERF_ERROR_TRUNCATED_HTTP_RESPONSE;
+        if (status && ctx->resume_skip)
+            return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Wrap STREAM in the decoder for the content coding named by the LEN
+   characters at CODING. Returns NULL if the coding isn't supported. */
+static serf_bucket_t *create_decoder(serf_bucket_t *stream,
+                                     const char *coding, apr_size_t len,
+                                     serf_bucket_alloc_t *allocator)
+{
+#define CODING_IS(name) \
+    (len == sizeof(name) - 1 && strncasecmp(coding, name, len) == 0)
+
+    if (CODING_IS("gzip") || CODING_IS("x-gzip"))
+        return serf_bucket_deflate_create(stream, allocator,
+                                          SERF_DEFLATE_GZIP);
+    if (CODING_IS("deflate"))
+        return serf_bucket_deflate_create(stream, allocator,
+                                          SERF_DEFLATE_DEFLATE);
+    if (CODING_IS("br"))
+        return serf_bucket_brotli_decompress_create(stream, allocator);
+    if (CODING_IS("zstd"))
+        return serf_bucket_zstd_decompress_create(stream, allocator);
+
+    return NULL;
+#undef CODING_IS
+}
+
+serf_bucket_t *serf_bucket_content_decode_create(
+    serf_bucket_t *stream,
+    const char *content_encoding,
+    serf_bucket_alloc_t *allocator)
+{
+    const char *end = content_encoding + strlen(content_encoding);
+
+    /* The last coding listed was applied last, so it is undone first. */
+    while (end > content_encoding) {
+        const char *sep = end;
+        const char *start;
+        serf_bucket_t *decoder;
+
+        while (sep > content_encoding && sep[-1] != ',')
+            sep--;
+
+        start = sep;
+        while (start < end && apr_isspace(*start))
+            start++;
+        while (end > start && apr_isspace(end[-1]))
+            end--;
+
+        if (end > start
+            && !(end - start == 8 && strncasecmp(start, "identity", 8) == 0)) {
+            decoder = create_decoder(stream, start, end - start, allocator);
+            if (!decoder)
+                break;
+            stream = decoder;
+        }
+
+        /* Continue before the comma */
+        end = sep > content_encoding ? sep - 1 : sep;
+    }
+
+    return stream;
+}
+
 /* Perform one iteration of the state machine.
  *
  * Will return when one the following conditions occurred:
@@ -227,6 +525,7 @@ static apr_status_t fetch_headers(serf_bucket_t *bkt, response_context_t *ctx)
 static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
 {
     apr_status_t status = APR_SUCCESS; /* initialize to avoid gcc warnings */
+    int parsed;
 
     switch (ctx->state) {
     case STATE_STATUS_LINE:
@@ -269,10 +568,16 @@ static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
         }
         break;
     case STATE_HEADERS:
-        status = fetch_headers(bkt, ctx);
-        if (SERF_BUCKET_READ_ERROR(status))
+        status = fetch_header_block(bkt, ctx, &parsed);
+        if (status)
             return status;
 
+        if (!parsed) {
+            status = fetch_headers(bkt, ctx);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+        }
+
         /* If an empty line was read, then we hit the end of the headers.
          * Move on to the body.
          */
@@ -282,6 +587,12 @@ static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
             /* Advance the state. */
             ctx->state = STATE_BODY;
 
+            if (ctx->resume_validator) {
+                status = check_resumed(bkt, ctx);
+                if (status)
+                    return status;
+            }
+
             /* If this is a response to a HEAD request, or code == 1xx,204 or304
                then we don't receive a real body. */
             if (!expect_body(ctx)) {
@@ -317,19 +628,9 @@ static apr_status_t run_machine(serf_bucket_t *bkt, response_context_t *ctx)
             }
             v = serf_bucket_headers_get(ctx->headers, "Content-Encoding");
             if (v) {
-                /* Need to handle multiple content-encoding. */
-                if (v && strcasecmp("gzip", v) == 0) {
-                    ctx->body =
-                        serf_bucket_deflate_create(ctx->body, bkt->allocator,
-                                                   SERF_DEFLATE_GZIP);
-                    serf_bucket_set_config(ctx->body, ctx->config);
-                }
-                else if (v && strcasecmp("deflate", v) == 0) {
-                    ctx->body =
-                        serf_bucket_deflate_create(ctx->body, bkt->allocator,
-                                                   SERF_DEFLATE_DEFLATE);
-                    serf_bucket_set_config(ctx->body, ctx->config);
-                }
+                ctx->body = serf_bucket_content_decode_create(ctx->body, v,
+                                                              bkt->allocator);
+                serf_bucket_set_config(ctx->body, ctx->config);
             }
         }
         break;
@@ -423,6 +724,8 @@ static apr_status_t serf_response_read(serf_bucket_t *bucket,
     apr_status_t status;
 
     status = wait_for_body(bucket, ctx);
+    if (!status && ctx->resume_skip)
+        status = skip_resumed(ctx);
     if (status) {
         /* It's not possible to have read anything yet! */
         if (APR_STATUS_IS_EOF(status) || APR_STATUS_IS_EAGAIN(status)) {
@@ -435,6 +738,53 @@ static apr_status_t serf_response_read(serf_bucket_t *bucket,
     if (SERF_BUCKET_READ_ERROR(status))
         return status;
 
+    ctx->body_read += *len;
+
+    if (APR_STATUS_IS_EOF(status)) {
+        if (ctx->chunked) {
+            ctx->state = STATE_TRAILERS;
+            /* Mask the result. */
+            status = APR_SUCCESS;
+        } else {
+            ctx->state = STATE_DONE;
+        }
+    }
+
+fake_eof:
+    if (APR_STATUS_IS_EOF(status) && ctx->error_on_eof)
+        return ctx->error_on_eof;
+
+    return status;
+}
+
+static apr_status_t serf_response_read_iovec(serf_bucket_t *bucket,
+                                             apr_size_t requested,
+                                             int vecs_size,
+                                             struct iovec *vecs,
+                                             int *vecs_used)
+{
+    response_context_t *ctx = bucket->data;
+    apr_status_t status;
+    int i;
+
+    *vecs_used = 0;
+
+    status = wait_for_body(bucket, ctx);
+    if (!status && ctx->resume_skip)
+        status = skip_resumed(ctx);
+    if (status)
+        goto fake_eof;
+
+    /* Lets the body hand out several spans at once, e.g. the data of all
+       the chunks that were received together. */
+    status = serf_bucket_read_iovec(ctx->body, requested, vecs_size, vecs,
+                                    vecs_used);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    for (i = 0; i < *vecs_used; i++)
+        ctx->body_read += vecs[i].iov_len;
+
     if (APR_STATUS_IS_EOF(status)) {
         if (ctx->chunked) {
             ctx->state = STATE_TRAILERS;
@@ -460,12 +810,16 @@ static apr_status_t serf_response_readline(serf_bucket_t *bucket,
     apr_status_t status;
 
     status = wait_for_body(bucket, ctx);
+    if (!status && ctx->resume_skip)
+        status = skip_resumed(ctx);
     if (status) {
         goto fake_eof;
     }
 
     /* Delegate to the stream bucket to do the readline. */
     status = serf_bucket_readline(ctx->body, acceptable, found, data, len);
+    if (!SERF_BUCKET_READ_ERROR(status))
+        ctx->body_read += *len;
 
 fake_eof:
     if (APR_STATUS_IS_EOF(status) && ctx->error_on_eof) {
@@ -477,6 +831,110 @@ fake_eof:
     return status;
 }
 
+static serf_bucket_t *serf_response_read_bucket(serf_bucket_t *bucket,
+                                                const serf_bucket_type_t *type)
+{
+    response_context_t *ctx = bucket->data;
+    serf_bucket_t *found;
+
+    /* The status line and headers are left to the reads, which can report
+       what goes wrong with them. */
+    if (ctx->state != STATE_BODY || ctx->resume_skip)
+        return NULL;
+
+    found = serf_bucket_read_bucket(ctx->body, type);
+    if (found)
+        ctx->body_read += serf_bucket_get_remaining(found);
+
+    return found;
+}
+
+static apr_uint64_t serf_response_get_remaining(serf_bucket_t *bucket)
+{
+    response_context_t *ctx = bucket->data;
+    apr_uint64_t remaining;
+
+    /* Trailers aren't part of the body. */
+    if (ctx->state == STATE_TRAILERS)
+        return 0;
+    if (ctx->state != STATE_BODY && ctx->state != STATE_DONE)
+        return SERF_LENGTH_UNKNOWN;
+
+    remaining = ctx->body ? serf_bucket_get_remaining(ctx->body)
+                          : SERF_LENGTH_UNKNOWN;
+
+    /* What a resumed response sends again is skipped. */
+    if (ctx->resume_skip && remaining != SERF_LENGTH_UNKNOWN)
+        remaining = remaining > ctx->resume_skip
+                    ? remaining - ctx->resume_skip : 0;
+
+    return remaining;
+}
+
+/* Make room for LEN more bytes in the body buffer of CTX, in POOL. Once
+   the rest of the body's length is known, and is at most
+   MAX_EXACT_BODY_SIZE, the buffer is made exactly as large as the body. */
+static void reserve_body_buf(serf_bucket_t *bucket,
+                             response_context_t *ctx,
+                             apr_size_t len,
+                             apr_pool_t *pool)
+{
+    apr_size_t needed = ctx->body_buf_len + len;
+    apr_uint64_t remaining;
+    apr_size_t size;
+    char *buf;
+
+    if (needed <= ctx->body_buf_size)
+        return;
+
+    remaining = serf_response_get_remaining(bucket);
+    if (remaining != SERF_LENGTH_UNKNOWN
+        && remaining <= MAX_EXACT_BODY_SIZE) {
+        size = needed + (apr_size_t)remaining;
+    }
+    else {
+        size = ctx->body_buf_size ? ctx->body_buf_size : INITIAL_BODY_SIZE;
+        while (size < needed)
+            size *= 2;
+    }
+
+    buf = apr_palloc(pool, size);
+    if (ctx->body_buf_len)
+        memcpy(buf, ctx->body_buf, ctx->body_buf_len);
+    ctx->body_buf = buf;
+    ctx->body_buf_size = size;
+}
+
+apr_status_t serf_bucket_response_read_body(serf_bucket_t *bucket,
+                                            const char **data,
+                                            apr_size_t *len,
+                                            apr_pool_t *pool)
+{
+    response_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    do {
+        const char *chunk;
+        apr_size_t chunk_len;
+
+        status = serf_response_read(bucket, SERF_READ_ALL_AVAIL,
+                                    &chunk, &chunk_len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            break;
+
+        if (chunk_len) {
+            reserve_body_buf(bucket, ctx, chunk_len, pool);
+            memcpy(ctx->body_buf + ctx->body_buf_len, chunk, chunk_len);
+            ctx->body_buf_len += chunk_len;
+        }
+    } while (!status);
+
+    *data = ctx->body_buf ? ctx->body_buf : "";
+    *len = ctx->body_buf_len;
+
+    return status;
+}
+
 apr_status_t serf_response_full_become_aggregate(serf_bucket_t *bucket)
 {
     response_context_t *ctx = bucket->data;
@@ -523,6 +981,45 @@ static apr_status_t serf_response_set_config(serf_bucket_t *bucket,
 /* ### need to implement */
 #define serf_response_peek NULL
 
+int serf__bucket_response_get_resume_point(serf_bucket_t *bucket,
+                                           apr_uint64_t *offset,
+                                           const char **validator)
+{
+    response_context_t *ctx = bucket->data;
+    const char *v;
+
+    /* Only a body still being read can be continued. */
+    if (ctx->state != STATE_BODY || ctx->sl.code != 200 || !ctx->body_read
+        || ctx->head_req)
+        return 0;
+
+    /* Ranges apply to the encoded body, but we count decoded bytes. */
+    if (serf_bucket_headers_get(ctx->headers, "Content-Encoding"))
+        return 0;
+
+    /* If-Range requires a strong validator. */
+    v = serf_bucket_headers_get(ctx->headers, "ETag");
+    if (!v || strncmp(v, "W/", 2) == 0)
+        v = serf_bucket_headers_get(ctx->headers, "Last-Modified");
+    if (!v)
+        return 0;
+
+    *offset = ctx->body_read;
+    *validator = v;
+
+    return 1;
+}
+
+void serf__bucket_response_set_resume(serf_bucket_t *bucket,
+                                      apr_uint64_t offset,
+                                      const char *validator)
+{
+    response_context_t *ctx = bucket->data;
+
+    ctx->body_read = offset;
+    ctx->resume_validator = validator;
+}
+
 void serf__bucket_response_set_error_on_eof(serf_bucket_t *bucket,
                                             apr_status_t error)
 {
@@ -534,12 +1031,12 @@ const serf_bucket_type_t serf_bucket_type_response = {
     "RESPONSE",
     serf_response_read,
     serf_response_readline,
-    serf_default_read_iovec,
+    serf_response_read_iovec,
     serf_default_read_for_sendfile,
     serf_buckets_are_v2,
     serf_response_peek,
     serf_response_destroy_and_data,
-    serf_default_read_bucket,
-    NULL,
+    serf_response_read_bucket,
+    serf_response_get_remaining,
     serf_response_set_config,
 };
@@ -13,12 +13,16 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
+
 #define APR_WANT_MEMFUNC
 #include <apr_want.h>
 #include <apr_pools.h>
+#include <apr_atomic.h>
 
 #include "serf.h"
 #include "serf_bucket_util.h"
+#include "serf_private.h"
 
 
 typedef struct simple_context_t {
@@ -90,6 +94,101 @@ serf_bucket_t *serf_bucket_simple_own_create(
     return serf_bucket_create(&serf_bucket_type_simple, allocator, ctx);
 }
 
+struct serf_shared_buffer_t {
+    volatile apr_uint32_t refcount;
+    apr_size_t len;
+
+    /* The data follows the struct. */
+};
+
+#define SHARED_DATA(buffer) ((const char *)((buffer) + 1))
+
+serf_shared_buffer_t *serf__shared_buffer_alloc(apr_size_t len)
+{
+    serf_shared_buffer_t *buffer;
+
+    /* The buffer outlives any single allocator, so it can't come from
+       one. */
+    buffer = malloc(sizeof(*buffer) + len);
+    if (!buffer)
+        return NULL;
+
+    apr_atomic_set32(&buffer->refcount, 1);
+    buffer->len = len;
+
+    return buffer;
+}
+
+serf_shared_buffer_t *serf_shared_buffer_create(
+    const char *data, apr_size_t len)
+{
+    serf_shared_buffer_t *buffer = serf__shared_buffer_alloc(len);
+
+    if (buffer)
+        memcpy(buffer + 1, data, len);
+
+    return buffer;
+}
+
+void serf_shared_buffer_release(serf_shared_buffer_t *buffer)
+{
+    if (!apr_atomic_dec32(&buffer->refcount))
+        free(buffer);
+}
+
+static void release_shared_data(void *baton, const char *data)
+{
+    serf_shared_buffer_release(baton);
+}
+
+serf_bucket_t *serf_bucket_shared_create(
+    serf_shared_buffer_t *buffer,
+    serf_bucket_alloc_t *allocator)
+{
+    apr_atomic_inc32(&buffer->refcount);
+
+    return serf_bucket_simple_create(SHARED_DATA(buffer), buffer->len,
+                                     release_shared_data, buffer,
+                                     allocator);
+}
+
+char *serf__shared_buffer_data(serf_shared_buffer_t *buffer)
+{
+    return (char *)(buffer + 1);
+}
+
+serf_bucket_t *serf__bucket_shared_span_create(serf_shared_buffer_t *buffer,
+                                               const char *data,
+                                               apr_size_t len,
+                                               serf_bucket_alloc_t *allocator)
+{
+    return serf_bucket_simple_create(data, len, release_shared_data, buffer,
+                                     allocator);
+}
+
+int serf__bucket_simple_movable(serf_bucket_t *bucket)
+{
+    simple_context_t *ctx = bucket->data;
+
+    /* Copied and owned data belongs to the allocator of BUCKET. */
+    return !ctx->freefunc || ctx->freefunc == release_shared_data;
+}
+
+serf_bucket_t *serf__bucket_simple_move(serf_bucket_t *bucket,
+                                        serf_bucket_alloc_t *allocator)
+{
+    simple_context_t *ctx = bucket->data;
+    serf_bucket_t *moved;
+
+    moved = serf_bucket_simple_create(ctx->current, ctx->remaining,
+                                      ctx->freefunc, ctx->baton, allocator);
+
+    /* The reference to the data went with it. */
+    serf_default_destroy_and_data(bucket);
+
+    return moved;
+}
+
 static apr_status_t serf_simple_read(serf_bucket_t *bucket,
                                      apr_size_t requested,
                                      const char **data, apr_size_t *len)
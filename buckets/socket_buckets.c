@@ -15,23 +15,113 @@
 
 #include <apr_pools.h>
 #include <apr_network_io.h>
+#include <apr_portable.h>
+
+#define APR_WANT_MEMFUNC
+#define APR_WANT_IOVEC
+#include <apr_want.h>
+
+#if APR_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#include <errno.h>
+#endif
 
 #include "serf.h"
 #include "serf_private.h"
 #include "serf_bucket_util.h"
 
 
+/* The number of buffers which serf_socket_read_iovec() receives into with
+   one call, the buffer of the databuf included. */
+#define IOVEC_BUFS 4
+
 typedef struct socket_context_t {
     apr_socket_t *skt;
 
-    serf_databuf_t databuf;
+    serf__databuf_t databuf;
+
+    /* Additional buffers for read_iovec, allocated the first time they are
+       needed, of iovec_bufsize bytes: the size of the databuf's buffer. */
+    char *iovec_bufs[IOVEC_BUFS - 1];
+    apr_size_t iovec_bufsize;
 
     /* Progress callback */
     serf_progress_t progress_func;
     void *progress_baton;
+
+    /* Trace callback, see serf__bucket_socket_set_trace_cb() */
+    serf__trace_cb_t trace_func;
+    void *trace_baton;
+
+    /* Where the reads are in the header section, see
+       serf__bucket_socket_read_head_only(). */
+    enum {
+        HEAD_OFF,           /* read as much as there is */
+        HEAD_IN_LINE,
+        HEAD_LINE_START,    /* after a LF */
+        HEAD_LINE_CR        /* after a CR at the start of a line */
+    } head_state;
 } socket_context_t;
 
 
+/* Receive up to *LEN bytes into BUF, up to the end of the header section.
+   Same status codes as apr_socket_recv(). */
+static apr_status_t recv_head(socket_context_t *ctx, char *buf,
+                              apr_size_t *len)
+{
+    apr_size_t avail = *len;
+    apr_size_t i;
+    apr_status_t status;
+
+#ifdef MSG_PEEK
+    /* See what arrived, so that we take only the header section. */
+    {
+        apr_sockaddr_t from;
+
+        memset(&from, 0, sizeof(from));
+        status = apr_socket_recvfrom(&from, ctx->skt, MSG_PEEK, buf, &avail);
+        if (status && !avail) {
+            *len = 0;
+            return status;
+        }
+    }
+#else
+    /* Byte by byte, then. */
+    avail = 1;
+    status = apr_socket_recv(ctx->skt, buf, &avail);
+    if (status && !avail) {
+        *len = 0;
+        return status;
+    }
+#endif
+
+    for (i = 0; i < avail && ctx->head_state != HEAD_OFF; i++) {
+        switch (buf[i]) {
+        case '\n':
+            ctx->head_state = ctx->head_state == HEAD_IN_LINE
+                              ? HEAD_LINE_START : HEAD_OFF;
+            break;
+        case '\r':
+            if (ctx->head_state != HEAD_LINE_START)
+                ctx->head_state = HEAD_IN_LINE;
+            else
+                ctx->head_state = HEAD_LINE_CR;
+            break;
+        default:
+            ctx->head_state = HEAD_IN_LINE;
+            break;
+        }
+    }
+
+    *len = i;
+#ifdef MSG_PEEK
+    status = apr_socket_recv(ctx->skt, buf, len);
+#endif
+
+    return status;
+}
+
+
 static apr_status_t socket_reader(void *baton, apr_size_t bufsize,
                                   char *buf, apr_size_t *len)
 {
@@ -39,11 +129,22 @@ static apr_status_t socket_reader(void *baton, apr_size_t bufsize,
     apr_status_t status;
 
     *len = bufsize;
-    status = apr_socket_recv(ctx->skt, buf, len);
+    if (ctx->head_state != HEAD_OFF)
+        status = recv_head(ctx, buf, len);
+    else
+        status = apr_socket_recv(ctx->skt, buf, len);
 
     if (ctx->progress_func && *len)
         ctx->progress_func(ctx->progress_baton, *len, 0);
 
+    if (ctx->trace_func && *len) {
+        struct iovec vec;
+
+        vec.iov_base = buf;
+        vec.iov_len = *len;
+        ctx->trace_func(ctx->trace_baton, &vec, 1, *len);
+    }
+
     return status;
 }
 
@@ -57,12 +158,16 @@ serf_bucket_t *serf_bucket_socket_create(
     ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
     ctx->skt = skt;
 
-    serf_databuf_init(&ctx->databuf);
-    ctx->databuf.read = socket_reader;
-    ctx->databuf.read_baton = ctx;
+    serf__databuf_init(&ctx->databuf, socket_reader, ctx);
+
+    memset(ctx->iovec_bufs, 0, sizeof(ctx->iovec_bufs));
+    ctx->iovec_bufsize = 0;
 
     ctx->progress_func = NULL;
     ctx->progress_baton = NULL;
+    ctx->trace_func = NULL;
+    ctx->trace_baton = NULL;
+    ctx->head_state = HEAD_OFF;
     return serf_bucket_create(&serf_bucket_type_socket, allocator, ctx);
 }
 
@@ -77,13 +182,202 @@ void serf_bucket_socket_set_read_progress_cb(
     ctx->progress_baton = progress_baton;
 }
 
+void serf__bucket_socket_set_trace_cb(serf_bucket_t *bucket,
+                                      serf__trace_cb_t trace_func,
+                                      void *trace_baton)
+{
+    socket_context_t *ctx = bucket->data;
+
+    ctx->trace_func = trace_func;
+    ctx->trace_baton = trace_baton;
+}
+
+void serf__bucket_socket_read_head_only(serf_bucket_t *bucket)
+{
+    socket_context_t *ctx = bucket->data;
+
+    ctx->head_state = HEAD_IN_LINE;
+}
+
 static apr_status_t serf_socket_read(serf_bucket_t *bucket,
                                      apr_size_t requested,
                                      const char **data, apr_size_t *len)
 {
     socket_context_t *ctx = bucket->data;
 
-    return serf_databuf_read(&ctx->databuf, requested, data, len);
+    return serf_databuf_read(&ctx->databuf.databuf, requested, data, len);
+}
+
+/* Receive into the NVEC buffers of VECS at once, with a single readv()
+   where the platform has one. Same status codes as apr_socket_recv(). */
+static apr_status_t socket_recvv(socket_context_t *ctx,
+                                 struct iovec *vecs, int nvec,
+                                 apr_size_t *len)
+{
+    apr_status_t status;
+#if APR_HAVE_SYS_UIO_H
+    apr_interval_time_t timeout;
+
+    /* readv() bypasses the waiting apr_socket_recv() does for sockets with
+       a timeout, so only use it on the non-blocking sockets of serf. */
+    if (apr_socket_timeout_get(ctx->skt, &timeout) == APR_SUCCESS
+        && timeout == 0) {
+        apr_os_sock_t osskt;
+        ssize_t rv;
+
+        status = apr_os_sock_get(&osskt, ctx->skt);
+        if (status)
+            return status;
+
+        do {
+            rv = readv(osskt, vecs, nvec);
+        } while (rv == -1 && errno == EINTR);
+
+        if (rv == -1) {
+            *len = 0;
+            status = apr_get_netos_error();
+        }
+        else {
+            *len = rv;
+            status = rv ? APR_SUCCESS : APR_EOF;
+        }
+    }
+    else
+#endif
+    {
+        int i;
+
+        /* Fill one buffer after the other, until the socket runs dry. */
+        *len = 0;
+        for (i = 0; i < nvec; i++) {
+            apr_size_t read_len = vecs[i].iov_len;
+
+            status = apr_socket_recv(ctx->skt, vecs[i].iov_base, &read_len);
+            *len += read_len;
+
+            if (status || read_len < vecs[i].iov_len)
+                break;
+        }
+
+        /* Any EAGAIN, EOF or error shows up again on the next read. */
+        if (*len)
+            status = APR_SUCCESS;
+    }
+
+    if (ctx->progress_func && *len)
+        ctx->progress_func(ctx->progress_baton, *len, 0);
+
+    if (ctx->trace_func && *len)
+        ctx->trace_func(ctx->trace_baton, vecs, nvec, *len);
+
+    return status;
+}
+
+/* Free the extra buffers of serf_socket_read_iovec(). */
+static void free_iovec_bufs(serf_bucket_t *bucket)
+{
+    socket_context_t *ctx = bucket->data;
+    int i;
+
+    for (i = 0; i < IOVEC_BUFS - 1; i++) {
+        if (ctx->iovec_bufs[i]) {
+            serf_bucket_mem_free(bucket->allocator, ctx->iovec_bufs[i]);
+            ctx->iovec_bufs[i] = NULL;
+        }
+    }
+}
+
+/* Hand up what the kernel has queued in up to IOVEC_BUFS buffers, instead
+   of one databuf worth per call. The data stays valid until the next read
+   from the bucket. */
+static apr_status_t serf_socket_read_iovec(serf_bucket_t *bucket,
+                                           apr_size_t requested,
+                                           int vecs_size,
+                                           struct iovec *vecs,
+                                           int *vecs_used)
+{
+    socket_context_t *ctx = bucket->data;
+    serf_databuf_t *databuf = &ctx->databuf.databuf;
+    apr_size_t len;
+    apr_status_t status;
+    int i;
+
+    /* Return what is left from a previous read first, and read the header
+       section through the databuf. */
+    if (databuf->remaining > 0 || APR_STATUS_IS_EOF(databuf->status)
+        || ctx->head_state != HEAD_OFF) {
+        const char *data;
+
+        status = serf_databuf_read(databuf, requested, &data, &len);
+        if (len) {
+            vecs[0].iov_base = (void *)data;
+            vecs[0].iov_len = len;
+            *vecs_used = 1;
+        }
+        else
+            *vecs_used = 0;
+
+        return status;
+    }
+
+    if (!requested || !vecs_size) {
+        *vecs_used = 0;
+        return APR_SUCCESS;
+    }
+
+    if (vecs_size > IOVEC_BUFS)
+        vecs_size = IOVEC_BUFS;
+
+    /* The extra buffers follow the read buffer size of the connection. */
+    if (ctx->iovec_bufsize != ctx->databuf.bufsize) {
+        free_iovec_bufs(bucket);
+        ctx->iovec_bufsize = ctx->databuf.bufsize;
+    }
+
+    for (i = 0; i < vecs_size && requested; i++) {
+        apr_size_t size;
+
+        if (i == 0) {
+            vecs[i].iov_base = ctx->databuf.buffer;
+            size = ctx->databuf.bufsize;
+        }
+        else {
+            if (!ctx->iovec_bufs[i - 1])
+                ctx->iovec_bufs[i - 1] = serf_bucket_mem_alloc(
+                                             bucket->allocator,
+                                             ctx->iovec_bufsize);
+            vecs[i].iov_base = ctx->iovec_bufs[i - 1];
+            size = ctx->iovec_bufsize;
+        }
+
+        if (size > requested)
+            size = requested;
+        vecs[i].iov_len = size;
+
+        if (requested != SERF_READ_ALL_AVAIL)
+            requested -= size;
+    }
+
+    status = socket_recvv(ctx, vecs, i, &len);
+
+    /* Everything received is handed up, so the databuf stays empty. */
+    databuf->current = ctx->databuf.buffer;
+    databuf->remaining = 0;
+    if (SERF_BUCKET_READ_ERROR(status)) {
+        *vecs_used = 0;
+        return status;
+    }
+    databuf->status = status;
+
+    /* Trim the vecs to what was actually received. */
+    for (i = 0; len; i++) {
+        if (vecs[i].iov_len > len)
+            vecs[i].iov_len = len;
+        len -= vecs[i].iov_len;
+    }
+    *vecs_used = i;
+
+    return status;
 }
 
 static apr_status_t serf_socket_readline(serf_bucket_t *bucket,
@@ -92,7 +386,8 @@ static apr_status_t serf_socket_readline(serf_bucket_t *bucket,
 {
     socket_context_t *ctx = bucket->data;
 
-    return serf_databuf_readline(&ctx->databuf, acceptable, found, data, len);
+    return serf_databuf_readline(&ctx->databuf.databuf, acceptable, found,
+                                 data, len);
 }
 
 static apr_status_t serf_socket_peek(serf_bucket_t *bucket,
@@ -101,19 +396,47 @@ static apr_status_t serf_socket_peek(serf_bucket_t *bucket,
 {
     socket_context_t *ctx = bucket->data;
 
-    return serf_databuf_peek(&ctx->databuf, data, len);
+    return serf_databuf_peek(&ctx->databuf.databuf, data, len);
+}
+
+static serf_bucket_t *serf_socket_read_bucket(serf_bucket_t *bucket,
+                                              const serf_bucket_type_t *type)
+{
+    socket_context_t *ctx = bucket->data;
+
+    return serf_databuf_read_bucket(&ctx->databuf.databuf, type,
+                                    bucket->allocator);
+}
+
+static apr_status_t serf_socket_set_config(serf_bucket_t *bucket,
+                                           serf_config_t *config)
+{
+    socket_context_t *ctx = bucket->data;
+
+    serf__databuf_configure(&ctx->databuf, config, bucket->allocator);
+
+    return APR_SUCCESS;
+}
+
+static void serf_socket_destroy(serf_bucket_t *bucket)
+{
+    socket_context_t *ctx = bucket->data;
+
+    free_iovec_bufs(bucket);
+    serf__databuf_cleanup(&ctx->databuf);
+    serf_default_destroy_and_data(bucket);
 }
 
 const serf_bucket_type_t serf_bucket_type_socket = {
     "SOCKET",
     serf_socket_read,
     serf_socket_readline,
-    serf_default_read_iovec,
+    serf_socket_read_iovec,
     serf_default_read_for_sendfile,
     serf_buckets_are_v2,
     serf_socket_peek,
-    serf_default_destroy_and_data,
-    serf_default_read_bucket,
+    serf_socket_destroy,
+    serf_socket_read_bucket,
     NULL,
-    serf_default_ignore_config,
+    serf_socket_set_config,
 };
@@ -0,0 +1,496 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_file_io.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+/* Data is kept in memory in blocks of at least this size. */
+#define SPILL_BLOCK_SIZE 8000
+
+typedef struct spill_block_t {
+    struct spill_block_t *next;
+
+    apr_size_t size;
+    apr_size_t len;
+    apr_size_t pos;
+    /* SIZE bytes of data follow, of which POS up to LEN are unread. */
+} spill_block_t;
+
+#define BLOCK_DATA(block) ((char *)(block) + sizeof(spill_block_t))
+
+/* The last block stays while it is read, so that it can be filled up. */
+#define HAS_MEM_DATA(ctx) ((ctx)->head && (ctx)->head->pos < (ctx)->head->len)
+
+typedef struct spill_context_t {
+    serf_bucket_t *stream;
+    apr_status_t stream_status;
+
+    /* The data in memory, read before the data in the file. */
+    spill_block_t *head;
+    spill_block_t *tail;
+    apr_size_t mem_size;
+    apr_size_t threshold;
+
+    /* The block of which the last read returned the final part. It is
+       freed on the next read. */
+    spill_block_t *done;
+
+    /* Once the memory is full, the rest of the data goes to FILE. It is
+       read back with FILE_BKT, when all of the stream is in. */
+    apr_pool_t *file_pool;
+    apr_file_t *file;
+    apr_uint64_t file_size;
+    serf_bucket_t *file_bkt;
+
+    serf_config_t *config;
+} spill_context_t;
+
+
+serf_bucket_t *serf_bucket_spill_create(
+    serf_bucket_t *stream,
+    apr_size_t threshold,
+    serf_bucket_alloc_t *allocator)
+{
+    spill_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->stream_status = APR_SUCCESS;
+    ctx->head = NULL;
+    ctx->tail = NULL;
+    ctx->mem_size = 0;
+    ctx->threshold = threshold ? threshold : SERF_SPILL_THRESHOLD_DEFAULT;
+    ctx->done = NULL;
+    ctx->file_pool = NULL;
+    ctx->file = NULL;
+    ctx->file_size = 0;
+    ctx->file_bkt = NULL;
+    ctx->config = NULL;
+
+    return serf_bucket_create(&serf_bucket_type_spill, allocator, ctx);
+}
+
+static void free_done_block(serf_bucket_t *bucket)
+{
+    spill_context_t *ctx = bucket->data;
+
+    if (ctx->done) {
+        ctx->mem_size -= ctx->done->size;
+        serf_bucket_mem_free(bucket->allocator, ctx->done);
+        ctx->done = NULL;
+    }
+}
+
+static apr_status_t open_file(serf_bucket_t *bucket)
+{
+    spill_context_t *ctx = bucket->data;
+    const char *temp_dir;
+    char *path;
+    apr_status_t status;
+
+    status = apr_pool_create(&ctx->file_pool,
+                             serf_bucket_allocator_get_pool(
+                                 bucket->allocator));
+    if (status)
+        return status;
+
+    status = apr_temp_dir_get(&temp_dir, ctx->file_pool);
+    if (status)
+        return status;
+
+    path = apr_pstrcat(ctx->file_pool, temp_dir, "/serf-spill-XXXXXX", NULL);
+
+    /* Not buffered, so that it can be mmap'ed when read back. */
+    return apr_file_mktemp(&ctx->file, path,
+                           APR_FOPEN_CREATE | APR_FOPEN_READ
+                           | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                           | APR_FOPEN_DELONCLOSE | APR_FOPEN_BINARY,
+                           ctx->file_pool);
+}
+
+/* Keep LEN bytes of DATA for reading them later. */
+static apr_status_t store(serf_bucket_t *bucket,
+                          const char *data, apr_size_t len)
+{
+    spill_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    if (!ctx->file) {
+        spill_block_t *block = ctx->tail;
+
+        /* Fill up the last block first. */
+        if (block && block->size > block->len) {
+            apr_size_t part = block->size - block->len;
+
+            if (part > len)
+                part = len;
+            memcpy(BLOCK_DATA(block) + block->len, data, part);
+            block->len += part;
+            data += part;
+            len -= part;
+        }
+
+        if (!len)
+            return APR_SUCCESS;
+
+        if (ctx->mem_size + len <= ctx->threshold) {
+            apr_size_t size = ctx->threshold - ctx->mem_size;
+
+            if (size > SPILL_BLOCK_SIZE)
+                size = SPILL_BLOCK_SIZE;
+            if (size < len)
+                size = len;
+
+            block = serf_bucket_mem_alloc(bucket->allocator,
+                                          sizeof(*block) + size);
+            block->next = NULL;
+            block->size = size;
+            block->len = len;
+            block->pos = 0;
+            memcpy(BLOCK_DATA(block), data, len);
+
+            if (ctx->tail)
+                ctx->tail->next = block;
+            else
+                ctx->head = block;
+            ctx->tail = block;
+            ctx->mem_size += size;
+
+            return APR_SUCCESS;
+        }
+
+        /* The memory is full. From now on everything goes to the file, to
+           keep the data in order. */
+        status = open_file(bucket);
+        if (status)
+            return status;
+    }
+
+    status = apr_file_write_full(ctx->file, data, len, NULL);
+    if (status)
+        return status;
+    ctx->file_size += len;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_bucket_spill_fill(serf_bucket_t *bucket)
+{
+    spill_context_t *ctx = bucket->data;
+
+    while (!APR_STATUS_IS_EOF(ctx->stream_status)) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_read(ctx->stream, SERF_READ_ALL_AVAIL,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+        ctx->stream_status = status;
+
+        if (len) {
+            apr_status_t store_status = store(bucket, data, len);
+
+            if (store_status)
+                return store_status;
+        }
+
+        if (status)
+            return status;
+    }
+
+    return APR_EOF;
+}
+
+/* Returns APR_SUCCESS if the data in the file can be read with FILE_BKT,
+   or why it can't (yet). */
+static apr_status_t prepare_file_bkt(serf_bucket_t *bucket)
+{
+    spill_context_t *ctx = bucket->data;
+    apr_off_t offset = 0;
+    apr_status_t status;
+
+    if (ctx->file_bkt)
+        return APR_SUCCESS;
+
+    /* The data that didn't fit in memory is read back when all of it is
+       in the file. */
+    status = serf_bucket_spill_fill(bucket);
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+
+    status = apr_file_seek(ctx->file, APR_SET, &offset);
+    if (status)
+        return status;
+
+    ctx->file_bkt = serf_bucket_mmap_window_create(ctx->file, 0,
+                                                   bucket->allocator);
+    serf_bucket_set_config(ctx->file_bkt, ctx->config);
+
+    return APR_SUCCESS;
+}
+
+/* Returns the status for a read that returned the last data of the head
+   block. */
+static apr_status_t status_after_block(spill_context_t *ctx)
+{
+    if (HAS_MEM_DATA(ctx) || ctx->file
+        || !APR_STATUS_IS_EOF(ctx->stream_status))
+        return APR_SUCCESS;
+
+    return APR_EOF;
+}
+
+/* Mark LEN bytes of the head block as read. */
+static apr_status_t consume(spill_context_t *ctx, apr_size_t len)
+{
+    spill_block_t *block = ctx->head;
+
+    block->pos += len;
+
+    /* The block can only be filled up further while it is the tail. */
+    if (block->pos == block->len
+        && (block != ctx->tail || ctx->file
+            || APR_STATUS_IS_EOF(ctx->stream_status))) {
+        ctx->head = block->next;
+        if (!ctx->head)
+            ctx->tail = NULL;
+        ctx->done = block;
+    }
+
+    return status_after_block(ctx);
+}
+
+static apr_status_t serf_spill_read(serf_bucket_t *bucket,
+                                    apr_size_t requested,
+                                    const char **data, apr_size_t *len)
+{
+    spill_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    free_done_block(bucket);
+
+    if (HAS_MEM_DATA(ctx)) {
+        spill_block_t *block = ctx->head;
+        apr_size_t avail = block->len - block->pos;
+
+        if (requested == SERF_READ_ALL_AVAIL || requested > avail)
+            requested = avail;
+
+        *data = BLOCK_DATA(block) + block->pos;
+        *len = requested;
+
+        return consume(ctx, requested);
+    }
+
+    if (ctx->file) {
+        status = prepare_file_bkt(bucket);
+        if (status) {
+            *len = 0;
+            return status;
+        }
+
+        return serf_bucket_read(ctx->file_bkt, requested, data, len);
+    }
+
+    if (APR_STATUS_IS_EOF(ctx->stream_status)) {
+        *len = 0;
+        return APR_EOF;
+    }
+
+    /* Nothing is buffered, read straight from the stream. */
+    status = serf_bucket_read(ctx->stream, requested, data, len);
+    if (!SERF_BUCKET_READ_ERROR(status))
+        ctx->stream_status = status;
+
+    return status;
+}
+
+static apr_status_t serf_spill_readline(serf_bucket_t *bucket,
+                                        int acceptable, int *found,
+                                        const char **data, apr_size_t *len)
+{
+    spill_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    free_done_block(bucket);
+
+    if (HAS_MEM_DATA(ctx)) {
+        const char *line = BLOCK_DATA(ctx->head) + ctx->head->pos;
+        apr_size_t avail = ctx->head->len - ctx->head->pos;
+
+        *data = line;
+        serf_util_readline(&line, &avail, acceptable, found);
+        *len = line - *data;
+
+        return consume(ctx, *len);
+    }
+
+    if (ctx->file) {
+        status = prepare_file_bkt(bucket);
+        if (status) {
+            *found = SERF_NEWLINE_NONE;
+            *len = 0;
+            return status;
+        }
+
+        return serf_bucket_readline(ctx->file_bkt, acceptable, found,
+                                    data, len);
+    }
+
+    if (APR_STATUS_IS_EOF(ctx->stream_status)) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        return APR_EOF;
+    }
+
+    status = serf_bucket_readline(ctx->stream, acceptable, found, data, len);
+    if (!SERF_BUCKET_READ_ERROR(status))
+        ctx->stream_status = status;
+
+    return status;
+}
+
+static apr_status_t serf_spill_read_for_sendfile(serf_bucket_t *bucket,
+                                                 apr_size_t requested,
+                                                 apr_hdtr_t *hdtr,
+                                                 apr_file_t **file,
+                                                 apr_off_t *offset,
+                                                 apr_size_t *len)
+{
+    spill_context_t *ctx = bucket->data;
+
+    /* The spilled data can be sent from the file as is. */
+    if (!HAS_MEM_DATA(ctx) && ctx->file
+        && prepare_file_bkt(bucket) == APR_SUCCESS) {
+        free_done_block(bucket);
+
+        return serf_bucket_read_for_sendfile(ctx->file_bkt, requested, hdtr,
+                                             file, offset, len);
+    }
+
+    return serf_default_read_for_sendfile(bucket, requested, hdtr,
+                                          file, offset, len);
+}
+
+static apr_status_t serf_spill_peek(serf_bucket_t *bucket,
+                                    const char **data,
+                                    apr_size_t *len)
+{
+    spill_context_t *ctx = bucket->data;
+
+    if (HAS_MEM_DATA(ctx)) {
+        *data = BLOCK_DATA(ctx->head) + ctx->head->pos;
+        *len = ctx->head->len - ctx->head->pos;
+
+        if (ctx->head->next || ctx->file
+            || !APR_STATUS_IS_EOF(ctx->stream_status))
+            return APR_SUCCESS;
+
+        return APR_EOF;
+    }
+
+    if (ctx->file_bkt)
+        return serf_bucket_peek(ctx->file_bkt, data, len);
+
+    if (ctx->file) {
+        /* Only available once all of the stream is in. */
+        *len = 0;
+        return APR_EAGAIN;
+    }
+
+    if (APR_STATUS_IS_EOF(ctx->stream_status)) {
+        *len = 0;
+        return APR_EOF;
+    }
+
+    return serf_bucket_peek(ctx->stream, data, len);
+}
+
+static apr_uint64_t serf_spill_get_remaining(serf_bucket_t *bucket)
+{
+    spill_context_t *ctx = bucket->data;
+    spill_block_t *block;
+    apr_uint64_t remaining;
+
+    if (ctx->file_bkt)
+        return serf_bucket_get_remaining(ctx->file_bkt);
+
+    if (!APR_STATUS_IS_EOF(ctx->stream_status))
+        return SERF_LENGTH_UNKNOWN;
+
+    remaining = ctx->file_size;
+    for (block = ctx->head; block; block = block->next)
+        remaining += block->len - block->pos;
+
+    return remaining;
+}
+
+static void serf_spill_destroy(serf_bucket_t *bucket)
+{
+    spill_context_t *ctx = bucket->data;
+
+    free_done_block(bucket);
+
+    while (ctx->head) {
+        spill_block_t *block = ctx->head;
+
+        ctx->head = block->next;
+        serf_bucket_mem_free(bucket->allocator, block);
+    }
+
+    if (ctx->file_bkt)
+        serf_bucket_destroy(ctx->file_bkt);
+
+    /* This also removes the file. */
+    if (ctx->file_pool)
+        apr_pool_destroy(ctx->file_pool);
+
+    serf_bucket_destroy(ctx->stream);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_spill_set_config(serf_bucket_t *bucket,
+                                          serf_config_t *config)
+{
+    spill_context_t *ctx = bucket->data;
+
+    ctx->config = config;
+
+    if (ctx->file_bkt)
+        serf_bucket_set_config(ctx->file_bkt, config);
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_spill = {
+    "SPILL",
+    serf_spill_read,
+    serf_spill_readline,
+    serf_default_read_iovec,
+    serf_spill_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_spill_peek,
+    serf_spill_destroy,
+    serf_default_read_bucket,
+    serf_spill_get_remaining,
+    serf_spill_set_config,
+};
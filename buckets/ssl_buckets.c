@@ -43,6 +43,7 @@
 #include <apr_base64.h>
 #include <apr_version.h>
 #include <apr_atomic.h>
+#include <apr_time.h>
 
 #include "serf.h"
 #include "serf_private.h"
@@ -61,6 +62,18 @@
 #define APR_ARRAY_PUSH(ary,type) (*((type *)apr_array_push(ary)))
 #endif
 
+/* OpenSSL 1.1 and later do their own locking, with the native threading
+   of the platform, and initialize themselves once. Their structures are
+   opaque; older versions get the accessors that replace the members. */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
+#define SERF_OPENSSL_NATIVE_THREADS
+#else
+#define BIO_get_data(bio) ((bio)->ptr)
+#define BIO_set_data(bio, data) ((bio)->ptr = (data))
+#define BIO_set_init(bio, val) ((bio)->init = (val))
+#define BIO_set_shutdown(bio, val) ((bio)->shutdown = (val))
+#endif
+
 
 /*
  * Here's an overview of the SSL bucket's relationship to OpenSSL and serf.
@@ -110,6 +123,13 @@
  *
  */
 
+/* The maximum amount of plain text in one TLS record. */
+#define FULL_RECORD_SIZE 16384
+
+/* The number of buffers that serf_ssl_decrypt_read_iovec() fills with one
+   call. */
+#define DECRYPT_IOVEC_BUFS 4
+
 typedef struct bucket_list {
     serf_bucket_t *bucket;
     struct bucket_list *next;
@@ -117,7 +137,7 @@ typedef struct bucket_list {
 
 typedef struct serf_ssl_stream_t {
     /* Helper to read data. Wraps stream. */
-    serf_databuf_t databuf;
+    serf__databuf_t databuf;
 
     /* Our source for more data. */
     serf_bucket_t *stream;
@@ -137,13 +157,16 @@ struct serf_ssl_context_t {
     serf_bucket_alloc_t *allocator;
 
     /* Internal OpenSSL parameters */
-    SSL_CTX *ctx;
     SSL *ssl;
     BIO *bio;
 
     serf_ssl_stream_t encrypt;
     serf_ssl_stream_t decrypt;
 
+    /* Buffers of FULL_RECORD_SIZE bytes that serf_ssl_decrypt_read_iovec()
+       decrypts into, allocated the first time they are needed. */
+    char *decrypt_bufs[DECRYPT_IOVEC_BUFS];
+
     /* The status of the last thing we read or wrote. */
     apr_status_t crypt_status;
 
@@ -185,6 +208,39 @@ struct serf_ssl_context_t {
     int renegotiation;
 
     serf_config_t *config;
+
+    /* The trust settings, applied to the certificate store of the SSL_CTX
+       when the context is first used, see setup_ssl_ctx(). */
+    int use_default_certs;
+    int check_crl;
+    apr_array_header_t *trusted_certs; /* X509 * */
+    apr_array_header_t *crls; /* X509_CRL * */
+
+    /* Set once SSL uses the SSL_CTX with these trust settings. */
+    int ctx_ready;
+
+    /* The key of the trust settings, see get_trust_key(). */
+    const char *trust_key;
+
+    /* Set when a server certificate callback accepted a certificate that
+       failed verification. The chain is then not remembered as verified. */
+    int verify_overridden;
+
+    /* Plain text bytes written since the connection started or was last
+       idle, and when that was. See record_size(). */
+    apr_size_t bulk_written;
+    apr_time_t last_write;
+
+    /* Called once the handshake is done, see serf_ssl_set_alpn_protocols().
+       Cleared when it was called. */
+    serf_ssl_protocol_result_cb_t protocol_callback;
+    void *protocol_userdata;
+
+    /* The protocol the server selected, once asked for. */
+    const char *selected_protocol;
+
+    /* Set once check_handshake_done() saw the end of the handshake. */
+    int handshake_finished;
 };
 
 typedef struct ssl_context_t {
@@ -192,7 +248,7 @@ typedef struct ssl_context_t {
     serf_ssl_context_t *ssl_ctx;
 
     /* Pointer to the 'right' databuf. */
-    serf_databuf_t *databuf;
+    serf__databuf_t *databuf;
 
     /* Pointer to our stream, so we can find it later. */
     serf_bucket_t **our_stream;
@@ -203,7 +259,12 @@ struct serf_ssl_certificate_t {
     int depth;
 };
 
-static void disable_compression(serf_ssl_context_t *ssl_ctx);
+static void disable_compression(SSL_CTX *ctx);
+static SSL_CTX *create_ssl_ctx(void);
+static void setup_ssl_ctx(serf_ssl_context_t *ssl_ctx);
+static const char *get_trust_key(serf_ssl_context_t *ssl_ctx);
+static const char *append_digest(const char *key, const unsigned char *md,
+                                 unsigned int md_len, apr_pool_t *pool);
 static char *
     pstrdup_escape_nul_bytes(const char *buf, int len, apr_pool_t *pool);
 
@@ -312,11 +373,48 @@ static void log_ssl_error(serf_ssl_context_t *ctx)
 
 }
 
+/* Once the handshake is done, record when in the timings of the connection
+   and tell the application which protocol the server selected. */
+static apr_status_t check_handshake_done(serf_ssl_context_t *ctx)
+{
+    serf_ssl_protocol_result_cb_t callback = ctx->protocol_callback;
+    void *timings = NULL;
+    apr_status_t status;
+
+    if (ctx->handshake_finished || !SSL_is_init_finished(ctx->ssl))
+        return APR_SUCCESS;
+
+    ctx->handshake_finished = 1;
+
+    if (ctx->config
+        && !serf_config_get_object(ctx->config, SERF__CONFIG_CONN_TIMINGS,
+                                   &timings)
+        && timings) {
+        serf_connection_timings_t *conn_timings = timings;
+
+        conn_timings->handshake_done = apr_time_now();
+        conn_timings->handshake_resumed = SSL_session_reused(ctx->ssl);
+    }
+
+    if (!callback)
+        return APR_SUCCESS;
+
+    ctx->protocol_callback = NULL;
+
+    status = callback(ctx->protocol_userdata,
+                      serf_ssl_get_selected_protocol(ctx));
+    if (status)
+        ctx->fatal_err = status;
+
+    return status;
+}
+
 /* Returns the amount read. */
 static int bio_bucket_read(BIO *bio, char *in, int inlen)
 {
-    serf_ssl_context_t *ctx = bio->ptr;
-    const char *data;
+    serf_ssl_context_t *ctx = BIO_get_data(bio);
+    struct iovec vecs[16];
+    int vecs_used, i;
     apr_status_t status;
     apr_size_t len;
 
@@ -330,7 +428,10 @@ static int bio_bucket_read(BIO *bio, char *in, int inlen)
 
     BIO_clear_retry_flags(bio); /* Clear retry hints */
 
-    status = serf_bucket_read(ctx->decrypt.stream, inlen, &data, &len);
+    /* Take as much as the stream has in one go; with read-ahead enabled
+       that is often several records. */
+    status = serf_bucket_read_iovec(ctx->decrypt.stream, inlen, 16, vecs,
+                                    &vecs_used);
     ctx->crypt_status = status;
     ctx->want_read = FALSE;
 
@@ -342,6 +443,12 @@ static int bio_bucket_read(BIO *bio, char *in, int inlen)
         BIO_set_retry_read(bio); /* Signal SSL: Retry later */
     }
 
+    len = 0;
+    for (i = 0; i < vecs_used; i++) {
+        memcpy(in + len, vecs[i].iov_base, vecs[i].iov_len);
+        len += vecs[i].iov_len;
+    }
+
     if (! len) {
         return -1; /* Raises: SSL_ERROR_SYSCALL; caller reads crypt_status */
     }
@@ -349,14 +456,13 @@ static int bio_bucket_read(BIO *bio, char *in, int inlen)
     serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
               "bio_bucket_read received %d bytes (%d)\n", len, status);
 
-    memcpy(in, data, len);
     return len;
 }
 
 /* Returns the amount written. */
 static int bio_bucket_write(BIO *bio, const char *in, int inl)
 {
-    serf_ssl_context_t *ctx = bio->ptr;
+    serf_ssl_context_t *ctx = BIO_get_data(bio);
     serf_bucket_t *tmp;
 
     /* The server initiated a renegotiation and we were instructed to report
@@ -381,7 +487,7 @@ static int bio_bucket_write(BIO *bio, const char *in, int inl)
 /* Returns the amount read. */
 static int bio_file_read(BIO *bio, char *in, int inlen)
 {
-    apr_file_t *file = bio->ptr;
+    apr_file_t *file = BIO_get_data(bio);
     apr_status_t status;
     apr_size_t len;
 
@@ -403,7 +509,7 @@ static int bio_file_read(BIO *bio, char *in, int inlen)
 /* Returns the amount written. */
 static int bio_file_write(BIO *bio, const char *in, int inl)
 {
-    apr_file_t *file = bio->ptr;
+    apr_file_t *file = BIO_get_data(bio);
     apr_size_t nbytes;
 
     BIO_clear_retry_flags(bio);
@@ -416,7 +522,7 @@ static int bio_file_write(BIO *bio, const char *in, int inl)
 
 static int bio_file_gets(BIO *bio, char *in, int inlen)
 {
-    apr_file_t *file = bio->ptr;
+    apr_file_t *file = BIO_get_data(bio);
     apr_status_t status;
 
     status = apr_file_gets(in, inlen, file);
@@ -432,10 +538,12 @@ static int bio_file_gets(BIO *bio, char *in, int inlen)
 
 static int bio_bucket_create(BIO *bio)
 {
-    bio->shutdown = 1;
-    bio->init = 1;
+    BIO_set_shutdown(bio, 1);
+    BIO_set_init(bio, 1);
+#ifndef SERF_OPENSSL_NATIVE_THREADS
     bio->num = -1;
-    bio->ptr = NULL;
+#endif
+    BIO_set_data(bio, NULL);
 
     return 1;
 }
@@ -469,7 +577,8 @@ static long bio_bucket_ctrl(BIO *bio, int cmd, long num, void *ptr)
     return ret;
 }
 
-static BIO_METHOD bio_bucket_method = {
+#ifndef SERF_OPENSSL_NATIVE_THREADS
+static BIO_METHOD bio_bucket_method_st = {
     BIO_TYPE_MEM,
     "Serf SSL encryption and decryption buckets",
     bio_bucket_write,
@@ -484,7 +593,7 @@ static BIO_METHOD bio_bucket_method = {
 #endif
 };
 
-static BIO_METHOD bio_file_method = {
+static BIO_METHOD bio_file_method_st = {
     BIO_TYPE_FILE,
     "Wrapper around APR file structures",
     bio_file_write,
@@ -499,19 +608,188 @@ static BIO_METHOD bio_file_method = {
 #endif
 };
 
+static BIO_METHOD *bio_bucket_method = &bio_bucket_method_st;
+static BIO_METHOD *bio_file_method = &bio_file_method_st;
+#else
+/* Created once by init_ssl_libraries(), OpenSSL no longer takes static
+   ones. */
+static BIO_METHOD *bio_bucket_method;
+static BIO_METHOD *bio_file_method;
+
+static BIO_METHOD *create_bio_method(int type, const char *name,
+                                     int (*write)(BIO *, const char *, int),
+                                     int (*read)(BIO *, char *, int),
+                                     int (*gets)(BIO *, char *, int))
+{
+    BIO_METHOD *biom = BIO_meth_new(type, name);
+
+    if (biom) {
+        BIO_meth_set_write(biom, write);
+        BIO_meth_set_read(biom, read);
+        if (gets)
+            BIO_meth_set_gets(biom, gets);
+        BIO_meth_set_ctrl(biom, bio_bucket_ctrl);
+        BIO_meth_set_create(biom, bio_bucket_create);
+        BIO_meth_set_destroy(biom, bio_bucket_destroy);
+    }
+
+    return biom;
+}
+#endif
+
+/* The SSL_CTX that every SSL is created from, created once by
+   init_ssl_libraries(). It has no trust settings and is never changed, see
+   setup_ssl_ctx(). */
+static SSL_CTX *bootstrap_ssl_ctx;
+
+/* Get the hash stored under KEY in the per host configuration of CONFIG,
+   optionally creating it. */
+static apr_hash_t *get_host_hash(serf_config_t *config, serf_config_key_t key,
+                                 int create)
+{
+    void *hash = NULL;
+
+    /* Only buckets on a connection know their host. */
+    if (!config)
+        return NULL;
+
+    if (serf_config_get_object(config, key, &hash))
+        return NULL;
+
+    if (!hash && create) {
+        hash = apr_hash_make(config->ctx_pool);
+        if (serf_config_set_object(config, key, hash))
+            return NULL;
+    }
+
+    return hash;
+}
+
 #ifndef OPENSSL_NO_TLSEXT
+/* The last OCSP response stapled for a server certificate of the host, and
+   the outcome of its checks. Handshakes that staple the same response
+   before its nextUpdate time reuse the outcome instead of parsing it. */
+typedef struct ocsp_cache_entry_t {
+    unsigned char *der;
+    int der_len;
+    int der_size;
+    int failures;
+    apr_time_t expires;
+} ocsp_cache_entry_t;
+
+/* Find the entry for the server certificate of SSL in the OCSP cache of
+   the host of CTX, optionally creating it. */
+static ocsp_cache_entry_t *find_ocsp_entry(serf_ssl_context_t *ctx, SSL *ssl,
+                                           int create)
+{
+    apr_hash_t *cache = get_host_hash(ctx->config,
+                                      SERF__CONFIG_HOST_OCSP_CACHE, create);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    ocsp_cache_entry_t *entry;
+    X509 *cert;
+    int digested;
+
+    if (!cache)
+        return NULL;
+
+    cert = SSL_get_peer_certificate(ssl);
+    if (!cert)
+        return NULL;
+    digested = X509_digest(cert, EVP_sha1(), md, &md_len);
+    X509_free(cert);
+    if (!digested)
+        return NULL;
+
+    entry = apr_hash_get(cache, md, md_len);
+    if (!entry && create) {
+        apr_pool_t *pool = ctx->config->ctx_pool;
+
+        entry = apr_pcalloc(pool, sizeof(*entry));
+        apr_hash_set(cache, apr_pmemdup(pool, md, md_len), md_len, entry);
+    }
+
+    return entry;
+}
+
+/* Parse the OCSP response DER of LEN bytes, and set *FAILURES to the
+   SERF_SSL_OCSP_* failures it reports. *EXPIRES is set to its nextUpdate
+   time, or 0 if it shouldn't be reused. Returns 0 if the response can't be
+   parsed. */
+static int parse_ocsp_response(const unsigned char *der, int len,
+                               int *failures, apr_time_t *expires)
+{
+    OCSP_RESPONSE *response;
+    long resp_status;
+
+    *failures = 0;
+    *expires = 0;
+
+    response = d2i_OCSP_RESPONSE(NULL, &der, len);
+    if (!response)
+        return 0;
+
+    /* Did the server get a valid response from the OCSP responder */
+    resp_status = OCSP_response_status(response);
+    switch (resp_status) {
+        case OCSP_RESPONSE_STATUS_SUCCESSFUL:
+            break;
+        case OCSP_RESPONSE_STATUS_MALFORMEDREQUEST:
+        case OCSP_RESPONSE_STATUS_INTERNALERROR:
+        case OCSP_RESPONSE_STATUS_SIGREQUIRED:
+        case OCSP_RESPONSE_STATUS_UNAUTHORIZED:
+            *failures |= SERF_SSL_OCSP_RESPONDER_ERROR;
+            break;
+        case OCSP_RESPONSE_STATUS_TRYLATER:
+            *failures |= SERF_SSL_OCSP_RESPONDER_TRYLATER;
+            break;
+        default:
+            *failures |= SERF_SSL_OCSP_RESPONDER_UNKNOWN_FAILURE;
+            break;
+    }
+
+    /* TODO: check certificate status */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    /* Without a nextUpdate time, newer information is always available. */
+    if (resp_status == OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+        OCSP_BASICRESP *basic = OCSP_response_get1_basic(response);
+
+        if (basic) {
+            OCSP_SINGLERESP *single = OCSP_resp_get0(basic, 0);
+            ASN1_GENERALIZEDTIME *next_update = NULL;
+            int days, secs;
+
+            if (single &&
+                OCSP_single_get0_status(single, NULL, NULL, NULL,
+                                        &next_update) >= 0 &&
+                next_update &&
+                ASN1_TIME_diff(&days, &secs, NULL, next_update)) {
+                apr_int64_t ttl = (apr_int64_t)days * 86400 + secs;
+
+                if (ttl > 0)
+                    *expires = apr_time_now() + apr_time_from_sec(ttl);
+            }
+            OCSP_BASICRESP_free(basic);
+        }
+    }
+#endif
+
+    OCSP_RESPONSE_free(response);
+
+    return 1;
+}
+
 /* Callback called when the server response has some OCSP info.
    Returns 1 if the application accepts the OCSP response as successful,
            0 in case of error.
  */
 static int ocsp_callback(SSL *ssl, void *baton)
 {
-    serf_ssl_context_t *ctx = (serf_ssl_context_t*)baton;
-    OCSP_RESPONSE *response;
-    OCSP_RESPBYTES *rb;
+    serf_ssl_context_t *ctx = SSL_get_app_data(ssl);
+    ocsp_cache_entry_t *entry;
     const unsigned char *resp_der;
     int len;
-    long resp_status;
     int failures = 0;
     int cert_valid = 0;
 
@@ -524,36 +802,36 @@ static int ocsp_callback(SSL *ssl, void *baton)
         /* No response sent */
         return SSL_TLSEXT_ERR_ALERT_FATAL;
     }
-    response = d2i_OCSP_RESPONSE(NULL, &resp_der, len);
-    if (!response) {
-        /* Error parsing OCSP response - tell the app? */
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
+
+    entry = find_ocsp_entry(ctx, ssl, 0);
+    if (entry && entry->der_len == len && entry->expires > apr_time_now() &&
+        memcmp(entry->der, resp_der, len) == 0) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "OCSP response seen before.\n");
+        failures = entry->failures;
     }
+    else {
+        apr_time_t expires;
 
-    rb = response->responseBytes;
+        if (!parse_ocsp_response(resp_der, len, &failures, &expires)) {
+            /* Error parsing OCSP response - tell the app? */
+            return SSL_TLSEXT_ERR_ALERT_FATAL;
+        }
 
-    /* Did the server get a valid response from the OCSP responder */
-    resp_status = ASN1_ENUMERATED_get(response->responseStatus);
-    switch (resp_status) {
-        case OCSP_RESPONSE_STATUS_SUCCESSFUL:
-            break;
-        case OCSP_RESPONSE_STATUS_MALFORMEDREQUEST:
-        case OCSP_RESPONSE_STATUS_INTERNALERROR:
-        case OCSP_RESPONSE_STATUS_SIGREQUIRED:
-        case OCSP_RESPONSE_STATUS_UNAUTHORIZED:
-            failures |= SERF_SSL_OCSP_RESPONDER_ERROR;
-            break;
-        case OCSP_RESPONSE_STATUS_TRYLATER:
-            failures |= SERF_SSL_OCSP_RESPONDER_TRYLATER;
-            break;
-        default:
-            failures |= SERF_SSL_OCSP_RESPONDER_UNKNOWN_FAILURE;
-            break;
+        if (expires && (entry = find_ocsp_entry(ctx, ssl, 1)) != NULL) {
+            if (entry->der_size < len) {
+                entry->der = apr_palloc(ctx->config->ctx_pool, len);
+                entry->der_size = len;
+            }
+            memcpy(entry->der, resp_der, len);
+            entry->der_len = len;
+            entry->failures = failures;
+            entry->expires = expires;
+        }
     }
 
-    /* TODO: check certificate status */
-
-    OCSP_RESPONSE_free(response);
+    /* A response without failures is good as it is. */
+    cert_valid = !failures;
 
     if (ctx->server_cert_callback && failures) {
         apr_status_t status;
@@ -672,6 +950,113 @@ static apr_status_t validate_cert_hostname(X509 *server_cert, apr_pool_t *pool)
     return APR_SUCCESS;
 }
 
+/* How long a server certificate chain that was accepted for a host is
+   accepted again without asking the application. */
+#define VERIFIED_CERT_TTL apr_time_from_sec(300)
+
+/* Describe the rules CTX verifies server certificates by: its trust
+   settings and its server certificate callbacks. What was verified under
+   some rules is only reused under the same. */
+static const char *get_verify_rules_key(serf_ssl_context_t *ctx)
+{
+    unsigned char ids[sizeof(ctx->server_cert_callback)
+                      + sizeof(ctx->server_cert_chain_callback)
+                      + sizeof(ctx->server_cert_userdata)];
+    const char *key;
+
+    key = get_trust_key(ctx);
+    if (!key)
+        return NULL;
+
+    memcpy(ids, &ctx->server_cert_callback,
+           sizeof(ctx->server_cert_callback));
+    memcpy(ids + sizeof(ctx->server_cert_callback),
+           &ctx->server_cert_chain_callback,
+           sizeof(ctx->server_cert_chain_callback));
+    memcpy(ids + sizeof(ctx->server_cert_callback)
+               + sizeof(ctx->server_cert_chain_callback),
+           &ctx->server_cert_userdata, sizeof(ctx->server_cert_userdata));
+
+    return append_digest(key, ids, sizeof(ids), ctx->pool);
+}
+
+/* Get the key of the chain that STORE_CTX verifies in the cache of
+   verified chains of the host of CTX: the verification rules, and the
+   SHA1 fingerprint of the server certificate. */
+static const char *get_verified_key(serf_ssl_context_t *ctx,
+                                    X509_STORE_CTX *store_ctx)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get_chain(store_ctx);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    const char *key;
+
+    if (!chain || sk_X509_num(chain) < 1)
+        return NULL;
+    if (!X509_digest(sk_X509_value(chain, 0), EVP_sha1(), md, &md_len))
+        return NULL;
+
+    key = get_verify_rules_key(ctx);
+    if (!key)
+        return NULL;
+
+    return append_digest(key, md, md_len, ctx->pool);
+}
+
+/* Was the chain of STORE_CTX accepted for this host a moment ago? */
+static int verified_recently(serf_ssl_context_t *ctx,
+                             X509_STORE_CTX *store_ctx)
+{
+    apr_hash_t *verified = get_host_hash(ctx->config,
+                                         SERF__CONFIG_HOST_VERIFIED_CERTS, 0);
+    const char *key;
+    apr_time_t *expires;
+
+    if (!verified)
+        return 0;
+
+    key = get_verified_key(ctx, store_ctx);
+    if (!key)
+        return 0;
+
+    expires = apr_hash_get(verified, key, APR_HASH_KEY_STRING);
+    if (!expires)
+        return 0;
+
+    if (*expires <= apr_time_now()) {
+        apr_hash_set(verified, key, APR_HASH_KEY_STRING, NULL);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void remember_verified(serf_ssl_context_t *ctx,
+                              X509_STORE_CTX *store_ctx)
+{
+    apr_hash_t *verified = get_host_hash(ctx->config,
+                                         SERF__CONFIG_HOST_VERIFIED_CERTS, 1);
+    const char *key;
+    apr_time_t *expires;
+
+    if (!verified)
+        return;
+
+    key = get_verified_key(ctx, store_ctx);
+    if (!key)
+        return;
+
+    expires = apr_hash_get(verified, key, APR_HASH_KEY_STRING);
+    if (!expires) {
+        apr_pool_t *pool = ctx->config->ctx_pool;
+
+        expires = apr_palloc(pool, sizeof(*expires));
+        apr_hash_set(verified, apr_pstrdup(pool, key), APR_HASH_KEY_STRING,
+                     expires);
+    }
+    *expires = apr_time_now() + VERIFIED_CERT_TTL;
+}
+
 static int
 validate_server_certificate(int cert_valid, X509_STORE_CTX *store_ctx)
 {
@@ -741,6 +1126,12 @@ validate_server_certificate(int cert_valid, X509_STORE_CTX *store_ctx)
         failures |= SERF_SSL_CERT_EXPIRED;
     }
 
+    /* Don't ask the application again about a chain that OpenSSL and our
+       checks found valid, and that it accepted a moment ago. */
+    if (cert_valid && !failures && depth == 0
+        && verified_recently(ctx, store_ctx))
+        return 1;
+
     if (ctx->server_cert_callback &&
         (depth == 0 || failures)) {
         serf_ssl_certificate_t *cert;
@@ -837,7 +1228,17 @@ validate_server_certificate(int cert_valid, X509_STORE_CTX *store_ctx)
     {
         ctx->pending_err = SERF_ERROR_SSL_CERT_FAILED;
     }
-        
+
+    if (cert_valid && failures)
+        ctx->verify_overridden = 1;
+
+    /* The whole chain is accepted once the server certificate is, as the
+       certificates are verified from the root down. Only chains that were
+       verified without the application overriding failures are
+       remembered. */
+    if (cert_valid && depth == 0 && !ctx->verify_overridden)
+        remember_verified(ctx, store_ctx);
+
     return cert_valid;
 }
 
@@ -850,6 +1251,7 @@ static apr_status_t ssl_decrypt(void *baton, apr_size_t bufsize,
     apr_status_t status;
     int ssl_len;
 
+    setup_ssl_ctx(ctx);
     if (ctx->fatal_err)
         return ctx->fatal_err;
 
@@ -934,50 +1336,57 @@ static apr_status_t ssl_decrypt(void *baton, apr_size_t bufsize,
                     "---\n%.*s\n-(%d)-\n", *len, buf, *len);
     }
  
+    if (!SERF_BUCKET_READ_ERROR(status)) {
+        apr_status_t cb_status = check_handshake_done(ctx);
+        if (cb_status)
+            status = cb_status;
+    }
+
     serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
               "ssl_decrypt: %d %d\n", status, *len);
 
     return status;
 }
 
-/* This function reads a decrypted stream and returns an encrypted stream.
-   Implements serf_databuf_reader_t */
-static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
-                                char *buf, apr_size_t *len)
+/* Dynamic record sizing: at the start of a connection, and after it was
+   idle, records are kept small so that each fits in one TCP segment and
+   the server can decrypt it as soon as it arrived. Once the connection is
+   busy, the records grow to the maximum size allowed by TLS, and several
+   are encrypted with one SSL_write to reduce the overhead per record. */
+#define SMALL_RECORD_SIZE 1369
+#define BULK_THRESHOLD (64 * 1024)
+#define BULK_BATCH_SIZE (4 * FULL_RECORD_SIZE)
+#define RECORD_IDLE_RESET apr_time_from_sec(1)
+
+/* Returns the size of the records to write now. */
+static apr_size_t record_size(serf_ssl_context_t *ctx)
 {
-    const char *data;
-    apr_size_t interim_bufsize;
-    serf_ssl_context_t *ctx = baton;
-    apr_status_t status;
-
-    if (ctx->fatal_err)
-        return ctx->fatal_err;
-
-    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-              "ssl_encrypt: begin %d\n", bufsize);
-
-    /* Try to read already encrypted but unread data first. */
-    status = serf_bucket_read(ctx->encrypt_pending, bufsize, &data, len);
-    if (SERF_BUCKET_READ_ERROR(status)) {
-        return status;
-    }
+    apr_time_t now = apr_time_now();
 
-    /* Aha, we read something.  Return that now. */
-    if (*len) {
-        memcpy(buf, data, *len);
-        if (APR_STATUS_IS_EOF(status)) {
-            status = APR_SUCCESS;
-        }
+    if (now - ctx->last_write > RECORD_IDLE_RESET)
+        ctx->bulk_written = 0;
+    ctx->last_write = now;
 
-        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                  "ssl_encrypt: %d %d (quick read)\n",
-                  status, *len);
+    return ctx->bulk_written < BULK_THRESHOLD ? SMALL_RECORD_SIZE
+                                              : FULL_RECORD_SIZE;
+}
 
-        return status;
-    }
+/* Encrypt what the stream has, about BUFSIZE bytes worth, and add the
+   records to encrypt_pending. */
+static apr_status_t encrypt_stream(serf_ssl_context_t *ctx,
+                                   apr_size_t bufsize)
+{
+    apr_size_t interim_bufsize;
+    apr_size_t rec_size;
+    apr_status_t status;
 
-    /* Oh well, read from our stream now. */
+    /* During bulk transfer encrypt more than BUFSIZE; what the caller
+       doesn't take stays in encrypt_pending until the next call. */
+    rec_size = record_size(ctx);
     interim_bufsize = bufsize;
+    if (rec_size == FULL_RECORD_SIZE && interim_bufsize < BULK_BATCH_SIZE)
+        interim_bufsize = BULK_BATCH_SIZE;
+
     do {
         apr_size_t interim_len;
 
@@ -992,6 +1401,7 @@ static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
             if (!SERF_BUCKET_READ_ERROR(status) && vecs_read) {
                 char *vecs_data;
                 int i, cur, vecs_data_len;
+                int written;
                 int ssl_len;
 
                 /* Combine the buffers of the iovec into one buffer, as
@@ -1017,25 +1427,45 @@ static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
                           "ssl_encrypt: bucket read %d bytes; "\
                           "status %d\n", interim_len, status);
 
-                ctx->crypt_status = APR_SUCCESS; /* Clear before calling SSL */
-                ssl_len = SSL_write(ctx->ssl, vecs_data, interim_len);
+                /* Small records each get an SSL_write of their own,
+                   full size ones are all written at once. */
+                written = 0;
+                do {
+                    int chunk_len = vecs_data_len - written;
 
-                serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                          "ssl_encrypt: SSL write: %d\n", ssl_len);
+                    if (rec_size == SMALL_RECORD_SIZE &&
+                        chunk_len > SMALL_RECORD_SIZE)
+                        chunk_len = SMALL_RECORD_SIZE;
+
+                    /* Clear before calling SSL */
+                    ctx->crypt_status = APR_SUCCESS;
+                    ssl_len = SSL_write(ctx->ssl, vecs_data + written,
+                                        chunk_len);
+
+                    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__,
+                              ctx->config, "ssl_encrypt: SSL write: %d\n",
+                              ssl_len);
+
+                    if (ssl_len > 0) {
+                        written += ssl_len;
+                        ctx->bulk_written += ssl_len;
+                    }
+                } while (ssl_len > 0 && written < vecs_data_len);
 
                 /* If we failed to write... */
                 if (ssl_len < 0) {
                     int ssl_err;
 
-                    /* Ah, bugger. We need to put that data back.
-                       Note: use the copy here, we do not own the original iovec
+                    /* Ah, bugger. We need to put the rest of the data back.
+                       Note: use a copy here, we do not own the original iovec
                        data buffer so it will be freed on next read. */
                     serf_bucket_t *vecs_copy =
-                        serf_bucket_simple_own_create(vecs_data,
-                                                      vecs_data_len,
-                                                      ctx->allocator);
+                        serf_bucket_simple_copy_create(vecs_data + written,
+                                                       vecs_data_len - written,
+                                                       ctx->allocator);
                     serf_bucket_aggregate_prepend(ctx->encrypt.stream,
                                                   vecs_copy);
+                    serf_bucket_mem_free(ctx->allocator, vecs_data);
 
                     ssl_err = SSL_get_error(ctx->ssl, ssl_len);
 
@@ -1087,7 +1517,6 @@ static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
         }
         else {
             interim_len = 0;
-            *len = 0;
             status = ctx->crypt_status;
 
             if (!status) {
@@ -1097,45 +1526,98 @@ static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
 
     } while (!status && interim_bufsize);
 
-    /* Okay, we exhausted our underlying stream. */
     if (!SERF_BUCKET_READ_ERROR(status)) {
-        apr_status_t agg_status;
-        struct iovec vecs[64];
-        int vecs_read, i;
-
-        /* We read something! */
-        agg_status = serf_bucket_read_iovec(ctx->encrypt_pending, bufsize,
-                                            64, vecs, &vecs_read);
-        *len = 0;
-        for (i = 0; i < vecs_read; i++) {
-            memcpy(buf + *len, vecs[i].iov_base, vecs[i].iov_len);
-            *len += vecs[i].iov_len;
-        }
-
-        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-                  "ssl_encrypt read agg: %d %d %d %d\n", status, agg_status,
-                  ctx->crypt_status, *len);
-
-        if (!agg_status) {
-            status = APR_SUCCESS;
-        }
+        apr_status_t cb_status = check_handshake_done(ctx);
+        if (cb_status)
+            status = cb_status;
     }
 
-    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
-              "ssl_encrypt finished: %d %d\n", status, *len);
-
     return status;
 }
 
-#if APR_HAS_THREADS
-static apr_pool_t *ssl_pool;
-static apr_thread_mutex_t **ssl_locks;
-
-typedef struct CRYPTO_dynlock_value {
-    apr_thread_mutex_t *lock;
-} CRYPTO_dynlock_value;
-
-static CRYPTO_dynlock_value *ssl_dyn_create(const char* file, int line)
+/* This function reads a decrypted stream and returns an encrypted stream.
+   Implements serf_databuf_reader_t */
+static apr_status_t ssl_encrypt(void *baton, apr_size_t bufsize,
+                                char *buf, apr_size_t *len)
+{
+    const char *data;
+    serf_ssl_context_t *ctx = baton;
+    apr_status_t status;
+
+    setup_ssl_ctx(ctx);
+    if (ctx->fatal_err)
+        return ctx->fatal_err;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "ssl_encrypt: begin %d\n", bufsize);
+
+    /* Try to read already encrypted but unread data first. */
+    status = serf_bucket_read(ctx->encrypt_pending, bufsize, &data, len);
+    if (SERF_BUCKET_READ_ERROR(status)) {
+        return status;
+    }
+
+    /* Aha, we read something.  Return that now. */
+    if (*len) {
+        memcpy(buf, data, *len);
+        if (APR_STATUS_IS_EOF(status)) {
+            status = APR_SUCCESS;
+        }
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "ssl_encrypt: %d %d (quick read)\n",
+                  status, *len);
+
+        return status;
+    }
+
+    /* Oh well, read from our stream now. */
+    *len = 0;
+    status = encrypt_stream(ctx, bufsize);
+
+    /* Okay, we exhausted our underlying stream. */
+    if (!SERF_BUCKET_READ_ERROR(status)) {
+        apr_status_t agg_status;
+        struct iovec vecs[64];
+        int vecs_read, i;
+
+        /* We read something! */
+        agg_status = serf_bucket_read_iovec(ctx->encrypt_pending, bufsize,
+                                            64, vecs, &vecs_read);
+        *len = 0;
+        for (i = 0; i < vecs_read; i++) {
+            memcpy(buf + *len, vecs[i].iov_base, vecs[i].iov_len);
+            *len += vecs[i].iov_len;
+        }
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+                  "ssl_encrypt read agg: %d %d %d %d\n", status, agg_status,
+                  ctx->crypt_status, *len);
+
+        if (!agg_status) {
+            status = APR_SUCCESS;
+        }
+    }
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "ssl_encrypt finished: %d %d\n", status, *len);
+
+    return status;
+}
+
+#if APR_HAS_THREADS && !defined(SERF_OPENSSL_NATIVE_THREADS)
+#define SERF_OPENSSL_LOCK_CALLBACKS
+#endif
+
+#ifdef SERF_OPENSSL_LOCK_CALLBACKS
+static apr_pool_t *ssl_pool;
+static apr_thread_mutex_t **ssl_locks;
+
+typedef struct CRYPTO_dynlock_value {
+    apr_thread_mutex_t *lock;
+} CRYPTO_dynlock_value;
+
+static CRYPTO_dynlock_value *ssl_dyn_create(const char* file, int line)
 {
     CRYPTO_dynlock_value *l;
     apr_status_t rv;
@@ -1196,6 +1678,7 @@ static apr_status_t cleanup_ssl(void *data)
 
 #if !APR_VERSION_AT_LEAST(1,0,0)
 #define apr_atomic_cas32(mem, with, cmp) apr_atomic_cas(mem, with, cmp)
+#define apr_atomic_read32(mem) apr_atomic_read(mem)
 #endif
 
 enum ssl_init_e
@@ -1211,10 +1694,15 @@ static void init_ssl_libraries(void)
 {
     apr_uint32_t val;
 
+    /* Every new ssl context passes here, so the common case shouldn't
+       need more than a read. */
+    if (apr_atomic_read32(&have_init_ssl) == INIT_DONE)
+        return;
+
     val = apr_atomic_cas32(&have_init_ssl, INIT_BUSY, INIT_UNINITIALIZED);
 
     if (!val) {
-#if APR_HAS_THREADS
+#ifdef SERF_OPENSSL_LOCK_CALLBACKS
         int i, numlocks;
 #endif
 
@@ -1231,13 +1719,27 @@ static void init_ssl_libraries(void)
         }
 #endif
 
+#ifdef SERF_OPENSSL_NATIVE_THREADS
+        OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS
+                         | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+
+        bio_bucket_method = create_bio_method(
+                                BIO_TYPE_MEM,
+                                "Serf SSL encryption and decryption buckets",
+                                bio_bucket_write, bio_bucket_read, NULL);
+        bio_file_method = create_bio_method(
+                              BIO_TYPE_FILE,
+                              "Wrapper around APR file structures",
+                              bio_file_write, bio_file_read, bio_file_gets);
+#else
         CRYPTO_malloc_init();
         ERR_load_crypto_strings();
         SSL_load_error_strings();
         SSL_library_init();
         OpenSSL_add_all_algorithms();
+#endif
 
-#if APR_HAS_THREADS
+#ifdef SERF_OPENSSL_LOCK_CALLBACKS
         numlocks = CRYPTO_num_locks();
         apr_pool_create(&ssl_pool, NULL);
         ssl_locks = apr_palloc(ssl_pool, sizeof(apr_thread_mutex_t*)*numlocks);
@@ -1259,6 +1761,9 @@ static void init_ssl_libraries(void)
 
         apr_pool_cleanup_register(ssl_pool, NULL, cleanup_ssl, cleanup_ssl);
 #endif
+
+        bootstrap_ssl_ctx = create_ssl_ctx();
+
         apr_atomic_cas32(&have_init_ssl, INIT_DONE, INIT_BUSY);
     }
   else
@@ -1268,9 +1773,7 @@ static void init_ssl_libraries(void)
         while (val != INIT_DONE) {
             apr_sleep(APR_USEC_PER_SEC / 1000);
       
-            val = apr_atomic_cas32(&have_init_ssl,
-                                   INIT_UNINITIALIZED,
-                                   INIT_UNINITIALIZED);            
+            val = apr_atomic_read32(&have_init_ssl);
         }
     }
 }
@@ -1319,8 +1822,8 @@ static int ssl_need_client_cert(SSL *ssl, X509 **cert, EVP_PKEY **pkey)
             continue;
         }
 
-        bio = BIO_new(&bio_file_method);
-        bio->ptr = cert_file;
+        bio = BIO_new(bio_file_method);
+        BIO_set_data(bio, cert_file);
 
         ctx->cert_path = cert_path;
         p12 = d2i_PKCS12_bio(bio, NULL);
@@ -1461,6 +1964,338 @@ void serf_ssl_server_cert_chain_callback_set(
     context->server_cert_userdata = data;
 }
 
+/* The last session negotiated with a host, kept in the per host config
+   so that new connections to the host can resume it instead of doing a
+   full handshake. This includes the session tickets of TLS 1.3. As a
+   resumed handshake doesn't verify the server certificate again, the
+   sessions are kept per verification rules, see get_verify_rules_key(). */
+typedef struct ssl_session_cache_t {
+    SSL_SESSION *session;
+} ssl_session_cache_t;
+
+static apr_status_t free_session_cache(void *baton)
+{
+    ssl_session_cache_t *cache = baton;
+
+    if (cache->session) {
+        SSL_SESSION_free(cache->session);
+        cache->session = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+static ssl_session_cache_t *get_session_cache(serf_ssl_context_t *ctx,
+                                              int create)
+{
+    apr_hash_t *sessions = get_host_hash(ctx->config,
+                                         SERF__CONFIG_HOST_SSL_SESSION,
+                                         create);
+    ssl_session_cache_t *cache;
+    const char *key;
+
+    if (!sessions)
+        return NULL;
+
+    key = get_verify_rules_key(ctx);
+    if (!key)
+        return NULL;
+
+    cache = apr_hash_get(sessions, key, APR_HASH_KEY_STRING);
+    if (!cache && create) {
+        apr_pool_t *pool = ctx->config->ctx_pool;
+
+        cache = apr_pcalloc(pool, sizeof(*cache));
+        apr_pool_cleanup_register(pool, cache, free_session_cache,
+                                  apr_pool_cleanup_null);
+        apr_hash_set(sessions, apr_pstrdup(pool, key), APR_HASH_KEY_STRING,
+                     cache);
+    }
+
+    return cache;
+}
+
+/* Called by OpenSSL when a new session was negotiated, or a new session
+   ticket arrived. */
+static int ssl_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    serf_ssl_context_t *ctx = SSL_get_app_data(ssl);
+    ssl_session_cache_t *cache;
+
+    /* The rules of this connection didn't verify the server. */
+    if (ctx->verify_overridden)
+        return 0;
+
+    cache = get_session_cache(ctx, 1);
+    if (!cache)
+        return 0;
+
+    if (cache->session)
+        SSL_SESSION_free(cache->session);
+    cache->session = session;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, ctx->config,
+              "cached new ssl session.\n");
+
+    /* We keep the reference OpenSSL passed to us. */
+    return 1;
+}
+
+/* Create a SSL_CTX with the settings that all client connections share.
+   Everything specific to a connection is set on its SSL object instead. */
+static SSL_CTX *create_ssl_ctx(void)
+{
+    SSL_CTX *ctx;
+
+    /* Use the best possible protocol version, but disable the broken SSLv2/3 */
+    ctx = SSL_CTX_new(SSLv23_client_method());
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+
+    SSL_CTX_set_client_cert_cb(ctx, ssl_need_client_cert);
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, validate_server_certificate);
+    SSL_CTX_set_options(ctx, SSL_OP_ALL);
+    /* Disable SSL compression by default. */
+    disable_compression(ctx);
+
+    /* Sessions are cached per host in the config store. */
+    SSL_CTX_set_session_cache_mode(ctx,
+                                   SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, ssl_new_session);
+
+#ifndef OPENSSL_NO_TLSEXT
+    /* Only called when the connection requested the certificate status. */
+    SSL_CTX_set_tlsext_status_cb(ctx, ocsp_callback);
+#endif
+
+#ifdef SERF_LOGGING_ENABLED
+    SSL_CTX_set_info_callback(ctx, apps_ssl_info_callback);
+#endif
+
+    return ctx;
+}
+
+/* Add the trust settings of SSL_CTX to STORE. */
+static apr_status_t apply_trust_settings(serf_ssl_context_t *ssl_ctx,
+                                         X509_STORE *store)
+{
+    int i;
+
+    if (ssl_ctx->use_default_certs && !X509_STORE_set_default_paths(store))
+        return SERF_ERROR_SSL_CERT_FAILED;
+
+    for (i = 0; ssl_ctx->trusted_certs && i < ssl_ctx->trusted_certs->nelts;
+         i++) {
+        X509 *cert = APR_ARRAY_IDX(ssl_ctx->trusted_certs, i, X509 *);
+
+        if (!X509_STORE_add_cert(store, cert))
+            return SERF_ERROR_SSL_CERT_FAILED;
+    }
+
+    for (i = 0; ssl_ctx->crls && i < ssl_ctx->crls->nelts; i++) {
+        X509_CRL *crl = APR_ARRAY_IDX(ssl_ctx->crls, i, X509_CRL *);
+
+        if (!X509_STORE_add_crl(store, crl)) {
+            log_ssl_error(ssl_ctx);
+            return SERF_ERROR_SSL_CERT_FAILED;
+        }
+    }
+
+    if (ssl_ctx->check_crl) {
+        X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK|
+                             X509_V_FLAG_CRL_CHECK_ALL);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Append the hex digest MD of MD_LEN bytes to KEY. */
+static const char *append_digest(const char *key, const unsigned char *md,
+                                 unsigned int md_len, apr_pool_t *pool)
+{
+    const char hex[] = "0123456789abcdef";
+    char digest[EVP_MAX_MD_SIZE * 2 + 1];
+    unsigned int i;
+
+    for (i = 0; i < md_len; i++) {
+        digest[2*i] = hex[(md[i] & 0xf0) >> 4];
+        digest[(2*i)+1] = hex[(md[i] & 0x0f)];
+    }
+    digest[2*md_len] = '\0';
+
+    return apr_pstrcat(pool, key, ":", digest, NULL);
+}
+
+/* Describe the trust settings of SSL_CTX, as key of the shared SSL_CTX's. */
+static const char *trust_settings_key(serf_ssl_context_t *ssl_ctx,
+                                      apr_pool_t *pool)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    const char *key;
+    int i;
+
+    key = apr_psprintf(pool, "%d%d", ssl_ctx->use_default_certs,
+                       ssl_ctx->check_crl);
+
+    for (i = 0; ssl_ctx->trusted_certs && i < ssl_ctx->trusted_certs->nelts;
+         i++) {
+        X509 *cert = APR_ARRAY_IDX(ssl_ctx->trusted_certs, i, X509 *);
+
+        if (!X509_digest(cert, EVP_sha1(), md, &md_len))
+            return NULL;
+        key = append_digest(key, md, md_len, pool);
+    }
+
+    key = apr_pstrcat(pool, key, ":", NULL);
+    for (i = 0; ssl_ctx->crls && i < ssl_ctx->crls->nelts; i++) {
+        X509_CRL *crl = APR_ARRAY_IDX(ssl_ctx->crls, i, X509_CRL *);
+
+        if (!X509_CRL_digest(crl, EVP_sha1(), md, &md_len))
+            return NULL;
+        key = append_digest(key, md, md_len, pool);
+    }
+
+    return key;
+}
+
+/* Get the trust settings key of SSL_CTX, computed once until the trust
+   settings change. */
+static const char *get_trust_key(serf_ssl_context_t *ssl_ctx)
+{
+    if (!ssl_ctx->trust_key)
+        ssl_ctx->trust_key = trust_settings_key(ssl_ctx, ssl_ctx->pool);
+
+    return ssl_ctx->trust_key;
+}
+
+static apr_status_t free_ssl_ctx_cache(void *baton)
+{
+    apr_hash_t *cache = baton;
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(NULL, cache); hi; hi = apr_hash_next(hi)) {
+        void *val;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        SSL_CTX_free(val);
+    }
+    apr_hash_clear(cache);
+
+    return APR_SUCCESS;
+}
+
+/* Find the SSL_CTX for the trust settings of SSL_CTX among the ones shared
+   by the connections of its context, or add a new one. Returns NULL when
+   it has to make do with its own. */
+static SSL_CTX *get_shared_ssl_ctx(serf_ssl_context_t *ssl_ctx)
+{
+    serf_config_t *config = ssl_ctx->config;
+    void *cache = NULL;
+    const char *key;
+    SSL_CTX *ctx;
+
+    if (serf_config_get_object(config, SERF__CONFIG_CTX_SSL_CTX_CACHE,
+                               &cache))
+        return NULL;
+
+    if (!cache) {
+        cache = apr_hash_make(config->ctx_pool);
+        apr_pool_cleanup_register(config->ctx_pool, cache,
+                                  free_ssl_ctx_cache, apr_pool_cleanup_null);
+
+        if (serf_config_set_object(config, SERF__CONFIG_CTX_SSL_CTX_CACHE,
+                                   cache))
+            return NULL;
+    }
+
+    key = get_trust_key(ssl_ctx);
+    if (!key)
+        return NULL;
+
+    ctx = apr_hash_get(cache, key, APR_HASH_KEY_STRING);
+    if (!ctx) {
+        ctx = create_ssl_ctx();
+        if (apply_trust_settings(ssl_ctx, SSL_CTX_get_cert_store(ctx))) {
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+
+        apr_hash_set(cache, apr_pstrdup(config->ctx_pool, key),
+                     APR_HASH_KEY_STRING, ctx);
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, config,
+                  "created shared ssl ctx for trust settings %s.\n", key);
+    }
+
+    return ctx;
+}
+
+/* Give SSL an SSL_CTX of its own, with the trust settings of SSL_CTX. */
+static apr_status_t use_own_ssl_ctx(serf_ssl_context_t *ssl_ctx)
+{
+    SSL_CTX *ctx;
+    apr_status_t status;
+
+    ctx = create_ssl_ctx();
+    status = apply_trust_settings(ssl_ctx, SSL_CTX_get_cert_store(ctx));
+    if (!status)
+        SSL_set_SSL_CTX(ssl_ctx->ssl, ctx);
+
+    /* SSL holds its own reference. */
+    SSL_CTX_free(ctx);
+
+    return status;
+}
+
+/* Make SSL use an SSL_CTX with the trust settings of SSL_CTX, before the
+   handshake starts. SSL was created from bootstrap_ssl_ctx, which is fine
+   as long as there are no trust settings. Otherwise the connections of a
+   context with the same settings share one SSL_CTX, so the CA certificates
+   are loaded only once and not for each connection. Without a config,
+   e.g. when not used on a connection, SSL gets an SSL_CTX of its own. */
+static void setup_ssl_ctx(serf_ssl_context_t *ssl_ctx)
+{
+    SSL_CTX *shared_ctx;
+    apr_status_t status;
+
+    if (ssl_ctx->ctx_ready)
+        return;
+    ssl_ctx->ctx_ready = 1;
+
+    if (!ssl_ctx->use_default_certs && !ssl_ctx->check_crl
+        && !ssl_ctx->trusted_certs && !ssl_ctx->crls)
+        return;
+
+    shared_ctx = ssl_ctx->config ? get_shared_ssl_ctx(ssl_ctx) : NULL;
+    if (shared_ctx) {
+        SSL_set_SSL_CTX(ssl_ctx->ssl, shared_ctx);
+        return;
+    }
+
+    status = use_own_ssl_ctx(ssl_ctx);
+    if (status)
+        ssl_ctx->fatal_err = status;
+}
+
+/* The trust settings of SSL_CTX changed. If SSL already uses an SSL_CTX,
+   give it a new one of its own, with all the settings. */
+static apr_status_t trust_settings_changed(serf_ssl_context_t *ssl_ctx)
+{
+    ssl_ctx->trust_key = NULL;
+
+    if (!ssl_ctx->ctx_ready)
+        return APR_SUCCESS;
+
+    return use_own_ssl_ctx(ssl_ctx);
+}
+
+void *serf__ssl_get_ssl_ctx(serf_ssl_context_t *ssl_ctx)
+{
+    return SSL_get_SSL_CTX(ssl_ctx->ssl);
+}
+
 static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
 {
     serf_ssl_context_t *ssl_ctx;
@@ -1473,11 +2308,6 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
     ssl_ctx->pool = serf_bucket_allocator_get_pool(allocator);
     ssl_ctx->allocator = allocator;
 
-    /* Use the best possible protocol version, but disable the broken SSLv2/3 */
-    ssl_ctx->ctx = SSL_CTX_new(SSLv23_client_method());
-    SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-
-    SSL_CTX_set_client_cert_cb(ssl_ctx->ctx, ssl_need_client_cert);
     ssl_ctx->cached_cert = 0;
     ssl_ctx->cached_cert_pw = 0;
     ssl_ctx->pending_err = APR_SUCCESS;
@@ -1485,42 +2315,53 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
     ssl_ctx->renegotiation = 0;
     ssl_ctx->config = NULL;
 
+    ssl_ctx->bulk_written = 0;
+    ssl_ctx->last_write = 0;
+
+    ssl_ctx->use_default_certs = 0;
+    ssl_ctx->check_crl = 0;
+    ssl_ctx->trusted_certs = NULL;
+    ssl_ctx->crls = NULL;
+    ssl_ctx->ctx_ready = 0;
+    ssl_ctx->trust_key = NULL;
+    ssl_ctx->verify_overridden = 0;
+
     ssl_ctx->cert_callback = NULL;
     ssl_ctx->cert_pw_callback = NULL;
     ssl_ctx->server_cert_callback = NULL;
     ssl_ctx->server_cert_chain_callback = NULL;
+    ssl_ctx->protocol_callback = NULL;
+    ssl_ctx->protocol_userdata = NULL;
+    ssl_ctx->selected_protocol = NULL;
+    ssl_ctx->handshake_finished = 0;
 
-    SSL_CTX_set_verify(ssl_ctx->ctx, SSL_VERIFY_PEER,
-                       validate_server_certificate);
-    SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_ALL);
-    /* Disable SSL compression by default. */
-    disable_compression(ssl_ctx);
-
-    ssl_ctx->ssl = SSL_new(ssl_ctx->ctx);
-    ssl_ctx->bio = BIO_new(&bio_bucket_method);
-    ssl_ctx->bio->ptr = ssl_ctx;
+    /* Cheap, unlike creating an SSL_CTX. The SSL_CTX with the trust
+       settings is set up later, see setup_ssl_ctx(). */
+    ssl_ctx->ssl = SSL_new(bootstrap_ssl_ctx);
+    ssl_ctx->bio = BIO_new(bio_bucket_method);
+    BIO_set_data(ssl_ctx->bio, ssl_ctx);
 
     SSL_set_bio(ssl_ctx->ssl, ssl_ctx->bio, ssl_ctx->bio);
 
     SSL_set_connect_state(ssl_ctx->ssl);
 
-    SSL_set_app_data(ssl_ctx->ssl, ssl_ctx);
+    /* Let OpenSSL read as much as is available from the stream, instead
+       of a record header and a record body at a time. */
+    SSL_set_read_ahead(ssl_ctx->ssl, 1);
 
-#ifdef SERF_LOGGING_ENABLED
-    SSL_CTX_set_info_callback(ssl_ctx->ctx, apps_ssl_info_callback);
-#endif
+    SSL_set_app_data(ssl_ctx->ssl, ssl_ctx);
 
     ssl_ctx->encrypt.stream = NULL;
     ssl_ctx->encrypt.stream_next = NULL;
     ssl_ctx->encrypt_pending = serf_bucket_aggregate_create(allocator);
-    serf_databuf_init(&ssl_ctx->encrypt.databuf);
-    ssl_ctx->encrypt.databuf.read = ssl_encrypt;
-    ssl_ctx->encrypt.databuf.read_baton = ssl_ctx;
+    serf__databuf_init(&ssl_ctx->encrypt.databuf, ssl_encrypt, ssl_ctx);
 
     ssl_ctx->decrypt.stream = NULL;
-    serf_databuf_init(&ssl_ctx->decrypt.databuf);
-    ssl_ctx->decrypt.databuf.read = ssl_decrypt;
-    ssl_ctx->decrypt.databuf.read_baton = ssl_ctx;
+    serf__databuf_init(&ssl_ctx->decrypt.databuf, ssl_decrypt, ssl_ctx);
+    /* Room for a full record, so that one SSL_read gets all of it. */
+    serf__databuf_set_bufsize(&ssl_ctx->decrypt.databuf, FULL_RECORD_SIZE,
+                              allocator);
+    memset(ssl_ctx->decrypt_bufs, 0, sizeof(ssl_ctx->decrypt_bufs));
 
     ssl_ctx->crypt_status = APR_SUCCESS;
     ssl_ctx->want_read = FALSE;
@@ -1531,14 +2372,23 @@ static serf_ssl_context_t *ssl_init_context(serf_bucket_alloc_t *allocator)
 static apr_status_t ssl_free_context(
     serf_ssl_context_t *ssl_ctx)
 {
+    int i;
+
     /* If never had the pending buckets, don't try to free them. */
     if (ssl_ctx->encrypt_pending != NULL) {
         serf_bucket_destroy(ssl_ctx->encrypt_pending);
     }
 
+    serf__databuf_cleanup(&ssl_ctx->encrypt.databuf);
+    serf__databuf_cleanup(&ssl_ctx->decrypt.databuf);
+
+    for (i = 0; i < DECRYPT_IOVEC_BUFS; i++) {
+        if (ssl_ctx->decrypt_bufs[i])
+            serf_bucket_mem_free(ssl_ctx->allocator, ssl_ctx->decrypt_bufs[i]);
+    }
+
     /* SSL_free implicitly frees the underlying BIO. */
     SSL_free(ssl_ctx->ssl);
-    SSL_CTX_free(ssl_ctx->ctx);
 
     serf_bucket_mem_free(ssl_ctx->allocator, ssl_ctx);
 
@@ -1576,13 +2426,77 @@ apr_status_t serf_ssl_set_hostname(serf_ssl_context_t *context,
     return APR_ENOTIMPL;
 }
 
-apr_status_t serf_ssl_use_default_certificates(serf_ssl_context_t *ssl_ctx)
+apr_status_t serf_ssl_set_alpn_protocols(
+    serf_ssl_context_t *context,
+    const char *protocols,
+    serf_ssl_protocol_result_cb_t callback,
+    void *data)
 {
-    X509_STORE *store = SSL_CTX_get_cert_store(ssl_ctx->ctx);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+    unsigned char *wire;
+    apr_size_t wire_len = 0;
+    const char *protocol = protocols;
+
+    /* The wire format prefixes each protocol with its length. */
+    wire = apr_palloc(context->pool, strlen(protocols) + 1);
+    while (*protocol) {
+        const char *end = strchr(protocol, ',');
+        apr_size_t len = end ? end - protocol : strlen(protocol);
+
+        if (len == 0 || len > 255)
+            return APR_EINVAL;
+
+        wire[wire_len++] = (unsigned char)len;
+        memcpy(wire + wire_len, protocol, len);
+        wire_len += len;
+
+        protocol += len;
+        if (*protocol) {
+            /* Skip the comma, which must be followed by another protocol. */
+            protocol++;
+            if (!*protocol)
+                return APR_EINVAL;
+        }
+    }
 
-    int result = X509_STORE_set_default_paths(store);
+    /* Unlike most of OpenSSL, this returns 0 on success. */
+    if (SSL_set_alpn_protos(context->ssl, wire, (unsigned int)wire_len) != 0)
+        return SERF_ERROR_SSL_SETUP_FAILED;
 
-    return result ? APR_SUCCESS : SERF_ERROR_SSL_CERT_FAILED;
+    context->protocol_callback = callback;
+    context->protocol_userdata = data;
+
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+const char *serf_ssl_get_selected_protocol(serf_ssl_context_t *context)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L && !defined(OPENSSL_NO_TLSEXT)
+    const unsigned char *data = NULL;
+    unsigned int len = 0;
+
+    if (context->selected_protocol)
+        return context->selected_protocol;
+
+    SSL_get0_alpn_selected(context->ssl, &data, &len);
+    if (len) {
+        context->selected_protocol = apr_pstrmemdup(context->pool,
+                                                    (const char *)data, len);
+        return context->selected_protocol;
+    }
+#endif
+
+    return "";
+}
+
+apr_status_t serf_ssl_use_default_certificates(serf_ssl_context_t *ssl_ctx)
+{
+    ssl_ctx->use_default_certs = 1;
+
+    return trust_settings_changed(ssl_ctx);
 }
 
 apr_status_t serf_ssl_load_cert_file(
@@ -1606,8 +2520,8 @@ apr_status_t serf_ssl_load_cert_file(
 
     init_ssl_libraries();
 
-    bio = BIO_new(&bio_file_method);
-    bio->ptr = cert_file;
+    bio = BIO_new(bio_file_method);
+    BIO_set_data(bio, cert_file);
 
     ssl_cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
 
@@ -1636,25 +2550,19 @@ apr_status_t serf_ssl_trust_cert(
     serf_ssl_context_t *ssl_ctx,
     serf_ssl_certificate_t *cert)
 {
-    X509_STORE *store = SSL_CTX_get_cert_store(ssl_ctx->ctx);
-
-    int result = X509_STORE_add_cert(store, cert->ssl_cert);
+    if (!ssl_ctx->trusted_certs)
+        ssl_ctx->trusted_certs = apr_array_make(ssl_ctx->pool, 1,
+                                                sizeof(X509 *));
+    APR_ARRAY_PUSH(ssl_ctx->trusted_certs, X509 *) = cert->ssl_cert;
 
-    return result ? APR_SUCCESS : SERF_ERROR_SSL_CERT_FAILED;
+    return trust_settings_changed(ssl_ctx);
 }
 
 apr_status_t serf_ssl_check_crl(serf_ssl_context_t *ssl_ctx, int enabled)
 {
-    X509_STORE *store = SSL_CTX_get_cert_store(ssl_ctx->ctx);
+    ssl_ctx->check_crl = enabled;
 
-    if (enabled) {
-        X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK|
-                             X509_V_FLAG_CRL_CHECK_ALL);
-    } else {
-        X509_VERIFY_PARAM_clear_flags(store->param, X509_V_FLAG_CRL_CHECK|
-                                      X509_V_FLAG_CRL_CHECK_ALL);
-    }
-    return APR_SUCCESS;
+    return trust_settings_changed(ssl_ctx);
 }
 
 apr_status_t serf_ssl_add_crl_from_file(serf_ssl_context_t *ssl_ctx,
@@ -1663,9 +2571,7 @@ apr_status_t serf_ssl_add_crl_from_file(serf_ssl_context_t *ssl_ctx,
 {
     apr_file_t *crl_file;
     X509_CRL *crl = NULL;
-    X509_STORE *store;
     BIO *bio;
-    int result;
     apr_status_t status;
 
     status = apr_file_open(&crl_file, file_path, APR_READ, APR_OS_DEFAULT,
@@ -1674,23 +2580,24 @@ apr_status_t serf_ssl_add_crl_from_file(serf_ssl_context_t *ssl_ctx,
         return status;
     }
 
-    bio = BIO_new(&bio_file_method);
-    bio->ptr = crl_file;
+    bio = BIO_new(bio_file_method);
+    BIO_set_data(bio, crl_file);
 
     crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
 
     apr_file_close(crl_file);
     BIO_free(bio);
 
-    store = SSL_CTX_get_cert_store(ssl_ctx->ctx);
-
-    result = X509_STORE_add_crl(store, crl);
-    if (!result) {
+    if (!crl) {
         log_ssl_error(ssl_ctx);
         return SERF_ERROR_SSL_CERT_FAILED;
     }
 
+    if (!ssl_ctx->crls)
+        ssl_ctx->crls = apr_array_make(ssl_ctx->pool, 1, sizeof(X509_CRL *));
     /* TODO: free crl when closing ssl session */
+    APR_ARRAY_PUSH(ssl_ctx->crls, X509_CRL *) = crl;
+
     return serf_ssl_check_crl(ssl_ctx, 1);
 }
 
@@ -1699,8 +2606,6 @@ serf_ssl_check_cert_status_request(serf_ssl_context_t *ssl_ctx, int enabled)
 {
 
 #ifndef OPENSSL_NO_TLSEXT
-    SSL_CTX_set_tlsext_status_cb(ssl_ctx->ctx, ocsp_callback);
-    SSL_CTX_set_tlsext_status_arg(ssl_ctx->ctx, ssl_ctx);
     SSL_set_tlsext_status_type(ssl_ctx->ssl, TLSEXT_STATUSTYPE_ocsp);
     return APR_SUCCESS;
 #endif
@@ -2016,10 +2921,10 @@ const char *serf_ssl_cert_export(
 }
 
 /* Disables compression for all SSL sessions. */
-static void disable_compression(serf_ssl_context_t *ssl_ctx)
+static void disable_compression(SSL_CTX *ctx)
 {
 #ifdef SSL_OP_NO_COMPRESSION
-    SSL_CTX_set_options(ssl_ctx->ctx, SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
 #endif
 }
 
@@ -2071,7 +2976,7 @@ static void serf_ssl_encrypt_destroy_and_data(serf_bucket_t *bucket)
 
         /* Reset our status and databuf. */
         ssl_ctx->crypt_status = APR_SUCCESS;
-        ssl_ctx->encrypt.databuf.status = APR_SUCCESS;
+        ssl_ctx->encrypt.databuf.databuf.status = APR_SUCCESS;
 
         /* Advance to the next stream - if we have one. */
         if (ssl_ctx->encrypt.stream_next == NULL) {
@@ -2102,7 +3007,140 @@ static apr_status_t serf_ssl_read(serf_bucket_t *bucket,
 {
     ssl_context_t *ctx = bucket->data;
 
-    return serf_databuf_read(ctx->databuf, requested, data, len);
+    return serf_databuf_read(&ctx->databuf->databuf, requested, data, len);
+}
+
+/* Decrypt into up to DECRYPT_IOVEC_BUFS buffers of their own and hand them
+   up as they are. The data stays valid until the next read from the
+   bucket. */
+static apr_status_t serf_ssl_decrypt_read_iovec(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                int vecs_size,
+                                                struct iovec *vecs,
+                                                int *vecs_used)
+{
+    ssl_context_t *ctx = bucket->data;
+    serf_ssl_context_t *ssl_ctx = ctx->ssl_ctx;
+    serf_databuf_t *databuf = &ctx->databuf->databuf;
+    apr_status_t status = APR_SUCCESS;
+
+    *vecs_used = 0;
+
+    /* Return what is left from a previous read first. */
+    if (databuf->remaining > 0 || APR_STATUS_IS_EOF(databuf->status)) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_databuf_read(databuf, requested, &data, &len);
+        if (len) {
+            vecs[0].iov_base = (void *)data;
+            vecs[0].iov_len = len;
+            *vecs_used = 1;
+        }
+
+        return status;
+    }
+
+    while (*vecs_used < vecs_size && *vecs_used < DECRYPT_IOVEC_BUFS &&
+           requested) {
+        char **buf = &ssl_ctx->decrypt_bufs[*vecs_used];
+        apr_size_t size = FULL_RECORD_SIZE;
+        apr_size_t len;
+
+        if (!*buf)
+            *buf = serf_bucket_mem_alloc(ssl_ctx->allocator,
+                                         FULL_RECORD_SIZE);
+        if (size > requested)
+            size = requested;
+
+        status = ssl_decrypt(ssl_ctx, size, *buf, &len);
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            if (!*vecs_used)
+                return status;
+
+            /* Return the data first, the error on the next read. */
+            ssl_ctx->fatal_err = status;
+            return APR_SUCCESS;
+        }
+
+        if (len) {
+            vecs[*vecs_used].iov_base = *buf;
+            vecs[*vecs_used].iov_len = len;
+            (*vecs_used)++;
+
+            if (requested != SERF_READ_ALL_AVAIL)
+                requested -= len;
+        }
+
+        /* Continue with the next record, until OpenSSL runs out of data. */
+        if (status)
+            break;
+    }
+
+    databuf->status = status;
+
+    return status;
+}
+
+/* Hand up the encrypted records from encrypt_pending as they are, instead
+   of copying them into the databuf first. */
+static apr_status_t serf_ssl_encrypt_read_iovec(serf_bucket_t *bucket,
+                                                apr_size_t requested,
+                                                int vecs_size,
+                                                struct iovec *vecs,
+                                                int *vecs_used)
+{
+    ssl_context_t *ctx = bucket->data;
+    serf_ssl_context_t *ssl_ctx = ctx->ssl_ctx;
+    serf_databuf_t *databuf = &ctx->databuf->databuf;
+    apr_status_t status;
+    apr_status_t agg_status;
+
+    *vecs_used = 0;
+
+    /* Return what is left from a previous read first. */
+    if (databuf->remaining > 0 || APR_STATUS_IS_EOF(databuf->status)) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_databuf_read(databuf, requested, &data, &len);
+        if (len) {
+            vecs[0].iov_base = (void *)data;
+            vecs[0].iov_len = len;
+            *vecs_used = 1;
+        }
+
+        return status;
+    }
+
+    setup_ssl_ctx(ssl_ctx);
+    if (ssl_ctx->fatal_err)
+        return ssl_ctx->fatal_err;
+
+    /* Try already encrypted data first. */
+    agg_status = serf_bucket_read_iovec(ssl_ctx->encrypt_pending, requested,
+                                        vecs_size, vecs, vecs_used);
+    if (SERF_BUCKET_READ_ERROR(agg_status))
+        return agg_status;
+    if (*vecs_used)
+        return APR_STATUS_IS_EOF(agg_status) ? APR_SUCCESS : agg_status;
+
+    status = encrypt_stream(ssl_ctx, ctx->databuf->bufsize);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    agg_status = serf_bucket_read_iovec(ssl_ctx->encrypt_pending, requested,
+                                        vecs_size, vecs, vecs_used);
+    if (SERF_BUCKET_READ_ERROR(agg_status))
+        return agg_status;
+
+    /* More is waiting in encrypt_pending. */
+    if (!agg_status)
+        status = APR_SUCCESS;
+
+    databuf->status = status;
+
+    return status;
 }
 
 static apr_status_t serf_ssl_readline(serf_bucket_t *bucket,
@@ -2112,7 +3150,8 @@ static apr_status_t serf_ssl_readline(serf_bucket_t *bucket,
 {
     ssl_context_t *ctx = bucket->data;
 
-    return serf_databuf_readline(ctx->databuf, acceptable, found, data, len);
+    return serf_databuf_readline(&ctx->databuf->databuf, acceptable, found,
+                                 data, len);
 }
 
 static apr_status_t serf_ssl_peek(serf_bucket_t *bucket,
@@ -2121,7 +3160,18 @@ static apr_status_t serf_ssl_peek(serf_bucket_t *bucket,
 {
     ssl_context_t *ctx = bucket->data;
 
-    return serf_databuf_peek(ctx->databuf, data, len);
+    return serf_databuf_peek(&ctx->databuf->databuf, data, len);
+}
+
+static serf_bucket_t *serf_ssl_decrypt_read_bucket(
+    serf_bucket_t *bucket,
+    const serf_bucket_type_t *type)
+{
+    ssl_context_t *ctx = bucket->data;
+
+    /* Hand over the decrypted data as it is, see serf_bucket_move(). */
+    return serf_databuf_read_bucket(&ctx->databuf->databuf, type,
+                                    bucket->allocator);
 }
 
 static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
@@ -2149,6 +3199,27 @@ static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
             if (status)
                 err_status = status;
         }
+
+        serf__databuf_configure(&ssl_ctx->encrypt.databuf, config,
+                                ssl_ctx->allocator);
+        serf__databuf_configure(&ssl_ctx->decrypt.databuf, config,
+                                ssl_ctx->allocator);
+    }
+
+    /* Now that the context is known, use its shared SSL_CTX. */
+    if (config)
+        setup_ssl_ctx(ssl_ctx);
+
+    /* Offer the session of an earlier connection to this host, unless the
+       handshake already started. */
+    if (!SSL_get_session(ssl_ctx->ssl)) {
+        ssl_session_cache_t *cache = get_session_cache(ssl_ctx, 0);
+
+        if (cache && cache->session) {
+            serf__log(LOGLVL_DEBUG, LOGCOMP_SSL, __FILE__, config,
+                      "resuming cached ssl session.\n");
+            SSL_set_session(ssl_ctx->ssl, cache->session);
+        }
     }
 
     status = serf_config_get_string(config, SERF_CONFIG_CONN_PIPELINING,
@@ -2157,7 +3228,7 @@ static apr_status_t serf_ssl_set_config(serf_bucket_t *bucket,
         return status;
 
     if (strcmp(pipelining, "Y") == 0) {
-        SSL_CTX_set_info_callback(ssl_ctx->ctx, detect_renegotiate);
+        SSL_set_info_callback(ssl_ctx->ssl, detect_renegotiate);
     }
 
     return err_status;
@@ -2167,7 +3238,7 @@ const serf_bucket_type_t serf_bucket_type_ssl_encrypt = {
     "SSLENCRYPT",
     serf_ssl_read,
     serf_ssl_readline,
-    serf_default_read_iovec,
+    serf_ssl_encrypt_read_iovec,
     serf_default_read_for_sendfile,
     serf_buckets_are_v2,
     serf_ssl_peek,
@@ -2181,12 +3252,12 @@ const serf_bucket_type_t serf_bucket_type_ssl_decrypt = {
     "SSLDECRYPT",
     serf_ssl_read,
     serf_ssl_readline,
-    serf_default_read_iovec,
+    serf_ssl_decrypt_read_iovec,
     serf_default_read_for_sendfile,
     serf_buckets_are_v2,
     serf_ssl_peek,
     serf_ssl_decrypt_destroy_and_data,
-    serf_default_read_bucket,
+    serf_ssl_decrypt_read_bucket,
     NULL,
     serf_ssl_set_config,
 };
@@ -0,0 +1,315 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+#include "serf_private.h"
+
+#ifdef SERF_HAVE_ZSTD
+
+#include <zstd.h>
+
+typedef struct zstd_context_t {
+    serf_bucket_t *stream;
+
+    ZSTD_DStream *dstream;
+
+    /* The compressed data not yet consumed by the decoder. It belongs to
+       STREAM, so STREAM isn't read again before it is consumed. */
+    ZSTD_inBuffer in;
+
+    /* Our output buffer, of ZSTD_DStreamOutSize() bytes. Decoded data is
+       handed out from it directly. */
+    char *buffer;
+    apr_size_t buffer_size;
+    const char *out;
+    apr_size_t out_len;
+
+    /* Set when the decoder filled the buffer, as it may hold more output
+       without needing more input. */
+    int flush_pending;
+
+    /* Set when no frame is partially decoded: at the start, and after
+       each frame. The stream may hold another frame after it. */
+    int frame_done;
+
+    /* Set once STREAM returned EOF. */
+    int hit_eof;
+
+    serf_config_t *config;
+} zstd_context_t;
+
+int serf_bucket_is_zstd_supported(void)
+{
+    return 1;
+}
+
+serf_bucket_t *serf_bucket_zstd_decompress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+    zstd_context_t *ctx;
+
+    ctx = serf_bucket_mem_alloc(allocator, sizeof(*ctx));
+    ctx->stream = stream;
+    ctx->dstream = NULL;
+    ctx->in.src = NULL;
+    ctx->in.size = 0;
+    ctx->in.pos = 0;
+    ctx->buffer = NULL;
+    ctx->buffer_size = 0;
+    ctx->out = NULL;
+    ctx->out_len = 0;
+    ctx->flush_pending = 0;
+    ctx->frame_done = 1;
+    ctx->hit_eof = 0;
+    ctx->config = NULL;
+
+    return serf_bucket_create(&serf_bucket_type_zstd_decompress, allocator,
+                              ctx);
+}
+
+/* Make sure CTX has decoded data to hand out, unless it returns an error,
+   APR_EAGAIN or APR_EOF. */
+static apr_status_t fill_output(serf_bucket_t *bucket)
+{
+    zstd_context_t *ctx = bucket->data;
+
+    if (!ctx->dstream) {
+        size_t ret;
+
+        ctx->dstream = ZSTD_createDStream();
+        if (!ctx->dstream)
+            return APR_ENOMEM;
+
+        ret = ZSTD_initDStream(ctx->dstream);
+        if (ZSTD_isError(ret)) {
+            serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                      "zstd init error %s\n", ZSTD_getErrorName(ret));
+            return SERF_ERROR_DECOMPRESSION_FAILED;
+        }
+
+        ctx->buffer_size = ZSTD_DStreamOutSize();
+        ctx->buffer = serf_bucket_mem_alloc(bucket->allocator,
+                                            ctx->buffer_size);
+    }
+
+    while (!ctx->out_len) {
+        ZSTD_outBuffer out;
+        size_t ret;
+
+        if (ctx->in.pos == ctx->in.size && !ctx->flush_pending) {
+            const char *data;
+            apr_size_t len;
+            apr_status_t status;
+
+            if (ctx->hit_eof)
+                break;
+
+            status = serf_bucket_read(ctx->stream, SERF_READ_ALL_AVAIL,
+                                      &data, &len);
+            if (SERF_BUCKET_READ_ERROR(status))
+                return status;
+
+            ctx->in.src = data;
+            ctx->in.size = len;
+            ctx->in.pos = 0;
+
+            if (APR_STATUS_IS_EOF(status))
+                ctx->hit_eof = 1;
+
+            if (!len) {
+                if (!ctx->hit_eof)
+                    return status;
+                break;
+            }
+        }
+
+        out.dst = ctx->buffer;
+        out.size = ctx->buffer_size;
+        out.pos = 0;
+
+        ret = ZSTD_decompressStream(ctx->dstream, &out, &ctx->in);
+        if (ZSTD_isError(ret)) {
+            serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                      "zstd decoding error %s\n", ZSTD_getErrorName(ret));
+            return SERF_ERROR_DECOMPRESSION_FAILED;
+        }
+
+        /* A return of 0 means a frame was completely decoded and flushed.
+           The decoder then starts on the next frame, if any. */
+        ctx->frame_done = (ret == 0);
+        ctx->flush_pending = (out.pos == out.size);
+
+        ctx->out = ctx->buffer;
+        ctx->out_len = out.pos;
+    }
+
+    if (ctx->out_len)
+        return APR_SUCCESS;
+
+    /* All input is consumed, and all output handed out */
+    if (!ctx->frame_done) {
+        serf__log(LOGLVL_ERROR, LOGCOMP_COMPR, __FILE__, ctx->config,
+                  "Unexpected EOF on input stream\n");
+        return SERF_ERROR_DECOMPRESSION_FAILED;
+    }
+
+    return APR_EOF;
+}
+
+/* The status to return with data handed out by CTX. */
+static apr_status_t output_status(zstd_context_t *ctx)
+{
+    if (!ctx->out_len && ctx->hit_eof && ctx->frame_done
+        && !ctx->flush_pending && ctx->in.pos == ctx->in.size)
+        return APR_EOF;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t serf_zstd_read(serf_bucket_t *bucket,
+                                   apr_size_t requested,
+                                   const char **data, apr_size_t *len)
+{
+    zstd_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = fill_output(bucket);
+    if (status) {
+        *len = 0;
+        return status;
+    }
+
+    *data = ctx->out;
+    *len = ctx->out_len;
+    if (requested < *len)
+        *len = requested;
+
+    ctx->out += *len;
+    ctx->out_len -= *len;
+
+    return output_status(ctx);
+}
+
+static apr_status_t serf_zstd_readline(serf_bucket_t *bucket,
+                                       int acceptable, int *found,
+                                       const char **data, apr_size_t *len)
+{
+    zstd_context_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = fill_output(bucket);
+    if (status) {
+        *found = SERF_NEWLINE_NONE;
+        *len = 0;
+        return status;
+    }
+
+    *data = ctx->out;
+    *len = ctx->out_len;
+    serf_util_readline(&ctx->out, &ctx->out_len, acceptable, found);
+    *len -= ctx->out_len;
+
+    return output_status(ctx);
+}
+
+static apr_status_t serf_zstd_peek(serf_bucket_t *bucket,
+                                   const char **data,
+                                   apr_size_t *len)
+{
+    zstd_context_t *ctx = bucket->data;
+
+    /* Only what was decoded already, as decoding may block. */
+    *data = ctx->out;
+    *len = ctx->out_len;
+
+    return output_status(ctx);
+}
+
+static void serf_zstd_destroy_and_data(serf_bucket_t *bucket)
+{
+    zstd_context_t *ctx = bucket->data;
+
+    if (ctx->dstream)
+        ZSTD_freeDStream(ctx->dstream);
+    if (ctx->buffer)
+        serf_bucket_mem_free(bucket->allocator, ctx->buffer);
+    serf_bucket_destroy(ctx->stream);
+
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_status_t serf_zstd_set_config(serf_bucket_t *bucket,
+                                         serf_config_t *config)
+{
+    zstd_context_t *ctx = bucket->data;
+
+    ctx->config = config;
+
+    return serf_bucket_set_config(ctx->stream, config);
+}
+
+const serf_bucket_type_t serf_bucket_type_zstd_decompress = {
+    "ZSTD-DECOMPRESS",
+    serf_zstd_read,
+    serf_zstd_readline,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    serf_zstd_peek,
+    serf_zstd_destroy_and_data,
+    serf_default_read_bucket,
+    NULL,
+    serf_zstd_set_config,
+};
+
+#else /* SERF_HAVE_ZSTD */
+
+int serf_bucket_is_zstd_supported(void)
+{
+    return 0;
+}
+
+serf_bucket_t *serf_bucket_zstd_decompress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator)
+{
+    return NULL;
+}
+
+static apr_status_t serf_zstd_read(serf_bucket_t *bucket,
+                                   apr_size_t requested,
+                                   const char **data, apr_size_t *len)
+{
+    *len = 0;
+    return APR_ENOTIMPL;
+}
+
+const serf_bucket_type_t serf_bucket_type_zstd_decompress = {
+    "ZSTD-DECOMPRESS",
+    serf_zstd_read,
+    NULL,
+    serf_default_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    NULL,
+    serf_default_destroy_and_data,
+    serf_default_read_bucket,
+    NULL,
+    serf_default_ignore_config,
+};
+
+#endif /* SERF_HAVE_ZSTD */
@@ -19,10 +19,17 @@
 #include "serf_bucket_util.h"
 #include "serf_private.h"
 
-/* Use a linked list to store the config values, as we'll only store a couple
-   of values per context. */
+/* Serf's own keys are small numbers per category, so their values are kept
+   in an array indexed by the key number. Other keys, like those defined by
+   applications in the second byte, are kept in a linked list, as we'll only
+   store a couple of them. */
+#define DIRECT_KEYS 16
+
+#define KEY_NUMBER(key) ((key) & 0x00FFFFFF)
+
 struct serf__config_hdr_t {
     apr_pool_t *pool;
+    void *direct[DIRECT_KEYS];
     struct config_entry_t *first;
 };
 
@@ -46,6 +53,11 @@ add_or_replace_entry(serf__config_hdr_t *hdr, serf_config_key_t key, void *value
     config_entry_t *last = iter;
     int found = FALSE;
 
+    if (KEY_NUMBER(key) < DIRECT_KEYS) {
+        hdr->direct[KEY_NUMBER(key)] = value;
+        return APR_SUCCESS;
+    }
+
     /* Find the entry with the matching key. If it exists, replace its value. */
     while (iter != NULL) {
         if (iter->key == key) {
@@ -116,6 +128,8 @@ apr_status_t serf__config_store_get_config(serf_context_t *ctx,
     serf_config_t *cfg = apr_pcalloc(out_pool, sizeof(serf_config_t));
     cfg->ctx_pool = ctx->pool;
     cfg->per_context = config_store->global_per_context;
+    cfg->log_baton =
+        &cfg->per_context->direct[KEY_NUMBER(SERF_CONFIG_CTX_LOGBATON)];
 
     if (conn) {
         const char *host_key, *conn_key;
@@ -276,6 +290,12 @@ apr_status_t serf_config_get_object(serf_config_t *config,
     *value = NULL;
     if (target) {
         config_entry_t *iter = target->first;
+
+        if (KEY_NUMBER(key) < DIRECT_KEYS) {
+            *value = target->direct[KEY_NUMBER(key)];
+            return APR_SUCCESS;
+        }
+
         /* Find the matching key and return its value */
         while (iter != NULL) {
             if (iter->key == key) {
@@ -15,6 +15,9 @@
 
 #include <apr_pools.h>
 #include <apr_poll.h>
+#include <apr_hash.h>
+#include <apr_file_io.h>
+#include <apr_tables.h>
 #include <apr_version.h>
 
 #include "serf.h"
@@ -26,6 +29,9 @@
  * Callback function (implements serf_progress_t). Takes a number of bytes
  * read @a read and bytes written @a written, adds those to the total for this
  * context and notifies an interested party (if any).
+ *
+ * With batched progress the interested party is notified later, from
+ * serf__context_progress_report().
  */
 void serf__context_progress_delta(
     void *progress_baton,
@@ -37,34 +43,134 @@ void serf__context_progress_delta(
     ctx->progress_read += read;
     ctx->progress_written += written;
 
-    if (ctx->progress_func)
+    /* The socket buckets read on behalf of the connection that is being
+       processed; the writes are counted by the connection itself. */
+    if (ctx->progress_conn)
+        ctx->progress_conn->progress_read += read;
+
+    if (ctx->progress_func && !ctx->progress_batched)
         ctx->progress_func(ctx->progress_baton,
                            ctx->progress_read,
                            ctx->progress_written);
 }
 
+void serf__context_trace_received(void *baton, const struct iovec *vecs,
+                                  int nvecs, apr_size_t len)
+{
+    serf_context_t *ctx = baton;
+
+    if (ctx->trace)
+        serf__trace(ctx->trace,
+                    ctx->progress_conn ? ctx->progress_conn->id : 0,
+                    SERF_TRACE_RECV, vecs, nvecs, len);
+}
+
+void serf__context_progress_report(serf_context_t *ctx)
+{
+    apr_off_t delta;
+    apr_time_t now;
+
+    if (!ctx->progress_batched || !ctx->progress_func)
+        return;
+
+    delta = (ctx->progress_read - ctx->progress_reported_read)
+            + (ctx->progress_written - ctx->progress_reported_written);
+    if (!delta)
+        return;
+
+    if (ctx->progress_min_bytes || ctx->progress_min_interval) {
+        int due = 0;
+
+        if (ctx->progress_min_bytes && delta >= ctx->progress_min_bytes)
+            due = 1;
+
+        if (!due && ctx->progress_min_interval) {
+            now = apr_time_now();
+            if (now - ctx->progress_reported_time
+                    >= ctx->progress_min_interval)
+                due = 1;
+        }
+
+        if (!due)
+            return;
+    }
+
+    ctx->progress_reported_read = ctx->progress_read;
+    ctx->progress_reported_written = ctx->progress_written;
+    if (ctx->progress_min_interval)
+        ctx->progress_reported_time = apr_time_now();
+
+    ctx->progress_func(ctx->progress_baton,
+                       ctx->progress_read,
+                       ctx->progress_written);
+}
+
+
+void serf__conn_set_dirty(serf_connection_t *conn)
+{
+    serf_context_t *ctx = conn->ctx;
+
+    if (!conn->dirty_conn) {
+        conn->dirty_next = ctx->dirty_conns;
+        if (conn->dirty_next)
+            conn->dirty_next->dirty_prev = &conn->dirty_next;
+        conn->dirty_prev = &ctx->dirty_conns;
+        ctx->dirty_conns = conn;
+
+        conn->dirty_conn = 1;
+    }
+
+    ctx->dirty_pollset = 1;
+}
+
+void serf__conn_clear_dirty(serf_connection_t *conn)
+{
+    if (conn->dirty_conn) {
+        *conn->dirty_prev = conn->dirty_next;
+        if (conn->dirty_next)
+            conn->dirty_next->dirty_prev = conn->dirty_prev;
+
+        conn->dirty_next = NULL;
+        conn->dirty_prev = NULL;
+        conn->dirty_conn = 0;
+    }
+}
+
+void serf__conn_stop_writing(serf_connection_t *conn)
+{
+    if (!conn->stop_writing) {
+        conn->stop_writing = 1;
+        conn->stop_writing_time = apr_time_now();
+    }
+    serf__conn_set_dirty(conn);
+}
+
+void serf__conn_continue_writing(serf_connection_t *conn)
+{
+    if (conn->stop_writing) {
+        conn->stop_writing = 0;
+        conn->metrics.blocked_time += apr_time_now()
+                                      - conn->stop_writing_time;
+        serf__conn_set_dirty(conn);
+    }
+}
 
 /* Check for dirty connections and update their pollsets accordingly. */
 static apr_status_t check_dirty_pollsets(serf_context_t *ctx)
 {
-    int i;
-
     /* if we're not dirty, return now. */
     if (!ctx->dirty_pollset) {
         return APR_SUCCESS;
     }
 
-    for (i = ctx->conns->nelts; i--; ) {
-        serf_connection_t *conn = GET_CONN(ctx, i);
+    /* Only the dirty connections are on the list, so there is no need to
+       look at all the others. */
+    while (ctx->dirty_conns) {
+        serf_connection_t *conn = ctx->dirty_conns;
         apr_status_t status;
 
-        /* if this connection isn't dirty, skip it. */
-        if (!conn->dirty_conn) {
-            continue;
-        }
-
         /* reset this connection's flag before we update. */
-        conn->dirty_conn = 0;
+        serf__conn_clear_dirty(conn);
 
         if ((status = serf__conn_update_pollset(conn)) != APR_SUCCESS)
             return status;
@@ -77,13 +183,132 @@ static apr_status_t check_dirty_pollsets(serf_context_t *ctx)
 }
 
 
+struct serf__pollfd_t {
+    apr_pollfd_t pfd;
+
+    /* The socket or file of PFD, used as the hash key. */
+    const void *key;
+
+    serf__pollfd_t *next;
+};
+
+static const void *pollfd_key(const apr_pollfd_t *pfd)
+{
+    if (pfd->desc_type == APR_POLL_SOCKET)
+        return pfd->desc.s;
+    return pfd->desc.f;
+}
+
+/* Create a pollset for SIZE descriptors in POOL, preferring the scalable
+   backends of the platform. */
+static apr_status_t create_pollset(apr_pollset_t **pollset,
+                                   apr_uint32_t size,
+                                   apr_uint32_t flags,
+                                   apr_pool_t *pool)
+{
+#ifdef BROKEN_WSAPOLL
+    /* APR 1.4.x switched to using WSAPoll() on Win32, but it does not
+     * properly handle errors on a non-blocking sockets (such as
+     * connecting to a server where no listener is active).
+     *
+     * So, sadly, we must force using select() on Win32.
+     *
+     * http://mail-archives.apache.org/mod_mbox/apr-dev/201105.mbox/%3CBANLkTin3rBCecCBRvzUA5B-14u-NWxR_Kg@mail.gmail.com%3E
+     */
+    return apr_pollset_create_ex(pollset, size, pool, flags,
+                                 APR_POLLSET_SELECT);
+#else
+    /* The cost of epoll and kqueue grows with the number of events, not
+       with the number of descriptors. APR falls back to its default
+       method when the preferred one isn't available. */
+#if defined(__linux__)
+    return apr_pollset_create_ex(pollset, size, pool, flags,
+                                 APR_POLLSET_EPOLL);
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) \
+      || defined(__OpenBSD__) || defined(__DragonFly__)
+    return apr_pollset_create_ex(pollset, size, pool, flags,
+                                 APR_POLLSET_KQUEUE);
+#else
+    return apr_pollset_create(pollset, size, pool, flags);
+#endif
+#endif
+}
+
+/* Replace the pollset of PS with one of twice the size, holding the
+   same descriptors. The old one is kept until the next prerun, as this
+   can run while its events are dispatched. */
+static apr_status_t grow_pollset(serf_pollset_t *ps)
+{
+    apr_pool_t *pollset_pool;
+    apr_pollset_t *pollset;
+    apr_hash_index_t *hi;
+    apr_status_t status;
+
+    apr_pool_create(&pollset_pool, ps->pool);
+
+    status = create_pollset(&pollset, ps->size * 2, ps->flags, pollset_pool);
+    if (status) {
+        apr_pool_destroy(pollset_pool);
+        return status;
+    }
+
+    for (hi = apr_hash_first(NULL, ps->pfds); hi; hi = apr_hash_next(hi)) {
+        void *val;
+        serf__pollfd_t *entry;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        entry = val;
+
+        status = apr_pollset_add(pollset, &entry->pfd);
+        if (status) {
+            apr_pool_destroy(pollset_pool);
+            return status;
+        }
+    }
+
+    APR_ARRAY_PUSH(ps->retired_pools, apr_pool_t *) = ps->pollset_pool;
+    ps->pollset_pool = pollset_pool;
+    ps->pollset = pollset;
+    ps->size *= 2;
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t pollset_add(void *user_baton,
                                 apr_pollfd_t *pfd,
                                 void *serf_baton)
 {
     serf_pollset_t *s = (serf_pollset_t*)user_baton;
+    serf__pollfd_t *entry;
+    apr_status_t status;
+
     pfd->client_data = serf_baton;
-    return apr_pollset_add(s->pollset, pfd);
+
+    if (s->nelts == s->size) {
+        status = grow_pollset(s);
+        if (status)
+            return status;
+    }
+
+    status = apr_pollset_add(s->pollset, pfd);
+    if (status)
+        return status;
+
+    if (s->free_pfds) {
+        entry = s->free_pfds;
+        s->free_pfds = entry->next;
+    }
+    else {
+        entry = apr_palloc(s->pool, sizeof(*entry));
+    }
+    entry->pfd = *pfd;
+    entry->key = pollfd_key(pfd);
+    entry->next = NULL;
+
+    apr_hash_set(s->pfds, &entry->key, sizeof(entry->key), entry);
+    s->nelts++;
+
+    return APR_SUCCESS;
 }
 
 static apr_status_t pollset_rm(void *user_baton,
@@ -91,8 +316,26 @@ static apr_status_t pollset_rm(void *user_baton,
                                void *serf_baton)
 {
     serf_pollset_t *s = (serf_pollset_t*)user_baton;
+    serf__pollfd_t *entry;
+    const void *key;
+    apr_status_t status;
+
     pfd->client_data = serf_baton;
-    return apr_pollset_remove(s->pollset, pfd);
+
+    status = apr_pollset_remove(s->pollset, pfd);
+    if (status)
+        return status;
+
+    key = pollfd_key(pfd);
+    entry = apr_hash_get(s->pfds, &key, sizeof(key));
+    if (entry) {
+        apr_hash_set(s->pfds, &key, sizeof(key), NULL);
+        entry->next = s->free_pfds;
+        s->free_pfds = entry;
+        s->nelts--;
+    }
+
+    return APR_SUCCESS;
 }
 
 
@@ -102,6 +345,12 @@ void serf_config_proxy(serf_context_t *ctx,
     ctx->proxy_address = address;
 }
 
+void serf_config_proxy_tunnel_pipelining(serf_context_t *ctx,
+                                         int enabled)
+{
+    ctx->proxy_tunnel_pipelining = enabled;
+}
+
 
 void serf_config_credentials_callback(serf_context_t *ctx,
                                       serf_credentials_callback_t cred_cb)
@@ -117,10 +366,11 @@ void serf_config_authn_types(serf_context_t *ctx,
 }
 
 
-serf_context_t *serf_context_create_ex(
+static serf_context_t *create_context(
     void *user_baton,
     serf_socket_add_t addf,
     serf_socket_remove_t rmf,
+    apr_uint32_t pollset_flags,
     apr_pool_t *pool)
 {
     serf_context_t *ctx = apr_pcalloc(pool, sizeof(*ctx));
@@ -133,28 +383,24 @@ serf_context_t *serf_context_create_ex(
         ctx->pollset_rm = rmf;
     }
     else {
-        /* build the pollset with a (default) number of connections */
+        /* build the pollset with a (default) number of connections; it
+           grows when more descriptors are added. */
         serf_pollset_t *ps = apr_pcalloc(pool, sizeof(*ps));
 
+        ps->pool = pool;
+        ps->size = MAX_CONN;
+        ps->flags = pollset_flags;
+        ps->pfds = apr_hash_make(pool);
+        ps->retired_pools = apr_array_make(pool, 1, sizeof(apr_pool_t *));
+        apr_pool_create(&ps->pollset_pool, pool);
+
         /* ### TODO: As of APR 1.4.x apr_pollset_create_ex can return a status
            ### other than APR_SUCCESS, so we should handle it.
            ### Probably move creation of the pollset to later when we have
            ### the possibility of returning status to the caller.
          */
-#ifdef BROKEN_WSAPOLL
-        /* APR 1.4.x switched to using WSAPoll() on Win32, but it does not
-         * properly handle errors on a non-blocking sockets (such as
-         * connecting to a server where no listener is active).
-         *
-         * So, sadly, we must force using select() on Win32.
-         *
-         * http://mail-archives.apache.org/mod_mbox/apr-dev/201105.mbox/%3CBANLkTin3rBCecCBRvzUA5B-14u-NWxR_Kg@mail.gmail.com%3E
-         */
-        (void) apr_pollset_create_ex(&ps->pollset, MAX_CONN, pool, 0,
-                                     APR_POLLSET_SELECT);
-#else
-        (void) apr_pollset_create(&ps->pollset, MAX_CONN, pool, 0);
-#endif
+        (void) create_pollset(&ps->pollset, ps->size, ps->flags,
+                              ps->pollset_pool);
         ctx->pollset_baton = ps;
         ctx->pollset_add = pollset_add;
         ctx->pollset_rm = pollset_rm;
@@ -170,6 +416,9 @@ serf_context_t *serf_context_create_ex(
     ctx->authn_types = SERF_AUTHN_ALL;
     ctx->server_authn_info = apr_hash_make(pool);
 
+    serf__timer_wheel_init(&ctx->timers, apr_time_now());
+    serf__dns_init(ctx);
+
     /* Assume returned status is APR_SUCCESS */
     serf__config_store_init(ctx);
 
@@ -181,14 +430,112 @@ serf_context_t *serf_context_create_ex(
 }
 
 
+serf_context_t *serf_context_create_ex(
+    void *user_baton,
+    serf_socket_add_t addf,
+    serf_socket_remove_t rmf,
+    apr_pool_t *pool)
+{
+    return create_context(user_baton, addf, rmf, 0, pool);
+}
+
+
 serf_context_t *serf_context_create(apr_pool_t *pool)
 {
     return serf_context_create_ex(NULL, NULL, NULL, pool);
 }
 
+
+serf_context_t *serf__context_create_wakeable(apr_pool_t *pool)
+{
+    serf_context_t *ctx = create_context(NULL, NULL, NULL, 0, pool);
+
+#if APR_FILES_AS_SOCKETS
+    /* A pipe of our own rather than a wakeable pollset: the pollset is
+       replaced when it grows, while other threads may be waking it up. */
+    if (apr_file_pipe_create_ex(&ctx->wakeup_in, &ctx->wakeup_out,
+                                APR_FULL_NONBLOCK, pool) == APR_SUCCESS) {
+        apr_pollfd_t pfd = { 0 };
+
+        ctx->wakeup_baton.type = SERF_IO_WAKEUP;
+        ctx->wakeup_baton.u.ctx = ctx;
+
+        pfd.desc_type = APR_POLL_FILE;
+        pfd.desc.f = ctx->wakeup_in;
+        pfd.reqevents = APR_POLLIN;
+
+        if (ctx->pollset_add(ctx->pollset_baton, &pfd,
+                             &ctx->wakeup_baton) != APR_SUCCESS) {
+            apr_file_close(ctx->wakeup_in);
+            apr_file_close(ctx->wakeup_out);
+            ctx->wakeup_in = ctx->wakeup_out = NULL;
+        }
+    }
+#endif
+
+    return ctx;
+}
+
+
+apr_status_t serf__context_wakeup(serf_context_t *ctx)
+{
+    char c = 0;
+    apr_size_t len = 1;
+    apr_status_t status;
+
+    if (!ctx->wakeup_out)
+        return APR_ENOTIMPL;
+
+    /* A full pipe already wakes up the loop. */
+    status = apr_file_write(ctx->wakeup_out, &c, &len);
+    if (APR_STATUS_IS_EAGAIN(status))
+        status = APR_SUCCESS;
+
+    return status;
+}
+
+/* Empty the wakeup pipe of CTX, the loop is awake now. */
+static void drain_wakeup_pipe(serf_context_t *ctx)
+{
+    char buf[64];
+    apr_size_t len;
+
+    do {
+        len = sizeof(buf);
+    } while (apr_file_read(ctx->wakeup_in, buf, &len) == APR_SUCCESS
+             && len == sizeof(buf));
+}
+
+/* Destroy the pollsets that were replaced while the events of the last
+   poll were dispatched. */
+static void destroy_retired_pollsets(serf_context_t *ctx)
+{
+    serf_pollset_t *ps = (serf_pollset_t*)ctx->pollset_baton;
+
+    if (ctx->pollset_add != pollset_add)
+        return;
+
+    while (ps->retired_pools->nelts)
+        apr_pool_destroy(*(apr_pool_t **)apr_array_pop(ps->retired_pools));
+}
+
 apr_status_t serf_context_prerun(serf_context_t *ctx)
 {
     apr_status_t status = APR_SUCCESS;
+
+    destroy_retired_pollsets(ctx);
+
+    /* For applications that run their own pollset. */
+    serf__context_progress_report(ctx);
+
+    /* Expire timeouts first, they may close or reset connections. */
+    if ((status = serf__timer_wheel_run(&ctx->timers,
+                                        apr_time_now())) != APR_SUCCESS)
+        return status;
+
+    /* A resolver thread may have woken us up. */
+    serf__dns_process(ctx);
+
     if ((status = serf__open_connections(ctx)) != APR_SUCCESS)
         return status;
 
@@ -220,6 +567,7 @@ apr_status_t serf_event_trigger(
             tdesc.reqevents = conn->reqevents;
             ctx->pollset_rm(ctx->pollset_baton,
                             &tdesc, &conn->baton);
+            conn->in_pollset = 0;
             return conn->status;
         }
         /* apr_pollset_poll() can return a conn multiple times... */
@@ -241,6 +589,7 @@ apr_status_t serf_event_trigger(
                 tdesc.reqevents = conn->reqevents;
                 ctx->pollset_rm(ctx->pollset_baton,
                                 &tdesc, &conn->baton);
+                conn->in_pollset = 0;
             }
             return conn->status;
         }
@@ -254,6 +603,14 @@ apr_status_t serf_event_trigger(
             return status;
         }
     }
+    else if (io->type == SERF_IO_CONNECT_ATTEMPT) {
+        status = serf__process_connect_attempt(io->u.attempt,
+                                               desc->rtnevents);
+
+        if (status) {
+            return status;
+        }
+    }
     else if (io->type == SERF_IO_CLIENT) {
         serf_incoming_t *c = io->u.client;
 
@@ -263,11 +620,15 @@ apr_status_t serf_event_trigger(
             return status;
         }
     }
+    else if (io->type == SERF_IO_WAKEUP) {
+        /* Whatever we were woken up for is handled by the next prerun. */
+        drain_wakeup_pipe(io->u.ctx);
+    }
     return status;
 }
 
 
-apr_status_t serf_context_run(
+static apr_status_t run_once(
     serf_context_t *ctx,
     apr_short_interval_time_t duration,
     apr_pool_t *pool)
@@ -276,12 +637,19 @@ apr_status_t serf_context_run(
     apr_int32_t num;
     const apr_pollfd_t *desc;
     serf_pollset_t *ps = (serf_pollset_t*)ctx->pollset_baton;
+    apr_interval_time_t timeout = duration;
+    apr_interval_time_t next_timer;
 
     if ((status = serf_context_prerun(ctx)) != APR_SUCCESS) {
         return status;
     }
 
-    if ((status = apr_pollset_poll(ps->pollset, duration, &num,
+    /* Don't sleep past the next timeout. */
+    next_timer = serf__timer_wheel_next(&ctx->timers, apr_time_now());
+    if (next_timer >= 0 && (timeout < 0 || next_timer < timeout))
+        timeout = next_timer;
+
+    if ((status = apr_pollset_poll(ps->pollset, timeout, &num,
                                    &desc)) != APR_SUCCESS) {
         /* EINTR indicates a handled signal happened during the poll call,
            ignore, the application can safely retry. */
@@ -296,8 +664,13 @@ apr_status_t serf_context_run(
         /* Use the strict documented error for poll timeouts, to allow proper
            handling of the other timeout types when returned from
            serf_event_trigger */
-        if (APR_STATUS_IS_TIMEUP(status))
+        if (APR_STATUS_IS_TIMEUP(status)) {
+            /* Woken up for a timeout, not because DURATION passed. */
+            if (timeout != duration)
+                return serf__timer_wheel_run(&ctx->timers, apr_time_now());
+
             return APR_TIMEUP; /* Return the documented error */
+        }
         return status;
     }
 
@@ -320,6 +693,19 @@ apr_status_t serf_context_run(
 }
 
 
+apr_status_t serf_context_run(
+    serf_context_t *ctx,
+    apr_short_interval_time_t duration,
+    apr_pool_t *pool)
+{
+    apr_status_t status = run_once(ctx, duration, pool);
+
+    serf__context_progress_report(ctx);
+
+    return status;
+}
+
+
 void serf_context_set_progress_cb(
     serf_context_t *ctx,
     const serf_progress_t progress_func,
@@ -330,6 +716,57 @@ void serf_context_set_progress_cb(
 }
 
 
+void serf_context_set_progress_batching(
+    serf_context_t *ctx,
+    int batched,
+    apr_off_t min_bytes,
+    apr_interval_time_t min_interval)
+{
+    ctx->progress_batched = batched;
+    ctx->progress_min_bytes = min_bytes;
+    ctx->progress_min_interval = min_interval;
+
+    /* Count from here, whatever was reported before. */
+    ctx->progress_reported_read = ctx->progress_read;
+    ctx->progress_reported_written = ctx->progress_written;
+    ctx->progress_reported_time = apr_time_now();
+}
+
+void serf__metrics_add(serf_metrics_t *sum, const serf_metrics_t *metrics)
+{
+    int i;
+
+    sum->requests_completed += metrics->requests_completed;
+    sum->responses_completed += metrics->responses_completed;
+    sum->resets += metrics->resets;
+    sum->requests_requeued += metrics->requests_requeued;
+    sum->bytes_read += metrics->bytes_read;
+    sum->bytes_written += metrics->bytes_written;
+    for (i = 0; i < SERF_METRICS_DEPTH_BUCKETS; i++)
+        sum->depth_histogram[i] += metrics->depth_histogram[i];
+    sum->blocked_time += metrics->blocked_time;
+    sum->handshakes_full += metrics->handshakes_full;
+    sum->handshakes_resumed += metrics->handshakes_resumed;
+    sum->auth_round_trips += metrics->auth_round_trips;
+}
+
+void serf_context_get_metrics(
+    serf_context_t *ctx,
+    serf_metrics_t *metrics)
+{
+    int i;
+
+    *metrics = ctx->closed_metrics;
+
+    for (i = 0; i < ctx->conns->nelts; i++) {
+        serf_metrics_t conn_metrics;
+
+        serf_connection_get_metrics(GET_CONN(ctx, i), &conn_metrics);
+        serf__metrics_add(metrics, &conn_metrics);
+    }
+}
+
+
 serf_bucket_t *serf_context_bucket_socket_create(
     serf_context_t *ctx,
     apr_socket_t *skt,
@@ -344,6 +781,8 @@ serf_bucket_t *serf_context_bucket_socket_create(
     serf_bucket_socket_set_read_progress_cb(bucket,
                                             serf__context_progress_delta,
                                             ctx);
+    serf__bucket_socket_set_trace_cb(bucket, serf__context_trace_received,
+                                     ctx);
 
     return bucket;
 }
@@ -370,6 +809,8 @@ const char *serf_error_string(apr_status_t errcode)
         return "The connection is blocked, pending further action";
     case SERF_ERROR_DECOMPRESSION_FAILED:
         return "An error occurred during decompression";
+    case SERF_ERROR_COMPRESSION_FAILED:
+        return "An error occurred during compression";
     case SERF_ERROR_BAD_HTTP_RESPONSE:
         return "The server sent an improper HTTP response";
     case SERF_ERROR_TRUNCATED_HTTP_RESPONSE:
@@ -384,6 +825,18 @@ const char *serf_error_string(apr_status_t errcode)
         return "The HTTP response header too long";
     case SERF_ERROR_CONNECTION_TIMEDOUT:
         return "The connection timed out";
+    case SERF_ERROR_BAD_HTTP_REQUEST:
+        return "The client sent an improper HTTP request";
+    case SERF_ERROR_HTTP2_PROTOCOL_ERROR:
+        return "The server violated the HTTP/2 protocol";
+    case SERF_ERROR_HTTP2_COMPRESSION_ERROR:
+        return "The server sent improperly compressed HTTP/2 headers";
+    case SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR:
+        return "The server violated HTTP/2 flow control";
+    case SERF_ERROR_HTTP2_FRAME_SIZE_ERROR:
+        return "The server sent an HTTP/2 frame with an invalid size";
+    case SERF_ERROR_HTTP2_STREAM_RESET:
+        return "The server reset the HTTP/2 stream of the request";
     case SERF_ERROR_SSL_COMM_FAILED:
         return "An error occurred during SSL communication";
     case SERF_ERROR_SSL_SETUP_FAILED:
@@ -0,0 +1,377 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_atomic.h>
+#include <stdlib.h>
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#endif
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+#if APR_HAS_THREADS
+
+/* How long a loop blocks in serf_context_run() when its pollset can't be
+   woken up, and thus how long a posted task may wait before it runs. */
+#define LOOP_POLL_INTERVAL (10 * 1000) /* 10 ms */
+
+typedef struct task_t {
+    serf_context_task_t func;
+    void *baton;
+    struct task_t *next;
+} task_t;
+
+typedef struct loop_t {
+    serf_context_group_t *group;
+    serf_context_t *ctx;
+
+    /* The pool of this loop, with its own allocator so the loops don't
+       contend on the allocator of the group's pool. */
+    apr_pool_t *pool;
+
+    apr_thread_t *thread;
+
+    /* Protects the task queues below. The tasks are malloc'ed, as the
+       posting threads can't allocate from POOL, which the loop uses. */
+    apr_thread_mutex_t *mutex;
+    task_t *tasks;
+    task_t *last_task;
+    task_t *free_tasks;
+
+    /* Whether serf__context_wakeup() works for CTX. */
+    int wakeable;
+
+    apr_status_t status;
+} loop_t;
+
+struct serf_context_group_t {
+    loop_t *loops;
+    int nloops;
+
+    /* Set to stop the loops. */
+    volatile apr_uint32_t stopping;
+
+    int running;
+
+    apr_pool_t *pool;
+};
+
+
+/* Run the queued tasks of LOOP. */
+static void run_tasks(loop_t *loop)
+{
+    task_t *tasks, *task;
+
+    apr_thread_mutex_lock(loop->mutex);
+    tasks = loop->tasks;
+    loop->tasks = loop->last_task = NULL;
+    apr_thread_mutex_unlock(loop->mutex);
+
+    if (!tasks)
+        return;
+
+    for (task = tasks; ; task = task->next) {
+        task->func(loop->ctx, task->baton);
+        if (!task->next)
+            break;
+    }
+
+    /* TASK is now the last one, put the whole list up for reuse. */
+    apr_thread_mutex_lock(loop->mutex);
+    task->next = loop->free_tasks;
+    loop->free_tasks = tasks;
+    apr_thread_mutex_unlock(loop->mutex);
+}
+
+static void * APR_THREAD_FUNC loop_thread(apr_thread_t *thread, void *baton)
+{
+    loop_t *loop = baton;
+    serf_context_group_t *group = loop->group;
+    apr_short_interval_time_t duration;
+    apr_pool_t *iterpool;
+
+    duration = loop->wakeable ? SERF_DURATION_FOREVER : LOOP_POLL_INTERVAL;
+
+    apr_pool_create(&iterpool, loop->pool);
+
+    while (!apr_atomic_read32(&group->stopping)) {
+        apr_status_t status;
+
+        run_tasks(loop);
+
+        apr_pool_clear(iterpool);
+        status = serf_context_run(loop->ctx, duration, iterpool);
+        if (APR_STATUS_IS_TIMEUP(status))
+            continue;
+        if (status) {
+            loop->status = status;
+            break;
+        }
+    }
+
+    apr_pool_destroy(iterpool);
+    apr_thread_exit(thread, APR_SUCCESS);
+
+    return NULL;
+}
+
+static void free_task_list(task_t *task)
+{
+    while (task) {
+        task_t *next = task->next;
+
+        free(task);
+        task = next;
+    }
+}
+
+/* Free the tasks of LOOP, once its thread is gone. */
+static apr_status_t tasks_cleanup(void *baton)
+{
+    loop_t *loop = baton;
+
+    free_task_list(loop->tasks);
+    free_task_list(loop->free_tasks);
+    loop->tasks = loop->last_task = loop->free_tasks = NULL;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t group_cleanup(void *baton)
+{
+    serf_context_group_t *group = baton;
+
+    (void) serf_context_group_stop(group);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_context_group_create(serf_context_group_t **group_p,
+                                       int nloops,
+                                       apr_pool_t *pool)
+{
+    serf_context_group_t *group;
+    int i;
+
+    if (nloops < 1)
+        return APR_EINVAL;
+
+    group = apr_pcalloc(pool, sizeof(*group));
+    group->pool = pool;
+    group->nloops = nloops;
+    group->loops = apr_pcalloc(pool, nloops * sizeof(*group->loops));
+    apr_atomic_set32(&group->stopping, 0);
+
+    for (i = 0; i < nloops; i++) {
+        loop_t *loop = &group->loops[i];
+        apr_allocator_t *allocator;
+        apr_status_t status;
+
+        status = apr_allocator_create(&allocator);
+        if (status)
+            return status;
+
+        status = apr_pool_create_ex(&loop->pool, pool, NULL, allocator);
+        if (status) {
+            apr_allocator_destroy(allocator);
+            return status;
+        }
+        apr_allocator_owner_set(allocator, loop->pool);
+
+        status = apr_thread_mutex_create(&loop->mutex,
+                                         APR_THREAD_MUTEX_DEFAULT,
+                                         loop->pool);
+        if (status)
+            return status;
+        apr_pool_cleanup_register(loop->pool, loop, tasks_cleanup,
+                                  apr_pool_cleanup_null);
+
+        loop->group = group;
+        loop->ctx = serf__context_create_wakeable(loop->pool);
+        /* Probing only makes the first serf_context_run() return early. */
+        loop->wakeable = serf__context_wakeup(loop->ctx) != APR_ENOTIMPL;
+    }
+
+    /* Stop the threads before the pools of the loops go away. */
+    apr_pool_pre_cleanup_register(pool, group, group_cleanup);
+
+    *group_p = group;
+
+    return APR_SUCCESS;
+}
+
+serf_context_t *serf_context_group_get(serf_context_group_t *group,
+                                       const char *host)
+{
+    apr_ssize_t klen = APR_HASH_KEY_STRING;
+    unsigned int hash;
+
+    hash = apr_hashfunc_default(host, &klen);
+
+    return group->loops[hash % group->nloops].ctx;
+}
+
+apr_status_t serf_context_group_post(serf_context_group_t *group,
+                                     serf_context_t *ctx,
+                                     serf_context_task_t func,
+                                     void *task_baton)
+{
+    loop_t *loop = NULL;
+    task_t *task;
+    int i;
+
+    for (i = 0; i < group->nloops; i++) {
+        if (group->loops[i].ctx == ctx) {
+            loop = &group->loops[i];
+            break;
+        }
+    }
+    if (!loop)
+        return APR_EINVAL;
+
+    apr_thread_mutex_lock(loop->mutex);
+
+    if (loop->free_tasks) {
+        task = loop->free_tasks;
+        loop->free_tasks = task->next;
+    }
+    else {
+        task = malloc(sizeof(*task));
+        if (!task) {
+            apr_thread_mutex_unlock(loop->mutex);
+            return APR_ENOMEM;
+        }
+    }
+    task->func = func;
+    task->baton = task_baton;
+    task->next = NULL;
+
+    if (loop->last_task)
+        loop->last_task->next = task;
+    else
+        loop->tasks = task;
+    loop->last_task = task;
+
+    apr_thread_mutex_unlock(loop->mutex);
+
+    if (loop->wakeable)
+        (void) serf__context_wakeup(ctx);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_context_group_start(serf_context_group_t *group)
+{
+    int i;
+
+    if (group->running)
+        return APR_SUCCESS;
+
+    apr_atomic_set32(&group->stopping, 0);
+
+    for (i = 0; i < group->nloops; i++) {
+        loop_t *loop = &group->loops[i];
+        apr_status_t status;
+
+        loop->status = APR_SUCCESS;
+
+        status = apr_thread_create(&loop->thread, NULL, loop_thread, loop,
+                                   loop->pool);
+        if (status) {
+            /* Don't leave the loops that did start running. */
+            loop->thread = NULL;
+            group->running = 1;
+            (void) serf_context_group_stop(group);
+            return status;
+        }
+    }
+
+    group->running = 1;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_context_group_stop(serf_context_group_t *group)
+{
+    apr_status_t status = APR_SUCCESS;
+    int i;
+
+    if (!group->running)
+        return APR_SUCCESS;
+
+    apr_atomic_set32(&group->stopping, 1);
+
+    for (i = 0; i < group->nloops; i++) {
+        loop_t *loop = &group->loops[i];
+        apr_status_t thread_status;
+
+        if (!loop->thread)
+            continue;
+
+        if (loop->wakeable)
+            (void) serf__context_wakeup(loop->ctx);
+
+        apr_thread_join(&thread_status, loop->thread);
+        loop->thread = NULL;
+
+        if (loop->status && !status)
+            status = loop->status;
+    }
+
+    group->running = 0;
+
+    return status;
+}
+
+#else /* APR_HAS_THREADS */
+
+apr_status_t serf_context_group_create(serf_context_group_t **group,
+                                       int nloops,
+                                       apr_pool_t *pool)
+{
+    return APR_ENOTIMPL;
+}
+
+serf_context_t *serf_context_group_get(serf_context_group_t *group,
+                                       const char *host)
+{
+    return NULL;
+}
+
+apr_status_t serf_context_group_post(serf_context_group_t *group,
+                                     serf_context_t *ctx,
+                                     serf_context_task_t func,
+                                     void *task_baton)
+{
+    return APR_ENOTIMPL;
+}
+
+apr_status_t serf_context_group_start(serf_context_group_t *group)
+{
+    return APR_ENOTIMPL;
+}
+
+apr_status_t serf_context_group_stop(serf_context_group_t *group)
+{
+    return APR_ENOTIMPL;
+}
+
+#endif /* APR_HAS_THREADS */
@@ -0,0 +1,337 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_pools.h>
+#include <apr_general.h>  /* for strcasecmp() */
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_uri.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* The times a URL is sent again after its connection was reset. */
+#define MAX_RETRIES 3
+
+typedef struct fetch_batch_t fetch_batch_t;
+
+/* The connections to one scheme://host:port of the batch. */
+typedef struct fetch_host_t {
+    fetch_batch_t *batch;
+    serf_host_pool_t *hpool;
+    const char *hostname;
+    int using_ssl;
+} fetch_host_t;
+
+/* The fetch of one URL. */
+typedef struct fetch_url_t {
+    fetch_batch_t *batch;
+    fetch_host_t *host;
+    const char *path;
+    int retries;
+    serf_fetch_result_t *result;
+    int done;
+} fetch_url_t;
+
+struct fetch_batch_t {
+    serf_context_t *ctx;
+    serf_bucket_alloc_t *allocator;
+    int pending;
+    int closing;
+
+    /* The bodies are allocated in POOL, the connections in CONNS_POOL,
+       which is destroyed when the batch is done. */
+    apr_pool_t *pool;
+    apr_pool_t *conns_pool;
+};
+
+static apr_status_t conn_setup(apr_socket_t *skt,
+                               serf_bucket_t **input_bkt,
+                               serf_bucket_t **output_bkt,
+                               void *setup_baton,
+                               apr_pool_t *pool)
+{
+    fetch_host_t *host = setup_baton;
+    serf_bucket_alloc_t *allocator = host->batch->allocator;
+    serf_ssl_context_t *ssl_ctx;
+
+    *input_bkt = serf_context_bucket_socket_create(host->batch->ctx, skt,
+                                                   allocator);
+    if (!host->using_ssl)
+        return APR_SUCCESS;
+
+    *input_bkt = serf_bucket_ssl_decrypt_create(*input_bkt, NULL, allocator);
+    ssl_ctx = serf_bucket_ssl_decrypt_context_get(*input_bkt);
+    serf_ssl_set_hostname(ssl_ctx, host->hostname);
+
+    *output_bkt = serf_bucket_ssl_encrypt_create(*output_bkt, ssl_ctx,
+                                                 allocator);
+
+    return APR_SUCCESS;
+}
+
+static void conn_closed(serf_connection_t *conn,
+                        void *closed_baton,
+                        apr_status_t why,
+                        apr_pool_t *pool)
+{
+    /* The host pool opens a new connection when it's needed. */
+}
+
+/* Mark FETCH as done with STATUS. */
+static void fetch_done(fetch_url_t *fetch, apr_status_t status)
+{
+    if (fetch->done)
+        return;
+
+    fetch->result->status = status;
+    fetch->done = 1;
+    fetch->batch->pending--;
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool);
+
+static serf_bucket_t *accept_response(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    serf_bucket_alloc_t *allocator = serf_request_get_alloc(request);
+    serf_bucket_t *c;
+
+    c = serf_bucket_barrier_create(stream, allocator);
+    return serf_bucket_response_create(c, allocator);
+}
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    fetch_url_t *fetch = handler_baton;
+    apr_status_t status;
+
+    if (!response) {
+        /* The request was cancelled because its connection was reset
+           while it was pending, send it again. */
+        if (fetch->batch->closing || fetch->retries++ == MAX_RETRIES
+            || !serf_host_pool_request_create(fetch->host->hpool,
+                                              setup_request, fetch))
+            fetch_done(fetch, APR_ECONNRESET);
+        return APR_SUCCESS;
+    }
+
+    if (!fetch->result->code) {
+        serf_status_line sl;
+
+        status = serf_bucket_response_status(response, &sl);
+        if (status)
+            return status;
+        fetch->result->code = sl.code;
+    }
+
+    /* The body is read into a buffer of the size of the Content-Length,
+       if the server sent one. */
+    status = serf_bucket_response_read_body(response, &fetch->result->body,
+                                            &fetch->result->body_len,
+                                            fetch->batch->pool);
+    if (SERF_BUCKET_READ_ERROR(status))
+        fetch_done(fetch, status);
+    else if (APR_STATUS_IS_EOF(status))
+        fetch_done(fetch, APR_SUCCESS);
+
+    return status;
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    fetch_url_t *fetch = setup_baton;
+
+    *req_bkt = serf_request_bucket_request_create(
+                   request, "GET", fetch->path, NULL,
+                   serf_request_get_alloc(request));
+
+    /* A request that is sent again starts over. */
+    fetch->result->code = 0;
+    fetch->result->body_len = 0;
+
+    *acceptor = accept_response;
+    *acceptor_baton = fetch;
+    *handler = handle_response;
+    *handler_baton = fetch;
+
+    return APR_SUCCESS;
+}
+
+/* Find or create the host of URI in HOSTS. */
+static apr_status_t get_host(fetch_host_t **host_p,
+                             apr_hash_t *hosts,
+                             const apr_uri_t *uri,
+                             unsigned int max_conns,
+                             fetch_batch_t *batch)
+{
+    const char *key;
+    fetch_host_t *host;
+    apr_uri_t host_info;
+    apr_status_t status;
+
+    key = apr_pstrcat(batch->conns_pool, uri->scheme, "://", uri->hostinfo,
+                      NULL);
+    host = apr_hash_get(hosts, key, APR_HASH_KEY_STRING);
+    if (host) {
+        *host_p = host;
+        return APR_SUCCESS;
+    }
+
+    host = apr_pcalloc(batch->conns_pool, sizeof(*host));
+    host->batch = batch;
+    host->hostname = uri->hostname;
+    host->using_ssl = strcasecmp(uri->scheme, "https") == 0;
+
+    memset(&host_info, 0, sizeof(host_info));
+    host_info.scheme = uri->scheme;
+    host_info.hostinfo = uri->hostinfo;
+    host_info.hostname = uri->hostname;
+    host_info.port_str = uri->port_str;
+    host_info.port = uri->port ? uri->port
+                               : apr_uri_port_of_scheme(uri->scheme);
+
+    status = serf_host_pool_create(&host->hpool, batch->ctx, host_info,
+                                   max_conns, 0, conn_setup, host,
+                                   conn_closed, host, batch->conns_pool);
+    if (status)
+        return status;
+
+    apr_hash_set(hosts, key, APR_HASH_KEY_STRING, host);
+    *host_p = host;
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_context_fetch_urls(serf_fetch_result_t *results,
+                                     serf_context_t *ctx,
+                                     const char * const *urls,
+                                     int nurls,
+                                     unsigned int max_conns,
+                                     apr_interval_time_t timeout,
+                                     apr_pool_t *pool)
+{
+    fetch_batch_t batch;
+    fetch_url_t *fetches;
+    apr_hash_t *hosts;
+    apr_pool_t *conns_pool, *iterpool;
+    apr_time_t deadline = timeout ? apr_time_now() + timeout : 0;
+    apr_status_t status = APR_SUCCESS;
+    int i;
+
+    if (!max_conns)
+        return APR_EINVAL;
+
+    apr_pool_create(&conns_pool, pool);
+    apr_pool_create(&iterpool, pool);
+
+    batch.ctx = ctx;
+    batch.allocator = serf_bucket_allocator_create(conns_pool, NULL, NULL);
+    batch.pending = 0;
+    batch.closing = 0;
+    batch.pool = pool;
+    batch.conns_pool = conns_pool;
+
+    hosts = apr_hash_make(conns_pool);
+    fetches = apr_pcalloc(conns_pool, nurls * sizeof(*fetches));
+
+    for (i = 0; i < nurls; i++) {
+        fetch_url_t *fetch = &fetches[i];
+        fetch_host_t *host = NULL;
+        apr_uri_t uri;
+
+        memset(&results[i], 0, sizeof(results[i]));
+        fetch->batch = &batch;
+        fetch->result = &results[i];
+
+        if (apr_uri_parse(conns_pool, urls[i], &uri) != APR_SUCCESS
+            || !uri.scheme || !uri.hostname) {
+            results[i].status = APR_EINVAL;
+            fetch->done = 1;
+            continue;
+        }
+        fetch->path = apr_uri_unparse(conns_pool, &uri,
+                                      APR_URI_UNP_OMITSITEPART);
+        if (!*fetch->path)
+            fetch->path = "/";
+
+        status = get_host(&host, hosts, &uri, max_conns, &batch);
+        fetch->host = host;
+        if (!status && !serf_host_pool_request_create(host->hpool,
+                                                      setup_request, fetch))
+            status = APR_EGENERAL;
+        if (status) {
+            results[i].status = status;
+            fetch->done = 1;
+            status = APR_SUCCESS;
+            continue;
+        }
+
+        batch.pending++;
+    }
+
+    while (batch.pending) {
+        apr_interval_time_t duration = SERF_DURATION_FOREVER;
+
+        if (deadline) {
+            apr_time_t now = apr_time_now();
+
+            if (now >= deadline) {
+                status = APR_TIMEUP;
+                break;
+            }
+            if (deadline - now < duration)
+                duration = deadline - now;
+        }
+
+        apr_pool_clear(iterpool);
+        status = serf_context_run(ctx, duration, iterpool);
+        if (APR_STATUS_IS_TIMEUP(status))
+            status = APR_SUCCESS;
+        if (status)
+            break;
+    }
+
+    /* What didn't finish failed with the error that stopped the batch. */
+    for (i = 0; i < nurls && batch.pending; i++)
+        fetch_done(&fetches[i], status);
+
+    batch.closing = 1;
+    apr_pool_destroy(iterpool);
+    apr_pool_destroy(conns_pool);
+
+    return status;
+}
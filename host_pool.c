@@ -0,0 +1,279 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_pools.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* The expected cost of opening a connection and sending a request on it,
+   in round trips: one for the TCP handshake, one for the request. */
+#define NEW_CONN_RTTS 2
+
+typedef struct host_conn_t {
+    serf_connection_t *conn;
+
+    /* Pool of CONN, destroyed when the connection is retired. */
+    apr_pool_t *pool;
+
+    /* When we first saw CONN without pending requests, or 0 if it's
+       busy. */
+    apr_time_t idle_since;
+} host_conn_t;
+
+struct serf_host_pool_t {
+    serf_context_t *ctx;
+    apr_uri_t host_info;
+
+    unsigned int max_conns;
+    apr_interval_time_t max_idle;
+
+    serf_connection_setup_t setup;
+    void *setup_baton;
+    serf_connection_closed_t closed;
+    void *closed_baton;
+
+    /* The open connections (host_conn_t). */
+    apr_array_header_t *conns;
+
+    apr_pool_t *pool;
+};
+
+#define GET_HOST_CONN(hpool, i) \
+    (&APR_ARRAY_IDX((hpool)->conns, (i), host_conn_t))
+
+
+apr_status_t serf_host_pool_create(serf_host_pool_t **hpool_p,
+                                   serf_context_t *ctx,
+                                   apr_uri_t host_info,
+                                   unsigned int max_conns,
+                                   apr_interval_time_t max_idle,
+                                   serf_connection_setup_t setup,
+                                   void *setup_baton,
+                                   serf_connection_closed_t closed,
+                                   void *closed_baton,
+                                   apr_pool_t *pool)
+{
+    serf_host_pool_t *hpool;
+
+    if (!max_conns)
+        return APR_EINVAL;
+
+    hpool = apr_pcalloc(pool, sizeof(*hpool));
+    hpool->ctx = ctx;
+    hpool->host_info = host_info;
+    hpool->max_conns = max_conns;
+    hpool->max_idle = max_idle;
+    hpool->setup = setup;
+    hpool->setup_baton = setup_baton;
+    hpool->closed = closed;
+    hpool->closed_baton = closed_baton;
+    hpool->conns = apr_array_make(pool, max_conns, sizeof(host_conn_t));
+    hpool->pool = pool;
+
+    *hpool_p = hpool;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t open_connection(host_conn_t **hconn_p,
+                                    serf_host_pool_t *hpool)
+{
+    host_conn_t *hconn;
+    serf_connection_t *conn;
+    apr_pool_t *conn_pool;
+    apr_status_t status;
+
+    apr_pool_create(&conn_pool, hpool->pool);
+
+    status = serf_connection_create2(&conn, hpool->ctx, hpool->host_info,
+                                     hpool->setup, hpool->setup_baton,
+                                     hpool->closed, hpool->closed_baton,
+                                     conn_pool);
+    if (status) {
+        apr_pool_destroy(conn_pool);
+        return status;
+    }
+
+    hconn = apr_array_push(hpool->conns);
+    hconn->conn = conn;
+    hconn->pool = conn_pool;
+    hconn->idle_since = 0;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "host pool opened connection %d of %d to %s\n",
+              hpool->conns->nelts, hpool->max_conns, conn->host_url);
+
+    *hconn_p = hconn;
+
+    return APR_SUCCESS;
+}
+
+static void close_connection(serf_host_pool_t *hpool, int i)
+{
+    host_conn_t *hconn = GET_HOST_CONN(hpool, i);
+    int last = hpool->conns->nelts - 1;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, hconn->conn->config,
+              "host pool retiring idle connection 0x%x\n", hconn->conn);
+
+    /* This closes the connection. */
+    apr_pool_destroy(hconn->pool);
+
+    /* The order of the connections doesn't matter. */
+    if (i < last)
+        *hconn = *GET_HOST_CONN(hpool, last);
+    hpool->conns->nelts--;
+}
+
+void serf_host_pool_retire_idle(serf_host_pool_t *hpool)
+{
+    apr_time_t now;
+    int i;
+
+    if (!hpool->max_idle)
+        return;
+
+    now = apr_time_now();
+
+    for (i = hpool->conns->nelts; i--; ) {
+        host_conn_t *hconn = GET_HOST_CONN(hpool, i);
+
+        if (serf_connection_pending_requests(hconn->conn)) {
+            hconn->idle_since = 0;
+            continue;
+        }
+
+        if (!hconn->idle_since) {
+            hconn->idle_since = now;
+        }
+        else if (now - hconn->idle_since > hpool->max_idle
+                 && hpool->conns->nelts > 1) {
+            close_connection(hpool, i);
+        }
+    }
+}
+
+/* The time a new request in class PRIORITY would wait for its response on
+   CONN: the requests in front of it plus its own round trip. */
+static apr_interval_time_t expected_wait(serf_connection_t *conn,
+                                         int priority,
+                                         apr_interval_time_t default_rtt)
+{
+    apr_interval_time_t rtt = serf_connection_get_latency(conn);
+
+    if (rtt < 0)
+        rtt = default_rtt;
+
+    return (serf__connection_requests_ahead(conn, priority) + 1) * rtt;
+}
+
+serf_request_t *serf_host_pool_request_create(serf_host_pool_t *hpool,
+                                              serf_request_setup_t setup,
+                                              void *setup_baton)
+{
+    return serf_host_pool_request_create2(hpool, setup, setup_baton,
+                                          SERF_PRIORITY_DEFAULT);
+}
+
+serf_request_t *serf_host_pool_request_create2(serf_host_pool_t *hpool,
+                                               serf_request_setup_t setup,
+                                               void *setup_baton,
+                                               int priority)
+{
+    host_conn_t *best = NULL;
+    apr_interval_time_t best_wait = 0;
+    apr_interval_time_t default_rtt;
+    apr_interval_time_t total_rtt = 0;
+    int nr_known = 0;
+    int i;
+
+    serf_host_pool_retire_idle(hpool);
+
+    /* Connections without a measured latency (yet) are assumed to be as
+       far away as the average of the others. When nothing is known, only
+       the queue depths are compared. */
+    for (i = 0; i < hpool->conns->nelts; i++) {
+        apr_interval_time_t rtt;
+
+        rtt = serf_connection_get_latency(GET_HOST_CONN(hpool, i)->conn);
+        if (rtt >= 0) {
+            total_rtt += rtt;
+            nr_known++;
+        }
+    }
+    default_rtt = nr_known ? total_rtt / nr_known : 1;
+    if (default_rtt <= 0)
+        default_rtt = 1;
+
+    for (i = 0; i < hpool->conns->nelts; i++) {
+        host_conn_t *hconn = GET_HOST_CONN(hpool, i);
+        apr_interval_time_t wait = expected_wait(hconn->conn, priority,
+                                                 default_rtt);
+
+        if (!best || wait < best_wait) {
+            best = hconn;
+            best_wait = wait;
+        }
+    }
+
+    /* Open a new connection when that's expected to be faster than
+       queueing behind the requests on the best existing one. */
+    if (!best || (best_wait > NEW_CONN_RTTS * default_rtt
+                  && hpool->conns->nelts < (int)hpool->max_conns)) {
+        host_conn_t *hconn;
+
+        if (open_connection(&hconn, hpool) == APR_SUCCESS)
+            best = hconn;
+        else if (!best)
+            return NULL;
+    }
+
+    best->idle_since = 0;
+
+    return serf_connection_request_create2(best->conn, setup, setup_baton,
+                                           priority);
+}
+
+apr_status_t serf_host_pool_prewarm(serf_host_pool_t *hpool,
+                                    unsigned int count)
+{
+    int i;
+
+    if (count > hpool->max_conns)
+        count = hpool->max_conns;
+
+    while (hpool->conns->nelts < (int)count) {
+        host_conn_t *hconn;
+        apr_status_t status;
+
+        if ((status = open_connection(&hconn, hpool)) != APR_SUCCESS)
+            return status;
+    }
+
+    for (i = 0; i < hpool->conns->nelts; i++)
+        serf_connection_prewarm(GET_HOST_CONN(hpool, i)->conn);
+
+    return APR_SUCCESS;
+}
+
+unsigned int serf_host_pool_connections(serf_host_pool_t *hpool)
+{
+    return hpool->conns->nelts;
+}
@@ -0,0 +1,1633 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <apr_lib.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_uri.h>
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* The HTTP/2 protocol engine, see RFC 7540.
+
+   Each request is sent on its own stream. Once its HEADERS are queued the
+   request moves to the written_reqs list of the connection, where it stays
+   until its response completed: unlike HTTP/1.1 the responses are
+   delivered in whatever order the server sends them.
+
+   The response of a stream is presented to the application as an
+   HTTP/1.1 response: a status line and headers rebuilt from the decoded
+   header block, followed by the payload of the DATA frames. This way the
+   existing response buckets, authentication and application handlers work
+   unchanged on HTTP/2 connections. */
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN (sizeof(HTTP2_PREFACE) - 1)
+
+/* The protocol defaults, until the peer's SETTINGS say otherwise. */
+#define DEFAULT_WINDOW_SIZE 65535
+#define DEFAULT_MAX_FRAME_SIZE 16384
+#define DEFAULT_HEADER_TABLE_SIZE 4096
+
+/* The limit on concurrent streams we assume before the server announced
+   its own. */
+#define DEFAULT_MAX_CONCURRENT 100
+
+/* The receive windows we give each stream and the whole connection. */
+#define STREAM_WINDOW_SIZE (1024 * 1024)
+#define CONNECTION_WINDOW_SIZE (16 * 1024 * 1024)
+
+/* The largest header block we accept, spread over HEADERS and
+   CONTINUATION frames. */
+#define MAX_HEADER_BLOCK_SIZE (256 * 1024)
+
+/* How much DATA we queue on the output stream before trying to write it
+   out, so one large body can't fill up memory. */
+#define MAX_QUEUED_DATA (64 * 1024)
+
+#define MAX_STREAM_ID 0x7fffffff
+#define MAX_WINDOW_SIZE 0x7fffffff
+
+/* SETTINGS parameters */
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+/* Error codes for RST_STREAM and GOAWAY */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+typedef struct http2_stream_t {
+    serf__http2_t *h2;
+    apr_uint32_t id;
+
+    /* NULL once the request is gone. */
+    serf_request_t *request;
+
+    /* The STREAM-DATA bucket the response is read from, NULL until the
+       response headers arrived or once the response bucket destroyed it. */
+    serf_bucket_t *data;
+
+    /* The request body that still has to be sent. */
+    serf_bucket_t *body;
+
+    /* What we may send, and what the server may still send us. */
+    apr_int64_t send_window;
+    apr_int64_t recv_window;
+
+    /* Bytes the application consumed, not yet given back to the server
+       with a WINDOW_UPDATE. */
+    apr_size_t unacked;
+
+    /* We sent or received END_STREAM. */
+    int local_closed;
+    int remote_closed;
+
+    /* The final (not 1xx) response headers were received. */
+    int headers_received;
+
+    struct http2_stream_t *next;
+} http2_stream_t;
+
+struct serf__http2_t {
+    serf_connection_t *conn;
+    apr_pool_t *pool;
+
+    serf__hpack_table_t *hpack;
+
+    /* The open streams, oldest first. */
+    http2_stream_t *streams;
+    unsigned int nr_of_streams;
+    http2_stream_t *free_streams;
+
+    apr_uint32_t next_stream_id;
+
+    /* The settings of the server. */
+    apr_uint32_t max_concurrent;
+    apr_int64_t initial_window;
+    apr_size_t max_frame_size;
+
+    /* The connection level windows, see http2_stream_t. */
+    apr_int64_t send_window;
+    apr_int64_t recv_window;
+    apr_size_t unacked;
+
+    /* The frame being read, and its payload so far. */
+    serf_bucket_t *frame;
+    char *payload;
+    apr_size_t payload_len;
+
+    /* The header block being collected from HEADERS and CONTINUATION
+       frames, for stream HEADERS_STREAM (0 if none). */
+    char *headers;
+    apr_size_t headers_len;
+    apr_size_t headers_size;
+    apr_uint32_t headers_stream;
+    int headers_end_stream;
+
+    /* The server sent GOAWAY, or we ran out of stream identifiers. */
+    int goaway;
+};
+
+
+static void put_uint32(char *buf, apr_uint32_t value)
+{
+    buf[0] = (char)((value >> 24) & 0xff);
+    buf[1] = (char)((value >> 16) & 0xff);
+    buf[2] = (char)((value >> 8) & 0xff);
+    buf[3] = (char)(value & 0xff);
+}
+
+static apr_uint32_t get_uint32(const char *buf)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16)
+           | ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
+static void queue_frame(serf__http2_t *h2, serf_bucket_t *payload,
+                        unsigned char frame_type, unsigned char flags,
+                        apr_uint32_t stream_id)
+{
+    serf_connection_t *conn = h2->conn;
+    serf_bucket_t *frame;
+
+    frame = serf_bucket_http2_frame_create(payload, frame_type, flags,
+                                           stream_id, conn->allocator);
+    serf_bucket_aggregate_append(conn->ostream_tail, frame);
+
+    serf__conn_set_dirty(conn);
+}
+
+/* Queue a frame with a copy of the LEN bytes in DATA as payload. */
+static void queue_control_frame(serf__http2_t *h2, unsigned char frame_type,
+                                unsigned char flags, apr_uint32_t stream_id,
+                                const char *data, apr_size_t len)
+{
+    serf_bucket_t *payload = NULL;
+
+    if (len)
+        payload = serf_bucket_simple_copy_create(data, len,
+                                                 h2->conn->allocator);
+
+    queue_frame(h2, payload, frame_type, flags, stream_id);
+}
+
+static void queue_window_update(serf__http2_t *h2, apr_uint32_t stream_id,
+                                apr_uint32_t increment)
+{
+    char buf[4];
+
+    put_uint32(buf, increment);
+    queue_control_frame(h2, SERF_HTTP2_FRAME_TYPE_WINDOW_UPDATE, 0,
+                        stream_id, buf, sizeof(buf));
+}
+
+static void queue_rst_stream(serf__http2_t *h2, apr_uint32_t stream_id,
+                             apr_uint32_t error_code)
+{
+    char buf[4];
+
+    put_uint32(buf, error_code);
+    queue_control_frame(h2, SERF_HTTP2_FRAME_TYPE_RST_STREAM, 0,
+                        stream_id, buf, sizeof(buf));
+}
+
+static void queue_goaway(serf__http2_t *h2, apr_uint32_t error_code)
+{
+    char buf[8];
+
+    /* We never accept streams from the server. */
+    put_uint32(buf, 0);
+    put_uint32(buf + 4, error_code);
+    queue_control_frame(h2, SERF_HTTP2_FRAME_TYPE_GOAWAY, 0, 0,
+                        buf, sizeof(buf));
+}
+
+
+/*** The STREAM-DATA bucket, the stream a response bucket reads from ***/
+
+typedef struct stream_data_t {
+    /* The data received on the stream, not read yet. */
+    serf_bucket_t *agg;
+    apr_size_t buffered;
+
+    /* The response headers at the start of AGG, which don't count for
+       flow control. */
+    apr_size_t uncounted;
+
+    /* NULL once the stream is gone. */
+    http2_stream_t *stream;
+
+    /* No more data arrives, read returns END_STATUS once AGG is empty. */
+    int done;
+    apr_status_t end_status;
+} stream_data_t;
+
+static const serf_bucket_type_t stream_data_bucket_type;
+
+static serf_bucket_t *stream_data_create(http2_stream_t *stream)
+{
+    serf_bucket_alloc_t *allocator = stream->request->allocator;
+    stream_data_t *ctx;
+
+    ctx = serf_bucket_mem_calloc(allocator, sizeof(*ctx));
+    ctx->agg = serf_bucket_aggregate_create(allocator);
+    ctx->stream = stream;
+
+    return serf_bucket_create(&stream_data_bucket_type, allocator, ctx);
+}
+
+static void stream_data_append(serf_bucket_t *bucket, const char *data,
+                               apr_size_t len, int counted)
+{
+    stream_data_t *ctx = bucket->data;
+
+    serf_bucket_aggregate_append(
+        ctx->agg, serf_bucket_simple_copy_create(data, len,
+                                                 bucket->allocator));
+    ctx->buffered += len;
+    if (!counted)
+        ctx->uncounted += len;
+}
+
+static void stream_data_end(serf_bucket_t *bucket, apr_status_t status)
+{
+    stream_data_t *ctx = bucket->data;
+
+    if (!ctx->done) {
+        ctx->done = 1;
+        ctx->end_status = status;
+    }
+}
+
+/* Account for LEN bytes read by the application. */
+static apr_status_t stream_data_consumed(stream_data_t *ctx, apr_size_t len,
+                                         apr_status_t status)
+{
+    apr_size_t counted = len;
+
+    ctx->buffered -= len;
+
+    if (ctx->uncounted) {
+        apr_size_t n = counted < ctx->uncounted ? counted : ctx->uncounted;
+
+        ctx->uncounted -= n;
+        counted -= n;
+    }
+
+    if (ctx->stream && counted) {
+        ctx->stream->unacked += counted;
+        ctx->stream->h2->unacked += counted;
+    }
+
+    /* An empty aggregate just means the next frame didn't arrive yet. */
+    if (APR_STATUS_IS_EOF(status))
+        return ctx->done ? ctx->end_status : APR_EAGAIN;
+
+    return status;
+}
+
+static apr_status_t stream_data_read(serf_bucket_t *bucket,
+                                     apr_size_t requested,
+                                     const char **data, apr_size_t *len)
+{
+    stream_data_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = serf_bucket_read(ctx->agg, requested, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    return stream_data_consumed(ctx, *len, status);
+}
+
+static apr_status_t stream_data_readline(serf_bucket_t *bucket,
+                                         int acceptable, int *found,
+                                         const char **data, apr_size_t *len)
+{
+    stream_data_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = serf_bucket_readline(ctx->agg, acceptable, found, data, len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    return stream_data_consumed(ctx, *len, status);
+}
+
+static apr_status_t stream_data_read_iovec(serf_bucket_t *bucket,
+                                           apr_size_t requested,
+                                           int vecs_size,
+                                           struct iovec *vecs,
+                                           int *vecs_used)
+{
+    stream_data_t *ctx = bucket->data;
+    apr_size_t len = 0;
+    apr_status_t status;
+    int i;
+
+    status = serf_bucket_read_iovec(ctx->agg, requested, vecs_size, vecs,
+                                    vecs_used);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    for (i = 0; i < *vecs_used; i++)
+        len += vecs[i].iov_len;
+
+    return stream_data_consumed(ctx, len, status);
+}
+
+static apr_status_t stream_data_peek(serf_bucket_t *bucket,
+                                     const char **data, apr_size_t *len)
+{
+    stream_data_t *ctx = bucket->data;
+    apr_status_t status;
+
+    status = serf_bucket_peek(ctx->agg, data, len);
+    if (APR_STATUS_IS_EOF(status) && !ctx->done)
+        return APR_EAGAIN;
+
+    return status;
+}
+
+static void stream_data_destroy(serf_bucket_t *bucket)
+{
+    stream_data_t *ctx = bucket->data;
+
+    /* Data nobody will read still occupied the connection window. */
+    if (ctx->stream) {
+        ctx->stream->h2->unacked += ctx->buffered - ctx->uncounted;
+        ctx->stream->data = NULL;
+    }
+
+    serf_bucket_destroy(ctx->agg);
+    serf_default_destroy_and_data(bucket);
+}
+
+static apr_uint64_t stream_data_get_remaining(serf_bucket_t *bucket)
+{
+    stream_data_t *ctx = bucket->data;
+
+    return ctx->done ? ctx->buffered : SERF_LENGTH_UNKNOWN;
+}
+
+static apr_status_t stream_data_set_config(serf_bucket_t *bucket,
+                                           serf_config_t *config)
+{
+    stream_data_t *ctx = bucket->data;
+
+    return serf_bucket_set_config(ctx->agg, config);
+}
+
+static const serf_bucket_type_t stream_data_bucket_type = {
+    "HTTP2-STREAM-DATA",
+    stream_data_read,
+    stream_data_readline,
+    stream_data_read_iovec,
+    serf_default_read_for_sendfile,
+    serf_buckets_are_v2,
+    stream_data_peek,
+    stream_data_destroy,
+    serf_default_read_bucket,
+    stream_data_get_remaining,
+    stream_data_set_config,
+};
+
+
+/*** Streams ***/
+
+static http2_stream_t *find_stream(serf__http2_t *h2, apr_uint32_t id)
+{
+    http2_stream_t *stream;
+
+    for (stream = h2->streams; stream; stream = stream->next) {
+        if (stream->id == id)
+            return stream;
+    }
+
+    return NULL;
+}
+
+/* Forget STREAM, resetting it on the server when it isn't finished and
+   SEND_RST is set. */
+static void free_stream(serf__http2_t *h2, http2_stream_t *stream,
+                        int send_rst)
+{
+    http2_stream_t **prev = &h2->streams;
+
+    while (*prev != stream)
+        prev = &(*prev)->next;
+    *prev = stream->next;
+    h2->nr_of_streams--;
+
+    if (send_rst && !(stream->local_closed && stream->remote_closed))
+        queue_rst_stream(h2, stream->id, H2_CANCEL);
+
+    if (stream->body) {
+        serf_bucket_destroy(stream->body);
+        stream->body = NULL;
+    }
+
+    if (stream->data) {
+        stream_data_t *ctx = stream->data->data;
+
+        /* What's left unread won't be counted by the bucket anymore. */
+        h2->unacked += ctx->buffered - ctx->uncounted;
+        stream_data_end(stream->data, SERF_ERROR_ABORTED_CONNECTION);
+        ctx->stream = NULL;
+        stream->data = NULL;
+    }
+
+    stream->request = NULL;
+    stream->next = h2->free_streams;
+    h2->free_streams = stream;
+}
+
+/* Remove REQUEST from the written requests of CONN. */
+static void unlink_written_request(serf_connection_t *conn,
+                                   serf_request_t *request)
+{
+    serf_request_t **prev = &conn->written_reqs;
+    serf_request_t *last = NULL;
+
+    while (*prev != request) {
+        last = *prev;
+        prev = &(*prev)->next;
+    }
+    *prev = request->next;
+
+    if (conn->written_reqs_tail == request)
+        conn->written_reqs_tail = last;
+
+    request->next = NULL;
+    conn->nr_of_written_reqs--;
+}
+
+/* Hand the request on STREAM back to the connection, to be sent again on
+   a new stream or connection. */
+static void requeue_stream(serf__http2_t *h2, http2_stream_t *stream)
+{
+    serf_request_t *request = stream->request;
+
+    unlink_written_request(h2->conn, request);
+    free_stream(h2, stream, 0);
+
+    serf__request_requeue(request);
+    serf__destroy_request(request);
+}
+
+/* Start a stream for REQUEST, queueing its HEADERS frame(s). */
+static apr_status_t open_stream(serf__http2_t *h2, serf_request_t *request)
+{
+    serf_connection_t *conn = h2->conn;
+    serf_bucket_t *req_bkt = request->req_bkt;
+    serf_bucket_t *hdrs, *body;
+    const char *uri, *method, *authority, *path, *scheme;
+    apr_int64_t content_length;
+    http2_stream_t *stream;
+    char *block;
+    apr_size_t block_len, offset;
+
+    /* Only request buckets can be taken apart into HTTP/2 headers. */
+    if (!SERF_BUCKET_IS_REQUEST(req_bkt)) {
+        serf__log(LOGLVL_ERROR, LOGCOMP_CONN, __FILE__, conn->config,
+                  "can't send a %s bucket as HTTP/2 request\n",
+                  req_bkt->type->name);
+        return APR_ENOTIMPL;
+    }
+
+    serf__bucket_request_read(req_bkt, &body, &uri, &method,
+                              &content_length);
+    hdrs = serf_bucket_request_get_headers(req_bkt);
+
+    authority = serf_bucket_headers_get(hdrs, "Host");
+    if (!authority)
+        authority = conn->host_info.hostinfo;
+    scheme = conn->host_info.scheme ? conn->host_info.scheme : "http";
+
+    /* Requests to a proxy use an absolute uri. */
+    path = uri;
+    if (uri[0] != '/' && strcmp(uri, "*") != 0) {
+        apr_uri_t parsed;
+
+        if (apr_uri_parse(request->respool, uri, &parsed) == APR_SUCCESS) {
+            path = apr_uri_unparse(request->respool, &parsed,
+                                   APR_URI_UNP_OMITSITEPART);
+            if (parsed.hostinfo)
+                authority = parsed.hostinfo;
+        }
+    }
+
+    if (content_length >= 0) {
+        char buf[30];
+
+        sprintf(buf, "%" APR_INT64_T_FMT, content_length);
+        serf_bucket_headers_set(hdrs, "Content-Length", buf);
+
+        if (content_length == 0 && body) {
+            serf_bucket_destroy(body);
+            body = NULL;
+        }
+    }
+
+    serf__hpack_encode_request(&block, &block_len, method, scheme,
+                               authority, path, hdrs, conn->allocator);
+
+    /* The body was taken out, the rest of the request is in BLOCK. */
+    serf_bucket_destroy(req_bkt);
+    request->req_bkt = NULL;
+    request->writing_started = 1;
+
+    if (h2->free_streams) {
+        stream = h2->free_streams;
+        h2->free_streams = stream->next;
+    }
+    else {
+        stream = apr_palloc(h2->pool, sizeof(*stream));
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->h2 = h2;
+    stream->id = h2->next_stream_id;
+    stream->request = request;
+    stream->body = body;
+    stream->send_window = h2->initial_window;
+    stream->recv_window = STREAM_WINDOW_SIZE;
+    stream->local_closed = body == NULL;
+
+    if (body)
+        serf_bucket_set_config(body, conn->config);
+
+    h2->next_stream_id += 2;
+    if (h2->next_stream_id > MAX_STREAM_ID)
+        h2->goaway = 1;
+
+    /* Streams are kept in the order they were opened. */
+    {
+        http2_stream_t **last = &h2->streams;
+
+        while (*last)
+            last = &(*last)->next;
+        *last = stream;
+    }
+    h2->nr_of_streams++;
+
+    serf__connection_request_started(conn, request);
+    request->timings.written = request->timings.write_start;
+
+    /* Move the request to the written queue. */
+    conn->unwritten_reqs = request->next;
+    if (!conn->unwritten_reqs)
+        conn->unwritten_reqs_tail = NULL;
+    conn->nr_of_unwritten_reqs--;
+    request->next = NULL;
+    if (conn->written_reqs_tail)
+        conn->written_reqs_tail->next = request;
+    else
+        conn->written_reqs = request;
+    conn->written_reqs_tail = request;
+    conn->nr_of_written_reqs++;
+    conn->completed_requests++;
+    serf__connection_request_written(conn);
+
+    if (request->first_byte_timeout)
+        serf__timer_schedule(&conn->ctx->timers, &request->first_byte_timer,
+                             apr_time_now() + request->first_byte_timeout);
+
+    /* The header block goes out in a HEADERS frame, followed by as many
+       CONTINUATION frames as needed; all of them, without anything in
+       between. */
+    if (block_len <= h2->max_frame_size) {
+        queue_frame(h2,
+                    serf_bucket_simple_own_create(block, block_len,
+                                                  conn->allocator),
+                    SERF_HTTP2_FRAME_TYPE_HEADERS,
+                    SERF_HTTP2_FLAG_END_HEADERS
+                    | (body ? 0 : SERF_HTTP2_FLAG_END_STREAM),
+                    stream->id);
+        return APR_SUCCESS;
+    }
+
+    for (offset = 0; offset < block_len; ) {
+        apr_size_t len = block_len - offset;
+        unsigned char flags = 0;
+
+        if (len > h2->max_frame_size)
+            len = h2->max_frame_size;
+        else
+            flags |= SERF_HTTP2_FLAG_END_HEADERS;
+
+        if (offset == 0 && !body)
+            flags |= SERF_HTTP2_FLAG_END_STREAM;
+
+        queue_control_frame(h2, offset ? SERF_HTTP2_FRAME_TYPE_CONTINUATION
+                                       : SERF_HTTP2_FRAME_TYPE_HEADERS,
+                            flags, stream->id, block + offset, len);
+        offset += len;
+    }
+    serf_bucket_mem_free(conn->allocator, block);
+
+    return APR_SUCCESS;
+}
+
+/* Queue one DATA frame of the body of STREAM, as far as the flow control
+   windows allow. Sets *SENT to the size of the payload, or to -1 if
+   nothing was queued. */
+static apr_status_t queue_data_frame(serf__http2_t *h2,
+                                     http2_stream_t *stream,
+                                     apr_ssize_t *sent)
+{
+    serf_connection_t *conn = h2->conn;
+    apr_size_t max = h2->max_frame_size;
+    apr_size_t len = 0;
+    apr_status_t status;
+    char *buf;
+    int eof;
+
+    /* Keep the frames small enough to interleave the streams. */
+    if (max > DEFAULT_MAX_FRAME_SIZE)
+        max = DEFAULT_MAX_FRAME_SIZE;
+    if (stream->send_window < (apr_int64_t)max)
+        max = (apr_size_t)stream->send_window;
+    if (h2->send_window < (apr_int64_t)max)
+        max = (apr_size_t)h2->send_window;
+
+    *sent = -1;
+
+    buf = serf_bucket_mem_alloc(conn->allocator, max ? max : 1);
+
+    do {
+        const char *data;
+        apr_size_t data_len;
+
+        status = serf_bucket_read(stream->body, max - len, &data, &data_len);
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            serf_bucket_mem_free(conn->allocator, buf);
+            return status;
+        }
+
+        memcpy(buf + len, data, data_len);
+        len += data_len;
+    } while (!status && len < max);
+
+    eof = APR_STATUS_IS_EOF(status);
+    if (!len && !eof) {
+        serf_bucket_mem_free(conn->allocator, buf);
+        return APR_SUCCESS;
+    }
+
+    if (eof) {
+        serf_bucket_destroy(stream->body);
+        stream->body = NULL;
+        stream->local_closed = 1;
+    }
+
+    if (len) {
+        queue_frame(h2, serf_bucket_simple_own_create(buf, len,
+                                                      conn->allocator),
+                    SERF_HTTP2_FRAME_TYPE_DATA,
+                    eof ? SERF_HTTP2_FLAG_END_STREAM : 0, stream->id);
+    }
+    else {
+        serf_bucket_mem_free(conn->allocator, buf);
+        queue_frame(h2, NULL, SERF_HTTP2_FRAME_TYPE_DATA,
+                    SERF_HTTP2_FLAG_END_STREAM, stream->id);
+    }
+
+    stream->send_window -= len;
+    h2->send_window -= len;
+    *sent = len;
+
+    return APR_SUCCESS;
+}
+
+/* Queue DATA frames for the streams with a body, one frame per stream at
+   a time so the bodies share the connection fairly. */
+static apr_status_t queue_data(serf__http2_t *h2, int *queued)
+{
+    apr_size_t total = 0;
+    int progress = 1;
+
+    while (progress && total < MAX_QUEUED_DATA) {
+        http2_stream_t *stream;
+
+        progress = 0;
+
+        for (stream = h2->streams; stream; stream = stream->next) {
+            apr_ssize_t sent;
+            apr_status_t status;
+
+            if (!stream->body || stream->send_window <= 0)
+                continue;
+            /* An empty DATA frame can still end the stream. */
+            if (h2->send_window <= 0
+                && serf_bucket_get_remaining(stream->body) != 0)
+                continue;
+
+            status = queue_data_frame(h2, stream, &sent);
+            if (status)
+                return status;
+
+            if (sent >= 0) {
+                total += sent;
+                progress = *queued = 1;
+            }
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Give the consumed part of the receive windows back to the server, once
+   it's worth a frame. */
+static void update_windows(serf__http2_t *h2)
+{
+    http2_stream_t *stream;
+
+    for (stream = h2->streams; stream; stream = stream->next) {
+        if (!stream->remote_closed
+            && stream->unacked >= STREAM_WINDOW_SIZE / 2) {
+            queue_window_update(h2, stream->id,
+                                (apr_uint32_t)stream->unacked);
+            stream->recv_window += stream->unacked;
+            stream->unacked = 0;
+        }
+    }
+
+    if (h2->unacked >= CONNECTION_WINDOW_SIZE / 2) {
+        queue_window_update(h2, 0, (apr_uint32_t)h2->unacked);
+        h2->recv_window += h2->unacked;
+        h2->unacked = 0;
+    }
+}
+
+
+/*** Reading responses ***/
+
+/* Pass what arrived on STREAM to the response handler of its request. */
+static apr_status_t deliver_response(serf__http2_t *h2,
+                                     http2_stream_t *stream,
+                                     apr_pool_t *pool)
+{
+    serf_connection_t *conn = h2->conn;
+    serf_request_t *request = stream->request;
+    apr_status_t status;
+
+    if (!stream->data)
+        stream->data = stream_data_create(stream);
+
+    if (!request->resp_bkt) {
+        request->resp_bkt = (*request->acceptor)(request, stream->data,
+                                                 request->acceptor_baton,
+                                                 pool);
+        apr_pool_clear(pool);
+
+        serf__timer_cancel(&conn->ctx->timers, &request->first_byte_timer);
+        request->timings.first_byte = apr_time_now();
+
+        if (request->resume_offset
+            && SERF_BUCKET_IS_RESPONSE(request->resp_bkt))
+            serf__bucket_response_set_resume(request->resp_bkt,
+                                             request->resume_offset,
+                                             request->resume_validator);
+
+        /* Share the configuration with the response bucket(s) */
+        serf_bucket_set_config(request->resp_bkt, conn->config);
+    }
+
+    do {
+        status = serf__handle_response(request, pool);
+    } while (status == APR_SUCCESS);
+
+    if (APR_STATUS_IS_EAGAIN(status))
+        return APR_SUCCESS;
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+
+    /* The response is complete. Tell the server if we stopped reading
+       before it was done. */
+    unlink_written_request(conn, request);
+    free_stream(h2, stream, 1);
+    serf__connection_request_completed(conn, request);
+    serf__destroy_request(request);
+
+    conn->completed_responses++;
+
+    return APR_SUCCESS;
+}
+
+typedef struct response_head_t {
+    char *buf;
+    apr_size_t len;
+    apr_size_t size;
+    apr_pool_t *pool;
+
+    /* The :status, 0 until seen. */
+    int status;
+    int seen_header;
+} response_head_t;
+
+static void head_append(response_head_t *head, const char *data,
+                        apr_size_t len)
+{
+    if (head->len + len > head->size) {
+        apr_size_t size = head->size ? head->size * 2 : 256;
+        char *buf;
+
+        while (size < head->len + len)
+            size *= 2;
+
+        buf = apr_palloc(head->pool, size);
+        if (head->len)
+            memcpy(buf, head->buf, head->len);
+        head->buf = buf;
+        head->size = size;
+    }
+
+    memcpy(head->buf + head->len, data, len);
+    head->len += len;
+}
+
+/* Rewrite the decoded response headers as HTTP/1.1, starting with the
+   status line from the :status pseudo header. */
+static apr_status_t collect_response_header(void *baton,
+                                            const char *name,
+                                            apr_size_t name_len,
+                                            const char *value,
+                                            apr_size_t value_len)
+{
+    response_head_t *head = baton;
+
+    if (name_len && name[0] == ':') {
+        if (head->seen_header || head->status
+            || name_len != 7 || memcmp(name, ":status", 7) != 0
+            || value_len != 3 || !apr_isdigit(value[0])
+            || !apr_isdigit(value[1]) || !apr_isdigit(value[2]))
+            return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+        head->status = (value[0] - '0') * 100 + (value[1] - '0') * 10
+                       + (value[2] - '0');
+
+        head_append(head, "HTTP/1.1 ", 9);
+        head_append(head, value, value_len);
+        head_append(head, "\r\n", 2);
+
+        return APR_SUCCESS;
+    }
+
+    if (!head->status)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    head->seen_header = 1;
+    head_append(head, name, name_len);
+    head_append(head, ": ", 2);
+    head_append(head, value, value_len);
+    head_append(head, "\r\n", 2);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t ignore_header(void *baton,
+                                  const char *name, apr_size_t name_len,
+                                  const char *value, apr_size_t value_len)
+{
+    return APR_SUCCESS;
+}
+
+static apr_status_t header_block_done(serf__http2_t *h2, apr_pool_t *pool)
+{
+    http2_stream_t *stream = find_stream(h2, h2->headers_stream);
+    response_head_t head = { 0 };
+    apr_status_t status;
+
+    h2->headers_stream = 0;
+
+    /* Blocks we don't need, like trailers, must still be decoded to keep
+       the decoder in sync with the server. */
+    if (!stream || stream->headers_received) {
+        status = serf__hpack_decode(h2->hpack, h2->headers, h2->headers_len,
+                                    ignore_header, NULL, pool);
+        if (status)
+            return status;
+    }
+    else {
+        head.pool = pool;
+        status = serf__hpack_decode(h2->hpack, h2->headers, h2->headers_len,
+                                    collect_response_header, &head, pool);
+        if (status)
+            return status;
+        if (!head.status)
+            return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+        /* Interim responses aren't passed on. */
+        if (head.status >= 200) {
+            head_append(&head, "\r\n", 2);
+
+            stream->headers_received = 1;
+            stream->data = stream_data_create(stream);
+            stream_data_append(stream->data, head.buf, head.len, 0);
+        }
+    }
+
+    if (!stream)
+        return APR_SUCCESS;
+
+    if (h2->headers_end_stream) {
+        if (!stream->headers_received)
+            return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+        stream->remote_closed = 1;
+        stream_data_end(stream->data, APR_EOF);
+    }
+
+    if (!stream->headers_received)
+        return APR_SUCCESS;
+
+    return deliver_response(h2, stream, pool);
+}
+
+static apr_status_t strip_padding(const char **data, apr_size_t *len,
+                                  unsigned char flags)
+{
+    apr_size_t pad;
+
+    if (!(flags & SERF_HTTP2_FLAG_PADDED))
+        return APR_SUCCESS;
+
+    if (*len < 1)
+        return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+
+    pad = (unsigned char)**data;
+    (*data)++;
+    (*len)--;
+
+    if (pad > *len)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    *len -= pad;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t append_header_block(serf__http2_t *h2,
+                                        const char *data, apr_size_t len)
+{
+    if (h2->headers_len + len > MAX_HEADER_BLOCK_SIZE)
+        return SERF_ERROR_RESPONSE_HEADER_TOO_LONG;
+
+    if (h2->headers_len + len > h2->headers_size) {
+        apr_size_t size = h2->headers_size ? h2->headers_size * 2 : 1024;
+        char *buf;
+
+        while (size < h2->headers_len + len)
+            size *= 2;
+
+        buf = apr_palloc(h2->pool, size);
+        memcpy(buf, h2->headers, h2->headers_len);
+        h2->headers = buf;
+        h2->headers_size = size;
+    }
+
+    memcpy(h2->headers + h2->headers_len, data, len);
+    h2->headers_len += len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t process_headers(serf__http2_t *h2, apr_uint32_t id,
+                                    unsigned char flags, apr_pool_t *pool)
+{
+    const char *data = h2->payload;
+    apr_size_t len = h2->payload_len;
+    apr_status_t status;
+
+    /* The server can't open streams, push is disabled. */
+    if (id == 0 || (id >= h2->next_stream_id && !find_stream(h2, id)))
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    status = strip_padding(&data, &len, flags);
+    if (status)
+        return status;
+
+    /* We don't use the priority information. */
+    if (flags & SERF_HTTP2_FLAG_PRIORITY) {
+        if (len < 5)
+            return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+        data += 5;
+        len -= 5;
+    }
+
+    h2->headers_stream = id;
+    h2->headers_end_stream = (flags & SERF_HTTP2_FLAG_END_STREAM) != 0;
+    h2->headers_len = 0;
+
+    status = append_header_block(h2, data, len);
+    if (status)
+        return status;
+
+    if (flags & SERF_HTTP2_FLAG_END_HEADERS)
+        return header_block_done(h2, pool);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t process_continuation(serf__http2_t *h2, apr_uint32_t id,
+                                         unsigned char flags,
+                                         apr_pool_t *pool)
+{
+    apr_status_t status;
+
+    if (!h2->headers_stream || id != h2->headers_stream)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    status = append_header_block(h2, h2->payload, h2->payload_len);
+    if (status)
+        return status;
+
+    if (flags & SERF_HTTP2_FLAG_END_HEADERS)
+        return header_block_done(h2, pool);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t process_data(serf__http2_t *h2, apr_uint32_t id,
+                                 unsigned char flags, apr_pool_t *pool)
+{
+    const char *data = h2->payload;
+    apr_size_t len = h2->payload_len;
+    http2_stream_t *stream;
+    apr_status_t status;
+
+    if (id == 0)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    /* The whole frame, padding included, counts for flow control. */
+    h2->recv_window -= h2->payload_len;
+    if (h2->recv_window < 0)
+        return SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR;
+
+    stream = find_stream(h2, id);
+    if (!stream || stream->remote_closed) {
+        if (id >= h2->next_stream_id)
+            return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+        /* Data for a stream we already closed: drop it. */
+        h2->unacked += h2->payload_len;
+        return APR_SUCCESS;
+    }
+
+    if (!stream->headers_received)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    stream->recv_window -= h2->payload_len;
+    if (stream->recv_window < 0)
+        return SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR;
+
+    status = strip_padding(&data, &len, flags);
+    if (status)
+        return status;
+
+    /* Padding is consumed right away. */
+    stream->unacked += h2->payload_len - len;
+    h2->unacked += h2->payload_len - len;
+
+    if (!stream->data) {
+        /* The response was destroyed already; the application didn't want
+           the rest. */
+        h2->unacked += len;
+    }
+    else if (len) {
+        stream_data_append(stream->data, data, len, 1);
+    }
+
+    if (flags & SERF_HTTP2_FLAG_END_STREAM) {
+        stream->remote_closed = 1;
+        if (stream->data)
+            stream_data_end(stream->data, APR_EOF);
+    }
+
+    return deliver_response(h2, stream, pool);
+}
+
+static apr_status_t process_rst_stream(serf__http2_t *h2, apr_uint32_t id,
+                                       apr_pool_t *pool)
+{
+    serf_connection_t *conn = h2->conn;
+    http2_stream_t *stream;
+    apr_uint32_t error_code;
+
+    if (h2->payload_len != 4)
+        return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+    if (id == 0 || id >= h2->next_stream_id)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    stream = find_stream(h2, id);
+    if (!stream)
+        return APR_SUCCESS;
+
+    error_code = get_uint32(h2->payload);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "stream %u reset by server, error code %u\n", id, error_code);
+
+    /* A refused stream wasn't processed at all, so it can be retried. */
+    if (error_code == H2_REFUSED_STREAM && !stream->headers_received) {
+        requeue_stream(h2, stream);
+        return APR_SUCCESS;
+    }
+
+    stream->local_closed = stream->remote_closed = 1;
+    if (stream->body) {
+        serf_bucket_destroy(stream->body);
+        stream->body = NULL;
+    }
+
+    if (!stream->data)
+        stream->data = stream_data_create(stream);
+    stream_data_end(stream->data, error_code == H2_NO_ERROR
+                                      ? APR_EOF
+                                      : SERF_ERROR_HTTP2_STREAM_RESET);
+
+    return deliver_response(h2, stream, pool);
+}
+
+static apr_status_t process_settings(serf__http2_t *h2, apr_uint32_t id,
+                                     unsigned char flags)
+{
+    apr_size_t i;
+
+    if (id != 0)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    if (flags & SERF_HTTP2_FLAG_ACK)
+        return h2->payload_len ? SERF_ERROR_HTTP2_FRAME_SIZE_ERROR
+                               : APR_SUCCESS;
+
+    if (h2->payload_len % 6)
+        return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+
+    for (i = 0; i < h2->payload_len; i += 6) {
+        const unsigned char *setting;
+        apr_uint32_t value;
+
+        setting = (const unsigned char *)h2->payload + i;
+        value = get_uint32(h2->payload + i + 2);
+
+        switch ((setting[0] << 8) | setting[1]) {
+          case SETTINGS_MAX_CONCURRENT_STREAMS:
+            h2->max_concurrent = value;
+            break;
+          case SETTINGS_INITIAL_WINDOW_SIZE:
+            {
+                http2_stream_t *stream;
+                apr_int64_t delta;
+
+                if (value > MAX_WINDOW_SIZE)
+                    return SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR;
+
+                /* Applies to the streams already open too, none of whose
+                   windows may grow beyond the maximum. */
+                delta = (apr_int64_t)value - h2->initial_window;
+                for (stream = h2->streams; stream; stream = stream->next) {
+                    if (stream->send_window + delta > MAX_WINDOW_SIZE)
+                        return SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR;
+                }
+                for (stream = h2->streams; stream; stream = stream->next)
+                    stream->send_window += delta;
+                h2->initial_window = value;
+            }
+            break;
+          case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_MAX_FRAME_SIZE || value > 0xffffff)
+                return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+            h2->max_frame_size = value;
+            break;
+          default:
+            /* Our encoder doesn't use the dynamic table, so the table size
+               doesn't matter; other settings are ignored as required. */
+            break;
+        }
+    }
+
+    queue_control_frame(h2, SERF_HTTP2_FRAME_TYPE_SETTINGS,
+                        SERF_HTTP2_FLAG_ACK, 0, NULL, 0);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t process_goaway(serf__http2_t *h2, apr_uint32_t id)
+{
+    serf_connection_t *conn = h2->conn;
+    http2_stream_t *stream, *next;
+    apr_uint32_t last_stream_id;
+
+    if (id != 0)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+    if (h2->payload_len < 8)
+        return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+
+    last_stream_id = get_uint32(h2->payload) & MAX_STREAM_ID;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "server going away after stream %u, error code %u\n",
+              last_stream_id, get_uint32(h2->payload + 4));
+
+    h2->goaway = 1;
+
+    /* The server didn't and won't process the later streams. */
+    for (stream = h2->streams; stream; stream = next) {
+        next = stream->next;
+        if (stream->id > last_stream_id)
+            requeue_stream(h2, stream);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t process_window_update(serf__http2_t *h2,
+                                          apr_uint32_t id)
+{
+    apr_uint32_t increment;
+
+    if (h2->payload_len != 4)
+        return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+
+    increment = get_uint32(h2->payload) & MAX_WINDOW_SIZE;
+    if (!increment)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    if (id == 0) {
+        h2->send_window += increment;
+        if (h2->send_window > MAX_WINDOW_SIZE)
+            return SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR;
+    }
+    else {
+        http2_stream_t *stream = find_stream(h2, id);
+
+        if (!stream)
+            return APR_SUCCESS;
+
+        stream->send_window += increment;
+        if (stream->send_window > MAX_WINDOW_SIZE)
+            return SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR;
+    }
+
+    /* We might be able to send some more now. */
+    serf__conn_set_dirty(h2->conn);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t process_frame(serf__http2_t *h2, apr_uint32_t id,
+                                  unsigned char frame_type,
+                                  unsigned char flags, apr_pool_t *pool)
+{
+    /* A header block can't be interrupted by other frames. */
+    if (h2->headers_stream
+        && frame_type != SERF_HTTP2_FRAME_TYPE_CONTINUATION)
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+
+    switch (frame_type) {
+      case SERF_HTTP2_FRAME_TYPE_DATA:
+        return process_data(h2, id, flags, pool);
+      case SERF_HTTP2_FRAME_TYPE_HEADERS:
+        return process_headers(h2, id, flags, pool);
+      case SERF_HTTP2_FRAME_TYPE_CONTINUATION:
+        return process_continuation(h2, id, flags, pool);
+      case SERF_HTTP2_FRAME_TYPE_PRIORITY:
+        return h2->payload_len == 5 ? APR_SUCCESS
+                                    : SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+      case SERF_HTTP2_FRAME_TYPE_RST_STREAM:
+        return process_rst_stream(h2, id, pool);
+      case SERF_HTTP2_FRAME_TYPE_SETTINGS:
+        return process_settings(h2, id, flags);
+      case SERF_HTTP2_FRAME_TYPE_PUSH_PROMISE:
+        /* We disabled push in our SETTINGS. */
+        return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+      case SERF_HTTP2_FRAME_TYPE_PING:
+        if (id != 0)
+            return SERF_ERROR_HTTP2_PROTOCOL_ERROR;
+        if (h2->payload_len != 8)
+            return SERF_ERROR_HTTP2_FRAME_SIZE_ERROR;
+        if (!(flags & SERF_HTTP2_FLAG_ACK))
+            queue_control_frame(h2, SERF_HTTP2_FRAME_TYPE_PING,
+                                SERF_HTTP2_FLAG_ACK, 0,
+                                h2->payload, h2->payload_len);
+        return APR_SUCCESS;
+      case SERF_HTTP2_FRAME_TYPE_GOAWAY:
+        return process_goaway(h2, id);
+      case SERF_HTTP2_FRAME_TYPE_WINDOW_UPDATE:
+        return process_window_update(h2, id);
+      default:
+        /* Unknown frame types must be ignored. */
+        return APR_SUCCESS;
+    }
+}
+
+/* Read the payload of the current frame into h2->payload. */
+static apr_status_t read_payload(serf__http2_t *h2)
+{
+    while (1) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_read(h2->frame,
+                                  DEFAULT_MAX_FRAME_SIZE - h2->payload_len,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+
+        memcpy(h2->payload + h2->payload_len, data, len);
+        h2->payload_len += len;
+
+        if (APR_STATUS_IS_EOF(status))
+            return APR_SUCCESS;
+        if (status)
+            return status;
+    }
+}
+
+static apr_uint32_t error_code_for(apr_status_t status)
+{
+    switch (status) {
+      case SERF_ERROR_HTTP2_PROTOCOL_ERROR:
+        return H2_PROTOCOL_ERROR;
+      case SERF_ERROR_HTTP2_COMPRESSION_ERROR:
+        return H2_COMPRESSION_ERROR;
+      case SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR:
+        return H2_FLOW_CONTROL_ERROR;
+      case SERF_ERROR_HTTP2_FRAME_SIZE_ERROR:
+        return H2_FRAME_SIZE_ERROR;
+      default:
+        return H2_INTERNAL_ERROR;
+    }
+}
+
+
+/*** The interface with the connection ***/
+
+apr_status_t serf__http2_setup(serf_connection_t *conn)
+{
+    serf__http2_t *h2;
+    char settings[12];
+
+    h2 = apr_pcalloc(conn->skt_pool, sizeof(*h2));
+    h2->conn = conn;
+    h2->pool = conn->skt_pool;
+    h2->hpack = serf__hpack_table_create(DEFAULT_HEADER_TABLE_SIZE,
+                                         h2->pool);
+    h2->next_stream_id = 1;
+    h2->max_concurrent = DEFAULT_MAX_CONCURRENT;
+    h2->initial_window = DEFAULT_WINDOW_SIZE;
+    h2->max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+    h2->send_window = DEFAULT_WINDOW_SIZE;
+    h2->recv_window = CONNECTION_WINDOW_SIZE;
+    h2->payload = apr_palloc(h2->pool, DEFAULT_MAX_FRAME_SIZE);
+
+    conn->http2 = h2;
+
+    /* The connection preface: the magic string and our SETTINGS. Servers
+       don't push to us, and streams get a larger window than the
+       default. */
+    serf_bucket_aggregate_append(conn->ostream_tail,
+                                 serf_bucket_simple_create(HTTP2_PREFACE,
+                                                           HTTP2_PREFACE_LEN,
+                                                           NULL, NULL,
+                                                           conn->allocator));
+
+    settings[0] = 0;
+    settings[1] = SETTINGS_ENABLE_PUSH;
+    put_uint32(settings + 2, 0);
+    settings[6] = 0;
+    settings[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put_uint32(settings + 8, STREAM_WINDOW_SIZE);
+    queue_control_frame(h2, SERF_HTTP2_FRAME_TYPE_SETTINGS, 0, 0,
+                        settings, sizeof(settings));
+
+    queue_window_update(h2, 0, CONNECTION_WINDOW_SIZE - DEFAULT_WINDOW_SIZE);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "using HTTP/2 on conn 0x%x\n", conn);
+
+    return APR_SUCCESS;
+}
+
+void serf__http2_teardown(serf_connection_t *conn)
+{
+    serf__http2_t *h2 = conn->http2;
+
+    if (!h2)
+        return;
+
+    /* The requests themselves stay with the connection, which cancels or
+       requeues them. */
+    while (h2->streams)
+        free_stream(h2, h2->streams, 0);
+
+    if (h2->frame) {
+        serf_bucket_destroy(h2->frame);
+        h2->frame = NULL;
+    }
+
+    conn->http2 = NULL;
+}
+
+void serf__http2_request_destroyed(serf_connection_t *conn,
+                                   serf_request_t *request)
+{
+    serf__http2_t *h2 = conn->http2;
+    http2_stream_t *stream;
+
+    for (stream = h2->streams; stream; stream = stream->next) {
+        if (stream->request == request) {
+            free_stream(h2, stream, 1);
+            return;
+        }
+    }
+}
+
+int serf__http2_wants_write(serf_connection_t *conn)
+{
+    serf__http2_t *h2 = conn->http2;
+    http2_stream_t *stream;
+
+    if (conn->pending.vec_len || conn->pending.sendfile_len)
+        return 1;
+
+    if (conn->unwritten_reqs
+        && (h2->goaway || h2->nr_of_streams < h2->max_concurrent))
+        return 1;
+
+    for (stream = h2->streams; stream; stream = stream->next) {
+        if (stream->body && stream->send_window > 0 && h2->send_window > 0)
+            return 1;
+    }
+
+    if (conn->ostream_head) {
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_peek(conn->ostream_head, &data, &len);
+        if (!SERF_BUCKET_READ_ERROR(status) && len)
+            return 1;
+    }
+
+    return 0;
+}
+
+apr_status_t serf__http2_write(serf_connection_t *conn)
+{
+    serf__http2_t *h2 = conn->http2;
+
+    while (1) {
+        int queued = 0;
+        apr_status_t status;
+
+        status = serf__connection_flush(conn);
+        if (APR_STATUS_IS_EAGAIN(status))
+            return APR_SUCCESS;
+        if (status)
+            return status;
+
+        /* Requests that can't be sent here go to a new connection. */
+        if (h2->goaway && !h2->nr_of_streams && conn->unwritten_reqs)
+            return SERF_ERROR_CLOSING;
+
+        while (conn->unwritten_reqs && !h2->goaway
+               && h2->nr_of_streams < h2->max_concurrent) {
+            serf_request_t *request = conn->unwritten_reqs;
+
+            if (!request->req_bkt) {
+                status = serf__setup_request(request);
+                if (status)
+                    return status;
+            }
+
+            status = open_stream(h2, request);
+            if (status)
+                return status;
+
+            queued = 1;
+        }
+
+        status = queue_data(h2, &queued);
+        if (status)
+            return status;
+
+        if (!queued) {
+            /* Nothing left to write, stop polling for it. */
+            serf__conn_set_dirty(conn);
+            return APR_SUCCESS;
+        }
+    }
+}
+
+apr_status_t serf__http2_read(serf_connection_t *conn)
+{
+    serf__http2_t *h2 = conn->http2;
+    apr_pool_t *tmppool;
+    apr_status_t status;
+
+    /* If the stop_writing flag was set on the connection, reset it now
+       because there is some data to read. */
+    serf__conn_continue_writing(conn);
+
+    if ((status = apr_pool_create(&tmppool, conn->pool)) != APR_SUCCESS)
+        return status;
+
+    while (1) {
+        apr_uint32_t stream_id;
+        unsigned char frame_type, flags;
+
+        /* A handler paused reading, see serf_request_pause_reading(). */
+        if (conn->read_paused) {
+            status = APR_EAGAIN;
+            break;
+        }
+
+        if (!h2->frame) {
+            h2->frame = serf_bucket_http2_unframe_create(
+                            conn->stream, DEFAULT_MAX_FRAME_SIZE,
+                            conn->allocator);
+            h2->payload_len = 0;
+        }
+
+        status = serf_bucket_http2_unframe_read_info(h2->frame, &stream_id,
+                                                     &frame_type, &flags);
+        if (!status)
+            status = read_payload(h2);
+        if (status)
+            break;
+
+        serf_bucket_destroy(h2->frame);
+        h2->frame = NULL;
+
+        apr_pool_clear(tmppool);
+        status = process_frame(h2, stream_id, frame_type, flags, tmppool);
+        if (status)
+            break;
+    }
+
+    if (APR_STATUS_IS_EAGAIN(status)) {
+        status = APR_SUCCESS;
+
+        update_windows(h2);
+
+        /* All done on this connection, open a new one for what's left. */
+        if (h2->goaway && !h2->nr_of_streams)
+            status = SERF_ERROR_CLOSING;
+    }
+    else if (APR_STATUS_IS_EOF(status)
+             || APR_STATUS_IS_ECONNRESET(status)
+             || APR_STATUS_IS_ECONNABORTED(status)
+             || status == SERF_ERROR_TRUNCATED_HTTP_RESPONSE) {
+        /* The server closed the connection. If it had ever been good, be
+           optimistic and try again. */
+        if (conn->completed_responses || h2->goaway)
+            status = SERF_ERROR_CLOSING;
+        else
+            status = SERF_ERROR_ABORTED_CONNECTION;
+    }
+    else if (status >= SERF_ERROR_HTTP2_PROTOCOL_ERROR
+             && status <= SERF_ERROR_HTTP2_FRAME_SIZE_ERROR) {
+        serf__log(LOGLVL_ERROR, LOGCOMP_CONN, __FILE__, conn->config,
+                  "HTTP/2 connection error %d on conn 0x%x\n",
+                  status, conn);
+
+        /* Let the server know, as far as that's possible. */
+        queue_goaway(h2, error_code_for(status));
+        (void) serf__connection_flush(conn);
+    }
+
+    apr_pool_destroy(tmppool);
+
+    return status;
+}
@@ -15,6 +15,8 @@
 
 #include <apr_pools.h>
 #include <apr_poll.h>
+#include <apr_portable.h>
+#include <apr_strings.h>
 #include <apr_version.h>
 
 #include "serf.h"
@@ -22,67 +24,487 @@
 
 #include "serf_private.h"
 
+/* The pool userdata that marks the pool of an accept callback. */
+#define LISTENER_KEY "serf:listener"
+
+/* The connections the kernel queues for us before refusing more; room for
+   a burst of them between two runs of the event loop. */
+#ifdef SOMAXCONN
+#define LISTEN_BACKLOG SOMAXCONN
+#else
+#define LISTEN_BACKLOG 511
+#endif
+
+/* Update the events the socket of CLIENT is polled for. */
+static apr_status_t update_pollset(serf_incoming_t *client)
+{
+    serf_context_t *ctx = client->ctx;
+    apr_int16_t reqevents = APR_POLLHUP | APR_POLLERR;
+    serf_incoming_request_t *req;
+    apr_status_t status;
+
+    if (!client->stop_reading || client->reading)
+        reqevents |= APR_POLLIN;
+
+    for (req = client->requests; req && req->written; req = req->next)
+        ;
+    if (client->pending.vec_len || client->pending.sendfile_len
+        || (req && req->resp_bkt))
+        reqevents |= APR_POLLOUT;
+
+    if (reqevents == client->desc.reqevents)
+        return APR_SUCCESS;
+
+    status = ctx->pollset_rm(ctx->pollset_baton, &client->desc,
+                             &client->baton);
+    if (status && !APR_STATUS_IS_NOTFOUND(status))
+        return status;
+
+    client->desc.reqevents = reqevents;
+
+    return ctx->pollset_add(ctx->pollset_baton, &client->desc,
+                            &client->baton);
+}
+
+static serf_incoming_request_t *create_request(serf_incoming_t *client)
+{
+    serf_incoming_request_t *req;
+    apr_pool_t *pool;
+    serf_bucket_t *stream;
+
+    apr_pool_create(&pool, client->pool);
+
+    req = apr_pcalloc(pool, sizeof(*req));
+    req->incoming = client;
+    req->pool = pool;
+
+    /* The stream outlives the request, it holds the requests after it. */
+    stream = serf_bucket_barrier_create(client->stream, client->allocator);
+    req->req_bkt = serf_bucket_incoming_request_create(stream,
+                                                       client->allocator);
+    serf_bucket_set_config(req->req_bkt, client->config);
+
+    return req;
+}
+
+static void destroy_request(serf_incoming_request_t *req)
+{
+    if (req->req_bkt)
+        serf_bucket_destroy(req->req_bkt);
+    if (req->resp_bkt)
+        serf_bucket_destroy(req->resp_bkt);
+
+    apr_pool_destroy(req->pool);
+}
+
+/* Destroy the requests at the head of the queue that were read and
+   answered. Those are done in order, so they are all at the head. */
+static void prune_requests(serf_incoming_t *client)
+{
+    while (client->requests && client->requests->read_done
+           && client->requests->written) {
+        serf_incoming_request_t *req = client->requests;
+
+        client->requests = req->next;
+        if (!client->requests)
+            client->requests_tail = NULL;
+
+        destroy_request(req);
+    }
+}
+
+/* Returns 1 if the comma separated header value VALUE holds TOKEN. */
+static int has_token(const char *value, const char *token)
+{
+    apr_size_t len = strlen(token);
+
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+
+        if (strncasecmp(value, token, len) == 0
+            && (value[len] == '\0' || value[len] == ','
+                || value[len] == ' ' || value[len] == '\t'))
+            return 1;
+
+        value = strchr(value, ',');
+    }
+
+    return 0;
+}
+
+/* The request line and the headers of REQ were read: queue it for its
+   response, and hand it to the application. */
+static apr_status_t request_headers_read(serf_incoming_request_t *req)
+{
+    serf_incoming_t *client = req->incoming;
+    serf_request_line rl;
+    const char *v;
+
+    req->headers_read = 1;
+
+    serf_bucket_incoming_request_line(req->req_bkt, &rl);
+    v = serf_bucket_headers_get(
+            serf_bucket_incoming_request_get_headers(req->req_bkt),
+            "Connection");
+
+    /* HTTP/1.0 keepalive needs the client to know the length of every
+       response, which we don't promise. */
+    if (rl.version < SERF_HTTP_11 || has_token(v, "close"))
+        req->close_after = 1;
+
+    if (client->requests_tail)
+        client->requests_tail->next = req;
+    else
+        client->requests = req;
+    client->requests_tail = req;
+
+    return client->request(client->ctx, req, client->request_baton,
+                           req->pool);
+}
+
+/* Read the body of a request nobody wants to read. */
+static apr_status_t discard_body(serf_bucket_t *bkt)
+{
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+    } while (!status);
+
+    return status;
+}
+
+/* Read the requests on CLIENT, as far as there is data. */
 static apr_status_t read_from_client(serf_incoming_t *client)
 {
-    return APR_ENOTIMPL;
+    while (1) {
+        serf_incoming_request_t *req = client->reading;
+        apr_status_t status;
+
+        if (!req) {
+            if (client->stop_reading)
+                return APR_SUCCESS;
+
+            req = client->reading = create_request(client);
+        }
+
+        if (!req->headers_read) {
+            status = serf_bucket_incoming_request_wait_for_headers(
+                         req->req_bkt);
+            if (APR_STATUS_IS_EOF(status)) {
+                /* The client closed the connection between requests, it
+                   still reads the responses to the earlier ones. */
+                client->reading = NULL;
+                client->stop_reading = 1;
+                destroy_request(req);
+                return APR_SUCCESS;
+            }
+            if (APR_STATUS_IS_EAGAIN(status))
+                return APR_SUCCESS;
+            if (status)
+                return status;
+
+            status = request_headers_read(req);
+            if (status)
+                return status;
+        }
+
+        if (req->handler)
+            status = req->handler(req, req->req_bkt, req->handler_baton,
+                                  req->pool);
+        else
+            status = discard_body(req->req_bkt);
+
+        if (APR_STATUS_IS_EOF(status)) {
+            /* On to the next request, which may be pipelined behind this
+               one. */
+            req->read_done = 1;
+            client->reading = NULL;
+            if (req->close_after)
+                client->stop_reading = 1;
+
+            prune_requests(client);
+            continue;
+        }
+        if (APR_STATUS_IS_EAGAIN(status))
+            return APR_SUCCESS;
+
+        return status;
+    }
+}
+
+/* Write the pending data of CLIENT to its socket. */
+static apr_status_t socket_write(serf_incoming_t *client)
+{
+    apr_size_t written;
+    apr_status_t status;
+
+    status = serf__pending_write(&client->pending, client->skt, NULL, 0,
+                                 client->config, &written);
+    if (written)
+        serf__context_progress_delta(client->ctx, 0, written);
+
+    return status;
 }
 
+/* Write the responses on CLIENT, in the order of the requests, until the
+   socket is full or the next response isn't there yet. Returns
+   SERF_ERROR_CLOSING when the connection is to be closed now. */
 static apr_status_t write_to_client(serf_incoming_t *client)
 {
-    return APR_ENOTIMPL;
+    while (1) {
+        serf_incoming_request_t *req;
+        apr_status_t status, read_status;
+
+        while (client->pending.vec_len || client->pending.sendfile_len) {
+            status = socket_write(client);
+            if (APR_STATUS_IS_EAGAIN(status))
+                return APR_SUCCESS;
+            if (status)
+                return status;
+        }
+
+        for (req = client->requests; req && req->written; req = req->next)
+            ;
+
+        if (client->hit_eof) {
+            /* All of the response was written, so its buffers can go. */
+            client->hit_eof = 0;
+            serf_bucket_destroy(req->resp_bkt);
+            req->resp_bkt = NULL;
+            req->written = 1;
+
+            if (req->close_after)
+                return SERF_ERROR_CLOSING;
+
+            prune_requests(client);
+            continue;
+        }
+
+        if (!req || !req->resp_bkt)
+            return APR_SUCCESS;
+
+#if APR_HAS_SENDFILE
+        {
+            apr_hdtr_t hdtr;
+
+            /* A file bucket in the response hands out its file here, so
+               we can send it without copying it through memory. */
+            hdtr.headers = client->pending.vec;
+            hdtr.numheaders = IOV_MAX;
+            hdtr.trailers = NULL;
+            hdtr.numtrailers = 0;
+
+            read_status = serf_bucket_read_for_sendfile(
+                              req->resp_bkt, SERF_READ_ALL_AVAIL, &hdtr,
+                              &client->pending.sendfile_file,
+                              &client->pending.sendfile_offset,
+                              &client->pending.sendfile_len);
+            client->pending.vec_len = hdtr.numheaders;
+            if (client->pending.sendfile_file == NULL)
+                client->pending.sendfile_len = 0;
+        }
+#else
+        read_status = serf_bucket_read_iovec(req->resp_bkt,
+                                             SERF_READ_ALL_AVAIL,
+                                             IOV_MAX,
+                                             client->pending.vec,
+                                             &client->pending.vec_len);
+#endif
+
+        if (APR_STATUS_IS_EOF(read_status))
+            client->hit_eof = 1;
+        else if (APR_STATUS_IS_EAGAIN(read_status)) {
+            /* The response isn't complete yet. Look again when we can
+               write. */
+            if (!client->pending.vec_len && !client->pending.sendfile_len)
+                return APR_SUCCESS;
+        }
+        else if (read_status)
+            return read_status;
+    }
+}
+
+/* Hand the pool of a closed client back to the listener L, which keeps a
+   few around: a cleared pool keeps its memory for the next client, which
+   saves a burst of new connections from allocating all of theirs. Clearing
+   the pool closes the socket. */
+static void recycle_client_pool(serf_listener_t *l, apr_pool_t *pool)
+{
+    if (l->nr_of_spare_pools < MAX_SPARE_CLIENT_POOLS) {
+        apr_pool_clear(pool);
+        l->spare_pools[l->nr_of_spare_pools++] = pool;
+    }
+    else {
+        apr_pool_destroy(pool);
+    }
+}
+
+/* Close CLIENT, and free all of its memory. */
+static void close_client(serf_incoming_t *client, apr_status_t status)
+{
+    serf_context_t *ctx = client->ctx;
+
+    ctx->pollset_rm(ctx->pollset_baton, &client->desc, &client->baton);
+
+    /* The buckets may hold more than memory, like files. */
+    if (client->reading)
+        destroy_request(client->reading);
+    while (client->requests) {
+        serf_incoming_request_t *req = client->requests;
+
+        client->requests = req->next;
+        if (req != client->reading)
+            destroy_request(req);
+    }
+    serf_bucket_destroy(client->stream);
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, client->config,
+              "client connection closed with status %d\n", status);
+
+    if (client->closed)
+        client->closed(client, client->closed_baton, status, client->pool);
+
+    /* Let the client see the end of the last response before we close. */
+    if (!status)
+        apr_socket_shutdown(client->skt, APR_SHUTDOWN_WRITE);
+
+    if (client->listener)
+        recycle_client_pool(client->listener, client->pool);
+    else
+        apr_pool_destroy(client->pool);
 }
 
 apr_status_t serf__process_client(serf_incoming_t *client, apr_int16_t events)
 {
-    apr_status_t rv;
+    apr_status_t rv = APR_SUCCESS;
+
+    /* Errors on a client connection only end that connection, so they
+       aren't returned to the event loop of the server. */
     if ((events & APR_POLLIN) != 0) {
         rv = read_from_client(client);
-        if (rv) {
-            return rv;
-        }
     }
 
-    if ((events & APR_POLLHUP) != 0) {
-        return APR_ECONNRESET;
+    if (!rv && (events & APR_POLLHUP) != 0) {
+        rv = APR_ECONNRESET;
     }
 
-    if ((events & APR_POLLERR) != 0) {
-        return APR_EGENERAL;
+    if (!rv && (events & APR_POLLERR) != 0) {
+        rv = APR_EGENERAL;
     }
 
-    if ((events & APR_POLLOUT) != 0) {
+    if (!rv) {
         rv = write_to_client(client);
-        if (rv) {
-            return rv;
-        }
+    }
+
+    if (!rv && client->stop_reading && !client->reading) {
+        serf_incoming_request_t *req;
+
+        /* The client closed its side, and got all of its responses. */
+        for (req = client->requests; req && req->written; req = req->next)
+            ;
+        if (!req)
+            rv = SERF_ERROR_CLOSING;
+    }
+
+    if (!rv)
+        rv = update_pollset(client);
+
+    if (rv) {
+        close_client(client, rv == SERF_ERROR_CLOSING ? APR_SUCCESS : rv);
     }
 
     return APR_SUCCESS;
 }
 
-apr_status_t serf__process_listener(serf_listener_t *l)
+void serf_incoming_set_closed_cb(serf_incoming_t *client,
+                                 serf_incoming_closed_t closed,
+                                 void *closed_baton)
 {
-    apr_status_t rv;
-    apr_socket_t *in;
-    apr_pool_t *p;
-    /* THIS IS NOT OPTIMAL */
-    apr_pool_create(&p, l->pool);
+    client->closed = closed;
+    client->closed_baton = closed_baton;
+}
 
-    rv = apr_socket_accept(&in, l->skt, p);
+void serf_incoming_request_set_handler(serf_incoming_request_t *req,
+                                       serf_incoming_handler_t handler,
+                                       void *handler_baton)
+{
+    req->handler = handler;
+    req->handler_baton = handler_baton;
+}
 
-    if (rv) {
-        apr_pool_destroy(p);
-        return rv;
-    }
+serf_bucket_t *serf_incoming_request_get_bucket(serf_incoming_request_t *req)
+{
+    return req->req_bkt;
+}
 
-    rv = l->accept_func(l->ctx, l, l->accept_baton, in, p);
+serf_bucket_alloc_t *serf_incoming_request_get_alloc(
+    serf_incoming_request_t *req)
+{
+    return req->incoming->allocator;
+}
 
-    if (rv) {
-        apr_pool_destroy(p);
-        return rv;
+apr_status_t serf_incoming_request_respond(serf_incoming_request_t *req,
+                                           serf_bucket_t *response)
+{
+    if (req->resp_bkt || req->written)
+        return APR_EINVAL;
+
+    if (SERF_BUCKET_IS_OUTGOING_RESPONSE(response)) {
+        if (req->close_after)
+            serf_bucket_headers_setn(
+                serf_bucket_outgoing_response_get_headers(response),
+                "Connection", "close");
+        else if (serf__bucket_outgoing_response_closes(response))
+            req->close_after = 1;
     }
 
-    return rv;
+    req->resp_bkt = response;
+
+    return update_pollset(req->incoming);
+}
+
+apr_status_t serf__process_listener(serf_listener_t *l)
+{
+    /* Accept all the connections that are waiting, a burst of them would
+       otherwise take a trip through the event loop each. */
+    while (1) {
+        apr_status_t rv;
+        apr_socket_t *in;
+        apr_pool_t *p;
+
+        if (l->nr_of_spare_pools)
+            p = l->spare_pools[--l->nr_of_spare_pools];
+        else
+            apr_pool_create(&p, l->pool);
+
+        /* APR creates the socket with accept4() where there is one, and
+           serf_incoming_create() makes it non-blocking. */
+        rv = apr_socket_accept(&in, l->skt, p);
+        if (rv) {
+            recycle_client_pool(l, p);
+
+            /* Done, or the client gave up before we got to it. */
+            if (APR_STATUS_IS_EAGAIN(rv))
+                return APR_SUCCESS;
+            if (APR_STATUS_IS_ECONNABORTED(rv))
+                continue;
+            return rv;
+        }
+
+        /* Let serf_incoming_create() know the pool is ours. */
+        apr_pool_userdata_setn(l, LISTENER_KEY, NULL, p);
+
+        rv = l->accept_func(l->ctx, l, l->accept_baton, in, p);
+        if (rv) {
+            recycle_client_pool(l, p);
+            return rv;
+        }
+    }
 }
 
 
@@ -95,7 +517,7 @@ apr_status_t serf_incoming_create(
     apr_pool_t *pool)
 {
     apr_status_t rv;
-    serf_incoming_t *ic = apr_palloc(pool, sizeof(*ic));
+    serf_incoming_t *ic = apr_pcalloc(pool, sizeof(*ic));
 
     ic->ctx = ctx;
     ic->baton.type = SERF_IO_CLIENT;
@@ -105,7 +527,29 @@ apr_status_t serf_incoming_create(
     ic->skt = insock;
     ic->desc.desc_type = APR_POLL_SOCKET;
     ic->desc.desc.s = ic->skt;
-    ic->desc.reqevents = APR_POLLIN;
+    ic->desc.reqevents = APR_POLLIN | APR_POLLHUP | APR_POLLERR;
+    ic->pool = pool;
+    ic->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
+
+    /* The pool of a listener's accept callback goes back to it. */
+    apr_pool_userdata_get((void **)&ic->listener, LISTENER_KEY, pool);
+
+    rv = serf__config_store_get_config(ctx, NULL, &ic->config, pool);
+    if (rv)
+        return rv;
+
+    /* Like our client sockets: non-blocking, and small responses aren't
+       held back. */
+    rv = apr_socket_timeout_set(insock, 0);
+    if (rv)
+        return rv;
+    apr_socket_opt_set(insock, APR_TCP_NODELAY, 1);
+
+    ic->stream = serf_bucket_socket_create(insock, ic->allocator);
+    serf_bucket_socket_set_read_progress_cb(ic->stream,
+                                            serf__context_progress_delta,
+                                            ctx);
+    serf_bucket_set_config(ic->stream, ic->config);
 
     rv = ctx->pollset_add(ctx->pollset_baton,
                          &ic->desc, &ic->baton);
@@ -115,6 +559,28 @@ apr_status_t serf_incoming_create(
 }
 
 
+/* Allow other sockets to bind to the same address and port, so the kernel
+   spreads the incoming connections over them. */
+static apr_status_t set_reuseport(apr_socket_t *skt)
+{
+#ifdef SO_REUSEPORT
+    apr_os_sock_t osskt;
+    int on = 1;
+    apr_status_t status;
+
+    if ((status = apr_os_sock_get(&osskt, skt)) != APR_SUCCESS)
+        return status;
+
+    if (setsockopt(osskt, SOL_SOCKET, SO_REUSEPORT,
+                   (void *)&on, sizeof(on)) != 0)
+        return apr_get_netos_error();
+
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
 apr_status_t serf_listener_create(
     serf_listener_t **listener,
     serf_context_t *ctx,
@@ -123,10 +589,24 @@ apr_status_t serf_listener_create(
     void *accept_baton,
     serf_accept_client_t accept,
     apr_pool_t *pool)
+{
+    return serf_listener_create2(listener, ctx, host, port, accept_baton,
+                                 accept, 0, pool);
+}
+
+apr_status_t serf_listener_create2(
+    serf_listener_t **listener,
+    serf_context_t *ctx,
+    const char *host,
+    apr_uint16_t port,
+    void *accept_baton,
+    serf_accept_client_t accept,
+    int flags,
+    apr_pool_t *pool)
 {
     apr_sockaddr_t *sa;
     apr_status_t rv;
-    serf_listener_t *l = apr_palloc(pool, sizeof(*l));
+    serf_listener_t *l = apr_pcalloc(pool, sizeof(*l));
 
     l->ctx = ctx;
     l->baton.type = SERF_IO_LISTENER;
@@ -153,11 +633,22 @@ apr_status_t serf_listener_create(
     if (rv)
         return rv;
 
+    if (flags & SERF_LISTENER_REUSEPORT) {
+        rv = set_reuseport(l->skt);
+        if (rv)
+            return rv;
+    }
+
+    /* We accept until there is nothing left, that must not block. */
+    rv = apr_socket_timeout_set(l->skt, 0);
+    if (rv)
+        return rv;
+
     rv = apr_socket_bind(l->skt, sa);
     if (rv)
         return rv;
 
-    rv = apr_socket_listen(l->skt, 5);
+    rv = apr_socket_listen(l->skt, LISTEN_BACKLOG);
     if (rv)
         return rv;
 
@@ -13,16 +13,17 @@
  * limitations under the License.
  */
 
+#include <apr_atomic.h>
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#endif
+
 #include "serf.h"
 #include "serf_private.h"
 
 /* For optimizations, we allow logging to be disabled entirely. */
 #ifdef SERF_LOGGING_ENABLED
 
-typedef struct log_baton_t {
-    apr_array_header_t *output_list;
-} log_baton_t;
-
 typedef apr_status_t (*log_to_output_t)(serf_log_output_t *output,
                                         serf_config_t *config,
                                         apr_uint32_t level,
@@ -54,10 +55,10 @@ const char * loglvl_labels[] = {
 
 apr_status_t serf__log_init(serf_context_t *ctx)
 {
-    log_baton_t *log_baton;
+    serf__log_baton_t *log_baton;
     serf_config_t *config = ctx->config;
 
-    log_baton = apr_palloc(ctx->pool, sizeof(log_baton_t));
+    log_baton = apr_pcalloc(ctx->pool, sizeof(serf__log_baton_t));
     log_baton->output_list = apr_array_make(ctx->pool, 1,
                                             sizeof(serf_log_output_t *));
 
@@ -87,11 +88,11 @@ apr_status_t serf__log_init(serf_context_t *ctx)
     return APR_SUCCESS;
 }
 
-static void log_time(FILE *logfp)
+static void log_time(FILE *logfp, apr_time_t now)
 {
     apr_time_exp_t tm;
 
-    apr_time_exp_lt(&tm, apr_time_now());
+    apr_time_exp_lt(&tm, now);
     fprintf(logfp, "%d-%02d-%02dT%02d:%02d:%02d.%06d%+03d ",
             1900 + tm.tm_year, 1 + tm.tm_mon, tm.tm_mday,
             tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec,
@@ -102,30 +103,23 @@ void serf__log_nopref(apr_uint32_t level, apr_uint32_t comp,
                       serf_config_t *config, const char *fmt, ...)
 {
     va_list argp;
-    log_baton_t *log_baton;
-    apr_status_t status;
+    serf__log_baton_t *log_baton;
+    int i;
 
-    if (!config) {
-        /* If we can't get the log baton we have no choice but to silently
-           return without logging. */
+    /* Nothing to do if no output logs this event, or if we can't get the
+       log baton. */
+    if (!serf__log_enabled(level, comp, config))
         return;
-    }
-
-    status = serf_config_get_object(config, SERF_CONFIG_CTX_LOGBATON,
-                                    (void **)&log_baton);
 
-    if (!status && log_baton) {
-        int i;
+    log_baton = *config->log_baton;
 
-        for (i = 0; i < log_baton->output_list->nelts; i++) {
-            serf_log_output_t *output = APR_ARRAY_IDX(log_baton->output_list,
-                                                      i, serf_log_output_t *);
-            if ((output->level >= level) && (comp & output->comps)) {
-                va_start(argp, fmt);
-                output->logger(output, config, level, comp, 0, "", fmt, argp);
-                va_end(argp);
-
-            }
+    for (i = 0; i < log_baton->output_list->nelts; i++) {
+        serf_log_output_t *output = APR_ARRAY_IDX(log_baton->output_list,
+                                                  i, serf_log_output_t *);
+        if ((output->level >= level) && (comp & output->comps)) {
+            va_start(argp, fmt);
+            output->logger(output, config, level, comp, 0, "", fmt, argp);
+            va_end(argp);
         }
     }
 }
@@ -134,31 +128,61 @@ void serf__log(apr_uint32_t level, apr_uint32_t comp, const char *prefix,
                serf_config_t *config, const char *fmt, ...)
 {
     va_list argp;
-    log_baton_t *log_baton;
-    apr_status_t status;
+    serf__log_baton_t *log_baton;
+    int i;
 
-    if (!config) {
-        /* If we can't get the log baton we have no choice but to silently
-           return without logging. */
+    /* Nothing to do if no output logs this event, or if we can't get the
+       log baton. */
+    if (!serf__log_enabled(level, comp, config))
         return;
-    }
 
-    status = serf_config_get_object(config, SERF_CONFIG_CTX_LOGBATON,
-                                    (void **)&log_baton);
+    log_baton = *config->log_baton;
 
-    if (!status && log_baton) {
-        int i;
+    for (i = 0; i < log_baton->output_list->nelts; i++) {
+        serf_log_output_t *output = APR_ARRAY_IDX(log_baton->output_list,
+                                                  i, serf_log_output_t *);
+        if ((output->level >= level) && (comp & output->comps)) {
+            va_start(argp, fmt);
+            output->logger(output, config, level, comp, 1, prefix, fmt, argp);
+            va_end(argp);
+        }
+    }
+}
 
-        for (i = 0; i < log_baton->output_list->nelts; i++) {
-            serf_log_output_t *output = APR_ARRAY_IDX(log_baton->output_list,
-                                                      i, serf_log_output_t *);
-            if ((output->level >= level) && (comp & output->comps)) {
-                va_start(argp, fmt);
-                output->logger(output, config, level, comp, 1, prefix, fmt, argp);
-                va_end(argp);
+void serf__log_alloc_stats(apr_uint32_t level, apr_uint32_t comp,
+                           const char *filename, serf_config_t *config,
+                           const char *name,
+                           const serf_bucket_alloc_t *allocator)
+{
+    serf_bucket_alloc_stats_t stats;
+    apr_size_t limit = 16;
+    int i;
 
-            }
-        }
+    if (serf_bucket_allocator_get_stats(&stats, allocator))
+        return;
+
+    serf__log(level, comp, filename, config,
+              "%s allocator: live %" APR_SIZE_T_FMT " bytes, "
+              "peak %" APR_SIZE_T_FMT " bytes, "
+              "%" APR_UINT64_T_FMT " allocs, %" APR_UINT64_T_FMT " frees, "
+              "%" APR_UINT64_T_FMT " freelist hits, "
+              "%" APR_UINT64_T_FMT " blocks, "
+              "%" APR_UINT64_T_FMT " direct.\n",
+              name, stats.live_bytes, stats.peak_bytes, stats.num_allocs,
+              stats.num_frees, stats.freelist_hits, stats.block_grabs,
+              stats.direct_allocs);
+
+    serf__log(level, comp, filename, config, "%s allocator sizes:", name);
+    for (i = 0; i < SERF_ALLOC_STATS_HISTOGRAM_SIZE; i++) {
+        if (i < SERF_ALLOC_STATS_HISTOGRAM_SIZE - 1)
+            serf__log_nopref(level, comp, config,
+                             " <=%" APR_SIZE_T_FMT ":%" APR_UINT64_T_FMT,
+                             limit, stats.size_histogram[i]);
+        else
+            serf__log_nopref(level, comp, config,
+                             " >%" APR_SIZE_T_FMT ":%" APR_UINT64_T_FMT "\n",
+                             limit >> 1, stats.size_histogram[i]);
+        limit <<= 1;
     }
 }
 
@@ -180,7 +204,7 @@ static apr_status_t log_to_stream_output(serf_log_output_t *output,
             const char *localip, *remoteip;
             apr_status_t status;
 
-            log_time(logfp);
+            log_time(logfp, apr_time_now());
 
             /* Log local and remote ip address:port */
             fprintf(logfp, "%s [l:", loglvl_labels[level]);
@@ -231,16 +255,284 @@ apr_status_t serf_logging_create_stream_output(serf_log_output_t **output,
     return APR_SUCCESS;
 }
 
+/*** Output to a stream, written by a thread of its own ***/
+
+#if APR_HAS_THREADS
+
+/* The longest event a ring output takes, longer ones are cut short. */
+#define RING_LINE_SIZE 4096
+
+/* How long the writer thread waits for new events when the ring is empty */
+#define RING_POLL_INTERVAL (10 * 1000) /* 10 ms */
+
+/* Each event in the ring is this header, followed by LEN bytes of text */
+typedef struct ring_event_t {
+    apr_time_t time; /* 0 when the event continues the previous line */
+    apr_uint32_t len;
+} ring_event_t;
+
+typedef struct ring_output_t {
+    FILE *fp;
+    char *buf;
+    apr_uint32_t size; /* A power of two */
+
+    /* Positions in BUF, as a count of bytes modulo 2^32. HEAD is only moved
+       by the thread that logs, TAIL only by the writer thread. */
+    volatile apr_uint32_t head;
+    volatile apr_uint32_t tail;
+
+    /* Number of events that didn't fit in the ring since the last report */
+    volatile apr_uint32_t dropped;
+
+    /* Set when the writer thread should exit once the ring is empty */
+    volatile apr_uint32_t stop;
+
+    /* Set when an event was dropped, so that its continuations are dropped
+       as well. */
+    int dropping;
+
+    apr_thread_t *thread;
+
+    char line[RING_LINE_SIZE];     /* Used by the thread that logs */
+    char out_line[RING_LINE_SIZE]; /* Used by the writer thread */
+} ring_output_t;
+
+static void ring_copy_in(ring_output_t *ring, apr_uint32_t pos,
+                         const void *data, apr_size_t len)
+{
+    apr_size_t offset = pos & (ring->size - 1);
+    apr_size_t first = ring->size - offset;
+
+    if (first > len)
+        first = len;
+
+    memcpy(ring->buf + offset, data, first);
+    memcpy(ring->buf, (const char *)data + first, len - first);
+}
+
+static void ring_copy_out(ring_output_t *ring, apr_uint32_t pos,
+                          void *data, apr_size_t len)
+{
+    apr_size_t offset = pos & (ring->size - 1);
+    apr_size_t first = ring->size - offset;
+
+    if (first > len)
+        first = len;
+
+    memcpy(data, ring->buf + offset, first);
+    memcpy((char *)data + first, ring->buf, len - first);
+}
+
+/* Formats the event in the ring, leaving only the timestamp and the actual
+   writing to the writer thread. The arguments of the event may not live
+   long enough to be formatted there. */
+static apr_status_t log_to_ring_output(serf_log_output_t *output,
+                                       serf_config_t *config,
+                                       apr_uint32_t level,
+                                       apr_uint32_t comp,
+                                       int header,
+                                       const char *prefix,
+                                       const char *fmt,
+                                       va_list argp)
+{
+    ring_output_t *ring;
+    ring_event_t event;
+    apr_size_t len = 0;
+    apr_uint32_t head;
+
+    if (!output || !output->baton)
+        return APR_EINVAL;
+
+    ring = output->baton;
+
+    if (header)
+        ring->dropping = 0;
+    else if (ring->dropping)
+        return APR_SUCCESS;
+
+    event.time = 0;
+    if (output->layout == SERF_LOG_DEFAULT_LAYOUT && header) {
+        const char *localip, *remoteip;
+
+        event.time = apr_time_now();
+
+        if (serf_config_get_string(config, SERF_CONFIG_CONN_LOCALIP,
+                                   &localip) || !localip)
+            localip = "";
+        if (serf_config_get_string(config, SERF_CONFIG_CONN_REMOTEIP,
+                                   &remoteip) || !remoteip)
+            remoteip = "";
+
+        len = apr_snprintf(ring->line, sizeof(ring->line),
+                           "%s [l:%s r:%s] %s%s", loglvl_labels[level],
+                           localip, remoteip, prefix ? prefix : "",
+                           prefix ? ": " : "");
+    }
+    len += apr_vsnprintf(ring->line + len, sizeof(ring->line) - len,
+                         fmt, argp);
+
+    head = apr_atomic_read32(&ring->head);
+    if (ring->size - (head - apr_atomic_read32(&ring->tail))
+            < sizeof(event) + len) {
+        /* Never wait for the writer thread. */
+        ring->dropping = 1;
+        apr_atomic_inc32(&ring->dropped);
+        return APR_SUCCESS;
+    }
+
+    event.len = (apr_uint32_t)len;
+    ring_copy_in(ring, head, &event, sizeof(event));
+    ring_copy_in(ring, head + sizeof(event), ring->line, len);
+
+    /* Publish the event to the writer thread */
+    apr_atomic_set32(&ring->head, head + (apr_uint32_t)(sizeof(event) + len));
+
+    return APR_SUCCESS;
+}
+
+/* Writes all events in the ring to the stream. Returns 0 if there were
+   none. */
+static int drain_ring(ring_output_t *ring)
+{
+    apr_uint32_t head = apr_atomic_read32(&ring->head);
+    apr_uint32_t tail = apr_atomic_read32(&ring->tail);
+    apr_uint32_t dropped;
+    int drained = 0;
+
+    while (tail != head) {
+        ring_event_t event;
+
+        ring_copy_out(ring, tail, &event, sizeof(event));
+        ring_copy_out(ring, tail + sizeof(event), ring->out_line, event.len);
+
+        /* Hand the space back to the thread that logs before doing I/O */
+        tail += (apr_uint32_t)sizeof(event) + event.len;
+        apr_atomic_set32(&ring->tail, tail);
+
+        if (event.time)
+            log_time(ring->fp, event.time);
+        fwrite(ring->out_line, 1, event.len, ring->fp);
+        drained = 1;
+    }
+
+    dropped = apr_atomic_xchg32(&ring->dropped, 0);
+    if (dropped) {
+        fprintf(ring->fp, "[%u log events dropped]\n", (unsigned)dropped);
+        drained = 1;
+    }
+
+    if (drained)
+        fflush(ring->fp);
+
+    return drained;
+}
+
+static void * APR_THREAD_FUNC ring_writer_thread(apr_thread_t *thread,
+                                                 void *baton)
+{
+    ring_output_t *ring = baton;
+
+    while (1) {
+        /* Check before draining, so no event logged before the stop
+           request is lost. */
+        int stop = apr_atomic_read32(&ring->stop);
+
+        if (!drain_ring(ring)) {
+            if (stop)
+                break;
+            apr_sleep(RING_POLL_INTERVAL);
+        }
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/* Write out what's left in the ring, and join the writer thread. */
+static apr_status_t ring_output_cleanup(void *baton)
+{
+    ring_output_t *ring = baton;
+    apr_status_t thread_status;
+
+    apr_atomic_set32(&ring->stop, 1);
+    apr_thread_join(&thread_status, ring->thread);
+
+    return APR_SUCCESS;
+}
+
+apr_status_t serf_logging_create_ring_output(serf_log_output_t **output,
+                                             apr_uint32_t level,
+                                             apr_uint32_t comp_mask,
+                                             serf_log_layout_t *layout,
+                                             FILE *fp,
+                                             apr_size_t ring_size,
+                                             apr_pool_t *pool)
+{
+    serf_log_output_t *baton;
+    ring_output_t *ring;
+    apr_uint32_t size = 4 * RING_LINE_SIZE;
+    apr_status_t status;
+
+    /* Round up to a power of two, so positions can wrap around freely */
+    while (size < ring_size && size <= APR_UINT32_MAX / 2)
+        size <<= 1;
+
+    ring = apr_pcalloc(pool, sizeof(*ring));
+    ring->fp = fp;
+    ring->size = size;
+    ring->buf = apr_palloc(pool, size);
+
+    status = apr_thread_create(&ring->thread, NULL, ring_writer_thread,
+                               ring, pool);
+    if (status)
+        return status;
+
+    apr_pool_pre_cleanup_register(pool, ring, ring_output_cleanup);
+
+    baton = apr_palloc(pool, sizeof(serf_log_output_t));
+    baton->baton = ring;
+    baton->logger = log_to_ring_output;
+    baton->level = level;
+    baton->comps = comp_mask;
+    baton->layout = layout;
+
+    *output = baton;
+    return APR_SUCCESS;
+}
+
+#else /* APR_HAS_THREADS */
+
+apr_status_t serf_logging_create_ring_output(serf_log_output_t **output,
+                                             apr_uint32_t level,
+                                             apr_uint32_t comp_mask,
+                                             serf_log_layout_t *layout,
+                                             FILE *fp,
+                                             apr_size_t ring_size,
+                                             apr_pool_t *pool)
+{
+    return APR_ENOTIMPL;
+}
+
+#endif /* APR_HAS_THREADS */
+
 apr_status_t serf_logging_add_output(serf_context_t *ctx,
                                      const serf_log_output_t *output)
 {
     apr_status_t status;
-    log_baton_t *log_baton;
+    serf__log_baton_t *log_baton;
 
     status = serf_config_get_object(ctx->config, SERF_CONFIG_CTX_LOGBATON,
                                     (void **)&log_baton);
     if (!status && log_baton) {
+        apr_uint32_t level;
+
         APR_ARRAY_PUSH(log_baton->output_list, const serf_log_output_t *) = output;
+
+        /* The output logs its components at its own and all less detailed
+           levels. */
+        for (level = 0; level <= output->level && level <= LOGLVL_DEBUG;
+             level++)
+            log_baton->comps[level] |= output->comps;
     }
 
     return status;
@@ -265,6 +557,13 @@ void serf__log(apr_uint32_t level, apr_uint32_t comp, const char *prefix,
 {
 }
 
+void serf__log_alloc_stats(apr_uint32_t level, apr_uint32_t comp,
+                           const char *filename, serf_config_t *config,
+                           const char *name,
+                           const serf_bucket_alloc_t *allocator)
+{
+}
+
 apr_status_t serf_logging_create_stream_output(serf_log_output_t **output,
                                                serf_context_t *ctx,
                                                apr_uint32_t level,
@@ -276,6 +575,17 @@ apr_status_t serf_logging_create_stream_output(serf_log_output_t **output,
     return APR_SUCCESS;
 }
 
+apr_status_t serf_logging_create_ring_output(serf_log_output_t **output,
+                                             apr_uint32_t level,
+                                             apr_uint32_t comp_mask,
+                                             serf_log_layout_t *layout,
+                                             FILE *fp,
+                                             apr_size_t ring_size,
+                                             apr_pool_t *pool)
+{
+    return APR_SUCCESS;
+}
+
 apr_status_t serf_logging_add_output(serf_context_t *ctx,
                                      const serf_log_output_t *output)
 {
@@ -18,21 +18,68 @@
 #include <apr_version.h>
 #include <apr_portable.h>
 #include <apr_strings.h>
+#if APR_HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 
 #include "serf.h"
 #include "serf_bucket_util.h"
 
 #include "serf_private.h"
 
+/* Time to give a connect before the next address is raced against it,
+   as recommended by RFC 8305. */
+#define CONNECT_ATTEMPT_DELAY (250 * 1000)
+
+static void unpoll_attempt(serf__connect_attempt_t *attempt)
+{
+    serf_context_t *ctx = attempt->conn->ctx;
+    apr_pollfd_t desc = { 0 };
+
+    desc.desc_type = APR_POLL_SOCKET;
+    desc.desc.s = attempt->skt;
+    desc.reqevents = APR_POLLOUT | APR_POLLHUP | APR_POLLERR;
+    ctx->pollset_rm(ctx->pollset_baton, &desc, &attempt->baton);
+}
+
+/* Close the socket of ATTEMPT, and stop polling it. */
+static void close_attempt(serf__connect_attempt_t *attempt)
+{
+    unpoll_attempt(attempt);
+
+    apr_socket_close(attempt->skt);
+    attempt->skt = NULL;
+}
+
+/* Abandon all connection attempts of CONN. */
+static void stop_connect_race(serf_connection_t *conn)
+{
+    while (conn->attempts) {
+        serf__connect_attempt_t *attempt = conn->attempts;
+
+        conn->attempts = attempt->next;
+        close_attempt(attempt);
+    }
+    serf__timer_cancel(&conn->ctx->timers, &conn->attempt_timer);
+    conn->race_addresses = NULL;
+}
+
 /* cleanup for sockets */
 static apr_status_t clean_skt(void *data)
 {
     serf_connection_t *conn = data;
     apr_status_t status = APR_SUCCESS;
 
+    stop_connect_race(conn);
+
     if (conn->skt) {
+        if (conn->ctx->trace)
+            serf__trace(conn->ctx->trace, conn->id, SERF_TRACE_CLOSE,
+                        NULL, 0, 0);
+
         status = apr_socket_close(conn->skt);
         conn->skt = NULL;
+        conn->in_pollset = 0;
         serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
                   "closed socket, status %d\n", status);
         serf_config_remove_value(conn->config, SERF_CONFIG_CONN_LOCALIP);
@@ -62,7 +109,7 @@ static apr_status_t clean_resp(void *data)
     }
 
     /* ### should we worry about debug stuff, like that performed in
-       ### destroy_request()? should we worry about calling req->handler
+       ### serf__destroy_request()? should we worry about calling req->handler
        ### to notify this "cancellation" due to pool clearing?  */
 
     /* This pool just got cleared/destroyed. Don't try to destroy the pool
@@ -79,11 +126,41 @@ static apr_status_t clean_conn(void *data)
 
     serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
               "cleaning up connection 0x%x\n", conn);
+
+    /* The subpools of conn->pool, including our spare request pools, are
+       already destroyed by the time this cleanup runs. */
+    conn->nr_of_spare_respools = 0;
+
+    /* The same goes for the HTTP/2 state and the connection attempts,
+       allocated in conn->skt_pool. */
+    conn->http2 = NULL;
+    conn->attempts = NULL;
+
     serf_connection_close(conn);
 
     return APR_SUCCESS;
 }
 
+/* Returns non-zero if the outgoing stream of CONN has data to write. */
+static int data_pending(serf_connection_t *conn)
+{
+    if (conn->ostream_head) {
+        const char *dummy;
+        apr_size_t len;
+        apr_status_t status;
+
+        status = serf_bucket_peek(conn->ostream_head, &dummy,
+                                  &len);
+        if (!SERF_BUCKET_READ_ERROR(status) && len) {
+            serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                      "All requests written but still data pending.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 /* Check if there is data waiting to be sent over the socket. This can happen
    in two situations:
    - The connection queue has atleast one request with unwritten data.
@@ -105,21 +182,39 @@ request_or_data_pending(serf_request_t **next_req, serf_connection_t *conn)
 
     if (request != NULL) {
         return 1;
-    } else if (conn->ostream_head) {
-        const char *dummy;
-        apr_size_t len;
-        apr_status_t status;
-
-        status = serf_bucket_peek(conn->ostream_head, &dummy,
-                                  &len);
-        if (!SERF_BUCKET_READ_ERROR(status) && len) {
-            serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
-                      "All requests written but still data pending.\n");
-            return 1;
-        }
     }
 
-    return 0;
+    return data_pending(conn);
+}
+
+/* Returns non-zero while CONN sets itself up without sending requests: it
+   is warming up, see serf_connection_prewarm(), or it waits for the
+   framing type to be negotiated. */
+static int setting_up(const serf_connection_t *conn)
+{
+    if (conn->http2)
+        return 0;
+
+    if (conn->framing_type == SERF_CONNECTION_FRAMING_TYPE_NONE)
+        return conn->state == SERF_CONN_CONNECTED;
+
+    return conn->prewarm && !conn->written_reqs && !conn->unwritten_reqs;
+}
+
+/* Take CONN out of the pollset of CTX. */
+static apr_status_t remove_connection(serf_context_t *ctx,
+                                      serf_connection_t *conn)
+{
+    apr_pollfd_t desc = { 0 };
+
+    desc.desc_type = APR_POLL_SOCKET;
+    desc.desc.s = conn->skt;
+    desc.reqevents = conn->reqevents;
+
+    conn->in_pollset = 0;
+
+    return ctx->pollset_rm(ctx->pollset_baton,
+                           &desc, &conn->baton);
 }
 
 /* Update the pollset for this connection. We tweak the pollset based on
@@ -133,23 +228,47 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
     apr_status_t status;
     apr_pollfd_t desc = { 0 };
 
+    /* An open connection without requests is idle. */
+    if (conn->idle_timeout && conn->skt
+        && !conn->written_reqs && !conn->unwritten_reqs) {
+        if (!serf__timer_pending(&conn->idle_timer))
+            serf__timer_schedule(&ctx->timers, &conn->idle_timer,
+                                 apr_time_now() + conn->idle_timeout);
+    }
+    else {
+        serf__timer_cancel(&ctx->timers, &conn->idle_timer);
+    }
+
     if (!conn->skt) {
         return APR_SUCCESS;
     }
 
-    /* Remove the socket from the poll set. */
     desc.desc_type = APR_POLL_SOCKET;
     desc.desc.s = conn->skt;
-    desc.reqevents = conn->reqevents;
 
-    status = ctx->pollset_rm(ctx->pollset_baton,
-                             &desc, &conn->baton);
-    if (status && !APR_STATUS_IS_NOTFOUND(status))
-        return status;
-
-    /* Now put it back in with the correct read/write values. */
+    /* Work out the read/write values. */
     desc.reqevents = APR_POLLHUP | APR_POLLERR;
-    if ((conn->written_reqs || conn->unwritten_reqs) &&
+    if (conn->http2) {
+        /* Frames can arrive at any time, and whether we want to write
+           depends on the streams. */
+        desc.reqevents |= APR_POLLIN;
+
+        if (conn->stop_writing != 1 && conn->state != SERF_CONN_CLOSING
+            && serf__http2_wants_write(conn))
+            desc.reqevents |= APR_POLLOUT;
+    }
+    else if (setting_up(conn) && conn->state == SERF_CONN_CONNECTED) {
+        /* A warm connection without requests, or one that waits for its
+           framing type, still reads and writes to complete its setup,
+           e.g. the TLS handshake. */
+        desc.reqevents |= APR_POLLIN;
+
+        if (conn->stop_writing != 1
+            && (!conn->prewarm_started || conn->pending.vec_len
+                || data_pending(conn)))
+            desc.reqevents |= APR_POLLOUT;
+    }
+    else if ((conn->written_reqs || conn->unwritten_reqs) &&
         conn->state != SERF_CONN_INIT) {
         /* If there are any outstanding events, then we want to read. */
         /* ### not true. we only want to read IF we have sent some data */
@@ -163,7 +282,7 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
              *   there are any requests that still have buckets to write out,
              *     then we want to write.
              */
-            if (conn->vec_len &&
+            if ((conn->pending.vec_len || conn->pending.sendfile_len) &&
                 conn->state != SERF_CONN_CLOSING)
                 desc.reqevents |= APR_POLLOUT;
             else {
@@ -187,14 +306,33 @@ apr_status_t serf__conn_update_pollset(serf_connection_t *conn)
         desc.reqevents |= APR_POLLIN;
     }
 
+    /* A response handler asked us to stop reading for now, so the server
+       is held back by TCP flow control. */
+    if (conn->read_paused) {
+        desc.reqevents &= ~APR_POLLIN;
+    }
+
+    /* Most updates don't change what we poll for. */
+    if (conn->in_pollset && desc.reqevents == conn->reqevents)
+        return APR_SUCCESS;
+
+    /* Remove the socket from the poll set, and put it back in with the new
+       values. */
+    status = remove_connection(ctx, conn);
+    if (status && !APR_STATUS_IS_NOTFOUND(status))
+        return status;
+
     /* save our reqevents, so we can pass it in to remove later. */
     conn->reqevents = desc.reqevents;
 
     /* Note: even if we don't want to read/write this socket, we still
      * want to poll it for hangups and errors.
      */
-    return ctx->pollset_add(ctx->pollset_baton,
-                            &desc, &conn->baton);
+    status = ctx->pollset_add(ctx->pollset_baton,
+                              &desc, &conn->baton);
+    conn->in_pollset = (status == APR_SUCCESS);
+
+    return status;
 }
 
 #ifdef SERF_DEBUG_BUCKET_USE
@@ -298,6 +436,10 @@ static apr_status_t do_conn_setup(serf_connection_t *conn)
        where STREAM is an internal variant of AGGREGATE.
     */
 
+    /* HTTP/2 starts with the connection preface, before any request. */
+    if (conn->framing_type == SERF_CONNECTION_FRAMING_TYPE_HTTP2)
+        status = serf__http2_setup(conn);
+
     return status;
 }
 
@@ -350,25 +492,391 @@ static apr_status_t prepare_conn_streams(serf_connection_t *conn,
     return APR_SUCCESS;
 }
 
+apr_status_t serf__conn_start_tunneled_handshake(serf_connection_t *conn,
+                                                 serf_bucket_t **handshake)
+{
+    serf_bucket_t *tunnel_stream = conn->stream;
+    int hit_eof = conn->hit_eof;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    conn->stream = NULL;
+    status = do_conn_setup(conn);
+    conn->tunneled_stream = conn->stream;
+    conn->stream = tunnel_stream;
+    if (status)
+        return status;
+
+    /* Reading starts the handshake, which then waits for the server. As the
+       CONNECT request isn't sent yet, nothing can have arrived that the
+       handshake would take for the answer of the server. */
+    status = serf_bucket_peek(conn->tunneled_stream, &data, &len);
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    *handshake = serf_bucket_aggregate_create(conn->allocator);
+    do {
+        status = serf_bucket_read(conn->ostream_head, SERF_READ_ALL_AVAIL,
+                                  &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            serf_bucket_destroy(*handshake);
+            return status;
+        }
+
+        if (len)
+            serf_bucket_aggregate_append(
+                *handshake,
+                serf_bucket_simple_copy_create(data, len, conn->allocator));
+    } while (!status && len);
+
+    /* No request was appended to the output stream, its end doesn't mean
+       anything. */
+    conn->hit_eof = hit_eof;
+
+    /* The response to the CONNECT request has to leave what the server
+       sends through the tunnel on the socket. */
+    if (SERF_BUCKET_IS_SOCKET(conn->stream))
+        serf__bucket_socket_read_head_only(conn->stream);
+
+    return APR_SUCCESS;
+}
+
 static void store_ipaddresses_in_config(serf_config_t *config,
                                         apr_socket_t *skt)
 {
      apr_sockaddr_t *sa;
 
     if (apr_socket_addr_get(&sa, APR_LOCAL, skt) == APR_SUCCESS) {
-        char buf[32];
-        apr_sockaddr_ip_getbuf(buf, 32, sa);
+        char buf[64];
+        apr_sockaddr_ip_getbuf(buf, sizeof(buf), sa);
         serf_config_set_stringf(config, SERF_CONFIG_CONN_LOCALIP,
                                 "%s:%d", buf, sa->port);
     }
     if (apr_socket_addr_get(&sa, APR_REMOTE, skt) == APR_SUCCESS) {
-        char buf[32];
-        apr_sockaddr_ip_getbuf(buf, 32, sa);
+        char buf[64];
+        apr_sockaddr_ip_getbuf(buf, sizeof(buf), sa);
         serf_config_set_stringf(config, SERF_CONFIG_CONN_REMOTEIP,
                                "%s:%d", buf, sa->port);
     }
 }
 
+/* Create a non-blocking socket for connecting CONN to ADDRESS. */
+static apr_status_t create_socket(apr_socket_t **skt,
+                                  serf_connection_t *conn,
+                                  apr_sockaddr_t *address)
+{
+    apr_status_t status;
+
+    status = apr_socket_create(skt, address->family,
+                               SOCK_STREAM,
+#if APR_MAJOR_VERSION > 0
+                               APR_PROTO_TCP,
+#endif
+                               conn->skt_pool);
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "created socket for conn 0x%x, status %d\n", conn, status);
+    if (status != APR_SUCCESS)
+        return status;
+
+    /* Set the socket to be non-blocking */
+    if ((status = apr_socket_timeout_set(*skt, 0)) != APR_SUCCESS)
+        return status;
+
+    /* Disable Nagle's algorithm */
+    if ((status = apr_socket_opt_set(*skt,
+                                     APR_TCP_NODELAY, 1)) != APR_SUCCESS)
+        return status;
+
+    return APR_SUCCESS;
+}
+
+/* Make the kernel send the first data written to SKT along with the SYN,
+   when it has a TCP Fast Open cookie for the server. Otherwise it falls
+   back to a normal connect, and requests the cookie for the next one. */
+static apr_status_t set_tcp_fastopen(apr_socket_t *skt)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+    apr_os_sock_t osskt;
+    int on = 1;
+    apr_status_t status;
+
+    if ((status = apr_os_sock_get(&osskt, skt)) != APR_SUCCESS)
+        return status;
+
+    if (setsockopt(osskt, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                   (void *)&on, sizeof(on)) != 0)
+        return apr_get_netos_error();
+
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+/* Get the pending error of SKT from the platform's socket layer, as an APR
+   status code. */
+static apr_status_t get_socket_error(apr_socket_t *skt)
+{
+#ifdef SO_ERROR
+    apr_os_sock_t osskt;
+
+    if (!apr_os_sock_get(&osskt, skt)) {
+        int error;
+        apr_socklen_t l = sizeof(error);
+
+        if (!getsockopt(osskt, SOL_SOCKET, SO_ERROR, (char*)&error, &l))
+            return APR_FROM_OS_ERROR(error);
+    }
+#endif
+    return APR_EGENERAL;
+}
+
+/* Prepare CONN to talk over its new socket. */
+static apr_status_t setup_new_socket(serf_connection_t *conn)
+{
+    serf_context_t *ctx = conn->ctx;
+    serf__authn_info_t *authn_info;
+    apr_status_t status;
+
+    status = serf_config_set_string(conn->config,
+                 SERF_CONFIG_CONN_PIPELINING,
+                 (conn->max_outstanding_requests != 1 &&
+                  conn->pipelining == 1) ? "Y" : "N");
+    if (status)
+        return status;
+
+    if (conn->read_bufsize) {
+        status = serf_config_set_stringf(conn->config,
+                                         SERF_CONFIG_CONN_READ_BUFSIZE,
+                                         "%" APR_SIZE_T_FMT,
+                                         conn->read_bufsize);
+        if (status)
+            return status;
+    }
+
+    /* Let the ssl buckets record the handshake. */
+    status = serf_config_set_object(conn->config, SERF__CONFIG_CONN_TIMINGS,
+                                    &conn->timings);
+    if (status)
+        return status;
+
+    /* Flag our pollset as dirty now that we have a new socket. */
+    serf__conn_set_dirty(conn);
+
+    if (ctx->trace) {
+        struct iovec vec;
+
+        vec.iov_base = (void *)(conn->host_url ? conn->host_url : "");
+        vec.iov_len = strlen(vec.iov_base);
+        serf__trace(ctx->trace, conn->id, SERF_TRACE_OPEN, &vec, 1,
+                    vec.iov_len);
+    }
+
+    /* If the authentication was already started on another connection,
+       prepare this connection (it might be possible to skip some
+       part of the handshaking). */
+    if (ctx->proxy_address) {
+        authn_info = &ctx->proxy_authn_info;
+        if (authn_info->scheme) {
+            authn_info->scheme->init_conn_func(authn_info->scheme, 407,
+                                               conn, conn->pool);
+        }
+    }
+
+    authn_info = serf__get_authn_info_for_server(conn);
+    if (authn_info->scheme) {
+        authn_info->scheme->init_conn_func(authn_info->scheme, 401,
+                                           conn, conn->pool);
+    }
+
+    /* Does this connection require a SSL tunnel over the proxy? */
+    if (ctx->proxy_address && strcmp(conn->host_info.scheme, "https") == 0)
+        serf__ssltunnel_connect(conn);
+    else {
+        conn->state = SERF_CONN_CONNECTED;
+        status = do_conn_setup(conn);
+        if (status)
+            return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Return the first address from SA on that has (SAME non-zero) or
+   hasn't (SAME zero) address family FAMILY. */
+static apr_sockaddr_t *next_address(apr_sockaddr_t *sa, int family, int same)
+{
+    while (sa && (sa->family == family) != same)
+        sa = sa->next;
+
+    return sa;
+}
+
+/* Connect to the next address in the race of CONN. If there is none, and
+   all attempts failed, return the error of the last one. */
+static apr_status_t start_attempt(serf_connection_t *conn)
+{
+    serf_context_t *ctx = conn->ctx;
+
+    while (conn->next_race_address < conn->race_addresses->nelts) {
+        serf__connect_attempt_t *attempt;
+        apr_pollfd_t desc = { 0 };
+        apr_status_t status;
+
+        attempt = apr_pcalloc(conn->skt_pool, sizeof(*attempt));
+        attempt->conn = conn;
+        attempt->address = APR_ARRAY_IDX(conn->race_addresses,
+                                         conn->next_race_address++,
+                                         apr_sockaddr_t *);
+        attempt->baton.type = SERF_IO_CONNECT_ATTEMPT;
+        attempt->baton.u.attempt = attempt;
+
+        status = create_socket(&attempt->skt, conn, attempt->address);
+        if (status == APR_SUCCESS) {
+            status = apr_socket_connect(attempt->skt, attempt->address);
+            if (APR_STATUS_IS_EINPROGRESS(status))
+                status = APR_SUCCESS;
+        }
+        if (status == APR_SUCCESS) {
+            /* A socket becomes writable when it is connected. */
+            desc.desc_type = APR_POLL_SOCKET;
+            desc.desc.s = attempt->skt;
+            desc.reqevents = APR_POLLOUT | APR_POLLHUP | APR_POLLERR;
+            status = ctx->pollset_add(ctx->pollset_baton, &desc,
+                                      &attempt->baton);
+        }
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "connect attempt %d for conn 0x%x, status %d\n",
+                  conn->next_race_address, conn, status);
+
+        if (status != APR_SUCCESS) {
+            /* Move on to the next address right away. */
+            if (attempt->skt)
+                apr_socket_close(attempt->skt);
+            conn->race_status = status;
+            continue;
+        }
+
+        attempt->next = conn->attempts;
+        conn->attempts = attempt;
+
+        if (conn->next_race_address < conn->race_addresses->nelts)
+            serf__timer_schedule(&ctx->timers, &conn->attempt_timer,
+                                 apr_time_now() + CONNECT_ATTEMPT_DELAY);
+
+        return APR_SUCCESS;
+    }
+
+    /* All failed, don't race again until the connection is reset. */
+    if (!conn->attempts) {
+        conn->status = conn->race_status ? conn->race_status : APR_EGENERAL;
+        return conn->status;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t attempt_delay_passed(serf__timer_t *timer)
+{
+    return start_attempt(timer->baton);
+}
+
+/* Start racing connects to the addresses of CONN, staggered in time, as
+   described in RFC 8305. The first that succeeds becomes the socket of
+   CONN. */
+static apr_status_t start_connect_race(serf_connection_t *conn)
+{
+    int family = conn->address->family;
+    apr_sockaddr_t *preferred, *other;
+
+    /* Alternate between address families, starting with the one the
+       resolver put first. */
+    conn->race_addresses = apr_array_make(conn->skt_pool, 4,
+                                          sizeof(apr_sockaddr_t *));
+    preferred = next_address(conn->address, family, 1);
+    other = next_address(conn->address, family, 0);
+    while (preferred || other) {
+        if (preferred) {
+            APR_ARRAY_PUSH(conn->race_addresses, apr_sockaddr_t *) = preferred;
+            preferred = next_address(preferred->next, family, 1);
+        }
+        if (other) {
+            APR_ARRAY_PUSH(conn->race_addresses, apr_sockaddr_t *) = other;
+            other = next_address(other->next, family, 0);
+        }
+    }
+
+    conn->next_race_address = 0;
+    conn->race_status = APR_SUCCESS;
+
+    return start_attempt(conn);
+}
+
+apr_status_t serf__process_connect_attempt(serf__connect_attempt_t *attempt,
+                                           apr_int16_t events)
+{
+    serf_connection_t *conn = attempt->conn;
+    serf__connect_attempt_t **prev;
+
+    /* Abandoned after it was returned by the same poll. */
+    if (!attempt->skt)
+        return APR_SUCCESS;
+
+    for (prev = &conn->attempts; *prev != attempt; prev = &(*prev)->next)
+        ;
+    *prev = attempt->next;
+
+    if ((events & (APR_POLLHUP | APR_POLLERR)) != 0) {
+        conn->race_status = get_socket_error(attempt->skt);
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "connect attempt for conn 0x%x failed, status %d\n",
+                  conn, conn->race_status);
+
+        close_attempt(attempt);
+
+        /* Don't wait for the delay to pass. */
+        serf__timer_cancel(&conn->ctx->timers, &conn->attempt_timer);
+        return start_attempt(conn);
+    }
+
+    /* The winner. Stop polling it as an attempt, and drop the others. */
+    unpoll_attempt(attempt);
+    stop_connect_race(conn);
+
+    conn->skt = attempt->skt;
+    attempt->skt = NULL;
+
+    serf__timer_cancel(&conn->ctx->timers, &conn->connect_timer);
+    conn->timings.connect_done = apr_time_now();
+    store_ipaddresses_in_config(conn->config, conn->skt);
+
+    {
+        char buf[64];
+
+        apr_sockaddr_ip_getbuf(buf, sizeof(buf), attempt->address);
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "conn 0x%x won the connect race with %s\n", conn, buf);
+    }
+
+    return setup_new_socket(conn);
+}
+
+/* Count the TLS handshake in TIMINGS, if it happened, in METRICS. */
+static void count_handshake(serf_metrics_t *metrics,
+                            const serf_connection_timings_t *timings)
+{
+    if (!timings->handshake_done)
+        return;
+
+    if (timings->handshake_resumed)
+        metrics->handshakes_resumed++;
+    else
+        metrics->handshakes_full++;
+}
+
 /* Create and connect sockets for any connections which don't have them
  * yet. This is the core of our lazy-connect behavior.
  */
@@ -378,7 +886,6 @@ apr_status_t serf__open_connections(serf_context_t *ctx)
 
     for (i = ctx->conns->nelts; i--; ) {
         serf_connection_t *conn = GET_CONN(ctx, i);
-        serf__authn_info_t *authn_info;
         apr_status_t status;
         apr_socket_t *skt;
 
@@ -391,42 +898,73 @@ apr_status_t serf__open_connections(serf_context_t *ctx)
             continue;
         }
 
+        /* Still waiting for one of the connection attempts, or all of
+           them failed. */
+        if (conn->attempts != NULL
+            || (conn->happy_eyeballs && conn->status)) {
+            continue;
+        }
+
         /* Delay opening until we have something to deliver! */
-        if (conn->unwritten_reqs == NULL) {
+        if (conn->unwritten_reqs == NULL && !conn->prewarm) {
             continue;
         }
 
+        /* Wait for the address of the server. */
+        if (conn->address == NULL && conn->lookup) {
+            status = serf__dns_lookup_result(&conn->address, conn->lookup);
+            if (APR_STATUS_IS_EAGAIN(status))
+                continue;
+            if (status) {
+                conn->address = NULL;
+                return status;
+            }
+            conn->timings.lookup_done = apr_time_now();
+        }
+
         apr_pool_clear(conn->skt_pool);
         apr_pool_cleanup_register(conn->skt_pool, conn, clean_skt,
                                   apr_pool_cleanup_null);
 
-        status = apr_socket_create(&skt, conn->address->family,
-                                   SOCK_STREAM,
-#if APR_MAJOR_VERSION > 0
-                                   APR_PROTO_TCP,
-#endif
-                                   conn->skt_pool);
-        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
-                  "created socket for conn 0x%x, status %d\n", conn, status);
-        if (status != APR_SUCCESS)
-            return status;
+        /* Remember time when we started connecting to server to calculate
+           network latency. */
+        conn->connect_time = apr_time_now();
+        conn->prewarm_started = 0;
 
-        /* Set the socket to be non-blocking */
-        if ((status = apr_socket_timeout_set(skt, 0)) != APR_SUCCESS)
-            return status;
+        count_handshake(&conn->metrics, &conn->timings);
+        conn->timings.connect_start = conn->connect_time;
+        conn->timings.connect_done = 0;
+        conn->timings.handshake_done = 0;
+        conn->timings.handshake_resumed = 0;
+
+        if (conn->happy_eyeballs && conn->address->next) {
+            if ((status = start_connect_race(conn)) != APR_SUCCESS)
+                return status;
 
-        /* Disable Nagle's algorithm */
-        if ((status = apr_socket_opt_set(skt,
-                                         APR_TCP_NODELAY, 1)) != APR_SUCCESS)
+            if (conn->connect_timeout)
+                serf__timer_schedule(&ctx->timers, &conn->connect_timer,
+                                     conn->connect_time
+                                     + conn->connect_timeout);
+            continue;
+        }
+
+        if ((status = create_socket(&skt, conn,
+                                    conn->address)) != APR_SUCCESS)
             return status;
 
+        /* Not for the racing sockets above: with Fast Open the connect
+           completes right away, before the handshake has. */
+        if (conn->tcp_fastopen) {
+            status = set_tcp_fastopen(skt);
+            if (status)
+                serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, conn->config,
+                          "TCP Fast Open unavailable for conn 0x%x, status "
+                          "%d\n", conn, status);
+        }
+
         /* Configured. Store it into the connection now. */
         conn->skt = skt;
 
-        /* Remember time when we started connecting to server to calculate
-           network latency. */
-        conn->connect_time = apr_time_now();
-
         /* Now that the socket is set up, let's connect it. This should
          * return immediately.
          */
@@ -440,43 +978,13 @@ apr_status_t serf__open_connections(serf_context_t *ctx)
                 return status;
         }
 
-        status = serf_config_set_string(conn->config,
-                     SERF_CONFIG_CONN_PIPELINING,
-                     (conn->max_outstanding_requests != 1 &&
-                      conn->pipelining == 1) ? "Y" : "N");
-        if (status)
-            return status;
+        /* Cancelled by the first event on the socket. */
+        if (conn->connect_timeout)
+            serf__timer_schedule(&ctx->timers, &conn->connect_timer,
+                                 conn->connect_time + conn->connect_timeout);
 
-        /* Flag our pollset as dirty now that we have a new socket. */
-        conn->dirty_conn = 1;
-        ctx->dirty_pollset = 1;
-
-        /* If the authentication was already started on another connection,
-           prepare this connection (it might be possible to skip some
-           part of the handshaking). */
-        if (ctx->proxy_address) {
-            authn_info = &ctx->proxy_authn_info;
-            if (authn_info->scheme) {
-                authn_info->scheme->init_conn_func(authn_info->scheme, 407,
-                                                   conn, conn->pool);
-            }
-        }
-
-        authn_info = serf__get_authn_info_for_server(conn);
-        if (authn_info->scheme) {
-            authn_info->scheme->init_conn_func(authn_info->scheme, 401,
-                                               conn, conn->pool);
-        }
-
-        /* Does this connection require a SSL tunnel over the proxy? */
-        if (ctx->proxy_address && strcmp(conn->host_info.scheme, "https") == 0)
-            serf__ssltunnel_connect(conn);
-        else {
-            conn->state = SERF_CONN_CONNECTED;
-            status = do_conn_setup(conn);
-            if (status)
-                return status;
-        }
+        if ((status = setup_new_socket(conn)) != APR_SUCCESS)
+            return status;
     }
 
     return APR_SUCCESS;
@@ -490,13 +998,15 @@ static apr_status_t no_more_writes(serf_connection_t *conn)
               "stop writing on conn 0x%x\n", conn);
 
     /* Clear our iovec. */
-    conn->vec_len = 0;
+    conn->pending.vec_start = 0;
+    conn->pending.vec_len = 0;
+    conn->pending.sendfile_file = NULL;
+    conn->pending.sendfile_len = 0;
 
     /* Update the pollset to know we don't want to write on this socket any
      * more.
      */
-    conn->dirty_conn = 1;
-    conn->ctx->dirty_pollset = 1;
+    serf__conn_set_dirty(conn);
     return APR_SUCCESS;
 }
 
@@ -533,10 +1043,29 @@ static void link_requests(serf_request_t **list, serf_request_t **tail,
     }
 }
 
-static apr_status_t destroy_request(serf_request_t *request)
+/* Destroy the request pools CONN has cached for reuse. */
+static void destroy_spare_respools(serf_connection_t *conn)
+{
+    while (conn->nr_of_spare_respools) {
+        apr_pool_destroy(
+            conn->spare_respools[--conn->nr_of_spare_respools]);
+    }
+}
+
+apr_status_t serf__destroy_request(serf_request_t *request)
 {
     serf_connection_t *conn = request->conn;
 
+    serf__timer_cancel(&conn->ctx->timers, &request->first_byte_timer);
+    serf__timer_cancel(&conn->ctx->timers, &request->total_timer);
+
+    /* Not via serf_request_resume_reading(), there's nothing to resume. */
+    if (request->read_paused) {
+        request->read_paused = 0;
+        conn->read_paused--;
+        serf__conn_set_dirty(conn);
+    }
+
     /* The request and response buckets are no longer needed,
        nor is the request's pool.  */
     if (request->resp_bkt) {
@@ -550,11 +1079,28 @@ static apr_status_t destroy_request(serf_request_t *request)
         request->req_bkt = NULL;
     }
 
+    /* Close its stream, which may still use the request's allocator. */
+    if (conn->http2)
+        serf__http2_request_destroyed(conn, request);
+
     if (request->respool) {
         serf_debug__bucket_alloc_check(request->allocator);
+        serf__log_alloc_stats(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__,
+                              conn->config, "request", request->allocator);
 
+        /* Keep the pool around for one of the next requests, so they can
+           reuse its memory instead of allocating their own. Clearing
+           the pool also destroys the request's bucket allocator. */
         /* ### unregister the pool cleanup for self?  */
-        apr_pool_destroy(request->respool);
+        if (conn->nr_of_spare_respools < MAX_SPARE_RESPOOLS) {
+            apr_pool_t *respool = request->respool;
+
+            apr_pool_clear(respool);
+            conn->spare_respools[conn->nr_of_spare_respools++] = respool;
+        }
+        else {
+            apr_pool_destroy(request->respool);
+        }
     }
 
     serf_bucket_mem_free(conn->allocator, request);
@@ -589,7 +1135,7 @@ static apr_status_t cancel_request(serf_request_t *request,
         }
     }
 
-    return destroy_request(request);
+    return serf__destroy_request(request);
 }
 
 /* Calculate the length of a linked list of requests. */
@@ -605,28 +1151,179 @@ static unsigned int req_list_length(serf_request_t *req)
     return length;
 }
 
-static apr_status_t remove_connection(serf_context_t *ctx,
-                                      serf_connection_t *conn)
+/* A socket was closed, inform the application. */
+static void handle_conn_closed(serf_connection_t *conn, apr_status_t status)
 {
-    apr_pollfd_t desc = { 0 };
+    (*conn->closed)(conn, conn->closed_baton, status,
+                    conn->pool);
+}
 
-    desc.desc_type = APR_POLL_SOCKET;
-    desc.desc.s = conn->skt;
-    desc.reqevents = conn->reqevents;
+/* Prepare REQUEST, of which the connection dropped while reading the
+   response, to continue the response on the next connection. Returns 0 if
+   it can't be resumed. */
+static int resume_request(serf_request_t *request)
+{
+    apr_uint64_t offset;
+    const char *validator;
 
-    return ctx->pollset_rm(ctx->pollset_baton,
-                           &desc, &conn->baton);
+    if (!request->resumable || request->timed_out || !request->resp_bkt
+        || !SERF_BUCKET_IS_RESPONSE(request->resp_bkt)
+        || !serf__bucket_response_get_resume_point(request->resp_bkt,
+                                                   &offset, &validator))
+        return 0;
+
+    /* Don't keep trying if nothing arrived since the last attempt. */
+    if (offset <= request->resume_offset)
+        return 0;
+
+    request->resume_offset = offset;
+    request->resume_validator = apr_pstrdup(request->respool, validator);
+
+    serf_debug__closed_conn(request->resp_bkt->allocator);
+    serf_bucket_destroy(request->resp_bkt);
+    request->resp_bkt = NULL;
+    if (request->req_bkt) {
+        serf_bucket_destroy(request->req_bkt);
+        request->req_bkt = NULL;
+    }
+    request->writing_started = 0;
+    request->written_time = 0;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, request->conn->config,
+              "resume request 0x%x at offset %" APR_UINT64_T_FMT "\n",
+              request, offset);
+
+    return 1;
 }
 
-/* A socket was closed, inform the application. */
-static void handle_conn_closed(serf_connection_t *conn, apr_status_t status)
+/* Returns the traits of the host of CONN, or NULL if none were stored yet.
+   They're created when CREATE is non-zero. */
+static serf__host_traits_t *get_host_traits(serf_connection_t *conn,
+                                            int create)
 {
-    (*conn->closed)(conn, conn->closed_baton, status,
-                    conn->pool);
+    void *traits = NULL;
+
+    if (!conn->config)
+        return NULL;
+
+    if (serf_config_get_object(conn->config, SERF__CONFIG_HOST_TRAITS,
+                               &traits))
+        return NULL;
+
+    if (!traits && create) {
+        serf__host_traits_t *new_traits;
+
+        new_traits = apr_pcalloc(conn->ctx->pool, sizeof(*new_traits));
+        new_traits->pipelining = 1;
+
+        if (serf_config_set_object(conn->config, SERF__CONFIG_HOST_TRAITS,
+                                   new_traits))
+            return NULL;
+        traits = new_traits;
+    }
+
+    return traits;
+}
+
+/* Remember the keepalive limit of CONN for new connections to its host. */
+static void store_keepalive_limit(serf_connection_t *conn)
+{
+    serf__host_traits_t *traits = get_host_traits(conn, 1);
+
+    if (traits && traits->keepalive_limit != conn->probable_keepalive_limit) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "keepalive limit of %s now %u\n", conn->host_url,
+                  conn->probable_keepalive_limit);
+        traits->keepalive_limit = conn->probable_keepalive_limit;
+    }
+}
+
+/* The defaults for adaptive pipelining, see
+   serf_connection_set_adaptive_pipelining(). */
+#define ADAPTIVE_MIN_DEPTH 1
+#define ADAPTIVE_MAX_DEPTH 64
+#define ADAPTIVE_INITIAL_DEPTH 2
+
+static void set_adaptive_depth(serf_connection_t *conn, unsigned int depth)
+{
+    if (depth < conn->min_depth)
+        depth = conn->min_depth;
+    if (depth > conn->max_depth)
+        depth = conn->max_depth;
+
+    if (depth != conn->max_outstanding_requests) {
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "pipelining depth of conn 0x%x now %u\n", conn, depth);
+        conn->max_outstanding_requests = depth;
+    }
+    conn->round_responses = 0;
+}
+
+/* Update the pipelining depth of CONN, now that the response to REQUEST
+   was handled. */
+static void adapt_depth_on_response(serf_connection_t *conn,
+                                    serf_request_t *request)
+{
+    unsigned int depth = conn->max_outstanding_requests;
+
+    if (request->written_time) {
+        apr_interval_time_t sample = apr_time_now() - request->written_time;
+
+        conn->srtt = conn->srtt ? (7 * conn->srtt + sample) / 8 : sample;
+    }
+
+    /* Decide once per round of responses. */
+    if (++conn->round_responses < depth)
+        return;
+
+    if (conn->latency > 0 && conn->srtt > 8 * conn->latency) {
+        /* The responses mostly wait for the ones before them, the server
+           doesn't handle the requests in parallel. More depth only means
+           more requests to send again when the connection drops. */
+        set_adaptive_depth(conn, depth - 1);
+    }
+    else if (conn->latency > 0 && conn->srtt > 2 * conn->latency) {
+        /* The pipeline is full enough to hide the latency. */
+        conn->round_responses = 0;
+    }
+    else if (conn->probable_keepalive_limit
+             && depth >= conn->probable_keepalive_limit) {
+        /* Don't send more than the server will answer on this socket. */
+        conn->round_responses = 0;
+    }
+    else {
+        set_adaptive_depth(conn, depth < conn->depth_threshold ? depth * 2
+                                                               : depth + 1);
+    }
+}
+
+/* Update the pipelining depth of CONN, which is about to be reset.
+   SERVER_CLOSED tells whether the server closed the connection. */
+static void adapt_depth_on_reset(serf_connection_t *conn, int server_closed)
+{
+    unsigned int depth = conn->max_outstanding_requests;
+
+    /* Requests in flight have to be sent again, so halve the depth and
+       grow more carefully from there on. */
+    if (conn->completed_requests > conn->completed_responses) {
+        depth /= 2;
+        conn->depth_threshold = depth;
+    }
+
+    /* The server is likely to close again after as many responses. */
+    if (server_closed && conn->completed_responses
+        && depth > conn->completed_responses)
+        depth = conn->completed_responses;
+
+    set_adaptive_depth(conn, depth);
 }
 
+/* Close the socket of CONN and prepare it for a new one. SERVER_CLOSED is
+   set when the server closed the connection, rather than serf giving up on
+   it; only then does it tell something about the keepalive limit. */
 static apr_status_t reset_connection(serf_connection_t *conn,
-                                     int requeue_requests)
+                                     int requeue_requests,
+                                     int server_closed)
 {
     serf_context_t *ctx = conn->ctx;
     apr_status_t status;
@@ -635,7 +1332,35 @@ static apr_status_t reset_connection(serf_connection_t *conn,
     serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
               "reset connection 0x%x\n", conn);
 
+    conn->metrics.resets++;
+    if (requeue_requests)
+        conn->metrics.requests_requeued += conn->nr_of_written_reqs;
+
+    serf__http2_teardown(conn);
+    stop_connect_race(conn);
+
+    /* The timers of the old socket. */
+    serf__timer_cancel(&ctx->timers, &conn->connect_timer);
+    serf__timer_cancel(&ctx->timers, &conn->idle_timer);
+    serf__timer_cancel(&ctx->timers, &conn->resume_timer);
+
+    if (conn->adaptive_pipelining)
+        adapt_depth_on_reset(conn, server_closed);
+
     conn->probable_keepalive_limit = conn->completed_responses;
+
+    /* A connection that closes before the first response tells us nothing
+       about the keepalive limit of the server, and neither does one that
+       timed out or was reset by the application. */
+    if (server_closed && conn->completed_responses) {
+        serf__host_traits_t *traits;
+
+        store_keepalive_limit(conn);
+
+        traits = get_host_traits(conn, 0);
+        if (traits && conn->adaptive_pipelining)
+            traits->pipelining_depth = conn->max_outstanding_requests;
+    }
     conn->completed_requests = 0;
     conn->completed_responses = 0;
 
@@ -649,8 +1374,18 @@ static apr_status_t reset_connection(serf_connection_t *conn,
        response yet. Inform the application that the request is cancelled, 
        so it can requeue them if needed. */
     while (conn->written_reqs) {
-        cancel_request(conn->written_reqs, &conn->written_reqs,
-                       requeue_requests);
+        serf_request_t *request = conn->written_reqs;
+
+        /* Resumed requests go first on the new socket. */
+        if (requeue_requests && resume_request(request)) {
+            conn->written_reqs = request->next;
+            request->next = NULL;
+            link_requests(&conn->unwritten_reqs, &conn->unwritten_reqs_tail,
+                          request);
+        }
+        else {
+            cancel_request(request, &conn->written_reqs, requeue_requests);
+        }
     }
     conn->written_reqs_tail = NULL;
 
@@ -691,14 +1426,23 @@ static apr_status_t reset_connection(serf_connection_t *conn,
         serf_bucket_destroy(conn->stream);
         conn->stream = NULL;
     }
+    if (conn->tunneled_stream != NULL) {
+        serf_bucket_destroy(conn->tunneled_stream);
+        conn->tunneled_stream = NULL;
+    }
 
     destroy_ostream(conn);
 
     /* Don't try to resume any writes */
-    conn->vec_len = 0;
+    conn->pending.vec_start = 0;
+    conn->pending.vec_len = 0;
+    conn->pending.sendfile_file = NULL;
+    conn->pending.sendfile_len = 0;
+
+    /* Start the new socket with fresh request pools. */
+    destroy_spare_respools(conn);
 
-    conn->dirty_conn = 1;
-    conn->ctx->dirty_pollset = 1;
+    serf__conn_set_dirty(conn);
     conn->state = SERF_CONN_INIT;
 
     conn->status = APR_SUCCESS;
@@ -714,68 +1458,312 @@ static apr_status_t reset_connection(serf_connection_t *conn,
     return APR_SUCCESS;
 }
 
-static apr_status_t socket_writev(serf_connection_t *conn)
+static apr_status_t connect_timed_out(serf__timer_t *timer)
+{
+    serf_connection_t *conn = timer->baton;
+
+    serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, conn->config,
+              "connect timed out on conn 0x%x\n", conn);
+
+    /* Try the next address of a multi-homed server, as when the
+       connection is refused. */
+    if (conn->completed_requests == 0 && conn->address->next != NULL
+        && !conn->happy_eyeballs) {
+        conn->address = conn->address->next;
+        return reset_connection(conn, 1, 0);
+    }
+
+    stop_connect_race(conn);
+    conn->status = SERF_ERROR_CONNECTION_TIMEDOUT;
+    return conn->status;
+}
+
+static apr_status_t idle_timed_out(serf__timer_t *timer)
+{
+    serf_connection_t *conn = timer->baton;
+
+    /* Requests queued since the pollset was last updated. */
+    if (conn->written_reqs || conn->unwritten_reqs)
+        return APR_SUCCESS;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "closing idle conn 0x%x\n", conn);
+
+    /* Warm or not, it is opened again for the next request. */
+    conn->prewarm = 0;
+
+    return reset_connection(conn, 1, 0);
+}
+
+/* Cancel REQUEST, which is queued on CONN, and notify its handler. */
+static apr_status_t cancel_queued_request(serf_connection_t *conn,
+                                          serf_request_t *request,
+                                          int written)
+{
+    serf_request_t **list = written ? &conn->written_reqs
+                                    : &conn->unwritten_reqs;
+    serf_request_t **tail = written ? &conn->written_reqs_tail
+                                    : &conn->unwritten_reqs_tail;
+    serf_request_t *prev = NULL;
+    serf_request_t *scan;
+
+    for (scan = *list; scan && scan != request; scan = scan->next)
+        prev = scan;
+    if (!scan)
+        return APR_NOTFOUND;
+
+    if (*tail == request)
+        *tail = prev;
+    if (written)
+        conn->nr_of_written_reqs--;
+    else
+        conn->nr_of_unwritten_reqs--;
+
+    serf__conn_set_dirty(conn);
+
+    return cancel_request(request, list, 1);
+}
+
+static apr_status_t request_timed_out(serf__timer_t *timer)
+{
+    serf_request_t *request = timer->baton;
+    serf_connection_t *conn = request->conn;
+
+    serf__log(LOGLVL_WARNING, LOGCOMP_CONN, __FILE__, conn->config,
+              "request 0x%x timed out on conn 0x%x\n", request, conn);
+
+    request->timed_out = 1;
+
+    if (!request->writing_started) {
+        /* Only a request that is set up has a handler to tell. */
+        if (!request->handler) {
+            apr_status_t status = serf__setup_request(request);
+            if (status)
+                return status;
+        }
+        return cancel_queued_request(conn, request, 0);
+    }
+
+    /* HTTP/2 just resets the stream of the request. */
+    if (conn->http2)
+        return cancel_queued_request(conn, request, 1);
+
+    /* An HTTP/1.1 connection can't skip a response; start over with a new
+       connection, on which the other requests are retried. */
+    return reset_connection(conn, 1, 0);
+}
+
+/* Deliver what arrived while reading from CONN was paused. It may already
+   sit in the buckets, and then the socket won't tell us again. */
+static apr_status_t reading_resumed(serf__timer_t *timer)
+{
+    serf_connection_t *conn = timer->baton;
+
+    if (!conn->skt || conn->read_paused)
+        return APR_SUCCESS;
+
+    if (!conn->http2 && !conn->written_reqs && !conn->unwritten_reqs)
+        return APR_SUCCESS;
+
+    return serf__process_connection(conn, APR_POLLIN);
+}
+
+/* Remove the first WRITTEN bytes from the pending iovecs of PENDING, as
+   they were sent on the socket. Returns how many of the WRITTEN bytes came
+   after that data.
+
+   The pending iovecs start at pending->vec_start, which moves forward over
+   the written ones, so a short write costs no copying. The buffers in
+   the iovecs belong to the buckets of the output stream and stay valid
+   only until the next read of the stream, so pending->vec is refilled once
+   all of them are written, from the start. */
+static apr_size_t vecs_written(serf__pending_t *pending, apr_size_t written,
+                               serf_config_t *config)
+{
+    apr_size_t len = 0;
+    int log_raw = serf__log_enabled(LOGLVL_DEBUG, LOGCOMP_RAWMSG, config);
+
+    while (pending->vec_len) {
+        struct iovec *vec = &pending->vec[pending->vec_start];
+
+        if (written - len < vec->iov_len) {
+            apr_size_t part = written - len;
+
+            if (log_raw)
+                serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, config,
+                                 "%.*s", part, vec->iov_base);
+            vec->iov_base = (char *)vec->iov_base + part;
+            vec->iov_len -= part;
+            return 0;
+        }
+
+        if (log_raw)
+            serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, config,
+                             "%.*s", vec->iov_len, vec->iov_base);
+        len += vec->iov_len;
+        pending->vec_start++;
+        pending->vec_len--;
+    }
+
+    /* we wrote everything. */
+    pending->vec_start = 0;
+
+    return written - len;
+}
+
+apr_status_t serf__pending_write(serf__pending_t *pending,
+                                 apr_socket_t *skt,
+                                 serf__trace_t *trace,
+                                 apr_uint32_t trace_id,
+                                 serf_config_t *config,
+                                 apr_size_t *written)
+{
+    apr_size_t file_written;
+    apr_status_t status;
+
+#if APR_HAS_SENDFILE
+    /* Send the iovecs followed by the file data, without copying the file
+       data to userspace. */
+    if (pending->sendfile_len) {
+        apr_hdtr_t hdtr;
+        apr_off_t offset = pending->sendfile_offset;
+
+        hdtr.headers = &pending->vec[pending->vec_start];
+        hdtr.numheaders = pending->vec_len;
+        hdtr.trailers = NULL;
+        hdtr.numtrailers = 0;
+
+        *written = pending->sendfile_len;
+        status = apr_socket_sendfile(skt, pending->sendfile_file, &hdtr,
+                                     &offset, written, 0);
+        if (status && !APR_STATUS_IS_EAGAIN(status))
+            serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, config,
+                      "socket_sendfile error %d\n", status);
+    }
+    else
+#endif
+    {
+        status = apr_socket_sendv(skt, &pending->vec[pending->vec_start],
+                                  pending->vec_len, written);
+        if (status && !APR_STATUS_IS_EAGAIN(status))
+            serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, config,
+                      "socket_sendv error %d\n", status);
+    }
+
+    if (!*written)
+        return status;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, config,
+              "--- socket_write: %d bytes. --\n", *written);
+
+    /* Only the data in the iovecs is sampled, not the file data. */
+    if (trace)
+        serf__trace(trace, trace_id, SERF_TRACE_SEND,
+                    &pending->vec[pending->vec_start], pending->vec_len,
+                    *written);
+
+    file_written = vecs_written(pending, *written, config);
+    if (file_written) {
+        serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, config,
+                         "[%d bytes of file data]", file_written);
+
+        pending->sendfile_offset += file_written;
+        pending->sendfile_len -= file_written;
+        if (!pending->sendfile_len)
+            pending->sendfile_file = NULL;
+    }
+    serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, config, "\n");
+
+    return status;
+}
+
+/* Write the pending data of CONN to its socket. */
+static apr_status_t socket_write(serf_connection_t *conn)
 {
     apr_size_t written;
     apr_status_t status;
 
-    status = apr_socket_sendv(conn->skt, conn->vec,
-                              conn->vec_len, &written);
-    if (status && !APR_STATUS_IS_EAGAIN(status))
-        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
-                  "socket_sendv error %d\n", status);
+    status = serf__pending_write(&conn->pending, conn->skt, conn->ctx->trace,
+                                 conn->id, conn->config, &written);
 
-    /* did we write everything? */
+    /* Log progress information */
     if (written) {
-        apr_size_t len = 0;
-        int i;
+        conn->progress_written += written;
+        serf__context_progress_delta(conn->ctx, 0, written);
+    }
 
-        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
-                  "--- socket_sendv: %d bytes. --\n", written);
-
-        for (i = 0; i < conn->vec_len; i++) {
-            len += conn->vec[i].iov_len;
-            if (written < len) {
-                serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, conn->config,
-                                 "%.*s", conn->vec[i].iov_len - (len - written),
-                                 conn->vec[i].iov_base);
-                if (i) {
-                    memmove(conn->vec, &conn->vec[i],
-                            sizeof(struct iovec) * (conn->vec_len - i));
-                    conn->vec_len -= i;
-                }
-                conn->vec[0].iov_base = (char *)conn->vec[0].iov_base + (conn->vec[0].iov_len - (len - written));
-                conn->vec[0].iov_len = len - written;
-                break;
-            } else {
-                serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, conn->config,
-                                 "%.*s",
-                                 conn->vec[i].iov_len, conn->vec[i].iov_base);
+    return status;
+}
+
+/* Write out the output stream, for protocol engines that queue their
+   own data on it. */
+apr_status_t serf__connection_flush(serf_connection_t *conn)
+{
+    while (1) {
+        apr_status_t status;
+
+        while (conn->pending.vec_len || conn->pending.sendfile_len) {
+            status = socket_write(conn);
+            if (APR_STATUS_IS_EAGAIN(status))
+                return APR_EAGAIN;
+
+            /* The server closed the connection, the read side will tell
+               us why. */
+            if (APR_STATUS_IS_EPIPE(status)
+                || APR_STATUS_IS_ECONNRESET(status)
+                || APR_STATUS_IS_ECONNABORTED(status)) {
+                no_more_writes(conn);
+                return APR_EAGAIN;
             }
+            if (status)
+                return status;
+        }
+
+        if (conn->stop_writing || conn->state == SERF_CONN_CLOSING)
+            return APR_EAGAIN;
+
+        status = serf_bucket_read_iovec(conn->ostream_head,
+                                        SERF_READ_ALL_AVAIL, IOV_MAX,
+                                        conn->pending.vec,
+                                        &conn->pending.vec_len);
+        conn->hit_eof = 0;
+
+        if (status == SERF_ERROR_WAIT_CONN) {
+            /* The SSL layer needs to read before it can write. */
+            serf__conn_stop_writing(conn);
         }
-        if (len == written) {
-            conn->vec_len = 0;
+        else if (SERF_BUCKET_READ_ERROR(status)) {
+            return status;
         }
-        serf__log_nopref(LOGLVL_DEBUG, LOGCOMP_RAWMSG, conn->config, "\n");
 
-        /* Log progress information */
-        serf__context_progress_delta(conn->ctx, 0, written);
+        if (!conn->pending.vec_len)
+            return conn->stop_writing ? APR_EAGAIN : APR_SUCCESS;
     }
-
-    return status;
 }
 
-static apr_status_t setup_request(serf_request_t *request)
+apr_status_t serf__setup_request(serf_request_t *request)
 {
     serf_connection_t *conn = request->conn;
     apr_status_t status;
 
-    /* Now that we are about to serve the request, allocate a pool. */
-    apr_pool_create(&request->respool, conn->pool);
-    request->allocator = serf_bucket_allocator_create(request->respool,
-                                                      NULL, NULL);
-    apr_pool_cleanup_register(request->respool, request,
-                              clean_resp, apr_pool_cleanup_null);
+    /* Now that we are about to serve the request, allocate a pool, or
+       take one of a finished request. A resumed request keeps its own. */
+    if (!request->respool) {
+        if (conn->nr_of_spare_respools) {
+            request->respool =
+                conn->spare_respools[--conn->nr_of_spare_respools];
+        }
+        else {
+            apr_pool_create(&request->respool, conn->pool);
+        }
+        request->allocator = serf_bucket_allocator_create(request->respool,
+                                                          NULL, NULL);
+        /* Collect what is logged when the request is destroyed. */
+        if (serf__log_enabled(LOGLVL_DEBUG, LOGCOMP_CONN, conn->config))
+            serf_bucket_allocator_enable_stats(request->allocator);
+        apr_pool_cleanup_register(request->respool, request,
+                                  clean_resp, apr_pool_cleanup_null);
+    }
 
     /* Fill in the rest of the values for the request. */
     status = request->setup(request, request->setup_baton,
@@ -785,17 +1773,45 @@ static apr_status_t setup_request(serf_request_t *request)
                             &request->handler,
                             &request->handler_baton,
                             request->respool);
-    return status;
+    if (status || !request->resumable)
+        return status;
+
+    /* Only GET requests can be resumed. */
+    if (SERF_BUCKET_IS_REQUEST(request->req_bkt)) {
+        const char *uri, *method;
+        apr_int64_t content_length;
+
+        serf__bucket_request_read(request->req_bkt, NULL, &uri, &method,
+                                  &content_length);
+        if (strcmp(method, "GET") == 0) {
+            if (request->resume_offset) {
+                serf_bucket_t *hdrs;
+
+                /* Ask for the rest of the same representation. */
+                hdrs = serf_bucket_request_get_headers(request->req_bkt);
+                serf_bucket_headers_set(hdrs, "Range",
+                    apr_psprintf(request->respool,
+                                 "bytes=%" APR_UINT64_T_FMT "-",
+                                 request->resume_offset));
+                serf_bucket_headers_set(hdrs, "If-Range",
+                                        request->resume_validator);
+            }
+            return APR_SUCCESS;
+        }
+    }
+
+    request->resumable = 0;
+
+    return APR_SUCCESS;
 }
 
 /* write data out to the connection */
-static apr_status_t write_to_connection(serf_connection_t *conn)
+static apr_status_t write_requests(serf_connection_t *conn)
 {
     if (conn->probable_keepalive_limit &&
         conn->completed_requests > conn->probable_keepalive_limit) {
 
-        conn->dirty_conn = 1;
-        conn->ctx->dirty_pollset = 1;
+        serf__conn_set_dirty(conn);
 
         /* backoff for now. */
         return APR_SUCCESS;
@@ -807,6 +1823,7 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
     while (1) {
         serf_request_t *request;
         int stop_reading = 0;
+        int negotiating;
         apr_status_t status;
         apr_status_t read_status;
         serf_bucket_t *ostreamt;
@@ -841,8 +1858,8 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
         }
 
         /* If we have unwritten data, then write what we can. */
-        while (conn->vec_len) {
-            status = socket_writev(conn);
+        while (conn->pending.vec_len || conn->pending.sendfile_len) {
+            status = socket_write(conn);
 
             /* If the write would have blocked, then we're done. Don't try
              * to write anything else to the socket.
@@ -860,6 +1877,13 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
            ### would imply unwritten_len > 0 ... */
         /* assert: unwritten_len == 0. */
 
+        /* The framing type was negotiated while we wrote, the HTTP/2
+           engine writes the requests then. */
+        if (conn->http2) {
+            serf__conn_set_dirty(conn);
+            return APR_SUCCESS;
+        }
+
         /* We may need to move forward to a request which has something
          * to write.
          */
@@ -869,8 +1893,7 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
              * Let's update the pollset so that we don't try to write to this
              * socket again.
              */
-            conn->dirty_conn = 1;
-            conn->ctx->dirty_pollset = 1;
+            serf__conn_set_dirty(conn);
             return APR_SUCCESS;
         }
 
@@ -879,9 +1902,15 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             return status;
         }
 
+        /* Until the framing type is known only the handshake is written. */
+        negotiating = conn->framing_type == SERF_CONNECTION_FRAMING_TYPE_NONE
+                      && conn->state == SERF_CONN_CONNECTED;
+        if (negotiating)
+            request = NULL;
+
         if (request) {
             if (request->req_bkt == NULL) {
-                read_status = setup_request(request);
+                read_status = serf__setup_request(request);
                 if (read_status) {
                     /* Something bad happened. Propagate any errors. */
                     return read_status;
@@ -890,20 +1919,49 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
 
             if (!request->writing_started) {
                 request->writing_started = 1;
+                serf__connection_request_started(conn, request);
                 serf_bucket_aggregate_append(ostreamt, request->req_bkt);
             }
         }
 
-        /* ### optimize at some point by using read_for_sendfile */
         /* TODO: now that read_iovec will effectively try to return as much
            data as available, we probably don't want to read ALL_AVAIL, but
            a lower number, like the size of one or a few TCP packets, the
            available TCP buffer size ... */
+#if APR_HAS_SENDFILE
+        {
+            apr_hdtr_t hdtr;
+
+            /* File buckets (passed through by the aggregate buckets) hand
+               out their file here, so we can send it without copying it
+               through memory. On TLS connections the encrypt bucket is in
+               the way, so we get only iovecs there. */
+            hdtr.headers = conn->pending.vec;
+            hdtr.numheaders = IOV_MAX;
+            hdtr.trailers = NULL;
+            hdtr.numtrailers = 0;
+
+            read_status = serf_bucket_read_for_sendfile(
+                              ostreamh, SERF_READ_ALL_AVAIL, &hdtr,
+                              &conn->pending.sendfile_file,
+                              &conn->pending.sendfile_offset,
+                              &conn->pending.sendfile_len);
+            conn->pending.vec_len = hdtr.numheaders;
+            if (conn->pending.sendfile_file == NULL)
+                conn->pending.sendfile_len = 0;
+        }
+#else
         read_status = serf_bucket_read_iovec(ostreamh,
                                              SERF_READ_ALL_AVAIL,
                                              IOV_MAX,
-                                             conn->vec,
-                                             &conn->vec_len);
+                                             conn->pending.vec,
+                                             &conn->pending.vec_len);
+#endif
+
+        /* No request was appended, so the end of the output stream
+           isn't the end of one. */
+        if (negotiating)
+            conn->hit_eof = 0;
 
         if (!conn->hit_eof) {
             if (APR_STATUS_IS_EAGAIN(read_status)) {
@@ -921,9 +1979,7 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
                    end up in a CPU spin: socket wants something, but we
                    don't have anything (and keep returning EAGAIN)
                  */
-                conn->stop_writing = 1;
-                conn->dirty_conn = 1;
-                conn->ctx->dirty_pollset = 1;
+                serf__conn_stop_writing(conn);
             }
             else if (read_status && !APR_STATUS_IS_EOF(read_status)) {
                 /* Something bad happened. Propagate any errors. */
@@ -933,8 +1989,8 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
 
         /* If we got some data, then deliver it. */
         /* ### what to do if we got no data?? is that a problem? */
-        if (conn->vec_len > 0) {
-            status = socket_writev(conn);
+        if (conn->pending.vec_len > 0 || conn->pending.sendfile_len > 0) {
+            status = socket_write(conn);
 
             /* If we can't write any more, or an error occurred, then
              * we're done here.
@@ -951,12 +2007,11 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
 
         if (read_status == SERF_ERROR_WAIT_CONN) {
             stop_reading = 1;
-            conn->stop_writing = 1;
-            conn->dirty_conn = 1;
-            conn->ctx->dirty_pollset = 1;
+            serf__conn_stop_writing(conn);
         }
         else if (request && read_status && conn->hit_eof &&
-                 conn->vec_len == 0) {
+                 conn->pending.vec_len == 0 &&
+                 conn->pending.sendfile_len == 0) {
             /* If we hit the end of the request bucket and all of its data has
              * been written, then clear it out to signify that we're done
              * sending the request. On the next iteration through this loop:
@@ -969,6 +2024,17 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             serf_bucket_destroy(request->req_bkt);
             request->req_bkt = NULL;
 
+            if (conn->adaptive_pipelining)
+                request->written_time = apr_time_now();
+
+            if (request->first_byte_timeout)
+                serf__timer_schedule(&conn->ctx->timers,
+                                     &request->first_byte_timer,
+                                     apr_time_now()
+                                     + request->first_byte_timeout);
+
+            request->timings.written = apr_time_now();
+
             /* Move the request to the written queue */
             link_requests(&conn->written_reqs, &conn->written_reqs_tail,
                           request);
@@ -983,10 +2049,11 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
             if (conn->async_responses) {
                 conn->unwritten_reqs = request->next;
                 conn->nr_of_unwritten_reqs--;
-                destroy_request(request);
+                serf__destroy_request(request);
             }
 
             conn->completed_requests++;
+            serf__connection_request_written(conn);
 
             if (conn->probable_keepalive_limit &&
                 conn->completed_requests > conn->probable_keepalive_limit) {
@@ -1002,9 +2069,30 @@ static apr_status_t write_to_connection(serf_connection_t *conn)
     /* NOTREACHED */
 }
 
+/* Write to CONN as much as we can now. With corking enabled the kernel
+   holds back partial segments until we're done, so a burst of small
+   requests goes out in full segments rather than one per write. */
+static apr_status_t write_to_connection(serf_connection_t *conn)
+{
+    apr_status_t status;
+
+    if (!conn->cork)
+        return write_requests(conn);
+
+    /* APR maps this on TCP_CORK or TCP_NOPUSH, where available. */
+    (void) apr_socket_opt_set(conn->skt, APR_TCP_NOPUSH, 1);
+
+    status = write_requests(conn);
+
+    if (conn->skt)
+        (void) apr_socket_opt_set(conn->skt, APR_TCP_NOPUSH, 0);
+
+    return status;
+}
+
 /* A response message was received from the server, so call
    the handler as specified on the original request. */
-static apr_status_t handle_response(serf_request_t *request,
+apr_status_t serf__handle_response(serf_request_t *request,
                                     apr_pool_t *pool)
 {
     int consumed_response = 0;
@@ -1147,7 +2235,7 @@ serf__provide_credentials(serf_context_t *ctx,
         if (!authn_req->req_bkt) {
             apr_status_t status;
 
-            status = setup_request(authn_req);
+            status = serf__setup_request(authn_req);
             /* If we can't setup a request, don't bother setting up the
                ssl tunnel. */
             if (status)
@@ -1183,11 +2271,7 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
 
     /* If the stop_writing flag was set on the connection, reset it now because
        there is some data to read. */
-    if (conn->stop_writing) {
-        conn->stop_writing = 0;
-        conn->dirty_conn = 1;
-        conn->ctx->dirty_pollset = 1;
-    }
+    serf__conn_continue_writing(conn);
 
     /* assert: request != NULL */
 
@@ -1200,6 +2284,12 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
 
         apr_pool_clear(tmppool);
 
+        /* The handler paused reading, see serf_request_pause_reading(). */
+        if (conn->read_paused) {
+            status = APR_SUCCESS;
+            goto error;
+        }
+
         /* Only interested in the input stream here. */
         status = prepare_conn_streams(conn, &dummy1, &dummy2);
         if (status) {
@@ -1248,7 +2338,7 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
             status = serf_bucket_peek(conn->stream, &data, &len);
 
             if (APR_STATUS_IS_EOF(status)) {
-                reset_connection(conn, 1);
+                reset_connection(conn, 1, 1);
                 status = APR_SUCCESS;
                 goto error;
             }
@@ -1278,11 +2368,32 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
                                                      tmppool);
             apr_pool_clear(tmppool);
 
+            serf__timer_cancel(&conn->ctx->timers,
+                               &request->first_byte_timer);
+            request->timings.first_byte = apr_time_now();
+
+            if (request->resume_offset
+                && SERF_BUCKET_IS_RESPONSE(request->resp_bkt))
+                serf__bucket_response_set_resume(request->resp_bkt,
+                                                 request->resume_offset,
+                                                 request->resume_validator);
+
             /* Share the configuration with the response bucket(s) */
             serf_bucket_set_config(request->resp_bkt, conn->config);
         }
 
-        status = handle_response(request, tmppool);
+        status = serf__handle_response(request, tmppool);
+
+        /* The proxy asked for authentication, but the TLS handshake that
+           followed the CONNECT request can't be taken back: the proxy takes
+           it for the next request. Send the CONNECT request again, with the
+           credentials, on a new connection. */
+        if (request->ssltunnel && conn->tunneled_stream
+            && APR_STATUS_IS_EOF(status)) {
+            reset_connection(conn, 1, 0);
+            status = APR_SUCCESS;
+            goto error;
+        }
 
         /* If we received APR_SUCCESS, run this loop again. */
         if (!status) {
@@ -1299,7 +2410,7 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
              * If it has never tried again (incl. a retry), fail.
              */
             if (conn->completed_responses) {
-                reset_connection(conn, 1);
+                reset_connection(conn, 1, 1);
                 status = APR_SUCCESS;
             }
             else if (status == SERF_ERROR_REQUEST_LOST) {
@@ -1316,8 +2427,14 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
            on a connection using HTTP pipelining, we reset the connection,
            disable pipelining and reconnect to the server. */
         if (status == SERF_ERROR_SSL_NEGOTIATE_IN_PROGRESS) {
+            serf__host_traits_t *traits = get_host_traits(conn, 1);
+
+            /* The next connections to this server will run into this too. */
+            if (traits)
+                traits->pipelining = 0;
+
             serf__connection_set_pipelining(conn, 0);
-            reset_connection(conn, 1);
+            reset_connection(conn, 1, 0);
             status = APR_SUCCESS;
             goto error;
         }
@@ -1331,8 +2448,7 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
                serf will not check for socket writability, so force this here.
              */
             if (request_or_data_pending(&request, conn) && !request) {
-                conn->dirty_conn = 1;
-                conn->ctx->dirty_pollset = 1;
+                serf__conn_set_dirty(conn);
             }
             status = APR_SUCCESS;
             goto error;
@@ -1362,7 +2478,11 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
             conn->nr_of_unwritten_reqs--;
         }
 
-        destroy_request(request);
+        if (conn->adaptive_pipelining)
+            adapt_depth_on_response(conn, request);
+
+        serf__connection_request_completed(conn, request);
+        serf__destroy_request(request);
 
         request = conn->written_reqs;
         if (!request) {
@@ -1380,13 +2500,12 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
            requests on this connection, we should stop polling for READ events
            for now. */
         if (!conn->written_reqs && !conn->unwritten_reqs) {
-            conn->dirty_conn = 1;
-            conn->ctx->dirty_pollset = 1;
+            serf__conn_set_dirty(conn);
         }
 
         /* This means that we're being advised that the connection is done. */
         if (close_connection == SERF_ERROR_CLOSING) {
-            reset_connection(conn, 1);
+            reset_connection(conn, 1, 1);
             if (APR_STATUS_IS_EOF(status))
                 status = APR_SUCCESS;
             goto error;
@@ -1400,6 +2519,7 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
         if (conn->probable_keepalive_limit &&
             conn->completed_responses > conn->probable_keepalive_limit) {
             conn->probable_keepalive_limit = 0;
+            store_keepalive_limit(conn);
         }
 
         /* If we just ran out of requests or have unwritten requests, then
@@ -1407,30 +2527,93 @@ static apr_status_t read_from_connection(serf_connection_t *conn)
          * more. We are definitely done with this loop, too.
          */
         if (request == NULL || !request->writing_started) {
-            conn->dirty_conn = 1;
-            conn->ctx->dirty_pollset = 1;
+            serf__conn_set_dirty(conn);
             status = APR_SUCCESS;
             goto error;
         }
     }
 
-error:
-    apr_pool_destroy(tmppool);
-    return status;
+error:
+    apr_pool_destroy(tmppool);
+    return status;
+}
+
+/* Drive the setup of CONN while it has no requests. The TLS handshake is
+   done by the ssl buckets as data is read from the connection, and they
+   queue what they have to send on the output stream. */
+static apr_status_t warm_up(serf_connection_t *conn)
+{
+    serf_bucket_t *dummy1, *dummy2;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    status = prepare_conn_streams(conn, &dummy1, &dummy2);
+    if (status)
+        return status;
+
+    conn->prewarm_started = 1;
+
+    status = serf_bucket_peek(conn->stream, &data, &len);
+
+    /* The handshake selected HTTP/2. Its engine takes over from here,
+       starting with what the server sent already. */
+    if (conn->http2) {
+        serf__conn_set_dirty(conn);
+
+        status = serf__http2_read(conn);
+        if (status == SERF_ERROR_CLOSING)
+            return reset_connection(conn, 1, 1);
+        return status;
+    }
+
+    if (APR_STATUS_IS_EOF(status)
+        || (!SERF_BUCKET_READ_ERROR(status) && len)) {
+        /* Closed or talked to before we asked anything. Leave it to the
+           next request to open a new connection. */
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "warm conn 0x%x closed by server\n", conn);
+        conn->prewarm = 0;
+        return reset_connection(conn, 1, 1);
+    }
+    if (SERF_BUCKET_READ_ERROR(status))
+        return status;
+
+    /* Maybe there's something to write now. */
+    serf__conn_set_dirty(conn);
+
+    return APR_SUCCESS;
 }
 
-/* process all events on the connection */
-apr_status_t serf__process_connection(serf_connection_t *conn,
-                                      apr_int16_t events)
+static apr_status_t process_connection(serf_connection_t *conn,
+                                       apr_int16_t events)
 {
+    int warming;
     apr_status_t status;
 
+    /* Any event means the socket is done connecting. */
+    serf__timer_cancel(&conn->ctx->timers, &conn->connect_timer);
+    if (!conn->timings.connect_done)
+        conn->timings.connect_done = apr_time_now();
+
+    warming = setting_up(conn);
+
     /* POLLHUP/ERR should come after POLLIN so if there's an error message or
      * the like sitting on the connection, we give the app a chance to read
      * it before we trigger a reset condition.
      */
     if ((events & APR_POLLIN) != 0) {
-        if ((status = read_from_connection(conn)) != APR_SUCCESS)
+        if (conn->http2)
+            status = serf__http2_read(conn);
+        else if (warming)
+            status = warm_up(conn);
+        else
+            status = read_from_connection(conn);
+
+        /* The HTTP/2 engine leaves resetting the connection to us. */
+        if (status == SERF_ERROR_CLOSING)
+            return reset_connection(conn, 1, 1);
+        if (status)
             return status;
 
         /* If we decided to reset our connection, return now as we don't
@@ -1447,7 +2630,11 @@ apr_status_t serf__process_connection(serf_connection_t *conn,
            If we haven't had any successful responses on this connection,
            then error out as it is likely a server issue. */
         if (conn->completed_responses) {
-            return reset_connection(conn, 1);
+            return reset_connection(conn, 1, 1);
+        }
+        if (warming) {
+            conn->prewarm = 0;
+            return reset_connection(conn, 1, 1);
         }
         return SERF_ERROR_ABORTED_CONNECTION;
     }
@@ -1460,52 +2647,68 @@ apr_status_t serf__process_connection(serf_connection_t *conn,
          * http://issues.apache.org/bugzilla/show_bug.cgi?id=35292
          */
         if (conn->completed_requests && !conn->probable_keepalive_limit) {
-            return reset_connection(conn, 1);
+            return reset_connection(conn, 1, 1);
         }
-#ifdef SO_ERROR
-        /* If possible, get the error from the platform's socket layer and
-           convert it to an APR status code. */
-        {
-            apr_os_sock_t osskt;
-            if (!apr_os_sock_get(&osskt, conn->skt)) {
-                int error;
-                apr_socklen_t l = sizeof(error);
-
-                if (!getsockopt(osskt, SOL_SOCKET, SO_ERROR, (char*)&error,
-                                &l)) {
-                    status = APR_FROM_OS_ERROR(error);
-
-                    /* Handle fallback for multi-homed servers.
-                     
-                       ### Improve algorithm to find better than just 'next'?
-
-                       Current Windows versions already handle re-ordering for
-                       api users by using statistics on the recently failed
-                       connections to order the list of addresses. */
-                    if (conn->completed_requests == 0
-                        && conn->address->next != NULL
-                        && (APR_STATUS_IS_ECONNREFUSED(status)
-                            || APR_STATUS_IS_TIMEUP(status)
-                            || APR_STATUS_IS_ENETUNREACH(status))) {
-
-                        conn->address = conn->address->next;
-                        return reset_connection(conn, 1);
-                    }
-
-                    return status;
-                  }
-            }
+
+        status = get_socket_error(conn->skt);
+
+        /* Handle fallback for multi-homed servers.
+
+           ### Improve algorithm to find better than just 'next'?
+
+           Current Windows versions already handle re-ordering for
+           api users by using statistics on the recently failed
+           connections to order the list of addresses. */
+        if (conn->completed_requests == 0
+            && conn->address->next != NULL
+            && !conn->happy_eyeballs
+            && (APR_STATUS_IS_ECONNREFUSED(status)
+                || APR_STATUS_IS_TIMEUP(status)
+                || APR_STATUS_IS_ENETUNREACH(status))) {
+
+            conn->address = conn->address->next;
+            return reset_connection(conn, 1, 0);
         }
-#endif
-        return APR_EGENERAL;
+
+        return status;
     }
     if ((events & APR_POLLOUT) != 0) {
-        if ((status = write_to_connection(conn)) != APR_SUCCESS)
+        if (warming && !conn->prewarm_started) {
+            /* Connected, start the setup. */
+            if ((status = warm_up(conn)) != APR_SUCCESS)
+                return status;
+            if ((conn->seen_in_pollset & APR_POLLHUP) != 0)
+                return APR_SUCCESS;
+        }
+
+        if (conn->http2)
+            status = serf__http2_write(conn);
+        else
+            status = write_to_connection(conn);
+
+        if (status == SERF_ERROR_CLOSING)
+            return reset_connection(conn, 1, 1);
+        if (status)
             return status;
     }
     return APR_SUCCESS;
 }
 
+/* process all events on the connection */
+apr_status_t serf__process_connection(serf_connection_t *conn,
+                                      apr_int16_t events)
+{
+    serf_context_t *ctx = conn->ctx;
+    serf_connection_t *progress_conn = ctx->progress_conn;
+    apr_status_t status;
+
+    ctx->progress_conn = conn;
+    status = process_connection(conn, events);
+    ctx->progress_conn = progress_conn;
+
+    return status;
+}
+
 serf_connection_t *serf_connection_create(
     serf_context_t *ctx,
     apr_sockaddr_t *address,
@@ -1518,6 +2721,7 @@ serf_connection_t *serf_connection_create(
     serf_connection_t *conn = apr_pcalloc(pool, sizeof(*conn));
 
     conn->ctx = ctx;
+    conn->id = ++ctx->last_conn_id;
     conn->status = APR_SUCCESS;
     /* Ignore server address if proxy was specified. */
     conn->address = ctx->proxy_address ? ctx->proxy_address : address;
@@ -1528,6 +2732,7 @@ serf_connection_t *serf_connection_create(
     conn->pool = pool;
     conn->allocator = serf_bucket_allocator_create(pool, NULL, NULL);
     conn->stream = NULL;
+    conn->tunneled_stream = NULL;
     conn->ostream_head = NULL;
     conn->ostream_tail = NULL;
     conn->baton.type = SERF_IO_CONN;
@@ -1536,6 +2741,11 @@ serf_connection_t *serf_connection_create(
     conn->state = SERF_CONN_INIT;
     conn->latency = -1; /* unknown */
     conn->pipelining = 1;
+    conn->framing_type = SERF_CONNECTION_FRAMING_TYPE_HTTP1;
+    serf__timer_init(&conn->connect_timer, connect_timed_out, conn);
+    serf__timer_init(&conn->idle_timer, idle_timed_out, conn);
+    serf__timer_init(&conn->attempt_timer, attempt_delay_passed, conn);
+    serf__timer_init(&conn->resume_timer, reading_resumed, conn);
 
     /* Create a subpool for our connection. */
     apr_pool_create(&conn->skt_pool, conn->pool);
@@ -1550,10 +2760,13 @@ serf_connection_t *serf_connection_create(
     return conn;
 }
 
-apr_status_t serf_connection_create2(
+/* Create a connection to the server in HOST_INFO. Its address is looked
+   up right away, or in the background if ASYNC is non-zero. */
+static apr_status_t create_connection(
     serf_connection_t **conn,
     serf_context_t *ctx,
     apr_uri_t host_info,
+    int async,
     serf_connection_setup_t setup,
     void *setup_baton,
     serf_connection_closed_t closed,
@@ -1563,7 +2776,9 @@ apr_status_t serf_connection_create2(
     apr_status_t status = APR_SUCCESS;
     serf_config_t *config;
     serf_connection_t *c;
+    serf__host_traits_t *traits;
     apr_sockaddr_t *host_address = NULL;
+    apr_time_t lookup_start = 0, lookup_done = 0;
 
     /* Set the port number explicitly, needed to create the socket later. */
     if (!host_info.port) {
@@ -1572,16 +2787,30 @@ apr_status_t serf_connection_create2(
 
     /* Only lookup the address of the server if no proxy server was
        configured. */
-    if (!ctx->proxy_address) {
+    if (!ctx->proxy_address && !async) {
+        lookup_start = apr_time_now();
         status = apr_sockaddr_info_get(&host_address,
                                        host_info.hostname,
                                        APR_UNSPEC, host_info.port, 0, pool);
         if (status)
             return status;
+        lookup_done = apr_time_now();
     }
 
     c = serf_connection_create(ctx, host_address, setup, setup_baton,
                                closed, closed_baton, pool);
+    c->timings.lookup_start = lookup_start;
+    c->timings.lookup_done = lookup_done;
+
+    if (!ctx->proxy_address && async) {
+        c->timings.lookup_start = apr_time_now();
+        status = serf__dns_lookup(&c->lookup, ctx, host_info.hostname,
+                                  host_info.port);
+        if (status) {
+            serf_connection_close(c);
+            return status;
+        }
+    }
 
     /* We're not interested in the path following the hostname. */
     c->host_url = apr_uri_unparse(c->pool,
@@ -1600,11 +2829,22 @@ apr_status_t serf_connection_create2(
     if (status)
         return status;
     c->config = config;
+    /* Collect what is logged when the connection is closed. */
+    if (serf__log_enabled(LOGLVL_DEBUG, LOGCOMP_CONN, config))
+        serf_bucket_allocator_enable_stats(c->allocator);
     serf_config_set_stringc(config, SERF_CONFIG_HOST_NAME,
                             c->host_info.hostname);
     serf_config_set_stringc(config, SERF_CONFIG_HOST_PORT,
                            apr_itoa(ctx->pool, c->host_info.port));
 
+    /* Start with what earlier connections learned about the server. */
+    traits = get_host_traits(c, 0);
+    if (traits) {
+        c->probable_keepalive_limit = traits->keepalive_limit;
+        if (!traits->pipelining)
+            serf__connection_set_pipelining(c, 0);
+    }
+
     *conn = c;
 
     serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, c->config,
@@ -1613,10 +2853,38 @@ apr_status_t serf_connection_create2(
     return status;
 }
 
+apr_status_t serf_connection_create2(
+    serf_connection_t **conn,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool)
+{
+    return create_connection(conn, ctx, host_info, 0, setup, setup_baton,
+                             closed, closed_baton, pool);
+}
+
+apr_status_t serf_connection_create_async(
+    serf_connection_t **conn,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool)
+{
+    return create_connection(conn, ctx, host_info, 1, setup, setup_baton,
+                             closed, closed_baton, pool);
+}
+
 apr_status_t serf_connection_reset(
     serf_connection_t *conn)
 {
-    return reset_connection(conn, 0);
+    return reset_connection(conn, 0, 0);
 }
 
 
@@ -1625,12 +2893,20 @@ apr_status_t serf_connection_close(
 {
     int i;
     serf_context_t *ctx = conn->ctx;
+    serf_metrics_t conn_metrics;
     apr_status_t status;
 
     for (i = ctx->conns->nelts; i--; ) {
         serf_connection_t *conn_seq = GET_CONN(ctx, i);
 
         if (conn_seq == conn) {
+            serf__http2_teardown(conn);
+            stop_connect_race(conn);
+
+            serf__timer_cancel(&ctx->timers, &conn->connect_timer);
+            serf__timer_cancel(&ctx->timers, &conn->idle_timer);
+            serf__timer_cancel(&ctx->timers, &conn->resume_timer);
+
             /* The application asked to close the connection, no need to notify
                it for each cancelled request. */
             while (conn->written_reqs) {
@@ -1650,9 +2926,24 @@ apr_status_t serf_connection_close(
                 serf_bucket_destroy(conn->stream);
                 conn->stream = NULL;
             }
+            if (conn->tunneled_stream != NULL) {
+                serf_bucket_destroy(conn->tunneled_stream);
+                conn->tunneled_stream = NULL;
+            }
 
             destroy_ostream(conn);
 
+            destroy_spare_respools(conn);
+
+            serf_connection_get_metrics(conn, &conn_metrics);
+            serf__metrics_add(&ctx->closed_metrics, &conn_metrics);
+
+            if (conn->lookup) {
+                conn->address = NULL;
+                serf__dns_lookup_release(conn->lookup);
+                conn->lookup = NULL;
+            }
+
             /* Remove the connection from the context. We don't want to
              * deal with it any more.
              */
@@ -1665,8 +2956,12 @@ apr_status_t serf_connection_close(
             }
             --ctx->conns->nelts;
 
+            serf__conn_clear_dirty(conn);
+
             serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
                       "closed connection 0x%x\n", conn);
+            serf__log_alloc_stats(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__,
+                                  conn->config, "connection", conn->allocator);
 
             /* Found the connection. Closed it. All done. */
             return APR_SUCCESS;
@@ -1692,9 +2987,36 @@ void serf_connection_set_max_outstanding_requests(
                   "Limit max. nr. of outstanding requests for this "
                   "connection to %u.\n", max_requests);
 
+    conn->adaptive_pipelining = 0;
     conn->max_outstanding_requests = max_requests;
 }
 
+void serf_connection_set_adaptive_pipelining(
+    serf_connection_t *conn,
+    unsigned int min_requests,
+    unsigned int max_requests)
+{
+    serf__host_traits_t *traits = get_host_traits(conn, 0);
+
+    conn->min_depth = min_requests ? min_requests : ADAPTIVE_MIN_DEPTH;
+    conn->max_depth = max_requests ? max_requests : ADAPTIVE_MAX_DEPTH;
+    if (conn->max_depth < conn->min_depth)
+        conn->max_depth = conn->min_depth;
+    conn->depth_threshold = conn->max_depth;
+    conn->srtt = 0;
+    conn->adaptive_pipelining = 1;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+              "Adapt max. nr. of outstanding requests for this connection "
+              "between %u and %u.\n", conn->min_depth, conn->max_depth);
+
+    /* Continue at the depth an earlier connection to the host reached. */
+    if (traits && traits->pipelining_depth)
+        set_adaptive_depth(conn, traits->pipelining_depth);
+    else
+        set_adaptive_depth(conn, ADAPTIVE_INITIAL_DEPTH);
+}
+
 /* Disable HTTP pipelining, ensure that only one request is outstanding at a 
    time. This is an internal method, an application that wants to disable
    HTTP pipelining can achieve this by calling:
@@ -1705,6 +3027,126 @@ void serf__connection_set_pipelining(serf_connection_t *conn, int enabled)
     conn->pipelining = enabled;
 }
 
+apr_status_t serf_connection_set_framing_type(
+    serf_connection_t *conn,
+    int framing_type)
+{
+    apr_status_t status = APR_SUCCESS;
+    int negotiating = conn->framing_type == SERF_CONNECTION_FRAMING_TYPE_NONE
+                      && conn->stream != NULL;
+
+    conn->framing_type = framing_type;
+
+    /* A connection that waited for the negotiation continues right away. */
+    if (negotiating && framing_type != SERF_CONNECTION_FRAMING_TYPE_NONE) {
+        if (framing_type == SERF_CONNECTION_FRAMING_TYPE_HTTP2
+            && !conn->http2)
+            status = serf__http2_setup(conn);
+
+        serf__conn_set_dirty(conn);
+    }
+
+    return status;
+}
+
+void serf_connection_set_happy_eyeballs(
+    serf_connection_t *conn,
+    int enabled)
+{
+    conn->happy_eyeballs = enabled;
+}
+
+void serf_connection_prewarm(
+    serf_connection_t *conn)
+{
+    conn->prewarm = 1;
+}
+
+apr_status_t serf_connection_set_tcp_fastopen(
+    serf_connection_t *conn,
+    int enabled)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+    conn->tcp_fastopen = enabled;
+    return APR_SUCCESS;
+#else
+    return enabled ? APR_ENOTIMPL : APR_SUCCESS;
+#endif
+}
+
+void serf_connection_set_cork(
+    serf_connection_t *conn,
+    int enabled)
+{
+    conn->cork = enabled;
+}
+
+void serf_connection_set_read_bufsize(
+    serf_connection_t *conn,
+    apr_size_t bufsize)
+{
+    conn->read_bufsize = bufsize;
+}
+
+void serf_connection_get_timings(
+    serf_connection_t *conn,
+    serf_connection_timings_t *timings)
+{
+    *timings = conn->timings;
+    timings->bytes_read = conn->progress_read;
+    timings->bytes_written = conn->progress_written;
+}
+
+void serf_connection_get_metrics(
+    serf_connection_t *conn,
+    serf_metrics_t *metrics)
+{
+    *metrics = conn->metrics;
+    metrics->bytes_read = conn->progress_read;
+    metrics->bytes_written = conn->progress_written;
+    count_handshake(metrics, &conn->timings);
+    if (conn->stop_writing)
+        metrics->blocked_time += apr_time_now() - conn->stop_writing_time;
+}
+
+void serf_request_get_timings(
+    serf_request_t *request,
+    serf_request_timings_t *timings)
+{
+    *timings = request->timings;
+}
+
+void serf_connection_set_timings_callback(
+    serf_connection_t *conn,
+    serf_request_timings_cb_t callback,
+    void *baton)
+{
+    conn->timings_callback = callback;
+    conn->timings_baton = baton;
+}
+
+void serf_connection_get_progress(
+    serf_connection_t *conn,
+    apr_off_t *read,
+    apr_off_t *written)
+{
+    *read = conn->progress_read;
+    *written = conn->progress_written;
+}
+
+void serf_connection_set_timeouts(
+    serf_connection_t *conn,
+    apr_interval_time_t connect_timeout,
+    apr_interval_time_t idle_timeout)
+{
+    conn->connect_timeout = connect_timeout;
+    conn->idle_timeout = idle_timeout;
+
+    /* Let the pollset update (re)start or stop the idle timer. */
+    serf__timer_cancel(&conn->ctx->timers, &conn->idle_timer);
+    serf__conn_set_dirty(conn);
+}
+
 void serf_connection_set_async_responses(
     serf_connection_t *conn,
     serf_response_acceptor_t acceptor,
@@ -1737,32 +3179,186 @@ create_request(serf_connection_t *conn,
     request->req_bkt = NULL;
     request->resp_bkt = NULL;
     request->priority = priority;
+    request->priority_class = SERF_PRIORITY_DEFAULT;
+    request->sched_tag = 0;
     request->writing_started = 0;
     request->ssltunnel = ssltunnel;
     request->next = NULL;
     request->auth_baton = NULL;
+    request->auth_path = NULL;
+    request->auth_realm = NULL;
+    request->written_time = 0;
+    request->resumable = 0;
+    request->resume_offset = 0;
+    request->resume_validator = NULL;
+    request->first_byte_timeout = 0;
+    serf__timer_init(&request->first_byte_timer, request_timed_out, request);
+    serf__timer_init(&request->total_timer, request_timed_out, request);
+    request->timed_out = 0;
+    request->timings.created = apr_time_now();
+    request->timings.write_start = 0;
+    request->timings.written = 0;
+    request->timings.first_byte = 0;
+    request->timings.done = 0;
 
     return request;
 }
 
+/* The virtual time a request in priority class PRIORITY takes in the
+   weighted fair scheduling: each class gets twice the share of the one
+   below it. */
+#define SCHED_COST(priority) \
+    ((apr_uint64_t)1 << (SERF_PRIORITY_HIGHEST - (priority)))
+
+/* Returns PRIORITY, limited to the valid priority classes. */
+static int sched_class(int priority)
+{
+    if (priority < SERF_PRIORITY_LOWEST)
+        return SERF_PRIORITY_LOWEST;
+    if (priority > SERF_PRIORITY_HIGHEST)
+        return SERF_PRIORITY_HIGHEST;
+    return priority;
+}
+
+/* Returns the tag a new request in class PRIORITY on CONN would get. It is
+   due when the last request of its class is sent, or when it is its turn
+   now if the class has nothing queued. */
+static apr_uint64_t next_sched_tag(const serf_connection_t *conn,
+                                   int priority)
+{
+    apr_uint64_t start = conn->sched_last[priority];
+
+    if (start < conn->sched_vtime)
+        start = conn->sched_vtime;
+
+    return start + SCHED_COST(priority);
+}
+
+/* Link REQUEST into the unwritten requests of CONN, after PREV or first
+   when PREV is NULL. */
+static void insert_request(serf_connection_t *conn,
+                           serf_request_t *prev,
+                           serf_request_t *request)
+{
+    if (prev) {
+        request->next = prev->next;
+        prev->next = request;
+    } else {
+        request->next = conn->unwritten_reqs;
+        conn->unwritten_reqs = request;
+    }
+    if (!request->next)
+        conn->unwritten_reqs_tail = request;
+    conn->nr_of_unwritten_reqs++;
+}
+
+/* Returns the request on CONN after which a request with tag TAG should
+   be queued, or NULL if it goes first. Requests that started writing and
+   priority requests stay in front. */
+static serf_request_t *find_sched_position(const serf_connection_t *conn,
+                                           apr_uint64_t tag)
+{
+    serf_request_t *iter = conn->unwritten_reqs;
+    serf_request_t *prev = NULL;
+
+    /* Most requests are queued in order. */
+    if (iter && conn->unwritten_reqs_tail->sched_tag <= tag)
+        return conn->unwritten_reqs_tail;
+
+    while (iter && (iter->writing_started || iter->priority
+                    || iter->sched_tag <= tag)) {
+        prev = iter;
+        iter = iter->next;
+    }
+
+    return prev;
+}
+
+void serf__connection_request_started(serf_connection_t *conn,
+                                      serf_request_t *request)
+{
+    if (request->sched_tag > conn->sched_vtime)
+        conn->sched_vtime = request->sched_tag;
+
+    request->timings.write_start = apr_time_now();
+}
+
+void serf__connection_request_written(serf_connection_t *conn)
+{
+    unsigned int depth = conn->nr_of_written_reqs;
+    int i = 0;
+
+    conn->metrics.requests_completed++;
+
+    while (depth > 1 && i < SERF_METRICS_DEPTH_BUCKETS - 1) {
+        depth >>= 1;
+        i++;
+    }
+    conn->metrics.depth_histogram[i]++;
+}
+
+void serf__connection_request_completed(serf_connection_t *conn,
+                                        serf_request_t *request)
+{
+    request->timings.done = apr_time_now();
+    conn->metrics.responses_completed++;
+
+    if (conn->timings_callback) {
+        serf_connection_timings_t conn_timings;
+
+        serf_connection_get_timings(conn, &conn_timings);
+        conn->timings_callback(conn->timings_baton, request,
+                               &request->timings, &conn_timings);
+    }
+}
+
+unsigned int serf__connection_requests_ahead(serf_connection_t *conn,
+                                             int priority)
+{
+    apr_uint64_t tag = next_sched_tag(conn, sched_class(priority));
+    unsigned int ahead = conn->nr_of_written_reqs;
+    serf_request_t *iter;
+
+    for (iter = conn->unwritten_reqs; iter; iter = iter->next) {
+        if (!iter->writing_started && !iter->priority && iter->sched_tag > tag)
+            break;
+        ahead++;
+    }
+
+    return ahead;
+}
+
 serf_request_t *serf_connection_request_create(
     serf_connection_t *conn,
     serf_request_setup_t setup,
     void *setup_baton)
+{
+    return serf_connection_request_create2(conn, setup, setup_baton,
+                                           SERF_PRIORITY_DEFAULT);
+}
+
+serf_request_t *serf_connection_request_create2(
+    serf_connection_t *conn,
+    serf_request_setup_t setup,
+    void *setup_baton,
+    int priority)
 {
     serf_request_t *request;
 
+    priority = sched_class(priority);
     request = create_request(conn, setup, setup_baton,
                              0, /* priority */
                              0  /* ssl tunnel */);
+    request->priority_class = priority;
+    request->sched_tag = next_sched_tag(conn, priority);
+    conn->sched_last[priority] = request->sched_tag;
 
-    /* Link the request to the end of the request chain. */
-    link_requests(&conn->unwritten_reqs, &conn->unwritten_reqs_tail, request);
-    conn->nr_of_unwritten_reqs++;
+    /* Link the request before the first one that is due later. */
+    insert_request(conn, find_sched_position(conn, request->sched_tag),
+                   request);
 
     /* Ensure our pollset becomes writable in context run */
-    conn->ctx->dirty_pollset = 1;
-    conn->dirty_conn = 1;
+    serf__conn_set_dirty(conn);
 
     return request;
 }
@@ -1780,6 +3376,9 @@ priority_request_create(serf_connection_t *conn,
                              1, /* priority */
                              ssltunnelreq);
 
+    /* It is due right away. */
+    request->sched_tag = conn->sched_vtime;
+
     /* Link the new request after the last written request. */
     iter = conn->unwritten_reqs;
     prev = NULL;
@@ -1804,18 +3403,10 @@ priority_request_create(serf_connection_t *conn,
         }
     }
 
-    if (prev) {
-        request->next = iter;
-        prev->next = request;
-    } else {
-        request->next = iter;
-        conn->unwritten_reqs = request;
-    }
-    conn->nr_of_unwritten_reqs++;
+    insert_request(conn, prev, request);
 
     /* Ensure our pollset becomes writable in context run */
-    conn->ctx->dirty_pollset = 1;
-    conn->dirty_conn = 1;
+    serf__conn_set_dirty(conn);
 
     return request;
 }
@@ -1842,11 +3433,16 @@ serf_request_t *serf__ssltunnel_request_create(serf_connection_t *conn,
 
 serf_request_t *serf__request_requeue(const serf_request_t *request)
 {
+    serf_request_t *new_request;
+
     /* ### in the future, maybe we could reset REQUEST and try again?  */
-    return priority_request_create(request->conn,
-                                   request->ssltunnel,
-                                   request->setup,
-                                   request->setup_baton);
+    new_request = priority_request_create(request->conn,
+                                          request->ssltunnel,
+                                          request->setup,
+                                          request->setup_baton);
+    new_request->priority_class = request->priority_class;
+
+    return new_request;
 }
 
 
@@ -1894,6 +3490,70 @@ serf_connection_t *serf_request_get_conn(
 }
 
 
+void serf_request_set_resumable(
+    serf_request_t *request,
+    int resumable)
+{
+    request->resumable = resumable;
+}
+
+
+void serf_request_set_timeouts(
+    serf_request_t *request,
+    apr_interval_time_t first_byte_timeout,
+    apr_interval_time_t total_timeout)
+{
+    serf_context_t *ctx = request->conn->ctx;
+
+    request->first_byte_timeout = first_byte_timeout;
+    if (!first_byte_timeout)
+        serf__timer_cancel(&ctx->timers, &request->first_byte_timer);
+
+    if (total_timeout)
+        serf__timer_schedule(&ctx->timers, &request->total_timer,
+                             apr_time_now() + total_timeout);
+    else
+        serf__timer_cancel(&ctx->timers, &request->total_timer);
+}
+
+
+int serf_request_timed_out(const serf_request_t *request)
+{
+    return request->timed_out;
+}
+
+
+void serf_request_pause_reading(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+
+    if (request->read_paused)
+        return;
+
+    request->read_paused = 1;
+    if (conn->read_paused++ == 0) {
+        serf__timer_cancel(&conn->ctx->timers, &conn->resume_timer);
+        serf__conn_set_dirty(conn);
+    }
+}
+
+
+void serf_request_resume_reading(serf_request_t *request)
+{
+    serf_connection_t *conn = request->conn;
+
+    if (!request->read_paused)
+        return;
+
+    request->read_paused = 0;
+    if (--conn->read_paused == 0) {
+        serf__timer_schedule(&conn->ctx->timers, &conn->resume_timer,
+                             apr_time_now());
+        serf__conn_set_dirty(conn);
+    }
+}
+
+
 void serf_request_set_handler(
     serf_request_t *request,
     const serf_response_handler_t handler,
@@ -1916,7 +3576,6 @@ serf_bucket_t *serf_request_bucket_request_create(
     serf_connection_t *conn = request->conn;
     serf_context_t *ctx = conn->ctx;
     int tunneled;
-    serf__authn_info_t *authn_info;
 
     tunneled = ctx->proxy_address
                && (strcmp(conn->host_info.scheme, "https") == 0);
@@ -1937,13 +3596,7 @@ serf_bucket_t *serf_request_bucket_request_create(
     }
 
     /* Setup server authentication headers.  */
-    authn_info = serf__get_authn_info_for_server(conn);
-    if (authn_info->scheme)
-    {
-        authn_info->scheme->setup_request_func(HOST, 0, conn, request,
-                                               method, uri,
-                                               hdrs_bkt);
-    }
+    serf__setup_request_authn(request, method, uri, hdrs_bkt);
 
     /* Setup proxy authentication headers, unless we're tunneling.  */
     if (ctx->proxy_authn_info.scheme && !tunneled)
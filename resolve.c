@@ -0,0 +1,431 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_network_io.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+#include <apr_atomic.h>
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
+
+#include "serf.h"
+#include "serf_bucket_util.h"
+
+#include "serf_private.h"
+
+/* Name lookups run on a few resolver threads per context, so that a slow
+   DNS server doesn't block the event loop. The lookups are queued for the
+   threads, which are started as they are needed, up to RESOLVER_THREADS.
+   The loop collects the finished lookups when it is woken up, or otherwise
+   every LOOKUP_POLL_INTERVAL.
+
+   Successful lookups stay in the cache of the context for its dns_ttl, so
+   connections to the same host don't need a lookup of their own. The
+   system resolver doesn't tell the TTL of the records, hence the fixed
+   one. Failed lookups are not cached. */
+
+#define LOOKUP_POLL_INTERVAL (10 * 1000) /* 10 ms */
+
+/* The most resolver threads of a context. */
+#define RESOLVER_THREADS 4
+
+/* The default of serf_context_set_dns_ttl() */
+#define DEFAULT_DNS_TTL apr_time_from_sec(60)
+
+struct serf__dns_lookup_t {
+    serf_context_t *ctx;
+
+    /* Holds the lookup and its results, with its own allocator as it is
+       used by the resolver thread. */
+    apr_pool_t *pool;
+
+    const char *hostname;
+    apr_port_t port;
+
+    /* The key in the cache, NULL when it isn't cached. */
+    const char *key;
+
+    /* The cache, the running list and each connection hold a reference. */
+    int refs;
+
+    apr_sockaddr_t *address;
+    apr_status_t status;
+
+    /* Set by the loop when it collected the result. */
+    int completed;
+    apr_time_t expires;
+
+#if APR_HAS_THREADS
+    /* Set by the resolver thread when it is done. The atomic store
+       publishes ADDRESS and STATUS to the loop, which reads DONE before
+       them. Once it is set the loop may destroy the lookup, so the thread
+       doesn't touch the lookup afterwards. */
+    volatile apr_uint32_t done;
+
+    /* The next lookup in the queue of the resolver threads. */
+    serf__dns_lookup_t *queued_next;
+#endif
+
+    /* The next running lookup of the context. */
+    serf__dns_lookup_t *next;
+};
+
+#if APR_HAS_THREADS
+struct serf__resolver_t {
+    /* With an allocator of its own, as the threads are created from it. */
+    apr_pool_t *pool;
+
+    /* Protects everything below. */
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+
+    /* The lookups no thread took yet, oldest first. */
+    serf__dns_lookup_t *queue;
+    serf__dns_lookup_t *queue_tail;
+
+    apr_thread_t *threads[RESOLVER_THREADS];
+    int nthreads;
+    int idle;
+
+    /* Set when the context goes away, the threads exit then. */
+    int shutdown;
+};
+#endif
+
+static void resolve(serf__dns_lookup_t *lookup)
+{
+    lookup->status = apr_sockaddr_info_get(&lookup->address,
+                                           lookup->hostname, APR_UNSPEC,
+                                           lookup->port, 0, lookup->pool);
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC resolve_thread(apr_thread_t *thread,
+                                             void *baton)
+{
+    serf__resolver_t *resolver = baton;
+
+    apr_thread_mutex_lock(resolver->mutex);
+    while (1) {
+        serf__dns_lookup_t *lookup;
+        serf_context_t *ctx;
+
+        while (!resolver->queue && !resolver->shutdown) {
+            resolver->idle++;
+            apr_thread_cond_wait(resolver->cond, resolver->mutex);
+            resolver->idle--;
+        }
+        if (resolver->shutdown)
+            break;
+
+        lookup = resolver->queue;
+        resolver->queue = lookup->queued_next;
+        if (!resolver->queue)
+            resolver->queue_tail = NULL;
+        apr_thread_mutex_unlock(resolver->mutex);
+
+        resolve(lookup);
+
+        ctx = lookup->ctx;
+        apr_atomic_set32(&lookup->done, 1);
+        (void) serf__context_wakeup(ctx);
+
+        apr_thread_mutex_lock(resolver->mutex);
+    }
+    apr_thread_mutex_unlock(resolver->mutex);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/* Create the resolver of CTX, without threads yet. */
+static apr_status_t create_resolver(serf_context_t *ctx)
+{
+    serf__resolver_t *resolver;
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+    apr_status_t status;
+
+    status = apr_allocator_create(&allocator);
+    if (status)
+        return status;
+
+    status = apr_pool_create_ex(&pool, ctx->pool, NULL, allocator);
+    if (status) {
+        apr_allocator_destroy(allocator);
+        return status;
+    }
+    apr_allocator_owner_set(allocator, pool);
+
+    resolver = apr_pcalloc(pool, sizeof(*resolver));
+    resolver->pool = pool;
+
+    status = apr_thread_mutex_create(&resolver->mutex,
+                                     APR_THREAD_MUTEX_DEFAULT, pool);
+    if (!status)
+        status = apr_thread_cond_create(&resolver->cond, pool);
+    if (status) {
+        apr_pool_destroy(pool);
+        return status;
+    }
+
+    ctx->dns_resolver = resolver;
+    return APR_SUCCESS;
+}
+
+/* Queue LOOKUP for the resolver threads of CTX, starting another thread
+   when none is idle. */
+static apr_status_t queue_lookup(serf_context_t *ctx,
+                                 serf__dns_lookup_t *lookup)
+{
+    serf__resolver_t *resolver;
+    apr_status_t status = APR_SUCCESS;
+
+    if (!ctx->dns_resolver) {
+        status = create_resolver(ctx);
+        if (status)
+            return status;
+    }
+    resolver = ctx->dns_resolver;
+
+    apr_thread_mutex_lock(resolver->mutex);
+
+    if (!resolver->idle && resolver->nthreads < RESOLVER_THREADS) {
+        status = apr_thread_create(&resolver->threads[resolver->nthreads],
+                                   NULL, resolve_thread, resolver,
+                                   resolver->pool);
+        if (status == APR_SUCCESS)
+            resolver->nthreads++;
+    }
+
+    /* Without any thread, the caller resolves it itself. */
+    if (!resolver->nthreads) {
+        apr_thread_mutex_unlock(resolver->mutex);
+        return status;
+    }
+
+    apr_atomic_set32(&lookup->done, 0);
+    lookup->queued_next = NULL;
+    if (resolver->queue_tail)
+        resolver->queue_tail->queued_next = lookup;
+    else
+        resolver->queue = lookup;
+    resolver->queue_tail = lookup;
+
+    apr_thread_cond_signal(resolver->cond);
+    apr_thread_mutex_unlock(resolver->mutex);
+
+    return APR_SUCCESS;
+}
+#endif
+
+static void uncache(serf__dns_lookup_t *lookup)
+{
+    if (lookup->key) {
+        apr_hash_set(lookup->ctx->dns_cache, lookup->key,
+                     APR_HASH_KEY_STRING, NULL);
+        lookup->key = NULL;
+        serf__dns_lookup_release(lookup);
+    }
+}
+
+static void complete(serf__dns_lookup_t *lookup)
+{
+    serf_context_t *ctx = lookup->ctx;
+
+    lookup->completed = 1;
+    lookup->expires = apr_time_now() + ctx->dns_ttl;
+
+    serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, ctx->config,
+              "resolved %s, status %d\n", lookup->hostname, lookup->status);
+
+    if (lookup->status || !ctx->dns_ttl)
+        uncache(lookup);
+}
+
+static apr_status_t lookup_poll(serf__timer_t *timer)
+{
+    serf__dns_process(timer->baton);
+
+    return APR_SUCCESS;
+}
+
+/* Stop the resolver threads before the pools of the lookups go away. The
+   threads finish the lookup they are running, the queued ones are dropped.
+*/
+static apr_status_t dns_cleanup(void *baton)
+{
+#if APR_HAS_THREADS
+    serf_context_t *ctx = baton;
+    serf__resolver_t *resolver = ctx->dns_resolver;
+    int i;
+
+    if (resolver) {
+        apr_thread_mutex_lock(resolver->mutex);
+        resolver->shutdown = 1;
+        apr_thread_cond_broadcast(resolver->cond);
+        apr_thread_mutex_unlock(resolver->mutex);
+
+        for (i = 0; i < resolver->nthreads; i++) {
+            apr_status_t thread_status;
+
+            apr_thread_join(&thread_status, resolver->threads[i]);
+        }
+
+        apr_pool_destroy(resolver->pool);
+        ctx->dns_resolver = NULL;
+    }
+    ctx->dns_lookups = NULL;
+#endif
+
+    return APR_SUCCESS;
+}
+
+void serf__dns_init(serf_context_t *ctx)
+{
+    ctx->dns_cache = apr_hash_make(ctx->pool);
+    ctx->dns_lookups = NULL;
+    ctx->dns_ttl = DEFAULT_DNS_TTL;
+    ctx->dns_resolver = NULL;
+    serf__timer_init(&ctx->dns_timer, lookup_poll, ctx);
+
+    apr_pool_pre_cleanup_register(ctx->pool, ctx, dns_cleanup);
+}
+
+apr_status_t serf__dns_lookup(serf__dns_lookup_t **lookup_p,
+                              serf_context_t *ctx,
+                              const char *hostname,
+                              apr_port_t port)
+{
+    serf__dns_lookup_t *lookup;
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+    char key[APRMAXHOSTLEN + 8];
+    apr_status_t status;
+
+    apr_snprintf(key, sizeof(key), "%s:%d", hostname, port);
+    lookup = apr_hash_get(ctx->dns_cache, key, APR_HASH_KEY_STRING);
+    if (lookup && lookup->completed && lookup->expires <= apr_time_now()) {
+        uncache(lookup);
+        lookup = NULL;
+    }
+
+    if (lookup) {
+        lookup->refs++;
+        *lookup_p = lookup;
+        return APR_SUCCESS;
+    }
+
+    status = apr_allocator_create(&allocator);
+    if (status)
+        return status;
+
+    status = apr_pool_create_ex(&pool, ctx->pool, NULL, allocator);
+    if (status) {
+        apr_allocator_destroy(allocator);
+        return status;
+    }
+    apr_allocator_owner_set(allocator, pool);
+
+    lookup = apr_pcalloc(pool, sizeof(*lookup));
+    lookup->ctx = ctx;
+    lookup->pool = pool;
+    lookup->hostname = apr_pstrdup(pool, hostname);
+    lookup->port = port;
+    lookup->refs = 1;
+
+    if (ctx->dns_ttl) {
+        lookup->key = apr_pstrdup(pool, key);
+        apr_hash_set(ctx->dns_cache, lookup->key, APR_HASH_KEY_STRING,
+                     lookup);
+        lookup->refs++;
+    }
+
+#if APR_HAS_THREADS
+    status = queue_lookup(ctx, lookup);
+    if (status == APR_SUCCESS) {
+        /* The running list holds a reference until the result is in. */
+        lookup->refs++;
+        lookup->next = ctx->dns_lookups;
+        ctx->dns_lookups = lookup;
+
+        if (!serf__timer_pending(&ctx->dns_timer))
+            serf__timer_schedule(&ctx->timers, &ctx->dns_timer,
+                                 apr_time_now() + LOOKUP_POLL_INTERVAL);
+
+        *lookup_p = lookup;
+        return APR_SUCCESS;
+    }
+#endif
+
+    /* Resolve it here then. */
+    resolve(lookup);
+    complete(lookup);
+
+    *lookup_p = lookup;
+    return APR_SUCCESS;
+}
+
+apr_status_t serf__dns_lookup_result(apr_sockaddr_t **address,
+                                     const serf__dns_lookup_t *lookup)
+{
+    if (!lookup->completed)
+        return APR_EAGAIN;
+
+    *address = lookup->address;
+    return lookup->status;
+}
+
+void serf__dns_lookup_release(serf__dns_lookup_t *lookup)
+{
+    if (--lookup->refs == 0)
+        apr_pool_destroy(lookup->pool);
+}
+
+void serf__dns_process(serf_context_t *ctx)
+{
+#if APR_HAS_THREADS
+    serf__dns_lookup_t **prev = &ctx->dns_lookups;
+
+    while (*prev) {
+        serf__dns_lookup_t *lookup = *prev;
+
+        /* Pairs with the store in resolve_thread(). */
+        if (!apr_atomic_read32(&lookup->done)) {
+            prev = &lookup->next;
+            continue;
+        }
+
+        *prev = lookup->next;
+
+        complete(lookup);
+        serf__dns_lookup_release(lookup);
+    }
+
+    if (ctx->dns_lookups && !serf__timer_pending(&ctx->dns_timer))
+        serf__timer_schedule(&ctx->timers, &ctx->dns_timer,
+                             apr_time_now() + LOOKUP_POLL_INTERVAL);
+#endif
+}
+
+void serf_context_set_dns_ttl(serf_context_t *ctx, apr_interval_time_t ttl)
+{
+    ctx->dns_ttl = ttl;
+}
@@ -100,6 +100,23 @@ typedef struct serf_config_t serf_config_t;
 #define SERF_ERROR_RESPONSE_HEADER_TOO_LONG (SERF_ERROR_START + 11)
 /* The connection to the server timed out. */
 #define SERF_ERROR_CONNECTION_TIMEDOUT (SERF_ERROR_START + 12)
+/* Compressing a request body failed. */
+#define SERF_ERROR_COMPRESSION_FAILED (SERF_ERROR_START + 13)
+/* A request received from a http client is not in http-compliant syntax,
+ * or the client closed the connection in the middle of it. */
+#define SERF_ERROR_BAD_HTTP_REQUEST (SERF_ERROR_START + 14)
+
+/* HTTP/2 related errors */
+/* The peer violated the HTTP/2 protocol. */
+#define SERF_ERROR_HTTP2_PROTOCOL_ERROR (SERF_ERROR_START + 50)
+/* The HPACK compressed headers couldn't be decoded. */
+#define SERF_ERROR_HTTP2_COMPRESSION_ERROR (SERF_ERROR_START + 51)
+/* The peer sent more data than the flow control window allowed. */
+#define SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR (SERF_ERROR_START + 52)
+/* A frame was larger than the maximum frame size, or had a bad length. */
+#define SERF_ERROR_HTTP2_FRAME_SIZE_ERROR (SERF_ERROR_START + 53)
+/* The server reset the stream of the request. */
+#define SERF_ERROR_HTTP2_STREAM_RESET (SERF_ERROR_START + 54)
 
 /* SSL certificates related errors */
 #define SERF_ERROR_SSL_CERT_FAILED (SERF_ERROR_START + 70)
@@ -228,7 +245,9 @@ apr_status_t serf_event_trigger(
  * again to continue processing data.
  *
  * If no activity occurs within the specified timeout duration, then
- * APR_TIMEUP is returned.
+ * APR_TIMEUP is returned. The function returns earlier when a connection
+ * or request timeout expires, see serf_connection_set_timeouts() and
+ * serf_request_set_timeouts().
  *
  * All temporary allocations will be made in @a pool.
  */
@@ -259,6 +278,110 @@ void serf_context_set_progress_cb(
     const serf_progress_t progress_func,
     void *progress_baton);
 
+/**
+ * Sets whether the progress callback of @a ctx is called for every read
+ * and write, or batched if @a batched is non-zero. Batched progress is
+ * reported at most once per serf_context_run() or serf_context_prerun(),
+ * when there was any.
+ *
+ * With a non-zero @a min_bytes or @a min_interval, progress is only
+ * reported when at least @a min_bytes were read or written, or
+ * @a min_interval passed, since it was last reported. The rest waits for
+ * the next run.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_progress_batching(
+    serf_context_t *ctx,
+    int batched,
+    apr_off_t min_bytes,
+    apr_interval_time_t min_interval);
+
+/**
+ * A group of contexts, each running its own control loop on its own
+ * thread.
+ *
+ * Connections are pinned to one loop by host: every call to
+ * serf_context_group_get() with the same host returns the same context.
+ * A context of a group may only be used from its own loop. Other threads
+ * hand work to it with serf_context_group_post(), e.g. to create
+ * connections and requests; all callbacks of the connections then run on
+ * that loop.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_context_group_t serf_context_group_t;
+
+/**
+ * Callback function. Runs a task posted with serf_context_group_post() on
+ * the loop of @a ctx, passing the @a task_baton given at post time.
+ *
+ * @since New in 1.4.
+ */
+typedef void (*serf_context_task_t)(
+    serf_context_t *ctx,
+    void *task_baton);
+
+/**
+ * Create a group of @a nloops contexts in @a *group, allocated in
+ * @a pool. The loops are started with serf_context_group_start().
+ *
+ * Returns APR_ENOTIMPL if APR was built without thread support.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_group_create(
+    serf_context_group_t **group,
+    int nloops,
+    apr_pool_t *pool);
+
+/**
+ * Return the context of @a group that owns the connections to @a host,
+ * typically in "hostname:port" form.
+ *
+ * @since New in 1.4.
+ */
+serf_context_t *serf_context_group_get(
+    serf_context_group_t *group,
+    const char *host);
+
+/**
+ * Queue @a task to be run with @a task_baton on the loop of @a ctx, which
+ * must be a context of @a group. This function may be called from any
+ * thread, including the loops of the group.
+ *
+ * Tasks run in the order they were posted. Tasks still queued when the
+ * group is stopped run when it is started again.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_group_post(
+    serf_context_group_t *group,
+    serf_context_t *ctx,
+    serf_context_task_t task,
+    void *task_baton);
+
+/**
+ * Start a thread for each loop of @a group. Each loop calls
+ * serf_context_run() on its context until the group is stopped.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_group_start(
+    serf_context_group_t *group);
+
+/**
+ * Stop the loops of @a group and wait for their threads to exit. Must not
+ * be called from a loop of @a group.
+ *
+ * Returns the first error returned by serf_context_run() in any of the
+ * loops, which also stops that loop, or APR_SUCCESS.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_group_stop(
+    serf_context_group_t *group);
+
 /** @} */
 
 /**
@@ -464,6 +587,39 @@ apr_status_t serf_connection_create2(
     void *closed_baton,
     apr_pool_t *pool);
 
+/**
+ * Like serf_connection_create2(), but without blocking on the lookup of
+ * the host address.
+ *
+ * The address is looked up in the background, and the connection opens
+ * once it is known. If the lookup fails, serf_context_run() returns its
+ * error. Found addresses are cached by @a ctx, so other connections to
+ * the same host don't need to look it up again, see
+ * serf_context_set_dns_ttl().
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_connection_create_async(
+    serf_connection_t **conn,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool);
+
+/**
+ * Sets for how long @a ctx caches the addresses it looked up for
+ * serf_connection_create_async(), in microseconds. 0 disables the cache.
+ * The default is 60 seconds.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_set_dns_ttl(
+    serf_context_t *ctx,
+    apr_interval_time_t ttl);
+
 
 typedef apr_status_t (*serf_accept_client_t)(
     serf_context_t *ctx,
@@ -481,12 +637,60 @@ apr_status_t serf_listener_create(
     serf_accept_client_t accept_func,
     apr_pool_t *pool);
 
+/**
+ * Open the listening socket with SO_REUSEPORT, so several listeners can
+ * share @a host and @a port. The kernel spreads the incoming connections
+ * over them: create one listener per context, with a context per thread,
+ * to use all cores.
+ *
+ * @since New in 1.4.
+ */
+#define SERF_LISTENER_REUSEPORT 0x0001
+
+/**
+ * Like serf_listener_create(), with @a flags a combination of the
+ * SERF_LISTENER_* flags. Returns APR_ENOTIMPL for a flag the platform
+ * doesn't support.
+ *
+ * Each time the socket is readable, all the waiting connections are
+ * accepted and handed to @a accept_func. The pools of closed client
+ * connections are kept around by the listener for the next ones.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_listener_create2(
+    serf_listener_t **listener,
+    serf_context_t *ctx,
+    const char *host,
+    apr_uint16_t port,
+    void *accept_baton,
+    serf_accept_client_t accept_func,
+    int flags,
+    apr_pool_t *pool);
+
 typedef apr_status_t (*serf_incoming_request_cb_t)(
     serf_context_t *ctx,
     serf_incoming_request_t *req,
     void *request_baton,
     apr_pool_t *pool);
 
+/**
+ * Serve HTTP/1.x requests on the accepted socket @a insock, usually from
+ * a serf_accept_client_t callback. The connection keeps running until the
+ * client closes it, an error occurs, or a request or response asks for
+ * the close (HTTP/1.0 requests, and @c Connection: @c close).
+ *
+ * @a request is called with @a request_baton once the headers of each
+ * request are read. The application then sets a handler for the body
+ * with serf_incoming_request_set_handler(), and hands the response to
+ * serf_incoming_request_respond(), right away or later. Pipelined
+ * requests are read while earlier ones wait for their responses, which
+ * are written in the order of the requests.
+ *
+ * The connection takes over @a pool, the pool passed to the accept
+ * callback, and destroys it when the connection is closed, or hands it
+ * back to the listener.
+ */
 apr_status_t serf_incoming_create(
     serf_incoming_t **client,
     serf_context_t *ctx,
@@ -495,6 +699,88 @@ apr_status_t serf_incoming_create(
     serf_incoming_request_cb_t request,
     apr_pool_t *pool);
 
+/**
+ * Notification callback for when a client connection was closed, with
+ * the error that closed it, or APR_SUCCESS for a normal close. The pool
+ * of the connection is destroyed after the callback returns.
+ *
+ * @since New in 1.4.
+ */
+typedef void (*serf_incoming_closed_t)(
+    serf_incoming_t *client,
+    void *closed_baton,
+    apr_status_t why,
+    apr_pool_t *pool);
+
+/**
+ * Call @a closed with @a closed_baton when @a client is closed.
+ *
+ * @since New in 1.4.
+ */
+void serf_incoming_set_closed_cb(
+    serf_incoming_t *client,
+    serf_incoming_closed_t closed,
+    void *closed_baton);
+
+/**
+ * Reads the body of the incoming request @a request, the bucket of
+ * @a req. Like a serf_response_handler_t, the handler reads until
+ * APR_EAGAIN, and returns APR_EOF once @a request was read to its end.
+ * Other errors close the connection.
+ *
+ * @since New in 1.4.
+ */
+typedef apr_status_t (*serf_incoming_handler_t)(
+    serf_incoming_request_t *req,
+    serf_bucket_t *request,
+    void *handler_baton,
+    apr_pool_t *pool);
+
+/**
+ * Read the body of @a req with @a handler. Without a handler the body is
+ * read and discarded.
+ *
+ * @since New in 1.4.
+ */
+void serf_incoming_request_set_handler(
+    serf_incoming_request_t *req,
+    serf_incoming_handler_t handler,
+    void *handler_baton);
+
+/**
+ * Return the incoming request bucket of @a req, with the request line and
+ * the headers already read. See serf_bucket_incoming_request_line().
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_incoming_request_get_bucket(
+    serf_incoming_request_t *req);
+
+/**
+ * Return the allocator for the buckets of the response to @a req.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_alloc_t *serf_incoming_request_get_alloc(
+    serf_incoming_request_t *req);
+
+/**
+ * Send @a response as the response to @a req. The connection takes over
+ * the bucket, and writes it out once the responses to the earlier
+ * requests are written; a response bucket that returns APR_EAGAIN is read
+ * again when the socket can be written to. @a response is normally an
+ * outgoing response bucket, see serf_bucket_outgoing_response_create(),
+ * but may be any bucket holding a complete HTTP/1.x response.
+ *
+ * @a req, and its pool, stay valid until its response is written and its
+ * body read, or the connection is closed.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_incoming_request_respond(
+    serf_incoming_request_t *req,
+    serf_bucket_t *response);
+
 
 
 
@@ -525,6 +811,302 @@ void serf_connection_set_max_outstanding_requests(
     serf_connection_t *conn,
     unsigned int max_requests);
 
+/**
+ * Let @a conn find its own limit on outstanding requests, between
+ * @a min_requests and @a max_requests. A value of 0 selects the default
+ * for that bound.
+ *
+ * The limit grows while responses keep coming in, and is cut in half
+ * when the server closes the connection while requests are in flight, so
+ * fewer requests have to be sent again. It isn't raised above the number
+ * of requests the server was seen to serve on one connection, nor while
+ * the responses take much longer than the network latency, which
+ * indicates that the server handles the pipelined requests one by one.
+ *
+ * Calling serf_connection_set_max_outstanding_requests() turns this off.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_adaptive_pipelining(
+    serf_connection_t *conn,
+    unsigned int min_requests,
+    unsigned int max_requests);
+
+/** No requests are sent until the framing type is known, e.g. from the
+    protocol negotiated during the TLS handshake. */
+#define SERF_CONNECTION_FRAMING_TYPE_NONE 0
+/** Requests are sent as HTTP/1.1 messages, the default. */
+#define SERF_CONNECTION_FRAMING_TYPE_HTTP1 1
+/** Requests are sent on the streams of an HTTP/2 connection. */
+#define SERF_CONNECTION_FRAMING_TYPE_HTTP2 2
+
+/**
+ * Sets the protocol @a framing_type used by @a conn, one of the
+ * SERF_CONNECTION_FRAMING_TYPE_* values.
+ *
+ * With SERF_CONNECTION_FRAMING_TYPE_HTTP2 the connection starts with the
+ * HTTP/2 connection preface without negotiation, so the server must be
+ * known to speak HTTP/2. All requests are then sent concurrently on their
+ * own streams, as far as the server allows, and the responses are
+ * delivered as they arrive. Only requests created with
+ * serf_bucket_request_create() can be sent this way.
+ *
+ * The new framing type is used from the next time the connection
+ * (re)connects to the server. The exception is a connection that is set up
+ * with SERF_CONNECTION_FRAMING_TYPE_NONE: it completes its handshake but
+ * holds back the requests until this function is called again, typically
+ * from the callback of serf_ssl_set_alpn_protocols(), and then continues
+ * with the new framing type right away. Returns the error of setting up
+ * the new framing then, which the callback can return to fail the
+ * connection.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_connection_set_framing_type(
+    serf_connection_t *conn,
+    int framing_type);
+
+/**
+ * Sets whether @a conn races connects to the addresses of the server when
+ * it has more than one, as described in RFC 8305 ("Happy Eyeballs"),
+ * @a enabled is non-zero. Attempts alternate between the IPv6 and IPv4
+ * addresses, and each new attempt starts when the previous ones didn't
+ * connect within 250 milliseconds, or failed. The first connected socket
+ * is used, the others are closed.
+ *
+ * By default the addresses are tried one after another, each after the
+ * previous failed.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_happy_eyeballs(
+    serf_connection_t *conn,
+    int enabled);
+
+/**
+ * Opens @a conn without waiting for its first request, and completes the
+ * connection setup, including the TLS handshake of the buckets created by
+ * its setup callback. The connection is then kept open without requests,
+ * until the server closes it or the idle timeout of
+ * serf_connection_set_timeouts() expires. After that it is opened again
+ * when the next request is created, as usual.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_prewarm(
+    serf_connection_t *conn);
+
+/**
+ * Sets whether @a conn uses TCP Fast Open when @a enabled is non-zero,
+ * so the first data written on a new socket is sent along with the SYN.
+ * This saves a round trip when the server supports it and the system has
+ * connected to it before. It isn't used for the sockets that race for a
+ * multi-homed server, see serf_connection_set_happy_eyeballs().
+ *
+ * Returns APR_ENOTIMPL if the platform doesn't support it.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_connection_set_tcp_fastopen(
+    serf_connection_t *conn,
+    int enabled);
+
+/**
+ * Sets whether @a conn corks its socket while it writes requests, when
+ * @a enabled is non-zero. The system then sends only full segments until
+ * all that could be written is written, which saves packets and system
+ * calls when many small requests are pipelined. It uses TCP_CORK or
+ * TCP_NOPUSH, and does nothing on platforms that have neither.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_cork(
+    serf_connection_t *conn,
+    int enabled);
+
+/**
+ * Sets the size of the buffers that the socket, file and SSL buckets of
+ * @a conn read into to @a bufsize bytes, from the next socket on. These
+ * buckets read up to SERF_DATABUF_BUFSIZE bytes at a time by default;
+ * larger reads save system calls on fast links.
+ *
+ * The size is shared with the buckets as SERF_CONFIG_CONN_READ_BUFSIZE.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_read_bufsize(
+    serf_connection_t *conn,
+    apr_size_t bufsize);
+
+/**
+ * Returns the number of bytes read from and written to the sockets of
+ * @a conn in @a read and @a written, since it was created.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_get_progress(
+    serf_connection_t *conn,
+    apr_off_t *read,
+    apr_off_t *written);
+
+/**
+ * The times at which a connection went through the phases of its setup,
+ * as returned by apr_time_now(), and the bytes it transferred. The
+ * connect and handshake times are those of its current socket. Phases
+ * that didn't happen (yet) have time 0.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_connection_timings_t {
+    /** The lookup of the server's address, for connections created with
+        serf_connection_create2() or serf_connection_create_async(). */
+    apr_time_t lookup_start;
+    apr_time_t lookup_done;
+    /** The TCP connect. */
+    apr_time_t connect_start;
+    apr_time_t connect_done;
+    /** The end of the TLS handshake, as seen by the ssl buckets. */
+    apr_time_t handshake_done;
+    /** Non-zero when the handshake resumed an earlier TLS session. */
+    int handshake_resumed;
+    /** The bytes read and written, as serf_connection_get_progress(). */
+    apr_off_t bytes_read;
+    apr_off_t bytes_written;
+} serf_connection_timings_t;
+
+/**
+ * The times at which a request went through the phases of its life, as
+ * returned by apr_time_now(). Phases that didn't happen (yet) have time 0.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_request_timings_t {
+    /** The request was created. */
+    apr_time_t created;
+    /** The connection started writing the request. */
+    apr_time_t write_start;
+    /** The request was written completely; for HTTP/2, its stream was
+        opened. */
+    apr_time_t written;
+    /** The first byte of the response arrived. */
+    apr_time_t first_byte;
+    /** The response was handled completely. */
+    apr_time_t done;
+} serf_request_timings_t;
+
+/**
+ * Called when the response to @a request was handled completely, with the
+ * @a timings of the request and the @a conn_timings of its connection.
+ * @a baton is the baton given to serf_connection_set_timings_callback().
+ *
+ * @since New in 1.4.
+ */
+typedef void (*serf_request_timings_cb_t)(
+    void *baton,
+    serf_request_t *request,
+    const serf_request_timings_t *timings,
+    const serf_connection_timings_t *conn_timings);
+
+/**
+ * Returns the timings of @a conn in @a timings.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_get_timings(
+    serf_connection_t *conn,
+    serf_connection_timings_t *timings);
+
+/**
+ * Returns the timings of @a request in @a timings.
+ *
+ * @since New in 1.4.
+ */
+void serf_request_get_timings(
+    serf_request_t *request,
+    serf_request_timings_t *timings);
+
+/**
+ * Sets the @a callback that gets the timings of each request of @a conn
+ * when its response was handled, or NULL to stop that.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_timings_callback(
+    serf_connection_t *conn,
+    serf_request_timings_cb_t callback,
+    void *baton);
+
+/** The number of buckets of serf_metrics_t.depth_histogram. */
+#define SERF_METRICS_DEPTH_BUCKETS 8
+
+/**
+ * Counters of a connection since it was created, or of all connections of
+ * a context, see serf_connection_get_metrics() and
+ * serf_context_get_metrics().
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_metrics_t {
+    /** Requests written completely, and responses handled completely. */
+    apr_uint64_t requests_completed;
+    apr_uint64_t responses_completed;
+    /** The times the connection lost its socket and started over, and the
+        written requests that had to be sent again because of that. */
+    apr_uint64_t resets;
+    apr_uint64_t requests_requeued;
+    /** The bytes read and written, as serf_connection_get_progress(). */
+    apr_off_t bytes_read;
+    apr_off_t bytes_written;
+    /** The number of requests waiting for their response each time a
+        request was written: bucket 0 counts depth 1, bucket 1 depths 2-3,
+        bucket 2 depths 4-7 and so on; the last bucket counts the rest. */
+    apr_uint64_t depth_histogram[SERF_METRICS_DEPTH_BUCKETS];
+    /** The time writing waited for a read, e.g. during TLS handshakes. */
+    apr_interval_time_t blocked_time;
+    /** TLS handshakes, which did or didn't resume an earlier session. */
+    apr_uint64_t handshakes_full;
+    apr_uint64_t handshakes_resumed;
+    /** Requests sent again with credentials after a 401 or 407. */
+    apr_uint64_t auth_round_trips;
+} serf_metrics_t;
+
+/**
+ * Returns the counters of @a conn in @a metrics.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_get_metrics(
+    serf_connection_t *conn,
+    serf_metrics_t *metrics);
+
+/**
+ * Returns the sum of the counters of all connections of @a ctx in
+ * @a metrics, including the connections that were closed already.
+ *
+ * @since New in 1.4.
+ */
+void serf_context_get_metrics(
+    serf_context_t *ctx,
+    serf_metrics_t *metrics);
+
+/**
+ * Sets the timeouts of @a conn, in microseconds. 0 disables a timeout,
+ * which is the default for both.
+ *
+ * If the connection isn't established within @a connect_timeout, the next
+ * address of the server is tried, or serf_context_run() returns
+ * SERF_ERROR_CONNECTION_TIMEDOUT when there is none.
+ *
+ * A connection without requests is closed after @a idle_timeout. It is
+ * opened again when the next request is created.
+ *
+ * @since New in 1.4.
+ */
+void serf_connection_set_timeouts(
+    serf_connection_t *conn,
+    apr_interval_time_t connect_timeout,
+    apr_interval_time_t idle_timeout);
+
 void serf_connection_set_async_responses(
     serf_connection_t *conn,
     serf_response_acceptor_t acceptor,
@@ -596,6 +1178,36 @@ serf_request_t *serf_connection_priority_request_create(
     serf_request_setup_t setup,
     void *setup_baton);
 
+/**
+ * The priority classes of serf_connection_request_create2(). Requests
+ * created with serf_connection_request_create() are in
+ * SERF_PRIORITY_DEFAULT.
+ *
+ * @since New in 1.4.
+ */
+#define SERF_PRIORITY_LOWEST 0
+#define SERF_PRIORITY_DEFAULT 3
+#define SERF_PRIORITY_HIGHEST 7
+
+/**
+ * Construct a request object for the @a conn connection in the
+ * @a priority class, between SERF_PRIORITY_LOWEST and
+ * SERF_PRIORITY_HIGHEST, as with serf_connection_request_create().
+ *
+ * The unwritten requests of a connection are sent by weighted fair
+ * scheduling over the classes: each class gets twice the share of the
+ * class below it, so requests in a higher class jump ahead of most
+ * queued lower class requests without starving them. Requests in the
+ * same class are sent in the order they were created.
+ *
+ * @since New in 1.4.
+ */
+serf_request_t *serf_connection_request_create2(
+    serf_connection_t *conn,
+    serf_request_setup_t setup,
+    void *setup_baton,
+    int priority);
+
 
 /** Returns detected network latency for the @a conn connection. Negative
  *  value means that latency is unknwon.
@@ -615,6 +1227,141 @@ unsigned int serf_connection_queued_requests(serf_connection_t *conn);
  */
 unsigned int serf_connection_pending_requests(serf_connection_t *conn);
 
+/**
+ * A set of connections to one host, sharing the requests sent to it.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_host_pool_t serf_host_pool_t;
+
+/**
+ * Create a pool of up to @a max_conns connections to the host in
+ * @a host_info, in the @a ctx serf context. The connections are created
+ * with serf_connection_create2() on demand, passing @a setup,
+ * @a setup_baton, @a closed and @a closed_baton.
+ *
+ * A connection that had no pending requests for @a max_idle is closed,
+ * except for the last one. A @a max_idle of 0 keeps idle connections open.
+ *
+ * The host pool and its connections are allocated in @a pool.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_host_pool_create(
+    serf_host_pool_t **hpool,
+    serf_context_t *ctx,
+    apr_uri_t host_info,
+    unsigned int max_conns,
+    apr_interval_time_t max_idle,
+    serf_connection_setup_t setup,
+    void *setup_baton,
+    serf_connection_closed_t closed,
+    void *closed_baton,
+    apr_pool_t *pool);
+
+/**
+ * Construct a request on the connection of @a hpool with the lowest
+ * expected wait, based on its latency and the number of requests pending
+ * on it. When all connections are busy and the limit has not been
+ * reached, a new connection is opened for the request.
+ *
+ * @a setup and @a setup_baton are used as in
+ * serf_connection_request_create(). Returns NULL if no connection could be
+ * created.
+ *
+ * @since New in 1.4.
+ */
+serf_request_t *serf_host_pool_request_create(
+    serf_host_pool_t *hpool,
+    serf_request_setup_t setup,
+    void *setup_baton);
+
+/**
+ * Construct a request in the @a priority class on a connection of
+ * @a hpool, as with serf_connection_request_create2(). The connection is
+ * chosen as in serf_host_pool_request_create(), counting only the
+ * requests that would be sent before this one.
+ *
+ * @since New in 1.4.
+ */
+serf_request_t *serf_host_pool_request_create2(
+    serf_host_pool_t *hpool,
+    serf_request_setup_t setup,
+    void *setup_baton,
+    int priority);
+
+/**
+ * Close the connections of @a hpool that have been idle for longer than
+ * the limit given at creation time. This also happens when requests are
+ * created; applications with long quiet periods can call this
+ * periodically.
+ *
+ * @since New in 1.4.
+ */
+void serf_host_pool_retire_idle(
+    serf_host_pool_t *hpool);
+
+/**
+ * Open connections in @a hpool until it has @a count of them, up to the
+ * limit given at creation time, and keep them all warm as with
+ * serf_connection_prewarm(). The requests created next then don't wait
+ * for the connection setup.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_host_pool_prewarm(
+    serf_host_pool_t *hpool,
+    unsigned int count);
+
+/**
+ * Returns the number of open connections in @a hpool.
+ *
+ * @since New in 1.4.
+ */
+unsigned int serf_host_pool_connections(
+    serf_host_pool_t *hpool);
+
+/**
+ * The outcome of one URL of serf_context_fetch_urls().
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_fetch_result_t {
+    /** APR_SUCCESS, or the error that stopped the fetch of the URL. */
+    apr_status_t status;
+    /** The HTTP status code of the response, 0 if none was read. */
+    int code;
+    /** The body of the response, without chunking and Content-Encoding. */
+    const char *body;
+    apr_size_t body_len;
+} serf_fetch_result_t;
+
+/**
+ * GET the @a nurls URLs in @a urls, which may be http: and https: URLs to
+ * any number of hosts, and run @a ctx until all responses were read or
+ * @a timeout passed; 0 means no timeout. The requests to each host are
+ * spread over up to @a max_conns connections of a serf_host_pool_t and
+ * pipelined on them. The connections are closed when this returns.
+ *
+ * This saves bindings from driving serf_context_run() and reading the
+ * responses from their own language, one call at a time.
+ *
+ * The outcome of @a urls[i] is stored in @a results[i], the bodies are
+ * allocated in @a pool. Returns APR_SUCCESS when every URL got a result,
+ * or the error that stopped the batch, e.g. APR_TIMEUP, which is then
+ * also the status of the URLs that didn't finish.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_context_fetch_urls(
+    serf_fetch_result_t *results,
+    serf_context_t *ctx,
+    const char * const *urls,
+    int nurls,
+    unsigned int max_conns,
+    apr_interval_time_t timeout,
+    apr_pool_t *pool);
+
 /** Check if a @a request has been completely written.
  *
  * Returns APR_SUCCESS if the request was written completely on the connection.
@@ -670,6 +1417,87 @@ void serf_request_set_handler(
     const serf_response_handler_t handler,
     const void **handler_baton);
 
+/**
+ * Let @a request continue where it left off, instead of being cancelled,
+ * when its connection drops while the response body is being read.
+ *
+ * The request is sent again on the new connection with Range and If-Range
+ * headers for the rest of the body, and the handler continues with a new
+ * response bucket whose body starts after the bytes read before. Its
+ * status is that of the original response.
+ *
+ * This only works for GET requests created with
+ * serf_bucket_request_create() and handled with a response bucket from
+ * serf_bucket_response_create(), and for responses without
+ * Content-Encoding that carry a strong ETag or a Last-Modified header.
+ * Other requests are cancelled as usual. The setup callback of the
+ * request is invoked again to create the new request bucket.
+ *
+ * If the server can't provide the rest of the same representation,
+ * reading the body fails with SERF_ERROR_TRUNCATED_HTTP_RESPONSE.
+ *
+ * @since New in 1.4.
+ */
+void serf_request_set_resumable(
+    serf_request_t *request,
+    int resumable);
+
+/**
+ * Sets the timeouts of @a request, in microseconds. 0 disables a timeout,
+ * which is the default for both.
+ *
+ * The response must start to arrive within @a first_byte_timeout after the
+ * request was written, and the whole exchange must be done within
+ * @a total_timeout from now.
+ *
+ * When a timeout expires the request is cancelled, and its handler is
+ * called without response. On an HTTP/1.1 connection the other written
+ * requests can't be received any more either, so the connection is reset
+ * as when the server closed it.
+ *
+ * @since New in 1.4.
+ */
+void serf_request_set_timeouts(
+    serf_request_t *request,
+    apr_interval_time_t first_byte_timeout,
+    apr_interval_time_t total_timeout);
+
+/**
+ * Returns non-zero if @a request is cancelled because one of its timeouts
+ * expired; to be called from its handler.
+ *
+ * @since New in 1.4.
+ */
+int serf_request_timed_out(
+    const serf_request_t *request);
+
+/**
+ * Stops reading from the connection of @a request, until
+ * serf_request_resume_reading() is called. A response handler that can't
+ * take more data for now, e.g. because it forwards it to a slow peer, can
+ * call this and return APR_EAGAIN. The data then stays in the socket
+ * buffers, and TCP flow control holds back the server, instead of piling
+ * up in memory.
+ *
+ * This pauses all responses on the connection; on HTTP/2 connections
+ * those of the other streams too.
+ *
+ * @since New in 1.4.
+ */
+void serf_request_pause_reading(
+    serf_request_t *request);
+
+/**
+ * Continues reading from the connection of @a request after
+ * serf_request_pause_reading(). The handler is called again from the next
+ * run of the context, also when the data it waits for was received
+ * already.
+ *
+ * @since New in 1.4.
+ */
+void serf_request_resume_reading(
+    serf_request_t *request);
+
 /**
  * Configure proxy server settings, to be used by all connections associated
  * with the @a ctx serf context.
@@ -704,6 +1532,40 @@ void serf_config_credentials_callback(
     serf_context_t *ctx,
     serf_credentials_callback_t cred_cb);
 
+/**
+ * Authenticate to the proxy of @a ctx with Basic authentication as
+ * @a username with @a password, starting with the first request, instead
+ * of after the proxy asked for it with a 407 response. This saves a round
+ * trip on every tunnel to an https server set up through the proxy.
+ *
+ * The credentials callback is still asked when the proxy rejects these.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_config_proxy_credentials(
+    serf_context_t *ctx,
+    const char *username,
+    const char *password);
+
+/**
+ * If @a enabled is non-zero, connections through the proxy of @a ctx to an
+ * https server start the TLS handshake right behind the CONNECT request,
+ * instead of waiting for the proxy to set up the tunnel. This saves a
+ * round trip on every new connection.
+ *
+ * Only enable this for proxies that accept data following a CONNECT
+ * request, and forward it once the tunnel is up. When the proxy asks for
+ * authentication, the connection is closed and the CONNECT request is sent
+ * again, with the credentials, on a new one.
+ *
+ * Disabled by default.
+ *
+ * @since New in 1.4.
+ */
+void serf_config_proxy_tunnel_pipelining(
+    serf_context_t *ctx,
+    int enabled);
+
 /* ### maybe some connection control functions for flood? */
 
 /*** Special bucket creation functions ***/
@@ -922,7 +1784,8 @@ struct serf_bucket_type_t {
                                       const serf_bucket_type_t *type);
 
     /* Returns length of remaining data to be read in @a bucket. Returns
-     * SERF_LENGTH_UNKNOWN if length is unknown.
+     * SERF_LENGTH_UNKNOWN if length is unknown. May be NULL for buckets
+     * that never know it.
      *
      * @since New in 1.4.
      */
@@ -987,7 +1850,8 @@ serf_bucket_t * serf_buckets_are_v2(serf_bucket_t *bucket,
 #define serf_bucket_peek(b,d,l) ((b)->type->peek(b,d,l))
 #define serf_bucket_destroy(b) ((b)->type->destroy(b))
 #define serf_bucket_get_remaining(b) \
-            ((b)->type->read_bucket == serf_buckets_are_v2 ? \
+            ((b)->type->read_bucket == serf_buckets_are_v2 \
+             && (b)->type->get_remaining ? \
              (b)->type->get_remaining(b) : \
              SERF_LENGTH_UNKNOWN)
 #define serf_bucket_set_config(b,c) \
@@ -1073,6 +1937,65 @@ serf_bucket_alloc_t *serf_bucket_allocator_create(
 apr_pool_t *serf_bucket_allocator_get_pool(
     const serf_bucket_alloc_t *allocator);
 
+/** Number of entries in the size histogram of serf_bucket_alloc_stats_t. */
+#define SERF_ALLOC_STATS_HISTOGRAM_SIZE 12
+
+/**
+ * Allocation statistics of a bucket allocator.
+ *
+ * All byte counts include the per-allocation overhead of the allocator, so
+ * they show the memory actually consumed rather than what was requested.
+ *
+ * Entry i of @a size_histogram counts the requests for at most (16 << i)
+ * bytes that didn't fit in a lower entry; the last entry counts all larger
+ * requests.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_bucket_alloc_stats_t {
+    /** Bytes currently handed out and not yet freed. */
+    apr_size_t live_bytes;
+    /** Highest value @a live_bytes has reached. */
+    apr_size_t peak_bytes;
+
+    /** Number of calls to serf_bucket_mem_alloc (and _calloc). */
+    apr_uint64_t num_allocs;
+    /** Number of calls to serf_bucket_mem_free. */
+    apr_uint64_t num_frees;
+
+    /** Allocations served from one of the free lists. */
+    apr_uint64_t freelist_hits;
+    /** 8k blocks taken from the apr_allocator to carve small nodes from. */
+    apr_uint64_t block_grabs;
+    /** Allocations too big for a node, given their own apr_memnode_t. */
+    apr_uint64_t direct_allocs;
+
+    /** Histogram of the requested sizes. */
+    apr_uint64_t size_histogram[SERF_ALLOC_STATS_HISTOGRAM_SIZE];
+} serf_bucket_alloc_stats_t;
+
+/**
+ * Start collecting allocation statistics on @a allocator.
+ *
+ * Statistics are off by default, as they add some bookkeeping to every
+ * allocation. Only allocations made after this call are accounted for.
+ *
+ * @since New in 1.4.
+ */
+void serf_bucket_allocator_enable_stats(serf_bucket_alloc_t *allocator);
+
+/**
+ * Copy the allocation statistics of @a allocator to @a stats.
+ *
+ * Returns APR_EINVAL if statistics collection wasn't enabled with
+ * serf_bucket_allocator_enable_stats().
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_allocator_get_stats(
+    serf_bucket_alloc_stats_t *stats,
+    const serf_bucket_alloc_t *allocator);
+
 
 /**
  * Utility structure for reading a complete line of input from a bucket.
@@ -1216,6 +2139,7 @@ typedef enum {
 #define SERF_CONFIG_CONN_LOCALIP    (SERF_CONFIG_PER_CONNECTION | 0x000001)
 #define SERF_CONFIG_CONN_REMOTEIP   (SERF_CONFIG_PER_CONNECTION | 0x000002)
 #define SERF_CONFIG_CONN_PIPELINING (SERF_CONFIG_PER_CONNECTION | 0x000003)
+#define SERF_CONFIG_CONN_READ_BUFSIZE (SERF_CONFIG_PER_CONNECTION | 0x000004)
 #define SERF_CONFIG_CTX_LOGBATON    (SERF_CONFIG_PER_CONTEXT | 0x000001)
 
 /* Configuration values stored in the configuration store:
@@ -1226,6 +2150,7 @@ typedef enum {
    Context      proxyauthn   apr_hash_t * (not implemented)
    Connection   localip      const char *
    Connection   remoteip     const char *
+   Connection   readbufsize  const char * (decimal number of bytes)
    Host         hostname     const char *
    Host         hostport     const char *
    Host         authn        apr_hash_t * (not implemented)
@@ -1330,6 +2255,25 @@ apr_status_t serf_logging_create_stream_output(serf_log_output_t **output,
                                                FILE *fp,
                                                apr_pool_t *pool);
 
+/* Create an output for log info that writes to the stream FP from a thread
+   of its own, so that logging doesn't block the thread of the context on
+   I/O.
+   Events wait for the writer thread in a ring buffer of at least RING_SIZE
+   bytes. When the ring is full, events are dropped rather than waited for,
+   and the number of dropped events is written to FP instead.
+   The output shouldn't be used by more than one context. Events are written
+   out and the thread is stopped when POOL is cleaned up.
+   Returns APR_ENOTIMPL if APR was built without thread support.
+   @since New in 1.4.
+ */
+apr_status_t serf_logging_create_ring_output(serf_log_output_t **output,
+                                             apr_uint32_t level,
+                                             apr_uint32_t comp_mask,
+                                             serf_log_layout_t *layout,
+                                             FILE *fp,
+                                             apr_size_t ring_size,
+                                             apr_pool_t *pool);
+
 /* Define an output handler for a log level and a (set of) log component(s).
    OUTPUT is the object returned by one of the serf_logging_create_XXX_output
    factory functions. */
@@ -1337,6 +2281,44 @@ apr_status_t serf_logging_add_output(serf_context_t *ctx,
                                      const serf_log_output_t *output);
 
 
+/*** Binary trace of the traffic ***/
+
+/* The kinds of records in a trace file. */
+#define SERF_TRACE_OPEN  1 /* A connection got a new socket. The data is the
+                              url of the server. */
+#define SERF_TRACE_SEND  2 /* Data was written to the socket. */
+#define SERF_TRACE_RECV  3 /* Data was read from the socket. */
+#define SERF_TRACE_CLOSE 4 /* The socket of a connection was closed. */
+
+/* Record the traffic on the connections of CTX in the file at PATH, in a
+   compact binary format. Unlike the RAWMSG and SSLMSG log components,
+   this costs little more than a copy of the payload, so it can be left on
+   to capture problems that depend on timing.
+
+   Each record has a timestamp, the id of the connection, the kind of
+   record (see SERF_TRACE_*), the length of the data, and at most
+   SAMPLE_SIZE bytes of the data itself. Use 0 to only record the lengths.
+
+   The file is FILE_SIZE bytes and mapped into memory, so records are
+   written without I/O calls and survive a crash of the process. Records
+   that don't fit are counted, but not written.
+
+   Data read by socket buckets not created with
+   serf_context_bucket_socket_create() is not recorded.
+
+   The trace stops, and the file is truncated to what was recorded, when
+   POOL is cleaned up. POOL shouldn't outlive CTX. test/serf_trace decodes
+   the trace file.
+
+   Returns APR_ENOTIMPL if APR doesn't support memory mapped files.
+   @since New in 1.4.
+ */
+apr_status_t serf_context_trace_to_file(serf_context_t *ctx,
+                                        const char *path,
+                                        apr_size_t file_size,
+                                        apr_size_t sample_size,
+                                        apr_pool_t *pool);
+
 /*** Connection and protocol API v2 ***/
 #if 0
 /* ### docco.  */
@@ -129,6 +129,25 @@ serf_bucket_t *serf_bucket_response_get_headers(
 void serf_bucket_response_set_head(
     serf_bucket_t *bucket);
 
+/**
+ * Read the body of the response @a bucket into one buffer allocated in
+ * @a pool, which is as large as the body when its length is known, e.g.
+ * from the Content-Length header. This saves growing and copying the
+ * buffer for every read.
+ *
+ * Returns what serf_bucket_read() returned last; on APR_EAGAIN call this
+ * again, with the same @a pool, when more data arrived. In all cases
+ * @a data and @a len are set to the body read so far, which is complete
+ * when APR_EOF is returned.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_response_read_body(
+    serf_bucket_t *bucket,
+    const char **data,
+    apr_size_t *len,
+    apr_pool_t *pool);
+
 /* ==================================================================== */
 
 extern const serf_bucket_type_t serf_bucket_type_response_body;
@@ -141,6 +160,100 @@ serf_bucket_t *serf_bucket_response_body_create(
 
 /* ==================================================================== */
 
+/**
+ * Parses a request as a server receives it from @a stream, like the
+ * response bucket does for responses. Reading the bucket returns the
+ * body of the request, without the framing; a request without
+ * Content-Length or chunked encoding has an empty body. Reading past the
+ * end of the request leaves @a stream at the start of the next one.
+ *
+ * @since New in 1.4.
+ */
+extern const serf_bucket_type_t serf_bucket_type_incoming_request;
+#define SERF_BUCKET_IS_INCOMING_REQUEST(b) \
+    SERF_BUCKET_CHECK((b), incoming_request)
+
+serf_bucket_t *serf_bucket_incoming_request_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator);
+
+typedef struct serf_request_line {
+    const char *method;
+    const char *uri;
+    int version;
+} serf_request_line;
+
+/**
+ * Return the Request-Line information, if available. This works like
+ * serf_bucket_response_status(): a return value of APR_SUCCESS always
+ * indicates that @a rline was filled in; for other return values the
+ * caller must check the version field in @a rline, 0 means that the data
+ * is not (yet) present. APR_EOF without @a rline means that the stream
+ * ended before a new request started.
+ *
+ * A malformed request results in SERF_ERROR_BAD_HTTP_REQUEST.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_incoming_request_line(
+    serf_bucket_t *bkt,
+    serf_request_line *rline);
+
+/**
+ * Wait for the request line and the headers of the @a request to be
+ * read. Returns APR_SUCCESS once they are available, see
+ * serf_bucket_response_wait_for_headers().
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_incoming_request_wait_for_headers(
+    serf_bucket_t *request);
+
+/**
+ * Get the headers bucket for @a request.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_incoming_request_get_headers(
+    serf_bucket_t *request);
+
+/* ==================================================================== */
+
+/**
+ * Serializes a response with status @a code and @a reason, which may be
+ * NULL for the usual phrase, to the request of HTTP version
+ * @a http_version, with the headers added to
+ * serf_bucket_outgoing_response_get_headers() and @a body, which may be
+ * NULL.
+ *
+ * Unless the headers say otherwise, the body is sent with a
+ * Content-Length when its length is known (see
+ * serf_bucket_get_remaining()), and chunked otherwise. A HTTP/1.0 client
+ * gets a body of unknown length up to the close of the connection.
+ *
+ * @since New in 1.4.
+ */
+extern const serf_bucket_type_t serf_bucket_type_outgoing_response;
+#define SERF_BUCKET_IS_OUTGOING_RESPONSE(b) \
+    SERF_BUCKET_CHECK((b), outgoing_response)
+
+serf_bucket_t *serf_bucket_outgoing_response_create(
+    serf_bucket_t *body,
+    int code,
+    const char *reason,
+    int http_version,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Get the headers bucket for the response @a bucket.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_outgoing_response_get_headers(
+    serf_bucket_t *bucket);
+
+/* ==================================================================== */
+
 extern const serf_bucket_type_t serf_bucket_type_bwtp_frame;
 #define SERF_BUCKET_IS_BWTP_FRAME(b) SERF_BUCKET_CHECK((b), bwtp_frame)
 
@@ -187,6 +300,81 @@ apr_status_t serf_bucket_bwtp_incoming_frame_wait_for_headers(
 
 /* ==================================================================== */
 
+/* HTTP/2 frame types, see RFC 7540 section 6. */
+#define SERF_HTTP2_FRAME_TYPE_DATA          0x00
+#define SERF_HTTP2_FRAME_TYPE_HEADERS       0x01
+#define SERF_HTTP2_FRAME_TYPE_PRIORITY      0x02
+#define SERF_HTTP2_FRAME_TYPE_RST_STREAM    0x03
+#define SERF_HTTP2_FRAME_TYPE_SETTINGS      0x04
+#define SERF_HTTP2_FRAME_TYPE_PUSH_PROMISE  0x05
+#define SERF_HTTP2_FRAME_TYPE_PING          0x06
+#define SERF_HTTP2_FRAME_TYPE_GOAWAY        0x07
+#define SERF_HTTP2_FRAME_TYPE_WINDOW_UPDATE 0x08
+#define SERF_HTTP2_FRAME_TYPE_CONTINUATION  0x09
+
+/* HTTP/2 frame flags. */
+#define SERF_HTTP2_FLAG_END_STREAM  0x01 /* DATA, HEADERS */
+#define SERF_HTTP2_FLAG_ACK         0x01 /* SETTINGS, PING */
+#define SERF_HTTP2_FLAG_END_HEADERS 0x04 /* HEADERS, CONTINUATION */
+#define SERF_HTTP2_FLAG_PADDED      0x08 /* DATA, HEADERS */
+#define SERF_HTTP2_FLAG_PRIORITY    0x20 /* HEADERS */
+
+/* The size of the header in front of every HTTP/2 frame. */
+#define SERF_HTTP2_FRAME_HEADER_SIZE 9
+
+extern const serf_bucket_type_t serf_bucket_type_http2_frame;
+#define SERF_BUCKET_IS_HTTP2_FRAME(b) SERF_BUCKET_CHECK((b), http2_frame)
+
+/**
+ * Create a bucket that frames @a payload as an HTTP/2 frame of type
+ * @a frame_type for stream @a stream_id. The length of @a payload must be
+ * known (see serf_bucket_get_remaining()) and not exceed the maximum frame
+ * size of the peer. @a payload may be NULL for frames without payload.
+ *
+ * The new bucket takes ownership of @a payload.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_http2_frame_create(
+    serf_bucket_t *payload,
+    unsigned char frame_type,
+    unsigned char flags,
+    apr_uint32_t stream_id,
+    serf_bucket_alloc_t *allocator);
+
+extern const serf_bucket_type_t serf_bucket_type_http2_unframe;
+#define SERF_BUCKET_IS_HTTP2_UNFRAME(b) SERF_BUCKET_CHECK((b), http2_unframe)
+
+/**
+ * Create a bucket that reads one HTTP/2 frame from @a stream and returns
+ * its payload. Frames with a payload larger than @a max_payload_size are
+ * rejected with SERF_ERROR_HTTP2_FRAME_SIZE_ERROR.
+ *
+ * The new bucket does not take ownership of @a stream, so the next frame
+ * can be read from it with a new bucket once this one returned APR_EOF.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_http2_unframe_create(
+    serf_bucket_t *stream,
+    apr_size_t max_payload_size,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Read the frame header of the HTTP/2 unframe @a bucket, and return the
+ * stream, type and flags of the frame. Any of the output arguments may be
+ * NULL. Returns APR_EAGAIN when the header isn't complete yet.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_http2_unframe_read_info(
+    serf_bucket_t *bucket,
+    apr_uint32_t *stream_id,
+    unsigned char *frame_type,
+    unsigned char *flags);
+
+/* ==================================================================== */
+
 
 extern const serf_bucket_type_t serf_bucket_type_aggregate;
 #define SERF_BUCKET_IS_AGGREGATE(b) SERF_BUCKET_CHECK((b), aggregate)
@@ -323,6 +511,64 @@ serf_bucket_t *serf_bucket_simple_own_create(
 #define SERF_BUCKET_SIMPLE_STRING_LEN(s,l,a) \
     serf_bucket_simple_create(s, l, NULL, NULL, a);
 
+/**
+ * An immutable, reference counted buffer which can be shared by buckets
+ * living in different allocators (and threads), e.g. to send the same
+ * request body over many connections without copying it for each one.
+ *
+ * @since New in 1.4.
+ */
+typedef struct serf_shared_buffer_t serf_shared_buffer_t;
+
+/**
+ * Create a shared buffer holding a copy of the LEN bytes at DATA. The
+ * buffer is not tied to any pool or bucket allocator. The caller holds
+ * one reference, which must be given up with serf_shared_buffer_release().
+ *
+ * Returns NULL if the memory could not be allocated.
+ *
+ * @since New in 1.4.
+ */
+serf_shared_buffer_t *serf_shared_buffer_create(
+    const char *data,
+    apr_size_t len);
+
+/**
+ * Release one reference to BUFFER. The buffer is freed when the last
+ * reference is released.
+ *
+ * @since New in 1.4.
+ */
+void serf_shared_buffer_release(
+    serf_shared_buffer_t *buffer);
+
+/**
+ * Create a simple bucket returning the contents of BUFFER, allocated
+ * from ALLOCATOR. The bucket holds its own reference to BUFFER, which it
+ * releases when it is destroyed.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_shared_create(
+    serf_shared_buffer_t *buffer,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Move @a bucket to @a allocator, so that it can be read and destroyed
+ * with the buckets of another connection, without copying its data.
+ * Returns the moved bucket, which replaces @a bucket, or NULL if
+ * @a bucket can't be moved; it is then left as it was.
+ *
+ * Simple buckets whose data isn't owned by their allocator (static data,
+ * shared buffers, and the data spliced off socket and SSL buckets with
+ * serf_bucket_read_bucket()) can be moved, and aggregates of them.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_move(
+    serf_bucket_t *bucket,
+    serf_bucket_alloc_t *allocator);
+
 /* ==================================================================== */
 
 
@@ -336,6 +582,29 @@ serf_bucket_t *serf_bucket_mmap_create(
     apr_mmap_t *mmap,
     serf_bucket_alloc_t *allocator);
 
+/** Default window size of serf_bucket_mmap_window_create(). */
+#define SERF_MMAP_WINDOW_DEFAULT (16 * 1024 * 1024)
+
+/**
+ * Create an mmap bucket that reads @a file from its current position to
+ * the end, mapping at most @a window_size bytes of it at a time. Once the
+ * data of a window is read, the window is unmapped and the next part of the
+ * file is mapped. This keeps the memory use bounded for huge files, while
+ * the data is still read without copying.
+ *
+ * @a window_size is rounded up to a multiple of 64KB. Pass 0 to use
+ * SERF_MMAP_WINDOW_DEFAULT.
+ *
+ * If the size of @a file can't be determined, or if APR doesn't support
+ * mmap, a file bucket is returned instead.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_mmap_window_create(
+    apr_file_t *file,
+    apr_size_t window_size,
+    serf_bucket_alloc_t *allocator);
+
 
 /* ==================================================================== */
 
@@ -478,6 +747,108 @@ serf_bucket_t *serf_bucket_deflate_create(
 /* ==================================================================== */
 
 
+extern const serf_bucket_type_t serf_bucket_type_brotli_decompress;
+#define SERF_BUCKET_IS_BROTLI_DECOMPRESS(b) \
+    SERF_BUCKET_CHECK((b), brotli_decompress)
+
+/**
+ * Returns non-zero if serf was built with the brotli decoder.
+ *
+ * @since New in 1.4.
+ */
+int serf_bucket_is_brotli_supported(void);
+
+/**
+ * Create a bucket that decodes the brotli ("br") compressed @a stream.
+ * Returns NULL when serf was built without brotli.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_brotli_decompress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator);
+
+
+/* ==================================================================== */
+
+
+extern const serf_bucket_type_t serf_bucket_type_zstd_decompress;
+#define SERF_BUCKET_IS_ZSTD_DECOMPRESS(b) \
+    SERF_BUCKET_CHECK((b), zstd_decompress)
+
+/**
+ * Returns non-zero if serf was built with the zstd decoder.
+ *
+ * @since New in 1.4.
+ */
+int serf_bucket_is_zstd_supported(void);
+
+/**
+ * Create a bucket that decodes the zstd compressed @a stream, which may
+ * hold several frames. Returns NULL when serf was built without zstd.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_zstd_decompress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Wrap @a stream in the buckets that decode the content codings listed in
+ * @a content_encoding, the value of a Content-Encoding header, e.g.
+ * "gzip" or "br, gzip". The codings are undone in the reverse order of
+ * the list. "identity" is skipped. Decoding stops at the first coding
+ * that isn't supported, leaving @a stream encoded with it and those
+ * listed before it.
+ *
+ * Returns @a stream itself when there is nothing to decode.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_content_decode_create(
+    serf_bucket_t *stream,
+    const char *content_encoding,
+    serf_bucket_alloc_t *allocator);
+
+
+/* ==================================================================== */
+
+
+extern const serf_bucket_type_t serf_bucket_type_compress;
+#define SERF_BUCKET_IS_COMPRESS(b) SERF_BUCKET_CHECK((b), compress)
+
+#define SERF_COMPRESS_GZIP 0
+#define SERF_COMPRESS_DEFLATE 1
+#define SERF_COMPRESS_ZSTD 2
+
+/* Use the default compression level of the library. */
+#define SERF_COMPRESS_LEVEL_DEFAULT -1
+
+/**
+ * Create a bucket that compresses @a stream in @a format, one of
+ * SERF_COMPRESS_GZIP, SERF_COMPRESS_DEFLATE (the zlib format) or
+ * SERF_COMPRESS_ZSTD, at compression @a level of the library used, or
+ * SERF_COMPRESS_LEVEL_DEFAULT.
+ *
+ * The compressed length isn't known in advance, so a request body
+ * wrapped in this bucket is usually sent with a chunk bucket, and the
+ * request needs a matching Content-Encoding header. The data compressed
+ * so far is flushed whenever @a stream returns APR_EAGAIN.
+ *
+ * Returns NULL if @a format isn't supported by this build.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_compress_create(
+    serf_bucket_t *stream,
+    serf_bucket_alloc_t *allocator,
+    int format,
+    int level);
+
+
+/* ==================================================================== */
+
+
 extern const serf_bucket_type_t serf_bucket_type_limit;
 #define SERF_BUCKET_IS_LIMIT(b) SERF_BUCKET_CHECK((b), limit)
 
@@ -573,6 +944,47 @@ apr_status_t serf_ssl_use_default_certificates(
 apr_status_t serf_ssl_set_hostname(
     serf_ssl_context_t *context, const char *hostname);
 
+/**
+ * Callback type for the result of the application protocol negotiation.
+ * @a protocol is the protocol selected by the server, or "" when the server
+ * didn't select one.
+ *
+ * @since New in 1.4.
+ */
+typedef apr_status_t (*serf_ssl_protocol_result_cb_t)(
+    void *data,
+    const char *protocol);
+
+/**
+ * Offer the application @a protocols to the server during the handshake,
+ * using the ALPN extension. @a protocols is a comma separated list in order
+ * of preference, e.g. "h2,http/1.1".
+ *
+ * Once the handshake is done, @a callback is called with @a data and the
+ * protocol the server selected. An application that calls
+ * serf_connection_set_framing_type() with SERF_CONNECTION_FRAMING_TYPE_NONE
+ * from its connection setup can select the framing type from there.
+ *
+ * Returns APR_ENOTIMPL when the SSL library doesn't support ALPN, and
+ * APR_EINVAL when a protocol name is empty or too long.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_ssl_set_alpn_protocols(
+    serf_ssl_context_t *context,
+    const char *protocols,
+    serf_ssl_protocol_result_cb_t callback,
+    void *data);
+
+/**
+ * Return the application protocol the server selected, or "" when none
+ * was (yet) selected. The string lives as long as @a context.
+ *
+ * @since New in 1.4.
+ */
+const char *serf_ssl_get_selected_protocol(
+    serf_ssl_context_t *context);
+
 /**
  * Return the depth of the certificate.
  */
@@ -719,6 +1131,43 @@ serf_bucket_t *serf_bucket_copy_create(
 
 /* ==================================================================== */
 
+extern const serf_bucket_type_t serf_bucket_type_spill;
+#define SERF_BUCKET_IS_SPILL(b) SERF_BUCKET_CHECK((b), spill)
+
+/** Default memory threshold of serf_bucket_spill_create(). */
+#define SERF_SPILL_THRESHOLD_DEFAULT (1024 * 1024)
+
+/**
+ * Create a bucket that buffers the data of @a stream, e.g. a response body
+ * that has to be complete before the application can process it. Up to
+ * @a threshold bytes are kept in memory of @a allocator, the rest is
+ * written to a temporary file. Pass 0 to use SERF_SPILL_THRESHOLD_DEFAULT.
+ *
+ * Use serf_bucket_spill_fill() to buffer the data that @a stream has
+ * available. Reading the bucket returns the buffered data, followed by
+ * whatever @a stream has not handed out yet. The data in the temporary
+ * file is read back through an mmap bucket, once all of @a stream is
+ * buffered. The file is removed when the bucket is destroyed.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_bucket_spill_create(
+    serf_bucket_t *stream,
+    apr_size_t threshold,
+    serf_bucket_alloc_t *allocator);
+
+/**
+ * Read all available data from the stream of the spill @a bucket into its
+ * buffer. Returns APR_EOF once all of the stream is buffered, or the
+ * status of the stream when it has no more data for now, e.g. APR_EAGAIN.
+ *
+ * @since New in 1.4.
+ */
+apr_status_t serf_bucket_spill_fill(
+    serf_bucket_t *bucket);
+
+/* ==================================================================== */
+
 /* ### do we need a PIPE bucket type? they are simple apr_file_t objects */
 
 
@@ -294,6 +294,24 @@ apr_status_t serf_databuf_peek(
     const char **data,
     apr_size_t *len);
 
+/**
+ * Implement a bucket-style read_bucket function from the @see serf_databuf_t
+ * structure given by @a databuf: for the simple bucket @a type, the data
+ * in the buffer is handed over in a simple bucket from @a allocator,
+ * without copying it. Returns NULL for other types, if the buffer is
+ * empty, or if @a databuf does not belong to one of serf's own buckets;
+ * this never reads, so peek first to fill the buffer.
+ *
+ * From then on @a databuf reads into shared buffers, so the buckets it
+ * hands over can be moved with @see serf_bucket_move.
+ *
+ * @since New in 1.4.
+ */
+serf_bucket_t *serf_databuf_read_bucket(
+    serf_databuf_t *databuf,
+    const serf_bucket_type_t *type,
+    serf_bucket_alloc_t *allocator);
+
 
 #ifdef __cplusplus
 }
@@ -16,11 +16,18 @@
 #ifndef _SERF_PRIVATE_H_
 #define _SERF_PRIVATE_H_
 
-/* ### what the hell? why does the APR interface have a "size" ??
-   ### the implication is that, if we bust this limit, we'd need to
-   ### stop, rebuild a pollset, and repopulate it. what suckage.  */
+#include "serf_bucket_util.h"
+
+/* Initial size of the pollset of a context. APR pollsets have a fixed
+   size, so when it fills up the pollset is rebuilt with twice the size
+   and repopulated. */
 #define MAX_CONN 16
 
+/* Maximum number of cleared request pools a connection keeps around for
+   reuse by its next requests. */
+#define MAX_SPARE_RESPOOLS 8
+#define MAX_SPARE_CLIENT_POOLS 16
+
 /* Windows does not define IOV_MAX, so we need to ensure it is defined. */
 #ifndef IOV_MAX
 /* There is no limit for iovec count on Windows, but apr_socket_sendv
@@ -46,6 +53,8 @@
 #define SERF_IO_CLIENT (1)
 #define SERF_IO_CONN (2)
 #define SERF_IO_LISTENER (3)
+#define SERF_IO_CONNECT_ATTEMPT (4)
+#define SERF_IO_WAKEUP (5)
 
 /*** Logging facilities ***/
 
@@ -91,6 +100,11 @@
 #endif
 
 typedef struct serf__authn_scheme_t serf__authn_scheme_t;
+typedef struct serf__http2_t serf__http2_t;
+typedef struct serf__connect_attempt_t serf__connect_attempt_t;
+typedef struct serf__dns_lookup_t serf__dns_lookup_t;
+typedef struct serf__resolver_t serf__resolver_t;
+typedef struct serf__trace_t serf__trace_t;
 
 typedef struct serf_io_baton_t {
     int type;
@@ -98,9 +112,71 @@ typedef struct serf_io_baton_t {
         serf_incoming_t *client;
         serf_connection_t *conn;
         serf_listener_t *listener;
+        serf__connect_attempt_t *attempt;
+        serf_context_t *ctx;
     } u;
 } serf_io_baton_t;
 
+/* One of the connects a connection races against each other, see
+   serf_connection_set_happy_eyeballs(). */
+struct serf__connect_attempt_t {
+    serf_connection_t *conn;
+    apr_sockaddr_t *address;
+    apr_socket_t *skt;          /* NULL once the attempt is over */
+    serf_io_baton_t baton;
+    serf__connect_attempt_t *next;
+};
+
+/*** Timer wheel, from timer_wheel.c ***/
+
+typedef struct serf__timer_t serf__timer_t;
+
+/* Called when TIMER expires. A non-APR_SUCCESS status stops the running
+   of the timers and is returned from serf__timer_wheel_run(). */
+typedef apr_status_t (*serf__timer_cb_t)(serf__timer_t *timer);
+
+/* A timer, embedded in the object it times out. */
+struct serf__timer_t {
+    apr_int64_t expires;        /* in ticks */
+    serf__timer_cb_t cb;
+    void *baton;
+
+    /* The slot list, PREV is NULL when the timer isn't scheduled. */
+    serf__timer_t *next;
+    serf__timer_t **prev;
+};
+
+#define SERF__TIMER_LEVELS 4
+#define SERF__TIMER_SLOTS 64
+
+typedef struct serf__timer_wheel_t {
+    apr_int64_t tick;           /* the next tick to expire */
+    unsigned int nr_of_timers;
+    serf__timer_t *slots[SERF__TIMER_LEVELS][SERF__TIMER_SLOTS];
+} serf__timer_wheel_t;
+
+void serf__timer_wheel_init(serf__timer_wheel_t *wheel, apr_time_t now);
+
+void serf__timer_init(serf__timer_t *timer, serf__timer_cb_t cb, void *baton);
+
+/* Make TIMER expire at WHEN, rescheduling it if it is pending. */
+void serf__timer_schedule(serf__timer_wheel_t *wheel, serf__timer_t *timer,
+                          apr_time_t when);
+
+/* Cancel TIMER, if it is pending. */
+void serf__timer_cancel(serf__timer_wheel_t *wheel, serf__timer_t *timer);
+
+#define serf__timer_pending(timer) ((timer)->prev != NULL)
+
+/* Return the time from NOW until the wheel needs to run again, or -1 if
+   no timers are pending. */
+apr_interval_time_t serf__timer_wheel_next(const serf__timer_wheel_t *wheel,
+                                           apr_time_t now);
+
+/* Call the callbacks of all timers that expired at NOW. */
+apr_status_t serf__timer_wheel_run(serf__timer_wheel_t *wheel,
+                                   apr_time_t now);
+
 /* Holds all the information corresponding to a request/response pair. */
 struct serf_request_t {
     serf_connection_t *conn;
@@ -126,6 +202,37 @@ struct serf_request_t {
 
     int writing_started;
     int priority;
+
+    /* The priority class, see serf_connection_request_create2(), and the
+       virtual time at which the request is due in the weighted fair
+       scheduling of its connection. */
+    int priority_class;
+    apr_uint64_t sched_tag;
+
+    /* When the request was completely written, to measure the response
+       time for adaptive pipelining. */
+    apr_time_t written_time;
+
+    /* Continue the response on a new connection when the old one drops,
+       see serf_request_set_resumable(). RESUME_OFFSET body bytes of the
+       representation identified by RESUME_VALIDATOR were delivered. */
+    int resumable;
+    apr_uint64_t resume_offset;
+    const char *resume_validator;
+
+    /* See serf_request_set_timeouts(). The first byte timer runs from
+       the moment the request is written until its response arrives. */
+    apr_interval_time_t first_byte_timeout;
+    serf__timer_t first_byte_timer;
+    serf__timer_t total_timer;
+    int timed_out;
+
+    /* See serf_request_pause_reading() */
+    int read_paused;
+
+    /* See serf_request_get_timings() */
+    serf_request_timings_t timings;
+
     /* 1 if this is a request to setup a SSL tunnel, 0 for normal requests. */
     int ssltunnel;
 
@@ -136,20 +243,75 @@ struct serf_request_t {
        anymore. */
     void *auth_baton;
 
+    /* The path of the request and the realm whose credentials were sent
+       with it, recorded when its authentication headers were set up. They
+       tell the handler of a 401 response which protection space the
+       challenge is for. */
+    const char *auth_path;
+    struct serf__authn_realm_t *auth_realm;
+
     struct serf_request_t *next;
 };
 
+typedef struct serf__pollfd_t serf__pollfd_t;
+
 typedef struct serf_pollset_t {
     /* the set of connections to poll */
     apr_pollset_t *pollset;
+
+    /* pool holding POLLSET, replaced when the pollset is rebuilt */
+    apr_pool_t *pollset_pool;
+
+    /* the pools of replaced pollsets (apr_pool_t *). The events returned
+       by the last poll may still point into them while they are
+       dispatched, so they are destroyed by the next prerun. */
+    apr_array_header_t *retired_pools;
+
+    /* the number of descriptors POLLSET was created for, and how many
+       it currently holds */
+    apr_uint32_t size;
+    apr_uint32_t nelts;
+
+    /* the flags POLLSET was created with */
+    apr_uint32_t flags;
+
+    /* the registered descriptors (serf__pollfd_t *), keyed by their
+       socket or file, to repopulate a rebuilt pollset. */
+    apr_hash_t *pfds;
+
+    /* unused entries, recycled by the next add */
+    serf__pollfd_t *free_pfds;
+
+    apr_pool_t *pool;
 } serf_pollset_t;
 
+/* A realm of a server, with the credentials the scheme that
+   authenticated to it keeps for it. */
+typedef struct serf__authn_realm_t {
+    const char *name;
+
+    const serf__authn_scheme_t *scheme;
+
+    /* The credentials, allocated from POOL. POOL is cleared each time they
+       are replaced, see serf__authn_realm_reset(). */
+    void *baton;
+    apr_pool_t *pool;
+} serf__authn_realm_t;
+
 typedef struct serf__authn_info_t {
     const serf__authn_scheme_t *scheme;
 
     void *baton;
 
     int failed_authn_types;
+
+    /* Server authentication only: the realms authenticated to by name,
+       the path prefixes each was found to protect, and the realm last
+       authenticated to. Requests get the credentials of their realm up
+       front, see serf__setup_request_authn(). */
+    apr_hash_t *realms;
+    apr_array_header_t *spaces;
+    serf__authn_realm_t *realm;
 } serf__authn_info_t;
 
 /*** Configuration store declarations ***/
@@ -169,6 +331,10 @@ struct serf_config_t {
     serf__config_hdr_t *per_host;
     /* Configuration key/value pairs per connection */
     serf__config_hdr_t *per_conn;
+
+    /* Where PER_CONTEXT keeps SERF_CONFIG_CTX_LOGBATON, so logging, which
+       needs it on every call, doesn't look it up */
+    void **log_baton;
 };
 
 typedef struct serf__config_store_t {
@@ -223,6 +389,44 @@ apr_status_t
 serf__config_store_remove_host(serf__config_store_t config_store,
                                const char *hostname_port);
 
+/* What the connections to a host learned about the server. Stored in the
+   per host configuration, so that new connections to the host don't have
+   to learn it again. */
+typedef struct serf__host_traits_t {
+    /* The number of responses after which the server closed the
+       connection, 0 if unknown. */
+    unsigned int keepalive_limit;
+
+    /* The last depth of adaptive pipelining, 0 if unknown. */
+    unsigned int pipelining_depth;
+
+    /* Zero if pipelining failed with this server. */
+    int pipelining;
+} serf__host_traits_t;
+
+/* The key of the serf__host_traits_t * in the per host configuration. */
+#define SERF__CONFIG_HOST_TRAITS (SERF_CONFIG_PER_HOST | 0x000003)
+
+/* The key of the TLS session to resume on new connections to the host, see
+   ssl_buckets.c. */
+#define SERF__CONFIG_HOST_SSL_SESSION (SERF_CONFIG_PER_HOST | 0x000004)
+
+/* The key of the server certificates recently accepted for the host, see
+   ssl_buckets.c. */
+#define SERF__CONFIG_HOST_VERIFIED_CERTS (SERF_CONFIG_PER_HOST | 0x000005)
+
+/* The key of the OCSP responses recently stapled by the host, see
+   ssl_buckets.c. */
+#define SERF__CONFIG_HOST_OCSP_CACHE (SERF_CONFIG_PER_HOST | 0x000006)
+
+/* The key of the SSL_CTX's shared by the connections of a context, see
+   ssl_buckets.c. */
+#define SERF__CONFIG_CTX_SSL_CTX_CACHE (SERF_CONFIG_PER_CONTEXT | 0x000002)
+
+/* The key of the serf_connection_timings_t * of a connection, which the
+   ssl buckets fill in the handshake times of. */
+#define SERF__CONFIG_CONN_TIMINGS (SERF_CONFIG_PER_CONNECTION | 0x000005)
+
 struct serf_context_t {
     /* the pool used for self and for other allocations */
     apr_pool_t *pool;
@@ -236,6 +440,17 @@ struct serf_context_t {
     /* one of our connections has a dirty pollset state. */
     int dirty_pollset;
 
+    /* the connections with a dirty pollset state. */
+    serf_connection_t *dirty_conns;
+
+    /* The pipe that wakes up serf_context_run() from other threads, in the
+       pollset for as long as the context lives, see
+       serf__context_create_wakeable(). NULL if the context can't be woken
+       up. */
+    apr_file_t *wakeup_in;
+    apr_file_t *wakeup_out;
+    serf_io_baton_t wakeup_baton;
+
     /* the list of active connections */
     apr_array_header_t *conns;
 #define GET_CONN(ctx, i) (((serf_connection_t **)(ctx)->conns->elts)[i])
@@ -249,6 +464,19 @@ struct serf_context_t {
     apr_off_t progress_read;
     apr_off_t progress_written;
 
+    /* See serf_context_set_progress_batching(). The totals and the time
+       of the last report. */
+    int progress_batched;
+    apr_off_t progress_min_bytes;
+    apr_interval_time_t progress_min_interval;
+    apr_off_t progress_reported_read;
+    apr_off_t progress_reported_written;
+    apr_time_t progress_reported_time;
+
+    /* The connection that is being processed, which the bytes read from
+       the socket buckets are counted for. */
+    serf_connection_t *progress_conn;
+
     /* authentication info for the servers used in this context. Shared by all
        connections to the same server.
        Structure of the hashtable:  key: host url, e.g. https://localhost:80
@@ -260,14 +488,52 @@ struct serf_context_t {
        all connections. */
     serf__authn_info_t proxy_authn_info;
 
+    /* Start the TLS handshake of a tunnel right behind its CONNECT request,
+       see serf_config_proxy_tunnel_pipelining(). */
+    int proxy_tunnel_pipelining;
+
     /* List of authn types supported by the client.*/
     int authn_types;
     /* Callback function used to get credentials for a realm. */
     serf_credentials_callback_t cred_cb;
 
     serf_config_t *config;
+
+    /* Connection and request timeouts */
+    serf__timer_wheel_t timers;
+
+    /* Finished lookups by "hostname:port", the running lookups, the
+       timer that collects them and the threads that run them, see
+       resolve.c. */
+    apr_hash_t *dns_cache;
+    serf__dns_lookup_t *dns_lookups;
+    apr_interval_time_t dns_ttl;
+    serf__timer_t dns_timer;
+    serf__resolver_t *dns_resolver;
+
+    /* The binary trace of the traffic, if enabled, and the id of the last
+       connection created. See serf_context_trace_to_file(). */
+    serf__trace_t *trace;
+    apr_uint32_t last_conn_id;
+
+    /* The metrics of the connections that were closed, see
+       serf_context_get_metrics(). */
+    serf_metrics_t closed_metrics;
 };
 
+/* Data that still has to be written to a socket: the VEC_LEN iovecs from
+   VEC_START on, followed by the SENDFILE_LEN bytes of SENDFILE_FILE from
+   SENDFILE_OFFSET on, which are sent with apr_socket_sendfile(). See
+   serf__pending_write() in outgoing.c. */
+typedef struct serf__pending_t {
+    struct iovec vec[IOV_MAX];
+    int vec_start;
+    int vec_len;
+    apr_file_t *sendfile_file;
+    apr_off_t sendfile_offset;
+    apr_size_t sendfile_len;
+} serf__pending_t;
+
 struct serf_listener_t {
     serf_context_t *ctx;
     serf_io_baton_t baton;
@@ -276,6 +542,10 @@ struct serf_listener_t {
     apr_pollfd_t desc;
     void *accept_baton;
     serf_accept_client_t accept_func;
+
+    /* Pools of closed client connections, cleared, for the next ones. */
+    apr_pool_t *spare_pools[MAX_SPARE_CLIENT_POOLS];
+    int nr_of_spare_pools;
 };
 
 struct serf_incoming_t {
@@ -285,6 +555,56 @@ struct serf_incoming_t {
     serf_incoming_request_cb_t request;
     apr_socket_t *skt;
     apr_pollfd_t desc;
+
+    /* Owned by the connection, destroyed when it is closed, or handed
+       back to LISTENER when that created it. */
+    apr_pool_t *pool;
+    serf_listener_t *listener;
+    serf_bucket_alloc_t *allocator;
+    serf_config_t *config;
+
+    serf_incoming_closed_t closed;
+    void *closed_baton;
+
+    /* The socket bucket the requests are read from. */
+    serf_bucket_t *stream;
+
+    /* The requests in the order they came in, which is the order their
+       responses are written in. READING is the one being read, if any. */
+    serf_incoming_request_t *requests;
+    serf_incoming_request_t *requests_tail;
+    serf_incoming_request_t *reading;
+
+    /* Don't read more requests: the connection is closed once the
+       responses to the ones read are written. */
+    int stop_reading;
+
+    /* The response of the first request was read up to its end, what is
+       left in VEC is the last of it. */
+    int hit_eof;
+
+    /* Response data that still has to be written to the socket. */
+    serf__pending_t pending;
+};
+
+struct serf_incoming_request_t {
+    serf_incoming_t *incoming;
+    apr_pool_t *pool;
+
+    /* The incoming request bucket, and the response to it once there is
+       one. */
+    serf_bucket_t *req_bkt;
+    serf_bucket_t *resp_bkt;
+
+    serf_incoming_handler_t handler;
+    void *handler_baton;
+
+    int headers_read;           /* The request callback was called. */
+    int read_done;              /* The whole request was read. */
+    int written;                /* The whole response was written. */
+    int close_after;            /* Close the connection after the response. */
+
+    serf_incoming_request_t *next;
 };
 
 /* States for the different stages in the lifecyle of a connection. */
@@ -299,6 +619,9 @@ typedef enum {
 struct serf_connection_t {
     serf_context_t *ctx;
 
+    /* Identifies the connection in the trace of CTX, starting at 1. */
+    apr_uint32_t id;
+
     apr_status_t status;
     serf_io_baton_t baton;
 
@@ -319,6 +642,13 @@ struct serf_connection_t {
     /* are we a dirty connection that needs its poll status updated? */
     int dirty_conn;
 
+    /* our links in the list of dirty connections of the context. */
+    serf_connection_t *dirty_next;
+    serf_connection_t **dirty_prev;
+
+    /* is the socket in the pollset, with REQEVENTS? */
+    int in_pollset;
+
     /* number of completed requests we've sent */
     unsigned int completed_requests;
 
@@ -350,6 +680,12 @@ struct serf_connection_t {
     /* Aggregate bucket used to send the CONNECT request. */
     serf_bucket_t *ssltunnel_ostream;
 
+    /* The input stream of the application, while the TLS handshake sent
+       behind the CONNECT request waits for the proxy to set up the tunnel;
+       STREAM reads the response to the CONNECT request meanwhile. NULL
+       otherwise. */
+    serf_bucket_t *tunneled_stream;
+
     /* The list of requests that are written but no response has been received
        yet. */
     serf_request_t *written_reqs;
@@ -361,8 +697,19 @@ struct serf_connection_t {
     serf_request_t *unwritten_reqs_tail;
     unsigned int nr_of_unwritten_reqs;
 
-    struct iovec vec[IOV_MAX];
-    int vec_len;
+    /* The unwritten requests are ordered by their SCHED_TAG. SCHED_VTIME
+       is the tag of the last request that started writing, SCHED_LAST the
+       tag of the last request queued in each priority class. */
+    apr_uint64_t sched_vtime;
+    apr_uint64_t sched_last[SERF_PRIORITY_HIGHEST + 1];
+
+    /* Request data that still has to be written to the socket. */
+    serf__pending_t pending;
+
+    /* Cleared pools of finished requests, ready to be reused by
+       setup_request(). */
+    apr_pool_t *spare_respools[MAX_SPARE_RESPOOLS];
+    int nr_of_spare_respools;
 
     serf_connection_setup_t setup;
     void *setup_baton;
@@ -376,6 +723,18 @@ struct serf_connection_t {
        only. */
     int pipelining;
 
+    /* Adaptive pipelining: max_outstanding_requests is tuned between
+       MIN_DEPTH and MAX_DEPTH. It doubles per round of responses while
+       below DEPTH_THRESHOLD, and grows by one above it. SRTT is the
+       smoothed response time, ROUND_RESPONSES counts the responses since
+       the depth last changed. */
+    int adaptive_pipelining;
+    unsigned int min_depth;
+    unsigned int max_depth;
+    unsigned int depth_threshold;
+    apr_interval_time_t srtt;
+    unsigned int round_responses;
+
     int hit_eof;
 
     /* Host url, path ommitted, syntax: https://svn.apache.org . */
@@ -394,15 +753,123 @@ struct serf_connection_t {
     /* Calculated connection latency. Negative value if latency is unknown. */
     apr_interval_time_t latency;
 
-    /* Needs to read first before we can write again. */
+    /* Needs to read first before we can write again, since
+       STOP_WRITING_TIME. */
     int stop_writing;
+    apr_time_t stop_writing_time;
 
     /* Configuration shared with buckets and authn plugins */
     serf_config_t *config;
+
+    /* The protocol to use on new connections, SERF_CONNECTION_FRAMING_TYPE_*,
+       and the HTTP/2 protocol state when it's in use. */
+    int framing_type;
+    serf__http2_t *http2;
+
+    /* See serf_connection_set_timeouts() */
+    apr_interval_time_t connect_timeout;
+    apr_interval_time_t idle_timeout;
+    serf__timer_t connect_timer;
+    serf__timer_t idle_timer;
+
+    /* Happy eyeballs: the addresses to race in order of preference, of
+       which the first NEXT_RACE_ADDRESS are tried, the running ATTEMPTS,
+       and the timer that starts the next attempt. RACE_STATUS is the
+       error of the last failed attempt. */
+    int happy_eyeballs;
+    apr_array_header_t *race_addresses;
+    int next_race_address;
+    serf__connect_attempt_t *attempts;
+    serf__timer_t attempt_timer;
+    apr_status_t race_status;
+
+    /* The lookup of the server's address, for connections created with
+       serf_connection_create_async(). conn->address points into it. */
+    serf__dns_lookup_t *lookup;
+
+    /* See serf_connection_prewarm(). PREWARM_STARTED is set once the
+       setup of the current socket was kicked off. */
+    int prewarm;
+    int prewarm_started;
+
+    /* See serf_connection_set_tcp_fastopen() */
+    int tcp_fastopen;
+
+    /* See serf_connection_set_cork() */
+    int cork;
+
+    /* See serf_connection_set_read_bufsize(), 0 for the default. */
+    apr_size_t read_bufsize;
+
+    /* The number of requests that paused reading, and the timer that
+       continues reading once none is left. */
+    int read_paused;
+    serf__timer_t resume_timer;
+
+    /* The bytes read and written on this connection, all sockets. */
+    apr_off_t progress_read;
+    apr_off_t progress_written;
+
+    /* See serf_connection_get_timings(). The byte counts are taken from
+       PROGRESS_READ and PROGRESS_WRITTEN when they are asked for. */
+    serf_connection_timings_t timings;
+    serf_request_timings_cb_t timings_callback;
+    void *timings_baton;
+
+    /* See serf_connection_get_metrics(). The byte counts, the handshake of
+       the current socket and the current stop_writing period are added
+       when they are asked for. */
+    serf_metrics_t metrics;
 };
 
 /*** Internal bucket functions ***/
 
+/* A serf_databuf_t that reads into a buffer of a configurable size. The
+   public struct keeps its layout; serf__databuf_init() makes its reader
+   point back to this struct, and the serf_databuf_*() functions use BUFFER
+   instead of DATABUF.buf when they find it. */
+typedef struct serf__databuf_t {
+    serf_databuf_t databuf;
+
+    /* The reader and its baton, as given to serf__databuf_init(). */
+    serf_databuf_reader_t read;
+    void *read_baton;
+
+    /* The buffer in use, of BUFSIZE bytes. This is DATABUF.buf, unless
+       another size was set with serf__databuf_set_bufsize(), in which case
+       it was allocated from ALLOCATOR. */
+    char *buffer;
+    apr_size_t bufsize;
+    serf_bucket_alloc_t *allocator;
+
+    /* The shared buffer that BUFFER is the data of, once the data was
+       handed over by serf_databuf_read_bucket(), or NULL. */
+    serf_shared_buffer_t *shared;
+} serf__databuf_t;
+
+/* Initialize PDB to read with READ and READ_BATON. */
+void serf__databuf_init(serf__databuf_t *pdb,
+                        serf_databuf_reader_t read,
+                        void *read_baton);
+
+/* Make PDB read up to BUFSIZE bytes at a time, allocating its buffer from
+   ALLOCATOR when it is larger than SERF_DATABUF_BUFSIZE. Data that is still
+   in the buffer is kept. After a hand-over by serf_databuf_read_bucket()
+   the new buffer is a shared buffer again. Buckets that set a size must
+   call serf__databuf_cleanup() when they are destroyed. */
+void serf__databuf_set_bufsize(serf__databuf_t *pdb,
+                               apr_size_t bufsize,
+                               serf_bucket_alloc_t *allocator);
+
+/* Free the buffer allocated by serf__databuf_set_bufsize(), if any. */
+void serf__databuf_cleanup(serf__databuf_t *pdb);
+
+/* Apply the SERF_CONFIG_CONN_READ_BUFSIZE of CONFIG, if set, to PDB of a
+   bucket from ALLOCATOR. */
+void serf__databuf_configure(serf__databuf_t *pdb,
+                             serf_config_t *config,
+                             serf_bucket_alloc_t *allocator);
+
 /** Transform a response_bucket in-place into an aggregate bucket. Restore the
     status line and all headers, not just the body.
  
@@ -420,12 +887,85 @@ apr_status_t serf_response_full_become_aggregate(serf_bucket_t *bucket);
 void serf__bucket_response_set_error_on_eof(serf_bucket_t *bucket,
                                             apr_status_t error);
 
+/* Get the point where the response bucket BUCKET could be continued after
+   the connection dropped: the number of body bytes read so far, OFFSET,
+   and the ETag or Last-Modified header VALIDATOR of the representation.
+   Returns 0 if the response can't be resumed. */
+int serf__bucket_response_get_resume_point(serf_bucket_t *bucket,
+                                           apr_uint64_t *offset,
+                                           const char **validator);
+
+/* Make the response bucket BUCKET continue a response of which OFFSET body
+   bytes were read already, see serf_request_set_resumable(). VALIDATOR
+   must live as long as BUCKET. */
+void serf__bucket_response_set_resume(serf_bucket_t *bucket,
+                                      apr_uint64_t offset,
+                                      const char *validator);
+
+/* Returns 1 if the connection has to be closed after the outgoing response
+   BUCKET, which must not have been read yet: because its headers say so,
+   or because the end of the body is only known by closing it. */
+int serf__bucket_outgoing_response_closes(serf_bucket_t *bucket);
+
 /**
  * Remove the header from the list, do nothing if the header wasn't added.
  */
 void serf__bucket_headers_remove(serf_bucket_t *headers_bucket,
                                  const char *header);
 
+/**
+ * Get the parts of the request bucket BUCKET, which must not have been read
+ * yet. The ownership of the body moves to the caller: BUCKET won't send or
+ * destroy it anymore, unless BODY_BKT is NULL. CONTENT_LENGTH is -1 when
+ * the length isn't known.
+ */
+void serf__bucket_request_read(serf_bucket_t *bucket,
+                               serf_bucket_t **body_bkt,
+                               const char **uri,
+                               const char **method,
+                               apr_int64_t *content_length);
+
+/*** HPACK header compression, from buckets/hpack_buckets.c ***/
+
+typedef struct serf__hpack_table_t serf__hpack_table_t;
+
+/* Create the table to decode the header blocks of one HTTP/2 connection
+   with, holding at most MAX_SIZE bytes of headers (our
+   SETTINGS_HEADER_TABLE_SIZE). */
+serf__hpack_table_t *serf__hpack_table_create(apr_size_t max_size,
+                                              apr_pool_t *pool);
+
+/* Called for each header decoded from a header block. NAME and VALUE are
+   not necessarily NUL terminated and only valid during the call. */
+typedef apr_status_t (*serf__hpack_header_cb_t)(void *baton,
+                                                const char *name,
+                                                apr_size_t name_len,
+                                                const char *value,
+                                                apr_size_t value_len);
+
+/* Decode the complete header block of LEN bytes in DATA, calling CB for
+   each header in it. Returns SERF_ERROR_HTTP2_COMPRESSION_ERROR when the
+   block is invalid, after which TBL is unusable. */
+apr_status_t serf__hpack_decode(serf__hpack_table_t *tbl,
+                                const char *data,
+                                apr_size_t len,
+                                serf__hpack_header_cb_t cb,
+                                void *baton,
+                                apr_pool_t *scratch_pool);
+
+/* Encode the header block of a request with the given pseudo headers and
+   the headers in HEADERS, leaving out those HTTP/2 doesn't allow. The
+   block is allocated in ALLOCATOR, the caller frees it. AUTHORITY and
+   HEADERS may be NULL. */
+void serf__hpack_encode_request(char **block,
+                                apr_size_t *block_len,
+                                const char *method,
+                                const char *scheme,
+                                const char *authority,
+                                const char *path,
+                                serf_bucket_t *headers,
+                                serf_bucket_alloc_t *allocator);
+
 /*** Authentication handler declarations ***/
 
 typedef enum { PROXY, HOST } peer_t;
@@ -541,10 +1081,73 @@ apr_status_t serf__handle_auth_response(int *consumed_response,
    able to cleanup stale objects from time to time. */
 serf__authn_info_t *serf__get_authn_info_for_server(serf_connection_t *conn);
 
+/* Set up the server authentication headers of REQUEST for METHOD and URI in
+   HDRS_BKT. When the path of URI lies in a realm authenticated to before, the
+   credentials of that realm are sent preemptively, saving a 401 round trip. */
+void serf__setup_request_authn(serf_request_t *request,
+                               const char *method,
+                               const char *uri,
+                               serf_bucket_t *hdrs_bkt);
+
 /* fromt context.c */
 void serf__context_progress_delta(void *progress_baton, apr_off_t read,
                                   apr_off_t written);
 
+/* Trace the data received by a socket bucket of the context in BATON, for
+   the connection it is processing. A serf__trace_cb_t. */
+void serf__context_trace_received(void *baton, const struct iovec *vecs,
+                                  int nvecs, apr_size_t len);
+
+/* Call the progress callback of CTX with the batched progress, if any and
+   the thresholds are met. */
+void serf__context_progress_report(serf_context_t *ctx);
+
+/* Add the counters of METRICS to SUM. */
+void serf__metrics_add(serf_metrics_t *sum, const serf_metrics_t *metrics);
+
+/* Mark the pollset state of CONN as dirty, so that it is updated before
+   the next poll. */
+void serf__conn_set_dirty(serf_connection_t *conn);
+
+/* Take CONN off the list of dirty connections of its context. */
+void serf__conn_clear_dirty(serf_connection_t *conn);
+
+/* Stop writing on CONN until something was read, and continue again. The
+   time in between is counted in the metrics of CONN. */
+void serf__conn_stop_writing(serf_connection_t *conn);
+void serf__conn_continue_writing(serf_connection_t *conn);
+
+/* Create a context whose serf_context_run() can be woken up from another
+   thread with serf__context_wakeup(). */
+serf_context_t *serf__context_create_wakeable(apr_pool_t *pool);
+
+/* Make a blocking serf_context_run() on CTX return early. Returns
+   APR_ENOTIMPL if CTX wasn't created with serf__context_create_wakeable()
+   or pipes can't be polled on this platform. Safe to call from any
+   thread. */
+apr_status_t serf__context_wakeup(serf_context_t *ctx);
+
+/* from resolve.c */
+void serf__dns_init(serf_context_t *ctx);
+
+/* Start looking up the address of HOSTNAME:PORT for CTX in the background,
+   or find it in the cache of CTX. Release *LOOKUP with
+   serf__dns_lookup_release() when its address is no longer used. */
+apr_status_t serf__dns_lookup(serf__dns_lookup_t **lookup,
+                              serf_context_t *ctx,
+                              const char *hostname,
+                              apr_port_t port);
+
+/* Return APR_EAGAIN while LOOKUP is running, else its outcome and in
+   *ADDRESS the list of addresses found. */
+apr_status_t serf__dns_lookup_result(apr_sockaddr_t **address,
+                                     const serf__dns_lookup_t *lookup);
+
+void serf__dns_lookup_release(serf__dns_lookup_t *lookup);
+
+/* Collect the results of the finished lookups of CTX. */
+void serf__dns_process(serf_context_t *ctx);
+
 /* from incoming.c */
 apr_status_t serf__process_client(serf_incoming_t *l, apr_int16_t events);
 apr_status_t serf__process_listener(serf_listener_t *l);
@@ -554,11 +1157,31 @@ apr_status_t serf__open_connections(serf_context_t *ctx);
 apr_status_t serf__process_connection(serf_connection_t *conn,
                                        apr_int16_t events);
 apr_status_t serf__conn_update_pollset(serf_connection_t *conn);
+apr_status_t serf__process_connect_attempt(serf__connect_attempt_t *attempt,
+                                           apr_int16_t events);
 serf_request_t *serf__ssltunnel_request_create(serf_connection_t *conn,
                                                serf_request_setup_t setup,
                                                void *setup_baton);
 void serf__connection_set_pipelining(serf_connection_t *conn, int enabled);
 
+/* Returns the number of requests on CONN that would be handled before a
+   new request in priority class PRIORITY. */
+unsigned int serf__connection_requests_ahead(serf_connection_t *conn,
+                                             int priority);
+
+/* Note that REQUEST on CONN starts writing, for the request scheduling. */
+void serf__connection_request_started(serf_connection_t *conn,
+                                      serf_request_t *request);
+
+/* Note that the response of REQUEST on CONN is complete, for the timings
+   of the request. */
+void serf__connection_request_completed(serf_connection_t *conn,
+                                        serf_request_t *request);
+
+/* Note that a request was written completely on CONN, and moved to its
+   written requests, for the metrics. */
+void serf__connection_request_written(serf_connection_t *conn);
+
 apr_status_t serf__provide_credentials(serf_context_t *ctx,
                                        char **username,
                                        char **password,
@@ -570,6 +1193,52 @@ apr_status_t serf__provide_credentials(serf_context_t *ctx,
 /* Requeue a request (at the front).  */
 serf_request_t *serf__request_requeue(const serf_request_t *request);
 
+/* Shared with the protocol engines, see http2_protocol.c. */
+apr_status_t serf__setup_request(serf_request_t *request);
+apr_status_t serf__handle_response(serf_request_t *request,
+                                   apr_pool_t *pool);
+apr_status_t serf__destroy_request(serf_request_t *request);
+
+/* Write as much of PENDING to SKT as the socket accepts, and drop what was
+   written from it. *WRITTEN is set to the number of bytes written. When
+   TRACE isn't NULL, the data is traced as sent on connection TRACE_ID. */
+apr_status_t serf__pending_write(serf__pending_t *pending,
+                                 apr_socket_t *skt,
+                                 serf__trace_t *trace,
+                                 apr_uint32_t trace_id,
+                                 serf_config_t *config,
+                                 apr_size_t *written);
+
+/* Write as much of the output stream of CONN to the socket as it accepts.
+   Returns APR_EAGAIN when data is left, APR_SUCCESS when all was
+   written. */
+apr_status_t serf__connection_flush(serf_connection_t *conn);
+
+/* from http2_protocol.c */
+
+/* Start talking HTTP/2 on the new socket of CONN. */
+apr_status_t serf__http2_setup(serf_connection_t *conn);
+
+/* Forget the HTTP/2 state of CONN, when its socket is closed. The
+   requests are left to the connection. */
+void serf__http2_teardown(serf_connection_t *conn);
+
+apr_status_t serf__http2_read(serf_connection_t *conn);
+apr_status_t serf__http2_write(serf_connection_t *conn);
+
+/* Return non-zero if CONN has something to write. */
+int serf__http2_wants_write(serf_connection_t *conn);
+
+/* Called when REQUEST is destroyed, to close its stream. */
+void serf__http2_request_destroyed(serf_connection_t *conn,
+                                   serf_request_t *request);
+
+/* Set up the streams of the application on CONN, whose tunnel isn't set up
+   yet, and start the TLS handshake. The records to send right behind the
+   CONNECT request are returned in *HANDSHAKE. Used by ssltunnel.c. */
+apr_status_t serf__conn_start_tunneled_handshake(serf_connection_t *conn,
+                                                 serf_bucket_t **handshake);
+
 /* from ssltunnel.c */
 apr_status_t serf__ssltunnel_connect(serf_connection_t *conn);
 
@@ -581,12 +1250,89 @@ serf_bucket_t *serf__bucket_log_wrapper_create(serf_bucket_t *wrapped,
                                                const char *prefix,
                                                serf_bucket_alloc_t *allocator);
 
+/* Splice a bucket of TYPE off STREAM with serf_bucket_read_bucket(), if
+   all the data STREAM has buffered fits in the *REMAINING bytes left of
+   the body read from it. *REMAINING is decreased by the length of the
+   returned bucket. Used by the buckets that limit the length of a body. */
+serf_bucket_t *serf__bucket_read_bucket_limited(serf_bucket_t *stream,
+                                                const serf_bucket_type_t *type,
+                                                apr_uint64_t *remaining);
+
+/* Shared buffers for serf_databuf_read_bucket(): allocate one of LEN
+   bytes that aren't initialized, get at its data, and create a simple
+   bucket of the LEN bytes at DATA within BUFFER. The bucket takes over the
+   caller's reference to BUFFER. */
+serf_shared_buffer_t *serf__shared_buffer_alloc(apr_size_t len);
+char *serf__shared_buffer_data(serf_shared_buffer_t *buffer);
+serf_bucket_t *serf__bucket_shared_span_create(serf_shared_buffer_t *buffer,
+                                               const char *data,
+                                               apr_size_t len,
+                                               serf_bucket_alloc_t *allocator);
+
+/* serf_bucket_move() for simple and aggregate buckets: whether BUCKET can
+   be moved, and move it to ALLOCATOR. */
+int serf__bucket_simple_movable(serf_bucket_t *bucket);
+serf_bucket_t *serf__bucket_simple_move(serf_bucket_t *bucket,
+                                        serf_bucket_alloc_t *allocator);
+int serf__bucket_aggregate_movable(serf_bucket_t *bucket);
+serf_bucket_t *serf__bucket_aggregate_move(serf_bucket_t *bucket,
+                                           serf_bucket_alloc_t *allocator);
+
+/* The SSL_CTX that the SSL of SSL_CTX uses, as a void * to keep OpenSSL out
+   of this header. Used by the tests. */
+void *serf__ssl_get_ssl_ctx(serf_ssl_context_t *ssl_ctx);
+
+/* Have the socket bucket BUCKET receive no further than the end of the
+   header section of the HTTP message it reads, so that what follows is left
+   on the socket for another bucket. */
+void serf__bucket_socket_read_head_only(serf_bucket_t *bucket);
+
+/* Have the socket bucket BUCKET pass everything it receives to TRACE_FUNC.
+   The data of the first LEN bytes of the NVECS VECS was received. */
+typedef void (*serf__trace_cb_t)(void *trace_baton, const struct iovec *vecs,
+                                 int nvecs, apr_size_t len);
+
+void serf__bucket_socket_set_trace_cb(serf_bucket_t *bucket,
+                                      serf__trace_cb_t trace_func,
+                                      void *trace_baton);
+
+/** Binary trace, see trace.c **/
+
+/* Records that LEN bytes, starting in the NVECS VECS, were sent or received
+   on the connection with CONN_ID. TYPE is one of the SERF_TRACE_* values.
+   Payload beyond the sample size of TRACE, or beyond VECS, isn't kept. */
+void serf__trace(serf__trace_t *trace, apr_uint32_t conn_id,
+                 apr_uint32_t type, const struct iovec *vecs, int nvecs,
+                 apr_size_t len);
+
 /** Logging functions. **/
 
 /* Initialize the logging subsystem. This will store a log baton in the 
    context's configuration store. */
 apr_status_t serf__log_init(serf_context_t *ctx);
 
+#ifdef SERF_LOGGING_ENABLED
+/* The log outputs of a context, stored as SERF_CONFIG_CTX_LOGBATON. */
+typedef struct serf__log_baton_t {
+    apr_array_header_t *output_list;
+
+    /* Per log level, the components that any output logs at that level */
+    apr_uint32_t comps[LOGLVL_DEBUG + 1];
+} serf__log_baton_t;
+
+/* Tells whether an event of LEVEL and COMP would be logged on CONFIG by any
+   output. This is cheap, so that callers can skip preparing an event that
+   nobody would log, like the message dumps of LOGCOMP_RAWMSG. serf__log()
+   and serf__log_nopref() do this check first as well. */
+#define serf__log_enabled(level, comp, config)                             \
+    ((config) && (config)->log_baton && *(config)->log_baton              \
+     && (level) <= LOGLVL_DEBUG                                           \
+     && (((serf__log_baton_t *)*(config)->log_baton)->comps[level]        \
+         & (comp)))
+#else
+#define serf__log_enabled(level, comp, config) 0
+#endif
+
 /* Logs a standard event, but without prefix. This is useful to build up
    log lines in parts. */
 void serf__log_nopref(apr_uint32_t level, apr_uint32_t comp,
@@ -596,4 +1342,11 @@ void serf__log_nopref(apr_uint32_t level, apr_uint32_t comp,
 void serf__log(apr_uint32_t level, apr_uint32_t comp, const char *filename,
                serf_config_t *config, const char *fmt, ...);
 
+/* Logs the allocation statistics of ALLOCATOR, labeled with NAME. Does
+   nothing if statistics collection isn't enabled on ALLOCATOR. */
+void serf__log_alloc_stats(apr_uint32_t level, apr_uint32_t comp,
+                           const char *filename, serf_config_t *config,
+                           const char *name,
+                           const serf_bucket_alloc_t *allocator);
+
 #endif
@@ -106,7 +106,11 @@ static apr_status_t handle_response(serf_request_t *request,
         apr_pool_destroy(ctx->pool);
         serf_bucket_destroy(conn->ssltunnel_ostream);
         serf_bucket_destroy(conn->stream);
-        conn->stream = NULL;
+
+        /* The handshake was sent along, continue with the application's
+           stream, or else have it created. */
+        conn->stream = conn->tunneled_stream;
+        conn->tunneled_stream = NULL;
         ctx = NULL;
 
         serf__log(LOGLVL_INFO, LOGCOMP_CONN, __FILE__, conn->config,
@@ -145,6 +149,7 @@ static apr_status_t setup_request(serf_request_t *request,
                                   apr_pool_t *pool)
 {
     req_ctx_t *ctx = setup_baton;
+    serf_connection_t *conn = request->conn;
     serf_bucket_t *hdrs_bkt;
 
     *req_bkt = serf_bucket_request_create("CONNECT", ctx->uri, NULL,
@@ -154,13 +159,35 @@ static apr_status_t setup_request(serf_request_t *request,
     serf_bucket_headers_setn(hdrs_bkt, "Host", ctx->uri);
 
     /* If proxy authn is required, then set it up.  */
-    if (request->conn->ctx->proxy_authn_info.scheme)
-        request->conn->ctx->proxy_authn_info.scheme->setup_request_func(
+    if (conn->ctx->proxy_authn_info.scheme)
+        conn->ctx->proxy_authn_info.scheme->setup_request_func(
                                                        PROXY, 0,
-                                                       request->conn, request,
+                                                       conn, request,
                                                        "CONNECT", ctx->uri,
                                                        hdrs_bkt);
 
+    /* Send the start of the TLS handshake along, so that the server can
+       answer it as soon as the tunnel is up. The application's streams are
+       set up here, so this happens once per connection. */
+    if (conn->ctx->proxy_tunnel_pipelining && !conn->ostream_head
+        && conn->framing_type != SERF_CONNECTION_FRAMING_TYPE_HTTP2) {
+        serf_bucket_t *handshake;
+        serf_bucket_t *agg;
+        apr_status_t status;
+
+        status = serf__conn_start_tunneled_handshake(conn, &handshake);
+        if (status)
+            return status;
+
+        agg = serf_bucket_aggregate_create(serf_request_get_alloc(request));
+        serf_bucket_aggregate_append(agg, *req_bkt);
+        serf_bucket_aggregate_append(agg, handshake);
+        *req_bkt = agg;
+
+        serf__log(LOGLVL_DEBUG, LOGCOMP_CONN, __FILE__, conn->config,
+                  "sending tls handshake with the CONNECT request.\n");
+    }
+
     *acceptor = accept_response;
     *acceptor_baton = ctx;
     *handler = handle_response;
@@ -134,15 +134,23 @@ static apr_status_t runServerLoop(MockHTTP *mh, loopRequestState_t *reqState)
 
     *reqState = NoReqsReceived;
     do {
+        bool ran = NO;
+
         if (mh->proxyCtx && mh->proxyCtx->threading != mhThreadSeparate) {
             status = _mhRunServerLoop(mh->proxyCtx);
             *reqState = mh->proxyCtx->reqState;
+            ran = YES;
         }
         /* TODO: status? */
         if (mh->servCtx && mh->servCtx->threading != mhThreadSeparate) {
             status = _mhRunServerLoop(mh->servCtx);
             *reqState |= mh->servCtx->reqState;
+            ran = YES;
         }
+
+        /* All servers run in their own threads, nothing to do here. */
+        if (!ran)
+            status = APR_TIMEUP;
     } while (status == APR_SUCCESS);
 
     return status;
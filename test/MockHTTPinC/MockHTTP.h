@@ -46,6 +46,7 @@ typedef enum mhServerType_t {
     mhHTTPSv1Proxy,     /* Sets up SSL tunnel on CONNECT request. */
     mhHTTPSv11Proxy,    /* Sets up SSL tunnel on CONNECT request. */
     mhOCSPResponder,
+    mhThroughputServer, /* Canned responses, see SetupThroughputServer */
 } mhServerType_t;
 
 typedef enum mhAction_t {
@@ -178,6 +179,42 @@ typedef struct mhResponseBldr_t mhResponseBldr_t;
                 mhConfigServer(__servctx, __VA_ARGS__, NULL);\
                 mhStartServer(__servctx);
 
+/* Setup a server for load tests, which answers every request with the same
+   canned response, with no request matching. It runs in its own worker
+   threads, so neither mhRunServerLoop() nor Given/Expect apply to it.
+   Request bodies must have a Content-Length.
+
+   e.g. SetupThroughputServer(WithPort(30080), WithWorkerThreads(4),
+                              WithResponseBodySize(1024 * 1024),
+                              WithChunkedResponses(8192)) */
+#define   SetupThroughputServer(...)\
+                __servctx = mhNewThroughputServer(__mh);\
+                mhConfigServer(__servctx, __VA_ARGS__, NULL);\
+                mhStartServer(__servctx);
+
+/**
+ * Throughput server configuration options. WithMaxKeepAliveRequests applies
+ * too.
+ */
+/* The number of threads accepting and serving connections. Default: 1 */
+#define     WithWorkerThreads(n)\
+                mhSetServerWorkerThreads(__servctx, (n))
+/* The size of the (decoded) canned response body. Default: 0 */
+#define     WithResponseBodySize(size)\
+                mhSetServerResponseBodySize(__servctx, (size))
+/* Send the body in chunks of SIZE bytes instead of with a Content-Length. */
+#define     WithChunkedResponses(size)\
+                mhSetServerChunkedResponses(__servctx, (size))
+/* Send the body gzip compressed, with Content-Encoding: gzip. */
+#define     WithGzipResponses\
+                mhSetServerGzipResponses(__servctx)
+/* Wait MSEC milliseconds after a request arrived before responding. */
+#define     WithResponseLatency(msec)\
+                mhSetServerResponseLatency(__servctx, (msec))
+/* Send at most BYTES_PER_SEC bytes per second on each connection. */
+#define     WithBandwidth(bytes_per_sec)\
+                mhSetServerBandwidth(__servctx, (bytes_per_sec))
+
 #define   ConfigServerWithID(serverID, ...)\
                 __servctx = mhFindServerByID(__mh, serverID);\
                 mhConfigServer(__servctx, __VA_ARGS__, NULL);
@@ -596,6 +633,7 @@ unsigned int mhServerByIDPortNr(const MockHTTP *mh, const char *serverID);
 mhServCtx_t *mhNewServer(MockHTTP *mh);
 mhServCtx_t *mhNewProxy(MockHTTP *mh);
 mhServCtx_t *mhNewOCSPResponder(MockHTTP *mh);
+mhServCtx_t *mhNewThroughputServer(MockHTTP *mh);
 mhServCtx_t *mhFindServerByID(const MockHTTP *mh, const char *serverID);
 void mhConfigServer(mhServCtx_t *ctx, ...);
 void mhStartServer(mhServCtx_t *ctx);
@@ -620,6 +658,17 @@ mhServerSetupBldr_t *mhSetServerRequestClientCert(mhServCtx_t *ctx,
 mhServerSetupBldr_t *mhSetServerEnableOCSP(mhServCtx_t *ctx);
 
 mhServerSetupBldr_t *mhAddSSLProtocol(mhServCtx_t *ctx, mhSSLProtocol_t proto);
+mhServerSetupBldr_t *mhSetServerWorkerThreads(mhServCtx_t *ctx,
+                                              unsigned int nthreads);
+mhServerSetupBldr_t *mhSetServerResponseBodySize(mhServCtx_t *ctx,
+                                                 unsigned int size);
+mhServerSetupBldr_t *mhSetServerChunkedResponses(mhServCtx_t *ctx,
+                                                 unsigned int chunkSize);
+mhServerSetupBldr_t *mhSetServerGzipResponses(mhServCtx_t *ctx);
+mhServerSetupBldr_t *mhSetServerResponseLatency(mhServCtx_t *ctx,
+                                                unsigned int msec);
+mhServerSetupBldr_t *mhSetServerBandwidth(mhServCtx_t *ctx,
+                                          unsigned int bytesPerSec);
 
 /* Define request stubs */
 mhRequestMatcher_t *mhGivenRequest(MockHTTP *mh, ...);
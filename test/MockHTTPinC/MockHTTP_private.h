@@ -129,6 +129,15 @@ struct mhServCtx_t {
     apr_array_header_t *connMatchers;   /* array of mhConnMatcherBldr_t *'s */
     apr_array_header_t *reqMatchers;    /* array of ReqMatcherRespPair_t *'s */
     apr_array_header_t *incompleteReqMatchers;       /*       .... same type */
+
+    /* Throughput server specific */
+    unsigned int nthreads;
+    apr_size_t bodySize;
+    apr_size_t chunkSize;       /* 0 = use Content-Length */
+    bool gzip;
+    apr_interval_time_t latency;
+    apr_size_t bandwidth;       /* bytes/sec per connection, 0 = no limit */
+    struct _mhThroughput_t *throughput;  /* state while running */
 };
     
 
@@ -319,6 +328,10 @@ void _mhErrorUnexpectedBuilder(const MockHTTP *mh, void *actual,
 /* Test servers */
 apr_status_t _mhRunServerLoop(mhServCtx_t *ctx);
 
+/* Throughput server, the listening socket of CTX is already set up. */
+apr_status_t _mhStartThroughputServer(mhServCtx_t *ctx);
+void _mhStopThroughputServer(mhServCtx_t *ctx);
+
 void _mhLog(int verbose_flag, apr_socket_t *skt, const char *fmt, ...);
 
 #ifdef __cplusplus
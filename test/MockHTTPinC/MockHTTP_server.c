@@ -1646,6 +1646,20 @@ mhServCtx_t *mhNewOCSPResponder(MockHTTP *mh)
     return mh->ocspRespCtx;
 }
 
+/**
+ * Creates a new throughput server on localhost and on the default server
+ * port. It replaces the regular server.
+ */
+mhServCtx_t *mhNewThroughputServer(MockHTTP *mh)
+{
+    mh->servCtx = initServCtx(mh, "localhost", DefaultSrvPort);
+    mh->servCtx->type = mhThroughputServer;
+    /* Keep mhRunServerLoop() away from it. */
+    mh->servCtx->threading = mhThreadSeparate;
+    mh->servCtx->nthreads = 1;
+    return mh->servCtx;
+}
+
 /**
  * Returns the server context associated with id SERVERID.
  */
@@ -1710,7 +1724,12 @@ void mhStartServer(mhServCtx_t *ctx)
     mhError_t err = MOCKHTTP_NO_ERROR;
     apr_status_t status;
 
-    if (ctx->threading == mhThreadSeparate) {
+    if (ctx->type == mhThroughputServer) {
+        /* Setup a non-blocking TCP server, served by the worker threads */
+        status = setupTCPServer(ctx);
+        if (!status)
+            status = _mhStartThroughputServer(ctx);
+    } else if (ctx->threading == mhThreadSeparate) {
 #if APR_HAS_THREADS
         /* Setup a non-blocking TCP server */
         status = setupTCPServer(ctx);
@@ -1737,6 +1756,11 @@ void mhStartServer(mhServCtx_t *ctx)
 void mhStopServer(mhServCtx_t *ctx)
 {
     apr_status_t status;
+
+    if (ctx->type == mhThroughputServer) {
+        _mhStopThroughputServer(ctx);
+        return;
+    }
 #ifdef APR_HAS_THREADS
     if (ctx->threading == mhThreadSeparate && ctx->threadid) {
         ctx->cancelThread = YES;
@@ -1914,6 +1938,127 @@ mhSetServerThreading(mhServCtx_t *ctx, mhThreading_t threading)
     return ssb;
 }
 
+/**
+ * Builder callbacks for the throughput server options.
+ */
+static bool
+set_server_worker_threads(const mhServerSetupBldr_t *ssb, mhServCtx_t *ctx)
+{
+    ctx->nthreads = ssb->ibaton ? ssb->ibaton : 1;
+    return YES;
+}
+
+static bool
+set_server_body_size(const mhServerSetupBldr_t *ssb, mhServCtx_t *ctx)
+{
+    ctx->bodySize = ssb->ibaton;
+    return YES;
+}
+
+static bool
+set_server_chunked(const mhServerSetupBldr_t *ssb, mhServCtx_t *ctx)
+{
+    ctx->chunkSize = ssb->ibaton;
+    return YES;
+}
+
+static bool
+set_server_gzip(const mhServerSetupBldr_t *ssb, mhServCtx_t *ctx)
+{
+    ctx->gzip = YES;
+    return YES;
+}
+
+static bool
+set_server_latency(const mhServerSetupBldr_t *ssb, mhServCtx_t *ctx)
+{
+    ctx->latency = apr_time_from_msec(ssb->ibaton);
+    return YES;
+}
+
+static bool
+set_server_bandwidth(const mhServerSetupBldr_t *ssb, mhServCtx_t *ctx)
+{
+    ctx->bandwidth = ssb->ibaton;
+    return YES;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, sets the number of worker
+ * threads of a throughput server.
+ */
+mhServerSetupBldr_t *
+mhSetServerWorkerThreads(mhServCtx_t *ctx, unsigned int nthreads)
+{
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(ctx->pool);
+    ssb->ibaton = nthreads;
+    ssb->serversetup = set_server_worker_threads;
+    return ssb;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, sets the size of the canned
+ * response body of a throughput server.
+ */
+mhServerSetupBldr_t *
+mhSetServerResponseBodySize(mhServCtx_t *ctx, unsigned int size)
+{
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(ctx->pool);
+    ssb->ibaton = size;
+    ssb->serversetup = set_server_body_size;
+    return ssb;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, makes a throughput server
+ * send its responses in chunks of CHUNKSIZE bytes.
+ */
+mhServerSetupBldr_t *
+mhSetServerChunkedResponses(mhServCtx_t *ctx, unsigned int chunkSize)
+{
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(ctx->pool);
+    ssb->ibaton = chunkSize;
+    ssb->serversetup = set_server_chunked;
+    return ssb;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, makes a throughput server
+ * gzip its response body.
+ */
+mhServerSetupBldr_t *mhSetServerGzipResponses(mhServCtx_t *ctx)
+{
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(ctx->pool);
+    ssb->serversetup = set_server_gzip;
+    return ssb;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, sets the delay before a
+ * throughput server responds to a request.
+ */
+mhServerSetupBldr_t *
+mhSetServerResponseLatency(mhServCtx_t *ctx, unsigned int msec)
+{
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(ctx->pool);
+    ssb->ibaton = msec;
+    ssb->serversetup = set_server_latency;
+    return ssb;
+}
+
+/**
+ * Create a builder of type mhServerSetupBldr_t, limits the bandwidth per
+ * connection of a throughput server.
+ */
+mhServerSetupBldr_t *
+mhSetServerBandwidth(mhServCtx_t *ctx, unsigned int bytesPerSec)
+{
+    mhServerSetupBldr_t *ssb = createServerSetupBldr(ctx->pool);
+    ssb->ibaton = bytesPerSec;
+    ssb->serversetup = set_server_bandwidth;
+    return ssb;
+}
+
 /**
  * Builder callback, sets the prefix for certificate paths on server CTX.
  */
@@ -0,0 +1,618 @@
+/* Copyright 2026 Lieven Govaerts
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The throughput server answers every request with the same canned response,
+   so it can keep up with a client that is being load tested. It doesn't
+   match requests and doesn't store them, use the regular server for that.
+
+   Each worker thread has its own pool, own allocator and own pollset. The
+   workers share the non-blocking listening socket: when a connection comes
+   in one of them wins the accept, the others see EAGAIN. */
+#define APR_WANT_MEMFUNC
+#include <apr_want.h>
+#include <apr_strings.h>
+#include <apr_lib.h>
+#include <apr_atomic.h>
+#include <apr_allocator.h>
+
+#include <zlib.h>
+
+#include "MockHTTP_private.h"
+
+#define TP_BUFSIZE 8192      /* Max. size of the headers of a request */
+#define TP_MAX_PIPELINED 64  /* Max. nr of requests waiting for a response */
+#define TP_MAX_CONNS 1024    /* Max. nr of connections per worker */
+#define TP_IDLE_TIMEOUT apr_time_from_msec(100)
+
+typedef struct _mhThroughput_t {
+    mhServCtx_t *ctx;
+
+    /* The canned responses, with and without Connection: close */
+    char *resp;
+    apr_size_t respLen;
+    char *closeResp;
+    apr_size_t closeRespLen;
+
+    apr_thread_t **threads;
+    volatile apr_uint32_t received;
+    volatile apr_uint32_t served;
+} _mhThroughput_t;
+
+typedef struct tpConn_t {
+    apr_pool_t *pool;
+    apr_socket_t *skt;
+    apr_int16_t reqevents;
+
+    char buf[TP_BUFSIZE];
+    apr_size_t buflen;
+    apr_size_t skip;           /* Request body bytes still to be discarded */
+    unsigned int reqs;
+    bool noMoreReqs;           /* Close after the last pending response */
+    bool peerClosed;
+
+    /* Ring of pending responses: when each is due and if it's the last */
+    apr_time_t due[TP_MAX_PIPELINED];
+    bool last[TP_MAX_PIPELINED];
+    unsigned int head, count;
+
+    /* Response being written */
+    const char *out;
+    apr_size_t outLen;
+    bool closeAfter;
+
+    /* Bandwidth limit */
+    apr_size_t credit;
+    apr_time_t refilled;
+
+    struct tpConn_t *next;
+} tpConn_t;
+
+typedef struct tpWorker_t {
+    _mhThroughput_t *tp;
+    apr_pool_t *pool;
+    apr_pollset_t *pollset;
+    tpConn_t *conns;
+    unsigned int nconns;
+} tpWorker_t;
+
+/**
+ * Compresses LEN bytes of DATA in gzip format, allocated in POOL.
+ */
+static apr_status_t gzipBody(char **out, apr_size_t *outLen,
+                             const char *data, apr_size_t len,
+                             apr_pool_t *pool)
+{
+    z_stream zs;
+    int zerr;
+
+    memset(&zs, 0, sizeof(zs));
+    /* windowBits 15 + 16 makes zlib write a gzip header and trailer */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return APR_EGENERAL;
+
+    *outLen = deflateBound(&zs, (uLong)len) + 32;
+    *out = apr_palloc(pool, *outLen);
+
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)len;
+    zs.next_out = (Bytef *)*out;
+    zs.avail_out = (uInt)*outLen;
+    zerr = deflate(&zs, Z_FINISH);
+    *outLen = zs.total_out;
+    deflateEnd(&zs);
+
+    return zerr == Z_STREAM_END ? APR_SUCCESS : APR_EGENERAL;
+}
+
+/**
+ * Builds a complete response from the status line and headers in HDRS and
+ * BODY, chunked in pieces of CHUNKSIZE bytes if that's not 0.
+ */
+static char *buildResponse(apr_size_t *respLen, const char *hdrs,
+                           const char *body, apr_size_t bodyLen,
+                           apr_size_t chunkSize, apr_pool_t *pool)
+{
+    apr_size_t hdrsLen = strlen(hdrs);
+    apr_size_t nchunks = chunkSize ? bodyLen / chunkSize + 1 : 0;
+    char *resp, *ptr;
+
+    /* A chunk header is at most 16 hex digits + CRLF, plus CRLF after the
+       chunk data. */
+    resp = apr_palloc(pool, hdrsLen + bodyLen + nchunks * 20 + 8);
+    memcpy(resp, hdrs, hdrsLen);
+    ptr = resp + hdrsLen;
+
+    if (chunkSize) {
+        apr_size_t offset = 0;
+
+        while (offset < bodyLen) {
+            apr_size_t len = bodyLen - offset;
+
+            if (len > chunkSize)
+                len = chunkSize;
+            ptr += apr_snprintf(ptr, 20, "%" APR_UINT64_T_HEX_FMT "\r\n",
+                                (apr_uint64_t)len);
+            memcpy(ptr, body + offset, len);
+            ptr += len;
+            *ptr++ = '\r'; *ptr++ = '\n';
+            offset += len;
+        }
+        memcpy(ptr, "0\r\n\r\n", 5);
+        ptr += 5;
+    } else {
+        memcpy(ptr, body, bodyLen);
+        ptr += bodyLen;
+    }
+
+    *respLen = ptr - resp;
+    return resp;
+}
+
+/**
+ * Creates the canned responses of throughput server TP.
+ */
+static apr_status_t setupResponses(_mhThroughput_t *tp)
+{
+    mhServCtx_t *ctx = tp->ctx;
+    apr_pool_t *pool = ctx->pool;
+    char *body;
+    const char *hdrs;
+    apr_size_t bodyLen = ctx->bodySize;
+    apr_size_t i;
+
+    /* Some text that is somewhat compressible */
+    body = apr_palloc(pool, bodyLen + 1);
+    for (i = 0; i < bodyLen; i++)
+        body[i] = (i % 64 == 63) ? '\n' : 'a' + (char)((i / 64 + i) % 26);
+
+    if (ctx->gzip) {
+        apr_status_t status = gzipBody(&body, &bodyLen, body, bodyLen, pool);
+        if (status)
+            return status;
+    }
+
+    hdrs = apr_pstrcat(pool, "HTTP/1.1 200 OK\r\n",
+                       "Server: MockHTTP throughput server\r\n",
+                       ctx->gzip ? "Content-Encoding: gzip\r\n" : "",
+                       ctx->chunkSize ?
+                           "Transfer-Encoding: chunked\r\n" :
+                           apr_psprintf(pool,
+                                        "Content-Length: %" APR_SIZE_T_FMT
+                                        "\r\n", bodyLen),
+                       NULL);
+
+    tp->resp = buildResponse(&tp->respLen,
+                             apr_pstrcat(pool, hdrs, "\r\n", NULL),
+                             body, bodyLen, ctx->chunkSize, pool);
+    tp->closeResp = buildResponse(&tp->closeRespLen,
+                                  apr_pstrcat(pool, hdrs,
+                                              "Connection: close\r\n\r\n",
+                                              NULL),
+                                  body, bodyLen, ctx->chunkSize, pool);
+    return APR_SUCCESS;
+}
+
+/**
+ * Finds header NAME in the LEN bytes of HDRS, case-insensitive. Returns the
+ * value or NULL, *VLEN is set to the length of the value.
+ */
+static const char *findHeader(const char *hdrs, apr_size_t len,
+                              const char *name, apr_size_t *vlen)
+{
+    apr_size_t nlen = strlen(name);
+    const char *end = hdrs + len;
+    const char *line = hdrs;
+
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        apr_size_t i;
+
+        if (!eol)
+            eol = end;
+        for (i = 0; i < nlen && line + i < eol; i++) {
+            if (apr_tolower(line[i]) != apr_tolower(name[i]))
+                break;
+        }
+        if (i == nlen && line + nlen < eol && line[nlen] == ':') {
+            const char *val = line + nlen + 1;
+
+            while (val < eol && (*val == ' ' || *val == '\t'))
+                val++;
+            *vlen = eol - val;
+            if (*vlen && val[*vlen - 1] == '\r')
+                (*vlen)--;
+            return val;
+        }
+        line = eol + 1;
+    }
+
+    return NULL;
+}
+
+static bool valueIs(const char *val, apr_size_t vlen, const char *expected)
+{
+    apr_size_t i;
+
+    if (!val || vlen != strlen(expected))
+        return NO;
+    for (i = 0; i < vlen; i++)
+        if (apr_tolower(val[i]) != expected[i])
+            return NO;
+    return YES;
+}
+
+static void setEvents(tpWorker_t *w, tpConn_t *conn, apr_int16_t reqevents)
+{
+    apr_pollfd_t pfd = { 0 };
+
+    if (conn->reqevents == reqevents)
+        return;
+
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s = conn->skt;
+    pfd.client_data = conn;
+    if (conn->reqevents) {
+        pfd.reqevents = conn->reqevents;
+        apr_pollset_remove(w->pollset, &pfd);
+    }
+    conn->reqevents = reqevents;
+    if (reqevents) {
+        pfd.reqevents = reqevents;
+        apr_pollset_add(w->pollset, &pfd);
+    }
+}
+
+/**
+ * Finds all complete requests in the buffer of CONN and queues a response
+ * for each of them.
+ */
+static void parseRequests(tpWorker_t *w, tpConn_t *conn, apr_time_t now)
+{
+    mhServCtx_t *ctx = w->tp->ctx;
+    apr_size_t offset = 0;
+
+    while (!conn->noMoreReqs && conn->count < TP_MAX_PIPELINED) {
+        const char *start = conn->buf + offset;
+        apr_size_t avail = conn->buflen - offset;
+        const char *val, *eoh = NULL;
+        apr_size_t vlen, hdrsLen, i;
+        bool lastReq;
+
+        if (conn->skip) {
+            apr_size_t len = conn->skip < avail ? conn->skip : avail;
+            conn->skip -= len;
+            offset += len;
+            if (conn->skip)
+                break;
+            continue;
+        }
+
+        for (i = 3; i < avail; i++) {
+            if (start[i] == '\n' && start[i-1] == '\r' &&
+                start[i-2] == '\n' && start[i-3] == '\r') {
+                eoh = start + i + 1;
+                break;
+            }
+        }
+        if (!eoh)
+            break;
+        hdrsLen = eoh - start;
+
+        conn->reqs++;
+        apr_atomic_inc32(&w->tp->received);
+
+        val = findHeader(start, hdrsLen, "Connection", &vlen);
+        lastReq = valueIs(val, vlen, "close");
+        /* The request line ends in HTTP/1.0 */
+        val = memchr(start, '\r', hdrsLen);
+        if (val && val - start >= 8 && memcmp(val - 8, "HTTP/1.0", 8) == 0)
+            lastReq = YES;
+        if (ctx->maxRequests && conn->reqs >= ctx->maxRequests)
+            lastReq = YES;
+
+        val = findHeader(start, hdrsLen, "Content-Length", &vlen);
+        if (val)
+            conn->skip = (apr_size_t)apr_atoi64(apr_pstrmemdup(conn->pool,
+                                                               val, vlen));
+        /* We don't parse chunked request bodies, stop after this one. */
+        val = findHeader(start, hdrsLen, "Transfer-Encoding", &vlen);
+        if (val)
+            lastReq = YES;
+
+        i = (conn->head + conn->count) % TP_MAX_PIPELINED;
+        conn->due[i] = now + ctx->latency;
+        conn->last[i] = lastReq;
+        conn->count++;
+        conn->noMoreReqs = lastReq;
+        offset += hdrsLen;
+    }
+
+    if (conn->noMoreReqs)
+        conn->buflen = 0;
+    else if (offset) {
+        memmove(conn->buf, conn->buf + offset, conn->buflen - offset);
+        conn->buflen -= offset;
+    } else if (conn->buflen == TP_BUFSIZE) {
+        /* Headers too large, give up on this client */
+        conn->noMoreReqs = YES;
+        conn->peerClosed = YES;
+    }
+}
+
+/**
+ * Reads what's available on the socket of CONN.
+ */
+static void readConn(tpWorker_t *w, tpConn_t *conn, apr_time_t now)
+{
+    while (!conn->noMoreReqs && conn->buflen < TP_BUFSIZE) {
+        apr_size_t len = TP_BUFSIZE - conn->buflen;
+        apr_status_t status;
+
+        status = apr_socket_recv(conn->skt, conn->buf + conn->buflen, &len);
+        conn->buflen += len;
+        if (len)
+            parseRequests(w, conn, now);
+        if (APR_STATUS_IS_EAGAIN(status))
+            break;
+        if (status) {
+            conn->peerClosed = YES;
+            break;
+        }
+        if (conn->count == TP_MAX_PIPELINED)
+            break;
+    }
+}
+
+/**
+ * Writes pending responses of CONN, as far as the latency and bandwidth
+ * settings allow. Returns the time of the next write attempt, or 0.
+ */
+static apr_time_t writeConn(tpWorker_t *w, tpConn_t *conn, apr_time_t now,
+                            bool *blocked)
+{
+    mhServCtx_t *ctx = w->tp->ctx;
+
+    *blocked = NO;
+    while (1) {
+        apr_size_t len;
+        apr_status_t status;
+
+        if (!conn->out) {
+            if (!conn->count)
+                return 0;
+            if (conn->due[conn->head] > now)
+                return conn->due[conn->head];
+
+            conn->closeAfter = conn->last[conn->head];
+            conn->out = conn->closeAfter ? w->tp->closeResp : w->tp->resp;
+            conn->outLen = conn->closeAfter ? w->tp->closeRespLen
+                                            : w->tp->respLen;
+            conn->head = (conn->head + 1) % TP_MAX_PIPELINED;
+            conn->count--;
+        }
+
+        len = conn->outLen;
+        if (ctx->bandwidth) {
+            /* Refill the bucket, allow bursts of 1/10th of a second. */
+            apr_size_t max = ctx->bandwidth / 10 + 1;
+            apr_uint64_t add = (apr_uint64_t)(now - conn->refilled)
+                                   * ctx->bandwidth / APR_USEC_PER_SEC;
+            if (add) {
+                conn->credit = (add + conn->credit > max) ? max
+                                 : conn->credit + (apr_size_t)add;
+                conn->refilled = now;
+            }
+            if (!conn->credit)
+                return now + APR_USEC_PER_SEC / ctx->bandwidth + 1;
+            if (len > conn->credit)
+                len = conn->credit;
+        }
+
+        status = apr_socket_send(conn->skt, conn->out, &len);
+        conn->out += len;
+        conn->outLen -= len;
+        if (ctx->bandwidth)
+            conn->credit -= len;
+
+        if (APR_STATUS_IS_EAGAIN(status)) {
+            *blocked = YES;
+            return 0;
+        }
+        if (status) {
+            conn->peerClosed = YES;
+            conn->count = 0;
+            conn->out = NULL;
+            return 0;
+        }
+        if (!conn->outLen) {
+            conn->out = NULL;
+            apr_atomic_inc32(&w->tp->served);
+            if (conn->closeAfter) {
+                conn->peerClosed = YES;
+                conn->count = 0;
+                return 0;
+            }
+        }
+    }
+}
+
+static void acceptConns(tpWorker_t *w, apr_time_t now)
+{
+    while (w->nconns < TP_MAX_CONNS) {
+        apr_pool_t *pool;
+        apr_socket_t *cskt;
+        tpConn_t *conn;
+
+        apr_pool_create(&pool, w->pool);
+        if (apr_socket_accept(&cskt, w->tp->ctx->skt, pool) != APR_SUCCESS) {
+            apr_pool_destroy(pool);
+            return;
+        }
+        apr_socket_opt_set(cskt, APR_SO_NONBLOCK, 1);
+        apr_socket_timeout_set(cskt, 0);
+        apr_socket_opt_set(cskt, APR_TCP_NODELAY, 1);
+
+        conn = apr_pcalloc(pool, sizeof(*conn));
+        conn->pool = pool;
+        conn->skt = cskt;
+        conn->refilled = now;
+        conn->next = w->conns;
+        w->conns = conn;
+        w->nconns++;
+
+        setEvents(w, conn, APR_POLLIN | APR_POLLHUP | APR_POLLERR);
+    }
+}
+
+static void * APR_THREAD_FUNC tpWorkerThread(apr_thread_t *tid, void *baton)
+{
+    _mhThroughput_t *tp = baton;
+    mhServCtx_t *ctx = tp->ctx;
+    apr_allocator_t *allocator;
+    apr_pollfd_t pfd = { 0 };
+    tpWorker_t w;
+
+    memset(&w, 0, sizeof(w));
+    w.tp = tp;
+
+    /* Own allocator, so the workers don't fight over the allocator mutex */
+    if (apr_allocator_create(&allocator))
+        return NULL;
+    apr_pool_create_ex(&w.pool, NULL, NULL, allocator);
+    apr_allocator_owner_set(allocator, w.pool);
+
+#ifdef BROKEN_WSAPOLL
+    apr_pollset_create_ex(&w.pollset, TP_MAX_CONNS + 1, w.pool, 0,
+                          APR_POLLSET_SELECT);
+#else
+    apr_pollset_create(&w.pollset, TP_MAX_CONNS + 1, w.pool, 0);
+#endif
+
+    pfd.desc_type = APR_POLL_SOCKET;
+    pfd.desc.s = ctx->skt;
+    pfd.reqevents = APR_POLLIN;
+    pfd.client_data = NULL;
+    apr_pollset_add(w.pollset, &pfd);
+
+    while (!ctx->cancelThread) {
+        const apr_pollfd_t *desc;
+        apr_int32_t num;
+        apr_time_t now, next = 0;
+        apr_interval_time_t timeout = TP_IDLE_TIMEOUT;
+        tpConn_t **pconn;
+
+        now = apr_time_now();
+        for (pconn = &w.conns; *pconn; ) {
+            tpConn_t *conn = *pconn;
+            bool blocked;
+            apr_time_t when = writeConn(&w, conn, now, &blocked);
+
+            if (when && (!next || when < next))
+                next = when;
+
+            if (conn->peerClosed && !conn->out && !conn->count) {
+                setEvents(&w, conn, 0);
+                apr_socket_close(conn->skt);
+                *pconn = conn->next;
+                w.nconns--;
+                apr_pool_destroy(conn->pool);
+                continue;
+            }
+
+            /* Only wait for POLLOUT when the socket buffer is full */
+            setEvents(&w, conn,
+                      (conn->peerClosed || conn->noMoreReqs
+                           ? 0 : APR_POLLIN | APR_POLLHUP | APR_POLLERR)
+                      | (blocked ? APR_POLLOUT : 0));
+            pconn = &conn->next;
+        }
+        if (next)
+            timeout = next > now ? next - now : 0;
+        if (timeout > TP_IDLE_TIMEOUT)
+            timeout = TP_IDLE_TIMEOUT;
+
+        if (apr_pollset_poll(w.pollset, timeout, &num, &desc) != APR_SUCCESS)
+            continue;
+
+        now = apr_time_now();
+        while (num--) {
+            tpConn_t *conn = desc->client_data;
+
+            if (!conn)
+                acceptConns(&w, now);
+            else if (desc->rtnevents & (APR_POLLIN | APR_POLLHUP |
+                                        APR_POLLERR))
+                readConn(&w, conn, now);
+            desc++;
+        }
+    }
+
+    apr_pool_destroy(w.pool);
+    return NULL;
+}
+
+/**
+ * Starts the worker threads of throughput server CTX.
+ */
+apr_status_t _mhStartThroughputServer(mhServCtx_t *ctx)
+{
+#if APR_HAS_THREADS
+    _mhThroughput_t *tp;
+    apr_status_t status;
+    unsigned int i;
+
+    tp = apr_pcalloc(ctx->pool, sizeof(*tp));
+    tp->ctx = ctx;
+    STATUSERR(setupResponses(tp));
+
+    ctx->cancelThread = NO;
+    tp->threads = apr_pcalloc(ctx->pool, ctx->nthreads * sizeof(apr_thread_t*));
+    ctx->throughput = tp;
+    for (i = 0; i < ctx->nthreads; i++) {
+        STATUSERR(apr_thread_create(&tp->threads[i], NULL, tpWorkerThread,
+                                    tp, ctx->pool));
+    }
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
+/**
+ * Stops the worker threads of throughput server CTX and adds their numbers
+ * to the statistics of the MockHTTP instance.
+ */
+void _mhStopThroughputServer(mhServCtx_t *ctx)
+{
+#if APR_HAS_THREADS
+    _mhThroughput_t *tp = ctx->throughput;
+    apr_status_t status;
+    unsigned int i;
+
+    if (!tp)
+        return;
+
+    ctx->cancelThread = YES;
+    for (i = 0; i < ctx->nthreads; i++) {
+        if (tp->threads[i])
+            apr_thread_join(&status, tp->threads[i]);
+    }
+
+    ctx->mh->verifyStats->requestsReceived += apr_atomic_read32(&tp->received);
+    ctx->mh->verifyStats->requestsResponded += apr_atomic_read32(&tp->served);
+    ctx->throughput = NULL;
+#endif
+}
@@ -0,0 +1,864 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Benchmarks for the buckets and for a client talking to a serf server
+   over loopback. Each benchmark prints one line of JSON on stdout, so
+   the results of two serf versions can be compared by a script. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_uri.h>
+#include <apr_strings.h>
+#include <apr_getopt.h>
+#include <apr_time.h>
+#include <apr_env.h>
+
+#include <openssl/ssl.h>
+
+#include "serf.h"
+
+#define BENCH_PORT 30090
+#define BENCH_DATA_SIZE (64 * 1024)
+
+/* The clock is read once per batch of operations. */
+#define BATCH_SIZE 16
+
+typedef struct bench_baton_t {
+    serf_bucket_alloc_t *alloc;
+    char *lines;            /* BENCH_DATA_SIZE bytes of 80 char lines */
+    char *chunked;          /* LINES in chunked encoding */
+    apr_size_t chunked_len;
+    char *gzipped;          /* LINES compressed with gzip */
+    apr_size_t gzipped_len;
+
+    /* A TLS connection over memory, between serf's buckets and a plain
+       OpenSSL server. */
+    serf_bucket_t *ssl_in;      /* what the server sent, to decrypt */
+    serf_bucket_t *ssl_out;     /* what is to be encrypted */
+    serf_bucket_t *decrypt;
+    serf_bucket_t *encrypt;
+    SSL *server;
+    char *records;              /* the records of one write of the server */
+    apr_size_t records_size;
+} bench_baton_t;
+
+/* Runs the benchmarked operation once. Returns the number of bytes it
+   processed, or 0 if that doesn't mean anything for this benchmark. */
+typedef apr_size_t (*bench_func_t)(bench_baton_t *bb);
+
+static void print_version(void)
+{
+    int major, minor, patch;
+
+    serf_lib_version(&major, &minor, &patch);
+    printf("\"serf_version\":\"%d.%d.%d\"", major, minor, patch);
+}
+
+static void fail(const char *what, apr_status_t status)
+{
+    char buf[256];
+
+    fprintf(stderr, "%s: %s (%d)\n", what,
+            serf_error_string(status) ? serf_error_string(status)
+                                      : apr_strerror(status, buf, sizeof(buf)),
+            status);
+    exit(1);
+}
+
+/* Reads BKT until EOF and destroys it. Returns the number of bytes read. */
+static apr_size_t drain(serf_bucket_t *bkt)
+{
+    apr_size_t total = 0;
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            fail(bkt->type->name, status);
+        total += len;
+    } while (!APR_STATUS_IS_EOF(status));
+
+    serf_bucket_destroy(bkt);
+
+    return total;
+}
+
+/* Appends and reads 64 buckets of 1KB, the way a request with a body made
+   of many pieces is written to the socket. */
+static apr_size_t bench_aggregate(bench_baton_t *bb)
+{
+    serf_bucket_t *agg = serf_bucket_aggregate_create(bb->alloc);
+    struct iovec vecs[16];
+    apr_size_t total = 0;
+    apr_status_t status;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        serf_bucket_t *bkt;
+
+        bkt = serf_bucket_simple_create(bb->lines + i * 1024, 1024, NULL,
+                                        NULL, bb->alloc);
+        serf_bucket_aggregate_append(agg, bkt);
+    }
+
+    do {
+        int vecs_used;
+
+        status = serf_bucket_read_iovec(agg, SERF_READ_ALL_AVAIL, 16, vecs,
+                                        &vecs_used);
+        if (SERF_BUCKET_READ_ERROR(status))
+            fail("aggregate", status);
+        for (i = 0; i < vecs_used; i++)
+            total += vecs[i].iov_len;
+    } while (!APR_STATUS_IS_EOF(status));
+
+    serf_bucket_destroy(agg);
+
+    return total;
+}
+
+static const char *const header_names[] = {
+    "Host", "User-Agent", "Accept", "Accept-Encoding", "Connection",
+    "Content-Type", "Content-Length", "Cache-Control", "Cookie", "X-Trace"
+};
+#define NUM_HEADERS (sizeof(header_names) / sizeof(header_names[0]))
+
+/* Sets 10 headers, looks each one up, and serializes them. */
+static apr_size_t bench_headers(bench_baton_t *bb)
+{
+    serf_bucket_t *hdrs = serf_bucket_headers_create(bb->alloc);
+    int i;
+
+    for (i = 0; i < NUM_HEADERS; i++)
+        serf_bucket_headers_setn(hdrs, header_names[i],
+                                 "some-reasonably-sized-header-value");
+
+    /* Look up in reverse and in another case, which is the worst case. */
+    for (i = NUM_HEADERS - 1; i >= 0; i--) {
+        char name[32];
+        int j;
+
+        for (j = 0; header_names[i][j]; j++)
+            name[j] = apr_tolower(header_names[i][j]);
+        name[j] = '\0';
+
+        if (!serf_bucket_headers_get(hdrs, name))
+            fail("headers", APR_EGENERAL);
+    }
+
+    return drain(hdrs);
+}
+
+/* Reads 64KB of text line by line, as the response status line and
+   headers are read. */
+static apr_size_t bench_readline(bench_baton_t *bb)
+{
+    serf_bucket_t *bkt;
+    apr_size_t total = 0;
+    apr_status_t status;
+
+    bkt = serf_bucket_simple_create(bb->lines, BENCH_DATA_SIZE, NULL, NULL,
+                                    bb->alloc);
+    do {
+        const char *data;
+        apr_size_t len;
+        int found;
+
+        status = serf_bucket_readline(bkt, SERF_NEWLINE_LF, &found,
+                                      &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            fail("readline", status);
+        total += len;
+    } while (!APR_STATUS_IS_EOF(status));
+
+    serf_bucket_destroy(bkt);
+
+    return total;
+}
+
+static apr_size_t bench_dechunk(bench_baton_t *bb)
+{
+    serf_bucket_t *bkt;
+
+    bkt = serf_bucket_simple_create(bb->chunked, bb->chunked_len, NULL, NULL,
+                                    bb->alloc);
+    return drain(serf_bucket_dechunk_create(bkt, bb->alloc));
+}
+
+static apr_size_t bench_deflate(bench_baton_t *bb)
+{
+    serf_bucket_t *bkt;
+
+    bkt = serf_bucket_simple_create(bb->gzipped, bb->gzipped_len, NULL, NULL,
+                                    bb->alloc);
+    return drain(serf_bucket_deflate_create(bkt, bb->alloc,
+                                            SERF_DEFLATE_GZIP));
+}
+
+static apr_size_t bench_compress(bench_baton_t *bb)
+{
+    serf_bucket_t *bkt;
+
+    bkt = serf_bucket_simple_create(bb->lines, BENCH_DATA_SIZE, NULL, NULL,
+                                    bb->alloc);
+    drain(serf_bucket_compress_create(bkt, bb->alloc, SERF_COMPRESS_GZIP,
+                                      SERF_COMPRESS_LEVEL_DEFAULT));
+
+    /* Report the input, which is what the throughput is about. */
+    return BENCH_DATA_SIZE;
+}
+
+/* Feeds what the client encrypted to the server. */
+static void client_to_server(bench_baton_t *bb)
+{
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(bb->encrypt, SERF_READ_ALL_AVAIL, &data,
+                                  &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            fail("ssl_encrypt", status);
+        if (len)
+            BIO_write(SSL_get_rbio(bb->server), data, (int)len);
+    } while (status == APR_SUCCESS);
+}
+
+/* Hands what the server wrote to the client. The records stay in
+   BB->records until the client read them. */
+static void server_to_client(bench_baton_t *bb)
+{
+    BIO *wbio = SSL_get_wbio(bb->server);
+    int len;
+
+    if (BIO_ctrl_pending(wbio) > bb->records_size)
+        fail("ssl server", APR_ENOSPC);
+
+    len = BIO_read(wbio, bb->records, (int)bb->records_size);
+    if (len > 0)
+        serf_bucket_aggregate_append(bb->ssl_in,
+            serf_bucket_simple_create(bb->records, len, NULL, NULL,
+                                      bb->alloc));
+}
+
+/* Reads what's there from BKT, which is held open. */
+static apr_size_t drain_available(serf_bucket_t *bkt)
+{
+    apr_size_t total = 0;
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            fail(bkt->type->name, status);
+        total += len;
+    } while (status == APR_SUCCESS);
+
+    return total;
+}
+
+/* Encrypts 64KB, which the server decrypts. */
+static apr_size_t bench_ssl_encrypt(bench_baton_t *bb)
+{
+    char buf[16384];
+
+    serf_bucket_aggregate_append(bb->ssl_out,
+        serf_bucket_simple_create(bb->lines, BENCH_DATA_SIZE, NULL, NULL,
+                                  bb->alloc));
+    client_to_server(bb);
+
+    while (SSL_read(bb->server, buf, sizeof(buf)) > 0)
+        ;
+
+    return BENCH_DATA_SIZE;
+}
+
+/* Decrypts the 64KB the server encrypted. */
+static apr_size_t bench_ssl_decrypt(bench_baton_t *bb)
+{
+    if (SSL_write(bb->server, bb->lines, BENCH_DATA_SIZE) != BENCH_DATA_SIZE)
+        fail("ssl server", APR_EGENERAL);
+    server_to_client(bb);
+
+    if (drain_available(bb->decrypt) != BENCH_DATA_SIZE)
+        fail("ssl_decrypt", APR_EGENERAL);
+
+    return BENCH_DATA_SIZE;
+}
+
+static const struct {
+    const char *name;
+    bench_func_t func;
+} benchmarks[] = {
+    { "aggregate_read_iovec", bench_aggregate },
+    { "headers_set_get_serialize", bench_headers },
+    { "readline", bench_readline },
+    { "dechunk", bench_dechunk },
+    { "deflate_gzip", bench_deflate },
+    { "compress_gzip", bench_compress },
+    { "ssl_encrypt", bench_ssl_encrypt },
+    { "ssl_decrypt", bench_ssl_decrypt },
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/* Reads BKT until EOF into a new string allocated in POOL. */
+static char *flatten(serf_bucket_t *bkt, apr_size_t *len, apr_pool_t *pool)
+{
+    char *result = NULL;
+    apr_size_t total = 0;
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t data_len;
+        char *grown;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data,
+                                  &data_len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            fail(bkt->type->name, status);
+
+        grown = apr_palloc(pool, total + data_len + 1);
+        if (total)
+            memcpy(grown, result, total);
+        memcpy(grown + total, data, data_len);
+        result = grown;
+        total += data_len;
+    } while (!APR_STATUS_IS_EOF(status));
+
+    serf_bucket_destroy(bkt);
+    if (result)
+        result[total] = '\0';
+    *len = total;
+
+    return result;
+}
+
+static void init_data(bench_baton_t *bb, apr_pool_t *pool)
+{
+    serf_bucket_t *bkt;
+    apr_size_t i;
+
+    bb->lines = apr_palloc(pool, BENCH_DATA_SIZE);
+    for (i = 0; i < BENCH_DATA_SIZE; i++)
+        bb->lines[i] = (i % 80 == 79) ? '\n' : 'a' + (i * 7 + i / 80) % 26;
+
+    /* Let serf produce the encoded data, so that it's like what we'd get
+       from a server. */
+    bkt = serf_bucket_simple_create(bb->lines, BENCH_DATA_SIZE, NULL, NULL,
+                                    bb->alloc);
+    bb->chunked = flatten(serf_bucket_chunk_create(bkt, bb->alloc),
+                          &bb->chunked_len, pool);
+
+    bkt = serf_bucket_simple_create(bb->lines, BENCH_DATA_SIZE, NULL, NULL,
+                                    bb->alloc);
+    bkt = serf_bucket_compress_create(bkt, bb->alloc, SERF_COMPRESS_GZIP,
+                                      SERF_COMPRESS_LEVEL_DEFAULT);
+    if (!bkt)
+        fail("compress", APR_ENOTIMPL);
+    bb->gzipped = flatten(bkt, &bb->gzipped_len, pool);
+}
+
+static apr_status_t hold_open_eagain(void *baton, serf_bucket_t *aggregate)
+{
+    return APR_EAGAIN;
+}
+
+static apr_status_t accept_server_cert(void *data, int failures,
+                                       const serf_ssl_certificate_t *cert)
+{
+    return APR_SUCCESS;
+}
+
+/* Returns FILE in the source tree, see test/test_util.c. */
+static const char *srcdir_file(apr_pool_t *pool, const char *file)
+{
+    char *srcdir;
+
+    if (apr_env_get(&srcdir, "srcdir", pool) == APR_SUCCESS)
+        return apr_pstrcat(pool, srcdir, "/", file, NULL);
+
+    return file;
+}
+
+/* Connects the ssl buckets to the server, with the certificate of the test
+   suite, and runs the handshake. */
+static void init_ssl(bench_baton_t *bb, apr_pool_t *pool)
+{
+    serf_ssl_context_t *ssl_ctx;
+    SSL_CTX *server_ctx;
+    int i;
+
+    /* The client first, which initializes OpenSSL. */
+    bb->ssl_in = serf_bucket_aggregate_create(bb->alloc);
+    serf_bucket_aggregate_hold_open(bb->ssl_in, hold_open_eagain, NULL);
+    bb->ssl_out = serf_bucket_aggregate_create(bb->alloc);
+    serf_bucket_aggregate_hold_open(bb->ssl_out, hold_open_eagain, NULL);
+
+    bb->decrypt = serf_bucket_ssl_decrypt_create(bb->ssl_in, NULL,
+                                                 bb->alloc);
+    ssl_ctx = serf_bucket_ssl_decrypt_context_get(bb->decrypt);
+    bb->encrypt = serf_bucket_ssl_encrypt_create(bb->ssl_out, ssl_ctx,
+                                                 bb->alloc);
+    serf_ssl_server_cert_callback_set(ssl_ctx, accept_server_cert, NULL);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    server_ctx = SSL_CTX_new(TLS_server_method());
+#else
+    server_ctx = SSL_CTX_new(SSLv23_server_method());
+#endif
+    if (!server_ctx)
+        fail("SSL_CTX_new", APR_EGENERAL);
+    SSL_CTX_set_default_passwd_cb_userdata(server_ctx, "serftest");
+    if (SSL_CTX_use_certificate_file(server_ctx,
+            srcdir_file(pool, "test/certs/serfservercert.pem"),
+            SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_use_PrivateKey_file(server_ctx,
+               srcdir_file(pool, "test/certs/private/serfserverkey.pem"),
+               SSL_FILETYPE_PEM) != 1)
+        fail("test/certs/serfservercert.pem", APR_ENOENT);
+
+    bb->server = SSL_new(server_ctx);
+    SSL_CTX_free(server_ctx);
+    SSL_set_bio(bb->server, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+    SSL_set_accept_state(bb->server);
+
+    /* Four 16KB records, and their headers, padding and MACs. */
+    bb->records_size = 2 * BENCH_DATA_SIZE;
+    bb->records = apr_palloc(pool, bb->records_size);
+
+    for (i = 0; i < 10; i++) {
+        drain_available(bb->decrypt);
+        client_to_server(bb);
+        SSL_do_handshake(bb->server);
+        server_to_client(bb);
+    }
+    if (!SSL_is_init_finished(bb->server))
+        fail("ssl handshake", APR_EGENERAL);
+
+    /* The session tickets of the server, before BB->records is reused. */
+    drain_available(bb->decrypt);
+}
+
+static void run_benchmark(int i, bench_baton_t *bb,
+                          apr_interval_time_t duration)
+{
+    apr_time_t start, now;
+    apr_uint64_t iterations = 0, bytes = 0;
+    double ns;
+    int j;
+
+    /* Warm up the allocator and the caches. */
+    for (j = 0; j < BATCH_SIZE; j++)
+        benchmarks[i].func(bb);
+
+    start = now = apr_time_now();
+    while (now - start < duration) {
+        for (j = 0; j < BATCH_SIZE; j++)
+            bytes += benchmarks[i].func(bb);
+        iterations += BATCH_SIZE;
+        now = apr_time_now();
+    }
+
+    ns = (double)(now - start) * 1000.0 / (double)iterations;
+    printf("{\"benchmark\":\"%s\",", benchmarks[i].name);
+    print_version();
+    printf(",\"iterations\":%" APR_UINT64_T_FMT ",\"ns_per_op\":%.1f",
+           iterations, ns);
+    if (bytes)
+        printf(",\"mb_per_s\":%.1f",
+               (double)bytes / (double)(now - start));
+    puts("}");
+    fflush(stdout);
+}
+
+/* The loopback benchmark. The client and the server run in the same
+   context, so the numbers include the work of both sides. */
+typedef struct loop_baton_t {
+    serf_context_t *ctx;
+    serf_bucket_alloc_t *alloc;
+    apr_pool_t *pool;
+    const char *body;
+    apr_size_t body_len;
+    int total;              /* requests to send */
+    int sent;
+    int done;
+    apr_interval_time_t *latencies;
+    apr_status_t status;
+} loop_baton_t;
+
+typedef struct loop_request_t {
+    loop_baton_t *lb;
+    serf_connection_t *conn;
+    apr_time_t start;
+} loop_request_t;
+
+static apr_status_t server_request(serf_context_t *ctx,
+                                   serf_incoming_request_t *req,
+                                   void *request_baton,
+                                   apr_pool_t *pool)
+{
+    loop_baton_t *lb = request_baton;
+    serf_bucket_alloc_t *alloc = serf_incoming_request_get_alloc(req);
+    serf_request_line rl;
+    serf_bucket_t *body, *resp;
+
+    serf_bucket_incoming_request_line(serf_incoming_request_get_bucket(req),
+                                      &rl);
+
+    body = serf_bucket_simple_create(lb->body, lb->body_len, NULL, NULL,
+                                     alloc);
+    resp = serf_bucket_outgoing_response_create(body, 200, NULL, rl.version,
+                                                alloc);
+
+    return serf_incoming_request_respond(req, resp);
+}
+
+static apr_status_t server_accept(serf_context_t *ctx,
+                                  serf_listener_t *l,
+                                  void *accept_baton,
+                                  apr_socket_t *insock,
+                                  apr_pool_t *pool)
+{
+    serf_incoming_t *client;
+
+    return serf_incoming_create(&client, ctx, insock, accept_baton,
+                                server_request, pool);
+}
+
+static apr_status_t conn_setup(apr_socket_t *skt,
+                               serf_bucket_t **input_bkt,
+                               serf_bucket_t **output_bkt,
+                               void *setup_baton,
+                               apr_pool_t *pool)
+{
+    loop_baton_t *lb = setup_baton;
+
+    *input_bkt = serf_context_bucket_socket_create(lb->ctx, skt, lb->alloc);
+
+    return APR_SUCCESS;
+}
+
+static void conn_closed(serf_connection_t *conn,
+                        void *closed_baton,
+                        apr_status_t why,
+                        apr_pool_t *pool)
+{
+    loop_baton_t *lb = closed_baton;
+
+    if (why && !lb->status)
+        lb->status = why;
+}
+
+static serf_bucket_t* accept_response(serf_request_t *request,
+                                      serf_bucket_t *stream,
+                                      void *acceptor_baton,
+                                      apr_pool_t *pool)
+{
+    serf_bucket_alloc_t *alloc = serf_request_get_alloc(request);
+
+    return serf_bucket_response_create(serf_bucket_barrier_create(stream,
+                                                                  alloc),
+                                       alloc);
+}
+
+static void send_request(loop_baton_t *lb, serf_connection_t *conn);
+
+static apr_status_t handle_response(serf_request_t *request,
+                                    serf_bucket_t *response,
+                                    void *handler_baton,
+                                    apr_pool_t *pool)
+{
+    loop_request_t *lr = handler_baton;
+    loop_baton_t *lb = lr->lb;
+    apr_status_t status;
+
+    if (!response) {
+        /* The request was cancelled. */
+        return APR_SUCCESS;
+    }
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data,
+                                  &len);
+        if (SERF_BUCKET_READ_ERROR(status)) {
+            lb->status = status;
+            return status;
+        }
+    } while (status == APR_SUCCESS);
+
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+
+    lb->latencies[lb->done++] = apr_time_now() - lr->start;
+
+    /* Keep the connection busy, with the same number of requests in
+       flight as when we started. */
+    send_request(lb, lr->conn);
+
+    return APR_EOF;
+}
+
+static apr_status_t setup_request(serf_request_t *request,
+                                  void *setup_baton,
+                                  serf_bucket_t **req_bkt,
+                                  serf_response_acceptor_t *acceptor,
+                                  void **acceptor_baton,
+                                  serf_response_handler_t *handler,
+                                  void **handler_baton,
+                                  apr_pool_t *pool)
+{
+    *req_bkt = serf_request_bucket_request_create(request, "GET", "/", NULL,
+                                                  serf_request_get_alloc(
+                                                      request));
+    *acceptor = accept_response;
+    *acceptor_baton = NULL;
+    *handler = handle_response;
+    *handler_baton = setup_baton;
+
+    return APR_SUCCESS;
+}
+
+static void send_request(loop_baton_t *lb, serf_connection_t *conn)
+{
+    loop_request_t *lr;
+
+    if (lb->sent == lb->total)
+        return;
+    lb->sent++;
+
+    /* Small enough to not bother reusing. */
+    lr = apr_palloc(lb->pool, sizeof(*lr));
+    lr->lb = lb;
+    lr->conn = conn;
+    lr->start = apr_time_now();
+
+    serf_connection_request_create(conn, setup_request, lr);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    apr_interval_time_t l = *(const apr_interval_time_t *)a;
+    apr_interval_time_t r = *(const apr_interval_time_t *)b;
+
+    return l < r ? -1 : (l > r);
+}
+
+static apr_interval_time_t percentile(loop_baton_t *lb, int pct)
+{
+    return lb->latencies[(lb->done - 1) * pct / 100];
+}
+
+static void run_loopback(int requests, int connections, int pipeline,
+                         apr_size_t body_len, apr_uint16_t port,
+                         apr_pool_t *pool)
+{
+    loop_baton_t lb;
+    serf_listener_t *listener;
+    apr_uri_t url;
+    apr_time_t start, elapsed;
+    apr_status_t status;
+    char *body;
+    int i, j;
+
+    memset(&lb, 0, sizeof(lb));
+    lb.ctx = serf_context_create(pool);
+    lb.alloc = serf_bucket_allocator_create(pool, NULL, NULL);
+    lb.pool = pool;
+    lb.total = requests;
+    lb.latencies = apr_palloc(pool, requests * sizeof(*lb.latencies));
+
+    body = apr_palloc(pool, body_len);
+    memset(body, 'x', body_len);
+    lb.body = body;
+    lb.body_len = body_len;
+
+    status = serf_listener_create(&listener, lb.ctx, "127.0.0.1", port,
+                                  &lb, server_accept, pool);
+    if (status)
+        fail("serf_listener_create", status);
+
+    apr_uri_parse(pool, apr_psprintf(pool, "http://127.0.0.1:%d/", port),
+                  &url);
+
+    start = apr_time_now();
+    for (i = 0; i < connections; i++) {
+        serf_connection_t *conn;
+
+        status = serf_connection_create2(&conn, lb.ctx, url, conn_setup, &lb,
+                                         conn_closed, &lb, pool);
+        if (status)
+            fail("serf_connection_create2", status);
+
+        for (j = 0; j < pipeline; j++)
+            send_request(&lb, conn);
+    }
+
+    while (lb.done < lb.total) {
+        status = serf_context_run(lb.ctx, SERF_DURATION_FOREVER, pool);
+        if (APR_STATUS_IS_TIMEUP(status))
+            continue;
+        if (status)
+            fail("serf_context_run", status);
+        if (lb.status)
+            fail("loopback", lb.status);
+    }
+    elapsed = apr_time_now() - start;
+
+    qsort(lb.latencies, lb.done, sizeof(*lb.latencies), compare_latency);
+
+    printf("{\"benchmark\":\"http_loopback\",");
+    print_version();
+    printf(",\"requests\":%d,\"connections\":%d,\"pipeline\":%d"
+           ",\"body_size\":%" APR_SIZE_T_FMT ",\"requests_per_s\":%.1f",
+           lb.done, connections, pipeline, body_len,
+           (double)lb.done * APR_USEC_PER_SEC / (double)elapsed);
+    printf(",\"p50_us\":%" APR_INT64_T_FMT ",\"p90_us\":%" APR_INT64_T_FMT
+           ",\"p99_us\":%" APR_INT64_T_FMT ",\"max_us\":%" APR_INT64_T_FMT
+           "}\n",
+           (apr_int64_t)percentile(&lb, 50), (apr_int64_t)percentile(&lb, 90),
+           (apr_int64_t)percentile(&lb, 99),
+           (apr_int64_t)lb.latencies[lb.done - 1]);
+    fflush(stdout);
+}
+
+static const apr_getopt_option_t options[] =
+{
+    {"help",    'h', 0, "Display this help"},
+    {NULL,      'd', 1, "<msec> Run each bucket benchmark this long"
+                        " (default 1000)"},
+    {NULL,      'f', 1, "<name> Only run the benchmarks containing <name>"},
+    {NULL,      'n', 1, "<count> Loopback requests to send (default 10000)"},
+    {NULL,      'c', 1, "<count> Loopback connections (default 4)"},
+    {NULL,      'x', 1, "<count> Requests in flight per connection"
+                        " (default 1)"},
+    {NULL,      's', 1, "<bytes> Loopback response body size"
+                        " (default 1024)"},
+    {NULL,      'p', 1, "<port> Loopback port (default 30090)"},
+};
+
+static void print_usage(void)
+{
+    int i;
+
+    puts("serf_bench [options]\n");
+    puts("Prints one JSON object per line for each benchmark.\n");
+    puts("Options:");
+
+    for (i = 0; i < sizeof(options) / sizeof(apr_getopt_option_t); i++) {
+        const apr_getopt_option_t* o = &options[i];
+
+        printf(" -%c", o->optch);
+        if (o->name)
+            printf(", ");
+
+        printf("%s%s\t%s\n",
+               o->name ? "--" : "\t",
+               o->name ? o->name : "",
+               o->description);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    int opt_c;
+    const char *opt_arg;
+    const char *filter = NULL;
+    apr_interval_time_t duration = apr_time_from_msec(1000);
+    int requests = 10000, connections = 4, pipeline = 1;
+    apr_size_t body_len = 1024;
+    apr_uint16_t port = BENCH_PORT;
+    bench_baton_t bb;
+    int i;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    apr_pool_create(&pool, NULL);
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, options, &opt_c, &opt_arg)) ==
+           APR_SUCCESS) {
+
+        switch (opt_c) {
+        case 'h':
+            print_usage();
+            exit(0);
+        case 'd':
+            duration = apr_time_from_msec(apr_atoi64(opt_arg));
+            break;
+        case 'f':
+            filter = opt_arg;
+            break;
+        case 'n':
+            requests = atoi(opt_arg);
+            break;
+        case 'c':
+            connections = atoi(opt_arg);
+            break;
+        case 'x':
+            pipeline = atoi(opt_arg);
+            break;
+        case 's':
+            body_len = (apr_size_t)apr_atoi64(opt_arg);
+            break;
+        case 'p':
+            port = (apr_uint16_t)atoi(opt_arg);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (status != APR_EOF || opt->ind != opt->argc || duration <= 0
+        || requests <= 0 || connections <= 0 || pipeline <= 0) {
+        print_usage();
+        exit(-1);
+    }
+
+    bb.alloc = serf_bucket_allocator_create(pool, NULL, NULL);
+    init_data(&bb, pool);
+    init_ssl(&bb, pool);
+
+    for (i = 0; i < NUM_BENCHMARKS; i++) {
+        if (!filter || strstr(benchmarks[i].name, filter))
+            run_benchmark(i, &bb, duration);
+    }
+
+    if (!filter || strstr("http_loopback", filter))
+        run_loopback(requests, connections, pipeline, body_len, port, pool);
+
+    SSL_free(bb.server);
+    apr_pool_destroy(pool);
+
+    return 0;
+}
@@ -25,9 +25,6 @@
 
 #include "serf.h"
 
-/* Add Connection: close header to each request. */
-/* #define CONNECTION_CLOSE_HDR */
-
 typedef struct app_baton_t {
     const char *hostinfo;
     int using_ssl;
@@ -261,6 +258,17 @@ typedef struct handler_baton_t {
     const char *password;
     int auth_attempts;
     serf_bucket_t *req_hdrs;
+    int close_conn;
+
+    /* Load mode: the responses are discarded, only their latency (from the
+       connection's timings) and status are kept. */
+    int load;
+    int rate;                   /* requests/sec, or 0 for closed loop */
+    int total;                  /* requests to send, or 0 for no limit */
+    apr_time_t deadline;        /* or 0 for no limit */
+    int sent;
+    int errors;
+    apr_array_header_t *latencies;
 } handler_baton_t;
 
 /* Kludges for APR 0.9 support. */
@@ -322,9 +330,8 @@ static apr_status_t setup_request(serf_request_t *request,
                              "Serf/" SERF_VERSION_STRING);
     /* Shouldn't serf do this for us? */
     serf_bucket_headers_setn(hdrs_bkt, "Accept-Encoding", "gzip");
-#ifdef CONNECTION_CLOSE_HDR
-    serf_bucket_headers_setn(hdrs_bkt, "Connection", "close");
-#endif
+    if (ctx->close_conn)
+        serf_bucket_headers_setn(hdrs_bkt, "Connection", "close");
 
     /* Add the extra headers from the command line */
     if (ctx->req_hdrs != NULL) {
@@ -339,6 +346,66 @@ static apr_status_t setup_request(serf_request_t *request,
     return APR_SUCCESS;
 }
 
+/* Returns non-zero if load mode should send another request. */
+static int want_more_requests(handler_baton_t *ctx)
+{
+    if (ctx->total && ctx->sent >= ctx->total)
+        return 0;
+    if (ctx->deadline && apr_time_now() >= ctx->deadline)
+        return 0;
+    return 1;
+}
+
+static void send_load_request(handler_baton_t *ctx, serf_connection_t *conn)
+{
+    if (!want_more_requests(ctx))
+        return;
+
+    ctx->sent++;
+    serf_connection_request_create(conn, setup_request, ctx);
+}
+
+static void record_timings(void *baton,
+                           serf_request_t *request,
+                           const serf_request_timings_t *timings,
+                           const serf_connection_timings_t *conn_timings)
+{
+    handler_baton_t *ctx = baton;
+
+    /* In open loop mode the request is created when it's due, so this
+       includes the time it waited for a connection. */
+    APR_ARRAY_PUSH(ctx->latencies, apr_interval_time_t) =
+        timings->done - timings->created;
+}
+
+/* Reads the rest of RESPONSE in load mode. */
+static apr_status_t discard_response(serf_request_t *request,
+                                     serf_bucket_t *response,
+                                     handler_baton_t *ctx)
+{
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(response, SERF_READ_ALL_AVAIL, &data,
+                                  &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+    } while (status == APR_SUCCESS);
+
+    if (APR_STATUS_IS_EOF(status)) {
+        apr_atomic_inc32(&ctx->completed_requests);
+
+        /* Closed loop: keep as many requests in flight as we started with. */
+        if (!ctx->rate)
+            send_load_request(ctx, serf_request_get_conn(request));
+    }
+
+    return status;
+}
+
 static apr_status_t handle_response(serf_request_t *request,
                                     serf_bucket_t *response,
                                     void *handler_baton,
@@ -362,6 +429,15 @@ static apr_status_t handle_response(serf_request_t *request,
         return status;
     }
 
+    if (ctx->load) {
+        /* The handler may be called again for the rest of the body. Count
+           the status when the response is complete. */
+        status = discard_response(request, response, ctx);
+        if (APR_STATUS_IS_EOF(status) && sl.code >= 400)
+            ctx->errors++;
+        return status;
+    }
+
     while (1) {
         struct iovec vecs[64];
         int vecs_read;
@@ -438,6 +514,9 @@ credentials_callback(char **username,
 /* Value for 'no short code' should be > 255 */
 #define CERTFILE 256
 #define CERTPWD  257
+#define TRACEFILE 258
+#define HTTP2 259
+#define NOKEEPALIVE 260
 
 static const apr_getopt_option_t options[] =
 {
@@ -456,8 +535,70 @@ static const apr_getopt_option_t options[] =
     {"certpwd", CERTPWD, 1, "<password> Password for the SSL client certificate"},
     {NULL,      'r', 1, "<header:value> Use <header:value> as request header"},
     {"debug",   'd', 0, "Enable debugging"},
+    {"trace",   TRACEFILE, 1, "<file> Record a binary trace in <file>"},
+    {"http2",   HTTP2, 0, "Speak HTTP/2 without negotiating it first"},
+    {"no-keepalive", NOKEEPALIVE, 0, "Add Connection: close to each request"},
+    {"load",    'l', 0, "Load mode: discard the responses, report throughput"
+                        " and latency"},
+    {NULL,      'c', 1, "<count> Use <count> connections (implies -l)"},
+    {NULL,      't', 1, "<seconds> Send requests for <seconds>, and with -n"
+                        " at most <count> (implies -l)"},
+    {NULL,      'R', 1, "<rate> Send <rate> requests/sec whether or not the"
+                        " responses keep up (implies -l)"},
 };
 
+static int compare_latency(const void *a, const void *b)
+{
+    apr_interval_time_t l = *(const apr_interval_time_t *)a;
+    apr_interval_time_t r = *(const apr_interval_time_t *)b;
+
+    return l < r ? -1 : (l > r);
+}
+
+/* Returns the latency in msec below which PERMILLE of the requests are. */
+static double latency_ms(apr_array_header_t *latencies, int permille)
+{
+    int i = (int)((apr_int64_t)(latencies->nelts - 1) * permille / 1000);
+
+    return APR_ARRAY_IDX(latencies, i, apr_interval_time_t) / 1000.0;
+}
+
+static void print_load_report(handler_baton_t *ctx,
+                              serf_connection_t **connections,
+                              int num_conns,
+                              apr_interval_time_t elapsed)
+{
+    apr_array_header_t *latencies = ctx->latencies;
+    apr_off_t bytes_read = 0;
+    double secs = (double)elapsed / APR_USEC_PER_SEC;
+    int i;
+
+    for (i = 0; i < num_conns; i++) {
+        serf_connection_timings_t timings;
+
+        serf_connection_get_timings(connections[i], &timings);
+        bytes_read += timings.bytes_read;
+    }
+
+    printf("Requests:   %d completed, %d with status >= 400, in %.3f s\n",
+           latencies->nelts, ctx->errors, secs);
+    if (ctx->rate)
+        printf("Target:     %d requests/s\n", ctx->rate);
+    printf("Throughput: %.1f requests/s, %.1f KB/s\n",
+           latencies->nelts / secs, bytes_read / secs / 1024);
+
+    if (!latencies->nelts)
+        return;
+
+    qsort(latencies->elts, latencies->nelts, latencies->elt_size,
+          compare_latency);
+    printf("Latency:    p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+           "p99.9 %.3f ms, max %.3f ms\n",
+           latency_ms(latencies, 500), latency_ms(latencies, 900),
+           latency_ms(latencies, 990), latency_ms(latencies, 999),
+           latency_ms(latencies, 1000));
+}
+
 static void print_usage(apr_pool_t *pool)
 {
     int i;
@@ -489,7 +630,7 @@ int main(int argc, const char **argv)
     apr_pool_t *pool;
     serf_bucket_alloc_t *bkt_alloc;
     serf_context_t *context;
-    serf_connection_t *connection;
+    serf_connection_t **connections;
     app_baton_t app_ctx;
     handler_baton_t handler_ctx;
     serf_bucket_t *req_hdrs = NULL;
@@ -499,9 +640,14 @@ int main(int argc, const char **argv)
     int count, inflight;
     int i;
     int print_headers, debug;
+    int load = 0, num_conns = 1, duration = 0, rate = 0, count_set = 0;
+    int http2 = 0, close_conn = 0;
+    apr_time_t start, next_send = 0;
+    int next_conn = 0;
     const char *username = NULL;
     const char *password = "";
     const char *pem_path = NULL, *pem_pwd = NULL;
+    const char *trace_path = NULL;
     apr_getopt_t *opt;
     int opt_c;
     const char *opt_arg;
@@ -559,6 +705,7 @@ int main(int argc, const char **argv)
                        errno);
                 return errno;
             }
+            count_set = 1;
             break;
         case 'x':
             errno = 0;
@@ -572,6 +719,27 @@ int main(int argc, const char **argv)
         case 'p':
             proxy = opt_arg;
             break;
+        case 'l':
+            load = 1;
+            break;
+        case 'c':
+            num_conns = atoi(opt_arg);
+            load = 1;
+            break;
+        case 't':
+            duration = atoi(opt_arg);
+            load = 1;
+            break;
+        case 'R':
+            rate = atoi(opt_arg);
+            load = 1;
+            break;
+        case HTTP2:
+            http2 = 1;
+            break;
+        case NOKEEPALIVE:
+            close_conn = 1;
+            break;
         case 'r':
             {
                 char *sep;
@@ -600,6 +768,9 @@ int main(int argc, const char **argv)
         case CERTPWD:
             pem_pwd = opt_arg;
             break;
+        case TRACEFILE:
+            trace_path = opt_arg;
+            break;
         case 'v':
             puts("Serf version: " SERF_VERSION_STRING);
             exit(0);
@@ -608,7 +779,8 @@ int main(int argc, const char **argv)
         }
     }
 
-    if (opt->ind != opt->argc - 1) {
+    if (opt->ind != opt->argc - 1 || num_conns <= 0 || duration < 0
+        || rate < 0) {
         print_usage(pool);
         exit(-1);
     }
@@ -715,20 +887,23 @@ int main(int argc, const char **argv)
             serf_logging_add_output(context, output);
     }
 
+    /* Record the traffic, with the first 256 bytes of each read and write */
+    if (trace_path)
+    {
+        status = serf_context_trace_to_file(context, trace_path,
+                                            64 * 1024 * 1024, 256, pool);
+        if (status)
+        {
+            printf("Cannot create trace file '%s': %d\n", trace_path, status);
+            apr_pool_destroy(pool);
+            exit(1);
+        }
+    }
+
     /* ### Connection or Context should have an allocator? */
     app_ctx.bkt_alloc = bkt_alloc;
     app_ctx.ssl_ctx = NULL;
 
-    status = serf_connection_create2(&connection, context, url,
-                                     conn_setup, &app_ctx,
-                                     closed_connection, &app_ctx,
-                                     pool);
-    if (status) {
-        printf("Error creating connection: %d\n", status);
-        apr_pool_destroy(pool);
-        exit(1);
-    }
-
     handler_ctx.completed_requests = 0;
     handler_ctx.print_headers = print_headers;
 
@@ -755,17 +930,84 @@ int main(int argc, const char **argv)
     handler_ctx.acceptor_baton = &app_ctx;
     handler_ctx.handler = handle_response;
     handler_ctx.req_hdrs = req_hdrs;
+    handler_ctx.close_conn = close_conn;
+
+    handler_ctx.load = load;
+    handler_ctx.rate = rate;
+    /* With a duration, -n is only an upper limit. */
+    handler_ctx.total = (duration && !count_set) ? 0 : count;
+    handler_ctx.deadline = 0;
+    handler_ctx.sent = 0;
+    handler_ctx.errors = 0;
+    handler_ctx.latencies = apr_array_make(pool, load ? 1024 : 1,
+                                           sizeof(apr_interval_time_t));
+
+    connections = apr_pcalloc(pool, num_conns * sizeof(*connections));
+    for (i = 0; i < num_conns; i++) {
+        /* Each connection needs its own SSL context. */
+        app_baton_t *conn_ctx = apr_pmemdup(pool, &app_ctx, sizeof(app_ctx));
+
+        status = serf_connection_create2(&connections[i], context, url,
+                                         conn_setup, conn_ctx,
+                                         closed_connection, conn_ctx,
+                                         pool);
+        if (status) {
+            printf("Error creating connection: %d\n", status);
+            apr_pool_destroy(pool);
+            exit(1);
+        }
 
-    serf_connection_set_max_outstanding_requests(connection, inflight);
+        serf_connection_set_max_outstanding_requests(connections[i],
+                                                     inflight);
+        if (http2) {
+            serf_connection_set_framing_type(
+                connections[i], SERF_CONNECTION_FRAMING_TYPE_HTTP2);
+        }
+        if (load)
+            serf_connection_set_timings_callback(connections[i],
+                                                 record_timings,
+                                                 &handler_ctx);
+    }
 
-    for (i = 0; i < count; i++) {
-        /* We don't need the returned request here. */
-        serf_connection_request_create(connection, setup_request,
-                                       &handler_ctx);
+    start = apr_time_now();
+    if (duration)
+        handler_ctx.deadline = start + apr_time_from_sec(duration);
+
+    if (!load) {
+        for (i = 0; i < count; i++) {
+            /* We don't need the returned request here. */
+            serf_connection_request_create(connections[0], setup_request,
+                                           &handler_ctx);
+        }
+    }
+    else if (rate) {
+        next_send = start;
+    }
+    else {
+        /* Closed loop: each response is followed by a new request on its
+           connection, so start with what a connection may have in flight. */
+        for (i = 0; i < num_conns * (inflight ? inflight : 1); i++)
+            send_load_request(&handler_ctx, connections[i % num_conns]);
     }
 
     while (1) {
-        status = serf_context_run(context, SERF_DURATION_FOREVER, pool);
+        apr_short_interval_time_t wait = SERF_DURATION_FOREVER;
+
+        /* Open loop: send the requests that are due, round robin over the
+           connections, and wake up when the next one is. */
+        if (rate) {
+            apr_time_t now = apr_time_now();
+
+            while (want_more_requests(&handler_ctx) && next_send <= now) {
+                send_load_request(&handler_ctx, connections[next_conn]);
+                next_conn = (next_conn + 1) % num_conns;
+                next_send += APR_USEC_PER_SEC / rate;
+            }
+            if (want_more_requests(&handler_ctx))
+                wait = next_send - now;
+        }
+
+        status = serf_context_run(context, wait, pool);
         if (APR_STATUS_IS_TIMEUP(status))
             continue;
         if (status) {
@@ -780,16 +1022,27 @@ int main(int argc, const char **argv)
             apr_pool_destroy(pool);
             exit(1);
         }
-        if (apr_atomic_read32(&handler_ctx.completed_requests) >= count) {
+        if (load) {
+            if (!want_more_requests(&handler_ctx)
+                && apr_atomic_read32(&handler_ctx.completed_requests)
+                       >= handler_ctx.sent)
+                break;
+        }
+        else if (apr_atomic_read32(&handler_ctx.completed_requests) >= count) {
             break;
         }
         /* Debugging purposes only! */
         serf_debug__closed_conn(app_ctx.bkt_alloc);
     }
 
+    if (load)
+        print_load_report(&handler_ctx, connections, num_conns,
+                          apr_time_now() - start);
+
     apr_file_close(handler_ctx.output_file);
 
-    serf_connection_close(connection);
+    for (i = 0; i < num_conns; i++)
+        serf_connection_close(connections[i]);
 
     apr_pool_destroy(pool);
     return 0;
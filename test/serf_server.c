@@ -35,8 +35,22 @@ static apr_status_t incoming_request(serf_context_t *ctx,
                                         void *request_baton,
                                         apr_pool_t *pool)
 {
-    printf("INCOMING REQUEST\n");
-    return APR_SUCCESS;
+    serf_bucket_alloc_t *alloc = serf_incoming_request_get_alloc(req);
+    serf_request_line rl;
+    serf_bucket_t *body, *resp;
+
+    serf_bucket_incoming_request_line(serf_incoming_request_get_bucket(req),
+                                      &rl);
+    printf("INCOMING REQUEST %s %s\n", rl.method, rl.uri);
+
+    /* The body of the request is discarded, as we set no handler. */
+    body = SERF_BUCKET_SIMPLE_STRING("Hello from serf\n", alloc);
+    resp = serf_bucket_outgoing_response_create(body, 200, NULL, rl.version,
+                                                alloc);
+    serf_bucket_headers_setn(serf_bucket_outgoing_response_get_headers(resp),
+                             "Content-Type", "text/plain");
+
+    return serf_incoming_request_respond(req, resp);
 }
 
 
@@ -56,6 +70,7 @@ static void print_usage(apr_pool_t *pool)
     puts("serf_server [options] listen_address:listen_port");
     puts("-h\tDisplay this help");
     puts("-v\tDisplay version");
+    puts("-r\tOpen the listener with SO_REUSEPORT, to run several servers");
 }
 
 int main(int argc, const char **argv)
@@ -72,6 +87,7 @@ int main(int argc, const char **argv)
     apr_getopt_t *opt;
     char opt_c;
     const char *opt_arg;
+    int flags = 0;
 
     apr_initialize();
     atexit(apr_terminate);
@@ -80,7 +96,7 @@ int main(int argc, const char **argv)
 
     apr_getopt_init(&opt, pool, argc, argv);
 
-    while ((rv = apr_getopt(opt, "hv", &opt_c, &opt_arg)) ==
+    while ((rv = apr_getopt(opt, "hvr", &opt_c, &opt_arg)) ==
            APR_SUCCESS) {
         switch (opt_c) {
         case 'h':
@@ -90,6 +106,9 @@ int main(int argc, const char **argv)
         case 'v':
             puts("Serf version: " SERF_VERSION_STRING);
             exit(0);
+        case 'r':
+            flags |= SERF_LISTENER_REUSEPORT;
+            break;
         default:
             break;
         }
@@ -121,8 +140,8 @@ int main(int argc, const char **argv)
 
     /* TODO.... stuff */
     app_ctx.foo = 1;
-    rv = serf_listener_create(&listener, context, addr, port, 
-                              &app_ctx, accept_fn, pool);
+    rv = serf_listener_create2(&listener, context, addr, port,
+                               &app_ctx, accept_fn, flags, pool);
     if (rv) {
         printf("Error parsing listener: %d\n", rv);
         exit(1);
@@ -25,10 +25,12 @@
 #include <apr_getopt.h>
 #include <apr_xml.h>
 #include <apr_thread_proc.h>
-#include <apr_thread_mutex.h>
-#include <apr_thread_cond.h>
 #include <apr_version.h>
 
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #include "serf.h"
 #include "serf_bucket_util.h"
 
@@ -41,12 +43,19 @@
 /* This is a rough-sketch example of how a multi-threaded spider could be
  * constructed using serf.
  *
- * A network thread will read in a URL and feed it into an expat parser.
- * After the entire response is read, the XML structure and the path is
- * passed to a set of parser threads.  These threads will scan the document
- * for HTML href's and queue up any links that it finds.
+ * The fetching is spread over the loops of a serf context group, each
+ * with its own connection to the server. A loop feeds the responses into
+ * an expat parser. After the entire response is read, the XML structure
+ * and the path are passed to a pool of parser threads, one per core that
+ * isn't running a loop. These scan the document for HTML href's, and hand
+ * the links they find to the loops, round robin, with
+ * serf_context_group_post().
  *
- * It does try to stay on the same server as it only uses one connection.
+ * Nothing is shared between the threads but the two queues: serf objects
+ * are only used on their own loop, and the parsers get the documents
+ * through a lock-free queue, so adding threads doesn't add contention.
+ *
+ * It only follows links to the same server.
  *
  * Because we feed the responses into an XML parser, the documents must be
  * well-formed XHTML.
@@ -54,14 +63,133 @@
  * There is no duplicate link detection.  You've been warned.
  */
 
-/* The structure passed to the parser thread after we've read the entire
- * response.
+/* The documents a loop may have in flight, from sending the request until
+   a parser finished with the response. The rest of its links wait. */
+#define MAX_DOCS_PER_FETCHER 16
+
+/* The times an idle parser yields before it starts sleeping. */
+#define PARSER_SPIN_COUNT 64
+#define PARSER_SLEEP (1000) /* 1 ms */
+
+#define CACHE_LINE_SIZE 64
+
+/* A bounded multi-producer, multi-consumer queue, after the design of
+ * Dmitry Vyukov. Each cell has a sequence number that says whether the
+ * cell is ready to be written or read at a given position: producers
+ * and consumers only compete for their own position, with one CAS, and
+ * never wait for each other.
+ *
+ * The positions wrap around, which works because the difference with
+ * a sequence number is compared as a signed value.
  */
-typedef struct doc_path_t {
-    apr_xml_doc *doc;
-    char *path;
-    apr_pool_t *pool;
-} doc_path_t;
+typedef struct queue_cell_t {
+    volatile apr_uint32_t seq;
+    void *data;
+} queue_cell_t;
+
+typedef struct queue_t {
+    queue_cell_t *cells;
+    apr_uint32_t mask;
+
+    /* Don't let the producers and consumers pull one cache line back and
+       forth between them. */
+    char pad1[CACHE_LINE_SIZE];
+    volatile apr_uint32_t enqueue_pos;
+    char pad2[CACHE_LINE_SIZE];
+    volatile apr_uint32_t dequeue_pos;
+    char pad3[CACHE_LINE_SIZE];
+} queue_t;
+
+/* Create a queue for at least SIZE items. */
+static queue_t *queue_create(apr_uint32_t size, apr_pool_t *pool)
+{
+    queue_t *q = apr_pcalloc(pool, sizeof(*q));
+    apr_uint32_t capacity = 2;
+    apr_uint32_t i;
+
+    while (capacity < size)
+        capacity <<= 1;
+
+    q->cells = apr_palloc(pool, capacity * sizeof(*q->cells));
+    q->mask = capacity - 1;
+    for (i = 0; i < capacity; i++)
+        apr_atomic_set32(&q->cells[i].seq, i);
+    apr_atomic_set32(&q->enqueue_pos, 0);
+    apr_atomic_set32(&q->dequeue_pos, 0);
+
+    return q;
+}
+
+/* Returns 0 if Q is full. */
+static int queue_push(queue_t *q, void *data)
+{
+    queue_cell_t *cell;
+    apr_uint32_t pos = apr_atomic_read32(&q->enqueue_pos);
+
+    while (1) {
+        apr_int32_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        diff = (apr_int32_t)(apr_atomic_read32(&cell->seq) - pos);
+        if (diff == 0) {
+            apr_uint32_t old = apr_atomic_cas32(&q->enqueue_pos, pos + 1, pos);
+
+            if (old == pos)
+                break;
+            pos = old;
+        }
+        else if (diff < 0) {
+            return 0;
+        }
+        else {
+            /* Another producer took this position. */
+            pos = apr_atomic_read32(&q->enqueue_pos);
+        }
+    }
+
+    cell->data = data;
+
+    /* Publish the cell. Unlike apr_atomic_set32(), this is a full barrier
+       with every implementation of APR, so the consumer sees DATA. */
+    apr_atomic_xchg32(&cell->seq, pos + 1);
+
+    return 1;
+}
+
+/* Returns NULL if Q is empty. */
+static void *queue_pop(queue_t *q)
+{
+    queue_cell_t *cell;
+    apr_uint32_t pos = apr_atomic_read32(&q->dequeue_pos);
+    void *data;
+
+    while (1) {
+        apr_int32_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        diff = (apr_int32_t)(apr_atomic_read32(&cell->seq) - (pos + 1));
+        if (diff == 0) {
+            apr_uint32_t old = apr_atomic_cas32(&q->dequeue_pos, pos + 1, pos);
+
+            if (old == pos)
+                break;
+            pos = old;
+        }
+        else if (diff < 0) {
+            return NULL;
+        }
+        else {
+            pos = apr_atomic_read32(&q->dequeue_pos);
+        }
+    }
+
+    data = cell->data;
+
+    /* Hand the cell back to the producers, one lap later. */
+    apr_atomic_xchg32(&cell->seq, pos + q->mask + 1);
+
+    return data;
+}
 
 typedef struct app_baton_t {
     const char *authn;
@@ -70,6 +198,64 @@ typedef struct app_baton_t {
     serf_bucket_alloc_t *bkt_alloc;
 } app_baton_t;
 
+typedef struct spider_t spider_t;
+typedef struct url_t url_t;
+
+/* A loop of the context group, and its connection. Only used on that
+   loop, except for CTX and SPIDER. */
+typedef struct fetcher_t {
+    spider_t *spider;
+    serf_context_t *ctx;
+    serf_connection_t *connection;
+    apr_pool_t *pool;
+    app_baton_t app_ctx;
+
+    /* Documents in flight, see MAX_DOCS_PER_FETCHER. */
+    int in_flight;
+    url_t *backlog;
+    url_t *backlog_tail;
+} fetcher_t;
+
+struct spider_t {
+    serf_context_group_t *group;
+    apr_sockaddr_t *address;
+    const char *authn;
+    int using_ssl;
+
+    /* Master host: for now, we'll stick to one host. */
+    const char *hostinfo;
+
+    fetcher_t *fetchers;
+    int nfetchers;
+    volatile apr_uint32_t next_fetcher;
+
+    /* The parsed responses, from the loops to the parsers. */
+    queue_t *docs;
+
+    /* The links that were found but aren't completely handled yet, that
+       is fetched and, for documents, parsed. The spider is done when this
+       drops to 0. */
+    volatile apr_uint32_t pending;
+};
+
+/* A link handed to a loop. Allocated with malloc(), as it is freed by
+   another thread. */
+struct url_t {
+    fetcher_t *fetcher;
+    url_t *next;
+    char path[1];
+};
+
+/* The structure passed to the parser thread after we've read the entire
+ * response. It lives in the pool of the document.
+ */
+typedef struct doc_path_t {
+    apr_xml_doc *doc;
+    char *path;
+    apr_pool_t *pool;
+    fetcher_t *fetcher;
+} doc_path_t;
+
 static void closed_connection(serf_connection_t *conn,
                               void *closed_baton,
                               apr_status_t why,
@@ -115,33 +301,17 @@ static serf_bucket_t* accept_response(serf_request_t *request,
 
     return serf_bucket_response_create(c, bkt_alloc);
 }
-
 typedef struct handler_baton_t {
     serf_bucket_alloc_t *allocator;
-#if APR_MAJOR_VERSION > 0
-    apr_uint32_t *requests_outstanding;
-#else
-    apr_atomic_t *requests_outstanding;
-#endif
-    serf_bucket_alloc_t *doc_queue_alloc;
-    apr_array_header_t *doc_queue;
-    apr_thread_cond_t *doc_queue_condvar;
-
-    const char *hostinfo;
+    fetcher_t *fetcher;
 
-    /* includes: path, query, fragment. */
+    /* includes: path, query. */
     char *full_path;
     apr_size_t full_path_len;
 
-    char *path;
+    /* The length of the path part of FULL_PATH. */
     apr_size_t path_len;
 
-    char *query;
-    apr_size_t query_len;
-
-    char *fragment;
-    apr_size_t fragment_len;
-
     apr_xml_parser *parser;
     apr_pool_t *parser_pool;
 
@@ -155,13 +325,16 @@ typedef struct handler_baton_t {
     app_baton_t *app_ctx;
 } handler_baton_t;
 
-/* Kludges for APR 0.9 support. */
-#if APR_MAJOR_VERSION == 0
-#define apr_atomic_inc32 apr_atomic_inc
-#define apr_atomic_dec32 apr_atomic_dec
-#define apr_atomic_read32 apr_atomic_read
-#define apr_atomic_set32 apr_atomic_set
-#endif
+static void fetch_next(fetcher_t *fetcher);
+
+/* A link or document of FETCHER is completely handled. */
+static void fetch_done(fetcher_t *fetcher)
+{
+    fetcher->in_flight--;
+    fetch_next(fetcher);
+
+    apr_atomic_dec32(&fetcher->spider->pending);
+}
 
 static apr_status_t handle_response(serf_request_t *request,
                                     serf_bucket_t *response,
@@ -199,7 +372,7 @@ static apr_status_t handle_response(serf_request_t *request,
             serf_bucket_t *hdrs;
             const char *val;
 
-            printf("Processing %s\n", ctx->path);
+            printf("Processing %s\n", ctx->full_path);
 
             hdrs = serf_bucket_response_get_headers(response);
             val = serf_bucket_headers_get(hdrs, "Content-Type");
@@ -225,49 +398,51 @@ static apr_status_t handle_response(serf_request_t *request,
 #ifdef SERF_VERBOSE
                 printf("XML parser error (feed): %d\n", xs);
 #endif
+                apr_pool_destroy(ctx->parser_pool);
                 ctx->is_html = 0;
             }
         }
 
         /* are we done yet? */
         if (APR_STATUS_IS_EOF(status)) {
+            fetcher_t *fetcher = ctx->fetcher;
+            apr_xml_doc *xmld = NULL;
 
             if (ctx->is_html) {
-                apr_xml_doc *xmld;
                 apr_status_t xs;
-                doc_path_t *dup;
 
                 xs = apr_xml_parser_done(ctx->parser, &xmld);
                 if (xs) {
 #ifdef SERF_VERBOSE
                     printf("XML parser error (done): %d\n", xs);
 #endif
-                    return xs;
+                    apr_pool_destroy(ctx->parser_pool);
+                    xmld = NULL;
                 }
-                dup = (doc_path_t*)
-                    serf_bucket_mem_alloc(ctx->doc_queue_alloc,
-                                          sizeof(doc_path_t));
+            }
+
+            if (xmld) {
+                doc_path_t *dup;
+
+                dup = apr_palloc(ctx->parser_pool, sizeof(*dup));
                 dup->doc = xmld;
-                dup->path = (char*)serf_bucket_mem_alloc(ctx->doc_queue_alloc,
-                                                         ctx->path_len);
-                memcpy(dup->path, ctx->path, ctx->path_len);
+                dup->path = apr_pstrmemdup(ctx->parser_pool, ctx->full_path,
+                                           ctx->path_len);
                 dup->pool = ctx->parser_pool;
+                dup->fetcher = fetcher;
 
-                *(doc_path_t **)apr_array_push(ctx->doc_queue) = dup;
-
-                apr_thread_cond_signal(ctx->doc_queue_condvar);
+                /* Can't fail: the queue has room for all the documents
+                   the loops may have in flight. */
+                queue_push(fetcher->spider->docs, dup);
             }
 
-            apr_atomic_dec32(ctx->requests_outstanding);
-            serf_bucket_mem_free(ctx->allocator, ctx->path);
-            if (ctx->query) {
-                serf_bucket_mem_free(ctx->allocator, ctx->query);
-                serf_bucket_mem_free(ctx->allocator, ctx->full_path);
-            }
-            if (ctx->fragment) {
-                serf_bucket_mem_free(ctx->allocator, ctx->fragment);
-            }
+            serf_bucket_mem_free(ctx->allocator, ctx->full_path);
             serf_bucket_mem_free(ctx->allocator, ctx);
+
+            /* A document is done when it's parsed. */
+            if (!xmld)
+                fetch_done(fetcher);
+
             return APR_EOF;
         }
 
@@ -280,21 +455,6 @@ static apr_status_t handle_response(serf_request_t *request,
     /* NOTREACHED */
 }
 
-typedef struct parser_baton_t {
-    apr_uint32_t *requests_outstanding;
-    serf_connection_t *connection;
-    apr_array_header_t *doc_queue;
-    serf_bucket_alloc_t *doc_queue_alloc;
-
-    apr_thread_cond_t *condvar;
-    apr_thread_mutex_t *mutex;
-
-    /* Master host: for now, we'll stick to one host. */
-    const char *hostinfo;
-
-    app_baton_t *app_ctx;
-} parser_baton_t;
-
 static apr_status_t setup_request(serf_request_t *request,
                                   void *setup_baton,
                                   serf_bucket_t **req_bkt,
@@ -313,7 +473,8 @@ static apr_status_t setup_request(serf_request_t *request,
     hdrs_bkt = serf_bucket_request_get_headers(*req_bkt);
 
     /* FIXME: Shouldn't we be able to figure out the host ourselves? */
-    serf_bucket_headers_setn(hdrs_bkt, "Host", ctx->hostinfo);
+    serf_bucket_headers_setn(hdrs_bkt, "Host",
+                             ctx->fetcher->spider->hostinfo);
     serf_bucket_headers_setn(hdrs_bkt, "User-Agent",
                              "Serf/" SERF_VERSION_STRING);
 
@@ -352,96 +513,110 @@ static apr_status_t setup_request(serf_request_t *request,
     return APR_SUCCESS;
 }
 
-static apr_status_t create_request(const char *hostinfo,
-                                   const char *path,
-                                   const char *query,
-                                   const char *fragment,
-                                   parser_baton_t *ctx,
-                                   apr_pool_t *tmppool)
+/* Send a request for URL on the connection of its loop. */
+static void create_request(fetcher_t *fetcher, url_t *url)
 {
     handler_baton_t *new_ctx;
-
-    if (hostinfo) {
-        /* Yes, this is a pointer comparison; not a string comparison. */
-        if (hostinfo != ctx->hostinfo) {
-            /* Not on the same host; ignore */
-            return APR_SUCCESS;
-        }
+    serf_bucket_alloc_t *allocator = fetcher->app_ctx.bkt_alloc;
+
+    if (!fetcher->connection) {
+        fetcher->connection = serf_connection_create(fetcher->ctx,
+                                                     fetcher->spider->address,
+                                                     conn_setup,
+                                                     &fetcher->app_ctx,
+                                                     closed_connection,
+                                                     &fetcher->app_ctx,
+                                                     fetcher->pool);
     }
 
-    new_ctx = (handler_baton_t*)serf_bucket_mem_alloc(ctx->app_ctx->bkt_alloc,
+    new_ctx = (handler_baton_t*)serf_bucket_mem_alloc(allocator,
                                                       sizeof(handler_baton_t));
-    new_ctx->allocator = ctx->app_ctx->bkt_alloc;
-    new_ctx->requests_outstanding = ctx->requests_outstanding;
-    new_ctx->app_ctx = ctx->app_ctx;
-
-    /* See above: this example restricts ourselves to the same vhost. */
-    new_ctx->hostinfo = ctx->hostinfo;
+    new_ctx->allocator = allocator;
+    new_ctx->fetcher = fetcher;
+    new_ctx->app_ctx = &fetcher->app_ctx;
 
     /* we need to copy it so it falls under the request's scope. */
-    new_ctx->path_len = strlen(path);
-    new_ctx->path = (char*)serf_bucket_mem_alloc(ctx->app_ctx->bkt_alloc,
-                                                 new_ctx->path_len + 1);
-    memcpy(new_ctx->path, path, new_ctx->path_len + 1);
+    new_ctx->full_path_len = strlen(url->path);
+    new_ctx->full_path = (char*)serf_bucket_mem_alloc(allocator,
+                                                      new_ctx->full_path_len
+                                                      + 1);
+    memcpy(new_ctx->full_path, url->path, new_ctx->full_path_len + 1);
+    new_ctx->path_len = strcspn(new_ctx->full_path, "?");
 
-    /* we need to copy it so it falls under the request's scope. */
-    if (query) {
-        new_ctx->query_len = strlen(query);
-        new_ctx->query = (char*)serf_bucket_mem_alloc(ctx->app_ctx->bkt_alloc,
-                                                      new_ctx->query_len + 1);
-        memcpy(new_ctx->query, query, new_ctx->query_len + 1);
-    }
-    else {
-        new_ctx->query = NULL;
-        new_ctx->query_len = 0;
-    }
+    new_ctx->hdr_read = 0;
 
-    /* we need to copy it so it falls under the request's scope. */
-    if (fragment) {
-        new_ctx->fragment_len = strlen(fragment);
-        new_ctx->fragment =
-            (char*)serf_bucket_mem_alloc(ctx->app_ctx->bkt_alloc,
-                                         new_ctx->fragment_len + 1);
-        memcpy(new_ctx->fragment, fragment, new_ctx->fragment_len + 1);
-    }
-    else {
-        new_ctx->fragment = NULL;
-        new_ctx->fragment_len = 0;
-    }
+    new_ctx->acceptor = accept_response;
+    new_ctx->acceptor_baton = &fetcher->app_ctx;
+    new_ctx->handler = handle_response;
 
-    if (!new_ctx->query) {
-        new_ctx->full_path = new_ctx->path;
-        new_ctx->full_path_len = new_ctx->path_len;
-    }
-    else {
-        new_ctx->full_path_len = new_ctx->path_len + new_ctx->query_len;
-        new_ctx->full_path =
-            (char*)serf_bucket_mem_alloc(ctx->app_ctx->bkt_alloc,
-                                         new_ctx->full_path_len + 1);
-        memcpy(new_ctx->full_path, new_ctx->path, new_ctx->path_len);
-        memcpy(new_ctx->full_path + new_ctx->path_len, new_ctx->query,
-               new_ctx->query_len + 1);
+    serf_connection_request_create(fetcher->connection, setup_request,
+                                   new_ctx);
+}
+
+/* Send the requests for the backlog of FETCHER, as far as it may. */
+static void fetch_next(fetcher_t *fetcher)
+{
+    while (fetcher->backlog && fetcher->in_flight < MAX_DOCS_PER_FETCHER) {
+        url_t *url = fetcher->backlog;
+
+        fetcher->backlog = url->next;
+        if (!fetcher->backlog)
+            fetcher->backlog_tail = NULL;
+
+        fetcher->in_flight++;
+        create_request(fetcher, url);
+        free(url);
     }
+}
 
-    new_ctx->hdr_read = 0;
+/* Runs on the loop of the fetcher of BATON, a url_t. */
+static void fetch_task(serf_context_t *ctx, void *baton)
+{
+    url_t *url = baton;
+    fetcher_t *fetcher = url->fetcher;
 
-    new_ctx->doc_queue_condvar = ctx->condvar;
-    new_ctx->doc_queue = ctx->doc_queue;
-    new_ctx->doc_queue_alloc = ctx->doc_queue_alloc;
+    url->next = NULL;
+    if (fetcher->backlog_tail)
+        fetcher->backlog_tail->next = url;
+    else
+        fetcher->backlog = url;
+    fetcher->backlog_tail = url;
 
-    new_ctx->acceptor = accept_response;
-    new_ctx->acceptor_baton = &ctx->app_ctx;
-    new_ctx->handler = handle_response;
+    fetch_next(fetcher);
+}
 
-    apr_atomic_inc32(ctx->requests_outstanding);
+/* Runs on the loop of BATON, a fetcher_t, when a parser is done with one
+   of its documents. */
+static void parsed_task(serf_context_t *ctx, void *baton)
+{
+    fetch_done(baton);
+}
 
-    serf_connection_request_create(ctx->connection, setup_request, new_ctx);
+/* Hand the link to PATH to the next loop. Can be called from any thread. */
+static apr_status_t queue_url(spider_t *spider, const char *path,
+                              apr_size_t path_len)
+{
+    url_t *url;
+    apr_uint32_t i;
 
-    return APR_SUCCESS;
+    url = malloc(sizeof(*url) + path_len);
+    if (!url)
+        return APR_ENOMEM;
+
+    memcpy(url->path, path, path_len);
+    url->path[path_len] = '\0';
+
+    i = apr_atomic_inc32(&spider->next_fetcher);
+    url->fetcher = &spider->fetchers[i % spider->nfetchers];
+
+    apr_atomic_inc32(&spider->pending);
+
+    return serf_context_group_post(spider->group, url->fetcher->ctx,
+                                   fetch_task, url);
 }
 
 static apr_status_t put_req(const char *c, const char *orig_path,
-                            parser_baton_t *ctx, apr_pool_t *pool)
+                            spider_t *spider, apr_pool_t *pool)
 {
     apr_status_t status;
     apr_uri_t url;
@@ -455,15 +630,20 @@ static apr_status_t put_req(const char *c, const char *orig_path,
 
     /* We got something that was minimally useful. */
     if (status == 0 && url.path) {
-        const char *path, *query, *fragment;
+        const char *path;
+        struct iovec vec[3];
+        apr_size_t nbytes;
+
+        if (url.hostinfo && strcasecmp(url.hostinfo, spider->hostinfo) != 0) {
+            /* Not on the same host; ignore */
+            return APR_SUCCESS;
+        }
 
         /* This is likely a relative URL. So, merge and hope for the
          * best.
          */
         if (!url.hostinfo && url.path[0] != '/') {
-            struct iovec vec[2];
             char *c;
-            apr_size_t nbytes;
 
             c = strrchr(orig_path, '/');
 
@@ -498,17 +678,23 @@ static apr_status_t put_req(const char *c, const char *orig_path,
             path = url.path;
         }
 
-        query = url.query;
-        fragment = url.fragment;
+        /* The fragment isn't sent to the server. */
+        vec[0].iov_base = (char*)path;
+        vec[0].iov_len = strlen(path);
+        vec[1].iov_base = "?";
+        vec[1].iov_len = url.query ? 1 : 0;
+        vec[2].iov_base = url.query;
+        vec[2].iov_len = url.query ? strlen(url.query) : 0;
+        path = apr_pstrcatv(pool, vec, 3, &nbytes);
 
-        return create_request(url.hostinfo, path, query, fragment, ctx, pool);
+        return queue_url(spider, path, nbytes);
     }
 
     return APR_SUCCESS;
 }
 
 static apr_status_t find_href(apr_xml_elem *e, const char *orig_path,
-                              parser_baton_t *ctx, apr_pool_t *pool)
+                              spider_t *spider, apr_pool_t *pool)
 {
     apr_status_t status;
 
@@ -525,7 +711,7 @@ static apr_status_t find_href(apr_xml_elem *e, const char *orig_path,
                 a = a->next;
             }
             if (a) {
-                status = put_req(a->value, orig_path, ctx, pool);
+                status = put_req(a->value, orig_path, spider, pool);
                 if (status) {
                     return status;
                 }
@@ -533,7 +719,7 @@ static apr_status_t find_href(apr_xml_elem *e, const char *orig_path,
         }
 
         if (e->first_child) {
-            status = find_href(e->first_child, orig_path, ctx, pool);
+            status = find_href(e->first_child, orig_path, spider, pool);
             if (status) {
                 return status;
             }
@@ -547,95 +733,109 @@ static apr_status_t find_href(apr_xml_elem *e, const char *orig_path,
 }
 
 static apr_status_t find_href_doc(apr_xml_doc *doc, const char *path,
-                                  parser_baton_t *ctx,
+                                  spider_t *spider,
                                   apr_pool_t *pool)
 {
-    return find_href(doc->root, path, ctx, pool);
+    return find_href(doc->root, path, spider, pool);
 }
 
 static void * APR_THREAD_FUNC parser_thread(apr_thread_t *thread, void *data)
 {
     apr_status_t status;
     apr_pool_t *pool, *subpool;
-    parser_baton_t *ctx;
+    spider_t *spider = data;
+    int idle = 0;
 
-    ctx = (parser_baton_t*)data;
     pool = apr_thread_pool_get(thread);
 
     apr_pool_create(&subpool, pool);
 
-    while (1) {
+    /* Hey are we done? */
+    while (apr_atomic_read32(&spider->pending)) {
         doc_path_t *dup;
+        fetcher_t *fetcher;
+
+        dup = queue_pop(spider->docs);
+        if (!dup) {
+            /* There's nothing to block on, so back off, to leave the cores
+               to the loops when there's nothing to parse. */
+            if (++idle < PARSER_SPIN_COUNT)
+                apr_thread_yield();
+            else
+                apr_sleep(PARSER_SLEEP);
+            continue;
+        }
+        idle = 0;
 
         apr_pool_clear(subpool);
 
-        /* Grab it. */
-        apr_thread_mutex_lock(ctx->mutex);
-        /* Sleep. */
-        apr_thread_cond_wait(ctx->condvar, ctx->mutex);
-
-        /* Fetch the doc off the list. */
-        if (ctx->doc_queue->nelts) {
-            dup = *(doc_path_t**)(apr_array_pop(ctx->doc_queue));
-            /* dup = (ctx->doc_queue->conns->elts)[0]; */
-        }
-        else {
-            dup = NULL;
+        /* Parse the doc/url pair. The links are queued before the
+           document is done, so PENDING can't drop to 0 in between. */
+        status = find_href_doc(dup->doc, dup->path, spider, subpool);
+        if (status) {
+            printf("Error finding hrefs: %d %s\n", status, dup->path);
         }
 
-        /* Don't need the mutex now. */
-        apr_thread_mutex_unlock(ctx->mutex);
+        /* Free the doc pair and its pool. */
+        fetcher = dup->fetcher;
+        apr_pool_destroy(dup->pool);
 
-        /* Parse the doc/url pair. */
-        if (dup) {
-            status = find_href_doc(dup->doc, dup->path, ctx, subpool);
-            if (status) {
-                printf("Error finding hrefs: %d %s\n", status, dup->path);
-            }
-            /* Free the doc pair and its pool. */
-            apr_pool_destroy(dup->pool);
-            serf_bucket_mem_free(ctx->doc_queue_alloc, dup->path);
-            serf_bucket_mem_free(ctx->doc_queue_alloc, dup);
-        }
-
-        /* Hey are we done? */
-        if (!apr_atomic_read32(ctx->requests_outstanding)) {
-            break;
-        }
+        serf_context_group_post(spider->group, fetcher->ctx, parsed_task,
+                                fetcher);
     }
+
+    apr_pool_destroy(subpool);
+
     return NULL;
 }
 
+/* The number of online cores, or 1 if we can't tell. */
+static int num_cores(void)
+{
+#if defined(WIN32)
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
 static void print_usage(apr_pool_t *pool)
 {
-    puts("serf_get [options] URL");
+    puts("serf_spider [options] URL");
     puts("-h\tDisplay this help");
     puts("-v\tDisplay version");
-    puts("-H\tPrint response headers");
     puts("-a <user:password> Present Basic authentication credentials");
+    puts("-c <count> Fetch with <count> contexts, each on its own thread"
+         " (default 2)");
+    puts("-p <count> Parse with <count> threads (default: one per core that"
+         " isn't fetching)");
 }
 
 int main(int argc, const char **argv)
 {
     apr_status_t status;
     apr_pool_t *pool;
-    apr_sockaddr_t *address;
-    serf_context_t *context;
-    serf_connection_t *connection;
-    app_baton_t app_ctx;
-    handler_baton_t *handler_ctx;
+    spider_t spider;
     apr_uri_t url;
     const char *raw_url;
     apr_getopt_t *opt;
     char opt_c;
     char *authn = NULL;
     const char *opt_arg;
+    int nfetchers = 2, nparsers = 0;
+    int i;
 
     /* For the parser threads */
-    apr_thread_t *thread[3];
+    apr_thread_t **thread;
     apr_threadattr_t *tattr;
     apr_status_t parser_status;
-    parser_baton_t *parser_ctx;
 
     apr_initialize();
     atexit(apr_terminate);
@@ -646,7 +846,7 @@ int main(int argc, const char **argv)
 
     apr_getopt_init(&opt, pool, argc, argv);
 
-    while ((status = apr_getopt(opt, "a:hv", &opt_c, &opt_arg)) ==
+    while ((status = apr_getopt(opt, "a:hvc:p:", &opt_c, &opt_arg)) ==
            APR_SUCCESS) {
         int srclen, enclen;
 
@@ -658,6 +858,12 @@ int main(int argc, const char **argv)
             strcpy(authn, "Basic ");
             (void) apr_base64_encode(&authn[6], opt_arg, srclen);
             break;
+        case 'c':
+            nfetchers = atoi(opt_arg);
+            break;
+        case 'p':
+            nparsers = atoi(opt_arg);
+            break;
         case 'h':
             print_usage(pool);
             exit(0);
@@ -670,11 +876,19 @@ int main(int argc, const char **argv)
         }
     }
 
-    if (opt->ind != opt->argc - 1) {
+    if (opt->ind != opt->argc - 1 || nfetchers < 1 || nparsers < 0) {
         print_usage(pool);
         exit(-1);
     }
 
+    /* The loops are mostly waiting for the network, so don't go below one
+       parser per core. */
+    if (!nparsers) {
+        nparsers = num_cores() - nfetchers;
+        if (nparsers < 1)
+            nparsers = 1;
+    }
+
     raw_url = argv[opt->ind];
 
     apr_uri_parse(pool, raw_url, &url);
@@ -685,14 +899,16 @@ int main(int argc, const char **argv)
         url.path = "/";
     }
 
+    memset(&spider, 0, sizeof(spider));
+
     if (strcasecmp(url.scheme, "https") == 0) {
-        app_ctx.using_ssl = 1;
+        spider.using_ssl = 1;
     }
     else {
-        app_ctx.using_ssl = 0;
+        spider.using_ssl = 0;
     }
 
-    status = apr_sockaddr_info_get(&address,
+    status = apr_sockaddr_info_get(&spider.address,
                                    url.hostname, APR_UNSPEC, url.port, 0,
                                    pool);
     if (status) {
@@ -700,118 +916,103 @@ int main(int argc, const char **argv)
         exit(1);
     }
 
-    context = serf_context_create(pool);
-
-    /* ### Connection or Context should have an allocator? */
-    app_ctx.bkt_alloc = serf_bucket_allocator_create(pool, NULL, NULL);
-    app_ctx.ssl_ctx = NULL;
-    app_ctx.authn = authn;
-
-    connection = serf_connection_create(context, address,
-                                        conn_setup, &app_ctx,
-                                        closed_connection, &app_ctx,
-                                        pool);
-
-    handler_ctx = (handler_baton_t*)serf_bucket_mem_alloc(app_ctx.bkt_alloc,
-                                                      sizeof(handler_baton_t));
-    handler_ctx->allocator = app_ctx.bkt_alloc;
-    handler_ctx->doc_queue = apr_array_make(pool, 1, sizeof(doc_path_t*));
-    handler_ctx->doc_queue_alloc = app_ctx.bkt_alloc;
-
-    handler_ctx->requests_outstanding =
-        (apr_uint32_t*)serf_bucket_mem_alloc(app_ctx.bkt_alloc,
-                                             sizeof(apr_uint32_t));
-    apr_atomic_set32(handler_ctx->requests_outstanding, 0);
-    handler_ctx->hdr_read = 0;
-
-    parser_ctx = (void*)serf_bucket_mem_alloc(app_ctx.bkt_alloc,
-                                       sizeof(parser_baton_t));
-
-    parser_ctx->requests_outstanding = handler_ctx->requests_outstanding;
-    parser_ctx->connection = connection;
-    parser_ctx->app_ctx = &app_ctx;
-    parser_ctx->doc_queue = handler_ctx->doc_queue;
-    parser_ctx->doc_queue_alloc = handler_ctx->doc_queue_alloc;
-    /* Restrict ourselves to this host. */
-    parser_ctx->hostinfo = url.hostinfo;
-
-    status = apr_thread_mutex_create(&parser_ctx->mutex,
-                                     APR_THREAD_MUTEX_DEFAULT, pool);
+    status = serf_context_group_create(&spider.group, nfetchers, pool);
     if (status) {
-        printf("Couldn't create mutex %d\n", status);
-        return status;
+        printf("Error creating context group: %d\n", status);
+        exit(1);
     }
 
-    status = apr_thread_cond_create(&parser_ctx->condvar, pool);
-    if (status) {
-        printf("Couldn't create condvar: %d\n", status);
-        return status;
+    /* Restrict ourselves to this host. */
+    spider.hostinfo = url.hostinfo;
+    spider.authn = authn;
+    spider.fetchers = apr_pcalloc(pool, nfetchers * sizeof(fetcher_t));
+
+    /* The group pins the connections to a host to one loop. We want a
+       connection on each loop, so look for a key for every context. */
+    for (i = 0; spider.nfetchers < nfetchers && i < nfetchers * 64; i++) {
+        serf_context_t *ctx;
+        const char *key;
+        int j;
+
+        key = apr_psprintf(pool, "%s#%d", url.hostinfo, i);
+        ctx = serf_context_group_get(spider.group, key);
+        for (j = 0; j < spider.nfetchers; j++) {
+            if (spider.fetchers[j].ctx == ctx)
+                break;
+        }
+        if (j == spider.nfetchers)
+            spider.fetchers[spider.nfetchers++].ctx = ctx;
     }
 
-    /* Let the handler now which condvar to use. */
-    handler_ctx->doc_queue_condvar = parser_ctx->condvar;
+    for (i = 0; i < spider.nfetchers; i++) {
+        fetcher_t *fetcher = &spider.fetchers[i];
 
-    apr_threadattr_create(&tattr, pool);
+        /* Used on the loop only, so not a subpool of POOL. */
+        apr_pool_create(&fetcher->pool, NULL);
+
+        fetcher->spider = &spider;
+        fetcher->app_ctx.bkt_alloc =
+            serf_bucket_allocator_create(fetcher->pool, NULL, NULL);
+        fetcher->app_ctx.ssl_ctx = NULL;
+        fetcher->app_ctx.authn = authn;
+        fetcher->app_ctx.using_ssl = spider.using_ssl;
+    }
 
-    /* Start the parser thread. */
-    apr_thread_create(&thread[0], tattr, parser_thread, parser_ctx, pool);
+    /* Room for every document the loops may have in flight. */
+    spider.docs = queue_create(spider.nfetchers * MAX_DOCS_PER_FETCHER, pool);
+
+    apr_atomic_set32(&spider.pending, 0);
+    apr_atomic_set32(&spider.next_fetcher, 0);
 
     /* Deliver the first request. */
-    create_request(url.hostinfo, url.path, NULL, NULL, parser_ctx, pool);
+    status = queue_url(&spider, url.path, strlen(url.path));
+    if (!status)
+        status = serf_context_group_start(spider.group);
+    if (status) {
+        printf("Error starting the loops: %d\n", status);
+        exit(1);
+    }
 
-    /* Go run our normal thread. */
-    while (1) {
-        int tries = 0;
+    apr_threadattr_create(&tattr, pool);
 
-        status = serf_context_run(context, SERF_DURATION_FOREVER, pool);
-        if (APR_STATUS_IS_TIMEUP(status))
-            continue;
+    /* Start the parser threads. */
+    thread = apr_palloc(pool, nparsers * sizeof(*thread));
+    for (i = 0; i < nparsers; i++) {
+        status = apr_thread_create(&thread[i], tattr, parser_thread, &spider,
+                                   pool);
         if (status) {
-            char buf[200];
-
-            printf("Error running context: (%d) %s\n", status,
-                   apr_strerror(status, buf, sizeof(buf)));
-            exit(1);
+            printf("Error creating thread: %d\n", status);
+            return status;
         }
+    }
 
-        /* We run this check to allow our parser threads to add more
-         * requests to our queue.
-         */
-        for (tries = 0; tries < 3; tries++) {
-            if (!apr_atomic_read32(handler_ctx->requests_outstanding)) {
-#ifdef SERF_VERBOSE
-                printf("Waiting...");
-#endif
-                apr_sleep(100000);
-#ifdef SERF_VERBOSE
-                printf("Done\n");
-#endif
-            }
-            else {
-                break;
-            }
-        }
-        if (tries >= 3) {
-            break;
+    /* The parsers return when everything was fetched and parsed. */
+    for (i = 0; i < nparsers; i++) {
+        status = apr_thread_join(&parser_status, thread[i]);
+        if (status) {
+            printf("Error joining thread: %d\n", status);
+            return status;
         }
-        /* Debugging purposes only! */
-        serf_debug__closed_conn(app_ctx.bkt_alloc);
     }
 
     printf("Quitting...\n");
-    serf_connection_close(connection);
-
-    /* wake up the parser via condvar signal */
-    apr_thread_cond_signal(parser_ctx->condvar);
-
-    status = apr_thread_join(&parser_status, thread[0]);
+    status = serf_context_group_stop(spider.group);
     if (status) {
-        printf("Error joining thread: %d\n", status);
-        return status;
+        char buf[200];
+
+        printf("Error running context: (%d) %s\n", status,
+               apr_strerror(status, buf, sizeof(buf)));
+        exit(1);
     }
 
-    serf_bucket_mem_free(app_ctx.bkt_alloc, handler_ctx->requests_outstanding);
-    serf_bucket_mem_free(app_ctx.bkt_alloc, parser_ctx);
+    /* The loops are stopped, so we may use their connections. */
+    for (i = 0; i < spider.nfetchers; i++) {
+        fetcher_t *fetcher = &spider.fetchers[i];
+
+        if (fetcher->connection)
+            serf_connection_close(fetcher->connection);
+        apr_pool_destroy(fetcher->pool);
+    }
 
     apr_pool_destroy(pool);
     return 0;
@@ -0,0 +1,262 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Prints the trace files written by serf_context_trace_to_file(). See
+   trace.c for the format. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_strings.h>
+#include <apr_getopt.h>
+#include <apr_time.h>
+
+#include "serf.h"
+
+#define TRACE_MAGIC "SERFTRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 40
+#define TRACE_RECORD_SIZE 24
+
+static apr_uint32_t get_uint32(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16)
+           | ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
+static apr_uint64_t get_uint64(const unsigned char *p)
+{
+    return ((apr_uint64_t)get_uint32(p) << 32) | get_uint32(p + 4);
+}
+
+static const char *type_name(apr_uint32_t type)
+{
+    switch (type) {
+        case SERF_TRACE_OPEN:
+            return "OPEN ";
+        case SERF_TRACE_SEND:
+            return "SEND ";
+        case SERF_TRACE_RECV:
+            return "RECV ";
+        case SERF_TRACE_CLOSE:
+            return "CLOSE";
+        default:
+            return "?    ";
+    }
+}
+
+/* Print DATA as text, with the unprintable characters escaped. */
+static void print_escaped(const unsigned char *data, apr_size_t len)
+{
+    apr_size_t i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = data[i];
+
+        if (c == '\n')
+            fputs("\\n\n", stdout);
+        else if (c == '\r')
+            fputs("\\r", stdout);
+        else if (c == '\\')
+            fputs("\\\\", stdout);
+        else if (c >= ' ' && c < 0x7f)
+            putchar(c);
+        else
+            printf("\\x%02x", c);
+    }
+    if (len && data[len - 1] != '\n')
+        putchar('\n');
+}
+
+/* Print DATA as a hex dump, 16 bytes per line. */
+static void print_hex(const unsigned char *data, apr_size_t len)
+{
+    apr_size_t i, j;
+
+    for (i = 0; i < len; i += 16) {
+        printf("  %06" APR_SIZE_T_FMT " ", i);
+        for (j = i; j < i + 16; j++) {
+            if (j < len)
+                printf(" %02x", data[j]);
+            else
+                fputs("   ", stdout);
+        }
+        fputs("  ", stdout);
+        for (j = i; j < i + 16 && j < len; j++)
+            putchar(data[j] >= ' ' && data[j] < 0x7f ? data[j] : '.');
+        putchar('\n');
+    }
+}
+
+static const apr_getopt_option_t options[] =
+{
+    {"help",    'h', 0, "Display this help"},
+    {NULL,      'c', 1, "<id> Only show the records of connection <id>"},
+    {NULL,      'q', 0, "Don't show the payload"},
+    {NULL,      'x', 0, "Show the payload as a hex dump"},
+};
+
+static void print_usage(void)
+{
+    int i;
+
+    puts("serf_trace [options] FILE\n");
+    puts("Options:");
+
+    for (i = 0; i < sizeof(options) / sizeof(apr_getopt_option_t); i++) {
+        const apr_getopt_option_t* o = &options[i];
+
+        printf(" -%c", o->optch);
+        if (o->name)
+            printf(", ");
+
+        printf("%s%s\t%s\n",
+               o->name ? "--" : "\t",
+               o->name ? o->name : "",
+               o->description);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    int opt_c;
+    const char *opt_arg;
+    apr_int64_t conn_filter = -1;
+    int quiet = 0, hex = 0;
+    FILE *fp;
+    unsigned char header[TRACE_HEADER_SIZE];
+    unsigned char record[TRACE_RECORD_SIZE];
+    apr_uint64_t end, pos, dropped;
+    apr_time_t start;
+    char start_str[APR_RFC822_DATE_LEN];
+    apr_size_t count = 0;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    apr_pool_create(&pool, NULL);
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, options, &opt_c, &opt_arg)) ==
+           APR_SUCCESS) {
+
+        switch (opt_c) {
+        case 'h':
+            print_usage();
+            exit(0);
+        case 'c':
+            conn_filter = apr_atoi64(opt_arg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'x':
+            hex = 1;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (opt->ind != opt->argc - 1) {
+        print_usage();
+        exit(-1);
+    }
+
+    fp = fopen(argv[opt->ind], "rb");
+    if (!fp) {
+        printf("Cannot open %s\n", argv[opt->ind]);
+        exit(1);
+    }
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header)
+        || memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        printf("%s is not a serf trace file\n", argv[opt->ind]);
+        exit(1);
+    }
+
+    if (get_uint32(header + 8) != TRACE_VERSION) {
+        printf("Unsupported trace file version %u\n",
+               (unsigned)get_uint32(header + 8));
+        exit(1);
+    }
+
+    start = (apr_time_t)get_uint64(header + 16);
+    end = get_uint64(header + 24);
+    dropped = get_uint64(header + 32);
+
+    apr_rfc822_date(start_str, start);
+    printf("Trace started %s, payload sampled up to %u bytes\n",
+           start_str, (unsigned)get_uint32(header + 12));
+
+    /* Don't trust END beyond what the file really holds, the trace may not
+       have been stopped cleanly. */
+    pos = TRACE_HEADER_SIZE;
+    while (pos + TRACE_RECORD_SIZE <= end
+           && fread(record, 1, TRACE_RECORD_SIZE, fp) == TRACE_RECORD_SIZE) {
+        apr_uint64_t time = get_uint64(record);
+        apr_uint32_t conn_id = get_uint32(record + 8);
+        apr_uint32_t type = get_uint32(record + 12);
+        apr_uint32_t len = get_uint32(record + 16);
+        apr_uint32_t captured = get_uint32(record + 20);
+        unsigned char *payload = NULL;
+
+        if (captured) {
+            payload = malloc(captured);
+            if (!payload || fread(payload, 1, captured, fp) != captured) {
+                printf("Truncated record at offset %" APR_UINT64_T_FMT "\n",
+                       pos);
+                free(payload);
+                break;
+            }
+        }
+        pos += TRACE_RECORD_SIZE + captured;
+        count++;
+
+        if (conn_filter >= 0 && conn_id != conn_filter) {
+            free(payload);
+            continue;
+        }
+
+        printf("%4" APR_UINT64_T_FMT ".%06" APR_UINT64_T_FMT
+               " conn %u %s %u bytes",
+               time / APR_USEC_PER_SEC, time % APR_USEC_PER_SEC,
+               (unsigned)conn_id, type_name(type), (unsigned)len);
+        if (captured < len)
+            printf(" (%u shown)", (unsigned)captured);
+        putchar('\n');
+
+        if (!quiet && captured) {
+            if (hex)
+                print_hex(payload, captured);
+            else
+                print_escaped(payload, captured);
+        }
+        free(payload);
+    }
+
+    printf("%" APR_SIZE_T_FMT " records, %" APR_UINT64_T_FMT
+           " dropped because the trace file was full\n", count, dropped);
+
+    fclose(fp);
+    apr_pool_destroy(pool);
+
+    return 0;
+}
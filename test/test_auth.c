@@ -437,6 +437,28 @@ static void authentication_switch_realms(CuTest *tc,
       CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
     EndVerify
     CuAssertTrue(tc, tb->result_flags & TEST_RESULT_AUTHNCB_CALLED);
+
+    /* Test that the credentials of both realms were cached, and are sent
+       preemptively for the paths each realm protects. */
+    tb->result_flags = 0;
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("4"),
+                 HeaderEqualTo("Authorization", exp_authz_test_suite))
+        Respond(WithCode(200), WithChunkedBody(""))
+      GETRequest(URLEqualTo("/newrealm/index.html"), ChunkedBodyEqualTo("5"),
+                 HeaderEqualTo("Authorization", exp_authz_new_realm))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 4);
+    create_new_request(tb, &handler_ctx[1], "GET", "/newrealm/index.html", 5);
+    status = run_client_and_mock_servers_loops(tb, 2, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    Verify(tb->mh)
+      CuAssertTrue(tc, VerifyAllRequestsReceivedInOrder);
+    EndVerify
+    CuAssertTrue(tc, !(tb->result_flags & TEST_RESULT_AUTHNCB_CALLED));
 }
 
 static void test_basic_switch_realms(CuTest *tc)
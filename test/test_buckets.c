@@ -20,6 +20,12 @@
 #include <apr_strings.h>
 #include <apr_random.h>
 #include <zlib.h>
+#ifdef SERF_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef SERF_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "serf.h"
 #include "test_serf.h"
@@ -228,6 +234,14 @@ static void test_simple_bucket_readline(CuTest *tc)
            "12345678901234567890" CRLF;
     bkt = SERF_BUCKET_SIMPLE_STRING(body, alloc);
     readlines_and_check_bucket(tc, bkt, SERF_NEWLINE_LF, body, 3);
+
+    /* Mixed line endings; a CR after the LF must not end the first line. */
+    body = "line1" LF "line2" CRLF "line3" CR "line4" LF;
+    bkt = SERF_BUCKET_SIMPLE_STRING(body, alloc);
+    readlines_and_check_bucket(tc, bkt, SERF_NEWLINE_ANY, body, 4);
+    bkt = SERF_BUCKET_SIMPLE_STRING(body, alloc);
+    readlines_and_check_bucket(tc, bkt, SERF_NEWLINE_CRLF | SERF_NEWLINE_LF,
+                               body, 3);
 }
 
 static void test_response_bucket_read(CuTest *tc)
@@ -288,6 +302,61 @@ static void test_response_bucket_headers(CuTest *tc)
         serf_bucket_headers_get(hdr, "NoSpace"));
 }
 
+/* Test that headers parsed in place, when the header block arrives at
+   once, are the same as those parsed line by line. */
+static void test_response_bucket_headers_in_place(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    const char *head = "HTTP/1.1 200 OK" CRLF;
+    const char *headers = "Content-Length: 3" CRLF
+                          "X-Repeated: 1" CRLF
+                          "X-LF-Only:\tvalue\n"
+                          "x-repeated: 2" CRLF
+                          CRLF;
+    mockbkt_action split_actions[]= {
+        { 1, NULL, APR_SUCCESS },
+        { 1, "Content-Length: 3" CRLF "X-Rep", APR_SUCCESS },
+        { 1, "", APR_EAGAIN },
+        { 1, "eated: 1" CRLF "X-LF-Only:\tvalue\n" "x-repeated: 2" CRLF
+             CRLF "abc", APR_EOF },
+    };
+    serf_bucket_t *bkt, *hdrs;
+    apr_status_t status;
+    int i;
+
+    split_actions[0].data = head;
+
+    for (i = 0; i < 2; i++) {
+        if (i == 0)
+            bkt = serf_bucket_simple_create(apr_pstrcat(tb->pool, head,
+                                                        headers, "abc",
+                                                        NULL),
+                                            strlen(head) + strlen(headers) + 3,
+                                            NULL, NULL, alloc);
+        else
+            bkt = serf_bucket_mock_create(split_actions, 4, alloc);
+
+        bkt = serf_bucket_response_create(bkt, alloc);
+        do {
+            status = serf_bucket_response_wait_for_headers(bkt);
+        } while (APR_STATUS_IS_EAGAIN(status));
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        hdrs = serf_bucket_response_get_headers(bkt);
+        CuAssertStrEquals(tc, "3",
+                          serf_bucket_headers_get(hdrs, "Content-Length"));
+        CuAssertStrEquals(tc, "value",
+                          serf_bucket_headers_get(hdrs, "X-LF-Only"));
+        CuAssertStrEquals(tc, "1,2",
+                          serf_bucket_headers_get(hdrs, "X-Repeated"));
+
+        read_and_check_bucket(tc, bkt, "abc");
+        serf_bucket_destroy(bkt);
+    }
+}
+
 static void test_response_bucket_chunked_read(CuTest *tc)
 {
     test_baton_t *tb = tc->testBaton;
@@ -578,6 +647,62 @@ static void test_header_buckets(CuTest *tc)
     read_and_check_bucket(tc, hdrs, cur);
 }
 
+/* Small header blocks are returned in one iovec, and their length is known
+   up front. */
+static void test_header_buckets_iovec(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    struct iovec vecs[16];
+    int vecs_used;
+    const char *cur;
+    char *big;
+    apr_status_t status;
+
+    serf_bucket_t *hdrs = serf_bucket_headers_create(alloc);
+
+    serf_bucket_headers_set(hdrs, "Content-Type", "text/plain");
+    serf_bucket_headers_set(hdrs, "Content-Length", "100");
+    cur = "Content-Type: text/plain" CRLF
+          "Content-Length: 100" CRLF
+          CRLF;
+
+    CuAssertTrue(tc, serf_bucket_get_remaining(hdrs) == strlen(cur));
+
+    status = serf_bucket_read_iovec(hdrs, SERF_READ_ALL_AVAIL, 16, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 1, vecs_used);
+    CuAssertIntEquals(tc, strlen(cur), vecs[0].iov_len);
+    CuAssertStrnEquals(tc, cur, strlen(cur), vecs[0].iov_base);
+    CuAssertTrue(tc, serf_bucket_get_remaining(hdrs) == 0);
+    serf_bucket_destroy(hdrs);
+
+    /* Reading in parts keeps the remaining length accurate. */
+    hdrs = serf_bucket_headers_create(alloc);
+    serf_bucket_headers_set(hdrs, "Content-Type", "text/plain");
+    serf_bucket_headers_set(hdrs, "Content-Length", "100");
+    status = serf_bucket_read_iovec(hdrs, 5, 16, vecs, &vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, serf_bucket_get_remaining(hdrs) == strlen(cur) - 5);
+    read_and_check_bucket(tc, hdrs, cur + 5);
+    serf_bucket_destroy(hdrs);
+
+    /* Too big to be copied, returned as separate iovecs. */
+    big = apr_palloc(tb->pool, 5001);
+    memset(big, 'x', 5000);
+    big[5000] = '\0';
+    hdrs = serf_bucket_headers_create(alloc);
+    serf_bucket_headers_set(hdrs, "Cookie", big);
+    CuAssertTrue(tc, serf_bucket_get_remaining(hdrs) == 5000 + 12);
+    status = serf_bucket_read_iovec(hdrs, SERF_READ_ALL_AVAIL, 16, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 5, vecs_used);
+    serf_bucket_destroy(hdrs);
+}
+
 static void test_aggregate_buckets(CuTest *tc)
 {
     test_baton_t *tb = tc->testBaton;
@@ -705,6 +830,106 @@ static void test_aggregate_bucket_readline(CuTest *tc)
     readlines_and_check_bucket(tc, aggbkt, SERF_NEWLINE_CRLF, BODY, 3);
 }
 
+/* Test that buckets in different allocators can share one buffer, which
+   is freed when the last reference goes away. */
+static void test_shared_buckets(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt1, *bkt2;
+    serf_shared_buffer_t *buffer;
+    serf_bucket_alloc_t *alloc1, *alloc2;
+    const char *BODY = "12345678901234567890";
+    const char *data1, *data2;
+    apr_size_t len;
+
+    alloc1 = serf_bucket_allocator_create(tb->pool, NULL, NULL);
+    alloc2 = serf_bucket_allocator_create(tb->pool, NULL, NULL);
+
+    buffer = serf_shared_buffer_create(BODY, strlen(BODY));
+    CuAssertPtrNotNull(tc, buffer);
+
+    bkt1 = serf_bucket_shared_create(buffer, alloc1);
+    bkt2 = serf_bucket_shared_create(buffer, alloc2);
+
+    /* The creator's reference is no longer needed. */
+    serf_shared_buffer_release(buffer);
+
+    CuAssertTrue(tc, SERF_BUCKET_IS_SIMPLE(bkt1));
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt2) == strlen(BODY));
+
+    /* Both buckets return the same memory, not a copy. */
+    serf_bucket_peek(bkt1, &data1, &len);
+    serf_bucket_peek(bkt2, &data2, &len);
+    CuAssertPtrEquals(tc, (void *)data1, (void *)data2);
+
+    read_and_check_bucket(tc, bkt1, BODY);
+    serf_bucket_destroy(bkt1);
+
+    /* The buffer must still be alive for the second bucket. */
+    read_and_check_bucket(tc, bkt2, BODY);
+    serf_bucket_destroy(bkt2);
+}
+
+/* Test an aggregate bucket holding more children than its initial list
+   size, mixing appends and prepends so the list wraps around. */
+static void test_aggregate_bucket_many_children(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt, *aggbkt;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    const char *BODY = "abcdefghijklmnopqrstuvwxyz0123456789";
+    struct iovec vecs[64];
+    int vecs_used;
+    apr_status_t status;
+    int i;
+
+    aggbkt = serf_bucket_aggregate_create(alloc);
+
+    /* Append the second half one char at a time, then prepend the first
+       half in reverse. */
+    for (i = 18; i < 36; i++) {
+        bkt = SERF_BUCKET_SIMPLE_STRING_LEN(BODY + i, 1, alloc);
+        serf_bucket_aggregate_append(aggbkt, bkt);
+    }
+    for (i = 17; i >= 0; i--) {
+        bkt = SERF_BUCKET_SIMPLE_STRING_LEN(BODY + i, 1, alloc);
+        serf_bucket_aggregate_prepend(aggbkt, bkt);
+    }
+
+    CuAssertTrue(tc, serf_bucket_get_remaining(aggbkt) == 36);
+
+    /* Read a few vecs, then add some more buckets at both ends. */
+    status = serf_bucket_read_iovec(aggbkt, SERF_READ_ALL_AVAIL, 4, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 4, vecs_used);
+    CuAssertTrue(tc, strncmp(vecs[0].iov_base, "a", 1) == 0);
+    CuAssertTrue(tc, strncmp(vecs[3].iov_base, "d", 1) == 0);
+
+    bkt = SERF_BUCKET_SIMPLE_STRING("abcd", alloc);
+    serf_bucket_aggregate_prepend(aggbkt, bkt);
+    bkt = SERF_BUCKET_SIMPLE_STRING("!", alloc);
+    serf_bucket_aggregate_append(aggbkt, bkt);
+
+    /* All small children are returned in one pass. */
+    status = serf_bucket_read_iovec(aggbkt, SERF_READ_ALL_AVAIL, 64, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 34, vecs_used);
+
+    serf_bucket_destroy(aggbkt);
+
+    /* And the same through the plain read interface. */
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    for (i = 0; i < 36; i++) {
+        bkt = SERF_BUCKET_SIMPLE_STRING_LEN(BODY + i, 1, alloc);
+        serf_bucket_aggregate_append(aggbkt, bkt);
+    }
+    read_and_check_bucket(tc, aggbkt, BODY);
+    serf_bucket_destroy(aggbkt);
+}
+
 /* Test for issue: the server aborts the connection in the middle of
    streaming the body of the response, where the length was set with the
    Content-Length header. Test that we get a decent error code from the
@@ -1342,6 +1567,98 @@ static void test_dechunk_buckets(CuTest *tc)
     CuAssert(tc, "Read less data than expected.", strlen(expected) == 0);
 }
 
+/* Test that read_iovec hands out the data of all buffered chunks at once,
+   and copes with the framing split anywhere. */
+static void test_dechunk_read_iovec(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *mock_bkt, *bkt;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    const mockbkt_action split_actions[]= {
+        { 1, "6" CRLF "blabla" CRLF "6" CRLF "bla", APR_SUCCESS },
+        { 1, "bla" CR, APR_EAGAIN },
+        { 1, LF "1", APR_SUCCESS },
+        { 1, "", APR_EAGAIN },
+        { 1, "2" CR, APR_SUCCESS },
+        { 1, LF "blablablablablabla" CRLF "6" CRLF "blabla" CRLF
+             "0" CRLF CRLF, APR_SUCCESS },
+    };
+    mockbkt_action actions[sizeof(split_actions) / sizeof(mockbkt_action)];
+    const char *expected_all = "blablablablablablablablablablablabla";
+    struct iovec vecs[16];
+    int vecs_used;
+    int vecs_size;
+    apr_status_t status;
+
+    bkt = SERF_BUCKET_SIMPLE_STRING("5" CRLF "hello" CRLF
+                                    "6" CRLF " world" CRLF
+                                    "0" CRLF CRLF, alloc);
+    bkt = serf_bucket_dechunk_create(bkt, alloc);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == SERF_LENGTH_UNKNOWN);
+
+    status = serf_bucket_read_iovec(bkt, SERF_READ_ALL_AVAIL, 16, vecs,
+                                    &vecs_used);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 2, vecs_used);
+    CuAssertStrnEquals(tc, "hello", vecs[0].iov_len, vecs[0].iov_base);
+    CuAssertStrnEquals(tc, " world", vecs[1].iov_len, vecs[1].iov_base);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 0);
+    serf_bucket_destroy(bkt);
+
+    for (vecs_size = 1; vecs_size <= 16; vecs_size *= 4) {
+        const char *expected = expected_all;
+
+        memcpy(actions, split_actions, sizeof(actions));
+        mock_bkt = serf_bucket_mock_create(actions,
+                                           sizeof(actions) / sizeof(actions[0]),
+                                           alloc);
+        bkt = serf_bucket_dechunk_create(mock_bkt, alloc);
+
+        do {
+            int i;
+
+            status = serf_bucket_read_iovec(bkt, 10, vecs_size, vecs,
+                                            &vecs_used);
+            CuAssert(tc, "Got error during bucket reading.",
+                     !SERF_BUCKET_READ_ERROR(status));
+            CuAssertTrue(tc, vecs_used <= vecs_size);
+
+            for (i = 0; i < vecs_used; i++) {
+                CuAssert(tc, "Read more data than expected.",
+                         strlen(expected) >= vecs[i].iov_len);
+                CuAssert(tc, "Read data is not equal to expected.",
+                         strncmp(expected, vecs[i].iov_base,
+                                 vecs[i].iov_len) == 0);
+                expected += vecs[i].iov_len;
+            }
+
+            if (!vecs_used && APR_STATUS_IS_EAGAIN(status))
+                serf_bucket_mock_more_data_arrived(mock_bkt);
+        } while (!APR_STATUS_IS_EOF(status));
+
+        CuAssert(tc, "Read less data than expected.", strlen(expected) == 0);
+        serf_bucket_destroy(bkt);
+    }
+
+    /* The response bucket passes the chunks on together. */
+    bkt = SERF_BUCKET_SIMPLE_STRING("HTTP/1.1 200 OK" CRLF
+                                    "Transfer-Encoding: chunked" CRLF
+                                    CRLF
+                                    "5" CRLF "hello" CRLF
+                                    "6" CRLF " world" CRLF
+                                    "0" CRLF CRLF, alloc);
+    bkt = serf_bucket_response_create(bkt, alloc);
+    do {
+        status = serf_bucket_read_iovec(bkt, SERF_READ_ALL_AVAIL, 16, vecs,
+                                        &vecs_used);
+    } while (status == APR_SUCCESS && !vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, vecs_used);
+    read_and_check_bucket(tc, bkt, "");
+    serf_bucket_destroy(bkt);
+}
+
 static apr_status_t deflate_compress(const char **data, apr_size_t *len,
                                      z_stream *zdestr,
                                      const char *orig, apr_size_t orig_len,
@@ -1511,6 +1828,361 @@ static void test_deflate_buckets(CuTest *tc)
     apr_pool_destroy(iterpool);
 }
 
+/* Test that a gzip stream that ends before the compressed data does is
+   reported as an error. */
+static void test_deflate_truncated(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    const char gzip_header[10] =
+        { '\037', '\213', Z_DEFLATED, 0,
+          0, 0, 0, 0, /* mtime */
+          0, 0x03 /* Unix OS_CODE */
+        };
+    const char *msg = "12345678901234567890123456789012345678901234567890";
+    serf_bucket_t *aggbkt, *defbkt;
+    z_stream zdestr;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+    int i;
+
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    defbkt = serf_bucket_deflate_create(aggbkt, alloc, SERF_DEFLATE_GZIP);
+
+    memset(&zdestr, 0, sizeof(z_stream));
+    CuAssertIntEquals(tc, Z_OK,
+             deflateInit2(&zdestr, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                          Z_DEFAULT_STRATEGY));
+
+    serf_bucket_aggregate_append(aggbkt,
+        serf_bucket_simple_create(gzip_header, 10, NULL, NULL, alloc));
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      deflate_compress(&data, &len, &zdestr, msg,
+                                       strlen(msg), 1, tb->pool));
+    deflateEnd(&zdestr);
+
+    /* Leave out the end of the compressed data, and the trailer. */
+    serf_bucket_aggregate_append(aggbkt,
+        serf_bucket_simple_create(data, len / 2, NULL, NULL, alloc));
+
+    for (i = 0; i < 10; i++) {
+        status = serf_bucket_read(defbkt, SERF_READ_ALL_AVAIL, &data, &len);
+        if (status)
+            break;
+    }
+    CuAssertIntEquals(tc, SERF_ERROR_DECOMPRESSION_FAILED, status);
+
+    serf_bucket_destroy(defbkt);
+}
+
+#if defined(SERF_HAVE_BROTLI) || defined(SERF_HAVE_ZSTD)
+/* A body of about 200KB that compresses well, NUL-terminated. */
+static const char *create_decode_body(apr_size_t *len, apr_pool_t *pool)
+{
+    apr_size_t size = 10000 * 24;
+    char *body = apr_palloc(pool, size);
+    apr_size_t used = 0;
+    int i;
+
+    for (i = 0; i < 10000; i++)
+        used += apr_snprintf(body + used, size - used,
+                             "line %d of the body\n", i);
+
+    *len = used;
+    return body;
+}
+
+/* Read BKT until it fails, and check that it fails with STATUS. */
+static void read_and_check_error(CuTest *tc, serf_bucket_t *bkt,
+                                 apr_status_t expected)
+{
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+    } while (status == APR_SUCCESS);
+
+    CuAssertIntEquals(tc, expected, status);
+}
+
+/* Create an aggregate bucket that hands out the LEN bytes at DATA in
+   pieces of PIECE bytes. */
+static serf_bucket_t *create_pieces_bucket(const char *data, apr_size_t len,
+                                           apr_size_t piece,
+                                           serf_bucket_alloc_t *alloc)
+{
+    serf_bucket_t *aggbkt = serf_bucket_aggregate_create(alloc);
+
+    while (len) {
+        apr_size_t this_len = len < piece ? len : piece;
+
+        serf_bucket_aggregate_append(aggbkt,
+            serf_bucket_simple_create(data, this_len, NULL, NULL, alloc));
+        data += this_len;
+        len -= this_len;
+    }
+
+    return aggbkt;
+}
+
+#endif
+
+#ifdef SERF_HAVE_BROTLI
+/* Compress the LEN bytes at DATA with brotli, flushing after FLUSH_AT bytes
+   so that the stream holds more than one meta-block. */
+static const char *brotli_compress(CuTest *tc, apr_size_t *compressed_len,
+                                   const char *data, apr_size_t len,
+                                   apr_size_t flush_at, apr_pool_t *pool)
+{
+    BrotliEncoderState *state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    size_t size = BrotliEncoderMaxCompressedSize(len) + 1024;
+    uint8_t *buf = apr_palloc(pool, size);
+    uint8_t *next_out = buf;
+    size_t avail_out = size;
+    const uint8_t *next_in = (const uint8_t *)data;
+    size_t avail_in = flush_at;
+
+    CuAssertPtrNotNull(tc, state);
+
+    while (avail_in || BrotliEncoderHasMoreOutput(state))
+        CuAssertTrue(tc, BrotliEncoderCompressStream(state,
+                                                     BROTLI_OPERATION_FLUSH,
+                                                     &avail_in, &next_in,
+                                                     &avail_out, &next_out,
+                                                     NULL));
+
+    avail_in = len - flush_at;
+    while (!BrotliEncoderIsFinished(state))
+        CuAssertTrue(tc, BrotliEncoderCompressStream(state,
+                                                     BROTLI_OPERATION_FINISH,
+                                                     &avail_in, &next_in,
+                                                     &avail_out, &next_out,
+                                                     NULL));
+    BrotliEncoderDestroyInstance(state);
+
+    *compressed_len = next_out - buf;
+    return (const char *)buf;
+}
+
+/* Test that a brotli body of several meta-blocks, read in small pieces,
+   decodes to the original, and that a truncated one fails. */
+static void check_brotli_decode(CuTest *tc, serf_bucket_alloc_t *alloc,
+                                apr_pool_t *pool)
+{
+    const char *body, *compressed;
+    apr_size_t body_len, compressed_len;
+    serf_bucket_t *bkt;
+
+    body = create_decode_body(&body_len, pool);
+    compressed = brotli_compress(tc, &compressed_len, body, body_len,
+                                 body_len / 2, pool);
+
+    bkt = serf_bucket_content_decode_create(
+              create_pieces_bucket(compressed, compressed_len, 100, alloc),
+              "br", alloc);
+    CuAssertTrue(tc, SERF_BUCKET_IS_BROTLI_DECOMPRESS(bkt));
+    read_and_check_bucket(tc, bkt, body);
+    serf_bucket_destroy(bkt);
+
+    bkt = serf_bucket_brotli_decompress_create(
+              serf_bucket_simple_create(compressed, compressed_len / 2,
+                                        NULL, NULL, alloc),
+              alloc);
+    read_and_check_error(tc, bkt, SERF_ERROR_DECOMPRESSION_FAILED);
+    serf_bucket_destroy(bkt);
+}
+#endif /* SERF_HAVE_BROTLI */
+
+#ifdef SERF_HAVE_ZSTD
+/* Test that a zstd body of two frames, read in small pieces, decodes to
+   the original, and that one truncated in its second frame fails. */
+static void check_zstd_decode(CuTest *tc, serf_bucket_alloc_t *alloc,
+                              apr_pool_t *pool)
+{
+    const char *body;
+    apr_size_t body_len, half, size, first_len, second_len;
+    serf_bucket_t *bkt;
+    char *compressed;
+
+    body = create_decode_body(&body_len, pool);
+    half = body_len / 2;
+
+    size = ZSTD_compressBound(half) + ZSTD_compressBound(body_len - half);
+    compressed = apr_palloc(pool, size);
+
+    first_len = ZSTD_compress(compressed, size, body, half, 1);
+    CuAssertTrue(tc, !ZSTD_isError(first_len));
+    second_len = ZSTD_compress(compressed + first_len, size - first_len,
+                               body + half, body_len - half, 1);
+    CuAssertTrue(tc, !ZSTD_isError(second_len));
+
+    bkt = serf_bucket_content_decode_create(
+              create_pieces_bucket(compressed, first_len + second_len, 100,
+                                   alloc),
+              "zstd", alloc);
+    CuAssertTrue(tc, SERF_BUCKET_IS_ZSTD_DECOMPRESS(bkt));
+    read_and_check_bucket(tc, bkt, body);
+    serf_bucket_destroy(bkt);
+
+    bkt = serf_bucket_zstd_decompress_create(
+              serf_bucket_simple_create(compressed,
+                                        first_len + second_len / 2,
+                                        NULL, NULL, alloc),
+              alloc);
+    read_and_check_error(tc, bkt, SERF_ERROR_DECOMPRESSION_FAILED);
+    serf_bucket_destroy(bkt);
+}
+#endif /* SERF_HAVE_ZSTD */
+
+/* Test that the decoders are chained as the Content-Encoding header lists
+   them, that unsupported codings are left alone, and that the brotli and
+   zstd decoders work when serf is built with them. */
+static void test_content_decode_buckets(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    const char *msg = "12345678901234567890123456789012345678901234567890";
+    serf_bucket_t *bkt, *decbkt;
+    z_stream zdestr;
+    const char *data;
+    apr_size_t len;
+
+    bkt = SERF_BUCKET_SIMPLE_STRING(msg, alloc);
+    CuAssertPtrEquals(tc, bkt,
+                      serf_bucket_content_decode_create(bkt, "identity",
+                                                        alloc));
+    CuAssertPtrEquals(tc, bkt,
+                      serf_bucket_content_decode_create(bkt, "compress",
+                                                        alloc));
+    /* Nothing is undone below a coding we don't know. */
+    CuAssertPtrEquals(tc, bkt,
+                      serf_bucket_content_decode_create(bkt,
+                                                        "deflate, compress",
+                                                        alloc));
+    if (!serf_bucket_is_brotli_supported())
+        CuAssertPtrEquals(tc, bkt,
+                          serf_bucket_content_decode_create(bkt, "br", alloc));
+    if (!serf_bucket_is_zstd_supported())
+        CuAssertPtrEquals(tc, bkt,
+                          serf_bucket_content_decode_create(bkt, "zstd",
+                                                            alloc));
+    serf_bucket_destroy(bkt);
+
+    memset(&zdestr, 0, sizeof(z_stream));
+    CuAssertIntEquals(tc, Z_OK,
+             deflateInit2(&zdestr, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                          Z_DEFAULT_STRATEGY));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      deflate_compress(&data, &len, &zdestr, msg,
+                                       strlen(msg), 1, tb->pool));
+    deflateEnd(&zdestr);
+
+    bkt = serf_bucket_simple_create(data, len, NULL, NULL, alloc);
+    decbkt = serf_bucket_content_decode_create(bkt, " Identity ,DEFLATE ",
+                                               alloc);
+    CuAssertTrue(tc, SERF_BUCKET_IS_DEFLATE(decbkt));
+
+    read_and_check_bucket(tc, decbkt, msg);
+    serf_bucket_destroy(decbkt);
+
+#ifdef SERF_HAVE_BROTLI
+    check_brotli_decode(tc, alloc, tb->pool);
+#endif
+#ifdef SERF_HAVE_ZSTD
+    check_zstd_decode(tc, alloc, tb->pool);
+#endif
+}
+
+/* Test that a compressed body decodes to the original, also when sent
+   chunked, and that what was compressed is flushed when the body stalls. */
+static void test_compress_buckets(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    const char *part1 = "first line of the body\n"
+                        "first line of the body\n";
+    const char *part2 = "second line of the body\n"
+                        "second line of the body\n";
+    mockbkt_action actions[]= {
+        { 1, NULL, APR_SUCCESS },
+        /* The first makes the compressor flush, the second is returned */
+        { 1, "", APR_EAGAIN },
+        { 1, "", APR_EAGAIN },
+        { 1, NULL, APR_EOF },
+    };
+    serf_bucket_t *mock_bkt, *bkt, *aggbkt;
+    char *compressed = apr_palloc(tb->pool, 1024);
+    apr_size_t compressed_len = 0;
+    char chunked[1100];
+    int stalled = 0;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    actions[0].data = part1;
+    actions[3].data = part2;
+    mock_bkt = serf_bucket_mock_create(actions, 4, alloc);
+    bkt = serf_bucket_compress_create(mock_bkt, alloc, SERF_COMPRESS_GZIP,
+                                      SERF_COMPRESS_LEVEL_DEFAULT);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == SERF_LENGTH_UNKNOWN);
+
+    do {
+        status = serf_bucket_read(bkt, 7, &data, &len);
+        CuAssertTrue(tc, !SERF_BUCKET_READ_ERROR(status));
+        if (APR_STATUS_IS_EAGAIN(status))
+            stalled++;
+        CuAssertTrue(tc, compressed_len + len <= 1024);
+        memcpy(compressed + compressed_len, data, len);
+        compressed_len += len;
+
+        if (APR_STATUS_IS_EAGAIN(status)) {
+            z_stream zstr;
+            char out[100];
+
+            /* All of the first part can be decoded already. */
+            memset(&zstr, 0, sizeof(zstr));
+            CuAssertIntEquals(tc, Z_OK, inflateInit2(&zstr, 15 + 16));
+            zstr.next_in = (Bytef *)compressed;
+            zstr.avail_in = (uInt)compressed_len;
+            zstr.next_out = (Bytef *)out;
+            zstr.avail_out = sizeof(out);
+            CuAssertIntEquals(tc, Z_OK, inflate(&zstr, Z_SYNC_FLUSH));
+            CuAssertIntEquals(tc, (int)strlen(part1),
+                              (int)(sizeof(out) - zstr.avail_out));
+            CuAssertTrue(tc, memcmp(out, part1, strlen(part1)) == 0);
+            inflateEnd(&zstr);
+        }
+    } while (!APR_STATUS_IS_EOF(status));
+    CuAssertIntEquals(tc, 1, stalled);
+    serf_bucket_destroy(bkt);
+
+    /* Send it chunked, and decode it again. */
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_append(aggbkt,
+        serf_bucket_simple_create(compressed, compressed_len, NULL, NULL,
+                                  alloc));
+    bkt = serf_bucket_chunk_create(aggbkt, alloc);
+    status = read_all(bkt, chunked, sizeof(chunked), &len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    serf_bucket_destroy(bkt);
+
+    bkt = serf_bucket_simple_create(chunked, len, NULL, NULL, alloc);
+    bkt = serf_bucket_dechunk_create(bkt, alloc);
+    bkt = serf_bucket_deflate_create(bkt, alloc, SERF_DEFLATE_GZIP);
+
+    read_and_check_bucket(tc, bkt, apr_pstrcat(tb->pool, part1, part2,
+                                               NULL));
+    serf_bucket_destroy(bkt);
+}
+
 static apr_status_t discard_data(serf_bucket_t *bkt,
                                  apr_size_t *read_len)
 {
@@ -1739,6 +2411,1183 @@ static void test_linebuf_fetch_crlf(CuTest *tc)
 
 }
 
+/* Test that freed memory of different sizes is recycled by the allocator's
+   size class freelists instead of being returned to the apr_allocator. */
+static void test_allocator_size_classes(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_size_t sizes[] = { 1, 40, 100, 200, 500, 1000, 2000, 4000 };
+    void *ptrs[sizeof(sizes)/sizeof(sizes[0])];
+    int i;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        ptrs[i] = serf_bucket_mem_alloc(alloc, sizes[i]);
+        memset(ptrs[i], 'x', sizes[i]);
+    }
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        void *ptr;
+
+        serf_bucket_mem_free(alloc, ptrs[i]);
+
+        /* An allocation of the same size should get the freed node back. */
+        ptr = serf_bucket_mem_alloc(alloc, sizes[i]);
+        CuAssertPtrEquals(tc, ptrs[i], ptr);
+        serf_bucket_mem_free(alloc, ptr);
+    }
+
+    /* Allocations bigger than the largest size class still work. */
+    ptrs[0] = serf_bucket_mem_alloc(alloc, 10000);
+    memset(ptrs[0], 'x', 10000);
+    serf_bucket_mem_free(alloc, ptrs[0]);
+}
+
+static void test_allocator_stats(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_stats_t stats;
+    void *small, *big, *before;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    CuAssertIntEquals(tc, APR_EINVAL,
+                      serf_bucket_allocator_get_stats(&stats, alloc));
+
+    before = serf_bucket_mem_alloc(alloc, 10000);
+    serf_bucket_allocator_enable_stats(alloc);
+
+    small = serf_bucket_mem_alloc(alloc, 10);
+    big = serf_bucket_mem_alloc(alloc, 10000);
+    serf_bucket_mem_free(alloc, small);
+    small = serf_bucket_mem_alloc(alloc, 10);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_allocator_get_stats(&stats, alloc));
+    CuAssertTrue(tc, stats.num_allocs == 3);
+    CuAssertTrue(tc, stats.num_frees == 1);
+    CuAssertTrue(tc, stats.freelist_hits == 1);
+    CuAssertTrue(tc, stats.block_grabs == 1);
+    CuAssertTrue(tc, stats.direct_allocs == 1);
+    CuAssertTrue(tc, stats.size_histogram[0] == 2);
+    CuAssertTrue(tc, stats.size_histogram[10] == 1);
+    CuAssertTrue(tc, stats.live_bytes > 10000);
+    CuAssertTrue(tc, stats.peak_bytes >= stats.live_bytes);
+
+    serf_bucket_mem_free(alloc, small);
+    serf_bucket_mem_free(alloc, big);
+    /* Memory from before the statistics were enabled isn't counted. */
+    serf_bucket_mem_free(alloc, before);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_allocator_get_stats(&stats, alloc));
+    CuAssertTrue(tc, stats.num_frees == 3);
+    CuAssertTrue(tc, stats.live_bytes == 0);
+    CuAssertTrue(tc, stats.peak_bytes > 10000);
+}
+
+/* Create a temporary file of LEN bytes, too big to be mmap'ed. */
+static apr_file_t *create_test_file(CuTest *tc, apr_size_t len,
+                                    apr_pool_t *pool)
+{
+    const char *tmpdir;
+    char *tmpl;
+    char buf[1000];
+    apr_file_t *file;
+    apr_off_t offset = 0;
+    apr_size_t i;
+
+    CuAssertIntEquals(tc, APR_SUCCESS, apr_temp_dir_get(&tmpdir, pool));
+    tmpl = apr_pstrcat(pool, tmpdir, "/serf_test_XXXXXX", NULL);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_mktemp(&file, tmpl,
+                                      APR_FOPEN_CREATE | APR_FOPEN_READ |
+                                      APR_FOPEN_WRITE | APR_FOPEN_EXCL |
+                                      APR_FOPEN_DELONCLOSE, pool));
+
+    for (i = 0; i < len; i += sizeof(buf)) {
+        apr_size_t j, chunk = len - i < sizeof(buf) ? len - i : sizeof(buf);
+
+        for (j = 0; j < chunk; j++)
+            buf[j] = 'a' + (i + j) % 26;
+        CuAssertIntEquals(tc, APR_SUCCESS,
+                          apr_file_write_full(file, buf, chunk, NULL));
+    }
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_seek(file, APR_SET, &offset));
+
+    return file;
+}
+
+static void test_file_bucket_read_for_sendfile(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt, *aggbkt;
+    apr_size_t file_len = APR_MMAP_LIMIT + 100;
+    apr_file_t *file, *sf_file;
+    apr_off_t sf_offset;
+    apr_size_t sf_len, len;
+    struct iovec vecs[4];
+    apr_hdtr_t hdtr;
+    const char *data;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    file = create_test_file(tc, file_len, tb->pool);
+
+    /* Part of the file, then read the rest the normal way. */
+    bkt = serf_bucket_file_create(file, alloc);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == file_len);
+
+    hdtr.headers = vecs;
+    hdtr.numheaders = 4;
+    hdtr.trailers = NULL;
+    hdtr.numtrailers = 0;
+    status = serf_bucket_read_for_sendfile(bkt, 100, &hdtr, &sf_file,
+                                           &sf_offset, &sf_len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertPtrEquals(tc, file, sf_file);
+    CuAssertIntEquals(tc, 0, hdtr.numheaders);
+    CuAssertTrue(tc, sf_offset == 0);
+    CuAssertTrue(tc, sf_len == 100);
+
+    status = serf_bucket_read(bkt, 10, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertTrue(tc, len == 10);
+    CuAssertStrnEquals(tc, "wxyzabcdef", 10, data);
+
+    /* Buffered data comes in the headers, the rest as file. */
+    hdtr.numheaders = 4;
+    status = serf_bucket_read_for_sendfile(bkt, SERF_READ_ALL_AVAIL, &hdtr,
+                                           &sf_file, &sf_offset, &sf_len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertPtrEquals(tc, NULL, sf_file);
+    CuAssertIntEquals(tc, 1, hdtr.numheaders);
+    CuAssertStrnEquals(tc, "ghij", 4, vecs[0].iov_base);
+
+    hdtr.numheaders = 4;
+    status = serf_bucket_read_for_sendfile(bkt, SERF_READ_ALL_AVAIL, &hdtr,
+                                           &sf_file, &sf_offset, &sf_len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertPtrEquals(tc, file, sf_file);
+    CuAssertIntEquals(tc, 0, hdtr.numheaders);
+    CuAssertTrue(tc, sf_offset + sf_len == file_len);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 0);
+    serf_bucket_destroy(bkt);
+
+    /* The aggregate bucket passes the file through, after the data of the
+       buckets before it. */
+    sf_offset = 0;
+    apr_file_seek(file, APR_SET, &sf_offset);
+
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    bkt = SERF_BUCKET_SIMPLE_STRING("PUT /", alloc);
+    serf_bucket_aggregate_append(aggbkt, bkt);
+    bkt = serf_bucket_file_create(file, alloc);
+    serf_bucket_aggregate_append(aggbkt, bkt);
+
+    hdtr.numheaders = 4;
+    status = serf_bucket_read_for_sendfile(aggbkt, SERF_READ_ALL_AVAIL,
+                                           &hdtr, &sf_file, &sf_offset,
+                                           &sf_len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 1, hdtr.numheaders);
+    CuAssertStrnEquals(tc, "PUT /", 5, vecs[0].iov_base);
+    CuAssertPtrEquals(tc, file, sf_file);
+    CuAssertTrue(tc, sf_offset == 0);
+    CuAssertTrue(tc, sf_len == file_len);
+
+    serf_bucket_destroy(aggbkt);
+}
+
+/* Test that the chunk bucket frames its stream with one iovec between the
+   chunks, and passes a file through for sendfile. */
+static void test_chunk_bucket(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt, *aggbkt;
+    apr_size_t file_len = APR_MMAP_LIMIT + 100;
+    apr_file_t *file, *sf_file;
+    apr_off_t sf_offset;
+    apr_size_t sf_len, hdr_len;
+    struct iovec vecs[4];
+    apr_hdtr_t hdtr;
+    char hdr[20];
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    aggbkt = serf_bucket_aggregate_create(alloc);
+    bkt = SERF_BUCKET_SIMPLE_STRING("abc", alloc);
+    serf_bucket_aggregate_append(aggbkt, bkt);
+    bkt = SERF_BUCKET_SIMPLE_STRING("1234", alloc);
+    serf_bucket_aggregate_append(aggbkt, bkt);
+    bkt = serf_bucket_chunk_create(aggbkt, alloc);
+    read_and_check_bucket(tc, bkt, "7\r\nabc1234\r\n0\r\n\r\n");
+    serf_bucket_destroy(bkt);
+
+    file = create_test_file(tc, file_len, tb->pool);
+    bkt = serf_bucket_chunk_create(serf_bucket_file_create(file, alloc),
+                                   alloc);
+
+    hdtr.headers = vecs;
+    hdtr.numheaders = 4;
+    hdtr.trailers = NULL;
+    hdtr.numtrailers = 0;
+    status = serf_bucket_read_for_sendfile(bkt, SERF_READ_ALL_AVAIL, &hdtr,
+                                           &sf_file, &sf_offset, &sf_len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertPtrEquals(tc, file, sf_file);
+    CuAssertIntEquals(tc, 1, hdtr.numheaders);
+    hdr_len = apr_snprintf(hdr, sizeof(hdr), "%" APR_UINT64_T_HEX_FMT "\r\n",
+                           (apr_uint64_t)file_len);
+    CuAssertIntEquals(tc, (int)hdr_len, (int)vecs[0].iov_len);
+    CuAssertStrnEquals(tc, hdr, hdr_len, vecs[0].iov_base);
+    CuAssertTrue(tc, sf_offset == 0);
+    CuAssertTrue(tc, sf_len == file_len);
+
+    /* The end of the chunk and the last-chunk in one go. */
+    read_and_check_bucket(tc, bkt, "\r\n0\r\n\r\n");
+    serf_bucket_destroy(bkt);
+}
+
+/* Test that the spill bucket keeps data in memory up to its threshold,
+   writes the rest to a file and reads all of it back in order. */
+static void test_spill_bucket(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *mock_bkt, *bkt;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    mockbkt_action actions[]= {
+        { 1, "0123456789", APR_SUCCESS },
+        { 1, "abcdefghij", APR_EAGAIN },
+        { 1, "KLMNO", APR_EOF },
+    };
+    apr_status_t status;
+
+    mock_bkt = serf_bucket_mock_create(actions, 3, alloc);
+    bkt = serf_bucket_spill_create(mock_bkt, 10, alloc);
+
+    status = serf_bucket_spill_fill(bkt);
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == SERF_LENGTH_UNKNOWN);
+
+    status = serf_bucket_spill_fill(bkt);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 25);
+
+    read_and_check_bucket(tc, bkt, "0123456789abcdefghijKLMNO");
+    serf_bucket_destroy(bkt);
+
+    /* Without buffering, the data is read straight from the stream. */
+    mock_bkt = serf_bucket_mock_create(actions, 3, alloc);
+    bkt = serf_bucket_spill_create(mock_bkt, 0, alloc);
+    read_and_check_bucket(tc, bkt, "0123456789abcdefghijKLMNO");
+    serf_bucket_destroy(bkt);
+}
+
+static void test_mmap_window_bucket(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt;
+    apr_size_t file_len = 300 * 1024;
+    apr_off_t pos = 1000;
+    apr_file_t *file;
+    apr_size_t total = 0;
+    int nr_of_reads = 0;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    file = create_test_file(tc, file_len, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, apr_file_seek(file, APR_SET, &pos));
+
+    /* Rounded up to one 64KB window. */
+    bkt = serf_bucket_mmap_window_create(file, 1, alloc);
+    CuAssertTrue(tc, SERF_BUCKET_IS_MMAP(bkt));
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == file_len - pos);
+
+    do {
+        const char *data;
+        apr_size_t len, i;
+
+        status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+        CuAssertTrue(tc, !SERF_BUCKET_READ_ERROR(status));
+        CuAssertTrue(tc, len <= 64 * 1024);
+
+        for (i = 0; i < len; i++) {
+            if (data[i] != 'a' + (pos + total + i) % 26)
+                CuFail(tc, "unexpected data");
+        }
+        total += len;
+        nr_of_reads++;
+    } while (status != APR_EOF);
+
+    CuAssertTrue(tc, total == file_len - pos);
+    CuAssertIntEquals(tc, 5, nr_of_reads);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 0);
+
+    serf_bucket_destroy(bkt);
+}
+
+/* Convert the hex string HEX to the binary data it represents. */
+static const char *unhex(const char *hex, apr_size_t *len, apr_pool_t *pool)
+{
+    apr_size_t i;
+    char *data;
+
+    *len = strlen(hex) / 2;
+    data = apr_palloc(pool, *len);
+    for (i = 0; i < *len; i++) {
+        char digits[3];
+
+        digits[0] = hex[2 * i];
+        digits[1] = hex[2 * i + 1];
+        digits[2] = '\0';
+        data[i] = (char)strtol(digits, NULL, 16);
+    }
+
+    return data;
+}
+
+typedef struct hpack_baton_t {
+    char buf[1024];
+    apr_size_t len;
+} hpack_baton_t;
+
+static apr_status_t collect_header(void *baton,
+                                   const char *name, apr_size_t name_len,
+                                   const char *value, apr_size_t value_len)
+{
+    hpack_baton_t *hb = baton;
+
+    memcpy(hb->buf + hb->len, name, name_len);
+    hb->len += name_len;
+    memcpy(hb->buf + hb->len, ": ", 2);
+    hb->len += 2;
+    memcpy(hb->buf + hb->len, value, value_len);
+    hb->len += value_len;
+    hb->buf[hb->len++] = '\n';
+    hb->buf[hb->len] = '\0';
+
+    return APR_SUCCESS;
+}
+
+static void check_hpack_block(CuTest *tc, serf__hpack_table_t *tbl,
+                              const char *hex, const char *expected)
+{
+    test_baton_t *tb = tc->testBaton;
+    hpack_baton_t hb;
+    const char *block;
+    apr_size_t len;
+
+    hb.len = 0;
+    hb.buf[0] = '\0';
+
+    block = unhex(hex, &len, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__hpack_decode(tbl, block, len, collect_header,
+                                         &hb, tb->pool));
+    CuAssertStrEquals(tc, expected, hb.buf);
+}
+
+/* Decode the header blocks of RFC 7541 Appendix C, which use Huffman coded
+   literals and the dynamic table. */
+static void test_hpack_decode(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf__hpack_table_t *tbl;
+    const char *block;
+    apr_size_t len;
+    hpack_baton_t hb;
+
+    /* C.4, requests with Huffman coding. */
+    tbl = serf__hpack_table_create(4096, tb->pool);
+    check_hpack_block(tc, tbl,
+                      "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+                      ":method: GET\n:scheme: http\n:path: /\n"
+                      ":authority: www.example.com\n");
+    check_hpack_block(tc, tbl,
+                      "828684be5886a8eb10649cbf",
+                      ":method: GET\n:scheme: http\n:path: /\n"
+                      ":authority: www.example.com\n"
+                      "cache-control: no-cache\n");
+    check_hpack_block(tc, tbl,
+                      "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+                      ":method: GET\n:scheme: https\n:path: /index.html\n"
+                      ":authority: www.example.com\n"
+                      "custom-key: custom-value\n");
+
+    /* C.6, responses with a 256 byte table, which evicts entries. */
+    tbl = serf__hpack_table_create(256, tb->pool);
+    check_hpack_block(tc, tbl,
+                      "488264025885aec3771a4b6196d07abe941054d444a8200595"
+                      "040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae"
+                      "82ae43d3",
+                      ":status: 302\ncache-control: private\n"
+                      "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                      "location: https://www.example.com\n");
+    check_hpack_block(tc, tbl,
+                      "4883640effc1c0bf",
+                      ":status: 307\ncache-control: private\n"
+                      "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                      "location: https://www.example.com\n");
+    check_hpack_block(tc, tbl,
+                      "88c16196d07abe941054d444a8200595040b8166e084a62d1b"
+                      "ffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960"
+                      "d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1"
+                      "063d5007",
+                      ":status: 200\ncache-control: private\n"
+                      "date: Mon, 21 Oct 2013 20:13:22 GMT\n"
+                      "location: https://www.example.com\n"
+                      "content-encoding: gzip\n"
+                      "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; "
+                      "max-age=3600; version=1\n");
+
+    /* An index beyond the dynamic table is an error. */
+    hb.len = 0;
+    block = unhex("be", &len, tb->pool);
+    tbl = serf__hpack_table_create(4096, tb->pool);
+    CuAssertIntEquals(tc, SERF_ERROR_HTTP2_COMPRESSION_ERROR,
+                      serf__hpack_decode(tbl, block, len, collect_header,
+                                         &hb, tb->pool));
+}
+
+/* Encode the headers of a request and decode them again. */
+static void test_hpack_encode_request(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *hdrs;
+    serf__hpack_table_t *tbl;
+    hpack_baton_t hb;
+    char *block;
+    apr_size_t len;
+
+    hdrs = serf_bucket_headers_create(alloc);
+    serf_bucket_headers_setn(hdrs, "Host", "www.example.com");
+    serf_bucket_headers_setn(hdrs, "Connection", "keep-alive");
+    serf_bucket_headers_setn(hdrs, "Accept-Encoding", "gzip, deflate");
+    serf_bucket_headers_setn(hdrs, "Authorization", "Basic dXNlcjpwYXNz");
+    serf_bucket_headers_setn(hdrs, "X-Custom-Header", "Some Value");
+
+    serf__hpack_encode_request(&block, &len, "GET", "https",
+                               "www.example.com", "/index.html", hdrs,
+                               alloc);
+
+    hb.len = 0;
+    hb.buf[0] = '\0';
+    tbl = serf__hpack_table_create(4096, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__hpack_decode(tbl, block, len, collect_header,
+                                         &hb, tb->pool));
+    CuAssertStrEquals(tc,
+                      ":method: GET\n:scheme: https\n"
+                      ":authority: www.example.com\n:path: /index.html\n"
+                      "accept-encoding: gzip, deflate\n"
+                      "authorization: Basic dXNlcjpwYXNz\n"
+                      "x-custom-header: Some Value\n",
+                      hb.buf);
+
+    serf_bucket_mem_free(alloc, block);
+    serf_bucket_destroy(hdrs);
+}
+
+/* Frame two payloads and read them back as frames. */
+static void test_http2_frame_buckets(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *payload, *frame, *stream, *unframe;
+    const char *data;
+    char buf[64];
+    apr_size_t len;
+    apr_uint32_t stream_id;
+    unsigned char frame_type, flags;
+    apr_status_t status;
+
+    stream = serf_bucket_aggregate_create(alloc);
+
+    payload = SERF_BUCKET_SIMPLE_STRING("hello", alloc);
+    frame = serf_bucket_http2_frame_create(payload,
+                                           SERF_HTTP2_FRAME_TYPE_DATA,
+                                           SERF_HTTP2_FLAG_END_STREAM,
+                                           3, alloc);
+    CuAssertTrue(tc, SERF_BUCKET_IS_HTTP2_FRAME(frame));
+    CuAssertTrue(tc, serf_bucket_get_remaining(frame) == 9 + 5);
+    serf_bucket_aggregate_append(stream, frame);
+
+    frame = serf_bucket_http2_frame_create(NULL,
+                                           SERF_HTTP2_FRAME_TYPE_SETTINGS,
+                                           SERF_HTTP2_FLAG_ACK, 0, alloc);
+    serf_bucket_aggregate_append(stream, frame);
+
+    /* Check the wire format of the first frame. */
+    status = serf_bucket_peek(stream, &data, &len);
+    CuAssertTrue(tc, len >= 9);
+    CuAssertTrue(tc, memcmp(data, "\0\0\5\0\1\0\0\0\3", 9) == 0);
+
+    unframe = serf_bucket_http2_unframe_create(stream, 16384, alloc);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_http2_unframe_read_info(unframe, &stream_id,
+                                                          &frame_type,
+                                                          &flags));
+    CuAssertIntEquals(tc, 3, stream_id);
+    CuAssertIntEquals(tc, SERF_HTTP2_FRAME_TYPE_DATA, frame_type);
+    CuAssertIntEquals(tc, SERF_HTTP2_FLAG_END_STREAM, flags);
+    CuAssertTrue(tc, serf_bucket_get_remaining(unframe) == 5);
+
+    status = read_all(unframe, buf, sizeof(buf), &len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertTrue(tc, len == 5 && memcmp(buf, "hello", 5) == 0);
+    serf_bucket_destroy(unframe);
+
+    /* The next frame was left untouched on the stream. */
+    unframe = serf_bucket_http2_unframe_create(stream, 16384, alloc);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_http2_unframe_read_info(unframe, &stream_id,
+                                                          &frame_type,
+                                                          &flags));
+    CuAssertIntEquals(tc, 0, stream_id);
+    CuAssertIntEquals(tc, SERF_HTTP2_FRAME_TYPE_SETTINGS, frame_type);
+    CuAssertIntEquals(tc, SERF_HTTP2_FLAG_ACK, flags);
+    status = read_all(unframe, buf, sizeof(buf), &len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertTrue(tc, len == 0);
+    serf_bucket_destroy(unframe);
+
+    /* And then the stream ends, between frames. */
+    unframe = serf_bucket_http2_unframe_create(stream, 16384, alloc);
+    CuAssertIntEquals(tc, APR_EOF,
+                      serf_bucket_http2_unframe_read_info(unframe, NULL,
+                                                          NULL, NULL));
+    serf_bucket_destroy(unframe);
+    serf_bucket_destroy(stream);
+
+    /* Frames larger than allowed are rejected. */
+    payload = SERF_BUCKET_SIMPLE_STRING("too large", alloc);
+    stream = serf_bucket_http2_frame_create(payload,
+                                            SERF_HTTP2_FRAME_TYPE_DATA, 0, 1,
+                                            alloc);
+    unframe = serf_bucket_http2_unframe_create(stream, 8, alloc);
+    status = read_all(unframe, buf, sizeof(buf), &len);
+    CuAssertIntEquals(tc, SERF_ERROR_HTTP2_FRAME_SIZE_ERROR, status);
+    serf_bucket_destroy(unframe);
+    serf_bucket_destroy(stream);
+}
+
+/* Test that a response bucket continues a response cut off earlier, with
+   a partial response or with the full body again. */
+static void test_response_bucket_resume(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt, *tmp;
+    serf_status_line sl;
+    apr_uint64_t offset;
+    const char *validator, *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    /* The original response, of which only a part is read. */
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 200 OK" CRLF
+        "ETag: \"v1\"" CRLF
+        "Content-Length: 10" CRLF
+        CRLF
+        "abcde",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+    CuAssert(tc, "no resume point before the body",
+             !serf__bucket_response_get_resume_point(bkt, &offset,
+                                                     &validator));
+    status = serf_bucket_read(bkt, 3, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 3, len);
+    CuAssert(tc, "expected a resume point",
+             serf__bucket_response_get_resume_point(bkt, &offset,
+                                                    &validator));
+    CuAssertIntEquals(tc, 3, (int)offset);
+    CuAssertStrEquals(tc, "\"v1\"", validator);
+    serf_bucket_destroy(bkt);
+
+    /* The rest as a partial response, presented as the original. */
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 206 Partial Content" CRLF
+        "ETag: \"v1\"" CRLF
+        "Content-Range: bytes 5-9/10" CRLF
+        "Content-Length: 5" CRLF
+        CRLF
+        "fghij",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+    serf__bucket_response_set_resume(bkt, 5, "\"v1\"");
+    read_and_check_bucket(tc, bkt, "fghij");
+    serf_bucket_response_status(bkt, &sl);
+    CuAssertIntEquals(tc, 200, sl.code);
+    serf_bucket_destroy(bkt);
+
+    /* The server ignored the range, skip what was read before. */
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 200 OK" CRLF
+        "ETag: \"v1\"" CRLF
+        "Content-Length: 10" CRLF
+        CRLF
+        "abcdefghij",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+    serf__bucket_response_set_resume(bkt, 5, "\"v1\"");
+    read_and_check_bucket(tc, bkt, "fghij");
+    serf_bucket_destroy(bkt);
+
+    /* The representation changed. */
+    tmp = SERF_BUCKET_SIMPLE_STRING(
+        "HTTP/1.1 200 OK" CRLF
+        "ETag: \"v2\"" CRLF
+        "Content-Length: 10" CRLF
+        CRLF
+        "ABCDEFGHIJ",
+        alloc);
+    bkt = serf_bucket_response_create(tmp, alloc);
+    serf__bucket_response_set_resume(bkt, 5, "\"v1\"");
+    status = serf_bucket_read(bkt, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, SERF_ERROR_TRUNCATED_HTTP_RESPONSE, status);
+    serf_bucket_destroy(bkt);
+}
+
+/* Fills the buffer with letters, and remembers how large it was. */
+static apr_status_t databuf_test_reader(void *baton, apr_size_t bufsize,
+                                        char *buf, apr_size_t *len)
+{
+    apr_size_t *last_bufsize = baton;
+
+    *last_bufsize = bufsize;
+    memset(buf, 'a', bufsize);
+    *len = bufsize;
+
+    return APR_SUCCESS;
+}
+
+/* Test that a databuf reads with the size that was set, and keeps its
+   unread data when the size changes. */
+static void test_databuf_bufsize(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf__databuf_t pdb;
+    serf_databuf_t *databuf = &pdb.databuf;
+    apr_size_t last_bufsize = 0;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    /* A databuf set up the public way reads into its own buffer. */
+    serf_databuf_init(&pdb.databuf);
+    databuf->read = databuf_test_reader;
+    databuf->read_baton = &last_bufsize;
+
+    status = serf_databuf_read(databuf, 10, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_DATABUF_BUFSIZE, last_bufsize);
+    CuAssertPtrEquals(tc, databuf->buf, (void *)data);
+    /* ... and can't hand it over. */
+    CuAssertPtrEquals(tc, NULL, serf_databuf_read_bucket(
+                                    databuf, &serf_bucket_type_simple,
+                                    alloc));
+
+    serf__databuf_init(&pdb, databuf_test_reader, &last_bufsize);
+
+    status = serf_databuf_read(databuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_DATABUF_BUFSIZE, last_bufsize);
+    CuAssertIntEquals(tc, SERF_DATABUF_BUFSIZE, len);
+
+    serf__databuf_set_bufsize(&pdb, 256 * 1024, alloc);
+    status = serf_databuf_read(databuf, SERF_READ_ALL_AVAIL, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 256 * 1024, last_bufsize);
+    CuAssertIntEquals(tc, 256 * 1024, len);
+
+    /* Read part of it, the rest has to survive going back to the
+       default buffer. */
+    status = serf_databuf_read(databuf, 10, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf__databuf_set_bufsize(&pdb, 100, alloc);
+    status = serf_databuf_read(databuf, 20, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 20, len);
+    CuAssertStrnEquals(tc, "aaaaaaaaaaaaaaaaaaaa", len, data);
+
+    serf__databuf_cleanup(&pdb);
+}
+
+/* Test splicing simple buckets off a databuf and a limited aggregate with
+   serf_bucket_read_bucket(), and moving them to another allocator. */
+static void test_bucket_splice_and_move(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf__databuf_t pdb;
+    serf_databuf_t *databuf = &pdb.databuf;
+    apr_size_t last_bufsize = 0;
+    serf_bucket_t *agg, *limit, *bkt, *moved, *resized;
+    const char *data, *spliced_data;
+    apr_size_t len;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_alloc_t *alloc2 = serf_bucket_allocator_create(tb->pool, NULL,
+                                                               NULL);
+
+    serf__databuf_init(&pdb, databuf_test_reader, &last_bufsize);
+
+    /* Nothing is buffered yet, and only simple buckets are handed over. */
+    CuAssertPtrEquals(tc, NULL, serf_databuf_read_bucket(
+                                    databuf, &serf_bucket_type_simple,
+                                    alloc));
+
+    status = serf_databuf_peek(databuf, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertPtrEquals(tc, NULL, serf_databuf_read_bucket(
+                                    databuf, &serf_bucket_type_aggregate,
+                                    alloc));
+
+    /* The first hand-over copies the data into a shared buffer. */
+    bkt = serf_databuf_read_bucket(databuf, &serf_bucket_type_simple, alloc);
+    CuAssertPtrNotNull(tc, bkt);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == SERF_DATABUF_BUFSIZE);
+    serf_bucket_destroy(bkt);
+
+    /* From then on the data is read into shared buffers and handed over
+       as it is. */
+    status = serf_databuf_read(databuf, 10, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = serf_databuf_peek(databuf, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, SERF_DATABUF_BUFSIZE - 10, len);
+
+    bkt = serf_databuf_read_bucket(databuf, &serf_bucket_type_simple, alloc);
+    CuAssertPtrNotNull(tc, bkt);
+    serf_bucket_peek(bkt, &spliced_data, &len);
+    CuAssertPtrEquals(tc, (void *)data, (void *)spliced_data);
+    CuAssertIntEquals(tc, SERF_DATABUF_BUFSIZE - 10, len);
+
+    /* A new size keeps reading into shared buffers. */
+    serf__databuf_set_bufsize(&pdb, 64 * 1024, alloc);
+    status = serf_databuf_peek(databuf, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 64 * 1024, len);
+    resized = serf_databuf_read_bucket(databuf, &serf_bucket_type_simple,
+                                       alloc);
+    CuAssertPtrNotNull(tc, resized);
+    serf_bucket_peek(resized, &spliced_data, &len);
+    CuAssertPtrEquals(tc, (void *)data, (void *)spliced_data);
+    CuAssertIntEquals(tc, 64 * 1024, len);
+    serf_bucket_destroy(resized);
+
+    /* The data outlives the databuf and the allocator it was read with. */
+    serf_bucket_peek(bkt, &spliced_data, &len);
+    moved = serf_bucket_move(bkt, alloc2);
+    CuAssertPtrNotNull(tc, moved);
+    CuAssertPtrEquals(tc, alloc2, moved->allocator);
+    serf__databuf_cleanup(&pdb);
+
+    serf_bucket_peek(moved, &data, &len);
+    CuAssertPtrEquals(tc, (void *)spliced_data, (void *)data);
+    CuAssertIntEquals(tc, SERF_DATABUF_BUFSIZE - 10, len);
+    CuAssertIntEquals(tc, 'a', data[len - 1]);
+    serf_bucket_destroy(moved);
+
+    /* A limit bucket splices off what fits in its limit. */
+    agg = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_append(agg, SERF_BUCKET_SIMPLE_STRING("", alloc));
+    serf_bucket_aggregate_append(agg, SERF_BUCKET_SIMPLE_STRING("abcd",
+                                                                alloc));
+    serf_bucket_aggregate_append(agg, SERF_BUCKET_SIMPLE_STRING("efgh",
+                                                                alloc));
+    limit = serf_bucket_limit_create(agg, 6, alloc);
+
+    bkt = serf_bucket_read_bucket(limit, &serf_bucket_type_simple);
+    CuAssertPtrNotNull(tc, bkt);
+    read_and_check_bucket(tc, bkt, "abcd");
+    serf_bucket_destroy(bkt);
+    CuAssertTrue(tc, serf_bucket_get_remaining(limit) == 2);
+
+    /* "efgh" runs past the limit, so it has to be read. */
+    CuAssertPtrEquals(tc, NULL,
+                      serf_bucket_read_bucket(limit,
+                                              &serf_bucket_type_simple));
+    read_and_check_bucket(tc, limit, "ef");
+    serf_bucket_destroy(limit);
+
+    /* Aggregates of movable buckets move as a whole, others stay. */
+    agg = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_append(agg, SERF_BUCKET_SIMPLE_STRING("abc", alloc));
+    serf_bucket_aggregate_append(agg, SERF_BUCKET_SIMPLE_STRING("def", alloc));
+
+    moved = serf_bucket_move(agg, alloc2);
+    CuAssertPtrNotNull(tc, moved);
+    CuAssertPtrEquals(tc, alloc2, moved->allocator);
+    read_and_check_bucket(tc, moved, "abcdef");
+
+    serf_bucket_aggregate_append(
+        moved, serf_bucket_simple_copy_create("ghi", 3, alloc2));
+    CuAssertPtrEquals(tc, NULL, serf_bucket_move(moved, alloc));
+    read_and_check_bucket(tc, moved, "ghi");
+    serf_bucket_destroy(moved);
+}
+
+/* Test that the length of a body is known from its Content-Length, and
+   that the body can be read into one buffer. */
+static void test_response_bucket_remaining(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    bkt = serf_bucket_response_create(
+              SERF_BUCKET_SIMPLE_STRING("HTTP/1.1 200 OK" CRLF
+                                        "Content-Length: 7" CRLF
+                                        CRLF
+                                        "abc1234", alloc),
+              alloc);
+
+    /* Nothing is known before the headers are read. */
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == SERF_LENGTH_UNKNOWN);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_response_wait_for_headers(bkt));
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 7);
+
+    status = serf_bucket_read(bkt, 3, &data, &len);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 3, (int)len);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 4);
+
+    status = serf_bucket_response_read_body(bkt, &data, &len, tb->pool);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 4, (int)len);
+    CuAssertTrue(tc, strncmp(data, "1234", len) == 0);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 0);
+    serf_bucket_destroy(bkt);
+
+    /* The length of a chunked body isn't known. */
+    bkt = serf_bucket_response_create(
+              SERF_BUCKET_SIMPLE_STRING("HTTP/1.1 200 OK" CRLF
+                                        "Transfer-Encoding: chunked" CRLF
+                                        CRLF
+                                        "3" CRLF "abc" CRLF
+                                        "4" CRLF "1234" CRLF
+                                        "0" CRLF CRLF, alloc),
+              alloc);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_response_wait_for_headers(bkt));
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == SERF_LENGTH_UNKNOWN);
+
+    status = serf_bucket_response_read_body(bkt, &data, &len, tb->pool);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 7, (int)len);
+    CuAssertTrue(tc, strncmp(data, "abc1234", len) == 0);
+    serf_bucket_destroy(bkt);
+
+    /* A huge Content-Length isn't allocated up front. */
+    bkt = serf_bucket_response_create(
+              SERF_BUCKET_SIMPLE_STRING("HTTP/1.1 200 OK" CRLF
+                                        "Content-Length: 1099511627776" CRLF
+                                        CRLF
+                                        "abc1234", alloc),
+              alloc);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_bucket_response_wait_for_headers(bkt));
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt)
+                         == APR_UINT64_C(1099511627776));
+
+    status = serf_bucket_response_read_body(bkt, &data, &len, tb->pool);
+    CuAssertIntEquals(tc, SERF_ERROR_TRUNCATED_HTTP_RESPONSE, status);
+    CuAssertIntEquals(tc, 7, (int)len);
+    CuAssertTrue(tc, strncmp(data, "abc1234", len) == 0);
+    serf_bucket_destroy(bkt);
+
+    /* A limit bucket reports the end of its stream before its limit. */
+    bkt = serf_bucket_limit_create(SERF_BUCKET_SIMPLE_STRING("abc", alloc),
+                                   10, alloc);
+    CuAssertTrue(tc, serf_bucket_get_remaining(bkt) == 3);
+    serf_bucket_destroy(bkt);
+}
+
+/* Test that the incoming request bucket parses pipelined requests, with
+   and without a body, and leaves the stream at the start of the next. */
+static void test_incoming_request_bucket(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *stream, *bkt;
+    serf_request_line rl;
+    char buf[1024];
+    apr_size_t len;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    stream = SERF_BUCKET_SIMPLE_STRING(
+        "GET /a HTTP/1.1" CRLF
+        "Host: localhost" CRLF
+        CRLF
+        "POST /b?x=1 HTTP/1.1" CRLF
+        "Content-Length: 5" CRLF
+        CRLF
+        "abcde"
+        "PUT /c HTTP/1.0" CRLF
+        "Transfer-Encoding: chunked" CRLF
+        CRLF
+        "3" CRLF "xyz" CRLF "0" CRLF "Trailer: t" CRLF CRLF
+        "BAD" CRLF CRLF,
+        alloc);
+
+    /* A GET without a body. */
+    bkt = serf_bucket_incoming_request_create(
+              serf_bucket_barrier_create(stream, alloc), alloc);
+    status = serf_bucket_incoming_request_wait_for_headers(bkt);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = serf_bucket_incoming_request_line(bkt, &rl);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "GET", rl.method);
+    CuAssertStrEquals(tc, "/a", rl.uri);
+    CuAssertIntEquals(tc, SERF_HTTP_11, rl.version);
+    CuAssertStrEquals(tc, "localhost",
+        serf_bucket_headers_get(serf_bucket_incoming_request_get_headers(bkt),
+                                "Host"));
+    status = read_all(bkt, buf, sizeof(buf), &len);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    CuAssertIntEquals(tc, 0, len);
+    serf_bucket_destroy(bkt);
+
+    /* A body with Content-Length. */
+    bkt = serf_bucket_incoming_request_create(
+              serf_bucket_barrier_create(stream, alloc), alloc);
+    status = serf_bucket_incoming_request_line(bkt, &rl);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertStrEquals(tc, "POST", rl.method);
+    CuAssertStrEquals(tc, "/b?x=1", rl.uri);
+    read_and_check_bucket(tc, bkt, "abcde");
+    serf_bucket_destroy(bkt);
+
+    /* A chunked body, with trailers. */
+    bkt = serf_bucket_incoming_request_create(
+              serf_bucket_barrier_create(stream, alloc), alloc);
+    status = serf_bucket_incoming_request_wait_for_headers(bkt);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_bucket_incoming_request_line(bkt, &rl);
+    CuAssertStrEquals(tc, "PUT", rl.method);
+    CuAssertIntEquals(tc, SERF_HTTP_10, rl.version);
+    read_and_check_bucket(tc, bkt, "xyz");
+    serf_bucket_destroy(bkt);
+
+    /* Not a request line. */
+    bkt = serf_bucket_incoming_request_create(
+              serf_bucket_barrier_create(stream, alloc), alloc);
+    status = serf_bucket_incoming_request_wait_for_headers(bkt);
+    CuAssertIntEquals(tc, SERF_ERROR_BAD_HTTP_REQUEST, status);
+    serf_bucket_destroy(bkt);
+
+    /* The end of the stream, between requests. */
+    bkt = serf_bucket_incoming_request_create(
+              serf_bucket_barrier_create(stream, alloc), alloc);
+    status = serf_bucket_incoming_request_wait_for_headers(bkt);
+    CuAssertIntEquals(tc, APR_EOF, status);
+    serf_bucket_destroy(bkt);
+    serf_bucket_destroy(stream);
+
+    /* A client that closes in the middle of the body. */
+    stream = SERF_BUCKET_SIMPLE_STRING(
+        "POST / HTTP/1.1" CRLF
+        "Content-Length: 10" CRLF
+        CRLF
+        "abc", alloc);
+    bkt = serf_bucket_incoming_request_create(stream, alloc);
+    status = read_all(bkt, buf, sizeof(buf), &len);
+    CuAssertIntEquals(tc, SERF_ERROR_BAD_HTTP_REQUEST, status);
+    serf_bucket_destroy(bkt);
+}
+
+/* Test the framing of the outgoing response bucket. */
+static void test_outgoing_response_bucket(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt, *body;
+    mockbkt_action actions[]= {
+        { 1, "abc", APR_EOF },
+    };
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    /* The length of a simple bucket is known. */
+    body = SERF_BUCKET_SIMPLE_STRING("abc", alloc);
+    bkt = serf_bucket_outgoing_response_create(body, 200, NULL, SERF_HTTP_11,
+                                               alloc);
+    serf_bucket_headers_setn(serf_bucket_outgoing_response_get_headers(bkt),
+                             "Content-Type", "text/plain");
+    read_and_check_bucket(tc, bkt,
+                          "HTTP/1.1 200 OK" CRLF
+                          "Content-Type: text/plain" CRLF
+                          "Content-Length: 3" CRLF
+                          CRLF
+                          "abc");
+    serf_bucket_destroy(bkt);
+
+    /* The length of a mock bucket isn't, so it's chunked. */
+    body = serf_bucket_mock_create(actions, 1, alloc);
+    bkt = serf_bucket_outgoing_response_create(body, 404, "Gone fishing",
+                                               SERF_HTTP_11, alloc);
+    read_and_check_bucket(tc, bkt,
+                          "HTTP/1.1 404 Gone fishing" CRLF
+                          "Transfer-Encoding: chunked" CRLF
+                          CRLF
+                          "3" CRLF "abc" CRLF "0" CRLF CRLF);
+    serf_bucket_destroy(bkt);
+
+    /* No body. */
+    bkt = serf_bucket_outgoing_response_create(NULL, 500, NULL, SERF_HTTP_10,
+                                               alloc);
+    read_and_check_bucket(tc, bkt,
+                          "HTTP/1.0 500 Internal Server Error" CRLF
+                          "Content-Length: 0" CRLF
+                          CRLF);
+    serf_bucket_destroy(bkt);
+
+    /* A 304 never has a body. */
+    body = SERF_BUCKET_SIMPLE_STRING("abc", alloc);
+    bkt = serf_bucket_outgoing_response_create(body, 304, NULL, SERF_HTTP_11,
+                                               alloc);
+    read_and_check_bucket(tc, bkt, "HTTP/1.1 304 Not Modified" CRLF CRLF);
+    serf_bucket_destroy(bkt);
+}
+
+/* Connect two sockets over the loopback interface. */
+static void create_socket_pair(CuTest *tc, apr_socket_t **client,
+                               apr_socket_t **server, apr_pool_t *pool)
+{
+    apr_socket_t *listener;
+    apr_sockaddr_t *addr;
+    apr_status_t status;
+
+    status = apr_sockaddr_info_get(&addr, "127.0.0.1", APR_INET, 0, 0, pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_create(&listener, APR_INET, SOCK_STREAM,
+                               APR_PROTO_TCP, pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_bind(listener, addr);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_listen(listener, 1);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_addr_get(&addr, APR_LOCAL, listener);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = apr_socket_create(client, APR_INET, SOCK_STREAM,
+                               APR_PROTO_TCP, pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_connect(*client, addr);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_accept(server, listener, pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    apr_socket_close(listener);
+}
+
+/* Read all of LEN bytes from the socket bucket BKT with read_iovec, and
+   check that they are the ones of EXPECTED, followed by EOF. */
+static void read_iovec_and_check_socket(CuTest *tc, serf_bucket_t *bkt,
+                                        const char *expected,
+                                        apr_size_t len)
+{
+    apr_size_t received = 0;
+    apr_status_t status;
+
+    do {
+        struct iovec vecs[16];
+        int vecs_used, i;
+
+        status = serf_bucket_read_iovec(bkt, SERF_READ_ALL_AVAIL, 16, vecs,
+                                        &vecs_used);
+        CuAssertTrue(tc, !SERF_BUCKET_READ_ERROR(status));
+        if (APR_STATUS_IS_EAGAIN(status) && !vecs_used)
+            apr_sleep(1000);
+
+        for (i = 0; i < vecs_used; i++) {
+            CuAssertTrue(tc, received + vecs[i].iov_len <= len);
+            CuAssertTrue(tc, memcmp(expected + received, vecs[i].iov_base,
+                                    vecs[i].iov_len) == 0);
+            received += vecs[i].iov_len;
+        }
+    } while (!APR_STATUS_IS_EOF(status));
+
+    CuAssertIntEquals(tc, len, received);
+}
+
+/* Test that the socket bucket hands up everything that was sent through
+   read_iovec, for a non-blocking socket and for one with a timeout. */
+static void test_socket_bucket_read_iovec(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    const apr_size_t len = 5 * SERF_DATABUF_BUFSIZE + 123;
+    apr_interval_time_t timeouts[2] = { 0, APR_USEC_PER_SEC };
+    char *data;
+    apr_size_t i;
+    int t;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    data = apr_palloc(tb->pool, len);
+    for (i = 0; i < len; i++)
+        data[i] = 'a' + (i % 26);
+
+    for (t = 0; t < 2; t++) {
+        apr_socket_t *client, *server;
+        serf_bucket_t *bkt;
+        apr_size_t written;
+        apr_status_t status;
+
+        create_socket_pair(tc, &client, &server, tb->pool);
+        apr_socket_timeout_set(client, APR_USEC_PER_SEC);
+        apr_socket_timeout_set(server, timeouts[t]);
+
+        /* The loopback socket buffers hold this much. */
+        written = len;
+        status = apr_socket_send(client, data, &written);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        CuAssertIntEquals(tc, len, written);
+        apr_socket_close(client);
+
+        bkt = serf_bucket_socket_create(server, alloc);
+        read_iovec_and_check_socket(tc, bkt, data, len);
+        serf_bucket_destroy(bkt);
+
+        apr_socket_close(server);
+    }
+}
+
 CuSuite *test_buckets(void)
 {
     CuSuite *suite = CuSuiteNew();
@@ -1748,6 +3597,7 @@ CuSuite *test_buckets(void)
     SUITE_ADD_TEST(suite, test_simple_bucket_readline);
     SUITE_ADD_TEST(suite, test_response_bucket_read);
     SUITE_ADD_TEST(suite, test_response_bucket_headers);
+    SUITE_ADD_TEST(suite, test_response_bucket_headers_in_place);
     SUITE_ADD_TEST(suite, test_response_bucket_chunked_read);
     SUITE_ADD_TEST(suite, test_response_body_too_small_cl);
     SUITE_ADD_TEST(suite, test_response_body_too_small_chunked);
@@ -1762,12 +3612,19 @@ CuSuite *test_buckets(void)
     SUITE_ADD_TEST(suite, test_iovec_buckets);
     SUITE_ADD_TEST(suite, test_aggregate_buckets);
     SUITE_ADD_TEST(suite, test_aggregate_bucket_readline);
+    SUITE_ADD_TEST(suite, test_aggregate_bucket_many_children);
+    SUITE_ADD_TEST(suite, test_shared_buckets);
     SUITE_ADD_TEST(suite, test_header_buckets);
+    SUITE_ADD_TEST(suite, test_header_buckets_iovec);
     SUITE_ADD_TEST(suite, test_linebuf_crlf_split);
     SUITE_ADD_TEST(suite, test_response_no_body_expected);
     SUITE_ADD_TEST(suite, test_random_eagain_in_response);
     SUITE_ADD_TEST(suite, test_dechunk_buckets);
+    SUITE_ADD_TEST(suite, test_dechunk_read_iovec);
     SUITE_ADD_TEST(suite, test_deflate_buckets);
+    SUITE_ADD_TEST(suite, test_deflate_truncated);
+    SUITE_ADD_TEST(suite, test_content_decode_buckets);
+    SUITE_ADD_TEST(suite, test_compress_buckets);
 #if 0
     /* This test for issue #152 takes a lot of time generating 4GB+ of random
        data so it's disabled by default. */
@@ -1779,6 +3636,22 @@ CuSuite *test_buckets(void)
 #endif
 
     SUITE_ADD_TEST(suite, test_linebuf_fetch_crlf);
+    SUITE_ADD_TEST(suite, test_allocator_size_classes);
+    SUITE_ADD_TEST(suite, test_allocator_stats);
+    SUITE_ADD_TEST(suite, test_file_bucket_read_for_sendfile);
+    SUITE_ADD_TEST(suite, test_chunk_bucket);
+    SUITE_ADD_TEST(suite, test_spill_bucket);
+    SUITE_ADD_TEST(suite, test_mmap_window_bucket);
+    SUITE_ADD_TEST(suite, test_hpack_decode);
+    SUITE_ADD_TEST(suite, test_hpack_encode_request);
+    SUITE_ADD_TEST(suite, test_http2_frame_buckets);
+    SUITE_ADD_TEST(suite, test_response_bucket_resume);
+    SUITE_ADD_TEST(suite, test_databuf_bufsize);
+    SUITE_ADD_TEST(suite, test_bucket_splice_and_move);
+    SUITE_ADD_TEST(suite, test_response_bucket_remaining);
+    SUITE_ADD_TEST(suite, test_incoming_request_bucket);
+    SUITE_ADD_TEST(suite, test_outgoing_response_bucket);
+    SUITE_ADD_TEST(suite, test_socket_bucket_read_iovec);
 
     return suite;
 }
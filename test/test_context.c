@@ -19,11 +19,16 @@
 #include <apr_pools.h>
 #include <apr_strings.h>
 #include <apr_version.h>
+#include <apr_atomic.h>
+#include <apr_time.h>
 
 #include "serf.h"
 
 #include "test_serf.h"
 
+/* test case has access to internal functions. */
+#include "serf_private.h"
+
 /* Validate that requests are sent and completed in the order of creation. */
 static void test_serf_connection_request_create(CuTest *tc)
 {
@@ -107,6 +112,59 @@ static void test_serf_connection_priority_request_create(CuTest *tc)
     }
 }
 
+/* Validate that requests in a higher priority class are sent before the
+   queued requests of a lower class, and that a class gets to send again
+   after its share. */
+static void test_request_priority_classes(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[6];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_status_t status;
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      DefaultResponse(WithCode(200), WithRequestBody)
+
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("3"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("4"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("5"))
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("6"))
+    EndGiven
+
+    /* Requests 4 and 6 are bulk transfers, the others are interactive and
+       get four times the share of the bulk class. */
+    setup_handler(tb, &handler_ctx[0], "GET", "/", 4, NULL);
+    serf_connection_request_create2(tb->connection, setup_request,
+                                    &handler_ctx[0], SERF_PRIORITY_DEFAULT);
+    setup_handler(tb, &handler_ctx[1], "GET", "/", 6, NULL);
+    serf_connection_request_create2(tb->connection, setup_request,
+                                    &handler_ctx[1], SERF_PRIORITY_DEFAULT);
+    for (i = 2; i < num_requests; i++) {
+        static const int req_ids[] = { 1, 2, 3, 5 };
+
+        setup_handler(tb, &handler_ctx[i], "GET", "/", req_ids[i - 2], NULL);
+        serf_connection_request_create2(tb->connection, setup_request,
+                                        &handler_ctx[i],
+                                        SERF_PRIORITY_DEFAULT + 2);
+    }
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    for (i = 0; i < tb->handled_requests->nelts; i++) {
+        int req_nr = APR_ARRAY_IDX(tb->handled_requests, i, int);
+        CuAssertIntEquals(tc, i + 1, req_nr);
+    }
+}
+
 /* Test that serf correctly handles the 'Connection:close' header when the
    server is planning to close the connection. */
 static void test_closed_connection(CuTest *tc)
@@ -581,6 +639,7 @@ static void test_keepalive_limit_one_by_one_and_burst(CuTest *tc)
 typedef struct progress_baton_t {
   apr_off_t read;
   apr_off_t written;
+  int calls;
 } progress_baton_t;
 
 static void
@@ -591,6 +650,7 @@ progress_cb(void *progress_baton, apr_off_t read, apr_off_t written)
 
     pb->read = read;
     pb->written = written;
+    pb->calls++;
 }
 
 static apr_status_t progress_conn_setup(apr_socket_t *skt,
@@ -648,6 +708,266 @@ static void test_progress_callback(CuTest *tc)
     CuAssertTrue(tc, pb->read > 0);
 }
 
+/* Test that batched progress is reported once the loop ran, and that it
+   adds up to what the connection counted. */
+static void test_progress_batching(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[5];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_off_t conn_read, conn_written;
+    int i;
+    progress_baton_t *pb;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, progress_conn_setup, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    pb = apr_pcalloc(tb->pool, sizeof(*pb));
+    tb->user_baton = pb;
+    serf_context_set_progress_cb(tb->context, progress_cb, tb);
+    serf_context_set_progress_batching(tb->context, 1, 0, 0);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"))
+        Respond(WithCode(200), WithChunkedBody("0123456789"))
+    EndGiven
+
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i+1);
+    }
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    serf_connection_get_progress(tb->connection, &conn_read, &conn_written);
+    CuAssertTrue(tc, conn_read > 0);
+    CuAssertTrue(tc, conn_written > 0);
+
+    CuAssertTrue(tc, pb->calls > 0);
+    CuAssertTrue(tc, pb->read == conn_read);
+    CuAssertTrue(tc, pb->written == conn_written);
+}
+
+typedef struct timings_baton_t {
+    int calls;
+    int in_order;
+} timings_baton_t;
+
+static void timings_cb(void *baton,
+                       serf_request_t *request,
+                       const serf_request_timings_t *timings,
+                       const serf_connection_timings_t *conn_timings)
+{
+    timings_baton_t *tmb = baton;
+
+    tmb->calls++;
+    if (timings->created > 0
+        && timings->write_start >= timings->created
+        && timings->written >= timings->write_start
+        && timings->first_byte >= timings->written
+        && timings->done >= timings->first_byte
+        && conn_timings->connect_start > 0
+        && conn_timings->connect_done >= conn_timings->connect_start
+        && conn_timings->bytes_written > 0)
+        tmb->in_order++;
+}
+
+/* Test that the timings of each request are reported when it's done, with
+   its phases in the order they happened. */
+static void test_request_timings(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_connection_timings_t conn_timings;
+    timings_baton_t tmb = { 0 };
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_timings_callback(tb->connection, timings_cb, &tmb);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"))
+        Respond(WithCode(200), WithChunkedBody("0123456789"))
+    EndGiven
+
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/", i+1);
+    }
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    CuAssertIntEquals(tc, num_requests, tmb.calls);
+    CuAssertIntEquals(tc, num_requests, tmb.in_order);
+
+    serf_connection_get_timings(tb->connection, &conn_timings);
+    CuAssertTrue(tc, conn_timings.connect_done > 0);
+    CuAssertIntEquals(tc, 0, (int)conn_timings.handshake_done);
+    CuAssertTrue(tc, conn_timings.bytes_read > 0);
+}
+
+/* Test that the metrics of a connection count its requests, responses and
+   resets, and that those of the context still include them after the
+   connection was closed. */
+static void test_connection_metrics(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[10];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_metrics_t metrics, ctx_metrics;
+    apr_uint64_t depths = 0;
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    InitMockServers(tb->mh)
+      ConfigServerWithID("server", WithMaxKeepAliveRequests(4))
+    EndInit
+
+    Given(tb->mh)
+      DefaultResponse(WithCode(200), WithRequestBody)
+
+      GETRequest(URLEqualTo("/index.html"))
+    EndGiven
+
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+    }
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_get_metrics(tb->connection, &metrics);
+    CuAssertIntEquals(tc, num_requests, (int)metrics.responses_completed);
+    CuAssertTrue(tc, metrics.requests_completed >= num_requests);
+    CuAssertTrue(tc, metrics.resets >= 2);
+    CuAssertTrue(tc, metrics.bytes_read > 0);
+    CuAssertTrue(tc, metrics.bytes_written > 0);
+    CuAssertIntEquals(tc, 0, (int)metrics.handshakes_full);
+    CuAssertIntEquals(tc, 0, (int)metrics.auth_round_trips);
+    for (i = 0; i < SERF_METRICS_DEPTH_BUCKETS; i++)
+        depths += metrics.depth_histogram[i];
+    CuAssertTrue(tc, depths == metrics.requests_completed);
+
+    serf_connection_close(tb->connection);
+    serf_context_get_metrics(tb->context, &ctx_metrics);
+    CuAssertTrue(tc, ctx_metrics.responses_completed ==
+                     metrics.responses_completed);
+    CuAssertTrue(tc, ctx_metrics.bytes_read == metrics.bytes_read);
+    CuAssertTrue(tc, ctx_metrics.resets == metrics.resets);
+}
+
+/* Test that the traffic of a connection is recorded in the trace file, with
+   the payload sampled. */
+static void test_trace_to_file(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[1];
+    apr_pool_t *trace_pool;
+    const char *tmpdir, *path;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    unsigned char *buf;
+    apr_size_t len, pos;
+    int seen_open = 0, seen_send = 0, seen_recv = 0;
+    apr_uint32_t conn_id = 0;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, progress_conn_setup, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, APR_SUCCESS, apr_temp_dir_get(&tmpdir, tb->pool));
+    path = apr_pstrcat(tb->pool, tmpdir, "/serf_test_trace", NULL);
+
+    apr_pool_create(&trace_pool, tb->pool);
+    status = serf_context_trace_to_file(tb->context, path, 64 * 1024, 16,
+                                        trace_pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"))
+        Respond(WithCode(200), WithChunkedBody("0123456789"))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, 1, handler_ctx,
+                                                tb->pool);
+
+    /* Stop the trace. */
+    apr_pool_destroy(trace_pool);
+
+    status = apr_file_open(&file, path,
+                           APR_FOPEN_READ | APR_FOPEN_BINARY |
+                           APR_FOPEN_DELONCLOSE,
+                           APR_OS_DEFAULT, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_info_get(&finfo, APR_FINFO_SIZE, file));
+    buf = apr_palloc(tb->pool, (apr_size_t)finfo.size);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_read_full(file, buf, (apr_size_t)finfo.size,
+                                         &len));
+    apr_file_close(file);
+
+    /* The file is cut down to the end of the last record. */
+    CuAssertTrue(tc, len > 40);
+    CuAssertIntEquals(tc, 0, memcmp(buf, "SERFTRC", 8));
+    CuAssertIntEquals(tc, 16, trace_uint32(buf + 12));
+    CuAssertIntEquals(tc, 0, trace_uint32(buf + 24));
+    CuAssertIntEquals(tc, len, trace_uint32(buf + 28));
+
+    for (pos = 40; pos < len; ) {
+        const unsigned char *record = buf + pos;
+        apr_uint32_t captured = trace_uint32(record + 20);
+
+        /* All traffic is on the one connection. */
+        if (!conn_id)
+            conn_id = trace_uint32(record + 8);
+        CuAssertTrue(tc, conn_id != 0);
+        CuAssertIntEquals(tc, conn_id, trace_uint32(record + 8));
+        CuAssertTrue(tc, captured <= trace_uint32(record + 16));
+
+        switch (trace_uint32(record + 12)) {
+            case SERF_TRACE_OPEN:
+                seen_open++;
+                break;
+            case SERF_TRACE_SEND:
+                CuAssertIntEquals(tc, 16, captured);
+                if (!seen_send++)
+                    CuAssertIntEquals(tc, 0, memcmp(record + 24, "GET / ", 6));
+                break;
+            case SERF_TRACE_RECV:
+                CuAssertTrue(tc, captured <= 16);
+                if (!seen_recv++)
+                    CuAssertIntEquals(tc, 0,
+                                      memcmp(record + 24, "HTTP/1.1 200", 12));
+                break;
+        }
+        pos += 24 + captured;
+    }
+    CuAssertIntEquals(tc, len, pos);
+    CuAssertIntEquals(tc, 1, seen_open);
+    CuAssertTrue(tc, seen_send > 0);
+    CuAssertTrue(tc, seen_recv > 0);
+}
+
 /* Test that username:password components in url are ignored. */
 static void test_connection_userinfo_in_url(CuTest *tc)
 {
@@ -968,7 +1288,1251 @@ static void test_max_keepalive_requests(CuTest *tc)
     CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
 }
 
-/*****************************************************************************/
+/* Test that a new connection to a host starts with the keepalive limit an
+   earlier connection to that host learned, so that it doesn't send more
+   requests than the server will answer. */
+static void test_keepalive_limit_per_host(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[8];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    InitMockServers(tb->mh)
+      ConfigServerWithID("server", WithMaxKeepAliveRequests(4))
+    EndInit
+
+    Given(tb->mh)
+      DefaultResponse(WithCode(200), WithRequestBody)
+
+      GETRequest(URLEqualTo("/index.html"))
+    EndGiven
+
+    /* Let the first connection learn the limit. */
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+    }
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    apr_array_clear(tb->sent_requests);
+    apr_array_clear(tb->accepted_requests);
+    apr_array_clear(tb->handled_requests);
+
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+    }
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+
+    /* Only the request after the limit, which tells whether the server
+       still closes there, is sent twice. */
+    CuAssertTrue(tc, tb->sent_requests->nelts <= num_requests + 1);
+}
+
+/* Test that adaptive pipelining delivers all responses while the server
+   keeps closing the connection mid-pipeline. */
+static void test_adaptive_pipelining(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[100];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    serf_connection_set_adaptive_pipelining(tb->connection, 0, 16);
+
+    InitMockServers(tb->mh)
+      ConfigServerWithID("server", WithMaxKeepAliveRequests(7))
+    EndInit
+
+    Given(tb->mh)
+      DefaultResponse(WithCode(200), WithRequestBody)
+
+      GETRequest(URLEqualTo("/index.html"))
+    EndGiven
+
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+    }
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Verify(tb->mh)
+      CuAssert(tc, ErrorMessage, VerifyAllRequestsReceived);
+      CuAssertIntEquals(tc, num_requests, VerifyStats->requestsResponded);
+    EndVerify
+    CuAssertIntEquals(tc, num_requests, tb->accepted_requests->nelts);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* Test that the client reads all pipelined chunked and gzipped responses
+   from the multi-threaded throughput server, with keepalive limits. */
+static void test_throughput_server(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    apr_status_t status;
+    handler_baton_t handler_ctx[100];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int i;
+
+    if (!tb->mh)
+        tb->mh = mhInit();
+
+    InitMockServers(tb->mh)
+      SetupThroughputServer(WithPort(30080), WithWorkerThreads(2),
+                            WithResponseBodySize(100000),
+                            WithChunkedResponses(4096), WithGzipResponses,
+                            WithMaxKeepAliveRequests(7))
+    EndInit
+    tb->serv_port = mhServerPortNr(tb->mh);
+    tb->serv_host = apr_psprintf(tb->pool, "%s:%d", "localhost", tb->serv_port);
+    tb->serv_url = apr_psprintf(tb->pool, "http://%s", tb->serv_host);
+
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+    }
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* Like handle_response(), but a request that timed out is recorded in the
+   array of tb->user_baton instead of being sent again. */
+static apr_status_t handle_response_or_timeout(serf_request_t *request,
+                                               serf_bucket_t *response,
+                                               void *handler_baton,
+                                               apr_pool_t *pool)
+{
+    handler_baton_t *ctx = handler_baton;
+
+    if (serf_request_timed_out(request)) {
+        apr_array_header_t *timed_out = ctx->tb->user_baton;
+
+        if (response)
+            return SERF_ERROR_ISSUE_IN_TESTSUITE;
+
+        APR_ARRAY_PUSH(timed_out, int) = ctx->req_id;
+        ctx->done = TRUE;
+        return APR_SUCCESS;
+    }
+
+    return handle_response(request, response, handler_baton, pool);
+}
+
+static void create_new_request_with_timeouts(
+    test_baton_t *tb,
+    handler_baton_t *handler_ctx,
+    int req_id,
+    apr_interval_time_t first_byte_timeout,
+    apr_interval_time_t total_timeout)
+{
+    serf_request_t *request;
+
+    setup_handler(tb, handler_ctx, "GET", "/", req_id,
+                  handle_response_or_timeout);
+    request = serf_connection_request_create(tb->connection, setup_request,
+                                             handler_ctx);
+    serf_request_set_timeouts(request, first_byte_timeout, total_timeout);
+}
+
+/* Set up a client for the throughput server, which answers each request
+   LATENCY msec after it arrived. */
+static apr_status_t setup_test_latency_server(test_baton_t *tb,
+                                              unsigned int latency)
+{
+    if (!tb->mh)
+        tb->mh = mhInit();
+
+    InitMockServers(tb->mh)
+      SetupThroughputServer(WithPort(30080), WithResponseLatency(latency))
+    EndInit
+    tb->serv_port = mhServerPortNr(tb->mh);
+    tb->serv_host = apr_psprintf(tb->pool, "%s:%d", "localhost", tb->serv_port);
+    tb->serv_url = apr_psprintf(tb->pool, "http://%s", tb->serv_host);
+    tb->user_baton = apr_array_make(tb->pool, 1, sizeof(int));
+
+    return setup_test_client_context(tb, NULL, tb->pool);
+}
+
+/* Run the client, without servers, for DURATION or until it fails. */
+static apr_status_t run_client_for(test_baton_t *tb,
+                                   apr_interval_time_t duration)
+{
+    apr_time_t finish_time = apr_time_now() + duration;
+    apr_pool_t *iter_pool;
+    apr_status_t status = APR_SUCCESS;
+
+    apr_pool_create(&iter_pool, tb->pool);
+
+    while (apr_time_now() < finish_time) {
+        apr_pool_clear(iter_pool);
+
+        status = serf_context_run(tb->context, apr_time_from_msec(10),
+                                  iter_pool);
+        if (APR_STATUS_IS_TIMEUP(status))
+            status = APR_SUCCESS;
+        if (status)
+            break;
+    }
+
+    apr_pool_destroy(iter_pool);
+
+    return status;
+}
+
+/* Test that a request that times out before it is written is cancelled,
+   and that the requests before and after it still get their response. */
+static void test_request_timeout_unwritten(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_array_header_t *timed_out;
+    serf_metrics_t metrics;
+    apr_status_t status;
+
+    status = setup_test_latency_server(tb, 500);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    timed_out = tb->user_baton;
+
+    /* Request 2 waits for the response to request 1. */
+    serf_connection_set_max_outstanding_requests(tb->connection, 1);
+    create_new_request_with_timeouts(tb, &handler_ctx[0], 1, 0, 0);
+    create_new_request_with_timeouts(tb, &handler_ctx[1], 2, 0,
+                                     apr_time_from_msec(100));
+    create_new_request_with_timeouts(tb, &handler_ctx[2], 3, 0, 0);
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, 1, timed_out->nelts);
+    CuAssertIntEquals(tc, 2, APR_ARRAY_IDX(timed_out, 0, int));
+    CuAssertIntEquals(tc, 2, tb->handled_requests->nelts);
+    CuAssertIntEquals(tc, 1, APR_ARRAY_IDX(tb->handled_requests, 0, int));
+    CuAssertIntEquals(tc, 3, APR_ARRAY_IDX(tb->handled_requests, 1, int));
+
+    /* Nothing was on the connection that had to be undone. */
+    serf_connection_get_metrics(tb->connection, &metrics);
+    CuAssertIntEquals(tc, 0, (int)metrics.resets);
+}
+
+/* Test that a pipelined request that gets no response in time is
+   cancelled, and that the requests written with it are sent again on a
+   new connection. */
+static void test_request_timeout_written(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_array_header_t *timed_out;
+    serf_metrics_t metrics;
+    apr_status_t status;
+
+    status = setup_test_latency_server(tb, 500);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    timed_out = tb->user_baton;
+
+    create_new_request_with_timeouts(tb, &handler_ctx[0], 1, 0, 0);
+    create_new_request_with_timeouts(tb, &handler_ctx[1], 2,
+                                     apr_time_from_msec(100), 0);
+    create_new_request_with_timeouts(tb, &handler_ctx[2], 3, 0, 0);
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    CuAssertIntEquals(tc, 1, timed_out->nelts);
+    CuAssertIntEquals(tc, 2, APR_ARRAY_IDX(timed_out, 0, int));
+    CuAssertIntEquals(tc, 2, tb->handled_requests->nelts);
+    CuAssertIntEquals(tc, 1, APR_ARRAY_IDX(tb->handled_requests, 0, int));
+    CuAssertIntEquals(tc, 3, APR_ARRAY_IDX(tb->handled_requests, 1, int));
+
+    /* Requests 1 and 3 went out again, on the second connection. */
+    CuAssertIntEquals(tc, 5, tb->sent_requests->nelts);
+    serf_connection_get_metrics(tb->connection, &metrics);
+    CuAssertIntEquals(tc, 1, (int)metrics.resets);
+    CuAssertIntEquals(tc, 2, (int)metrics.responses_completed);
+}
+
+/* Test that a connection without requests is closed after its idle
+   timeout, and opened again for the next request. */
+static void test_connection_idle_timeout(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    serf_metrics_t metrics;
+    apr_status_t status;
+
+    status = setup_test_latency_server(tb, 0);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_connection_set_timeouts(tb->connection, 0, apr_time_from_msec(100));
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    status = run_client_and_mock_servers_loops(tb, 1, handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = run_client_for(tb, apr_time_from_msec(500));
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_connection_get_metrics(tb->connection, &metrics);
+    CuAssertIntEquals(tc, 1, (int)metrics.resets);
+
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+    status = run_client_and_mock_servers_loops(tb, 1, &handler_ctx[1],
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, tb->handled_requests->nelts);
+
+    serf_connection_get_metrics(tb->connection, &metrics);
+    CuAssertIntEquals(tc, 1, (int)metrics.resets);
+    CuAssertIntEquals(tc, 2, (int)metrics.responses_completed);
+}
+
+/* Test that connecting to a server that doesn't answer fails after the
+   connect timeout. */
+static void test_connection_connect_timeout(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    apr_socket_t *listener, *filler;
+    apr_sockaddr_t *addr;
+    apr_status_t status;
+    int i;
+
+    /* A listener that never accepts ignores new connections once its
+       backlog is full, as an unreachable host would. */
+    status = apr_sockaddr_info_get(&addr, "127.0.0.1", APR_INET, 0, 0,
+                                   tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_create(&listener, APR_INET, SOCK_STREAM,
+                               APR_PROTO_TCP, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_bind(listener, addr);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_listen(listener, 0);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_addr_get(&addr, APR_LOCAL, listener);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    for (i = 0; i < 3; i++) {
+        status = apr_socket_create(&filler, APR_INET, SOCK_STREAM,
+                                   APR_PROTO_TCP, tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        apr_socket_timeout_set(filler, 0);
+        status = apr_socket_connect(filler, addr);
+        CuAssertTrue(tc, status == APR_SUCCESS
+                         || APR_STATUS_IS_EINPROGRESS(status));
+    }
+    apr_sleep(apr_time_from_msec(100));
+
+    tb->serv_url = apr_psprintf(tb->pool, "http://127.0.0.1:%d", addr->port);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_connection_set_timeouts(tb->connection, apr_time_from_msec(200), 0);
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    status = run_client_for(tb, apr_time_from_sec(5));
+    CuAssertIntEquals(tc, SERF_ERROR_CONNECTION_TIMEDOUT, status);
+    CuAssertIntEquals(tc, 0, tb->handled_requests->nelts);
+}
+
+/* Test that serf_context_fetch_urls() gets all URLs of a batch in one
+   call, and reports the ones it can't parse. */
+static void test_context_fetch_urls(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_fetch_result_t results[21];
+    const char *urls[21];
+    const int num_urls = sizeof(urls)/sizeof(urls[0]);
+    apr_status_t status;
+    int i;
+
+    if (!tb->mh)
+        tb->mh = mhInit();
+
+    InitMockServers(tb->mh)
+      SetupThroughputServer(WithPort(30080), WithWorkerThreads(2),
+                            WithResponseBodySize(10000),
+                            WithMaxKeepAliveRequests(5))
+    EndInit
+
+    for (i = 0; i < num_urls - 1; i++)
+        urls[i] = apr_psprintf(tb->pool, "http://localhost:%d/%d",
+                               mhServerPortNr(tb->mh), i);
+    urls[i] = "not a url";
+
+    tb->context = serf_context_create(tb->pool);
+    status = serf_context_fetch_urls(results, tb->context, urls, num_urls,
+                                     2, apr_time_from_sec(15), tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    for (i = 0; i < num_urls - 1; i++) {
+        CuAssertIntEquals(tc, APR_SUCCESS, results[i].status);
+        CuAssertIntEquals(tc, 200, results[i].code);
+        CuAssertIntEquals(tc, 10000, (int)results[i].body_len);
+    }
+    CuAssertIntEquals(tc, APR_EINVAL, results[i].status);
+}
+
+/* Test that connections that look up the server address in the
+   background deliver their requests, the second one using the cached
+   address. */
+static void test_connection_create_async(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[4];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_connection_t *conns[2];
+    apr_uri_t url;
+    apr_status_t status;
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      DefaultResponse(WithCode(200), WithRequestBody)
+
+      GETRequest(URLEqualTo("/index.html"))
+    EndGiven
+
+    apr_uri_parse(tb->pool, tb->serv_url, &url);
+    for (i = 0; i < 2; i++) {
+        status = serf_connection_create_async(&conns[i], tb->context, url,
+                                              tb->conn_setup, tb,
+                                              NULL, NULL,
+                                              tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+    }
+
+    for (i = 0 ; i < num_requests ; i++) {
+        tb->connection = conns[i % 2];
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+    }
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Verify(tb->mh)
+      CuAssert(tc, ErrorMessage, VerifyAllRequestsReceived);
+    EndVerify
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+
+    for (i = 0; i < 2; i++)
+        serf_connection_close(conns[i]);
+}
+
+/* Test that a prewarmed connection is set up before it has a request, and
+   still handles the requests created afterwards. */
+static void test_connection_prewarm(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_time_t finish_time;
+    apr_status_t status;
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/index.html"))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    CuAssertTrue(tc, serf_connection_get_latency(tb->connection) < 0);
+
+    serf_connection_prewarm(tb->connection);
+
+    /* The latency is known once the connection is set up. */
+    finish_time = apr_time_now() + apr_time_from_sec(15);
+    while (serf_connection_get_latency(tb->connection) < 0) {
+        status = run_client_and_mock_servers_loops(tb, 0, handler_ctx,
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        CuAssertTrue(tc, apr_time_now() < finish_time);
+    }
+
+    for (i = 0 ; i < num_requests ; i++)
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    Verify(tb->mh)
+      CuAssert(tc, ErrorMessage, VerifyAllRequestsReceived);
+    EndVerify
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* A connection racing its addresses uses the one that accepts, when the
+   other refuses. */
+static void test_happy_eyeballs(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_sockaddr_t *refused;
+    const char *remote_ip;
+    apr_status_t status;
+    int i;
+
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Nothing listens on port 1, try it first. */
+    status = apr_sockaddr_info_get(&refused, "127.0.0.1", APR_INET, 1, 0,
+                                   tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    refused->next = tb->connection->address;
+    tb->connection->address = refused;
+
+    serf_connection_set_happy_eyeballs(tb->connection, 1);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/index.html"))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    for (i = 0 ; i < num_requests ; i++) {
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+    }
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+
+    serf_config_get_string(tb->connection->config, SERF_CONFIG_CONN_REMOTEIP,
+                           &remote_ip);
+    CuAssertPtrNotNull(tc, remote_ip);
+    CuAssertStrEquals(tc, apr_psprintf(tb->pool, ":%d", tb->serv_port),
+                      strrchr(remote_ip, ':'));
+}
+
+/* Test that pipelined requests on a corked connection all get through. */
+static void test_connection_cork(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[20];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_status_t status;
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/index.html"))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    serf_connection_set_cork(tb->connection, 1);
+
+    for (i = 0 ; i < num_requests ; i++)
+        create_new_request(tb, &handler_ctx[i], "GET", "/index.html", i+1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+
+    Verify(tb->mh)
+      CuAssert(tc, ErrorMessage, VerifyAllRequestsReceived);
+    EndVerify
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* Pauses reading on the first response it sees, and leaves it to the test
+   to resume. */
+static apr_status_t handle_response_pause(serf_request_t *request,
+                                          serf_bucket_t *response,
+                                          void *handler_baton,
+                                          apr_pool_t *pool)
+{
+    handler_baton_t *ctx = handler_baton;
+
+    if (response && !ctx->tb->user_baton) {
+        ctx->tb->user_baton = request;
+        serf_request_pause_reading(request);
+        return APR_EAGAIN;
+    }
+
+    return handle_response(request, response, handler_baton, pool);
+}
+
+/* Test that no responses are handled while reading is paused, and that
+   they all are after it's resumed. */
+static void test_request_pause_reading(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_time_t finish_time;
+    apr_status_t status;
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/index.html"))
+        Respond(WithCode(200), WithChunkedBody("0123456789"))
+    EndGiven
+
+    for (i = 0; i < num_requests; i++) {
+        setup_handler(tb, &handler_ctx[i], "GET", "/index.html", i + 1,
+                      handle_response_pause);
+        serf_connection_request_create(tb->connection, setup_request,
+                                       &handler_ctx[i]);
+    }
+
+    finish_time = apr_time_now() + apr_time_from_sec(15);
+    while (!tb->user_baton) {
+        status = run_client_and_mock_servers_loops(tb, 0, handler_ctx,
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+        CuAssertTrue(tc, apr_time_now() < finish_time);
+    }
+
+    for (i = 0; i < 20; i++) {
+        status = run_client_and_mock_servers_loops(tb, 0, handler_ctx,
+                                                   tb->pool);
+        CuAssertIntEquals(tc, APR_SUCCESS, status);
+    }
+    CuAssertIntEquals(tc, 0, tb->handled_requests->nelts);
+
+    serf_request_resume_reading(tb->user_baton);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* Test that a host pool spreads requests over more connections when the
+   existing ones are busy, up to its limit. */
+static void test_host_pool_request_create(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[10];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    serf_host_pool_t *hpool;
+    apr_uri_t url;
+    apr_status_t status;
+    int i;
+
+    /* Set up a test context with a server */
+    setup_test_mock_server(tb);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      DefaultResponse(WithCode(200), WithRequestBody)
+
+      GETRequest(URLEqualTo("/"), HeaderEqualTo("Host", tb->serv_host))
+    EndGiven
+
+    status = apr_uri_parse(tb->pool, tb->serv_url, &url);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_host_pool_create(&hpool, tb->context, url, 3, 0,
+                                   tb->conn_setup, tb, NULL, NULL,
+                                   tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 0, serf_host_pool_connections(hpool));
+
+    for (i = 0; i < num_requests; i++) {
+        setup_handler(tb, &handler_ctx[i], "GET", "/", i + 1, NULL);
+        CuAssertPtrNotNull(tc,
+                           serf_host_pool_request_create(hpool,
+                                                         setup_request,
+                                                         &handler_ctx[i]));
+    }
+
+    /* All requests were queued at once, so all connections are used. */
+    CuAssertIntEquals(tc, 3, serf_host_pool_connections(hpool));
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+typedef struct group_task_baton_t {
+    serf_context_t *ctx;
+    volatile apr_uint32_t ran;
+} group_task_baton_t;
+
+static void group_task(serf_context_t *ctx, void *task_baton)
+{
+    group_task_baton_t *baton = task_baton;
+
+    baton->ctx = ctx;
+    apr_atomic_inc32(&baton->ran);
+}
+
+/* Test that tasks posted to a context group run on the loop of the
+   requested context. */
+static void test_context_group_post(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_context_group_t *group;
+    serf_context_t *ctx;
+    group_task_baton_t baton;
+    apr_status_t status;
+    int i;
+
+    status = serf_context_group_create(&group, 4, tb->pool);
+#if !APR_HAS_THREADS
+    CuAssertIntEquals(tc, APR_ENOTIMPL, status);
+    return;
+#endif
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* The same host always maps to the same loop. */
+    ctx = serf_context_group_get(group, "localhost:12345");
+    CuAssertPtrNotNull(tc, ctx);
+    CuAssertPtrEquals(tc, ctx, serf_context_group_get(group,
+                                                      "localhost:12345"));
+
+    baton.ctx = NULL;
+    apr_atomic_set32(&baton.ran, 0);
+
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_context_group_start(group));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_context_group_post(group, ctx, group_task,
+                                              &baton));
+
+    for (i = 0; i < 500 && !apr_atomic_read32(&baton.ran); i++)
+        apr_sleep(10000);
+
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_context_group_stop(group));
+    CuAssertIntEquals(tc, 1, apr_atomic_read32(&baton.ran));
+    CuAssertPtrEquals(tc, ctx, baton.ctx);
+}
+
+/*****************************************************************************/
+/* The HTTP/2 connection engine, against a server that sends the frames the
+   test gives it. */
+
+/* The connection preface the client starts with. */
+#define H2_PREFACE_LEN 24
+
+typedef struct h2_server_t {
+    apr_socket_t *listener;
+
+    /* The connection accepted last, and the stream the client reads the
+       frames from on it. */
+    apr_socket_t *peer;
+    serf_bucket_t *frames;
+    int connections;
+
+    /* What the client sent on PEER so far. */
+    char sent[16384];
+    apr_size_t sent_len;
+} h2_server_t;
+
+static apr_status_t h2_hold_open(void *baton, serf_bucket_t *aggregate)
+{
+    return APR_EAGAIN;
+}
+
+/* Accept the connection of the client, and have it read the frames of the
+   test instead of what arrives on the socket. */
+static apr_status_t h2_conn_setup(apr_socket_t *skt,
+                                  serf_bucket_t **input_bkt,
+                                  serf_bucket_t **output_bkt,
+                                  void *setup_baton,
+                                  apr_pool_t *pool)
+{
+    test_baton_t *tb = setup_baton;
+    h2_server_t *srv = tb->user_baton;
+    apr_size_t len = 1;
+    apr_status_t status;
+
+    status = apr_socket_accept(&srv->peer, srv->listener, tb->pool);
+    if (status)
+        return status;
+
+    /* Keeps the socket of the client readable, so it reads the frames as
+       soon as they are there. */
+    status = apr_socket_send(srv->peer, "x", &len);
+    if (status)
+        return status;
+    apr_socket_timeout_set(srv->peer, 0);
+    srv->sent_len = 0;
+
+    srv->frames = serf_bucket_aggregate_create(tb->bkt_alloc);
+    serf_bucket_aggregate_hold_open(srv->frames, h2_hold_open, NULL);
+    *input_bkt = srv->frames;
+    srv->connections++;
+
+    return APR_SUCCESS;
+}
+
+/* Set up a context with an HTTP/2 connection to the server of the test. */
+static h2_server_t *setup_h2_server(CuTest *tc, test_baton_t *tb)
+{
+    h2_server_t *srv = apr_pcalloc(tb->pool, sizeof(*srv));
+    apr_sockaddr_t *addr;
+    apr_status_t status;
+
+    status = apr_sockaddr_info_get(&addr, "127.0.0.1", APR_INET, 0, 0,
+                                   tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_create(&srv->listener, APR_INET, SOCK_STREAM,
+                               APR_PROTO_TCP, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_bind(srv->listener, addr);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_listen(srv->listener, 5);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    status = apr_socket_addr_get(&addr, APR_LOCAL, srv->listener);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    /* Don't wait forever for a client that doesn't connect. */
+    apr_socket_timeout_set(srv->listener, apr_time_from_sec(5));
+
+    tb->user_baton = srv;
+    tb->serv_url = apr_psprintf(tb->pool, "http://127.0.0.1:%d",
+                                addr->port);
+    tb->context = serf_context_create(tb->pool);
+    tb->conn_setup = h2_conn_setup;
+    status = use_new_connection(tb, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_connection_set_framing_type(
+                 tb->connection, SERF_CONNECTION_FRAMING_TYPE_HTTP2);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    return srv;
+}
+
+/* Have the server send a frame with a copy of the LEN bytes of PAYLOAD. */
+static void h2_send_frame(test_baton_t *tb, unsigned char frame_type,
+                          unsigned char flags, apr_uint32_t stream_id,
+                          const char *payload, apr_size_t len)
+{
+    h2_server_t *srv = tb->user_baton;
+    serf_bucket_t *bkt = NULL;
+
+    if (len)
+        bkt = serf_bucket_simple_copy_create(payload, len, tb->bkt_alloc);
+
+    serf_bucket_aggregate_append(srv->frames,
+        serf_bucket_http2_frame_create(bkt, frame_type, flags, stream_id,
+                                       tb->bkt_alloc));
+}
+
+/* Have the server send the response to request REQ_ID on STREAM_ID: a 200
+   with the id of the request as body. */
+static void h2_send_response(test_baton_t *tb, apr_uint32_t stream_id,
+                             int req_id)
+{
+    const char *body = apr_psprintf(tb->pool, "%d", req_id);
+
+    /* :status 200, from the static table. */
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_HEADERS,
+                  SERF_HTTP2_FLAG_END_HEADERS, stream_id, "\x88", 1);
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_DATA, SERF_HTTP2_FLAG_END_STREAM,
+                  stream_id, body, strlen(body));
+}
+
+static void h2_put_uint32(char *buf, apr_uint32_t value)
+{
+    buf[0] = (char)((value >> 24) & 0xff);
+    buf[1] = (char)((value >> 16) & 0xff);
+    buf[2] = (char)((value >> 8) & 0xff);
+    buf[3] = (char)(value & 0xff);
+}
+
+/* Find the first frame of FRAME_TYPE with all of FLAGS that the client
+   sent on the connection accepted last. Returns its payload, or NULL. */
+static const unsigned char *h2_find_sent_frame(h2_server_t *srv,
+                                               unsigned char frame_type,
+                                               unsigned char flags,
+                                               apr_size_t *payload_len)
+{
+    apr_size_t offset = H2_PREFACE_LEN;
+    apr_status_t status;
+
+    do {
+        apr_size_t len = sizeof(srv->sent) - srv->sent_len;
+
+        if (!len)
+            break;
+        status = apr_socket_recv(srv->peer, srv->sent + srv->sent_len, &len);
+        srv->sent_len += len;
+    } while (!status);
+
+    while (offset + 9 <= srv->sent_len) {
+        const unsigned char *frame;
+        apr_size_t len;
+
+        frame = (const unsigned char *)srv->sent + offset;
+        len = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+        if (offset + 9 + len > srv->sent_len)
+            break;
+
+        if (frame[3] == frame_type && (frame[4] & flags) == flags) {
+            *payload_len = len;
+            return frame + 9;
+        }
+        offset += 9 + len;
+    }
+
+    return NULL;
+}
+
+/* Run the client until ARR has COUNT elements. */
+static apr_status_t h2_run_until(test_baton_t *tb, apr_array_header_t *arr,
+                                 int count)
+{
+    apr_time_t finish_time = apr_time_now() + apr_time_from_sec(15);
+    apr_pool_t *iter_pool;
+    apr_status_t status = APR_SUCCESS;
+
+    apr_pool_create(&iter_pool, tb->pool);
+
+    while (arr->nelts < count) {
+        apr_pool_clear(iter_pool);
+
+        status = serf_context_run(tb->context, 1000, iter_pool);
+        if (APR_STATUS_IS_TIMEUP(status))
+            status = APR_SUCCESS;
+        if (status)
+            break;
+
+        if (apr_time_now() > finish_time) {
+            status = APR_ETIMEDOUT;
+            break;
+        }
+    }
+
+    apr_pool_destroy(iter_pool);
+
+    return status;
+}
+
+/* Check that the response is a 200 with the id of the request as body. */
+static apr_status_t handle_h2_response(serf_request_t *request,
+                                       serf_bucket_t *response,
+                                       void *handler_baton,
+                                       apr_pool_t *pool)
+{
+    handler_baton_t *ctx = handler_baton;
+    const char *expected = apr_psprintf(pool, "%d", ctx->req_id);
+    serf_status_line sl;
+    const char *data;
+    apr_size_t len;
+    apr_status_t status;
+
+    if (!response)
+        return SERF_ERROR_ISSUE_IN_TESTSUITE;
+
+    status = serf_bucket_response_status(response, &sl);
+    if (SERF_BUCKET_READ_ERROR(status) || !sl.version)
+        return status;
+    if (sl.code != 200)
+        return SERF_ERROR_ISSUE_IN_TESTSUITE;
+
+    status = serf_bucket_response_read_body(response, &data, &len,
+                                            serf_request_get_pool(request));
+    if (!APR_STATUS_IS_EOF(status))
+        return status;
+    if (len != strlen(expected) || memcmp(data, expected, len) != 0)
+        return SERF_ERROR_ISSUE_IN_TESTSUITE;
+
+    APR_ARRAY_PUSH(ctx->handled_requests, int) = ctx->req_id;
+    ctx->done = TRUE;
+
+    return APR_EOF;
+}
+
+/* Test that HTTP/2 responses reach the requests of their streams in the
+   order the server sends them, and that a request on a stream the server
+   refused is sent again on a new stream. */
+static void test_http2_responses(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    char refused[4];
+    const unsigned char *payload;
+    apr_size_t len;
+    apr_status_t status;
+    int i;
+
+    setup_h2_server(tc, tb);
+
+    for (i = 0; i < num_requests; i++)
+        create_new_request_with_resp_hdlr(tb, &handler_ctx[i], "GET", "/",
+                                          i + 1, handle_h2_response);
+
+    /* Requests 1, 2 and 3 are on streams 1, 3 and 5. */
+    status = h2_run_until(tb, tb->sent_requests, num_requests);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    h2_put_uint32(refused, 0x7); /* REFUSED_STREAM */
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_SETTINGS, 0, 0, NULL, 0);
+    h2_send_response(tb, 5, 3);
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_RST_STREAM, 0, 3, refused, 4);
+    h2_send_response(tb, 1, 1);
+
+    status = h2_run_until(tb, tb->handled_requests, 2);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 3, APR_ARRAY_IDX(tb->handled_requests, 0, int));
+    CuAssertIntEquals(tc, 1, APR_ARRAY_IDX(tb->handled_requests, 1, int));
+
+    /* The refused request 2 goes out again, on stream 7. */
+    status = h2_run_until(tb, tb->sent_requests, num_requests + 1);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, APR_ARRAY_IDX(tb->sent_requests, 3, int));
+
+    h2_send_response(tb, 7, 2);
+
+    status = h2_run_until(tb, tb->handled_requests, num_requests);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, APR_ARRAY_IDX(tb->handled_requests, 2, int));
+
+    /* The SETTINGS of the server were acknowledged. */
+    payload = h2_find_sent_frame(tb->user_baton,
+                                 SERF_HTTP2_FRAME_TYPE_SETTINGS,
+                                 SERF_HTTP2_FLAG_ACK, &len);
+    CuAssertPtrNotNull(tc, payload);
+    CuAssertIntEquals(tc, 0, (int)len);
+}
+
+/* Test that the requests on the streams after the last one a GOAWAY of the
+   server allows are sent again on a new connection. */
+static void test_http2_goaway_requeues(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    h2_server_t *srv;
+    char goaway[8];
+    apr_status_t status;
+    int i;
+
+    srv = setup_h2_server(tc, tb);
+
+    for (i = 0; i < num_requests; i++)
+        create_new_request_with_resp_hdlr(tb, &handler_ctx[i], "GET", "/",
+                                          i + 1, handle_h2_response);
+
+    status = h2_run_until(tb, tb->sent_requests, num_requests);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Stream 1 is processed, stream 3 isn't. */
+    h2_put_uint32(goaway, 1);
+    h2_put_uint32(goaway + 4, 0); /* NO_ERROR */
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_SETTINGS, 0, 0, NULL, 0);
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_GOAWAY, 0, 0, goaway, 8);
+    h2_send_response(tb, 1, 1);
+
+    status = h2_run_until(tb, tb->handled_requests, 1);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Request 2 goes out again, on stream 1 of a new connection. */
+    status = h2_run_until(tb, tb->sent_requests, num_requests + 1);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 2, srv->connections);
+    CuAssertIntEquals(tc, 2, APR_ARRAY_IDX(tb->sent_requests, 2, int));
+
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_SETTINGS, 0, 0, NULL, 0);
+    h2_send_response(tb, 1, 2);
+
+    status = h2_run_until(tb, tb->handled_requests, num_requests);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, 1, APR_ARRAY_IDX(tb->handled_requests, 0, int));
+    CuAssertIntEquals(tc, 2, APR_ARRAY_IDX(tb->handled_requests, 1, int));
+}
+
+/* Test that a new initial window size that makes the send window of an
+   open stream too large is a connection error, which the client reports
+   to the server with a GOAWAY. */
+static void test_http2_settings_window_overflow(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    h2_server_t *srv;
+    char settings[6];
+    char increment[4];
+    const unsigned char *payload;
+    apr_size_t len;
+    apr_status_t status;
+
+    srv = setup_h2_server(tc, tb);
+
+    create_new_request_with_resp_hdlr(tb, &handler_ctx[0], "GET", "/", 1,
+                                      handle_h2_response);
+    status = h2_run_until(tb, tb->sent_requests, 1);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* Stream 1 had a window of 65535, minus what was sent of its body.
+       Grow it to just below the maximum. */
+    h2_put_uint32(increment, 0x7fffffff - 65535);
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_SETTINGS, 0, 0, NULL, 0);
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_WINDOW_UPDATE, 0, 1,
+                  increment, 4);
+
+    /* A larger initial window size pushes it over. */
+    settings[0] = 0;
+    settings[1] = 0x4; /* SETTINGS_INITIAL_WINDOW_SIZE */
+    h2_put_uint32(settings + 2, 65535 + 2);
+    h2_send_frame(tb, SERF_HTTP2_FRAME_TYPE_SETTINGS, 0, 0, settings, 6);
+
+    status = h2_run_until(tb, tb->handled_requests, 1);
+    CuAssertIntEquals(tc, SERF_ERROR_HTTP2_FLOW_CONTROL_ERROR, status);
+
+    payload = h2_find_sent_frame(srv, SERF_HTTP2_FRAME_TYPE_GOAWAY, 0, &len);
+    CuAssertPtrNotNull(tc, payload);
+    CuAssertIntEquals(tc, 8, (int)len);
+    /* FLOW_CONTROL_ERROR */
+    CuAssertIntEquals(tc, 0x3, payload[7]);
+}
+
+/*****************************************************************************/
+/* The port of the serf server in test_incoming_requests. */
+#define INCOMING_TEST_PORT 30081
+
+/* Answers every request with its path. */
+static apr_status_t echo_path_request(serf_context_t *ctx,
+                                      serf_incoming_request_t *req,
+                                      void *request_baton,
+                                      apr_pool_t *pool)
+{
+    test_baton_t *tb = request_baton;
+    serf_bucket_alloc_t *alloc = serf_incoming_request_get_alloc(req);
+    serf_request_line rl;
+    serf_bucket_t *body, *resp;
+
+    serf_bucket_incoming_request_line(serf_incoming_request_get_bucket(req),
+                                      &rl);
+    tb->user_baton_l++;
+
+    body = serf_bucket_simple_copy_create(rl.uri, strlen(rl.uri), alloc);
+    resp = serf_bucket_outgoing_response_create(body, 200, NULL, rl.version,
+                                                alloc);
+
+    return serf_incoming_request_respond(req, resp);
+}
+
+static apr_status_t accept_test_client(serf_context_t *ctx,
+                                       serf_listener_t *l,
+                                       void *accept_baton,
+                                       apr_socket_t *insock,
+                                       apr_pool_t *pool)
+{
+    serf_incoming_t *client;
+
+    return serf_incoming_create(&client, ctx, insock, accept_baton,
+                                echo_path_request, pool);
+}
+
+/* Test that a serf server answers pipelined requests from a serf client on
+   one connection, in order. */
+static void test_incoming_requests(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_listener_t *listener;
+    handler_baton_t handler_ctx[3];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_time_t finish_time = apr_time_now() + apr_time_from_sec(15);
+    apr_status_t status;
+    int i, done = 0;
+
+    tb->serv_url = apr_psprintf(tb->pool, "http://localhost:%d",
+                                INCOMING_TEST_PORT);
+    status = setup_test_client_context(tb, NULL, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_listener_create(&listener, tb->context, "localhost",
+                                  INCOMING_TEST_PORT, tb, accept_test_client,
+                                  tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    /* The requests have a chunked body, which the server reads past. */
+    create_new_request(tb, &handler_ctx[0], "GET", "/1", 1);
+    create_new_request(tb, &handler_ctx[1], "GET", "/2", 2);
+    create_new_request(tb, &handler_ctx[2], "GET", "/3", 3);
+
+    /* The client and the server share the context. */
+    while (!done) {
+        status = serf_context_run(tb->context, 0, tb->pool);
+        if (!APR_STATUS_IS_TIMEUP(status))
+            CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+        done = 1;
+        for (i = 0; i < num_requests; i++)
+            done &= handler_ctx[i].done;
+
+        CuAssertTrue(tc, done || apr_time_now() < finish_time);
+    }
+
+    CuAssertIntEquals(tc, num_requests, tb->user_baton_l);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+    for (i = 0; i < tb->handled_requests->nelts; i++) {
+        int req_nr = APR_ARRAY_IDX(tb->handled_requests, i, int);
+        CuAssertIntEquals(tc, i + 1, req_nr);
+    }
+}
+
+/* Test that SO_REUSEPORT listeners can share a port, where supported. */
+static void test_listener_reuseport(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_listener_t *listener1, *listener2;
+    apr_status_t status;
+
+    tb->context = serf_context_create(tb->pool);
+
+    status = serf_listener_create2(&listener1, tb->context, "localhost",
+                                   INCOMING_TEST_PORT, tb, accept_test_client,
+                                   SERF_LISTENER_REUSEPORT, tb->pool);
+    if (APR_STATUS_IS_ENOTIMPL(status))
+        return;
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_listener_create2(&listener2, tb->context, "localhost",
+                                   INCOMING_TEST_PORT, tb, accept_test_client,
+                                   SERF_LISTENER_REUSEPORT, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+}
+
 CuSuite *test_context(void)
 {
     CuSuite *suite = CuSuiteNew();
@@ -977,6 +2541,7 @@ CuSuite *test_context(void)
 
     SUITE_ADD_TEST(suite, test_serf_connection_request_create);
     SUITE_ADD_TEST(suite, test_serf_connection_priority_request_create);
+    SUITE_ADD_TEST(suite, test_request_priority_classes);
     SUITE_ADD_TEST(suite, test_closed_connection);
     SUITE_ADD_TEST(suite, test_eof_connection);
     SUITE_ADD_TEST(suite, test_eof_connection_with_authn_cb);
@@ -988,11 +2553,35 @@ CuSuite *test_context(void)
     SUITE_ADD_TEST(suite, test_keepalive_limit_one_by_one);
     SUITE_ADD_TEST(suite, test_keepalive_limit_one_by_one_and_burst);
     SUITE_ADD_TEST(suite, test_progress_callback);
+    SUITE_ADD_TEST(suite, test_progress_batching);
+    SUITE_ADD_TEST(suite, test_request_timings);
+    SUITE_ADD_TEST(suite, test_connection_metrics);
+    SUITE_ADD_TEST(suite, test_trace_to_file);
+    SUITE_ADD_TEST(suite, test_incoming_requests);
+    SUITE_ADD_TEST(suite, test_listener_reuseport);
     SUITE_ADD_TEST(suite, test_connection_userinfo_in_url);
     SUITE_ADD_TEST(suite, test_request_timeout);
     SUITE_ADD_TEST(suite, test_connection_large_response);
     SUITE_ADD_TEST(suite, test_connection_large_request);
     SUITE_ADD_TEST(suite, test_max_keepalive_requests);
+    SUITE_ADD_TEST(suite, test_keepalive_limit_per_host);
+    SUITE_ADD_TEST(suite, test_adaptive_pipelining);
+    SUITE_ADD_TEST(suite, test_throughput_server);
+    SUITE_ADD_TEST(suite, test_request_timeout_unwritten);
+    SUITE_ADD_TEST(suite, test_request_timeout_written);
+    SUITE_ADD_TEST(suite, test_connection_idle_timeout);
+    SUITE_ADD_TEST(suite, test_connection_connect_timeout);
+    SUITE_ADD_TEST(suite, test_context_fetch_urls);
+    SUITE_ADD_TEST(suite, test_connection_create_async);
+    SUITE_ADD_TEST(suite, test_connection_prewarm);
+    SUITE_ADD_TEST(suite, test_happy_eyeballs);
+    SUITE_ADD_TEST(suite, test_connection_cork);
+    SUITE_ADD_TEST(suite, test_request_pause_reading);
+    SUITE_ADD_TEST(suite, test_host_pool_request_create);
+    SUITE_ADD_TEST(suite, test_context_group_post);
+    SUITE_ADD_TEST(suite, test_http2_responses);
+    SUITE_ADD_TEST(suite, test_http2_goaway_requeues);
+    SUITE_ADD_TEST(suite, test_http2_settings_window_overflow);
 
     return suite;
 }
@@ -13,6 +13,9 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
+#include <string.h>
+
 #include "serf.h"
 #include "test_serf.h"
 
@@ -68,6 +71,125 @@ static void test_config_store_per_context(CuTest *tc)
     }
 }
 
+/* Serf's own keys are stored apart from the application defined ones, test
+   that keys with the same low bits don't mix. */
+static void test_config_store_direct_keys(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_config_t *cfg;
+    const char *actual;
+    void *log_baton;
+
+    serf_context_t *ctx = serf_context_create(tb->pool);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__config_store_get_config(ctx, NULL, &cfg, tb->pool));
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_set_string(cfg,
+                                             SERF_CONFIG_PER_CONTEXT | 0x000007,
+                                             "serf_value"));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_set_string(cfg,
+                                             SERF_CONFIG_PER_CONTEXT | 0x010007,
+                                             "app_value"));
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_string(cfg,
+                                             SERF_CONFIG_PER_CONTEXT | 0x000007,
+                                             &actual));
+    CuAssertStrEquals(tc, "serf_value", actual);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_string(cfg,
+                                             SERF_CONFIG_PER_CONTEXT | 0x010007,
+                                             &actual));
+    CuAssertStrEquals(tc, "app_value", actual);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_remove_value(cfg,
+                                               SERF_CONFIG_PER_CONTEXT
+                                               | 0x000007));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_string(cfg,
+                                             SERF_CONFIG_PER_CONTEXT | 0x000007,
+                                             &actual));
+    CuAssertPtrEquals(tc, NULL, (void *)actual);
+
+    /* The log baton the config object keeps at hand is the one stored. */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_config_get_object(cfg, SERF_CONFIG_CTX_LOGBATON,
+                                             &log_baton));
+    CuAssertPtrEquals(tc, log_baton, *cfg->log_baton);
+}
+
+#ifdef SERF_LOGGING_ENABLED
+/* Test that the events logged through a ring output are written to its
+   stream, and that the ones that didn't fit in the ring are counted. */
+static void test_logging_ring_output(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_context_t *ctx = serf_context_create(tb->pool);
+    serf_log_output_t *output;
+    serf_config_t *cfg;
+    apr_pool_t *pool;
+    char filler[1001];
+    char line[2048];
+    FILE *fp;
+    int written = 0, dropped = 0;
+    int i;
+    apr_status_t status;
+
+    fp = tmpfile();
+    CuAssertPtrNotNull(tc, fp);
+
+    apr_pool_create(&pool, tb->pool);
+    status = serf_logging_create_ring_output(&output, SERF_LOG_INFO,
+                                             SERF_LOGCOMP_ALL,
+                                             SERF_LOG_DEFAULT_LAYOUT,
+                                             fp, 0, pool);
+    if (status == APR_ENOTIMPL) {
+        fclose(fp);
+        return;
+    }
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_logging_add_output(ctx, output));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__config_store_get_config(ctx, NULL, &cfg,
+                                                    tb->pool));
+
+    /* Many times what the smallest ring holds, logged faster than the
+       writer thread can write it out. */
+    memset(filler, 'x', sizeof(filler) - 1);
+    filler[sizeof(filler) - 1] = '\0';
+    for (i = 0; i < 1000; i++)
+        serf__log(LOGLVL_INFO, LOGCOMP_CONN, "test", cfg,
+                  "ring event %d %s\n", i, filler);
+
+    /* Writes out what is left in the ring. */
+    apr_pool_destroy(pool);
+
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned int count;
+        const char *event = strstr(line, "ring event ");
+
+        if (event) {
+            CuAssertTrue(tc, strstr(line, "INFO") != NULL);
+            CuAssertTrue(tc, strstr(event, filler) != NULL);
+            written++;
+        }
+        else if (sscanf(line, "[%u log events dropped]", &count) == 1) {
+            dropped += count;
+        }
+    }
+    fclose(fp);
+
+    CuAssertTrue(tc, written > 0);
+    CuAssertTrue(tc, dropped > 0);
+    CuAssertIntEquals(tc, 1000, written + dropped);
+}
+#endif
+
 /* Empty implementations, they won't be called. */
 static void conn_closed(serf_connection_t *conn, void *closed_baton,
                         apr_status_t why, apr_pool_t *pool)
@@ -380,6 +502,174 @@ static void test_header_buckets_remove(CuTest *tc)
     read_and_check_bucket(tc, hdrs, cur);
 }
 
+/* Lookups and removals on a headers bucket large enough to be indexed. */
+static void test_header_buckets_index(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *hdrs = serf_bucket_headers_create(alloc);
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        serf_bucket_headers_setc(hdrs, apr_psprintf(tb->pool, "X-Hdr-%d", i),
+                                 "value");
+    }
+    serf_bucket_headers_set(hdrs, "Content-Type", "text/plain");
+
+    /* The first lookups build the index. */
+    CuAssertStrEquals(tc, "value", serf_bucket_headers_get(hdrs, "x-hdr-5"));
+    CuAssertStrEquals(tc, "text/plain",
+                      serf_bucket_headers_get(hdrs, "CONTENT-TYPE"));
+    CuAssertPtrEquals(tc, NULL, serf_bucket_headers_get(hdrs, "X-Hdr-10"));
+
+    /* Headers added later are indexed, multiple values are combined in
+       the order they were added. */
+    serf_bucket_headers_set(hdrs, "Content-Type", "text/html");
+    CuAssertStrEquals(tc, "text/plain,text/html",
+                      serf_bucket_headers_get(hdrs, "Content-Type"));
+
+    /* Remove the last header, then add a new one. */
+    serf__bucket_headers_remove(hdrs, "Content-Type");
+    CuAssertPtrEquals(tc, NULL, serf_bucket_headers_get(hdrs, "Content-Type"));
+    serf__bucket_headers_remove(hdrs, "X-Hdr-0");
+    serf_bucket_headers_set(hdrs, "Content-Length", "100");
+    CuAssertStrEquals(tc, "100",
+                      serf_bucket_headers_get(hdrs, "Content-Length"));
+
+    read_and_check_bucket(tc, hdrs,
+                          "X-Hdr-1: value" CRLF "X-Hdr-2: value" CRLF
+                          "X-Hdr-3: value" CRLF "X-Hdr-4: value" CRLF
+                          "X-Hdr-5: value" CRLF "X-Hdr-6: value" CRLF
+                          "X-Hdr-7: value" CRLF "X-Hdr-8: value" CRLF
+                          "X-Hdr-9: value" CRLF "Content-Length: 100" CRLF
+                          CRLF);
+
+    serf_bucket_destroy(hdrs);
+}
+
+/* Records the order in which the timers of a test expire. */
+typedef struct timer_log_t {
+    int fired[10];
+    int nr_fired;
+} timer_log_t;
+
+typedef struct test_timer_t {
+    serf__timer_t timer;
+    int id;
+    timer_log_t *log;
+} test_timer_t;
+
+static apr_status_t test_timer_expired(serf__timer_t *timer)
+{
+    test_timer_t *t = timer->baton;
+
+    t->log->fired[t->log->nr_fired++] = t->id;
+
+    return APR_SUCCESS;
+}
+
+static void init_test_timers(test_timer_t *timers, int count,
+                             timer_log_t *log)
+{
+    int i;
+
+    memset(log, 0, sizeof(*log));
+    for (i = 0; i < count; i++) {
+        timers[i].id = i;
+        timers[i].log = log;
+        serf__timer_init(&timers[i].timer, test_timer_expired, &timers[i]);
+    }
+}
+
+/* Timers on all levels of the wheel expire in order, and never early. */
+static void test_timer_wheel_expiry(CuTest *tc)
+{
+    serf__timer_wheel_t wheel;
+    test_timer_t timers[5];
+    timer_log_t log;
+    apr_time_t start = apr_time_from_sec(1400000000) + 123;
+
+    serf__timer_wheel_init(&wheel, start);
+    init_test_timers(timers, 5, &log);
+
+    serf__timer_schedule(&wheel, &timers[0].timer, start + 5000);
+    serf__timer_schedule(&wheel, &timers[1].timer, start + 1000);
+    serf__timer_schedule(&wheel, &timers[2].timer, start + 300000);
+    serf__timer_schedule(&wheel, &timers[3].timer,
+                         start + 10 * APR_USEC_PER_SEC);
+    serf__timer_schedule(&wheel, &timers[4].timer,
+                         start + 7200 * APR_USEC_PER_SEC);
+    CuAssertIntEquals(tc, 5, wheel.nr_of_timers);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__timer_wheel_run(&wheel, start + 999));
+    CuAssertIntEquals(tc, 0, log.nr_fired);
+
+    /* Expiry is rounded up to the next tick of the wheel. */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__timer_wheel_run(&wheel, start + 2000));
+    CuAssertIntEquals(tc, 1, log.nr_fired);
+    CuAssertIntEquals(tc, 1, log.fired[0]);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__timer_wheel_run(&wheel, start + 400000));
+    CuAssertIntEquals(tc, 3, log.nr_fired);
+    CuAssertIntEquals(tc, 0, log.fired[1]);
+    CuAssertIntEquals(tc, 2, log.fired[2]);
+
+    /* Cancelled timers don't fire. */
+    serf__timer_cancel(&wheel, &timers[4].timer);
+    CuAssertTrue(tc, !serf__timer_pending(&timers[4].timer));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__timer_wheel_run(&wheel,
+                                            start + 9 * APR_USEC_PER_SEC));
+    CuAssertIntEquals(tc, 3, log.nr_fired);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__timer_wheel_run(&wheel,
+                                            start + 8000 * APR_USEC_PER_SEC));
+    CuAssertIntEquals(tc, 4, log.nr_fired);
+    CuAssertIntEquals(tc, 3, log.fired[3]);
+    CuAssertIntEquals(tc, 0, wheel.nr_of_timers);
+    CuAssertTrue(tc, serf__timer_wheel_next(&wheel, start) < 0);
+}
+
+/* Rescheduling moves a timer, and polling for the time returned by
+   serf__timer_wheel_next() reaches a far timer in a few steps. */
+static void test_timer_wheel_next(CuTest *tc)
+{
+    serf__timer_wheel_t wheel;
+    test_timer_t timers[2];
+    timer_log_t log;
+    apr_time_t now = apr_time_from_sec(1400000000);
+    apr_time_t deadline = now + 90 * APR_USEC_PER_SEC;
+    int steps = 0;
+
+    serf__timer_wheel_init(&wheel, now);
+    init_test_timers(timers, 2, &log);
+
+    serf__timer_schedule(&wheel, &timers[0].timer, now + 3000);
+    CuAssertTrue(tc, serf__timer_wheel_next(&wheel, now) == 3000);
+
+    serf__timer_schedule(&wheel, &timers[0].timer, deadline);
+    CuAssertIntEquals(tc, 1, wheel.nr_of_timers);
+
+    while (!log.nr_fired) {
+        apr_interval_time_t next = serf__timer_wheel_next(&wheel, now);
+
+        CuAssertTrue(tc, next >= 0);
+        now += next;
+        CuAssertIntEquals(tc, APR_SUCCESS,
+                          serf__timer_wheel_run(&wheel, now));
+        steps++;
+    }
+
+    CuAssertTrue(tc, now >= deadline);
+    CuAssertTrue(tc, now < deadline + 1000);
+    CuAssertTrue(tc, steps <= 5);
+}
+
 CuSuite *test_internal(void)
 {
     CuSuite *suite = CuSuiteNew();
@@ -387,11 +677,18 @@ CuSuite *test_internal(void)
     CuSuiteSetSetupTeardownCallbacks(suite, test_setup, test_teardown);
 
     SUITE_ADD_TEST(suite, test_config_store_per_context);
+    SUITE_ADD_TEST(suite, test_config_store_direct_keys);
     SUITE_ADD_TEST(suite, test_config_store_per_connection_different_host);
     SUITE_ADD_TEST(suite, test_config_store_per_connection_same_host);
     SUITE_ADD_TEST(suite, test_config_store_error_handling);
     SUITE_ADD_TEST(suite, test_config_store_remove_objects);
+#ifdef SERF_LOGGING_ENABLED
+    SUITE_ADD_TEST(suite, test_logging_ring_output);
+#endif
     SUITE_ADD_TEST(suite, test_header_buckets_remove);
+    SUITE_ADD_TEST(suite, test_header_buckets_index);
+    SUITE_ADD_TEST(suite, test_timer_wheel_expiry);
+    SUITE_ADD_TEST(suite, test_timer_wheel_next);
 
     return suite;
 }
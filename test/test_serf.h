@@ -293,4 +293,7 @@ void test__log_nopref(int verbose_flag, const char *fmt, ...);
  * 'srcdir' env variable. */
 const char * get_srcdir_file(apr_pool_t *pool, const char * file);
 
+/* Read a 32 bit number from the file of serf_context_trace_to_file(). */
+apr_uint32_t trace_uint32(const unsigned char *p);
+
 #endif /* TEST_SERF_H */
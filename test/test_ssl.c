@@ -18,11 +18,20 @@
 #include <apr_strings.h>
 #include <apr_env.h>
 
+#include <openssl/ssl.h>
+#ifndef OPENSSL_NO_OCSP
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#endif
+
 #include "serf.h"
 #include "serf_bucket_types.h"
 
 #include "test_serf.h"
 
+/* test case has access to internal functions. */
+#include "serf_private.h"
+
 #if defined(WIN32) && defined(_DEBUG)
 /* Include this file to allow running a Debug build of serf with a Release
    build of OpenSSL. */
@@ -54,6 +63,43 @@ static void test_ssl_init(CuTest *tc)
     CuAssertIntEquals(tc, APR_SUCCESS, status);
 }
 
+/* Test that the list of ALPN protocols is validated, and that no protocol
+   is selected before the handshake. */
+static void test_ssl_alpn_protocols(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_t *bkt, *stream;
+    serf_ssl_context_t *ssl_context;
+    apr_status_t status;
+
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+
+    stream = SERF_BUCKET_SIMPLE_STRING("", alloc);
+
+    bkt = serf_bucket_ssl_decrypt_create(stream, NULL, alloc);
+    ssl_context = serf_bucket_ssl_decrypt_context_get(bkt);
+
+    status = serf_ssl_set_alpn_protocols(ssl_context, "h2,http/1.1",
+                                         NULL, NULL);
+    if (status == APR_ENOTIMPL)
+        return;
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    status = serf_ssl_set_alpn_protocols(ssl_context, "h2,,http/1.1",
+                                         NULL, NULL);
+    CuAssertIntEquals(tc, APR_EINVAL, status);
+
+    status = serf_ssl_set_alpn_protocols(ssl_context, "h2,", NULL, NULL);
+    CuAssertIntEquals(tc, APR_EINVAL, status);
+
+    status = serf_ssl_set_alpn_protocols(ssl_context, ",h2", NULL, NULL);
+    CuAssertIntEquals(tc, APR_EINVAL, status);
+
+    CuAssertStrEquals(tc, "", serf_ssl_get_selected_protocol(ssl_context));
+
+    serf_bucket_destroy(bkt);
+}
 
 /* Test that loading a custom CA certificate file works. */
 static void test_ssl_load_cert_file(CuTest *tc)
@@ -872,6 +918,737 @@ static void test_ssl_large_response(CuTest *tc)
                                                 handler_ctx, tb->pool);
 }
 
+/* The TLS records the server of test_ssl_decrypt_read_iovec() sends. */
+#define IOVEC_RECORD_SIZE 10000
+#define IOVEC_RECORDS 6
+
+static apr_status_t
+ssl_server_cert_cb_accept_all(void *baton, int failures,
+                              const serf_ssl_certificate_t *cert)
+{
+    return APR_SUCCESS;
+}
+
+static apr_status_t hold_open_eagain(void *baton, serf_bucket_t *aggbkt)
+{
+    return APR_EAGAIN;
+}
+
+/* Append what SERVER wrote to its memory BIO to AGGBKT, the stream of the
+   client. Returns the number of bytes appended. */
+static int server_to_client(SSL *server, serf_bucket_t *aggbkt,
+                            serf_bucket_alloc_t *alloc)
+{
+    char buf[4096];
+    int len, total = 0;
+
+    while ((len = BIO_read(SSL_get_wbio(server), buf, sizeof(buf))) > 0) {
+        serf_bucket_aggregate_append(aggbkt,
+            serf_bucket_simple_copy_create(buf, len, alloc));
+        total += len;
+    }
+
+    return total;
+}
+
+/* Feed what the client encrypted to SERVER. */
+static apr_status_t client_to_server(serf_bucket_t *encrypt, SSL *server)
+{
+    apr_status_t status;
+
+    do {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(encrypt, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            return status;
+        if (len)
+            BIO_write(SSL_get_rbio(server), data, (int)len);
+    } while (status == APR_SUCCESS);
+
+    return APR_SUCCESS;
+}
+
+/* Test that a response of several TLS records is read through
+   serf_bucket_read_iovec() on the decrypt bucket, a record per iovec, and
+   that an error after the first records is returned after their data. */
+static void test_ssl_decrypt_read_iovec(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *in_agg, *out_agg, *decrypt, *encrypt;
+    serf_ssl_context_t *ssl_context;
+    SSL_CTX *server_ctx;
+    SSL *server;
+    char record[IOVEC_RECORD_SIZE];
+    char *body, *read_body;
+    apr_size_t body_len = IOVEC_RECORDS * IOVEC_RECORD_SIZE;
+    apr_size_t read_len = 0;
+    struct iovec vecs[16];
+    int vecs_used, most_vecs = 0;
+    apr_status_t status;
+    int i;
+
+    /* The client first, which initializes OpenSSL. */
+    in_agg = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_hold_open(in_agg, hold_open_eagain, NULL);
+    out_agg = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_hold_open(out_agg, hold_open_eagain, NULL);
+
+    decrypt = serf_bucket_ssl_decrypt_create(in_agg, NULL, alloc);
+    ssl_context = serf_bucket_ssl_decrypt_context_get(decrypt);
+    encrypt = serf_bucket_ssl_encrypt_create(out_agg, ssl_context, alloc);
+    serf_ssl_server_cert_callback_set(ssl_context,
+                                      ssl_server_cert_cb_accept_all, NULL);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    server_ctx = SSL_CTX_new(TLS_server_method());
+#else
+    server_ctx = SSL_CTX_new(SSLv23_server_method());
+#endif
+    CuAssertPtrNotNull(tc, server_ctx);
+    SSL_CTX_set_default_passwd_cb_userdata(server_ctx, "serftest");
+    CuAssertIntEquals(tc, 1,
+        SSL_CTX_use_certificate_file(server_ctx,
+            get_srcdir_file(tb->pool, "test/certs/serfservercert.pem"),
+            SSL_FILETYPE_PEM));
+    CuAssertIntEquals(tc, 1,
+        SSL_CTX_use_PrivateKey_file(server_ctx,
+            get_srcdir_file(tb->pool, "test/certs/private/serfserverkey.pem"),
+            SSL_FILETYPE_PEM));
+
+    server = SSL_new(server_ctx);
+    SSL_set_bio(server, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+    SSL_set_accept_state(server);
+
+    /* Run the handshake, passing the data between client and server. */
+    for (i = 0; i < 10; i++) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(decrypt, SERF_READ_ALL_AVAIL, &data, &len);
+        CuAssertIntEquals(tc, APR_EAGAIN, status);
+        CuAssertIntEquals(tc, APR_SUCCESS,
+                          client_to_server(encrypt, server));
+        SSL_do_handshake(server);
+        server_to_client(server, in_agg, alloc);
+    }
+    CuAssertTrue(tc, SSL_is_init_finished(server));
+
+    /* A record per write. */
+    body = apr_palloc(tb->pool, body_len);
+    for (i = 0; i < IOVEC_RECORDS; i++) {
+        memset(body + i * IOVEC_RECORD_SIZE, 'a' + i, IOVEC_RECORD_SIZE);
+        CuAssertIntEquals(tc, IOVEC_RECORD_SIZE,
+                          SSL_write(server, body + i * IOVEC_RECORD_SIZE,
+                                    IOVEC_RECORD_SIZE));
+    }
+    server_to_client(server, in_agg, alloc);
+
+    read_body = apr_palloc(tb->pool, body_len);
+    do {
+        status = serf_bucket_read_iovec(decrypt, SERF_READ_ALL_AVAIL,
+                                        16, vecs, &vecs_used);
+        CuAssertTrue(tc, !SERF_BUCKET_READ_ERROR(status));
+
+        if (vecs_used > most_vecs)
+            most_vecs = vecs_used;
+        for (i = 0; i < vecs_used; i++) {
+            CuAssertTrue(tc, read_len + vecs[i].iov_len <= body_len);
+            memcpy(read_body + read_len, vecs[i].iov_base, vecs[i].iov_len);
+            read_len += vecs[i].iov_len;
+        }
+    } while (status == APR_SUCCESS);
+
+    CuAssertIntEquals(tc, APR_EAGAIN, status);
+    CuAssertIntEquals(tc, (int)body_len, (int)read_len);
+    CuAssertTrue(tc, memcmp(body, read_body, body_len) == 0);
+    /* More than one record was handed out with one read. */
+    CuAssertTrue(tc, most_vecs > 1);
+
+    /* Two good records, then one that fails its integrity check. */
+    memset(record, 'x', sizeof(record));
+    for (i = 0; i < 2; i++)
+        SSL_write(server, record, sizeof(record));
+    server_to_client(server, in_agg, alloc);
+
+    SSL_write(server, record, sizeof(record));
+    {
+        char buf[IOVEC_RECORD_SIZE + 1024];
+        int len = BIO_read(SSL_get_wbio(server), buf, sizeof(buf));
+
+        CuAssertTrue(tc, len > 0);
+        buf[len - 1] ^= 0xff;
+        serf_bucket_aggregate_append(in_agg,
+            serf_bucket_simple_copy_create(buf, len, alloc));
+    }
+
+    /* The data of the good records comes first, without the error. */
+    read_len = 0;
+    status = serf_bucket_read_iovec(decrypt, SERF_READ_ALL_AVAIL,
+                                    16, vecs, &vecs_used);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    for (i = 0; i < vecs_used; i++)
+        read_len += vecs[i].iov_len;
+    CuAssertIntEquals(tc, 2 * IOVEC_RECORD_SIZE, (int)read_len);
+
+    /* The error follows on the next read, and stays. */
+    status = serf_bucket_read_iovec(decrypt, SERF_READ_ALL_AVAIL,
+                                    16, vecs, &vecs_used);
+    CuAssertIntEquals(tc, SERF_ERROR_SSL_COMM_FAILED, status);
+    CuAssertIntEquals(tc, 0, vecs_used);
+    status = serf_bucket_read_iovec(decrypt, SERF_READ_ALL_AVAIL,
+                                    16, vecs, &vecs_used);
+    CuAssertIntEquals(tc, SERF_ERROR_SSL_COMM_FAILED, status);
+
+    serf_bucket_destroy(encrypt);
+    serf_bucket_destroy(decrypt);
+    SSL_free(server);
+    SSL_CTX_free(server_ctx);
+}
+
+static apr_status_t
+ssl_server_cert_cb_count(void *baton, int failures,
+                         const serf_ssl_certificate_t *cert)
+{
+    test_baton_t *tb = baton;
+    int *handshakes = tb->user_baton;
+
+    (*handshakes)++;
+
+    return failures ? SERF_ERROR_ISSUE_IN_TESTSUITE : APR_SUCCESS;
+}
+
+/* Validate that a new connection to the same server resumes the session of
+   the previous one, so the server certificate isn't verified again. */
+static void test_ssl_session_resumption(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[2];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    int handshakes = 0;
+    apr_status_t status;
+
+    /* Set up a test context and a https server */
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    status = setup_test_client_https_context(tb,
+                                             https_set_root_ca_conn_setup,
+                                             ssl_server_cert_cb_count,
+                                             tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    tb->user_baton = &handshakes;
+
+    /* The server closes the connection after the first response. */
+    Given(tb->mh)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("1"))
+        Respond(WithCode(200), WithChunkedBody(""),
+                WithConnectionCloseHeader)
+      GETRequest(URLEqualTo("/"), ChunkedBodyEqualTo("2"))
+        Respond(WithCode(200), WithChunkedBody(""))
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+    create_new_request(tb, &handler_ctx[1], "GET", "/", 2);
+
+    status = run_client_and_mock_servers_loops(tb, num_requests, handler_ctx,
+                                               tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+
+    /* Only the first connection did a full handshake. */
+    CuAssertIntEquals(tc, 1, handshakes);
+}
+
+static void host_conn_closed(serf_connection_t *conn, void *closed_baton,
+                             apr_status_t why, apr_pool_t *pool)
+{
+}
+
+/* Get the config of a connection to localhost in a new context, which
+   becomes tb->context, for ssl buckets that aren't used on a real
+   connection. */
+static serf_config_t *create_host_config(CuTest *tc, test_baton_t *tb)
+{
+    serf_context_t *ctx = serf_context_create(tb->pool);
+    serf_connection_t *conn;
+    serf_config_t *config;
+    apr_uri_t url;
+
+    apr_uri_parse(tb->pool, "https://localhost:12345", &url);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_connection_create2(&conn, ctx, url,
+                                              default_https_conn_setup, tb,
+                                              host_conn_closed, NULL,
+                                              tb->pool));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf__config_store_get_config(ctx, conn, &config,
+                                                    tb->pool));
+    tb->context = ctx;
+
+    return config;
+}
+
+/* Create an ssl context that trusts the certificate in CERT_FILE, on its
+   own decrypt bucket, returned in *BKT. */
+static serf_ssl_context_t *
+create_trusting_ssl_context(CuTest *tc, test_baton_t *tb,
+                            const char *cert_file, serf_bucket_t **bkt,
+                            serf_bucket_alloc_t *alloc)
+{
+    serf_ssl_certificate_t *cert;
+    serf_ssl_context_t *ssl_context;
+
+    *bkt = serf_bucket_ssl_decrypt_create(SERF_BUCKET_SIMPLE_STRING("",
+                                                                   alloc),
+                                          NULL, alloc);
+    ssl_context = serf_bucket_ssl_decrypt_context_get(*bkt);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_load_cert_file(&cert,
+                                              get_srcdir_file(tb->pool,
+                                                              cert_file),
+                                              tb->pool));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_ssl_trust_cert(ssl_context, cert));
+
+    return ssl_context;
+}
+
+/* Validate that the connections of a context with the same trust settings
+   use the same SSL_CTX, and that none of them creates one of its own
+   before its context is known. */
+static void test_ssl_shared_ssl_ctx(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_config_t *config = create_host_config(tc, tb);
+    serf_ssl_context_t *ssl1, *ssl2, *ssl3;
+    serf_bucket_t *bkt1, *bkt2, *bkt3;
+
+    ssl1 = create_trusting_ssl_context(tc, tb,
+                                       "test/certs/serfrootcacert.pem",
+                                       &bkt1, alloc);
+    ssl2 = create_trusting_ssl_context(tc, tb,
+                                       "test/certs/serfrootcacert.pem",
+                                       &bkt2, alloc);
+    ssl3 = create_trusting_ssl_context(tc, tb, "test/serftestca.pem",
+                                       &bkt3, alloc);
+
+    CuAssertPtrEquals(tc, serf__ssl_get_ssl_ctx(ssl1),
+                      serf__ssl_get_ssl_ctx(ssl2));
+    CuAssertPtrEquals(tc, serf__ssl_get_ssl_ctx(ssl1),
+                      serf__ssl_get_ssl_ctx(ssl3));
+
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_set_config(bkt1, config));
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_set_config(bkt2, config));
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_set_config(bkt3, config));
+
+    CuAssertPtrEquals(tc, serf__ssl_get_ssl_ctx(ssl1),
+                      serf__ssl_get_ssl_ctx(ssl2));
+    CuAssertTrue(tc, serf__ssl_get_ssl_ctx(ssl1)
+                         != serf__ssl_get_ssl_ctx(ssl3));
+
+    serf_bucket_destroy(bkt1);
+    serf_bucket_destroy(bkt2);
+    serf_bucket_destroy(bkt3);
+}
+
+/* Create a server for handshake_with_server(), that can't resume
+   sessions, so every handshake is a full one. */
+static SSL_CTX *create_full_handshake_server(CuTest *tc, test_baton_t *tb)
+{
+    SSL_CTX *server_ctx;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    server_ctx = SSL_CTX_new(TLS_server_method());
+#else
+    server_ctx = SSL_CTX_new(SSLv23_server_method());
+#endif
+    CuAssertPtrNotNull(tc, server_ctx);
+    SSL_CTX_set_default_passwd_cb_userdata(server_ctx, "serftest");
+    CuAssertIntEquals(tc, 1,
+        SSL_CTX_use_certificate_file(server_ctx,
+            get_srcdir_file(tb->pool, "test/certs/serfservercert.pem"),
+            SSL_FILETYPE_PEM));
+    CuAssertIntEquals(tc, 1,
+        SSL_CTX_use_PrivateKey_file(server_ctx,
+            get_srcdir_file(tb->pool, "test/certs/private/serfserverkey.pem"),
+            SSL_FILETYPE_PEM));
+
+    SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    SSL_CTX_set_num_tickets(server_ctx, 0);
+#endif
+
+    return server_ctx;
+}
+
+/* Run a handshake between a server of SERVER_CTX and an ssl context with
+   CONFIG, which trusts the certificates in the NULL terminated CA_FILES
+   and calls SERVER_CERT_CB with TB. Returns the error of the client. */
+static apr_status_t handshake_with_server(CuTest *tc, test_baton_t *tb,
+                                          SSL_CTX *server_ctx,
+                                          serf_config_t *config,
+                                          const char *const *ca_files,
+                                          serf_ssl_need_server_cert_t
+                                              server_cert_cb)
+{
+    serf_bucket_alloc_t *alloc = serf_bucket_allocator_create(tb->pool, NULL,
+                                                              NULL);
+    serf_bucket_t *in_agg, *out_agg, *decrypt, *encrypt;
+    serf_ssl_context_t *ssl_context;
+    SSL *server;
+    apr_status_t status = APR_SUCCESS;
+    int i;
+
+    in_agg = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_hold_open(in_agg, hold_open_eagain, NULL);
+    out_agg = serf_bucket_aggregate_create(alloc);
+    serf_bucket_aggregate_hold_open(out_agg, hold_open_eagain, NULL);
+
+    decrypt = serf_bucket_ssl_decrypt_create(in_agg, NULL, alloc);
+    ssl_context = serf_bucket_ssl_decrypt_context_get(decrypt);
+    encrypt = serf_bucket_ssl_encrypt_create(out_agg, ssl_context, alloc);
+    serf_ssl_server_cert_callback_set(ssl_context, server_cert_cb, tb);
+    serf_ssl_set_hostname(ssl_context, "localhost");
+    if (tb->enable_ocsp_stapling)
+        serf_ssl_check_cert_status_request(ssl_context, 1);
+
+    for (; *ca_files; ca_files++) {
+        serf_ssl_certificate_t *cert;
+
+        CuAssertIntEquals(tc, APR_SUCCESS,
+                          serf_ssl_load_cert_file(&cert,
+                              get_srcdir_file(tb->pool, *ca_files),
+                              tb->pool));
+        CuAssertIntEquals(tc, APR_SUCCESS,
+                          serf_ssl_trust_cert(ssl_context, cert));
+    }
+    CuAssertIntEquals(tc, APR_SUCCESS, serf_bucket_set_config(decrypt,
+                                                              config));
+
+    server = SSL_new(server_ctx);
+    SSL_set_bio(server, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+    SSL_set_accept_state(server);
+
+    for (i = 0; i < 10; i++) {
+        const char *data;
+        apr_size_t len;
+
+        status = serf_bucket_read(decrypt, SERF_READ_ALL_AVAIL, &data, &len);
+        if (SERF_BUCKET_READ_ERROR(status))
+            break;
+        status = client_to_server(encrypt, server);
+        if (status)
+            break;
+        SSL_do_handshake(server);
+        server_to_client(server, in_agg, alloc);
+    }
+    if (!status && !SSL_is_init_finished(server))
+        status = SERF_ERROR_ISSUE_IN_TESTSUITE;
+    if (APR_STATUS_IS_EAGAIN(status))
+        status = APR_SUCCESS;
+
+    serf_bucket_destroy(encrypt);
+    serf_bucket_destroy(decrypt);
+    SSL_free(server);
+
+    return status;
+}
+
+/* The same as ssl_server_cert_cb_count(), but another callback. */
+static apr_status_t
+ssl_server_cert_cb_count_too(void *baton, int failures,
+                             const serf_ssl_certificate_t *cert)
+{
+    return ssl_server_cert_cb_count(baton, failures, cert);
+}
+
+/* Like ssl_server_cert_cb_count(), but accepts failures too. */
+static apr_status_t
+ssl_server_cert_cb_count_all(void *baton, int failures,
+                             const serf_ssl_certificate_t *cert)
+{
+    ssl_server_cert_cb_count(baton, 0, cert);
+
+    return APR_SUCCESS;
+}
+
+static const char *const chain_ca_files[] = {
+    "test/certs/serfrootcacert.pem",
+    "test/certs/serfcacert.pem",
+    NULL };
+
+/* Validate that a chain accepted for a host isn't verified again by the
+   application on the next full handshake with that host, unless the
+   verification rules changed. */
+static void test_ssl_verified_cert_cache(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    SSL_CTX *server_ctx = create_full_handshake_server(tc, tb);
+    serf_config_t *config = create_host_config(tc, tb);
+    const char *const more_ca_files[] = {
+        "test/certs/serfrootcacert.pem",
+        "test/certs/serfcacert.pem",
+        "test/serftestca.pem",
+        NULL };
+    int calls = 0;
+
+    tb->user_baton = &calls;
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 1, calls);
+
+    /* Accepted a moment ago. */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 1, calls);
+
+    /* Another callback hasn't seen the chain yet. */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count_too));
+    CuAssertIntEquals(tc, 2, calls);
+
+    /* Neither has the same callback under other trust settings. */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            more_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 3, calls);
+
+    SSL_CTX_free(server_ctx);
+}
+
+/* Validate that a chain that is only accepted because the application
+   overrode a verification failure is never remembered as verified. */
+static void test_ssl_verified_cert_cache_overridden(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    SSL_CTX *server_ctx = create_full_handshake_server(tc, tb);
+    serf_config_t *config = create_host_config(tc, tb);
+    /* Without the intermediate CA, which the server doesn't send. */
+    const char *const root_ca_file[] = {
+        "test/certs/serfrootcacert.pem",
+        NULL };
+    int calls = 0, first_calls;
+
+    tb->user_baton = &calls;
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            root_ca_file,
+                                            ssl_server_cert_cb_count_all));
+    first_calls = calls;
+    CuAssertTrue(tc, first_calls > 0);
+
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            root_ca_file,
+                                            ssl_server_cert_cb_count_all));
+    CuAssertIntEquals(tc, 2 * first_calls, calls);
+
+    SSL_CTX_free(server_ctx);
+}
+
+#if defined(SERF_LOGGING_ENABLED) && !defined(OPENSSL_NO_OCSP) \
+    && !defined(OPENSSL_NO_TLSEXT)
+typedef struct stapled_response_t {
+    unsigned char *der;
+    int len;
+} stapled_response_t;
+
+/* Staple the response that ARG points to on the server's handshake. */
+static int staple_ocsp_response(SSL *ssl, void *arg)
+{
+    const stapled_response_t *stapled = *(stapled_response_t **)arg;
+    unsigned char *der = OPENSSL_malloc(stapled->len);
+
+    if (!der)
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    memcpy(der, stapled->der, stapled->len);
+    SSL_set_tlsext_status_ocsp_resp(ssl, der, stapled->len);
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static X509 *load_test_cert(CuTest *tc, test_baton_t *tb, const char *file)
+{
+    BIO *bio = BIO_new_file(get_srcdir_file(tb->pool, file), "r");
+    X509 *cert;
+
+    CuAssertPtrNotNull(tc, bio);
+    cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    CuAssertPtrNotNull(tc, cert);
+
+    return cert;
+}
+
+/* Create a good OCSP response for the server certificate, signed by its
+   CA, that is valid for the next NEXT_UPDATE seconds. */
+static void create_ocsp_response(CuTest *tc, test_baton_t *tb,
+                                 long next_update,
+                                 stapled_response_t *stapled)
+{
+    X509 *server_cert = load_test_cert(tc, tb,
+                                       "test/certs/serfservercert.pem");
+    X509 *ca_cert = load_test_cert(tc, tb, "test/certs/serfcacert.pem");
+    EVP_PKEY *ca_key;
+    OCSP_CERTID *id;
+    OCSP_BASICRESP *basic;
+    OCSP_RESPONSE *response;
+    ASN1_TIME *this_upd, *next_upd;
+    unsigned char *der = NULL;
+    BIO *bio;
+
+    bio = BIO_new_file(get_srcdir_file(tb->pool,
+                                       "test/certs/private/serfcakey.pem"),
+                       "r");
+    CuAssertPtrNotNull(tc, bio);
+    ca_key = PEM_read_bio_PrivateKey(bio, NULL, NULL, "serftest");
+    BIO_free(bio);
+    CuAssertPtrNotNull(tc, ca_key);
+
+    id = OCSP_cert_to_id(EVP_sha1(), server_cert, ca_cert);
+    CuAssertPtrNotNull(tc, id);
+    basic = OCSP_BASICRESP_new();
+    this_upd = X509_gmtime_adj(NULL, 0);
+    next_upd = X509_gmtime_adj(NULL, next_update);
+    CuAssertPtrNotNull(tc, OCSP_basic_add1_status(basic, id,
+                                                  V_OCSP_CERTSTATUS_GOOD,
+                                                  0, NULL, this_upd,
+                                                  next_upd));
+    CuAssertIntEquals(tc, 1, OCSP_basic_sign(basic, ca_cert, ca_key,
+                                             EVP_sha256(), NULL, 0));
+    response = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, basic);
+    CuAssertPtrNotNull(tc, response);
+
+    stapled->len = i2d_OCSP_RESPONSE(response, &der);
+    CuAssertTrue(tc, stapled->len > 0);
+    stapled->der = apr_pmemdup(tb->pool, der, stapled->len);
+
+    OPENSSL_free(der);
+    OCSP_RESPONSE_free(response);
+    ASN1_TIME_free(next_upd);
+    ASN1_TIME_free(this_upd);
+    OCSP_BASICRESP_free(basic);
+    OCSP_CERTID_free(id);
+    EVP_PKEY_free(ca_key);
+    X509_free(ca_cert);
+    X509_free(server_cert);
+}
+
+/* Count the lines logged to FP that contain TEXT. */
+static int count_log_lines(FILE *fp, const char *text)
+{
+    char line[1024];
+    int count = 0;
+
+    fflush(fp);
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp))
+        if (strstr(line, text))
+            count++;
+    fseek(fp, 0, SEEK_END);
+
+    return count;
+}
+
+/* Validate that a stapled OCSP response that was seen before for the same
+   server certificate is taken from the cache, until it expires or the
+   server staples another one. */
+static void test_ssl_ocsp_cache(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    SSL_CTX *server_ctx = create_full_handshake_server(tc, tb);
+    serf_config_t *config = create_host_config(tc, tb);
+    stapled_response_t short_lived, long_lived, *current;
+    serf_log_output_t *output;
+    FILE *fp;
+    int calls = 0;
+
+    tb->enable_ocsp_stapling = 1;
+    tb->user_baton = &calls;
+
+    create_ocsp_response(tc, tb, 2, &short_lived);
+    create_ocsp_response(tc, tb, 3600, &long_lived);
+    SSL_CTX_set_tlsext_status_cb(server_ctx, staple_ocsp_response);
+    SSL_CTX_set_tlsext_status_arg(server_ctx, &current);
+
+    fp = tmpfile();
+    CuAssertPtrNotNull(tc, fp);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_logging_create_stream_output(&output,
+                                                        tb->context,
+                                                        SERF_LOG_DEBUG,
+                                                        SERF_LOGCOMP_SSL,
+                                                        SERF_LOG_DEFAULT_LAYOUT,
+                                                        fp, tb->pool));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      serf_logging_add_output(tb->context, output));
+
+    current = &short_lived;
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 0, count_log_lines(fp, "seen before"));
+
+    /* The same response again. */
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 1, count_log_lines(fp, "seen before"));
+
+    /* A different response replaces the cached one. */
+    current = &long_lived;
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 1, count_log_lines(fp, "seen before"));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 2, count_log_lines(fp, "seen before"));
+
+    current = &short_lived;
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 2, count_log_lines(fp, "seen before"));
+
+    /* Past its nextUpdate time, the same response is parsed again. */
+    apr_sleep(apr_time_from_sec(3));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      handshake_with_server(tc, tb, server_ctx, config,
+                                            chain_ca_files,
+                                            ssl_server_cert_cb_count));
+    CuAssertIntEquals(tc, 2, count_log_lines(fp, "seen before"));
+
+    CuAssertIntEquals(tc, 6, count_log_lines(fp, "OCSP callback called."));
+
+    SSL_CTX_free(server_ctx);
+    fclose(fp);
+}
+#endif
+
 /* Similar to test_connection_large_request, validate sending a large
    chunked request over SSL. */
 static void test_ssl_large_request(CuTest *tc)
@@ -1694,6 +2471,202 @@ static void test_ssltunnel_spnego_authn(CuTest *tc)
     run_client_and_mock_servers_loops(tb, num_requests, handler_ctx, tb->pool);
 }
 
+/* Send the proxy credentials with the first CONNECT request, and the start
+   of the TLS handshake right behind it. */
+static void test_ssltunnel_pipelined_with_credentials(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_status_t status;
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    CuAssertIntEquals(tc, APR_SUCCESS, setup_test_mock_proxy(tb));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+            setup_serf_https_context_with_proxy(tb, https_set_root_ca_conn_setup,
+                                                NULL, /* No server cert cb */
+                                                tb->pool));
+
+    status = serf_config_proxy_credentials(tb->context, "serfproxy",
+                                           "serftest");
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    serf_config_proxy_tunnel_pipelining(tb->context, 1);
+
+    Given(tb->mh)
+      RequestsReceivedByServer
+        GETRequest(URLEqualTo("/"))
+          Respond(WithCode(200), WithChunkedBody(""))
+      RequestsReceivedByProxy
+        HTTPRequest(MethodEqualTo("CONNECT"),
+                    URLEqualTo(tb->serv_host),
+                    HeaderEqualTo("Proxy-Authorization",
+                                  "Basic c2VyZnByb3h5OnNlcmZ0ZXN0"))
+          Respond(WithCode(200), WithChunkedBody(""))
+          SetupSSLTunnel
+    Expect
+      AllRequestsReceivedInOrder
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+}
+
+/* Check that what was sent on the socket of a tunneled connection before
+   anything was received, the LEN bytes at DATA, is a CONNECT request with
+   the start of the TLS handshake right behind it. */
+static void check_connect_with_handshake(CuTest *tc, const char *data,
+                                         apr_size_t len, int with_creds,
+                                         apr_pool_t *pool)
+{
+    const char *headers;
+    apr_size_t end;
+
+    CuAssertTrue(tc, len > 8);
+    CuAssertIntEquals(tc, 0, memcmp(data, "CONNECT ", 8));
+
+    for (end = 0; end + 4 <= len; end++)
+        if (memcmp(data + end, "\r\n\r\n", 4) == 0)
+            break;
+    end += 4;
+
+    /* A TLS handshake record, holding a ClientHello, follows the
+       headers. */
+    CuAssertTrue(tc, end + 6 <= len);
+    CuAssertIntEquals(tc, 0x16, (unsigned char)data[end]);
+    CuAssertIntEquals(tc, 0x03, (unsigned char)data[end + 1]);
+    CuAssertIntEquals(tc, 1, (unsigned char)data[end + 5]);
+
+    headers = apr_pstrndup(pool, data, end);
+    CuAssertIntEquals(tc, with_creds,
+                      strstr(headers, "Proxy-Authorization: Basic") != NULL);
+}
+
+/* The proxy asks for credentials on a connection that sent the TLS
+   handshake behind the CONNECT request. The connection is reset, and the
+   CONNECT request is sent again with the credentials and the handshake. */
+static void test_ssltunnel_pipelined_407(CuTest *tc)
+{
+    test_baton_t *tb = tc->testBaton;
+    handler_baton_t handler_ctx[1];
+    const int num_requests = sizeof(handler_ctx)/sizeof(handler_ctx[0]);
+    apr_pool_t *trace_pool;
+    const char *tmpdir, *path;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    unsigned char *buf;
+    char *sent = NULL;
+    apr_size_t len, pos, sent_len = 0;
+    int sockets = 0, received = 0;
+    apr_status_t status;
+
+    setup_test_mock_https_server(tb, server_key,
+                                 server_certs,
+                                 test_clientcert_none);
+    CuAssertIntEquals(tc, APR_SUCCESS, setup_test_mock_proxy(tb));
+    CuAssertIntEquals(tc, APR_SUCCESS,
+            setup_serf_https_context_with_proxy(tb, https_set_root_ca_conn_setup,
+                                                NULL, /* No server cert cb */
+                                                tb->pool));
+
+    serf_config_authn_types(tb->context, SERF_AUTHN_BASIC);
+    serf_config_credentials_callback(tb->context,
+                                     ssltunnel_basic_authn_callback);
+    serf_config_proxy_tunnel_pipelining(tb->context, 1);
+
+    /* Record what is sent to the proxy. */
+    CuAssertIntEquals(tc, APR_SUCCESS, apr_temp_dir_get(&tmpdir, tb->pool));
+    path = apr_pstrcat(tb->pool, tmpdir, "/serf_test_tunnel_trace", NULL);
+    apr_pool_create(&trace_pool, tb->pool);
+    status = serf_context_trace_to_file(tb->context, path, 256 * 1024, 4096,
+                                        trace_pool);
+    if (status == APR_ENOTIMPL)
+        return;
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+
+    Given(tb->mh)
+      RequestsReceivedByServer
+        GETRequest(URLEqualTo("/"))
+          Respond(WithCode(200), WithChunkedBody(""))
+      RequestsReceivedByProxy
+        HTTPRequest(MethodEqualTo("CONNECT"),
+                    URLEqualTo(tb->serv_host),
+                    HeaderNotSet("Proxy-Authorization"))
+          Respond(WithCode(407), WithChunkedBody(""),
+                  WithHeader("Proxy-Authenticate",
+                             "Basic realm=\"Test Suite Proxy\""))
+        HTTPRequest(MethodEqualTo("CONNECT"),
+                    URLEqualTo(tb->serv_host),
+                    HeaderEqualTo("Proxy-Authorization",
+                                  "Basic c2VyZnByb3h5OnNlcmZ0ZXN0"))
+          Respond(WithCode(200), WithChunkedBody(""))
+          SetupSSLTunnel
+    Expect
+      AllRequestsReceivedInOrder
+    EndGiven
+
+    create_new_request(tb, &handler_ctx[0], "GET", "/", 1);
+
+    run_client_and_mock_servers_loops_expect_ok(tc, tb, num_requests,
+                                                handler_ctx, tb->pool);
+    CuAssertIntEquals(tc, num_requests, tb->handled_requests->nelts);
+    CuAssertTrue(tc, tb->result_flags & TEST_RESULT_AUTHNCB_CALLED);
+
+    /* Stop the trace. */
+    apr_pool_destroy(trace_pool);
+
+    status = apr_file_open(&file, path,
+                           APR_FOPEN_READ | APR_FOPEN_BINARY |
+                           APR_FOPEN_DELONCLOSE,
+                           APR_OS_DEFAULT, tb->pool);
+    CuAssertIntEquals(tc, APR_SUCCESS, status);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_info_get(&finfo, APR_FINFO_SIZE, file));
+    buf = apr_palloc(tb->pool, (apr_size_t)finfo.size);
+    CuAssertIntEquals(tc, APR_SUCCESS,
+                      apr_file_read_full(file, buf, (apr_size_t)finfo.size,
+                                         &len));
+    apr_file_close(file);
+
+    /* Collect what each socket sent before its first answer. */
+    for (pos = 40; pos < len; ) {
+        const unsigned char *record = buf + pos;
+        apr_uint32_t captured = trace_uint32(record + 20);
+
+        switch (trace_uint32(record + 12)) {
+            case SERF_TRACE_OPEN:
+                if (sockets)
+                    check_connect_with_handshake(tc, sent, sent_len, 0,
+                                                 tb->pool);
+                sockets++;
+                sent = apr_palloc(tb->pool, len);
+                sent_len = 0;
+                received = 0;
+                break;
+            case SERF_TRACE_SEND:
+                if (!received) {
+                    memcpy(sent + sent_len, record + 24, captured);
+                    sent_len += captured;
+                }
+                break;
+            case SERF_TRACE_RECV:
+                if (trace_uint32(record + 16))
+                    received = 1;
+                break;
+        }
+        pos += 24 + captured;
+    }
+
+    /* The first CONNECT request got the 407, the second one went through
+       with the credentials. */
+    CuAssertIntEquals(tc, 2, sockets);
+    check_connect_with_handshake(tc, sent, sent_len, 1, tb->pool);
+}
+
 static void test_server_spnego_authn(CuTest *tc)
 {
     test_baton_t *tb = tc->testBaton;
@@ -2113,6 +3086,7 @@ CuSuite *test_ssl(void)
     CuSuiteSetSetupTeardownCallbacks(suite, test_setup, test_teardown);
 
     SUITE_ADD_TEST(suite, test_ssl_init);
+    SUITE_ADD_TEST(suite, test_ssl_alpn_protocols);
     SUITE_ADD_TEST(suite, test_ssl_load_cert_file);
     SUITE_ADD_TEST(suite, test_ssl_cert_subject);
     SUITE_ADD_TEST(suite, test_ssl_cert_issuer);
@@ -2127,7 +3101,16 @@ CuSuite *test_ssl(void)
     SUITE_ADD_TEST(suite, test_ssl_no_servercert_callback_allok);
     SUITE_ADD_TEST(suite, test_ssl_no_servercert_callback_fail);
     SUITE_ADD_TEST(suite, test_ssl_large_response);
+    SUITE_ADD_TEST(suite, test_ssl_decrypt_read_iovec);
     SUITE_ADD_TEST(suite, test_ssl_large_request);
+    SUITE_ADD_TEST(suite, test_ssl_session_resumption);
+    SUITE_ADD_TEST(suite, test_ssl_shared_ssl_ctx);
+    SUITE_ADD_TEST(suite, test_ssl_verified_cert_cache);
+    SUITE_ADD_TEST(suite, test_ssl_verified_cert_cache_overridden);
+#if defined(SERF_LOGGING_ENABLED) && !defined(OPENSSL_NO_OCSP) \
+    && !defined(OPENSSL_NO_TLSEXT)
+    SUITE_ADD_TEST(suite, test_ssl_ocsp_cache);
+#endif
     SUITE_ADD_TEST(suite, test_ssl_client_certificate);
     SUITE_ADD_TEST(suite, test_ssl_expired_server_cert);
     SUITE_ADD_TEST(suite, test_ssl_future_server_cert);
@@ -2141,6 +3124,8 @@ CuSuite *test_ssl(void)
     SUITE_ADD_TEST(suite, test_ssltunnel_basic_auth_2ndtry);
     SUITE_ADD_TEST(suite, test_ssltunnel_digest_auth);
     SUITE_ADD_TEST(suite, test_ssltunnel_spnego_authn);
+    SUITE_ADD_TEST(suite, test_ssltunnel_pipelined_with_credentials);
+    SUITE_ADD_TEST(suite, test_ssltunnel_pipelined_407);
     SUITE_ADD_TEST(suite, test_server_spnego_authn);
     SUITE_ADD_TEST(suite, test_ssl_missing_client_certificate);
     SUITE_ADD_TEST(suite, test_connect_to_non_http_server);
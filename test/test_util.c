@@ -42,6 +42,12 @@ const char * get_srcdir_file(apr_pool_t *pool, const char * file)
     }
 }
 
+apr_uint32_t trace_uint32(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16)
+           | ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
 /* cleanup for conn */
 static apr_status_t cleanup_conn(void *baton)
 {
@@ -0,0 +1,218 @@
+/* Copyright 2014 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <apr_time.h>
+
+#include "serf.h"
+
+#include "serf_private.h"
+
+/* A hierarchical timer wheel, as described by Varghese and Lauck.
+
+   Time is counted in ticks of TIMER_TICK. A timer that expires within
+   SERF__TIMER_SLOTS ticks sits in the slot of its tick on level 0. Later
+   timers sit on a higher level, where each slot covers SERF__TIMER_SLOTS
+   slots of the level below. Each time level 0 completes a round, the next
+   slot of level 1 is emptied and its timers are spread over level 0, and
+   so on for the higher levels.
+
+   Scheduling and cancelling a timer is O(1), and expiring timers costs
+   O(1) per tick plus one move per level for every timer. */
+
+/* One millisecond */
+#define TIMER_TICK 1000
+
+#define LEVEL_BITS 6
+#define LEVEL_MASK (SERF__TIMER_SLOTS - 1)
+
+/* Timers further out than this are parked in the last slot of the top
+   level, and moved on from there. */
+#define MAX_DELTA (((apr_int64_t)1 << (LEVEL_BITS * SERF__TIMER_LEVELS)) - 1)
+
+static void link_timer(serf__timer_wheel_t *wheel, serf__timer_t *timer)
+{
+    apr_int64_t expires = timer->expires;
+    apr_int64_t delta;
+    serf__timer_t **slot;
+    int level;
+
+    /* Expired timers fire at the next tick processed. */
+    if (expires < wheel->tick)
+        expires = wheel->tick;
+
+    delta = expires - wheel->tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = wheel->tick + MAX_DELTA;
+    }
+
+    for (level = 0; level < SERF__TIMER_LEVELS - 1; level++) {
+        if (delta < ((apr_int64_t)1 << (LEVEL_BITS * (level + 1))))
+            break;
+    }
+
+    slot = &wheel->slots[level][(expires >> (LEVEL_BITS * level))
+                                & LEVEL_MASK];
+
+    timer->next = *slot;
+    if (timer->next)
+        timer->next->prev = &timer->next;
+    timer->prev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(serf__timer_t *timer)
+{
+    *timer->prev = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* Spread the timers of the current slot of LEVEL over the lower levels,
+   and continue with the next level if LEVEL completed a round. */
+static void cascade(serf__timer_wheel_t *wheel, int level)
+{
+    int index = (int)((wheel->tick >> (LEVEL_BITS * level)) & LEVEL_MASK);
+    serf__timer_t *timer = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+
+    while (timer) {
+        serf__timer_t *next = timer->next;
+
+        link_timer(wheel, timer);
+        timer = next;
+    }
+
+    if (index == 0 && level < SERF__TIMER_LEVELS - 1)
+        cascade(wheel, level + 1);
+}
+
+void serf__timer_wheel_init(serf__timer_wheel_t *wheel, apr_time_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick = now / TIMER_TICK;
+}
+
+void serf__timer_init(serf__timer_t *timer, serf__timer_cb_t cb, void *baton)
+{
+    timer->expires = 0;
+    timer->cb = cb;
+    timer->baton = baton;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void serf__timer_schedule(serf__timer_wheel_t *wheel, serf__timer_t *timer,
+                          apr_time_t when)
+{
+    if (serf__timer_pending(timer))
+        unlink_timer(timer);
+    else
+        wheel->nr_of_timers++;
+
+    /* Round up, a timer never fires early. */
+    timer->expires = (when + TIMER_TICK - 1) / TIMER_TICK;
+
+    link_timer(wheel, timer);
+}
+
+void serf__timer_cancel(serf__timer_wheel_t *wheel, serf__timer_t *timer)
+{
+    if (serf__timer_pending(timer)) {
+        unlink_timer(timer);
+        wheel->nr_of_timers--;
+    }
+}
+
+apr_interval_time_t serf__timer_wheel_next(const serf__timer_wheel_t *wheel,
+                                           apr_time_t now)
+{
+    apr_int64_t next = -1;
+    apr_interval_time_t interval;
+    int level, i;
+
+    if (!wheel->nr_of_timers)
+        return -1;
+
+    for (i = 0; i < SERF__TIMER_SLOTS; i++) {
+        if (wheel->slots[0][(wheel->tick + i) & LEVEL_MASK]) {
+            next = wheel->tick + i;
+            break;
+        }
+    }
+
+    /* The timers on higher levels need to be looked at again when their
+       slot is spread over the lower levels. The current slot is still to
+       be spread if the levels below just completed a round. */
+    for (level = 1; level < SERF__TIMER_LEVELS; level++) {
+        int shift = LEVEL_BITS * level;
+        int first = (wheel->tick & (((apr_int64_t)1 << shift) - 1)) ? 1 : 0;
+
+        for (i = first; i < first + SERF__TIMER_SLOTS; i++) {
+            apr_int64_t block = (wheel->tick >> shift) + i;
+
+            if (wheel->slots[level][block & LEVEL_MASK]) {
+                if (next < 0 || (block << shift) < next)
+                    next = block << shift;
+                break;
+            }
+        }
+    }
+
+    interval = next * TIMER_TICK - now;
+
+    return interval > 0 ? interval : 0;
+}
+
+apr_status_t serf__timer_wheel_run(serf__timer_wheel_t *wheel,
+                                   apr_time_t now)
+{
+    apr_int64_t now_tick = now / TIMER_TICK;
+
+    while (wheel->tick <= now_tick) {
+        int index = (int)(wheel->tick & LEVEL_MASK);
+        serf__timer_t *timer;
+
+        if (!wheel->nr_of_timers) {
+            wheel->tick = now_tick + 1;
+            break;
+        }
+
+        if (index == 0)
+            cascade(wheel, 1);
+
+        /* The callbacks may schedule and cancel timers. */
+        while ((timer = wheel->slots[0][index]) != NULL) {
+            apr_status_t status;
+
+            unlink_timer(timer);
+            wheel->nr_of_timers--;
+
+            status = timer->cb(timer);
+            if (status)
+                return status;
+        }
+
+        wheel->tick++;
+    }
+
+    return APR_SUCCESS;
+}
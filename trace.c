@@ -0,0 +1,214 @@
+/* Copyright 2026 Justin Erenkrantz and Greg Stein
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <apr_file_io.h>
+#include <apr_mmap.h>
+
+#include "serf.h"
+#include "serf_private.h"
+
+/* The layout of a trace file. All numbers are unsigned, in network byte
+   order. The file starts with a header:
+
+     offset  size
+          0     8  "SERFTRC\0"
+          8     4  version, TRACE_VERSION
+         12     4  the sample size: the most payload a record holds
+         16     8  start of the trace, in microseconds since the epoch
+         24     8  end of the last record, from the start of the file
+         32     8  number of records that didn't fit in the file
+
+   followed by the records, each of them:
+
+          0     8  time since the start of the trace, in microseconds
+          8     4  id of the connection, 0 if unknown
+         12     4  type, one of SERF_TRACE_*
+         16     4  length of the data
+         20     4  length of the payload that follows
+
+   test/serf_trace.c reads this format as well. */
+#define TRACE_MAGIC "SERFTRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 40
+#define TRACE_RECORD_SIZE 24
+
+#define TRACE_END_OFFSET 24
+#define TRACE_DROPPED_OFFSET 32
+
+#if APR_HAS_MMAP
+
+struct serf__trace_t {
+    serf_context_t *ctx;
+
+    apr_file_t *file;
+    apr_mmap_t *mm;
+    unsigned char *base;
+    apr_size_t size;
+
+    /* End of the last record in BASE */
+    apr_size_t end;
+
+    apr_size_t sample_size;
+    apr_time_t start;
+    apr_uint64_t dropped;
+};
+
+static void put_uint32(unsigned char *p, apr_uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void put_uint64(unsigned char *p, apr_uint64_t value)
+{
+    put_uint32(p, (apr_uint32_t)(value >> 32));
+    put_uint32(p + 4, (apr_uint32_t)value);
+}
+
+void serf__trace(serf__trace_t *trace, apr_uint32_t conn_id,
+                 apr_uint32_t type, const struct iovec *vecs, int nvecs,
+                 apr_size_t len)
+{
+    unsigned char *p;
+    apr_size_t payload = len;
+    int i;
+
+    /* Sample the data, but keep all of the url of an OPEN record. */
+    if (type != SERF_TRACE_OPEN && payload > trace->sample_size)
+        payload = trace->sample_size;
+
+    if (trace->size - trace->end < TRACE_RECORD_SIZE + payload) {
+        trace->dropped++;
+        put_uint64(trace->base + TRACE_DROPPED_OFFSET, trace->dropped);
+        return;
+    }
+
+    p = trace->base + trace->end;
+    put_uint64(p, (apr_uint64_t)(apr_time_now() - trace->start));
+    put_uint32(p + 8, conn_id);
+    put_uint32(p + 12, type);
+    put_uint32(p + 16, (apr_uint32_t)len);
+    p += TRACE_RECORD_SIZE;
+
+    /* Fill in the payload from VECS, which may end before it. */
+    len = payload;
+    for (i = 0; i < nvecs && len; i++) {
+        apr_size_t part = vecs[i].iov_len;
+
+        if (part > len)
+            part = len;
+        memcpy(p, vecs[i].iov_base, part);
+        p += part;
+        len -= part;
+    }
+    payload -= len;
+    put_uint32(trace->base + trace->end + 20, (apr_uint32_t)payload);
+
+    /* Make the record part of the trace, only when it is complete. */
+    trace->end += TRACE_RECORD_SIZE + payload;
+    put_uint64(trace->base + TRACE_END_OFFSET, trace->end);
+}
+
+/* Stop the trace, and cut the file down to the records in it. */
+static apr_status_t trace_cleanup(void *baton)
+{
+    serf__trace_t *trace = baton;
+    apr_status_t status;
+
+    if (trace->ctx->trace == trace)
+        trace->ctx->trace = NULL;
+
+    status = apr_mmap_delete(trace->mm);
+    if (!status)
+        status = apr_file_trunc(trace->file, (apr_off_t)trace->end);
+    apr_file_close(trace->file);
+
+    return status;
+}
+
+apr_status_t serf_context_trace_to_file(serf_context_t *ctx,
+                                        const char *path,
+                                        apr_size_t file_size,
+                                        apr_size_t sample_size,
+                                        apr_pool_t *pool)
+{
+    serf__trace_t *trace;
+    apr_status_t status;
+
+    if (file_size < TRACE_HEADER_SIZE)
+        return APR_EINVAL;
+
+    trace = apr_pcalloc(pool, sizeof(*trace));
+    trace->ctx = ctx;
+    trace->size = file_size;
+    trace->sample_size = sample_size;
+
+    status = apr_file_open(&trace->file, path,
+                           APR_FOPEN_CREATE | APR_FOPEN_READ |
+                           APR_FOPEN_WRITE | APR_FOPEN_TRUNCATE |
+                           APR_FOPEN_BINARY,
+                           APR_OS_DEFAULT, pool);
+    if (status)
+        return status;
+
+    /* Grow the file to its full size, so all of it can be mapped. */
+    status = apr_file_trunc(trace->file, (apr_off_t)file_size);
+    if (!status)
+        status = apr_mmap_create(&trace->mm, trace->file, 0, file_size,
+                                 APR_MMAP_READ | APR_MMAP_WRITE, pool);
+    if (status) {
+        apr_file_close(trace->file);
+        return status;
+    }
+
+    trace->base = trace->mm->mm;
+    trace->start = apr_time_now();
+    trace->end = TRACE_HEADER_SIZE;
+
+    memset(trace->base, 0, TRACE_HEADER_SIZE);
+    memcpy(trace->base, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    put_uint32(trace->base + 8, TRACE_VERSION);
+    put_uint32(trace->base + 12, (apr_uint32_t)sample_size);
+    put_uint64(trace->base + 16, (apr_uint64_t)trace->start);
+    put_uint64(trace->base + TRACE_END_OFFSET, trace->end);
+
+    apr_pool_cleanup_register(pool, trace, trace_cleanup,
+                              apr_pool_cleanup_null);
+
+    ctx->trace = trace;
+
+    return APR_SUCCESS;
+}
+
+#else /* APR_HAS_MMAP */
+
+void serf__trace(serf__trace_t *trace, apr_uint32_t conn_id,
+                 apr_uint32_t type, const struct iovec *vecs, int nvecs,
+                 apr_size_t len)
+{
+}
+
+apr_status_t serf_context_trace_to_file(serf_context_t *ctx,
+                                        const char *path,
+                                        apr_size_t file_size,
+                                        apr_size_t sample_size,
+                                        apr_pool_t *pool)
+{
+    return APR_ENOTIMPL;
+}
+
+#endif /* APR_HAS_MMAP */